@@ -0,0 +1,676 @@
+// HttpUtils benchmark.
+// Runs HttpClient against a minimal HTTP/1.1 server on the loopback interface,
+// so that the numbers measure the client (its queue, workers and curl) rather
+// than the network. Each scenario is run with both engines:
+//   get_small      - keep 1, 10 or 1000 small GETs in flight until 1000 are done
+//   download       - one large response body, discarded as it arrives
+//   upload         - one large multipart POST, generated as it is sent
+//   update_cost    - the time taken by each HttpClient::Update() call while N requests are queued
+// Then, under each of the server's simulated networks (see NetworkCondition) but the loopback itself:
+//   net_get        - keep 4 small GETs in flight until 100 are done, retrying those that fail
+//   net_get_hedged - the same, with each one hedged (see HttpClient::SetHedging())
+//   net_download   - one download to a file, retried from the start if the connection drops
+//   net_download_resume - the same, but resumable (see HttpDownload::SetResumable())
+// The results are written to benchmark_results.json, and traced one per line,
+// so that runs before and after a change can be compared by a script.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "s3e.h"
+#include "IwDebug.h"
+#include "HttpClient.h"
+#include "HttpMultipartPost.h"
+#include "HttpTracer.h"
+
+#include <algorithm>
+#include <sstream>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+using std::string;
+
+///////////////////////////////////////////////////////////////////////////////
+// The loopback server:
+// One thread accepts connections, and each connection gets a thread of its own
+// (there are never more than the HttpClient has workers). The threads only use
+// fixed buffers, and allocate next to nothing, so there is no memory
+// environment to worry about. Paths:
+//   /bytes/N  - responds with N bytes of body (with an ETag, and honouring "Range: bytes=<start>-" as
+//               a resumed HttpDownload sends it, unless If-Range says it's another version)
+//   /upload   - reads the request body, and responds with its size as JSON
+// Connections are kept alive, as curl expects.
+//
+// Network conditions:
+// The server can make its responses behave as if they came over a worse network, so that the features that
+// only pay off there (retries, resumed downloads, hedging, adaptive concurrency) can be measured, the same way
+// each run. Each response waits for the round trip (latency, give or take up to jitter) before it is sent,
+// and its body goes out in slices of up to 16 KB, at most bandwidth bytes per second for each connection.
+// Before each slice, the connection may stall (as TCP does while it recovers a lost packet), or be dropped
+// part way through the slice. The random numbers come from a generator of each connection's own, which is
+// seeded afresh whenever the conditions change, so a given run sees the same stalls and drops each time.
+
+struct NetworkCondition {
+	const char* name;
+	uint latencyMs; // The round trip
+	uint jitterMs;
+	uint bandwidth; // Bytes per second of response body, for each connection; 0 for no limit
+	double stallChance; // For each slice
+	uint stallMs;
+	double disconnectChance; // For each slice
+	bool IsIdeal() const { return !latencyMs && !jitterMs && !bandwidth && stallChance <= 0 && disconnectChance <= 0; }
+};
+
+static const NetworkCondition s_LoopbackServer_conditions[] = {
+	//  name          latency jitter bandwidth  stalls       drops
+	{ "loopback",     0,      0,     0,         0,     0,    0 },
+	{ "lte",          50,     15,    1500000,   0.002, 200,  0 },
+	{ "3g",           150,    50,    180000,    0.01,  500,  0.01 },
+	{ "lossy_wifi",   20,     30,    2500000,   0.02,  300,  0.02 },
+};
+static const uint LOOPBACK_SERVER_NUM_CONDITIONS = sizeof(s_LoopbackServer_conditions) / sizeof(s_LoopbackServer_conditions[0]);
+
+struct LoopbackServer {
+	enum { MAX_CONNECTIONS = 64 };
+	int listenFd;
+	int port;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	int connections[MAX_CONNECTIONS]; // -1 if unused
+	volatile bool quit;
+	// Guarded by mutex: the connections pick up a change before their next response
+	NetworkCondition condition;
+	uint conditionVersion;
+	uint32 seed;
+	LoopbackServer() : listenFd(-1), port(0), quit(false), condition(s_LoopbackServer_conditions[0]), conditionVersion(0), seed(1) { pthread_mutex_init(&mutex, nullptr); for (int i = 0; i < MAX_CONNECTIONS; i++) connections[i] = -1; }
+	~LoopbackServer() { pthread_mutex_destroy(&mutex); }
+	bool Start();
+	void Stop();
+	void SetCondition(const NetworkCondition& newCondition) { pthread_mutex_lock(&mutex); condition = newCondition; conditionVersion++; pthread_mutex_unlock(&mutex); }
+};
+
+static bool LoopbackServer_SendAll(int fd, const char* pData, size_t size) {
+	while (size > 0) {
+		const ssize_t sent = send(fd, pData, size, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		pData += sent;
+		size -= (size_t)sent;
+	}
+	return true;
+}
+
+static const char* LoopbackServer_FindHeader(const char* pHeaders, const char* pEnd, const char* header) {
+	const size_t length = strlen(header);
+	for (const char* p_line = pHeaders; p_line < pEnd; ) {
+		const char* p_next = strstr(p_line, "\r\n");
+		if (!p_next || p_next > pEnd)
+			break;
+		if ((size_t)(p_next - p_line) > length && strncasecmp(p_line, header, length) == 0 && p_line[length] == ':') {
+			const char* p_value = p_line + length + 1;
+			while (*p_value == ' ')
+				p_value++;
+			return p_value;
+		}
+		p_line = p_next + 2;
+	}
+	return nullptr;
+}
+
+static char s_LoopbackServer_body[64 * 1024]; // Filled by Start(), then only ever read, so it is shared by all the connections
+static const size_t LOOPBACK_SERVER_SLICE_SIZE = 16 * 1024; // What a response body is sent in under simulated conditions
+
+// xorshift32, so that each connection has its own repeatable sequence:
+static uint32 LoopbackServer_Random(uint32& state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+static double LoopbackServer_Chance(uint32& state) { return (LoopbackServer_Random(state) >> 8) / 16777216.0; } // In [0, 1)
+
+// The round trip, before a response is sent:
+static void LoopbackServer_Delay(const NetworkCondition& condition, uint32& random) {
+	long delay_ms = (long)condition.latencyMs;
+	if (condition.jitterMs)
+		delay_ms += (long)(LoopbackServer_Random(random) % (2 * condition.jitterMs + 1)) - (long)condition.jitterMs;
+	if (delay_ms > 0)
+		usleep((useconds_t)delay_ms * 1000);
+}
+
+// Send size bytes of body under condition. Returns false if the connection is to be closed (having been dropped on purpose, or not).
+static bool LoopbackServer_SendBody(int fd, long long size, const NetworkCondition& condition, uint32& random) {
+	const bool ideal = condition.IsIdeal();
+	const size_t slice_size = ideal ? sizeof(s_LoopbackServer_body) : LOOPBACK_SERVER_SLICE_SIZE;
+	uint64 start_us = HttpTracer::NowUs();
+	long long sent = 0;
+	while (sent < size) {
+		const size_t slice = size - sent < (long long)slice_size ? (size_t)(size - sent) : slice_size;
+		if (!ideal) {
+			if (condition.stallChance > 0 && LoopbackServer_Chance(random) < condition.stallChance) {
+				usleep((useconds_t)condition.stallMs * 1000);
+				start_us += (uint64)condition.stallMs * 1000; // (The bandwidth doesn't catch up afterwards)
+			}
+			if (condition.disconnectChance > 0 && LoopbackServer_Chance(random) < condition.disconnectChance) {
+				LoopbackServer_SendAll(fd, s_LoopbackServer_body, LoopbackServer_Random(random) % slice);
+				return false;
+			}
+		}
+		if (!LoopbackServer_SendAll(fd, s_LoopbackServer_body, slice))
+			return false;
+		sent += slice;
+		if (condition.bandwidth) {
+			const uint64 due_us = start_us + (uint64)(sent * 1000000 / condition.bandwidth);
+			const uint64 now_us = HttpTracer::NowUs();
+			if (due_us > now_us)
+				usleep((useconds_t)(due_us - now_us));
+		}
+	}
+	return true;
+}
+
+struct LoopbackServer_Connection {
+	LoopbackServer* pServer;
+	int* pFd;
+};
+
+static void* LoopbackServer_ConnectionMain(void* _pConnection) {
+	LoopbackServer_Connection connection = *(LoopbackServer_Connection*)_pConnection;
+	delete (LoopbackServer_Connection*)_pConnection;
+	const int fd = *connection.pFd;
+	const uint32 slot = (uint32)(connection.pFd - connection.pServer->connections);
+	NetworkCondition condition = s_LoopbackServer_conditions[0];
+	uint condition_version = 0;
+	uint32 random = 1;
+	char buffer[16 * 1024];
+	size_t filled = 0;
+	for (;;) {
+		// Read the request line and headers:
+		char* p_end = nullptr;
+		while (!p_end) {
+			if (filled == sizeof(buffer) - 1)
+				goto closed; // Headers too big for a benchmark
+			const ssize_t received = recv(fd, buffer + filled, sizeof(buffer) - 1 - filled, 0);
+			if (received < 0 && errno == EINTR)
+				continue;
+			if (received <= 0)
+				goto closed;
+			filled += (size_t)received;
+			buffer[filled] = 0;
+			p_end = strstr(buffer, "\r\n\r\n");
+		}
+		p_end += 4;
+		const char* p_content_length = LoopbackServer_FindHeader(buffer, p_end, "Content-Length");
+		const long long content_length = p_content_length ? strtoll(p_content_length, nullptr, 10) : 0;
+		if (const char* p_expect = LoopbackServer_FindHeader(buffer, p_end, "Expect")) {
+			if (strncasecmp(p_expect, "100-continue", 12) == 0 && !LoopbackServer_SendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25))
+				goto closed;
+		}
+		char path[256] = "";
+		sscanf(buffer, "%*s %255s", path);
+		// Discard the body, which may have started arriving with the headers:
+		long long left = content_length;
+		size_t leftover = filled - (p_end - buffer);
+		const size_t used = left < (long long)leftover ? (size_t)left : leftover;
+		memmove(buffer, p_end + used, leftover - used);
+		filled = leftover - used;
+		left -= used;
+		while (left > 0) {
+			char discard[64 * 1024];
+			const ssize_t received = recv(fd, discard, left < (long long)sizeof(discard) ? (size_t)left : sizeof(discard), 0);
+			if (received < 0 && errno == EINTR)
+				continue;
+			if (received <= 0)
+				goto closed;
+			left -= received;
+		}
+		// Respond, under the conditions of the moment:
+		pthread_mutex_lock(&connection.pServer->mutex);
+		if (condition_version != connection.pServer->conditionVersion) {
+			condition = connection.pServer->condition;
+			condition_version = connection.pServer->conditionVersion;
+			random = (connection.pServer->seed ^ ((slot + 1) * 2654435761u) ^ (condition_version * 40503u)) | 1;
+		}
+		pthread_mutex_unlock(&connection.pServer->mutex);
+		LoopbackServer_Delay(condition, random);
+		char header[256];
+		if (strncmp(path, "/bytes/", 7) == 0) {
+			const long long size = strtoll(path + 7, nullptr, 10);
+			char etag[48];
+			const int etag_size = snprintf(etag, sizeof(etag), "\"bytes-%lld\"", size);
+			const char* p_range = LoopbackServer_FindHeader(buffer, p_end, "Range");
+			const char* p_if_range = LoopbackServer_FindHeader(buffer, p_end, "If-Range");
+			long long start = 0;
+			if (!p_range || sscanf(p_range, "bytes=%lld-", &start) != 1 || start <= 0 || start >= size || (p_if_range && strncmp(p_if_range, etag, etag_size) != 0))
+				start = 0; // The whole body
+			const int header_size = start > 0
+				? snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\nContent-Type: application/octet-stream\r\nETag: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n\r\n", etag, start, size - 1, size, size - start)
+				: snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nETag: %s\r\nContent-Length: %lld\r\n\r\n", etag, size);
+			if (!LoopbackServer_SendAll(fd, header, header_size) || !LoopbackServer_SendBody(fd, size - start, condition, random))
+				goto closed;
+		} else if (strcmp(path, "/upload") == 0) {
+			char body[64];
+			const int body_size = snprintf(body, sizeof(body), "{\"received\":%lld}", content_length);
+			const int header_size = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n", body_size);
+			if (!LoopbackServer_SendAll(fd, header, header_size) || !LoopbackServer_SendAll(fd, body, body_size))
+				goto closed;
+		} else {
+			static const char s_not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+			if (!LoopbackServer_SendAll(fd, s_not_found, sizeof(s_not_found) - 1))
+				goto closed;
+		}
+	}
+closed:
+	pthread_mutex_lock(&connection.pServer->mutex);
+	close(fd);
+	*connection.pFd = -1; // Stop() waits for this
+	pthread_mutex_unlock(&connection.pServer->mutex);
+	return nullptr;
+}
+
+static void* LoopbackServer_Main(void* _pServer) {
+	LoopbackServer* p_server = (LoopbackServer*)_pServer;
+	while (!p_server->quit) {
+		const int fd = accept(p_server->listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break; // Stop() has shut the socket down
+		}
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_mutex_lock(&p_server->mutex);
+		int* p_fd = nullptr;
+		for (int i = 0; i < LoopbackServer::MAX_CONNECTIONS && !p_fd; i++) {
+			if (p_server->connections[i] == -1)
+				p_fd = &p_server->connections[i];
+		}
+		bool handled = false;
+		if (p_fd) {
+			// (Allocated in the same memory environment as the connection thread frees it in)
+			LoopbackServer_Connection* p_connection = new LoopbackServer_Connection;
+			p_connection->pServer = p_server;
+			p_connection->pFd = p_fd;
+			*p_fd = fd;
+			pthread_t thread;
+			handled = pthread_create(&thread, nullptr, LoopbackServer_ConnectionMain, p_connection) == 0;
+			if (handled) {
+				pthread_detach(thread);
+			} else {
+				*p_fd = -1;
+				delete p_connection;
+			}
+		}
+		pthread_mutex_unlock(&p_server->mutex);
+		if (!handled) {
+			s3eDebugTracePrintf("LoopbackServer: Unable to handle another connection");
+			close(fd);
+		}
+	}
+	return nullptr;
+}
+
+bool LoopbackServer::Start() {
+	memset(s_LoopbackServer_body, 'x', sizeof(s_LoopbackServer_body));
+	signal(SIGPIPE, SIG_IGN); // Clients close connections part way through responses (e.g. the loser of a hedge), and send() should just fail then
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenFd < 0)
+		return false;
+	const int one = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0; // Any free port
+	socklen_t addr_size = sizeof(addr);
+	if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, MAX_CONNECTIONS) != 0 || getsockname(listenFd, (sockaddr*)&addr, &addr_size) != 0
+		|| pthread_create(&thread, nullptr, LoopbackServer_Main, this) != 0) {
+		close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+	port = ntohs(addr.sin_port);
+	return true;
+}
+
+void LoopbackServer::Stop() {
+	quit = true;
+	shutdown(listenFd, SHUT_RDWR);
+	pthread_join(thread, nullptr);
+	close(listenFd);
+	// The HttpClients have all been deleted by now, so their connections should be closing; make sure:
+	for (;;) {
+		bool any_open = false;
+		pthread_mutex_lock(&mutex);
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			if (connections[i] != -1) {
+				shutdown(connections[i], SHUT_RDWR);
+				any_open = true;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+		if (!any_open)
+			break;
+		usleep(1000);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Requests:
+
+// A GET that counts its response body and throws it away.
+class BenchmarkGet : public HttpRequest {
+public:
+	BenchmarkGet(const string& url, bool hedge = false) : HttpRequest(GET, url.c_str()), m_bytesReceived(0) { SetUseCache(false); SetCoalesce(false); SetCompression(COMPRESSION_REFUSE); SetHedge(hedge); }
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) { m_bytesReceived += size; return size; }
+	int64 GetBytesReceived() const { return m_bytesReceived; }
+private:
+	volatile int64 m_bytesReceived;
+};
+
+// Upload data that is generated as it is sent, so the upload isn't limited by a file read.
+class BenchmarkSource : public HttpMultipartPost::Source {
+public:
+	BenchmarkSource(int64 size) : m_size(size) {}
+	virtual int64 GetSize() const { return m_size; }
+	virtual size_t Worker_Read(unsigned char* pData, size_t size, int64 offset) { memset(pData, 'u', size); return size; }
+private:
+	const int64 m_size;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Scenarios:
+
+static const uint BENCHMARK_NUM_WORKERS = 8;
+
+struct BenchmarkResult {
+	string engine;
+	string network; // See NetworkCondition
+	string scenario;
+	uint concurrency;
+	uint numRequests;
+	uint numFailed;
+	uint64 numRetries, numHedges; // See HttpClient::Stats
+	double seconds;
+	double bytes; // Moved by the scenario, if it is about throughput
+	// These are about the latency of each request, or the cost of each Update() call for update_cost:
+	double p50, p90, p99, max;
+	const char* latencyUnit;
+	BenchmarkResult() : network("loopback"), concurrency(0), numRequests(0), numFailed(0), numRetries(0), numHedges(0), seconds(0), bytes(0), p50(0), p90(0), p99(0), max(0), latencyUnit("ms") {}
+};
+
+static double Benchmark_Percentile(std::vector<double>& values, double fraction) {
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, (size_t)(fraction * values.size()))];
+}
+
+static void Benchmark_SetLatencies(BenchmarkResult& result, std::vector<double>& values) {
+	result.p50 = Benchmark_Percentile(values, 0.5);
+	result.p90 = Benchmark_Percentile(values, 0.9);
+	result.p99 = Benchmark_Percentile(values, 0.99);
+	result.max = values.empty() ? 0 : values.back();
+}
+
+// Returns false if the user asked to quit
+static bool Benchmark_Frame(HttpClient& client) {
+	client.Update();
+	s3eDeviceYield(0);
+	return !s3eDeviceCheckQuitRequest();
+}
+
+// Keep `concurrency` GETs of url in flight until numRequests have been done.
+static BenchmarkResult Benchmark_Gets(HttpClient& client, const char* scenario, const string& url, uint concurrency, uint numRequests, bool hedge = false) {
+	BenchmarkResult result;
+	result.scenario = scenario;
+	result.concurrency = concurrency;
+	std::vector< Ptr<BenchmarkGet> > in_flight;
+	std::vector<uint64> queued_us;
+	std::vector<double> latencies;
+	uint num_queued = 0;
+	const uint64 start_us = HttpTracer::NowUs();
+	do {
+		// Replace the requests that have finished (which also queues the first ones):
+		for (size_t i = 0; i < in_flight.size(); i++) {
+			const HttpRequest::Status status = in_flight[i]->GetStatus();
+			if (status == HttpRequest::DONE || status == HttpRequest::ERROR) {
+				latencies.push_back((HttpTracer::NowUs() - queued_us[i]) / 1000.0);
+				if (status == HttpRequest::ERROR)
+					result.numFailed++;
+				in_flight[i] = in_flight.back();
+				queued_us[i] = queued_us.back();
+				in_flight.pop_back();
+				queued_us.pop_back();
+				i--;
+			}
+		}
+		while (in_flight.size() < concurrency && num_queued < numRequests) {
+			in_flight.push_back(new BenchmarkGet(url, hedge));
+			queued_us.push_back(HttpTracer::NowUs());
+			client.QueueRequest(in_flight.back());
+			num_queued++;
+		}
+	} while (!in_flight.empty() && Benchmark_Frame(client));
+	result.seconds = (HttpTracer::NowUs() - start_us) / 1000000.0;
+	result.numRequests = latencies.size();
+	Benchmark_SetLatencies(result, latencies);
+	return result;
+}
+
+static BenchmarkResult Benchmark_GetSmall(HttpClient& client, const string& baseUrl, uint concurrency, uint numRequests) {
+	return Benchmark_Gets(client, "get_small", baseUrl + "/bytes/256", concurrency, numRequests);
+}
+
+// Wait for one request, and time it.
+static BenchmarkResult Benchmark_Transfer(HttpClient& client, const char* scenario, Ptr<HttpRequest> pRequest, double bytes) {
+	BenchmarkResult result;
+	result.scenario = scenario;
+	result.concurrency = 1;
+	result.numRequests = 1;
+	result.bytes = bytes;
+	const uint64 start_us = HttpTracer::NowUs();
+	client.QueueRequest(pRequest);
+	while (pRequest->GetStatus() != HttpRequest::DONE && pRequest->GetStatus() != HttpRequest::ERROR && Benchmark_Frame(client)) {}
+	result.seconds = (HttpTracer::NowUs() - start_us) / 1000000.0;
+	result.numFailed = pRequest->GetStatus() == HttpRequest::DONE ? 0 : 1;
+	result.p50 = result.p90 = result.p99 = result.max = result.seconds * 1000.0;
+	return result;
+}
+
+// Queue numRequests GETs at once, and time each Update() call until they are all done.
+static BenchmarkResult Benchmark_UpdateCost(HttpClient& client, const string& baseUrl, uint numRequests) {
+	BenchmarkResult result;
+	result.scenario = "update_cost";
+	result.concurrency = numRequests;
+	result.latencyUnit = "us";
+	std::vector< Ptr<BenchmarkGet> > requests;
+	for (uint i = 0; i < numRequests; i++) {
+		requests.push_back(new BenchmarkGet(baseUrl + "/bytes/256"));
+		client.QueueRequest(requests.back());
+	}
+	std::vector<double> update_us;
+	uint num_done = 0;
+	const uint64 start_us = HttpTracer::NowUs();
+	while (num_done < numRequests) {
+		const uint64 before_us = HttpTracer::NowUs();
+		client.Update();
+		update_us.push_back((double)(HttpTracer::NowUs() - before_us));
+		s3eDeviceYield(0);
+		if (s3eDeviceCheckQuitRequest())
+			break;
+		for (num_done = 0; num_done < numRequests; num_done++) {
+			const HttpRequest::Status status = requests[num_done]->GetStatus();
+			if (status != HttpRequest::DONE && status != HttpRequest::ERROR)
+				break; // Requests mostly finish in order, so this is usually the only one left to check
+		}
+	}
+	result.seconds = (HttpTracer::NowUs() - start_us) / 1000000.0;
+	result.numRequests = numRequests;
+	for (uint i = 0; i < numRequests; i++) {
+		if (requests[i]->GetStatus() != HttpRequest::DONE)
+			result.numFailed++;
+	}
+	Benchmark_SetLatencies(result, update_us);
+	return result;
+}
+
+// Under each simulated network, the scenarios for the features that are there for bad networks. The client retries
+// what fails, and each result says how many retries and hedges it took.
+static void Benchmark_RunNetworks(HttpClient& client, LoopbackServer& server, const string& baseUrl, std::vector<BenchmarkResult>& results) {
+	static const char s_download_file[] = "benchmark_download.bin";
+	const int64 download_size = 512 * 1024;
+	char download_path[64];
+	snprintf(download_path, sizeof(download_path), "/bytes/%lld", (long long)download_size);
+	client.SetRetryPolicy(HttpClient::RetryPolicy(5, 100, 2000));
+	for (uint i = 1; i < LOOPBACK_SERVER_NUM_CONDITIONS && !s3eDeviceCheckQuitRequest(); i++) {
+		const NetworkCondition& condition = s_LoopbackServer_conditions[i];
+		server.SetCondition(condition);
+		for (uint scenario = 0; scenario < 4; scenario++) {
+			const HttpClient::Stats before = client.GetStats();
+			BenchmarkResult result;
+			if (scenario < 2) {
+				client.SetHedging(scenario == 1 ? 0.9 : 0); // (net_get's responses give it the latencies to go by)
+				result = Benchmark_Gets(client, scenario == 1 ? "net_get_hedged" : "net_get", baseUrl + "/bytes/4096", 4, 100, scenario == 1);
+			} else {
+				const bool resumable = scenario == 3;
+				Ptr<HttpDownload> p_download = new HttpDownload(baseUrl + download_path, s_download_file);
+				p_download->SetResumable(resumable);
+				p_download->SetUseCache(false);
+				result = Benchmark_Transfer(client, resumable ? "net_download_resume" : "net_download", p_download, (double)download_size);
+				if (s3eFileGetFileInt(s_download_file, S3E_FILE_SIZE) != download_size)
+					result.numFailed = 1;
+				s3eFileDelete(s_download_file);
+			}
+			const HttpClient::Stats after = client.GetStats();
+			result.network = condition.name;
+			result.numRetries = after.numRetries - before.numRetries;
+			result.numHedges = after.numHedges - before.numHedges;
+			results.push_back(result);
+		}
+	}
+	client.SetHedging(0);
+	client.SetRetryPolicy(HttpClient::RetryPolicy());
+	server.SetCondition(s_LoopbackServer_conditions[0]);
+}
+
+static void Benchmark_Run(HttpClient::Engine engine, LoopbackServer& server, const string& baseUrl, std::vector<BenchmarkResult>& results) {
+	const char* engine_name = engine == HttpClient::ENGINE_MULTI ? "multi" : "threads";
+	const size_t first = results.size();
+	HttpClient* p_client = new HttpClient(BENCHMARK_NUM_WORKERS, "HttpUtils Benchmark", engine);
+	p_client->SetMaxRequestsPerHost(BENCHMARK_NUM_WORKERS);
+
+	// Warm up, so that the first scenario doesn't pay for starting the workers and connecting:
+	Benchmark_GetSmall(*p_client, baseUrl, BENCHMARK_NUM_WORKERS, BENCHMARK_NUM_WORKERS * 4);
+
+	const uint concurrencies[] = { 1, 10, 1000 };
+	for (uint i = 0; i < sizeof(concurrencies) / sizeof(concurrencies[0]); i++)
+		results.push_back(Benchmark_GetSmall(*p_client, baseUrl, concurrencies[i], 1000));
+
+	const int64 download_size = 256 * 1024 * 1024;
+	char path[64];
+	snprintf(path, sizeof(path), "/bytes/%lld", (long long)download_size);
+	Ptr<BenchmarkGet> p_get = new BenchmarkGet(baseUrl + path);
+	results.push_back(Benchmark_Transfer(*p_client, "download", p_get, (double)download_size));
+	if (p_get->GetBytesReceived() != download_size)
+		results.back().numFailed = 1;
+
+	const int64 upload_size = 64 * 1024 * 1024;
+	Ptr<HttpMultipartPost> p_post = new HttpMultipartPost(baseUrl + "/upload");
+	p_post->AddSource("data", new BenchmarkSource(upload_size));
+	results.push_back(Benchmark_Transfer(*p_client, "upload", p_post, (double)upload_size));
+
+	const uint queued[] = { 10, 100, 1000 };
+	for (uint i = 0; i < sizeof(queued) / sizeof(queued[0]); i++)
+		results.push_back(Benchmark_UpdateCost(*p_client, baseUrl, queued[i]));
+
+	Benchmark_RunNetworks(*p_client, server, baseUrl, results);
+
+	for (size_t i = first; i < results.size(); i++)
+		results[i].engine = engine_name;
+	p_get = nullptr;
+	p_post = nullptr;
+	delete p_client;
+}
+
+static json::Object Benchmark_ToJson(const BenchmarkResult& result) {
+	json::Object object;
+	object["engine"] = json::String(result.engine);
+	object["network"] = json::String(result.network);
+	object["scenario"] = json::String(result.scenario);
+	object["concurrency"] = json::Number::FromInteger(result.concurrency);
+	object["requests"] = json::Number::FromInteger(result.numRequests);
+	object["failed"] = json::Number::FromInteger(result.numFailed);
+	object["retries"] = json::Number::FromInteger(result.numRetries);
+	object["hedges"] = json::Number::FromInteger(result.numHedges);
+	object["seconds"] = json::Number(result.seconds);
+	if (result.seconds > 0) {
+		object["requestsPerSecond"] = json::Number(result.numRequests / result.seconds);
+		if (result.bytes > 0)
+			object["bytesPerSecond"] = json::Number(result.bytes / result.seconds);
+	}
+	const string unit = result.latencyUnit;
+	object["p50" + unit] = json::Number(result.p50);
+	object["p90" + unit] = json::Number(result.p90);
+	object["p99" + unit] = json::Number(result.p99);
+	object["max" + unit] = json::Number(result.max);
+	return object;
+}
+
+static void Benchmark_WriteResults(const std::vector<BenchmarkResult>& results, const char* filePath) {
+	json::Array array;
+	for (auto it = results.begin(); it != results.end(); it++) {
+		json::Object object = Benchmark_ToJson(*it);
+		std::ostringstream line;
+		json::Writer::Write(object, line);
+		s3eDebugTracePrintf("HttpBenchmark: %s", line.str().c_str());
+		array.Insert(std::move(object));
+	}
+	json::Object document;
+	document["version"] = json::Number::FromInteger(1);
+	document["workers"] = json::Number::FromInteger(BENCHMARK_NUM_WORKERS);
+	document["results"] = std::move(array);
+	std::ostringstream out;
+	json::Writer::Write(document, out);
+	const string data = out.str();
+	s3eFile* p_file = s3eFileOpen(filePath, "w");
+	if (!p_file || s3eFileWrite(data.data(), 1, data.size(), p_file) != data.size())
+		s3eDebugErrorShow(S3E_MESSAGE_CONTINUE, "Unable to write the benchmark results.");
+	if (p_file)
+		s3eFileClose(p_file);
+}
+
+int main()
+{
+	HttpClient::GlobalInit();
+
+	LoopbackServer server;
+	if (!server.Start()) {
+		s3eDebugErrorShow(S3E_MESSAGE_CONTINUE, "Unable to start the loopback server.");
+		HttpClient::GlobalCleanup();
+		return 1;
+	}
+	char base_url[64];
+	snprintf(base_url, sizeof(base_url), "http://127.0.0.1:%d", server.port);
+
+	std::vector<BenchmarkResult> results;
+	Benchmark_Run(HttpClient::ENGINE_THREADS, server, base_url, results);
+	if (!s3eDeviceCheckQuitRequest())
+		Benchmark_Run(HttpClient::ENGINE_MULTI, server, base_url, results);
+	Benchmark_WriteResults(results, "benchmark_results.json");
+
+	server.Stop();
+	HttpClient::GlobalCleanup();
+	return 0;
+}
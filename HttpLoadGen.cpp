@@ -0,0 +1,458 @@
+// HttpUtils load generator.
+// Drives a traffic profile against a real server through HttpClient (with the
+// same request, header and JSON handling that the apps ship with), for
+// capacity tests of a backend. Native builds (see src/platform/posix) take the
+// profile's path and the results' as arguments:
+//   HttpLoadGen profile.json [results.json]
+// On a device, they are loadgen_profile.json and loadgen_results.json.
+// The profile says what to send and how fast:
+//   {"baseUrl": "https://api.example.com",
+//    "engine": "multi",          // or "threads"
+//    "workers": 64, "ioThreads": 2,
+//    "concurrency": 64,          // The most requests in flight at once
+//    "rps": 200,                 // Requests started per second, or 0 to keep `concurrency` in flight
+//    "durationSeconds": 60,      // and/or "requests": N, whichever comes first
+//    "warmupSeconds": 5,         // Sent at the same rate, but not counted
+//    "caBundle": "cacert.pem",   // For HTTPS (see HttpClient::GlobalInit())
+//    "seed": 1,
+//    "record": "session.rec",    // Save the responses to a file (see HttpRecording)...
+//    "replay": "session.rec",    // ...or serve them from one, without the network,
+//    "replaySpeed": 1,           // at the recorded pace (or 0 for as fast as possible)
+//    "headers": {"Authorization": "Bearer ..."}, // Sent with every request
+//    "mix": [{"name": "feed", "method": "GET", "path": "/feed", "weight": 5, "json": true},
+//            {"name": "event", "method": "POST", "path": "/events", "weight": 1, "bodySize": 2048,
+//             "contentType": "application/json", "headers": {...}}]}
+// Each request of the mix is picked at random by weight. "url" may be given
+// instead of "path". A POST or PUT sends "body" if it has one, otherwise
+// "bodySize" bytes. "json" parses each successful response as JSON (on the
+// worker as it arrives, then into elements on the app thread, as HttpPost
+// does); a body that isn't JSON counts as an error.
+// With a target rate, requests are started on a fixed schedule whatever the
+// server does (open loop), and each one's latency is measured from when it
+// was due, so a server that falls behind shows in the percentiles instead of
+// just slowing the test down. The results (throughput, latency percentiles,
+// HTTP statuses and errors, in total and for each request of the mix) are
+// written as JSON and traced one line per request of the mix.
+// A replay measures the client itself: Update(), the callbacks, header
+// handling and JSON parsing, with nothing but the recording's pace between the
+// requests and their responses.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eDevice.h"
+#include "s3eFile.h"
+#include "HttpClient.h"
+#include "HttpRecording.h"
+#include "HttpResponseBody.h"
+#include "HttpTracer.h"
+#include "util/iohelpers.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+using std::string;
+
+///////////////////////////////////////////////////////////////////////////////
+// The profile:
+
+struct LoadGenEntry {
+	string name;
+	HttpRequest::Method method;
+	string url;
+	uint weight;
+	string body; // For POST and PUT; read by the workers as it is sent
+	HttpHeaders headers;
+	bool parseJson;
+	LoadGenEntry() : method(HttpRequest::GET), weight(1), parseJson(false) {}
+};
+
+struct LoadGenProfile {
+	HttpClient::Engine engine;
+	uint numWorkers;
+	uint numIoThreads;
+	uint concurrency;
+	double rps;
+	double durationSeconds;
+	double warmupSeconds;
+	uint64 maxRequests; // 0 for no limit
+	string caBundle;
+	uint32 seed;
+	string recordPath, replayPath;
+	double replaySpeed;
+	std::vector<LoadGenEntry> mix;
+	uint totalWeight;
+	LoadGenProfile() : engine(HttpClient::ENGINE_MULTI), numWorkers(32), numIoThreads(1), concurrency(32), rps(0), durationSeconds(10), warmupSeconds(0), maxRequests(0), seed(1), replaySpeed(1), totalWeight(0) {}
+};
+
+static HttpHeaders LoadGen_ReadHeaders(const json::Object& object) {
+	HttpHeaders headers;
+	if (!object.HasKey("headers"))
+		return headers;
+	const json::Object& members = object["headers"];
+	for (json::Object::const_iterator it = members.Begin(); it != members.End(); it++)
+		headers.Set(it->name, (const json::String&)it->element);
+	return headers;
+}
+
+// Throws a runtime_error (or a json::Exception) if the profile can't be read.
+static LoadGenProfile LoadGen_ReadProfile(const char* filePath) {
+	const FileData data(filePath);
+	json::Object root;
+	json::Reader::Read(root, data.Data(), data.Size());
+	LoadGenProfile profile;
+	const string engine = root.GetOrDefault("engine", string("multi"));
+	if (engine != "multi" && engine != "threads")
+		throw std::runtime_error("engine must be \"multi\" or \"threads\"");
+	profile.engine = engine == "multi" ? HttpClient::ENGINE_MULTI : HttpClient::ENGINE_THREADS;
+	profile.numWorkers = (uint)std::max(1, root.GetOrDefault("workers", (int)profile.numWorkers));
+	profile.numIoThreads = (uint)std::max(1, root.GetOrDefault("ioThreads", (int)profile.numIoThreads));
+	profile.concurrency = (uint)std::max(1, root.GetOrDefault("concurrency", (int)profile.numWorkers));
+	profile.rps = std::max(0.0, root.GetOrDefault("rps", 0.0));
+	profile.durationSeconds = root.GetOrDefault("durationSeconds", profile.durationSeconds);
+	profile.warmupSeconds = std::max(0.0, root.GetOrDefault("warmupSeconds", 0.0));
+	profile.maxRequests = (uint64)std::max(0LL, root.GetOrDefault("requests", 0LL));
+	profile.caBundle = root.GetOrDefault("caBundle", string());
+	profile.seed = (uint32)root.GetOrDefault("seed", 1LL) | 1;
+	profile.recordPath = root.GetOrDefault("record", string());
+	profile.replayPath = root.GetOrDefault("replay", string());
+	profile.replaySpeed = std::max(0.0, root.GetOrDefault("replaySpeed", 1.0));
+	if (!profile.recordPath.empty() && !profile.replayPath.empty())
+		throw std::runtime_error("a profile can't both record and replay");
+	const string base_url = root.GetOrDefault("baseUrl", string());
+	const HttpHeaders common_headers = LoadGen_ReadHeaders(root);
+	const json::Array& mix = root["mix"];
+	for (json::Array::const_iterator it = mix.Begin(); it != mix.End(); it++) {
+		const json::Object& item = *it;
+		LoadGenEntry entry;
+		const string method = item.GetOrDefault("method", string("GET"));
+		if (method == "GET")
+			entry.method = HttpRequest::GET;
+		else if (method == "POST")
+			entry.method = HttpRequest::POST;
+		else if (method == "PUT")
+			entry.method = HttpRequest::PUT;
+		else if (method == "HEAD")
+			entry.method = HttpRequest::HEAD;
+		else
+			throw std::runtime_error("unsupported method " + method);
+		entry.url = item.GetOrDefault("url", string());
+		if (entry.url.empty())
+			entry.url = base_url + item.GetOrDefault("path", string());
+		if (entry.url.empty())
+			throw std::runtime_error("a request of the mix has no url or path");
+		entry.name = item.GetOrDefault("name", method + " " + entry.url);
+		entry.weight = (uint)std::max(0, item.GetOrDefault("weight", 1));
+		if (entry.method == HttpRequest::POST || entry.method == HttpRequest::PUT) {
+			entry.body = item.GetOrDefault("body", string());
+			if (entry.body.empty())
+				entry.body.assign((size_t)std::max(0LL, item.GetOrDefault("bodySize", 0LL)), 'x');
+		}
+		entry.headers = common_headers;
+		const HttpHeaders own_headers = LoadGen_ReadHeaders(item);
+		for (size_t i = 0; i < own_headers.Size(); i++)
+			entry.headers.Set(own_headers.GetName(i), own_headers.GetNameLength(i), own_headers.GetValue(i), own_headers.GetValueLength(i));
+		const string content_type = item.GetOrDefault("contentType", string());
+		if (!content_type.empty())
+			entry.headers.Set("Content-Type", content_type);
+		entry.parseJson = item.GetOrDefault("json", false);
+		profile.totalWeight += entry.weight;
+		profile.mix.push_back(std::move(entry));
+	}
+	if (!profile.totalWeight)
+		throw std::runtime_error("the mix is empty (or all its weights are 0)");
+	if (profile.durationSeconds <= 0 && !profile.maxRequests)
+		throw std::runtime_error("the profile needs a durationSeconds or a number of requests");
+	return profile;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Requests:
+
+// Sends its entry's body, and counts (or parses) the response.
+class LoadGenRequest : public HttpRequest {
+public:
+	LoadGenRequest(const LoadGenEntry& entry, uint entryIndex, uint64 dueUs, bool counted)
+		: HttpRequest(entry.method, entry.url.c_str()), m_entry(entry), m_entryIndex(entryIndex), m_dueUs(dueUs), m_counted(counted),
+		  m_bytesUploaded(0), m_bytesReceived(0), m_responseBody(entry.parseJson), m_httpStatusCode(0), m_jsonFailed(false)
+	{
+		SetUseCache(false);
+		SetCoalesce(false);
+		SetHeaders(entry.headers);
+	}
+	uint GetEntryIndex() const { return m_entryIndex; }
+	uint64 GetDueUs() const { return m_dueUs; }
+	bool IsCounted() const { return m_counted; } // (Not sent during the warm-up)
+	int GetHttpStatusCode() const { return m_httpStatusCode; }
+	bool IsJsonFailed() const { return m_jsonFailed; }
+	int64 GetBytesReceived() const { return m_bytesReceived; }
+
+	virtual int64 Worker_GetUploadSize() const { return m_entry.body.size(); }
+	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize) {
+		const size_t size = MIN(m_entry.body.size() - m_bytesUploaded, fillSize);
+		memcpy((void*)pData, m_entry.body.data() + m_bytesUploaded, size);
+		m_bytesUploaded += size;
+		return size;
+	}
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) {
+		m_bytesReceived += size;
+		if (m_entry.parseJson && !m_responseBody.Worker_Append(contents, size))
+			return 0; // Out of memory: abort the transfer
+		return size;
+	}
+	virtual void Worker_HandleDone(bool success, int httpStatusCode) { m_responseBody.Worker_Finish(); HttpRequest::Worker_HandleDone(success, httpStatusCode); }
+	virtual void Worker_HandleCleanup() { m_responseBody.Worker_Free(); }
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		HttpRequest::HandleResponse(success, httpStatusCode);
+		m_httpStatusCode = httpStatusCode;
+		if (success && m_entry.parseJson) {
+			json::UnknownElement response;
+			if (!m_responseBody.ParseJson(response)) {
+				m_jsonFailed = true;
+				m_status = ERROR;
+			}
+		}
+	}
+	virtual void HandleRequeue() { m_bytesUploaded = 0; m_bytesReceived = 0; HttpRequest::HandleRequeue(); }
+
+private:
+	const LoadGenEntry& m_entry; // The profile outlives its requests
+	const uint m_entryIndex;
+	const uint64 m_dueUs;
+	const bool m_counted;
+	size_t m_bytesUploaded;
+	volatile int64 m_bytesReceived;
+	HttpResponseBody m_responseBody; // Only if the entry's responses are parsed
+	int m_httpStatusCode;
+	bool m_jsonFailed;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Results:
+
+struct LoadGenStats {
+	uint64 numRequests;
+	uint64 numSucceeded;
+	uint64 numRetries;
+	double bytesUploaded;
+	double bytesDownloaded;
+	std::vector<double> latenciesMs;
+	std::map<int, uint64> statusCounts; // By HTTP status, 0 for none (the transfer failed)
+	std::map<string, uint64> errorCounts; // By kind
+	LoadGenStats() : numRequests(0), numSucceeded(0), numRetries(0), bytesUploaded(0), bytesDownloaded(0) {}
+	void Add(const LoadGenRequest& request, double latencyMs);
+};
+
+void LoadGenStats::Add(const LoadGenRequest& request, double latencyMs) {
+	numRequests++;
+	numRetries += request.GetNumRetries();
+	const HttpRequest::Timings& timings = request.GetTimings();
+	bytesUploaded += timings.bytesUploaded;
+	bytesDownloaded += (double)request.GetBytesReceived();
+	latenciesMs.push_back(latencyMs);
+	const int status_code = request.GetHttpStatusCode();
+	if (request.GetStatus() != HttpRequest::CANCELLED)
+		statusCounts[status_code]++;
+	if (request.GetStatus() == HttpRequest::DONE) {
+		numSucceeded++;
+		return;
+	}
+	const char* kind = request.GetStatus() == HttpRequest::CANCELLED ? "cancelled" : request.IsJsonFailed() ? "json"
+		: status_code >= 500 ? "http_5xx" : status_code >= 400 ? "http_4xx" : status_code ? "http_other" : "network";
+	errorCounts[kind]++;
+}
+
+static double LoadGen_Percentile(const std::vector<double>& sorted, double fraction) {
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()))];
+}
+
+static json::Object LoadGen_ToJson(const string& name, LoadGenStats& stats, double seconds) {
+	std::sort(stats.latenciesMs.begin(), stats.latenciesMs.end());
+	json::Object object;
+	object["name"] = json::String(name);
+	object["requests"] = json::Number::FromInteger((long long)stats.numRequests);
+	object["succeeded"] = json::Number::FromInteger((long long)stats.numSucceeded);
+	object["failed"] = json::Number::FromInteger((long long)(stats.numRequests - stats.numSucceeded));
+	object["retries"] = json::Number::FromInteger((long long)stats.numRetries);
+	if (seconds > 0) {
+		object["requestsPerSecond"] = json::Number(stats.numRequests / seconds);
+		object["bytesDownloadedPerSecond"] = json::Number(stats.bytesDownloaded / seconds);
+		object["bytesUploadedPerSecond"] = json::Number(stats.bytesUploaded / seconds);
+	}
+	object["p50ms"] = json::Number(LoadGen_Percentile(stats.latenciesMs, 0.5));
+	object["p90ms"] = json::Number(LoadGen_Percentile(stats.latenciesMs, 0.9));
+	object["p99ms"] = json::Number(LoadGen_Percentile(stats.latenciesMs, 0.99));
+	object["p999ms"] = json::Number(LoadGen_Percentile(stats.latenciesMs, 0.999));
+	object["maxms"] = json::Number(stats.latenciesMs.empty() ? 0 : stats.latenciesMs.back());
+	json::Object statuses;
+	for (auto it = stats.statusCounts.begin(); it != stats.statusCounts.end(); it++) {
+		char code[16];
+		snprintf(code, sizeof(code), "%d", it->first);
+		statuses[code] = json::Number::FromInteger((long long)it->second);
+	}
+	object["statuses"] = std::move(statuses);
+	json::Object errors;
+	for (auto it = stats.errorCounts.begin(); it != stats.errorCounts.end(); it++)
+		errors[it->first] = json::Number::FromInteger((long long)it->second);
+	object["errors"] = std::move(errors);
+	return object;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The run:
+
+static uint32 LoadGen_Random(uint32& state) {
+	// xorshift32: the same sequence of requests for the same seed
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static uint LoadGen_PickEntry(const LoadGenProfile& profile, uint32& randomState) {
+	uint pick = LoadGen_Random(randomState) % profile.totalWeight;
+	for (uint i = 0; i < profile.mix.size(); i++) {
+		if (pick < profile.mix[i].weight)
+			return i;
+		pick -= profile.mix[i].weight;
+	}
+	return (uint)profile.mix.size() - 1;
+}
+
+// Returns the seconds that the counted requests took, from the end of the warm-up until the last of them was done.
+static double LoadGen_Run(const LoadGenProfile& profile, HttpRecording* pRecording, LoadGenStats& total, std::vector<LoadGenStats>& perEntry) {
+	HttpClient client(profile.numWorkers, "HttpUtils LoadGen", profile.engine, profile.numIoThreads);
+	client.SetMaxRequestsPerHost(profile.numWorkers);
+	client.SetRecording(pRecording);
+	perEntry.assign(profile.mix.size(), LoadGenStats());
+	std::vector< Ptr<LoadGenRequest> > in_flight;
+	uint32 random_state = profile.seed;
+	const uint64 start_us = HttpTracer::NowUs();
+	const uint64 measure_us = start_us + (uint64)(profile.warmupSeconds * 1000000);
+	const uint64 end_us = profile.durationSeconds > 0 ? measure_us + (uint64)(profile.durationSeconds * 1000000) : 0;
+	uint64 num_started = 0; // Including the warm-up's
+	uint64 num_counted = 0;
+	uint64 last_done_us = measure_us;
+	bool sending = true;
+	while (sending || !in_flight.empty()) {
+		// Handle the requests that have finished:
+		for (size_t i = 0; i < in_flight.size(); i++) {
+			const HttpRequest::Status status = in_flight[i]->GetStatus();
+			if (status == HttpRequest::DONE || status == HttpRequest::ERROR || status == HttpRequest::CANCELLED) {
+				const LoadGenRequest& request = *in_flight[i].ptr();
+				if (request.IsCounted()) {
+					const uint64 now_us = HttpTracer::NowUs();
+					const double latency_ms = (now_us - request.GetDueUs()) / 1000.0;
+					total.Add(request, latency_ms);
+					perEntry[request.GetEntryIndex()].Add(request, latency_ms);
+					last_done_us = now_us;
+				}
+				in_flight[i] = in_flight.back();
+				in_flight.pop_back();
+				i--;
+			}
+		}
+		// Start the requests that are due:
+		const uint64 now_us = HttpTracer::NowUs();
+		if (sending && ((end_us && now_us >= end_us) || (profile.maxRequests && num_counted >= profile.maxRequests) || s3eDeviceCheckQuitRequest()))
+			sending = false;
+		while (sending && in_flight.size() < profile.concurrency) {
+			uint64 due_us = now_us;
+			if (profile.rps > 0) {
+				due_us = start_us + (uint64)(num_started * 1000000 / profile.rps);
+				if (due_us > now_us)
+					break; // Not yet
+			}
+			const bool counted = due_us >= measure_us;
+			if (counted && profile.maxRequests && num_counted >= profile.maxRequests)
+				break;
+			const uint entry = LoadGen_PickEntry(profile, random_state);
+			Ptr<LoadGenRequest> p_request = new LoadGenRequest(profile.mix[entry], entry, due_us, counted);
+			in_flight.push_back(p_request);
+			client.QueueRequest(p_request);
+			num_started++;
+			if (counted)
+				num_counted++;
+		}
+		client.Update();
+		s3eDeviceYield(0);
+	}
+	return (last_done_us - measure_us) / 1000000.0;
+}
+
+static void LoadGen_WriteResults(const LoadGenProfile& profile, LoadGenStats& total, std::vector<LoadGenStats>& perEntry, double seconds, const char* filePath) {
+	json::Array entries;
+	for (size_t i = 0; i < perEntry.size(); i++) {
+		json::Object object = LoadGen_ToJson(profile.mix[i].name, perEntry[i], seconds);
+		std::ostringstream line;
+		json::Writer::Write(object, line, json::Writer::COMPACT);
+		s3eDebugTracePrintf("HttpLoadGen: %s", line.str().c_str());
+		entries.Insert(std::move(object));
+	}
+	json::Object document;
+	document["version"] = json::Number::FromInteger(1);
+	document["engine"] = json::String(profile.engine == HttpClient::ENGINE_MULTI ? "multi" : "threads");
+	document["workers"] = json::Number::FromInteger(profile.numWorkers);
+	document["concurrency"] = json::Number::FromInteger(profile.concurrency);
+	document["targetRps"] = json::Number(profile.rps);
+	document["seconds"] = json::Number(seconds);
+	json::Object total_object = LoadGen_ToJson("total", total, seconds);
+	std::ostringstream line;
+	json::Writer::Write(total_object, line, json::Writer::COMPACT);
+	s3eDebugTracePrintf("HttpLoadGen: %s", line.str().c_str());
+	document["total"] = std::move(total_object);
+	document["mix"] = std::move(entries);
+	std::ostringstream out;
+	json::Writer::Write(document, out);
+	const string data = out.str();
+	s3eFile* p_file = s3eFileOpen(filePath, "w");
+	if (!p_file || s3eFileWrite(data.data(), 1, data.size(), p_file) != data.size())
+		s3eDebugTracePrintf("HttpLoadGen: Unable to write the results to %s", filePath);
+	if (p_file)
+		s3eFileClose(p_file);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* profile_path = argc > 1 ? argv[1] : "loadgen_profile.json";
+	const char* results_path = argc > 2 ? argv[2] : "loadgen_results.json";
+	LoadGenProfile profile;
+	try {
+		profile = LoadGen_ReadProfile(profile_path);
+		if (profile.caBundle.empty())
+			HttpClient::GlobalInit();
+		else
+			HttpClient::GlobalInit(profile.caBundle.c_str());
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpLoadGen: Unable to read %s: %s", profile_path, e.what());
+		return 1;
+	}
+
+	HttpRecording recording(profile.replayPath.empty() ? HttpRecording::MODE_RECORD : HttpRecording::MODE_REPLAY);
+	recording.SetSpeed(profile.replaySpeed);
+	if (!profile.replayPath.empty() && !recording.Load(profile.replayPath.c_str())) {
+		HttpClient::GlobalCleanup();
+		return 1;
+	}
+	const bool use_recording = !profile.recordPath.empty() || !profile.replayPath.empty();
+
+	LoadGenStats total;
+	std::vector<LoadGenStats> per_entry;
+	const double seconds = LoadGen_Run(profile, use_recording ? &recording : nullptr, total, per_entry);
+	LoadGen_WriteResults(profile, total, per_entry, seconds, results_path);
+	if (!profile.recordPath.empty() && !recording.Save(profile.recordPath.c_str()))
+		s3eDebugTracePrintf("HttpLoadGen: Unable to write the recording to %s", profile.recordPath.c_str());
+	if (!profile.replayPath.empty() && recording.GetNumMisses())
+		s3eDebugTracePrintf("HttpLoadGen: %llu requests had no recorded response", (unsigned long long)recording.GetNumMisses());
+
+	HttpClient::GlobalCleanup();
+	return 0;
+}
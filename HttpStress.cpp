@@ -0,0 +1,340 @@
+// HttpUtils stress test.
+// Hammers HttpClient's worker state machine (the UNUSED/ACTIVE/DONE/CLEANUP/
+// READY handshake between the app thread and the workers, and the completion
+// queue) with thousands of tiny requests, random aborts and clients destroyed
+// with requests in flight, and measures it as it goes. The responses are
+// served by an HttpRecording in replay mode (see src/HttpRecording.h), with a
+// few milliseconds of recorded pace, so nothing but the client itself is under
+// test and an abort is as likely to land mid-transfer as in the queue.
+// The run is a series of rounds, each on a new client with NUM_WORKERS worker
+// threads (or NUM_IO_THREADS I/O threads, with the multi engine), which takes
+// turns with each engine. Each round keeps CONCURRENCY requests queued or in
+// flight, and aborts one in ABORT_ONE_IN of them, at a random time from when it
+// is queued until a little after it could have finished, then either stops
+// sending and waits for everything to finish, or destroys the client there and
+// then. Every request is checked:
+//   lost       - one that was never aborted, but whose callback wasn't called by the end of its round
+//                (or, if its client was destroyed, one that finished without its callback being called)
+//   duplicated - one whose callback was called more than once, or at all after it was aborted
+//   misrouted  - one that got a response other than its own, or that finished as anything but DONE
+//   stuck      - one that was aborted, but never ended up finished or cancelled once its round was drained
+// Native builds (see src/platform/posix) take the duration and the results' path as arguments:
+//   HttpStress [seconds] [results.json]
+// On a device, it runs for DEFAULT_SECONDS and writes stress_results.json. The results (sustained
+// requests per second, the time taken by each Update() call, and the counts above) are also traced
+// as a line of JSON. The exit code is 1 if any request was lost, duplicated, misrouted or stuck.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "IwDebug.h"
+#include "s3eDevice.h"
+#include "s3eFile.h"
+#include "HttpClient.h"
+#include "HttpRecording.h"
+#include "HttpTracer.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+using std::string;
+
+static const uint NUM_WORKERS = 64;
+static const uint NUM_IO_THREADS = 4;
+static const uint CONCURRENCY = 512; // Requests queued or in flight at once: more than there are workers, so that the queue is busy too
+static const uint ABORT_ONE_IN = 8;
+static const uint NUM_URLS = 256;
+static const uint MAX_RESPONSE_MS = 8; // The recorded pace of the slowest response
+static const uint MIN_ROUND_MS = 50, MAX_ROUND_MS = 500;
+static const uint DRAIN_TIMEOUT_MS = 10000;
+static const double DEFAULT_SECONDS = 20;
+
+static uint32 Stress_Random(uint32& state) {
+	// xorshift32: the same run for the same seed (up to the threads' timing)
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static string Stress_Url(uint index) {
+	char url[64];
+	snprintf(url, sizeof(url), "http://stress.invalid/item/%u", index);
+	return url;
+}
+
+// FNV-1a, so that a response can be told from any other without keeping it:
+static uint32 Stress_Hash(uint32 hash, const unsigned char* pData, size_t size) {
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ pData[i]) * 16777619u;
+	return hash;
+}
+static const uint32 STRESS_HASH_START = 2166136261u;
+
+// A response for each URL, of a few bytes to a couple of KB (which name the URL), in one to three chunks spread
+// over up to MAX_RESPONSE_MS. Returns each one's hash.
+static std::vector<uint32> Stress_Record(HttpRecording& recording, uint32& random) {
+	std::vector<uint32> hashes;
+	for (uint i = 0; i < NUM_URLS; i++) {
+		HttpRecording::Exchange& exchange = recording.Add("GET", Stress_Url(i));
+		exchange.statusLine = "HTTP/1.1 200 OK";
+		exchange.statusCode = 200;
+		exchange.headers.Set("Content-Type", "text/plain");
+		char item[32];
+		const int item_size = snprintf(item, sizeof(item), "item %u;", i);
+		for (uint size = 16 + Stress_Random(random) % 2048; exchange.body.size() < size; )
+			exchange.body.append(item, item_size);
+		const uint num_chunks = 1 + Stress_Random(random) % 3;
+		const uint total_ms = Stress_Random(random) % (MAX_RESPONSE_MS + 1);
+		exchange.headersMs = total_ms / (num_chunks + 1);
+		for (uint c = 0, offset = 0; c < num_chunks; c++) {
+			HttpRecording::Chunk chunk;
+			chunk.offsetMs = exchange.headersMs + (total_ms - exchange.headersMs) * (c + 1) / num_chunks;
+			chunk.size = c + 1 < num_chunks ? (uint32)(exchange.body.size() / num_chunks) : (uint32)(exchange.body.size() - offset);
+			offset += chunk.size;
+			exchange.chunks.push_back(chunk);
+		}
+		exchange.totalMs = total_ms;
+		hashes.push_back(Stress_Hash(STRESS_HASH_START, (const unsigned char*)exchange.body.data(), exchange.body.size()));
+	}
+	return hashes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Requests:
+
+// Hashes its response as it arrives, and counts its callbacks.
+class StressRequest : public HttpRequest {
+public:
+	StressRequest(uint urlIndex, uint64 abortAtUs) : HttpRequest(GET, Stress_Url(urlIndex).c_str()), m_urlIndex(urlIndex), m_abortAtUs(abortAtUs), m_hash(STRESS_HASH_START), m_numCallbacks(0), m_aborted(false), m_wrongStatus(false) {
+		SetUseCache(false);
+		SetCoalesce(false);
+	}
+	uint GetUrlIndex() const { return m_urlIndex; }
+	uint64 GetAbortAtUs() const { return m_abortAtUs; } // 0 for never
+	uint32 GetHash() const { return m_hash; }
+	uint GetNumCallbacks() const { return m_numCallbacks; }
+	bool WasAborted() const { return m_aborted; }
+	bool WasWrongStatus() const { return m_wrongStatus; }
+	bool IsFinished() const { return m_status == DONE || m_status == ERROR || m_status == CANCELLED; }
+	void StressAbort() { m_aborted = true; Abort(); }
+	void HandleCallback() {
+		m_numCallbacks++;
+		if (m_status != DONE)
+			m_wrongStatus = true;
+	}
+
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) { m_hash = Stress_Hash(m_hash, contents, size); return size; }
+	virtual void HandleRequeue() { m_hash = STRESS_HASH_START; HttpRequest::HandleRequeue(); }
+
+private:
+	const uint m_urlIndex;
+	const uint64 m_abortAtUs;
+	volatile uint32 m_hash;
+	uint m_numCallbacks;
+	bool m_aborted; // By us, before its callback was called
+	bool m_wrongStatus; // Its callback was called when it wasn't DONE
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Results:
+
+struct StressStats {
+	uint64 numStarted;
+	uint64 numCompleted; // Callbacks called
+	uint64 numAborted;
+	uint64 numAbandoned; // Still in flight when their client was destroyed
+	uint64 numLost;
+	uint64 numDuplicated;
+	uint64 numMisrouted;
+	uint64 numStuck;
+	uint numRounds;
+	uint numDestroyed; // Rounds that ended by destroying the client
+	std::vector<double> updateMs;
+	StressStats() : numStarted(0), numCompleted(0), numAborted(0), numAbandoned(0), numLost(0), numDuplicated(0), numMisrouted(0), numStuck(0), numRounds(0), numDestroyed(0) {}
+	uint64 NumFailures() const { return numLost + numDuplicated + numMisrouted + numStuck; }
+};
+
+static double Stress_Percentile(const std::vector<double>& sorted, double fraction) {
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()))];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The run:
+
+class StressRound {
+public:
+	StressRound(HttpClient& client, const std::vector<uint32>& hashes, StressStats& stats, uint32& random) : m_client(client), m_engine(client.GetEngine()), m_hashes(hashes), m_stats(stats), m_random(random) {}
+	// Runs the round for durationMs, then drains it (or leaves its requests in flight, to be destroyed with the client).
+	void Run(uint durationMs, bool drain);
+	void Check(bool drained); // Once the client has been drained, or destroyed
+	void HandleResponse(Ptr<HttpRequest> pRequest) { ((StressRequest*)pRequest.ptr())->HandleCallback(); }
+
+private:
+	HttpClient& m_client; // Gone by the time a round that wasn't drained is checked
+	const HttpClient::Engine m_engine;
+	const std::vector<uint32>& m_hashes;
+	StressStats& m_stats;
+	uint32& m_random;
+	std::vector< Ptr<StressRequest> > m_requests; // All of this round's
+	std::vector<StressRequest*> m_inFlight; // Those we haven't seen finish yet
+	void Frame();
+};
+
+void StressRound::Frame() {
+	const uint64 start_us = HttpTracer::NowUs();
+	for (auto it = m_inFlight.begin(); it != m_inFlight.end(); it++) {
+		StressRequest& request = **it;
+		if (request.GetAbortAtUs() && request.GetAbortAtUs() <= start_us && !request.WasAborted() && !request.GetNumCallbacks()) {
+			request.StressAbort();
+			m_stats.numAborted++;
+		}
+	}
+	m_client.Update();
+	m_stats.updateMs.push_back((HttpTracer::NowUs() - start_us) / 1000.0);
+	for (size_t i = 0; i < m_inFlight.size(); i++) {
+		if (m_inFlight[i]->IsFinished()) {
+			m_inFlight[i] = m_inFlight.back();
+			m_inFlight.pop_back();
+			i--;
+		}
+	}
+	s3eDeviceYield(0);
+}
+
+void StressRound::Run(uint durationMs, bool drain) {
+	const uint64 end_us = HttpTracer::NowUs() + durationMs * 1000ULL;
+	while (HttpTracer::NowUs() < end_us && !s3eDeviceCheckQuitRequest()) {
+		while (m_inFlight.size() < CONCURRENCY) {
+			const uint url_index = Stress_Random(m_random) % NUM_URLS;
+			const uint64 abort_at_us = Stress_Random(m_random) % ABORT_ONE_IN ? 0 : HttpTracer::NowUs() + Stress_Random(m_random) % (MAX_RESPONSE_MS * 2000);
+			Ptr<StressRequest> p_request = new StressRequest(url_index, abort_at_us);
+			m_requests.push_back(p_request);
+			m_inFlight.push_back(p_request.ptr());
+			m_client.QueueRequest(p_request, fastdelegate::MakeDelegate(this, &StressRound::HandleResponse));
+			m_stats.numStarted++;
+		}
+		Frame();
+	}
+	if (!drain)
+		return;
+	const uint64 drain_end_us = HttpTracer::NowUs() + DRAIN_TIMEOUT_MS * 1000ULL;
+	while (!m_inFlight.empty() && HttpTracer::NowUs() < drain_end_us)
+		Frame();
+}
+
+void StressRound::Check(bool drained) {
+	for (auto it = m_requests.begin(); it != m_requests.end(); it++) {
+		const StressRequest& request = *it->ptr();
+		const uint num_callbacks = request.GetNumCallbacks();
+		m_stats.numCompleted += num_callbacks;
+		const char* failure = nullptr;
+		if (num_callbacks > 1 || (num_callbacks && request.WasAborted())) {
+			m_stats.numDuplicated++;
+			failure = "duplicated";
+		} else if (num_callbacks && (request.WasWrongStatus() || request.GetHash() != m_hashes[request.GetUrlIndex()])) {
+			m_stats.numMisrouted++;
+			failure = "misrouted";
+		} else if (request.WasAborted()) {
+			if (drained && !request.IsFinished()) {
+				m_stats.numStuck++;
+				failure = "stuck";
+			}
+		} else if (!num_callbacks) {
+			if (drained || request.IsFinished()) {
+				m_stats.numLost++;
+				failure = "lost";
+			} else {
+				m_stats.numAbandoned++;
+			}
+		}
+		if (failure)
+			s3eDebugTracePrintf("HttpStress: %s: %s (%s engine, status %d, %u callbacks, %s, %s response, %u retries)", failure, request.GetURL().c_str(),
+				m_engine == HttpClient::ENGINE_MULTI ? "multi" : "threads", (int)request.GetStatus(), num_callbacks, request.WasAborted() ? "aborted" : "not aborted",
+				request.GetHash() == m_hashes[request.GetUrlIndex()] ? "its own" : "another", request.GetNumRetries());
+	}
+	if (!drained)
+		m_stats.numDestroyed++;
+	m_stats.numRounds++;
+}
+
+static double Stress_Run(double seconds, StressStats& stats) {
+	uint32 random = 1;
+	HttpRecording recording(HttpRecording::MODE_REPLAY);
+	const std::vector<uint32> hashes = Stress_Record(recording, random);
+	const uint64 start_us = HttpTracer::NowUs();
+	const uint64 end_us = start_us + (uint64)(seconds * 1000000);
+	for (uint round = 0; HttpTracer::NowUs() < end_us && !s3eDeviceCheckQuitRequest(); round++) {
+		// Each engine in turn, and each ending in turn for each engine:
+		const HttpClient::Engine engine = round % 2 ? HttpClient::ENGINE_MULTI : HttpClient::ENGINE_THREADS;
+		const bool drain = (round / 2) % 2 == 0;
+		HttpClient* p_client = new HttpClient(NUM_WORKERS, "HttpUtils Stress", engine, NUM_IO_THREADS);
+		p_client->SetMaxRequestsPerHost(NUM_WORKERS);
+		p_client->SetRecording(&recording);
+		StressRound stress_round(*p_client, hashes, stats, random);
+		stress_round.Run(MIN_ROUND_MS + Stress_Random(random) % (MAX_ROUND_MS - MIN_ROUND_MS + 1), drain);
+		if (drain)
+			stress_round.Check(true);
+		delete p_client;
+		if (!drain)
+			stress_round.Check(false); // Once the client is gone, so that a callback from its destructor would be caught
+	}
+	return (HttpTracer::NowUs() - start_us) / 1000000.0;
+}
+
+static void Stress_WriteResults(StressStats& stats, double seconds, const char* filePath) {
+	std::sort(stats.updateMs.begin(), stats.updateMs.end());
+	json::Object results;
+	results["version"] = json::Number::FromInteger(1);
+	results["workers"] = json::Number::FromInteger(NUM_WORKERS);
+	results["ioThreads"] = json::Number::FromInteger(NUM_IO_THREADS);
+	results["concurrency"] = json::Number::FromInteger(CONCURRENCY);
+	results["seconds"] = json::Number(seconds);
+	results["rounds"] = json::Number::FromInteger(stats.numRounds);
+	results["destroyed"] = json::Number::FromInteger(stats.numDestroyed);
+	results["started"] = json::Number::FromInteger((long long)stats.numStarted);
+	results["completed"] = json::Number::FromInteger((long long)stats.numCompleted);
+	results["aborted"] = json::Number::FromInteger((long long)stats.numAborted);
+	results["abandoned"] = json::Number::FromInteger((long long)stats.numAbandoned);
+	results["requestsPerSecond"] = json::Number(seconds > 0 ? stats.numCompleted / seconds : 0);
+	results["lost"] = json::Number::FromInteger((long long)stats.numLost);
+	results["duplicated"] = json::Number::FromInteger((long long)stats.numDuplicated);
+	results["misrouted"] = json::Number::FromInteger((long long)stats.numMisrouted);
+	results["stuck"] = json::Number::FromInteger((long long)stats.numStuck);
+	results["updates"] = json::Number::FromInteger((long long)stats.updateMs.size());
+	results["updateP50ms"] = json::Number(Stress_Percentile(stats.updateMs, 0.5));
+	results["updateP90ms"] = json::Number(Stress_Percentile(stats.updateMs, 0.9));
+	results["updateP99ms"] = json::Number(Stress_Percentile(stats.updateMs, 0.99));
+	results["updateP999ms"] = json::Number(Stress_Percentile(stats.updateMs, 0.999));
+	results["updateMaxms"] = json::Number(stats.updateMs.empty() ? 0 : stats.updateMs.back());
+	std::ostringstream line;
+	json::Writer::Write(results, line, json::Writer::COMPACT);
+	s3eDebugTracePrintf("HttpStress: %s", line.str().c_str());
+	std::ostringstream out;
+	json::Writer::Write(results, out);
+	const string data = out.str();
+	s3eFile* p_file = s3eFileOpen(filePath, "w");
+	if (!p_file || s3eFileWrite(data.data(), 1, data.size(), p_file) != data.size())
+		s3eDebugTracePrintf("HttpStress: Unable to write the results to %s", filePath);
+	if (p_file)
+		s3eFileClose(p_file);
+}
+
+int main(int argc, char* argv[])
+{
+	const double seconds = argc > 1 ? atof(argv[1]) : DEFAULT_SECONDS;
+	const char* results_path = argc > 2 ? argv[2] : "stress_results.json";
+	HttpClient::GlobalInit();
+	StressStats stats;
+	const double elapsed = Stress_Run(seconds, stats);
+	Stress_WriteResults(stats, elapsed, results_path);
+	if (stats.NumFailures())
+		s3eDebugTracePrintf("HttpStress: FAILED: %llu lost, %llu duplicated, %llu misrouted, %llu stuck", (unsigned long long)stats.numLost,
+			(unsigned long long)stats.numDuplicated, (unsigned long long)stats.numMisrouted, (unsigned long long)stats.numStuck);
+	HttpClient::GlobalCleanup();
+	return stats.NumFailures() ? 1 : 0;
+}
@@ -0,0 +1,422 @@
+// HttpUtils regression tests.
+// Runs HttpClient against a minimal HTTP/1.1 server on the loopback interface,
+// checking behaviour that has broken before. Each test is run with both engines:
+//   segmented_compressed   - an HttpSegmentedDownload from a client that asks for compressed responses by
+//                            default, from a server that compresses whatever it is allowed to: the probe must
+//                            not ask, so that it gets the file's real size, and the file must arrive whole
+//   segmented_encoded_head - the same, from a server that labels its HEAD responses as compressed even when
+//                            not asked to: the probe's Content-Length can't be the file's size then, so the
+//                            file must be downloaded in one piece, and arrive whole
+// And one for the json layer on its own:
+//   json_arena_threads     - a json::Arena::Scope that is open on one thread must not be current on another, so
+//                            that a worker can parse a response into its own arena while the app thread has one
+// Each result is traced as it finishes. The exit code is 1 if any test failed.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "IwDebug.h"
+#include "s3eDevice.h"
+#include "s3eFile.h"
+#include "s3eTimer.h"
+#include "HttpClient.h"
+#include "HttpSegmentedDownload.h"
+#include "HttpTracer.h"
+#include "json.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "zlib.h"
+
+using std::string;
+
+static const size_t TEST_FILE_SIZE = 1024 * 1024; // Split into 4 segments of 256 KB by the segmented tests
+static const uint TEST_TIMEOUT_MS = 30000;
+
+///////////////////////////////////////////////////////////////////////////////
+// The loopback server:
+// One thread accepts connections, and each connection gets a thread of its own.
+// The threads only use the file and its compressed copy, which are made before
+// the server starts and only ever read, and fixed buffers, so there is no memory
+// environment to worry about. There is the one path:
+//   /file - TEST_FILE_SIZE bytes of text (honouring "Range: bytes=<start>-<end>" with a 206), gzipped
+//           if the request accepts it and has no Range, or, for a HEAD, if encodeHead is set
+// Connections are kept alive, as curl expects.
+
+struct TestServer {
+	enum { MAX_CONNECTIONS = 32 };
+	int listenFd;
+	int port;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	int connections[MAX_CONNECTIONS]; // -1 if unused
+	volatile bool quit;
+	volatile bool encodeHead; // Set between tests
+	// Guarded by mutex: what the clients asked for
+	uint numHeads;
+	uint numHeadsAcceptingGzip;
+	uint numRanges;
+	TestServer() : listenFd(-1), port(0), quit(false), encodeHead(false), numHeads(0), numHeadsAcceptingGzip(0), numRanges(0) { pthread_mutex_init(&mutex, nullptr); for (int i = 0; i < MAX_CONNECTIONS; i++) connections[i] = -1; }
+	~TestServer() { pthread_mutex_destroy(&mutex); }
+	bool Start();
+	void Stop();
+	void ResetCounts() { pthread_mutex_lock(&mutex); numHeads = numHeadsAcceptingGzip = numRanges = 0; pthread_mutex_unlock(&mutex); }
+};
+
+static string s_TestServer_file; // Filled by Start(), then only ever read, so it is shared by all the connections
+static string s_TestServer_gzipped;
+
+static bool TestServer_SendAll(int fd, const char* pData, size_t size) {
+	while (size > 0) {
+		const ssize_t sent = send(fd, pData, size, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		pData += sent;
+		size -= (size_t)sent;
+	}
+	return true;
+}
+
+static const char* TestServer_FindHeader(const char* pHeaders, const char* pEnd, const char* header) {
+	const size_t length = strlen(header);
+	for (const char* p_line = pHeaders; p_line < pEnd; ) {
+		const char* p_next = strstr(p_line, "\r\n");
+		if (!p_next || p_next > pEnd)
+			break;
+		if ((size_t)(p_next - p_line) > length && strncasecmp(p_line, header, length) == 0 && p_line[length] == ':') {
+			const char* p_value = p_line + length + 1;
+			while (*p_value == ' ')
+				p_value++;
+			return p_value;
+		}
+		p_line = p_next + 2;
+	}
+	return nullptr;
+}
+
+static bool TestServer_Gzip(const string& in, string& out) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) // (+16 for a gzip wrapper)
+		return false;
+	out.resize(deflateBound(&stream, (uLong)in.size()) + 32);
+	stream.next_in = (Bytef*)in.data();
+	stream.avail_in = (uInt)in.size();
+	stream.next_out = (Bytef*)&out[0];
+	stream.avail_out = (uInt)out.size();
+	const bool ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+	return ok;
+}
+
+struct TestServer_Connection {
+	TestServer* pServer;
+	int* pFd;
+};
+
+static void* TestServer_ConnectionMain(void* _pConnection) {
+	TestServer_Connection connection = *(TestServer_Connection*)_pConnection;
+	delete (TestServer_Connection*)_pConnection;
+	TestServer* p_server = connection.pServer;
+	int* p_fd = connection.pFd;
+	const int fd = *p_fd;
+	char buffer[16 * 1024];
+	size_t filled = 0;
+	for (;;) {
+		// Read the request line and headers (none of the requests have a body):
+		char* p_end = nullptr;
+		while (!p_end) {
+			if (filled == sizeof(buffer) - 1)
+				goto closed;
+			const ssize_t received = recv(fd, buffer + filled, sizeof(buffer) - 1 - filled, 0);
+			if (received < 0 && errno == EINTR)
+				continue;
+			if (received <= 0)
+				goto closed;
+			filled += (size_t)received;
+			buffer[filled] = 0;
+			p_end = strstr(buffer, "\r\n\r\n");
+		}
+		p_end += 4;
+		char method[16] = "", path[256] = "";
+		sscanf(buffer, "%15s %255s", method, path);
+		const bool head = strcmp(method, "HEAD") == 0;
+		const char* p_accept = TestServer_FindHeader(buffer, p_end, "Accept-Encoding");
+		const char* p_gzip = p_accept ? strstr(p_accept, "gzip") : nullptr;
+		const bool accepts_gzip = p_gzip && p_gzip < strstr(p_accept, "\r\n");
+		long long start = -1, end = -1;
+		const char* p_range = TestServer_FindHeader(buffer, p_end, "Range");
+		const bool ranged = p_range && sscanf(p_range, "bytes=%lld-%lld", &start, &end) == 2 && start >= 0 && start <= end && end < (long long)s_TestServer_file.size();
+		pthread_mutex_lock(&p_server->mutex);
+		p_server->numHeads += head;
+		p_server->numHeadsAcceptingGzip += head && accepts_gzip;
+		p_server->numRanges += ranged;
+		pthread_mutex_unlock(&p_server->mutex);
+		const size_t used = p_end - buffer;
+		memmove(buffer, p_end, filled - used);
+		filled -= used;
+
+		char header[256];
+		int header_size;
+		const char* p_body = nullptr;
+		size_t body_size = 0;
+		if (strcmp(path, "/file") != 0) {
+			header_size = snprintf(header, sizeof(header), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+		} else if (ranged) {
+			p_body = s_TestServer_file.data() + start;
+			body_size = (size_t)(end - start + 1);
+			header_size = snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\nContent-Type: text/plain\r\nAccept-Ranges: bytes\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n\r\n",
+				start, end, (long long)s_TestServer_file.size(), (long long)body_size);
+		} else if ((accepts_gzip && !p_range) || (head && p_server->encodeHead)) {
+			p_body = s_TestServer_gzipped.data();
+			body_size = s_TestServer_gzipped.size();
+			header_size = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nAccept-Ranges: bytes\r\nContent-Length: %lld\r\n\r\n", (long long)body_size);
+		} else {
+			p_body = s_TestServer_file.data();
+			body_size = s_TestServer_file.size();
+			header_size = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nAccept-Ranges: bytes\r\nContent-Length: %lld\r\n\r\n", (long long)body_size);
+		}
+		if (!TestServer_SendAll(fd, header, header_size) || (!head && body_size && !TestServer_SendAll(fd, p_body, body_size)))
+			goto closed;
+	}
+closed:
+	pthread_mutex_lock(&p_server->mutex);
+	close(fd);
+	*p_fd = -1; // Stop() waits for this
+	pthread_mutex_unlock(&p_server->mutex);
+	return nullptr;
+}
+
+static void* TestServer_Main(void* _pServer) {
+	TestServer* p_server = (TestServer*)_pServer;
+	while (!p_server->quit) {
+		const int fd = accept(p_server->listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break; // Stop() has shut the socket down
+		}
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_mutex_lock(&p_server->mutex);
+		int* p_fd = nullptr;
+		for (int i = 0; i < TestServer::MAX_CONNECTIONS && !p_fd; i++) {
+			if (p_server->connections[i] == -1)
+				p_fd = &p_server->connections[i];
+		}
+		bool handled = false;
+		if (p_fd) {
+			// (Allocated in the same memory environment as the connection thread frees it in)
+			TestServer_Connection* p_connection = new TestServer_Connection;
+			p_connection->pServer = p_server;
+			p_connection->pFd = p_fd;
+			*p_fd = fd;
+			pthread_t thread;
+			handled = pthread_create(&thread, nullptr, TestServer_ConnectionMain, p_connection) == 0;
+			if (handled) {
+				pthread_detach(thread);
+			} else {
+				*p_fd = -1;
+				delete p_connection;
+			}
+		}
+		pthread_mutex_unlock(&p_server->mutex);
+		if (!handled) {
+			s3eDebugTracePrintf("TestServer: Unable to handle another connection");
+			close(fd);
+		}
+	}
+	return nullptr;
+}
+
+bool TestServer::Start() {
+	// Text compresses well, so the gzipped Content-Length is far from the file's size:
+	s_TestServer_file.reserve(TEST_FILE_SIZE);
+	for (uint line = 0; s_TestServer_file.size() < TEST_FILE_SIZE; line++) {
+		char text[32];
+		snprintf(text, sizeof(text), "line %08u\n", line);
+		s_TestServer_file.append(text);
+	}
+	s_TestServer_file.resize(TEST_FILE_SIZE);
+	if (!TestServer_Gzip(s_TestServer_file, s_TestServer_gzipped))
+		return false;
+	signal(SIGPIPE, SIG_IGN);
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenFd < 0)
+		return false;
+	const int one = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0; // Any free port
+	socklen_t addr_size = sizeof(addr);
+	if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, MAX_CONNECTIONS) != 0 || getsockname(listenFd, (sockaddr*)&addr, &addr_size) != 0
+		|| pthread_create(&thread, nullptr, TestServer_Main, this) != 0) {
+		close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+	port = ntohs(addr.sin_port);
+	return true;
+}
+
+void TestServer::Stop() {
+	quit = true;
+	shutdown(listenFd, SHUT_RDWR);
+	pthread_join(thread, nullptr);
+	close(listenFd);
+	// The HttpClients have all been deleted by now, so their connections should be closing; make sure:
+	for (;;) {
+		bool any_open = false;
+		pthread_mutex_lock(&mutex);
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			if (connections[i] != -1) {
+				shutdown(connections[i], SHUT_RDWR);
+				any_open = true;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+		if (!any_open)
+			break;
+		usleep(1000);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The tests:
+
+static uint s_numFailed = 0;
+
+static void Test_Check(bool ok, const char* test, const char* engine, const char* what) {
+	if (!ok) {
+		s3eDebugTracePrintf("HttpTests: FAILED: %s (%s): %s", test, engine, what);
+		s_numFailed++;
+	}
+}
+
+static bool Test_FileMatches(const char* filePath, const string& expected) {
+	s3eFile* p_file = s3eFileOpen(filePath, "rb");
+	if (!p_file)
+		return false;
+	string data(expected.size() + 1, '\0'); // One more, to catch a file that is too long
+	const size_t size = s3eFileRead(&data[0], 1, data.size(), p_file);
+	s3eFileClose(p_file);
+	return size == expected.size() && memcmp(data.data(), expected.data(), size) == 0;
+}
+
+// Run the client until pRequest has finished (or the test has timed out):
+static bool Test_Wait(HttpClient& client, HttpRequest& request) {
+	const uint64 start_ms = s3eTimerGetMs();
+	while (request.GetStatus() != HttpRequest::DONE && request.GetStatus() != HttpRequest::ERROR && request.GetStatus() != HttpRequest::CANCELLED) {
+		if (s3eTimerGetMs() - start_ms > TEST_TIMEOUT_MS)
+			return false;
+		client.Update();
+		s3eDeviceYield(1);
+	}
+	return true;
+}
+
+static void Test_SegmentedDownload(TestServer& server, HttpClient::Engine engine, bool encodeHead) {
+	const char* const test = encodeHead ? "segmented_encoded_head" : "segmented_compressed";
+	const char* const engine_name = engine == HttpClient::ENGINE_MULTI ? "multi" : "threads";
+	const char* const dest_file = "http_tests/segmented.txt";
+	server.encodeHead = encodeHead;
+	server.ResetCounts();
+	s3eFileDelete(dest_file);
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/file", server.port);
+	const uint64 start_us = HttpTracer::NowUs();
+	{
+		HttpClient client(8, "HttpUtils Tests", engine, 2);
+		client.SetAcceptCompressed(true); // (The default, but it's what this is about)
+		Ptr<HttpSegmentedDownload> p_download = new HttpSegmentedDownload(client, url, dest_file, 4, TEST_FILE_SIZE / 4);
+		client.QueueRequest(p_download.ptr());
+		Test_Check(Test_Wait(client, *p_download.ptr()), test, engine_name, "timed out");
+		Test_Check(p_download->GetStatus() == HttpRequest::DONE, test, engine_name, "the download failed");
+		if (encodeHead) {
+			Test_Check(p_download->GetFileSize() == -1, test, engine_name, "took a compressed Content-Length as the file's size");
+			Test_Check(p_download->GetNumSegments() == 1, test, engine_name, "split a file of unknown size into segments");
+		} else {
+			Test_Check(p_download->GetFileSize() == (int64)TEST_FILE_SIZE, test, engine_name, "the probe got the wrong file size");
+			Test_Check(p_download->GetNumSegments() == 4, test, engine_name, "the file wasn't split into segments");
+		}
+	}
+	Test_Check(Test_FileMatches(dest_file, s_TestServer_file), test, engine_name, "the file doesn't match the server's");
+	pthread_mutex_lock(&server.mutex);
+	const uint num_heads = server.numHeads, num_heads_gzip = server.numHeadsAcceptingGzip, num_ranges = server.numRanges;
+	pthread_mutex_unlock(&server.mutex);
+	Test_Check(num_heads == 1, test, engine_name, "expected one probe");
+	Test_Check(num_heads_gzip == 0, test, engine_name, "the probe asked for a compressed response");
+	Test_Check(num_ranges == (encodeHead ? 0u : 4u), test, engine_name, "wrong number of ranged requests");
+	s3eFileDelete(dest_file);
+	s3eDebugTracePrintf("HttpTests: %s (%s): %.1f ms", test, engine_name, (HttpTracer::NowUs() - start_us) / 1000.0);
+}
+
+// The other thread of Test_JsonArenaThreads():
+static void* Test_JsonArenaThreads_Main(void* _pResult) {
+	const char** p_result = static_cast<const char**>(_pResult);
+	if (json::Arena::Current() != NULL) {
+		*p_result = "another thread's arena is current here";
+		return nullptr;
+	}
+	static const char s_document[] = "[\"arena\", 1, 2, 3]";
+	json::Document document;
+	document.Read(s_document, sizeof(s_document) - 1);
+	const json::Array& array = document.Root();
+	if (array.Size() != 4 || static_cast<const json::String&>(array[0]).Value() != "arena")
+		*p_result = "the document was read wrongly";
+	else if (json::Arena::Current() != NULL)
+		*p_result = "the arena was left current after reading";
+	return nullptr;
+}
+
+static void Test_JsonArenaThreads() {
+	const char* const test = "json_arena_threads";
+	const uint64 start_us = HttpTracer::NowUs();
+	json::Arena arena;
+	{
+		json::Arena::Scope scope(arena);
+		const char* p_result = nullptr;
+		pthread_t thread;
+		if (pthread_create(&thread, nullptr, Test_JsonArenaThreads_Main, &p_result) == 0) {
+			pthread_join(thread, nullptr);
+			Test_Check(p_result == nullptr, test, "json", p_result ? p_result : "");
+		} else
+			Test_Check(false, test, "json", "unable to start a thread");
+		Test_Check(json::Arena::Current() == &arena, test, "json", "this thread's arena was changed by the other");
+	}
+	s3eDebugTracePrintf("HttpTests: %s: %.1f ms", test, (HttpTracer::NowUs() - start_us) / 1000.0);
+}
+
+int main(int argc, char* argv[])
+{
+	HttpClient::GlobalInit();
+	TestServer server;
+	if (!server.Start()) {
+		s3eDebugTracePrintf("HttpTests: Unable to start the loopback server");
+		return 1;
+	}
+	for (int i = 0; i < 2; i++) {
+		const HttpClient::Engine engine = i ? HttpClient::ENGINE_MULTI : HttpClient::ENGINE_THREADS;
+		Test_SegmentedDownload(server, engine, false);
+		Test_SegmentedDownload(server, engine, true);
+	}
+	server.Stop();
+	Test_JsonArenaThreads();
+	HttpClient::GlobalCleanup();
+	s3eDebugTracePrintf("HttpTests: %s", s_numFailed ? "FAILED" : "all passed");
+	return s_numFailed ? 1 : 0;
+}
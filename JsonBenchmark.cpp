@@ -0,0 +1,395 @@
+// JSON benchmark.
+// Times the json layer (src/util/json.h) over a corpus of generated documents,
+// each shaped to stress one part of it:
+//   api_response  - like a typical REST response: an array of small objects
+//   deep_nesting  - arrays and objects nested a few hundred deep
+//   large_array   - one flat array of 100000 small integers
+//   long_strings  - a few long strings full of escapes and non-ASCII text
+//   numbers       - an array of arrays of floating point numbers
+// For each document it times Reader::Read() (from memory, through Document's
+// arena, and from an istream), PushParser, Writer::Write() (pretty and compact),
+// writing and reading the same document as CBOR, Object::operator[] lookups and
+// copying an UnknownElement, which shares what it holds rather than copying it
+// (and, for api_response, Reader::ReadValue() into
+// structs that only want a few of its fields, and picking a few values out of
+// every item by chained operator[], by compiled json::Paths, and by a
+// json::PathSet on the DOM and on a tape), and counts the heap allocations each one makes
+// (every allocation in json goes through the global operator new, which this
+// file replaces). The results are printed, and written to
+// json_benchmark_results.json, one object per document and operation.
+// Only depends on json.h, jsonbind.h, jsoncbor.h, jsontape.h and jsonpath.h, so it can also be built on its own, e.g.
+//     g++ -O2 -std=c++0x -Isrc/util JsonBenchmark.cpp -o JsonBenchmark
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "json.h"
+#include "jsonbind.h"
+#include "jsoncbor.h"
+#include "jsonpath.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+using std::string;
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation counting (the benchmark is single threaded):
+
+static unsigned long long s_numAllocations = 0;
+static unsigned long long s_bytesAllocated = 0;
+
+// Kept out of line, so that the compiler doesn't pair our operator new with the free() inside
+// operator delete and warn about a mismatched deallocation:
+__attribute__((noinline)) static void* JsonBenchmark_Allocate(size_t size) { return malloc(size ? size : 1); }
+__attribute__((noinline)) static void JsonBenchmark_Deallocate(void* p) { free(p); }
+
+void* operator new(size_t size) {
+	s_numAllocations++;
+	s_bytesAllocated += size;
+	if (void* p = JsonBenchmark_Allocate(size))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) throw() { JsonBenchmark_Deallocate(p); }
+void operator delete[](void* p) throw() { JsonBenchmark_Deallocate(p); }
+
+static double JsonBenchmark_NowSeconds() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The corpus:
+
+static string JsonBenchmark_ApiResponse() {
+	string text("{\"kind\":\"videoListResponse\",\"pageInfo\":{\"totalResults\":2000,\"resultsPerPage\":2000},\"items\":[");
+	char item[512];
+	for (int i = 0; i < 2000; i++) {
+		snprintf(item, sizeof(item), "%s{\"id\":\"v%07d\",\"etag\":\"\\\"tag%d\\\"\",\"snippet\":{\"title\":\"Video number %d\",\"publishedAt\":\"2014-01-%02dT12:00:00.000Z\","
+			"\"tags\":[\"one\",\"two\",\"three\"],\"thumbnail\":{\"url\":\"https://i.example.com/vi/v%07d/default.jpg\",\"width\":120,\"height\":90}},"
+			"\"statistics\":{\"viewCount\":%d,\"likeCount\":%d,\"rating\":%d.%02d,\"private\":%s,\"location\":null}}",
+			i ? "," : "", i, i, i, i % 28 + 1, i, i * 37, i * 3, i % 5, i % 100, i % 3 ? "false" : "true");
+		text.append(item);
+	}
+	return text.append("]}");
+}
+
+// What a client of api_response might actually want from it:
+struct JsonBenchmark_Snippet {
+	string title;
+	std::vector<string> tags;
+};
+struct JsonBenchmark_Statistics {
+	JsonBenchmark_Statistics() : viewCount(0) {}
+	long long viewCount;
+};
+struct JsonBenchmark_Item {
+	string id;
+	JsonBenchmark_Snippet snippet;
+	JsonBenchmark_Statistics statistics;
+};
+struct JsonBenchmark_Response {
+	std::vector<JsonBenchmark_Item> items;
+};
+JSON_FIELDS(JsonBenchmark_Snippet, title, tags)
+JSON_FIELDS(JsonBenchmark_Statistics, viewCount)
+JSON_FIELDS(JsonBenchmark_Item, id, snippet, statistics)
+JSON_FIELDS(JsonBenchmark_Response, items)
+
+static string JsonBenchmark_DeepNesting() {
+	const int depth = 500;
+	string text;
+	for (int i = 0; i < depth; i++)
+		text.append(i % 2 ? "[" : "{\"child\":");
+	text.append("\"leaf\"");
+	for (int i = depth - 1; i >= 0; i--)
+		text.append(i % 2 ? "]" : "}");
+	return text;
+}
+
+static string JsonBenchmark_LargeArray() {
+	string text("[");
+	char number[16];
+	for (int i = 0; i < 100000; i++) {
+		snprintf(number, sizeof(number), i ? ",%d" : "%d", (i * 7919) % 100000);
+		text.append(number);
+	}
+	return text.append("]");
+}
+
+static string JsonBenchmark_LongStrings() {
+	string text("[");
+	for (int i = 0; i < 8; i++) {
+		text.append(i ? ",\"" : "\"");
+		for (int j = 0; j < 4096; j++)
+			text.append(j % 4 == 0 ? "line\\n\\ttab \\\"quoted\\\" " : j % 4 == 1 ? "caf\xC3\xA9 \\u00e9\\u4e2d " : "plain ascii text ");
+		text.append("\"");
+	}
+	return text.append("]");
+}
+
+static string JsonBenchmark_Numbers() {
+	string text("[");
+	char number[64];
+	for (int i = 0; i < 10000; i++) {
+		text.append(i ? ",[" : "[");
+		for (int j = 0; j < 4; j++) {
+			snprintf(number, sizeof(number), j ? ",%.17g" : "%.17g", (i + 1) * (j + 1) * 1.000123456789e-3 - 5.5);
+			text.append(number);
+		}
+		text.append("]");
+	}
+	return text.append("]");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing:
+
+struct JsonBenchmarkResult {
+	string document;
+	string operation;
+	size_t bytes; // Of JSON text per iteration (0 if the operation doesn't deal in text)
+	unsigned long long iterations;
+	size_t lookupsPerIteration; // For lookup
+	double seconds;
+	double allocationsPerIteration;
+	double bytesAllocatedPerIteration;
+};
+
+// Run op until it has taken at least minSeconds, then report the average.
+template <typename Op>
+static JsonBenchmarkResult JsonBenchmark_Time(const string& document, const char* operation, size_t bytes, Op op, double minSeconds = 0.25) {
+	op(); // Warm up (e.g. fill the arena's first block)
+	JsonBenchmarkResult result;
+	result.document = document;
+	result.operation = operation;
+	result.bytes = bytes;
+	result.iterations = 0;
+	result.lookupsPerIteration = 0;
+	const unsigned long long num_allocations = s_numAllocations, bytes_allocated = s_bytesAllocated;
+	const double start = JsonBenchmark_NowSeconds();
+	do {
+		op();
+		result.iterations++;
+		result.seconds = JsonBenchmark_NowSeconds() - start;
+	} while (result.seconds < minSeconds);
+	result.allocationsPerIteration = (double)(s_numAllocations - num_allocations) / result.iterations;
+	result.bytesAllocatedPerIteration = (double)(s_bytesAllocated - bytes_allocated) / result.iterations;
+	return result;
+}
+
+// Collect the paths to every member of every object in the document, to look them up again
+static void JsonBenchmark_FindKeys(const json::UnknownElement& element, std::vector< std::pair<const json::Object*, string> >& keys) {
+	if (element.IsOfType<json::Object>()) {
+		const json::Object& object = element;
+		for (json::Object::const_iterator it = object.Begin(); it != object.End(); it++) {
+			keys.push_back(std::make_pair(&object, it->name));
+			JsonBenchmark_FindKeys(it->element, keys);
+		}
+	} else if (element.IsOfType<json::Array>()) {
+		const json::Array& array = element;
+		for (json::Array::const_iterator it = array.Begin(); it != array.End(); it++)
+			JsonBenchmark_FindKeys(*it, keys);
+	}
+}
+
+volatile size_t g_JsonBenchmarkSink; // Results are stored here, so that the optimizer can't drop the work
+
+static void JsonBenchmark_Run(const string& name, const string& text, std::vector<JsonBenchmarkResult>& results) {
+	results.push_back(JsonBenchmark_Time(name, "read", text.size(), [&]() {
+		json::UnknownElement root;
+		json::Reader::Read(root, text.data(), text.size());
+	}));
+	json::Document document;
+	results.push_back(JsonBenchmark_Time(name, "read_document", text.size(), [&]() {
+		document.Read(text.data(), text.size());
+	}));
+	results.push_back(JsonBenchmark_Time(name, "read_istream", text.size(), [&]() {
+		std::istringstream in(text);
+		json::UnknownElement root;
+		json::Reader::Read(root, in);
+	}));
+	results.push_back(JsonBenchmark_Time(name, "read_push", text.size(), [&]() {
+		// In 16 KB chunks, as a download would arrive
+		json::UnknownElement root;
+		json::DomBuilder builder(root);
+		json::PushParser parser(builder);
+		for (size_t pos = 0; pos < text.size(); pos += 16384)
+			parser.Feed(text.data() + pos, std::min<size_t>(16384, text.size() - pos));
+		parser.Finish();
+	}));
+	if (name == "api_response") {
+		results.push_back(JsonBenchmark_Time(name, "read_value", text.size(), [&]() {
+			JsonBenchmark_Response response;
+			json::Reader::ReadValue(response, text.data(), text.size());
+			g_JsonBenchmarkSink = response.items.size();
+		}));
+	}
+
+	json::UnknownElement root;
+	json::Reader::Read(root, text.data(), text.size());
+	std::ostringstream written;
+	json::Writer::Write(root, written);
+	const size_t written_size = written.str().size();
+	results.push_back(JsonBenchmark_Time(name, "write", written_size, [&]() {
+		std::ostringstream out;
+		json::Writer::Write(root, out);
+		g_JsonBenchmarkSink = (size_t)out.tellp();
+	}));
+	std::ostringstream written_compact;
+	json::Writer::Write(root, written_compact, json::Writer::COMPACT);
+	const size_t written_compact_size = written_compact.str().size();
+	results.push_back(JsonBenchmark_Time(name, "write_compact", written_compact_size, [&]() {
+		std::ostringstream out;
+		json::Writer::Write(root, out, json::Writer::COMPACT);
+		g_JsonBenchmarkSink = (size_t)out.tellp();
+	}));
+	string cbor(json::CborWriter::MeasureSize(root), '\0');
+	json::CborWriter::Write(root, &cbor[0]);
+	printf("JsonBenchmark: %s is %u bytes of compact JSON, %u bytes of CBOR\n", name.c_str(), (unsigned)written_compact_size, (unsigned)cbor.size());
+	results.push_back(JsonBenchmark_Time(name, "write_cbor", cbor.size(), [&]() {
+		string out(json::CborWriter::MeasureSize(root), '\0');
+		json::CborWriter::Write(root, &out[0]);
+		g_JsonBenchmarkSink = out.size();
+	}));
+	results.push_back(JsonBenchmark_Time(name, "read_cbor", cbor.size(), [&]() {
+		json::UnknownElement cbor_root;
+		json::DomBuilder builder(cbor_root);
+		json::CborParser::Parse(cbor.data(), cbor.size(), builder);
+	}));
+
+	std::vector< std::pair<const json::Object*, string> > keys;
+	JsonBenchmark_FindKeys(root, keys);
+	if (!keys.empty()) {
+		results.push_back(JsonBenchmark_Time(name, "lookup", 0, [&]() {
+			for (size_t i = 0; i < keys.size(); i++)
+				g_JsonBenchmarkSink = (size_t)&(*keys[i].first)[keys[i].second];
+		}));
+		results.back().lookupsPerIteration = keys.size();
+	}
+
+	// (Through a const reference: a non-const one would pick UnknownElement's non-const cast, which stops it sharing with copies)
+	const json::UnknownElement& const_root = root;
+	std::vector<float> numbers;
+	if (root.IsOfType<json::Array>() && ((const json::Array&)const_root).GetNumbers(numbers)) {
+		results.push_back(JsonBenchmark_Time(name, "get_numbers", 0, [&]() {
+			((const json::Array&)const_root).GetNumbers(numbers);
+			g_JsonBenchmarkSink = (size_t)numbers.back();
+		}));
+	}
+
+	if (name == "api_response") {
+		// What a handler might pull out of each item:
+		const json::UnknownElement& items = const_root["items"];
+		const size_t num_items = ((const json::Array&)items).Size();
+		results.push_back(JsonBenchmark_Time(name, "lookup_chain", 0, [&]() {
+			for (size_t i = 0; i < num_items; i++) {
+				const json::UnknownElement& item = items[i];
+				g_JsonBenchmarkSink = (size_t)&item["id"] + (size_t)&item["snippet"]["title"] + (size_t)&item["snippet"]["thumbnail"]["url"]
+					+ (size_t)&item["statistics"]["viewCount"];
+			}
+		}));
+		results.back().lookupsPerIteration = num_items * 4;
+		const json::Path id_path("/id"), title_path("/snippet/title"), url_path("/snippet/thumbnail/url"), views_path("/statistics/viewCount");
+		results.push_back(JsonBenchmark_Time(name, "lookup_path", 0, [&]() {
+			for (size_t i = 0; i < num_items; i++) {
+				const json::UnknownElement& item = items[i];
+				g_JsonBenchmarkSink = (size_t)id_path.Find(item) + (size_t)title_path.Find(item) + (size_t)url_path.Find(item) + (size_t)views_path.Find(item);
+			}
+		}));
+		results.back().lookupsPerIteration = num_items * 4;
+		json::PathSet item_paths;
+		item_paths.Add(id_path);
+		item_paths.Add(title_path);
+		item_paths.Add(url_path);
+		item_paths.Add(views_path);
+		std::vector<const json::UnknownElement*> found;
+		results.push_back(JsonBenchmark_Time(name, "lookup_path_set", 0, [&]() {
+			for (size_t i = 0; i < num_items; i++) {
+				item_paths.Find(items[i], found);
+				g_JsonBenchmarkSink = (size_t)found[3];
+			}
+		}));
+		results.back().lookupsPerIteration = num_items * 4;
+		json::TapeWriter tape;
+		json::PushParser tape_parser(tape);
+		tape_parser.Feed(text.data(), text.size());
+		tape_parser.Finish();
+		json::TapeDocument tape_document;
+		tape_document.Adopt(tape);
+		const json::TapeValue tape_items = tape_document.Root()["items"];
+		std::vector<json::TapeValue> tape_found;
+		results.push_back(JsonBenchmark_Time(name, "lookup_path_set_tape", 0, [&]() {
+			for (json::TapeValue::Iterator it = tape_items.Begin(), it_end = tape_items.End(); it != it_end; ++it) {
+				item_paths.Find(it.Value(), tape_found);
+				g_JsonBenchmarkSink = (size_t)tape_found[3].AsInteger();
+			}
+		}));
+		results.back().lookupsPerIteration = num_items * 4;
+	}
+
+	results.push_back(JsonBenchmark_Time(name, "copy", 0, [&]() {
+		json::UnknownElement copy(root);
+		g_JsonBenchmarkSink = (size_t)&copy;
+	}));
+}
+
+static json::Object JsonBenchmark_ToJson(const JsonBenchmarkResult& result) {
+	json::Object object;
+	object["document"] = json::String(result.document);
+	object["operation"] = json::String(result.operation);
+	object["iterations"] = json::Number::FromInteger(result.iterations);
+	object["usPerIteration"] = json::Number(result.seconds * 1e6 / result.iterations);
+	if (result.bytes)
+		object["mbPerSecond"] = json::Number(result.bytes * (double)result.iterations / result.seconds / (1024 * 1024));
+	if (result.lookupsPerIteration)
+		object["nsPerLookup"] = json::Number(result.seconds * 1e9 / result.iterations / result.lookupsPerIteration);
+	object["allocationsPerIteration"] = json::Number(result.allocationsPerIteration);
+	object["bytesAllocatedPerIteration"] = json::Number(result.bytesAllocatedPerIteration);
+	return object;
+}
+
+int main()
+{
+	struct { const char* name; string (*generate)(); } corpus[] = {
+		{ "api_response", JsonBenchmark_ApiResponse },
+		{ "deep_nesting", JsonBenchmark_DeepNesting },
+		{ "large_array", JsonBenchmark_LargeArray },
+		{ "long_strings", JsonBenchmark_LongStrings },
+		{ "numbers", JsonBenchmark_Numbers },
+	};
+	std::vector<JsonBenchmarkResult> results;
+	for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		try {
+			JsonBenchmark_Run(corpus[i].name, corpus[i].generate(), results);
+		} catch (const json::Exception& e) {
+			printf("JsonBenchmark: %s failed: %s\n", corpus[i].name, e.what());
+			return 1;
+		}
+	}
+
+	json::Array array;
+	for (size_t i = 0; i < results.size(); i++) {
+		json::Object object = JsonBenchmark_ToJson(results[i]);
+		std::ostringstream line;
+		json::Writer::Write(object, line, json::Writer::COMPACT);
+		printf("JsonBenchmark: %s\n", line.str().c_str());
+		array.Insert(std::move(object));
+	}
+	json::Object document;
+	document["version"] = json::Number::FromInteger(1);
+	document["results"] = std::move(array);
+	std::ostringstream out;
+	json::Writer::Write(document, out);
+	const string data = out.str();
+	FILE* p_file = fopen("json_benchmark_results.json", "w");
+	if (!p_file || fwrite(data.data(), 1, data.size(), p_file) != data.size())
+		printf("JsonBenchmark: Unable to write the results\n");
+	if (p_file)
+		fclose(p_file);
+	return 0;
+}
@@ -0,0 +1,177 @@
+// HttpAllocStats:
+// Counts heap allocations by memory environment, site and request, if built with HTTP_ALLOC_STATS.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpAllocStats.h"
+
+#include <new>
+#include <pthread.h>
+#include <stdlib.h>
+#include <s3eDebug.h>
+
+#include "util/atomic.h"
+
+namespace HttpAllocStats {
+
+static const char* const HTTP_ALLOC_STATS_SITE_NAMES[NUM_SITES] = { "other", "request", "headers", "body", "json", "finish", "callback" };
+
+const char* GetSiteName(Site site) {
+	return site < NUM_SITES ? HTTP_ALLOC_STATS_SITE_NAMES[site] : "???";
+}
+
+unsigned long long Counters::GetNumAllocations() const {
+	unsigned long long total = 0;
+	for (int i = 0; i < NUM_SITES; i++)
+		total += sites[i].numAllocations;
+	return total;
+}
+
+unsigned long long Counters::GetNumBytes() const {
+	unsigned long long total = 0;
+	for (int i = 0; i < NUM_SITES; i++)
+		total += sites[i].numBytes;
+	return total;
+}
+
+void Counters::Add(const Counters& other) {
+	for (int i = 0; i < NUM_SITES; i++) {
+		sites[i].numAllocations += other.sites[i].numAllocations;
+		sites[i].numBytes += other.sites[i].numBytes;
+	}
+}
+
+#ifdef HTTP_ALLOC_STATS
+
+// What the current thread is doing. Allocated with malloc(), as operator new is what we're counting.
+struct ThreadState {
+	Site site;
+	Counters* pRequest;
+};
+
+static Counters s_totals[NUM_ENVIRONMENTS];
+static pthread_t s_appThread;
+static pthread_key_t s_stateKey;
+static volatile bool s_initialised = false; // Nothing is counted until Init(), e.g. during static construction
+
+static void HttpAllocStats_FreeState(void* pState) {
+	free(pState);
+}
+
+static ThreadState* HttpAllocStats_GetState() {
+	ThreadState* p_state = (ThreadState*)pthread_getspecific(s_stateKey);
+	if (!p_state) {
+		p_state = (ThreadState*)malloc(sizeof(ThreadState));
+		if (!p_state)
+			return nullptr;
+		p_state->site = SITE_OTHER;
+		p_state->pRequest = nullptr;
+		pthread_setspecific(s_stateKey, p_state);
+	}
+	return p_state;
+}
+
+static void HttpAllocStats_Add(Counter& counter, size_t bytes) {
+	atomic::FetchAdd(counter.numAllocations, 1ULL);
+	atomic::FetchAdd(counter.numBytes, (unsigned long long)bytes);
+}
+
+void Init() {
+	if (s_initialised)
+		return;
+	s_appThread = pthread_self();
+	pthread_key_create(&s_stateKey, HttpAllocStats_FreeState);
+	ResetTotals();
+	atomic::StoreRelease(s_initialised, true);
+}
+
+void Count(size_t bytes) {
+	if (!atomic::LoadAcquire(s_initialised))
+		return;
+	const Environment environment = pthread_equal(pthread_self(), s_appThread) ? ENV_APP : ENV_WORKER;
+	const ThreadState* p_state = HttpAllocStats_GetState();
+	const Site site = p_state ? p_state->site : SITE_OTHER;
+	HttpAllocStats_Add(s_totals[environment].sites[site], bytes);
+	if (p_state && p_state->pRequest)
+		HttpAllocStats_Add(p_state->pRequest->sites[site], bytes);
+}
+
+const Counters& GetTotals(Environment environment) {
+	return s_totals[environment];
+}
+
+void ResetTotals() {
+	for (int i = 0; i < NUM_ENVIRONMENTS; i++)
+		Reset(s_totals[i]);
+}
+
+void Reset(Counters& counters) {
+	for (int i = 0; i < NUM_SITES; i++) {
+		atomic::StoreRelaxed(counters.sites[i].numAllocations, 0ULL);
+		atomic::StoreRelaxed(counters.sites[i].numBytes, 0ULL);
+	}
+}
+
+void TraceTotals() {
+	static const char* const environment_names[NUM_ENVIRONMENTS] = { "app", "worker" };
+	for (int env = 0; env < NUM_ENVIRONMENTS; env++) {
+		const Counters& totals = s_totals[env];
+		s3eDebugTracePrintf("HttpAllocStats: %s: %llu allocations, %llu bytes", environment_names[env], totals.GetNumAllocations(), totals.GetNumBytes());
+		for (int site = 0; site < NUM_SITES; site++) {
+			const Counter& counter = totals.sites[site];
+			if (counter.numAllocations)
+				s3eDebugTracePrintf("HttpAllocStats:   %-8s %10llu allocations %12llu bytes", HTTP_ALLOC_STATS_SITE_NAMES[site], counter.numAllocations, counter.numBytes);
+		}
+	}
+}
+
+Scope::Scope(Site site, Counters* pRequest) : m_prevSite(SITE_OTHER), m_pPrevRequest(nullptr) {
+	if (!atomic::LoadAcquire(s_initialised))
+		return;
+	if (ThreadState* p_state = HttpAllocStats_GetState()) {
+		m_prevSite = p_state->site;
+		m_pPrevRequest = p_state->pRequest;
+		p_state->site = site;
+		if (pRequest)
+			p_state->pRequest = pRequest;
+	}
+}
+
+Scope::~Scope() {
+	if (!atomic::LoadAcquire(s_initialised))
+		return;
+	if (ThreadState* p_state = HttpAllocStats_GetState()) {
+		p_state->site = m_prevSite;
+		p_state->pRequest = m_pPrevRequest;
+	}
+}
+
+#endif
+
+} // End namespace
+
+#ifdef HTTP_ALLOC_STATS
+
+void* operator new(size_t size) {
+	HttpAllocStats::Count(size);
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) throw() {
+	HttpAllocStats::Count(size);
+	return malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t&) throw() {
+	return operator new(size, std::nothrow);
+}
+void operator delete(void* p) throw() { free(p); }
+void operator delete[](void* p) throw() { free(p); }
+void operator delete(void* p, const std::nothrow_t&) throw() { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) throw() { free(p); }
+
+#endif
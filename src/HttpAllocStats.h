@@ -0,0 +1,87 @@
+// HttpAllocStats:
+// Build-time instrumentation that counts heap allocations, for setting and
+// checking allocation budgets. Define HTTP_ALLOC_STATS (e.g. in the defines
+// of HttpUtils.mkb) to turn it on; without it, everything here compiles away.
+//
+// With it, every operator new (and the response buffers, which are malloc'ed)
+// is counted three ways:
+//  - by memory environment: the app thread (the s3e heap) or a worker / I/O
+//    thread (the system heap; see HttpClientWorker.h),
+//  - by site, i.e. which part of the request's life it happened in (see Site),
+//  - by request: see HttpRequest::GetAllocStats().
+// Allocations outside of any HttpClient code count as SITE_OTHER of their
+// environment. Only allocations are counted, not frees.
+// operator new is replaced with one that counts and then calls malloc(), so
+// each thread still allocates from its own environment's heap.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include "s3eTypes.h"
+
+namespace HttpAllocStats {
+
+enum Environment {
+	ENV_APP,
+	ENV_WORKER, // Worker and I/O threads
+	NUM_ENVIRONMENTS
+};
+
+enum Site {
+	SITE_OTHER,
+	SITE_REQUEST,  // Queueing and compiling a request, and setting curl up to send it (including the upload)
+	SITE_HEADERS,  // Parsing the response headers (see HttpHeaders)
+	SITE_BODY,     // Receiving the response body: the response buffer, the memory cache's copy etc.
+	SITE_JSON,     // Parsing JSON, on either thread (keys and string tokens, and the elements that are built)
+	SITE_FINISH,   // The worker finishing the transfer, and cleaning up after it
+	SITE_CALLBACK, // The app thread handling the response, including the request's callback
+	NUM_SITES
+};
+const char* GetSiteName(Site site);
+
+struct Counter {
+	volatile unsigned long long numAllocations;
+	volatile unsigned long long numBytes;
+	Counter() : numAllocations(0), numBytes(0) {}
+};
+struct Counters {
+	Counter sites[NUM_SITES];
+	unsigned long long GetNumAllocations() const; // In total
+	unsigned long long GetNumBytes() const;
+	void Add(const Counters& other); // e.g. a worker's counts for a request, to the request's own
+};
+
+#ifdef HTTP_ALLOC_STATS
+
+void Init(); // Called by HttpClient::GlobalInit(), on the app thread
+void Count(size_t bytes); // For allocations that don't go through operator new
+const Counters& GetTotals(Environment environment);
+void ResetTotals();
+void TraceTotals(); // s3eDebugTracePrintf() a table of the totals
+void Reset(Counters& counters);
+
+// While one of these is alive, this thread's allocations are counted against site, and also
+// against pRequest if it is set (otherwise, against the request of the enclosing Scope, if any).
+class Scope {
+public:
+	Scope(Site site, Counters* pRequest = nullptr);
+	~Scope();
+private:
+	Site m_prevSite;
+	Counters* m_pPrevRequest;
+};
+
+#endif
+
+} // End namespace
+
+#ifdef HTTP_ALLOC_STATS
+#define HTTP_ALLOC_SCOPE(site, pRequest) HttpAllocStats::Scope http_alloc_scope(HttpAllocStats::site, pRequest)
+#define HTTP_ALLOC_COUNT(bytes) HttpAllocStats::Count(bytes)
+#else
+#define HTTP_ALLOC_SCOPE(site, pRequest)
+#define HTTP_ALLOC_COUNT(bytes)
+#endif
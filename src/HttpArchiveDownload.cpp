@@ -0,0 +1,642 @@
+// HttpArchiveDownload:
+// Extracts a zip, tar or tar.gz archive as it downloads.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpArchiveDownload.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+#include "util/iohelpers.h"
+
+using std::string;
+
+// Zip record signatures:
+static const uLong ZIP_LOCAL_HEADER = 0x04034b50;
+static const uLong ZIP_CENTRAL_HEADER = 0x02014b50;
+static const uLong ZIP_END_OF_CENTRAL_DIR = 0x06054b50;
+static const uLong ZIP_DATA_DESCRIPTOR = 0x08074b50;
+
+static uint HttpArchive_Read16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uLong HttpArchive_Read32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uLong)p[3] << 24);
+}
+
+static size_t HttpArchive_Length(const unsigned char* p, size_t maxLength) {
+	size_t length = 0;
+	while (length < maxLength && p[length])
+		length++;
+	return length;
+}
+
+// A tar header's number: octal, or base-256 (a GNU extension, for sizes of 8 GB and up). -1 if it isn't one.
+static int64 HttpArchive_TarNumber(const unsigned char* p, size_t length) {
+	int64 value = 0;
+	if (p[0] & 0x80) {
+		if (p[0] & 0x40)
+			return -1; // Negative
+		value = p[0] & 0x3f;
+		for (size_t i = 1; i < length; i++)
+			value = (value << 8) | p[i];
+		return value;
+	}
+	size_t i = 0;
+	while (i < length && p[i] == ' ')
+		i++;
+	for (; i < length && p[i] && p[i] != ' '; i++) {
+		if (p[i] < '0' || p[i] > '7')
+			return -1;
+		value = value * 8 + (p[i] - '0');
+	}
+	return value;
+}
+
+HttpArchiveDownload::HttpArchiveDownload(const string& url, const string& destFolder, Format format) :
+	HttpRequest(GET, url.c_str()), m_destFolder(destFolder), m_format(format), m_stripComponents(0),
+	m_detected(format), m_state(TAR_HEADER), m_discardData(false), m_pError(nullptr), m_headerUsed(0), m_hasLongName(false), m_pEntryName(nullptr),
+	m_metaUsed(0), m_left(0), m_pad(0), m_metaIsPax(false), m_zipFlags(0), m_zipMethod(0), m_crcWanted(0), m_crc(0),
+	m_gzipInitialised(false), m_gzipEnded(false), m_entryInitialised(false), m_pOut(nullptr), m_pFile(nullptr), m_numFiles(0), m_bytesExtracted(0)
+{
+	memset(&m_gzip, 0, sizeof(m_gzip));
+	memset(&m_entry, 0, sizeof(m_entry));
+}
+
+HttpArchiveDownload::~HttpArchiveDownload() {
+	// Worker_HandleDone() must have been called from the worker thread:
+	IwAssert(HTTP_CLIENT, m_pOut == nullptr && m_pFile == nullptr && !m_gzipInitialised && !m_entryInitialised);
+}
+
+void HttpArchiveDownload::HandleResponse(bool success, int httpStatusCode) {
+	if (m_pError)
+		s3eDebugTracePrintf("HttpArchiveDownload: Unable to extract %s to %s: %s", m_url.c_str(), m_destFolder.c_str(), m_pError);
+	HttpRequest::HandleResponse(success && !m_discardData && !m_pError, httpStatusCode);
+}
+
+void HttpArchiveDownload::HandleRequeue() {
+	m_pError = nullptr;
+	m_numFiles = 0;
+	m_bytesExtracted = 0;
+	HttpRequest::HandleRequeue();
+}
+
+void HttpArchiveDownload::Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+	m_discardData = httpStatusCode / 100 != 2;
+	m_detected = m_format;
+	m_state = m_format == ARCHIVE_ZIP ? ZIP_HEADER : TAR_HEADER;
+	m_headerUsed = 0;
+	m_hasLongName = false;
+	m_pEntryName = nullptr;
+	m_pError = nullptr;
+	m_gzipEnded = false;
+	m_numFiles = 0;
+	m_bytesExtracted = 0;
+}
+
+size_t HttpArchiveDownload::Worker_HandleData(const unsigned char* contents, size_t size) {
+	if (m_discardData)
+		return size;
+	if (m_pError || !Worker_Feed(contents, size))
+		return 0; // Abort the transfer
+	return size;
+}
+
+void HttpArchiveDownload::Worker_HandleDone(bool success, int httpStatusCode) {
+	if (success && !m_discardData && !m_pError && !Worker_IsComplete())
+		Worker_Fail("The archive ends early");
+	Worker_Free();
+	HttpRequest::Worker_HandleDone(success && !m_pError, httpStatusCode);
+}
+
+bool HttpArchiveDownload::Worker_Feed(const unsigned char* pData, size_t size) {
+	if (m_detected == ARCHIVE_AUTO) {
+		// Tell the format from the first 4 bytes:
+		if (!Worker_Collect(pData, size, 4))
+			return true;
+		unsigned char first[4];
+		memcpy(first, m_header, sizeof(first));
+		m_headerUsed = 0;
+		const uLong signature = HttpArchive_Read32(first);
+		if (signature == ZIP_LOCAL_HEADER || signature == ZIP_END_OF_CENTRAL_DIR)
+			m_detected = ARCHIVE_ZIP;
+		else if ((first[0] == 0x1f && first[1] == 0x8b) || ((first[0] & 0x0f) == Z_DEFLATED && ((first[0] << 8) | first[1]) % 31 == 0))
+			m_detected = ARCHIVE_TAR_GZ; // A gzip or zlib header
+		else
+			m_detected = ARCHIVE_TAR; // (Which has no magic number this early)
+		m_state = m_detected == ARCHIVE_ZIP ? ZIP_HEADER : TAR_HEADER;
+		if (!Worker_Feed(first, sizeof(first)))
+			return false;
+	}
+	if (m_detected == ARCHIVE_ZIP)
+		return Worker_Zip(pData, size);
+	if (m_detected == ARCHIVE_TAR_GZ)
+		return Worker_Inflate(pData, size);
+	return Worker_Tar(pData, size);
+}
+
+bool HttpArchiveDownload::Worker_Collect(const unsigned char*& pData, size_t& size, size_t wanted) {
+	const size_t n = wanted - m_headerUsed < size ? wanted - m_headerUsed : size;
+	memcpy(m_header + m_headerUsed, pData, n);
+	m_headerUsed += n;
+	pData += n;
+	size -= n;
+	return m_headerUsed == wanted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// tar.gz
+
+bool HttpArchiveDownload::Worker_Inflate(const unsigned char* pData, size_t size) {
+	if (m_state == TAR_END)
+		return true; // What follows the end of the archive doesn't matter
+	if (!m_gzipInitialised) {
+		// windowBits 15 + 32 reads either a gzip or a zlib header:
+		if (inflateInit2(&m_gzip, 15 + 32) != Z_OK)
+			return Worker_Fail("Unable to initialise zlib");
+		m_gzipInitialised = true;
+	}
+	if (!m_pOut && !(m_pOut = static_cast<unsigned char*>(malloc(OUT_BUFFER_SIZE))))
+		return Worker_Fail("Out of memory");
+	m_gzip.next_in = const_cast<Bytef*>(pData);
+	m_gzip.avail_in = (uInt)size;
+	for (;;) {
+		if (m_gzipEnded) {
+			if (!m_gzip.avail_in)
+				return true;
+			inflateReset(&m_gzip); // The next member of a multi-member gzip file
+			m_gzipEnded = false;
+		}
+		m_gzip.next_out = m_pOut;
+		m_gzip.avail_out = OUT_BUFFER_SIZE;
+		const int result = inflate(&m_gzip, Z_NO_FLUSH);
+		if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+			return Worker_Fail("The archive isn't valid gzip");
+		const size_t out = OUT_BUFFER_SIZE - m_gzip.avail_out;
+		if (out && !Worker_Tar(m_pOut, out))
+			return false;
+		if (m_state == TAR_END)
+			return true;
+		if (result == Z_STREAM_END)
+			m_gzipEnded = true;
+		else if (m_gzip.avail_out)
+			return true; // It has taken all of the input
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// tar
+
+bool HttpArchiveDownload::Worker_Tar(const unsigned char* pData, size_t size) {
+	while (size) {
+		const size_t n = m_left < (int64)size ? (size_t)m_left : size; // For the states with data
+		switch (m_state) {
+		case TAR_HEADER:
+			if (!Worker_Collect(pData, size, 512))
+				return true;
+			m_headerUsed = 0;
+			if (!Worker_TarHeader())
+				return false;
+			break;
+		case TAR_META:
+			if (m_metaUsed + n > MAX_META)
+				return Worker_Fail("A tar header is too long");
+			memcpy(m_meta + m_metaUsed, pData, n);
+			m_metaUsed += n;
+			pData += n;
+			size -= n;
+			m_left -= n;
+			if (!m_left) {
+				if (!Worker_TarMeta())
+					return false;
+				m_left = m_pad;
+				m_state = m_pad ? TAR_SKIP : TAR_HEADER;
+			}
+			break;
+		case TAR_DATA:
+			if (!Worker_Write(pData, n))
+				return false;
+			pData += n;
+			size -= n;
+			m_left -= n;
+			if (!m_left) {
+				Worker_EndEntry();
+				m_left = m_pad;
+				m_state = m_pad ? TAR_SKIP : TAR_HEADER;
+			}
+			break;
+		case TAR_SKIP:
+			pData += n;
+			size -= n;
+			m_left -= n;
+			if (!m_left)
+				m_state = TAR_HEADER;
+			break;
+		default:
+			return true; // TAR_END: the rest is padding
+		}
+	}
+	return true;
+}
+
+bool HttpArchiveDownload::Worker_TarHeader() {
+	const unsigned char* p_header = m_header;
+	// Two blocks of zeroes end the archive (one is enough for us):
+	size_t i = 0;
+	while (i < 512 && !p_header[i])
+		i++;
+	if (i == 512) {
+		m_state = TAR_END;
+		return true;
+	}
+	// The checksum is of the header with its own field as spaces:
+	int64 checksum = 0;
+	for (i = 0; i < 512; i++)
+		checksum += i >= 148 && i < 156 ? ' ' : p_header[i];
+	const int64 size = HttpArchive_TarNumber(p_header + 124, 12);
+	if (HttpArchive_TarNumber(p_header + 148, 8) != checksum || size < 0)
+		return Worker_Fail("The archive isn't a valid tar");
+	m_left = size;
+	m_pad = (size_t)((512 - size % 512) % 512);
+	const unsigned char type = p_header[156];
+	if (type == 'L' || type == 'x') {
+		// A GNU long name, or pax extended header, for the next entry:
+		m_metaIsPax = type == 'x';
+		m_metaUsed = 0;
+		m_state = TAR_META;
+		if (!m_left) {
+			m_left = m_pad;
+			m_state = TAR_HEADER;
+		}
+		return true;
+	}
+	if (!m_hasLongName) {
+		// ustar keeps the start of a long name in the prefix field:
+		size_t length = 0;
+		if (memcmp(p_header + 257, "ustar", 5) == 0 && p_header[345]) {
+			length = HttpArchive_Length(p_header + 345, 155);
+			memcpy(m_name, p_header + 345, length);
+			m_name[length++] = '/';
+		}
+		const size_t name_length = HttpArchive_Length(p_header, 100);
+		memcpy(m_name + length, p_header, name_length);
+		m_name[length + name_length] = 0;
+	}
+	m_hasLongName = false;
+	const bool is_file = type == '0' || type == 0 || type == '7'; // (7 is a contiguous file)
+	const bool is_dir = type == '5';
+	if ((is_file || is_dir) && !Worker_BeginEntry(is_dir))
+		return false;
+	if (is_file) {
+		m_state = TAR_DATA;
+		if (!m_left) {
+			Worker_EndEntry();
+			m_state = TAR_HEADER;
+		}
+	} else {
+		// A folder, or a link, device etc. that we don't extract: skip its data (if it has any) and padding
+		m_left += m_pad;
+		m_state = m_left ? TAR_SKIP : TAR_HEADER;
+	}
+	return true;
+}
+
+bool HttpArchiveDownload::Worker_TarMeta() {
+	const char* p_name = nullptr;
+	size_t length = 0;
+	if (!m_metaIsPax) {
+		p_name = m_meta;
+		length = HttpArchive_Length(reinterpret_cast<const unsigned char*>(m_meta), m_metaUsed);
+	} else {
+		// Records of "<length> <key>=<value>\n", of which we only want the path:
+		size_t pos = 0;
+		while (pos < m_metaUsed) {
+			size_t record_length = 0;
+			size_t i = pos;
+			while (i < m_metaUsed && m_meta[i] >= '0' && m_meta[i] <= '9')
+				record_length = record_length * 10 + (m_meta[i++] - '0');
+			if (!record_length || pos + record_length > m_metaUsed || i >= m_metaUsed || m_meta[i] != ' ')
+				break; // Malformed: make do with the ustar header
+			const char* p_key = m_meta + i + 1;
+			const char* p_end = m_meta + pos + record_length - 1; // The '\n'
+			if (p_end - p_key > 5 && memcmp(p_key, "path=", 5) == 0) {
+				p_name = p_key + 5;
+				length = p_end - p_name;
+			}
+			pos += record_length;
+		}
+		if (!p_name)
+			return true;
+	}
+	if (length >= MAX_NAME)
+		return Worker_Fail("A name in the archive is too long");
+	memcpy(m_name, p_name, length);
+	m_name[length] = 0;
+	m_hasLongName = true;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// zip
+
+bool HttpArchiveDownload::Worker_Zip(const unsigned char* pData, size_t size) {
+	while (size) {
+		const size_t n = m_left < (int64)size ? (size_t)m_left : size; // For the states with data
+		switch (m_state) {
+		case ZIP_HEADER:
+			if (m_headerUsed < 4) {
+				if (!Worker_Collect(pData, size, 4))
+					return true;
+				const uLong signature = HttpArchive_Read32(m_header);
+				if (signature == ZIP_CENTRAL_HEADER || signature == ZIP_END_OF_CENTRAL_DIR) {
+					m_state = ZIP_END; // Every entry has been extracted
+					return true;
+				}
+				if (signature != ZIP_LOCAL_HEADER)
+					return Worker_Fail("The archive isn't a valid zip");
+			}
+			if (!Worker_Collect(pData, size, 30))
+				return true;
+			m_headerUsed = 0;
+			if (!Worker_ZipHeader())
+				return false;
+			break;
+		case ZIP_NAME:
+			memcpy(m_name + m_metaUsed, pData, n);
+			m_metaUsed += n;
+			pData += n;
+			size -= n;
+			m_left -= n;
+			if (!m_left) {
+				m_name[m_metaUsed] = 0;
+				m_left = HttpArchive_Read16(m_header + 28); // The extra field, which we skip
+				m_state = ZIP_EXTRA;
+				if (!m_left && !Worker_ZipBeginData())
+					return false;
+			}
+			break;
+		case ZIP_EXTRA:
+			pData += n;
+			size -= n;
+			m_left -= n;
+			if (!m_left && !Worker_ZipBeginData())
+				return false;
+			break;
+		case ZIP_DATA:
+			if (m_zipMethod == Z_DEFLATED) {
+				size_t consumed;
+				bool ended;
+				if (!Worker_ZipInflate(pData, size, &consumed, &ended))
+					return false;
+				pData += consumed;
+				size -= consumed;
+				if (ended && !Worker_ZipDataEnd())
+					return false;
+			} else {
+				m_crc = crc32(m_crc, pData, (uInt)n);
+				if (!Worker_Write(pData, n))
+					return false;
+				pData += n;
+				size -= n;
+				m_left -= n;
+				if (!m_left && !Worker_ZipDataEnd())
+					return false;
+			}
+			break;
+		case ZIP_DESCRIPTOR: {
+			// The CRC-32 and sizes, optionally after a signature:
+			if (m_headerUsed < 4 && !Worker_Collect(pData, size, 4))
+				return true;
+			const size_t wanted = HttpArchive_Read32(m_header) == ZIP_DATA_DESCRIPTOR ? 16 : 12;
+			if (!Worker_Collect(pData, size, wanted))
+				return true;
+			m_headerUsed = 0;
+			m_crcWanted = HttpArchive_Read32(m_header + wanted - 12);
+			if (!Worker_ZipFinish())
+				return false;
+			break;
+		}
+		default:
+			return true; // ZIP_END: the central directory, which tells us nothing that the local headers didn't
+		}
+	}
+	return true;
+}
+
+bool HttpArchiveDownload::Worker_ZipHeader() {
+	m_zipFlags = HttpArchive_Read16(m_header + 6);
+	m_zipMethod = HttpArchive_Read16(m_header + 8);
+	m_crcWanted = HttpArchive_Read32(m_header + 14);
+	const uLong compressed_size = HttpArchive_Read32(m_header + 18);
+	const uLong size = HttpArchive_Read32(m_header + 22);
+	const uint name_length = HttpArchive_Read16(m_header + 26);
+	if (m_zipFlags & 1)
+		return Worker_Fail("Encrypted zips aren't supported");
+	if (m_zipMethod != 0 && m_zipMethod != Z_DEFLATED)
+		return Worker_Fail("A file in the zip is compressed with a method that isn't supported");
+	if (compressed_size == 0xffffffff || size == 0xffffffff)
+		return Worker_Fail("Zip64 isn't supported");
+	if ((m_zipFlags & 8) && m_zipMethod == 0)
+		return Worker_Fail("A file in the zip is stored without its size"); // There'd be no telling where it ends
+	if (!name_length || name_length >= MAX_NAME)
+		return Worker_Fail("A name in the archive is empty, or too long");
+	m_metaUsed = 0;
+	m_left = name_length;
+	m_state = ZIP_NAME;
+	return true;
+}
+
+bool HttpArchiveDownload::Worker_ZipBeginData() {
+	const size_t length = strlen(m_name);
+	const bool is_dir = m_name[length - 1] == '/';
+	if (!Worker_BeginEntry(is_dir))
+		return false;
+	m_crc = crc32(0, Z_NULL, 0);
+	m_state = ZIP_DATA;
+	if (m_zipMethod == Z_DEFLATED) {
+		// A raw deflate stream (negative windowBits), which ends itself:
+		if (!m_entryInitialised) {
+			if (inflateInit2(&m_entry, -MAX_WBITS) != Z_OK) {
+				Worker_AbandonEntry();
+				return Worker_Fail("Unable to initialise zlib");
+			}
+			m_entryInitialised = true;
+		} else {
+			inflateReset(&m_entry);
+		}
+		return true;
+	}
+	m_left = HttpArchive_Read32(m_header + 18); // (The local header is still there)
+	return m_left || Worker_ZipDataEnd();
+}
+
+bool HttpArchiveDownload::Worker_ZipInflate(const unsigned char* pData, size_t size, size_t* pConsumed, bool* pEnded) {
+	if (!m_pOut && !(m_pOut = static_cast<unsigned char*>(malloc(OUT_BUFFER_SIZE)))) {
+		Worker_AbandonEntry();
+		return Worker_Fail("Out of memory");
+	}
+	m_entry.next_in = const_cast<Bytef*>(pData);
+	m_entry.avail_in = (uInt)size;
+	*pEnded = false;
+	for (;;) {
+		m_entry.next_out = m_pOut;
+		m_entry.avail_out = OUT_BUFFER_SIZE;
+		const int result = inflate(&m_entry, Z_NO_FLUSH);
+		if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+			Worker_AbandonEntry();
+			return Worker_Fail("A file in the archive is corrupt");
+		}
+		const size_t out = OUT_BUFFER_SIZE - m_entry.avail_out;
+		if (out) {
+			m_crc = crc32(m_crc, m_pOut, (uInt)out);
+			if (!Worker_Write(m_pOut, out))
+				return false;
+		}
+		if (result == Z_STREAM_END) {
+			*pEnded = true; // What's left of the input is the next record
+			break;
+		}
+		if (m_entry.avail_out)
+			break; // It has taken all of the input
+	}
+	*pConsumed = size - m_entry.avail_in;
+	return true;
+}
+
+bool HttpArchiveDownload::Worker_ZipDataEnd() {
+	if (m_zipFlags & 8) {
+		// The CRC-32 follows the data
+		m_headerUsed = 0;
+		m_state = ZIP_DESCRIPTOR;
+		return true;
+	}
+	return Worker_ZipFinish();
+}
+
+bool HttpArchiveDownload::Worker_ZipFinish() {
+	if (m_crc != m_crcWanted) {
+		Worker_AbandonEntry();
+		return Worker_Fail("A file in the archive is corrupt");
+	}
+	Worker_EndEntry();
+	m_state = ZIP_HEADER;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Entries
+
+bool HttpArchiveDownload::Worker_BeginEntry(bool isDir) {
+	m_pEntryName = nullptr;
+	const char* p_name = m_name;
+	while (p_name[0] == '.' && p_name[1] == '/')
+		p_name += 2;
+	for (uint i = 0; i < m_stripComponents; i++) {
+		const char* p_slash = strchr(p_name, '/');
+		if (!p_slash)
+			return true; // Skipped
+		p_name = p_slash + 1;
+	}
+	if (!*p_name)
+		return true; // (A folder that was stripped)
+	// Nothing may be written outside the folder ("zip slip"):
+	bool safe = *p_name != '/' && !strchr(p_name, '\\') && !strchr(p_name, ':');
+	for (const char* p = p_name; safe && *p; ) {
+		const char* p_slash = strchr(p, '/');
+		const size_t length = p_slash ? p_slash - p : strlen(p);
+		safe = !(length == 2 && p[0] == '.' && p[1] == '.');
+		p += p_slash ? length + 1 : length;
+	}
+	if (!safe) {
+		s3eDebugTracePrintf("HttpArchiveDownload: %s isn't a safe name to extract", m_name);
+		return Worker_Fail("A name in the archive is outside its folder");
+	}
+	m_pEntryName = p_name;
+	const string path = Worker_GetPath();
+	// (MakePath() remembers the folders it has made, so this only costs stats for the first entry in each)
+	try {
+		MakePath(isDir ? path : DirName(path));
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpArchiveDownload: %s", e.what());
+		m_pEntryName = nullptr;
+		return Worker_Fail("Unable to make a folder");
+	}
+	if (!isDir) {
+		m_pFile = s3eFileOpen(path.c_str(), "w");
+		if (!m_pFile) {
+			s3eDebugTracePrintf("HttpArchiveDownload: Unable to write %s", path.c_str());
+			m_pEntryName = nullptr;
+			return Worker_Fail("Unable to write a file");
+		}
+	}
+	return true;
+}
+
+bool HttpArchiveDownload::Worker_Write(const unsigned char* pData, size_t size) {
+	if (!m_pFile || !size)
+		return true; // Not extracted
+	if (s3eFileWrite(pData, 1, size, m_pFile) != size) {
+		s3eDebugTracePrintf("HttpArchiveDownload: Unable to write %s", Worker_GetPath().c_str());
+		Worker_AbandonEntry();
+		return Worker_Fail("Unable to write a file");
+	}
+	m_bytesExtracted += size;
+	return true;
+}
+
+void HttpArchiveDownload::Worker_EndEntry() {
+	if (m_pFile) {
+		s3eFileClose(m_pFile);
+		m_pFile = nullptr;
+		m_numFiles++;
+	}
+	m_pEntryName = nullptr;
+}
+
+void HttpArchiveDownload::Worker_AbandonEntry() {
+	if (m_pFile) {
+		s3eFileClose(m_pFile);
+		m_pFile = nullptr;
+		s3eFileDelete(Worker_GetPath().c_str()); // It's only part of the file
+	}
+	m_pEntryName = nullptr;
+}
+
+string HttpArchiveDownload::Worker_GetPath() const {
+	if (!m_pEntryName)
+		return string();
+	string path(m_destFolder);
+	if (!path.empty() && path[path.size() - 1] != '/')
+		path += '/';
+	path += m_pEntryName;
+	if (path[path.size() - 1] == '/')
+		path.erase(path.size() - 1); // A folder
+	return path;
+}
+
+bool HttpArchiveDownload::Worker_IsComplete() const {
+	if (m_detected == ARCHIVE_ZIP)
+		return m_state == ZIP_END;
+	if (m_detected == ARCHIVE_AUTO || (m_detected == ARCHIVE_TAR_GZ && m_state != TAR_END && !m_gzipEnded))
+		return false;
+	// (A tar may end without its blocks of zeroes, as long as it ends between entries)
+	return m_state == TAR_END || (m_state == TAR_HEADER && m_headerUsed == 0);
+}
+
+void HttpArchiveDownload::Worker_Free() {
+	Worker_AbandonEntry();
+	if (m_gzipInitialised) {
+		inflateEnd(&m_gzip);
+		m_gzipInitialised = false;
+	}
+	if (m_entryInitialised) {
+		inflateEnd(&m_entry);
+		m_entryInitialised = false;
+	}
+	free(m_pOut);
+	m_pOut = nullptr;
+}
@@ -0,0 +1,139 @@
+// HttpArchiveDownload:
+// Downloads a zip, tar or tar.gz archive (e.g. a pack of assets) and extracts
+// its files into a folder as the data arrives, rather than saving the archive
+// and unpacking it in a second pass once it is all in: unpacking overlaps with
+// the network, and the archive itself never touches the disk.
+// The worker feeds each chunk of the response through zlib (the one curl is
+// linked with): a tar.gz is inflated as one stream and its tar records parsed
+// from the output, while a zip's entries are inflated one by one, each
+// checked against its CRC-32. Entries are written to
+// "<destFolder>/<name in the archive>", making folders as needed; files
+// already there are overwritten. Only files and folders are extracted (not
+// links or devices), and an entry whose name is absolute or has a ".."
+// component fails the whole request rather than being written outside
+// destFolder.
+// The format is told from the first bytes of the response, unless given.
+// Zips are read front to back from their local headers, so one made by a
+// streaming zipper (sizes in data descriptors) is fine as long as its entries
+// are deflated; zip64 and encrypted zips aren't supported.
+// If the transfer or the archive fails part way through, the entry being
+// written is deleted, but those already extracted are left in place. A retry
+// extracts the archive again from the first entry.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <zlib.h>
+
+#include "HttpRequest.h"
+
+class HttpArchiveDownload : public HttpRequest {
+public:
+	enum Format {
+		ARCHIVE_AUTO, // From the first bytes of the response
+		ARCHIVE_ZIP,
+		ARCHIVE_TAR,
+		ARCHIVE_TAR_GZ // (Or any tar in a gzip or zlib stream)
+	};
+	// destFolder (and the folders in the archive) are made by the worker, as the entries arrive.
+	HttpArchiveDownload(const std::string& url, const std::string& destFolder, Format format = ARCHIVE_AUTO);
+	~HttpArchiveDownload();
+
+	// Leave out the first numComponents folders of each entry's name, e.g. 1 to extract "pack-1.2/images/a.png"
+	// as "<destFolder>/images/a.png". Entries with no more than that in their names are skipped.
+	HttpArchiveDownload& SetStripComponents(uint numComponents) { m_stripComponents = numComponents; return *this; }
+	const std::string& GetDestFolder() const { return m_destFolder; }
+	// Once the request is DONE (or has failed): what was extracted, and why it failed, if the archive was at fault
+	uint GetNumFiles() const { return m_numFiles; }
+	int64 GetBytesExtracted() const { return m_bytesExtracted; }
+	const char* GetArchiveError() const { return m_pError; } // nullptr if none
+
+	virtual std::string GetMemoryCacheKey() const { return std::string(); } // The body isn't kept
+	virtual size_t EstimateMemory(int64 contentLength) const { return HttpRequest::EstimateMemory(0) + OUT_BUFFER_SIZE + 2 * INFLATE_STATE_SIZE; }
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void HandleRequeue();
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode);
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
+	virtual void Worker_HandleDone(bool success, int httpStatusCode);
+
+private:
+	enum {
+		OUT_BUFFER_SIZE = 64 * 1024, // Inflated data, on its way to the file
+		INFLATE_STATE_SIZE = 44 * 1024, // Roughly what zlib allocates for each stream
+		MAX_NAME = 1024,
+		MAX_META = 4 * 1024 // A tar's GNU long name or pax header
+	};
+	enum State {
+		// Tar records:
+		TAR_HEADER,
+		TAR_META, // The data of a long name or pax header, for the next entry
+		TAR_DATA,
+		TAR_SKIP, // Padding, or an entry that isn't extracted
+		TAR_END,
+		// Zip entries:
+		ZIP_HEADER,
+		ZIP_NAME,
+		ZIP_EXTRA,
+		ZIP_DATA,
+		ZIP_DESCRIPTOR,
+		ZIP_END
+	};
+	const std::string m_destFolder;
+	const Format m_format;
+	uint m_stripComponents;
+	// Managed by the worker thread, for each attempt:
+	Format m_detected; // ARCHIVE_AUTO until enough of the response has arrived to tell
+	State m_state;
+	bool m_discardData; // The response is an error page
+	const char* m_pError; // A string literal, if the archive couldn't be extracted
+	unsigned char m_header[512]; // Collected until it's whole: a tar header, a zip local header or data descriptor,
+	size_t m_headerUsed; // or the response's first bytes, to tell the format from
+	char m_name[MAX_NAME]; // The entry's name, or a tar's long name for the next entry
+	bool m_hasLongName;
+	const char* m_pEntryName; // Within m_name, less the stripped folders: nullptr if the entry isn't extracted
+	char m_meta[MAX_META];
+	size_t m_metaUsed;
+	int64 m_left; // In the state's data (or header, for ZIP_NAME and ZIP_DESCRIPTOR)
+	size_t m_pad; // A tar entry's padding, after its data
+	bool m_metaIsPax;
+	// The zip entry:
+	uint m_zipFlags;
+	uint m_zipMethod;
+	uLong m_crcWanted;
+	uLong m_crc;
+	// zlib, with memory allocated by the worker thread:
+	z_stream m_gzip; // The outer stream of a tar.gz
+	bool m_gzipInitialised;
+	bool m_gzipEnded;
+	z_stream m_entry; // A zip entry
+	bool m_entryInitialised;
+	unsigned char* m_pOut;
+	s3eFile* m_pFile; // The entry being written, if it is extracted
+	// Totals, from the worker:
+	uint m_numFiles;
+	int64 m_bytesExtracted;
+
+	bool Worker_Fail(const char* pError) { if (!m_pError) m_pError = pError; return false; }
+	bool Worker_Feed(const unsigned char* pData, size_t size);
+	bool Worker_Inflate(const unsigned char* pData, size_t size);
+	bool Worker_Tar(const unsigned char* pData, size_t size);
+	bool Worker_TarHeader();
+	bool Worker_TarMeta();
+	bool Worker_Zip(const unsigned char* pData, size_t size);
+	bool Worker_ZipHeader();
+	bool Worker_ZipBeginData();
+	bool Worker_ZipInflate(const unsigned char* pData, size_t size, size_t* pConsumed, bool* pEnded);
+	bool Worker_ZipDataEnd();
+	bool Worker_ZipFinish(); // Once the CRC-32 it should have is known
+	bool Worker_Collect(const unsigned char*& pData, size_t& size, size_t wanted); // Into m_header; true once it has wanted bytes
+	bool Worker_BeginEntry(bool isDir);
+	bool Worker_Write(const unsigned char* pData, size_t size);
+	void Worker_EndEntry();
+	void Worker_AbandonEntry();
+	std::string Worker_GetPath() const; // The entry's destination, or empty if it isn't extracted
+	bool Worker_IsComplete() const;
+	void Worker_Free();
+};
@@ -0,0 +1,297 @@
+// HttpAssetSync:
+// Keeps a folder of content files in step with a manifest, downloading only
+// what has changed.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpAssetSync.h"
+
+#include <ctype.h>
+#include <stdexcept>
+
+#include "HttpClient.h"
+#include "HttpDownloader.h"
+#include "util/iohelpers.h"
+#include "util/json.h"
+
+using std::string;
+
+static const char* HttpAssetSync_HashName(HttpDigest::Type type) {
+	return type == HttpDigest::DIGEST_SHA256 ? "sha256" : type == HttpDigest::DIGEST_MD5 ? "md5" : nullptr;
+}
+
+static int64 HttpAssetSync_FileSize(const string& path) {
+	return IsFile(path) ? s3eFileGetFileInt(path.c_str(), S3E_FILE_SIZE) : -1;
+}
+
+// The index files are manifests too (with the URLs that the files came from):
+static string HttpAssetSync_ToJson(const std::map<string, HttpAssetSync::Asset>& index, bool deleteRemoved) {
+	json::Array files;
+	for (auto it = index.begin(); it != index.end(); it++) {
+		const HttpAssetSync::Asset& asset = it->second;
+		json::Object file;
+		file["path"] = json::String(asset.path);
+		file["url"] = json::String(asset.url);
+		if (asset.size >= 0)
+			file["size"] = json::Number::FromInteger(asset.size);
+		if (const char* p_hash_name = HttpAssetSync_HashName(asset.hashType))
+			file[p_hash_name] = json::String(asset.hash);
+		files.Insert(std::move(file));
+	}
+	json::Object root;
+	root["files"] = std::move(files);
+	root["deleteRemoved"] = json::Boolean(deleteRemoved); // (For finishing an interrupted commit)
+	string data;
+	data.resize(json::BufferWriter::MeasureSize(root));
+	json::BufferWriter::Write(root, &data[0]);
+	return data;
+}
+
+static bool HttpAssetSync_WriteFile(const string& path, const string& data) {
+	s3eFile* p_file = s3eFileOpen(path.c_str(), "wb");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpAssetSync: Unable to write %s", path.c_str());
+		return false;
+	}
+	const bool written = s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	s3eFileClose(p_file);
+	return written;
+}
+
+static std::map<string, HttpAssetSync::Asset> HttpAssetSync_LoadIndex(const string& path, bool* pDeleteRemoved = nullptr) {
+	std::map<string, HttpAssetSync::Asset> index;
+	const FileData data(path.c_str());
+	const HttpAssetSync::Manifest files = HttpAssetSync::ParseManifest(data.Data(), data.Size());
+	for (auto it = files.begin(); it != files.end(); it++)
+		index[it->path] = *it;
+	if (pDeleteRemoved) {
+		json::Object root;
+		json::Reader::Read(root, data.Data(), data.Size());
+		*pDeleteRemoved = root.GetOrDefault("deleteRemoved", true);
+	}
+	return index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+HttpAssetSync::HttpAssetSync(HttpDownloader& downloader, const string& rootFolder) :
+	m_downloader(downloader), m_rootFolder(rootFolder.empty() || rootFolder[rootFolder.size() - 1] == '/' ? rootFolder : rootFolder + "/"),
+	m_deleteRemoved(true), m_state(SYNC_IDLE)
+{
+	const string index_path = GetSyncFolder() + "index";
+	try {
+		if (IsFile(index_path + ".new")) {
+			// The app stopped part way through a commit: finish it
+			bool delete_removed = true;
+			const Index index = HttpAssetSync_LoadIndex(index_path + ".new", &delete_removed);
+			if (IsFile(index_path))
+				m_index = HttpAssetSync_LoadIndex(index_path);
+			CompleteCommit(index, delete_removed);
+		} else if (IsFile(index_path)) {
+			m_index = HttpAssetSync_LoadIndex(index_path);
+		}
+	} catch (const std::exception& e) {
+		// Without an index, everything is fetched again (but files that are still staged needn't be)
+		s3eDebugTracePrintf("HttpAssetSync: Ignoring damaged index in %s (%s)", m_rootFolder.c_str(), e.what());
+		m_index.clear();
+	}
+}
+
+HttpAssetSync::~HttpAssetSync() {
+	Cancel();
+}
+
+HttpAssetSync::Manifest HttpAssetSync::ParseManifest(const char* pJson, size_t size) {
+	json::Object root;
+	json::Reader::Read(root, pJson, size);
+	const string base_url = root.GetOrDefault("baseUrl", string());
+	const json::Array& files = root["files"];
+	Manifest manifest;
+	manifest.reserve(files.Size());
+	for (json::Array::const_iterator it = files.Begin(); it != files.End(); it++) {
+		const json::Object& file = *it;
+		Asset asset;
+		asset.path = file.GetOrDefault("path", string());
+		asset.url = file.GetOrDefault("url", string());
+		if (asset.url.empty() && !base_url.empty())
+			asset.url = base_url + asset.path;
+		if (asset.path.empty() || asset.url.empty())
+			throw std::runtime_error("manifest has a file without a path or url");
+		asset.size = file.GetOrDefault("size", -1LL);
+		if (file.HasKey("sha256")) {
+			asset.hashType = HttpDigest::DIGEST_SHA256;
+			asset.hash = file.GetOrDefault("sha256", string());
+		} else if (file.HasKey("md5")) {
+			asset.hashType = HttpDigest::DIGEST_MD5;
+			asset.hash = file.GetOrDefault("md5", string());
+		}
+		for (size_t i = 0; i < asset.hash.size(); i++)
+			asset.hash[i] = (char)tolower((unsigned char)asset.hash[i]);
+		manifest.push_back(std::move(asset));
+	}
+	return manifest;
+}
+
+void HttpAssetSync::Sync(const Manifest& manifest, HttpRequest::Priority priority) {
+	Cancel();
+	m_target.clear();
+	m_progress = Progress();
+	m_state = SYNC_RUNNING;
+	std::vector< Ptr<HttpRequest> > requests;
+	for (auto it = manifest.begin(); it != manifest.end(); it++) {
+		const Asset& asset = *it;
+		if (!IsSafePath(asset.path)) {
+			s3eDebugTracePrintf("HttpAssetSync: Skipping %s, which is outside the folder", asset.path.c_str());
+			continue;
+		}
+		if (!m_target.insert(std::make_pair(asset.path, asset)).second)
+			continue; // Listed twice
+		// Up to date if the index says it's the same file, and it's still there (one stat):
+		const Index::const_iterator it_installed = m_index.find(asset.path);
+		const int64 installed_size = HttpAssetSync_FileSize(GetPath(asset.path));
+		if (it_installed != m_index.end() && it_installed->second.hashType == asset.hashType && it_installed->second.hash == asset.hash
+			&& it_installed->second.size == asset.size && installed_size >= 0 && (asset.size < 0 || installed_size == asset.size))
+			continue;
+		m_progress.numFiles++;
+		if (asset.size > 0)
+			m_progress.bytesTotal += asset.size;
+		// A download only stages a file once its hash has been checked, so one staged by an earlier sync will do:
+		const string staged_path = GetStagedPath(asset);
+		if (!asset.hash.empty() && asset.size >= 0 && HttpAssetSync_FileSize(staged_path) == asset.size) {
+			m_progress.numDone++;
+			m_progress.bytesDone += asset.size;
+			continue;
+		}
+		HttpDownload* p_download = new HttpDownload(asset.url, staged_path);
+		Ptr<HttpRequest> p_request = p_download;
+		p_download->SetResumable(true);
+		if (!asset.hash.empty()) {
+			try {
+				p_download->SetExpectedDigest(asset.hashType, asset.hash);
+			} catch (const std::exception& e) {
+				s3eDebugTracePrintf("HttpAssetSync: Downloading %s without checking it (%s)", asset.path.c_str(), e.what());
+			}
+		}
+		if (asset.size > 0)
+			p_download->SetExpectedSize((size_t)asset.size);
+		requests.push_back(p_request);
+	}
+	if (requests.empty()) {
+		Finish(true); // Everything is there already, or staged
+		return;
+	}
+	m_pGroup = new HttpRequestGroup(new HttpCallback<HttpAssetSync>(this, &HttpAssetSync::HandleFileDone), new HttpGroupCallback<HttpAssetSync>(this, &HttpAssetSync::HandleGroupDone));
+	m_pGroup->SetPriority(priority);
+	m_downloader.QueueRequests(requests, m_pGroup);
+}
+
+void HttpAssetSync::Cancel() {
+	if (Ptr<HttpRequestGroup> p_group = m_pGroup) {
+		m_pGroup = nullptr; // (So that its done callback, which Cancel() calls, knows it's been cancelled)
+		p_group->Cancel();
+		m_state = SYNC_IDLE;
+	}
+}
+
+HttpAssetSync::Progress HttpAssetSync::GetProgress() const {
+	Progress progress = m_progress;
+	if (m_pGroup)
+		progress.bytesDone += m_pGroup->GetProgress().GetDownloadBytesDone(); // (Of the downloads, as the workers count them)
+	return progress;
+}
+
+string HttpAssetSync::GetStagedPath(const Asset& asset) const {
+	// Named for the version it is, so that a file staged for an older manifest is never taken for this one's:
+	string path = GetSyncFolder() + "staging/" + asset.path;
+	if (!asset.hash.empty())
+		path.append(1, '.').append(asset.hash, 0, 16);
+	return path;
+}
+
+void HttpAssetSync::HandleFileDone(Ptr<HttpRequest> pRequest) {
+	if (pRequest->GetStatus() == HttpRequest::DONE)
+		m_progress.numDone++;
+	else
+		m_progress.numFailed++;
+}
+
+void HttpAssetSync::HandleGroupDone(Ptr<HttpRequestGroup> pGroup) {
+	if (pGroup != m_pGroup)
+		return; // Cancelled
+	m_progress.bytesDone += pGroup->GetProgress().GetDownloadBytesDone();
+	m_pGroup = nullptr;
+	Finish(pGroup->GetNumSucceeded() == pGroup->GetNumRequests());
+}
+
+void HttpAssetSync::Finish(bool commit) {
+	m_state = commit && Commit() ? SYNC_DONE : SYNC_FAILED;
+	m_target.clear();
+	if (m_doneCallback)
+		m_doneCallback(this);
+}
+
+bool HttpAssetSync::Commit() {
+	// The new index is written first, so that if we don't get to the end, the next HttpAssetSync of the folder does:
+	const string index_path = GetSyncFolder() + "index";
+	try {
+		MakePath(DirName(index_path));
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpAssetSync: %s", e.what());
+		return false;
+	}
+	if (!HttpAssetSync_WriteFile(index_path + ".new", HttpAssetSync_ToJson(m_target, m_deleteRemoved))) {
+		s3eFileDelete((index_path + ".new").c_str());
+		return false;
+	}
+	CompleteCommit(m_target, m_deleteRemoved);
+	return true;
+}
+
+void HttpAssetSync::CompleteCommit(const Index& index, bool deleteRemoved) {
+	// Move the staged files into place (those that have been already, if this is finishing an earlier commit, aren't staged any more):
+	for (auto it = index.begin(); it != index.end(); it++) {
+		const string staged_path = GetStagedPath(it->second);
+		if (!IsFile(staged_path))
+			continue;
+		const string path = GetPath(it->first);
+		try {
+			MakePath(DirName(path));
+		} catch (const std::exception& e) {
+			s3eDebugTracePrintf("HttpAssetSync: %s", e.what());
+		}
+		if (IsFile(path))
+			s3eFileDelete(path.c_str());
+		if (s3eFileRename(staged_path.c_str(), path.c_str()) != S3E_RESULT_SUCCESS)
+			s3eDebugTracePrintf("HttpAssetSync: Unable to move %s into place", path.c_str());
+	}
+	if (deleteRemoved) {
+		for (auto it = m_index.begin(); it != m_index.end(); it++) {
+			const string path = GetPath(it->first);
+			if (!index.count(it->first) && IsFile(path))
+				s3eFileDelete(path.c_str());
+		}
+	}
+	const string index_path = GetSyncFolder() + "index";
+	if (IsFile(index_path))
+		s3eFileDelete(index_path.c_str());
+	s3eFileRename((index_path + ".new").c_str(), index_path.c_str());
+	m_index = index;
+	// Whatever is left in the staging folder is of no use now (e.g. partial files of versions that have been superseded):
+	if (IsDir(GetSyncFolder() + "staging"))
+		DeleteFolderAndContents(GetSyncFolder() + "staging");
+}
+
+bool HttpAssetSync::IsSafePath(const string& path) {
+	if (path.empty() || path[0] == '/' || path.find('\\') != string::npos || path.find(':') != string::npos || path.compare(0, 6, ".sync/") == 0)
+		return false;
+	for (size_t pos = 0; pos <= path.size(); ) {
+		size_t end = path.find('/', pos);
+		if (end == string::npos)
+			end = path.size();
+		if (end - pos == 0 || (end - pos == 2 && path.compare(pos, 2, "..") == 0))
+			return false; // (An empty component would be too, e.g. "a//b" or "a/")
+		pos = end + 1;
+	}
+	return true;
+}
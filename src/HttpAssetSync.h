@@ -0,0 +1,113 @@
+// HttpAssetSync:
+// Keeps a folder of content files (e.g. the thousands of assets of a game)
+// in step with a manifest of what it should hold, downloading only the files
+// that are missing or have changed, rather than all of them on every version
+// bump.
+// The manifest lists each file's path in the folder, the URL to fetch it
+// from, and its size and hash (SHA-256 or MD5, in hex) if known. Sync()
+// compares it with the local index, the manifest that was last installed
+// (kept in "<rootFolder>/.sync/index"), and queues one HttpDownload for each
+// file whose size or hash differs, or that isn't there any more, as one
+// HttpRequestGroup at the sync's priority, in the manifest's order. Each is
+// downloaded into a staging folder, "<rootFolder>/.sync/staging", and checked
+// against its hash as it arrives (see HttpDownload::SetExpectedDigest()).
+// Nothing in the folder itself changes until every one has arrived. Then the
+// sync commits: it writes the new index as "index.new", moves the staged
+// files into place, deletes the files that the new manifest doesn't list any
+// more (unless SetDeleteRemoved(false)), and renames "index.new" to "index".
+// If the app dies part way through a commit, the next HttpAssetSync of the
+// folder finishes it, so the folder always ends up with one version or the
+// other, as the index says. If a download fails, the sync fails without
+// committing, but what has been staged (including partial files, which are
+// resumable) is kept, so syncing the same manifest again only fetches the
+// rest.
+// App thread only. It must not outlive its downloader.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HttpDigest.h"
+#include "HttpRequestGroup.h"
+
+class HttpDownloader;
+
+class HttpAssetSync : public IObservable {
+public:
+	struct Asset {
+		Asset() : size(-1), hashType(HttpDigest::DIGEST_NONE) {}
+		std::string path; // Relative to the root folder, with '/' between folders
+		std::string url;
+		int64 size; // -1 if unknown
+		HttpDigest::Type hashType;
+		std::string hash; // In lower-case hex. If there is none, the file is only fetched if it's missing or its size has changed
+	};
+	typedef std::vector<Asset> Manifest;
+	enum State {
+		SYNC_IDLE,
+		SYNC_RUNNING,
+		SYNC_DONE, // Committed: the folder holds the manifest's files
+		SYNC_FAILED // Not committed, e.g. a download failed
+	};
+	struct Progress {
+		Progress() : numFiles(0), numDone(0), numFailed(0), bytesTotal(0), bytesDone(0) {}
+		uint numFiles; // To be fetched: those that were missing or changed
+		uint numDone; // Including any that were already staged
+		uint numFailed;
+		int64 bytesTotal; // Of the files whose sizes are known
+		int64 bytesDone; // Including what has arrived of the files still being downloaded
+	};
+	typedef fastdelegate::FastDelegate1<HttpAssetSync*> DoneDelegate;
+
+	// Finishes a commit that was interrupted, if need be, then loads the index.
+	HttpAssetSync(HttpDownloader& downloader, const std::string& rootFolder);
+	~HttpAssetSync(); // Cancels a sync in progress
+
+	// Read a manifest from JSON, of the form
+	//   {"baseUrl": "https://cdn.example.com/v42/",
+	//    "files": [{"path": "images/a.png", "size": 1234, "sha256": "...", "url": "..."}, ...]}
+	// where each file has a "sha256" or an "md5" (or neither) and a "url", or a path that is appended to baseUrl.
+	// Throws a runtime_error if it isn't one.
+	static Manifest ParseManifest(const char* pJson, size_t size);
+
+	// Bring the folder up to date with manifest, in the background. Cancels the sync in progress, if any.
+	// The done callback is called once the sync has committed or failed (straight away if nothing has changed).
+	void Sync(const Manifest& manifest, HttpRequest::Priority priority = HttpRequest::PRIORITY_NORMAL);
+	// Stop the sync in progress, without committing. What has been staged is kept for next time.
+	void Cancel();
+	void SetDoneCallback(DoneDelegate callback) { m_doneCallback = callback; }
+	// Whether a commit deletes the files of the last manifest that the new one doesn't have (by default, it does):
+	HttpAssetSync& SetDeleteRemoved(bool deleteRemoved) { m_deleteRemoved = deleteRemoved; return *this; }
+
+	State GetState() const { return m_state; }
+	Progress GetProgress() const;
+	// The installed files, by path:
+	const std::map<std::string, Asset>& GetIndex() const { return m_index; }
+	std::string GetPath(const std::string& path) const { return m_rootFolder + path; } // Where a file is installed
+
+private:
+	typedef std::map<std::string, Asset> Index;
+	HttpDownloader& m_downloader;
+	const std::string m_rootFolder; // Ending in '/'
+	Index m_index;
+	bool m_deleteRemoved;
+	State m_state;
+	Index m_target; // The manifest being synced
+	Ptr<HttpRequestGroup> m_pGroup; // Its downloads
+	Progress m_progress; // Of the downloads that have finished
+	DoneDelegate m_doneCallback;
+
+	std::string GetSyncFolder() const { return m_rootFolder + ".sync/"; }
+	std::string GetStagedPath(const Asset& asset) const;
+	void HandleFileDone(Ptr<HttpRequest> pRequest);
+	void HandleGroupDone(Ptr<HttpRequestGroup> pGroup);
+	void Finish(bool commit);
+	bool Commit();
+	void CompleteCommit(const Index& index, bool deleteRemoved); // Once "index.new" has been written
+	static bool IsSafePath(const std::string& path);
+};
@@ -0,0 +1,294 @@
+// HttpBatcher:
+// Sends many small HttpPostJson calls to one API as a few batch requests.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpBatcher.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <s3eTimer.h>
+
+#include "HttpClient.h"
+#include "HttpUrl.h"
+
+using std::string;
+
+// One POST to the batch URL, with the requests it is for:
+class HttpBatcher::Batch : public HttpPost {
+public:
+	Batch(const string& url, const string& contentType, string& body, bool multipart) : HttpPost(url), m_multipart(multipart), m_httpStatusCode(0) {
+		SetHeader("Content-Type", contentType);
+		m_body.swap(body);
+	}
+	std::vector< Ptr<HttpPostJson> > requests;
+	int GetHttpStatusCode() const { return m_httpStatusCode; }
+	const json::UnknownElement& GetResponseElement() const { return m_responseData; } // (Which may be an array, unlike GetResponse())
+	virtual void CompileRequest() {
+		m_postData.swap(m_body);
+		HttpRequest::CompileRequest();
+	}
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		m_httpStatusCode = httpStatusCode;
+		if (m_multipart)
+			HttpRequest::HandleResponse(success, httpStatusCode); // The parts are split up straight from GetResponseBody()
+		else
+			HttpPost::HandleResponse(success, httpStatusCode);
+	}
+private:
+	string m_body;
+	const bool m_multipart;
+	int m_httpStatusCode;
+};
+
+HttpBatcher::HttpBatcher(HttpClient& client, const string& batchUrl, Format format)
+: m_client(client), m_batchUrl(batchUrl), m_format(format), m_windowMs(20), m_maxBatchSize(50), m_windowEndMs(0), m_numBatches(0) {}
+
+HttpBatcher::~HttpBatcher() {
+	for (auto it = m_waiting.begin(); it != m_waiting.end(); it++)
+		(*it)->Cancel();
+	for (auto it = m_batches.begin(); it != m_batches.end(); it++) {
+		Batch* p_batch = static_cast<Batch*>(it->ptr());
+		for (auto request_it = p_batch->requests.begin(); request_it != p_batch->requests.end(); request_it++)
+			(*request_it)->Cancel();
+		p_batch->Abort();
+	}
+}
+
+HttpFuture HttpBatcher::QueueRequest(Ptr<HttpPostJson> pRequest, Ptr<HttpCallbackBase> pCallback) {
+	IwAssert(HTTP_CLIENT, !pRequest->IsCbor() && !pRequest->IsStreamBody() && !pRequest->IsCompileOnWorker()); // (A batch is written out whole)
+	if (pRequest->GetStatus() == HttpRequest::BUILDING)
+		pRequest->CompileRequest();
+	IwAssert(HTTP_CLIENT, pRequest->GetStatus() == HttpRequest::PENDING);
+	pRequest->ForgetCallbacks();
+	pRequest->m_pCallback = pCallback;
+	pRequest->m_queuedMs = s3eTimerGetMs();
+	if (m_waiting.empty())
+		m_windowEndMs = pRequest->m_queuedMs + m_windowMs;
+	m_waiting.push_back(pRequest);
+	if (m_waiting.size() >= m_maxBatchSize)
+		Flush();
+	return HttpFuture(&m_client, pRequest.ptr());
+}
+
+HttpFuture HttpBatcher::QueueRequest(Ptr<HttpPostJson> pRequest, HttpRequest::CallbackDelegate delegate, IObservable* pGuard) {
+	HttpFuture future = QueueRequest(pRequest);
+	pRequest->m_callbackDelegate = delegate;
+	pRequest->m_pCallbackGuard = pGuard;
+	pRequest->m_callbackGuarded = pGuard != nullptr;
+	return future;
+}
+
+void HttpBatcher::Update() {
+	if (!m_waiting.empty() && s3eTimerGetMs() >= m_windowEndMs)
+		Flush();
+}
+
+void HttpBatcher::Flush() {
+	std::vector< Ptr<HttpPostJson> > requests;
+	for (auto it = m_waiting.begin(); it != m_waiting.end(); it++) {
+		if ((*it)->GetStatus() == HttpRequest::PENDING) // i.e. not cancelled
+			requests.push_back(*it);
+	}
+	m_waiting.clear();
+	if (requests.empty())
+		return;
+	string body, content_type;
+	HttpRequest::Priority priority = HttpRequest::PRIORITY_BACKGROUND;
+	if (m_format == FORMAT_JSON_ARRAY) {
+		body.append(1, '[');
+		for (size_t i = 0; i < requests.size(); i++) {
+			const json::String url(requests[i]->GetURL());
+			body.append(i ? ",{\"method\":\"POST\",\"url\":" : "{\"method\":\"POST\",\"url\":");
+			const size_t url_size = json::BufferWriter::MeasureSize(url);
+			body.resize(body.size() + url_size);
+			json::BufferWriter::Write(url, &body[body.size() - url_size]);
+			body.append(",\"body\":").append(requests[i]->GetPostBody().empty() ? "null" : requests[i]->GetPostBody()).append(1, '}');
+		}
+		body.append(1, ']');
+		content_type = "application/json";
+	} else {
+		char boundary[64];
+		snprintf(boundary, sizeof(boundary), "batch_httputils_%u", ++m_numBatches);
+		for (size_t i = 0; i < requests.size(); i++) {
+			HttpPostJson& request = *requests[i].ptr();
+			char part_headers[64];
+			snprintf(part_headers, sizeof(part_headers), "\r\nContent-Type: application/http\r\nContent-ID: <%u>\r\n\r\n", (uint)i + 1);
+			body.append("--").append(boundary).append(part_headers);
+			body.append("POST ").append(HttpUrl(request.GetURL()).GetPathAndQuery()).append(" HTTP/1.1\r\n");
+			const HttpHeaders& headers = request.GetRequestHeaders();
+			for (size_t h = 0; h < headers.Size(); h++)
+				body.append(headers.GetLine(h)).append("\r\n");
+			body.append("\r\n").append(request.GetPostBody()).append("\r\n");
+		}
+		body.append("--").append(boundary).append("--\r\n");
+		content_type = string("multipart/mixed; boundary=").append(boundary);
+	}
+	for (size_t i = 0; i < requests.size(); i++) {
+		if (requests[i]->GetPriority() > priority)
+			priority = requests[i]->GetPriority();
+	}
+	Ptr<Batch> p_batch = new Batch(m_batchUrl, content_type, body, m_format == FORMAT_MULTIPART);
+	p_batch->requests.swap(requests);
+	p_batch->SetPriority(priority);
+	m_batches.push_back(p_batch.ptr());
+	m_client.QueueRequest(p_batch.ptr(), this, &HttpBatcher::HandleBatchDone);
+}
+
+void HttpBatcher::HandleBatchDone(Ptr<HttpRequest> pBatch) {
+	for (auto it = m_batches.begin(); it != m_batches.end(); it++) {
+		if (*it == pBatch) {
+			m_batches.erase(it);
+			break;
+		}
+	}
+	Batch& batch = *static_cast<Batch*>(pBatch.ptr());
+	if (batch.GetStatus() == HttpRequest::DONE) {
+		if (m_format == FORMAT_JSON_ARRAY)
+			SplitJsonArray(batch);
+		else
+			SplitMultipart(batch);
+	}
+	// Whatever didn't get a response of its own (all of them, if the batch failed) gets the batch's failure:
+	const int code = batch.GetHttpStatusCode() < 400 ? 0 : batch.GetHttpStatusCode();
+	const HttpHeaders no_headers;
+	for (auto it = batch.requests.begin(); it != batch.requests.end(); it++) {
+		if ((*it)->GetStatus() == HttpRequest::PENDING)
+			Complete(*it->ptr(), code, no_headers, nullptr, 0);
+	}
+	batch.requests.clear();
+}
+
+void HttpBatcher::SplitJsonArray(Batch& batch) {
+	const json::UnknownElement& response = batch.GetResponseElement();
+	if (!response.IsOfType<json::Array>()) {
+		s3eDebugTracePrintf("HttpBatcher: The response from %s isn't an array", m_batchUrl.c_str());
+		return;
+	}
+	const json::Array& items = response;
+	HttpHeaders headers;
+	string body;
+	for (size_t i = 0; i < batch.requests.size() && i < items.Size(); i++) {
+		HttpPostJson& request = *batch.requests[i].ptr();
+		if (request.GetStatus() != HttpRequest::PENDING)
+			continue; // Cancelled
+		headers.Clear();
+		body.clear();
+		int code = 0;
+		try {
+			const json::Object& item = items[i];
+			json::Object::const_iterator it = item.Find("status");
+			if (it != item.End())
+				code = (int)(double)(const json::Number&)it->element;
+			it = item.Find("headers");
+			if (it != item.End()) {
+				const json::Object& item_headers = it->element;
+				for (json::Object::const_iterator header_it = item_headers.Begin(); header_it != item_headers.End(); header_it++)
+					headers.Add(header_it->name, (const std::string&)(const json::String&)header_it->element);
+			}
+			it = item.Find("body");
+			if (it != item.End()) {
+				body.resize(json::BufferWriter::MeasureSize(it->element));
+				json::BufferWriter::Write(it->element, &body[0]);
+				if (!headers.Find("Content-Type"))
+					headers.Add("Content-Type", "application/json");
+			}
+		} catch (const json::Exception& e) {
+			s3eDebugTracePrintf("HttpBatcher: Bad item %u in the response from %s: %s", (uint)i, m_batchUrl.c_str(), e.what());
+			continue;
+		}
+		Complete(request, code, headers, body.data(), body.size());
+	}
+}
+
+// Where the first delimiter is in p up to end, or nullptr:
+static const char* HttpBatcher_Find(const char* p, const char* end, const string& delimiter) {
+	const char* p_found = std::search(p, end, delimiter.begin(), delimiter.end());
+	return p_found != end ? p_found : nullptr;
+}
+
+// The next line of text from p, up to end, without its line break, moving p past it:
+static bool HttpBatcher_NextLine(const char*& p, const char* end, const char*& pLine, size_t& length) {
+	if (p >= end)
+		return false;
+	pLine = p;
+	const char* p_newline = static_cast<const char*>(memchr(p, '\n', end - p));
+	const char* p_line_end = p_newline ? p_newline : end;
+	p = p_newline ? p_newline + 1 : end;
+	length = p_line_end - pLine;
+	if (length && pLine[length - 1] == '\r')
+		length--;
+	return true;
+}
+
+void HttpBatcher::SplitMultipart(Batch& batch) {
+	// The boundary is in the response's Content-Type, e.g. "multipart/mixed; boundary=batch_abc":
+	const char* p_type = batch.GetResponseHeaders().Find("Content-Type");
+	const char* p_boundary = p_type ? strstr(p_type, "boundary=") : nullptr;
+	if (!p_boundary) {
+		s3eDebugTracePrintf("HttpBatcher: The response from %s isn't multipart", m_batchUrl.c_str());
+		return;
+	}
+	p_boundary += 9;
+	string delimiter("--");
+	if (*p_boundary == '"')
+		delimiter.append(p_boundary + 1, strcspn(p_boundary + 1, "\""));
+	else
+		delimiter.append(p_boundary, strcspn(p_boundary, "; "));
+	const HttpResponseBody& response = batch.GetResponseBody();
+	const char* const p_body = response.Data();
+	const char* const p_end = p_body + response.Size();
+	HttpHeaders part_headers, headers;
+	size_t next_index = 0; // For parts without a Content-ID, which are taken to be in order
+	const char* p = p_body;
+	for (;;) {
+		// Find the next delimiter line, and the part that follows it up to the one after:
+		const char* p_delimiter = HttpBatcher_Find(p, p_end, delimiter);
+		if (!p_delimiter)
+			break;
+		p = p_delimiter + delimiter.size();
+		if (p_end - p >= 2 && p[0] == '-' && p[1] == '-')
+			break; // The end
+		const char* p_line;
+		size_t length;
+		HttpBatcher_NextLine(p, p_end, p_line, length); // (The rest of the delimiter line)
+		const char* p_part_end = HttpBatcher_Find(p, p_end, delimiter);
+		if (!p_part_end)
+			p_part_end = p_end;
+		const char* p_next = p_part_end;
+		if (p_part_end > p && p_part_end[-1] == '\n')
+			p_part_end--;
+		if (p_part_end > p && p_part_end[-1] == '\r')
+			p_part_end--;
+		// The part's own headers, then the HTTP response: its status line, headers and body
+		part_headers.Clear();
+		while (HttpBatcher_NextLine(p, p_part_end, p_line, length) && length)
+			part_headers.ParseLine(p_line, length);
+		headers.Clear();
+		while (HttpBatcher_NextLine(p, p_part_end, p_line, length) && length)
+			headers.ParseLine(p_line, length);
+		const char* p_part_body = p < p_part_end ? p : p_part_end;
+		p = p_next;
+		int code = 0;
+		sscanf(headers.GetStatusLine(), "%*s %d", &code);
+		// Google answers Content-ID "<n>" with "<response-n>":
+		size_t index = next_index;
+		if (const char* p_id = part_headers.Find("Content-ID")) {
+			const char* p_digits = p_id + strcspn(p_id, "0123456789");
+			if (*p_digits)
+				index = (size_t)strtoul(p_digits, nullptr, 10) - 1;
+		}
+		next_index = index + 1;
+		if (index >= batch.requests.size() || batch.requests[index]->GetStatus() != HttpRequest::PENDING)
+			continue; // Not one of ours, answered already, or cancelled
+		Complete(*batch.requests[index].ptr(), code, headers, p_part_body, p_part_end - p_part_body);
+	}
+}
+
+void HttpBatcher::Complete(HttpPostJson& request, int httpStatusCode, const HttpHeaders& headers, const char* pBody, size_t bodySize) {
+	Ptr<HttpRequest> p_request(&request); // (Its callback may let go of it)
+	m_client.CompleteLocally(request, httpStatusCode, headers, pBody, bodySize);
+}
@@ -0,0 +1,85 @@
+// HttpBatcher:
+// Sends many small HttpPostJson calls to one API as a few batch requests,
+// for APIs that have a batch endpoint (Google's APIs and our own backend do).
+// Each call is a request of its own, with its own callback, queued with the
+// batcher instead of the client; the batcher collects them for a short window
+// (or until there are SetMaxBatchSize() of them), then sends them all in one
+// POST to the batch URL, on one worker. When the batch's response arrives, it
+// is split up again, and each request gets its part of it, as if it had been
+// sent by itself: GetResponse(), GetResponseHeaders() and the callback all
+// work as usual. If the batch itself fails (e.g. the connection drops), every
+// request in it fails, with the batch's HTTP status.
+// Two formats are supported:
+//  - FORMAT_JSON_ARRAY (our backend): the body is a JSON array of
+//    {"method": "POST", "url": <the request's URL>, "body": <its body>}, and the
+//    response is an array of {"status": <HTTP status>, "body": <its response>,
+//    "headers": {<name>: <value>...} (optional)}, in the same order.
+//  - FORMAT_MULTIPART (Google's batch endpoints, e.g.
+//    "https://www.googleapis.com/batch/youtube/v3"): the body is multipart/mixed,
+//    each part an application/http request with the request's path, headers and
+//    body, and a Content-ID by which the part of the response for it is found.
+// Requests with a callback object or delegate, cancelling (HttpRequest::Cancel(),
+// while the request is waiting or in its batch) and HttpFuture all work as they
+// do with an HttpClient. Requests that have their own retries, hedging,
+// priorities or deadlines get those of the batch instead: the batch goes at the
+// highest priority of its requests. CBOR requests can't be batched.
+// Like HttpClient, it must only be used from the app thread. It must not
+// outlive its client.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "HttpFuture.h"
+#include "HttpRequest.h"
+
+class HttpClient;
+
+class HttpBatcher : public IObservable {
+public:
+	enum Format {
+		FORMAT_JSON_ARRAY,
+		FORMAT_MULTIPART
+	};
+	HttpBatcher(HttpClient& client, const std::string& batchUrl, Format format = FORMAT_JSON_ARRAY);
+	~HttpBatcher(); // Cancels the requests that are still waiting, and aborts the batches under way
+
+	// How long the first request of a batch waits for others to join it (20 ms by default, i.e. about a frame):
+	HttpBatcher& SetWindow(uint windowMs) { m_windowMs = windowMs; return *this; }
+	// How many requests may go in one batch (50 by default; Google's endpoints take up to 100):
+	HttpBatcher& SetMaxBatchSize(uint maxRequests) { m_maxBatchSize = maxRequests ? maxRequests : 1; return *this; }
+
+	// Queue pRequest for the next batch:
+	HttpFuture QueueRequest(Ptr<HttpPostJson> pRequest, Ptr<HttpCallbackBase> pCallback = nullptr);
+	HttpFuture QueueRequest(Ptr<HttpPostJson> pRequest, HttpRequest::CallbackDelegate delegate, IObservable* pGuard = nullptr);
+	template<typename WatcherType>
+	HttpFuture QueueRequest(Ptr<HttpPostJson> pRequest, WatcherType* pWatcher, void (WatcherType::*pMethod)(Ptr<HttpRequest>)) { return QueueRequest(pRequest, fastdelegate::MakeDelegate(pWatcher, pMethod), pWatcher); }
+
+	// Call regularly, e.g. along with HttpClient::Update(), to send the waiting requests once their window is over:
+	void Update();
+	// Send the waiting requests now:
+	void Flush();
+
+	size_t GetNumWaiting() const { return m_waiting.size(); }
+
+private:
+	class Batch;
+	HttpClient& m_client;
+	const std::string m_batchUrl;
+	const Format m_format;
+	uint m_windowMs;
+	uint m_maxBatchSize;
+	std::vector< Ptr<HttpPostJson> > m_waiting;
+	uint64 m_windowEndMs; // When m_waiting is to be sent
+	std::vector< Ptr<HttpRequest> > m_batches; // Under way
+	uint m_numBatches; // For the multipart boundaries
+
+	void HandleBatchDone(Ptr<HttpRequest> pBatch);
+	void SplitJsonArray(Batch& batch);
+	void SplitMultipart(Batch& batch);
+	void Complete(HttpPostJson& request, int httpStatusCode, const HttpHeaders& headers, const char* pBody, size_t bodySize);
+};
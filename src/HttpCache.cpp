@@ -0,0 +1,768 @@
+// HttpCache:
+// An on-disk cache of HTTP responses, for use with HttpClient::SetCache().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpCache.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <s3eTimer.h>
+#include "util/iohelpers.h"
+#include "util/jsonfile.h"
+
+using std::string;
+typedef std::map<string, string> Vary;
+
+// Lower-case a header name, for comparisons:
+static string HttpCache_Lower(const string& name) {
+	string lower(name);
+	for (auto it = lower.begin(); it != lower.end(); it++)
+		*it = tolower(*it);
+	return lower;
+}
+
+static string HttpCache_BodyName(uint64 fileId) {
+	char name[32];
+	snprintf(name, sizeof(name), "/%llu.body", (unsigned long long)fileId);
+	return name;
+}
+
+static string HttpCache_PackName(uint64 packId) {
+	char name[32];
+	snprintf(name, sizeof(name), "/%llu.pack", (unsigned long long)packId);
+	return name;
+}
+
+HttpCache::HttpCache(const string& folder, uint64 maxBytes)
+	: m_folder(folder), m_numBytes(0), m_maxBytes(maxBytes), m_nextFileId(1), m_packThreshold(32 * 1024), m_currentPack(0), m_dirty(false), m_pOldest(nullptr), m_pNewest(nullptr)
+{
+	if (!IsDir(m_folder))
+		MakePath(m_folder);
+	Load();
+}
+
+HttpCache::~HttpCache() {
+	Save();
+}
+
+void HttpCache::Clear() {
+	for (Entries::iterator it = m_entries.begin(); it != m_entries.end();)
+		Remove(it++);
+	m_redirects.clear();
+	m_missing.Clear();
+	m_dirty = true;
+}
+
+void HttpCache::ParseCacheControl(const char* pCacheControl, int64& maxAgeMs, bool& noStore, bool& noCache) {
+	maxAgeMs = -1;
+	noStore = noCache = false;
+	if (!pCacheControl)
+		return;
+	// e.g. "public, max-age=3600" or "no-cache, no-store, must-revalidate"
+	const string value = HttpCache_Lower(pCacheControl);
+	size_t pos = 0;
+	while (pos < value.size()) {
+		size_t end = value.find(',', pos);
+		if (end == string::npos)
+			end = value.size();
+		while (pos < end && value[pos] == ' ')
+			pos++;
+		const string directive = value.substr(pos, end - pos);
+		if (directive.compare(0, 8, "max-age=") == 0)
+			maxAgeMs = strtoll(directive.c_str() + 8, nullptr, 10) * 1000;
+		else if (directive.compare(0, 8, "no-store") == 0)
+			noStore = true;
+		else if (directive.compare(0, 8, "no-cache") == 0 || directive.compare(0, 15, "must-revalidate") == 0)
+			noCache = true;
+		pos = end + 1;
+	}
+}
+
+void HttpCache::StripContentEncoding(HttpHeaders& headers) {
+	if (!headers.Find("Content-Encoding"))
+		return;
+	headers.Remove("Content-Encoding");
+	headers.Remove("Content-Length");
+}
+
+bool HttpCache::Matches(const Entry& entry, HttpRequest& request) const {
+	// Every request header named by the response's Vary header must be the same as it was then:
+	for (auto it = entry.vary.begin(); it != entry.vary.end(); it++) {
+		const char* p_value = request.FindRequestHeader(it->first.c_str());
+		if (it->second != (p_value ? p_value : ""))
+			return false;
+	}
+	return true;
+}
+
+HttpCache::Entry* HttpCache::Acquire(HttpRequest& request) {
+	std::pair<Entries::iterator, Entries::iterator> range = m_entries.equal_range(request.GetURL());
+	for (Entries::iterator it = range.first; it != range.second;) {
+		Entries::iterator entry_it = it++;
+		Entry& entry = entry_it->second;
+		if (entry.dead || !Matches(entry, request))
+			continue;
+		if (!entry.verified) {
+			// Its first use since the index was loaded (which doesn't look at the bodies, so as to be quick):
+			const string path = GetBodyPath(entry);
+			if (!IsFile(path) || (entry.packId && s3eFileGetFileInt(path.c_str(), S3E_FILE_SIZE) < (int64)(entry.offset + entry.size))) {
+				Remove(entry_it);
+				continue;
+			}
+			entry.verified = true;
+		}
+		entry.pins++;
+		return &entry;
+	}
+	return nullptr;
+}
+
+void HttpCache::Release(Entry* pEntry) {
+	IwAssert(HTTP_CLIENT, pEntry->pins > 0);
+	if (--pEntry->pins > 0 || !pEntry->dead)
+		return;
+	Remove(Find(pEntry));
+}
+
+void HttpCache::AcquireHottest(std::vector<Entry*>& entries, size_t maxEntries, uint64 maxEntrySize, uint64 maxBytes) {
+	uint64 num_bytes = 0;
+	for (Entry* p_entry = m_pNewest; p_entry && entries.size() < maxEntries; p_entry = p_entry->pOlder) {
+		if (p_entry->size > maxEntrySize || num_bytes + p_entry->size > maxBytes || !IsFresh(*p_entry))
+			continue;
+		bool varies = false;
+		for (auto it = p_entry->vary.begin(); it != p_entry->vary.end() && !varies; it++)
+			varies = it->first != "accept-encoding"; // (The body was stored after decompression)
+		if (varies)
+			continue;
+		p_entry->pins++;
+		entries.push_back(p_entry);
+		num_bytes += p_entry->size;
+	}
+}
+
+HttpCache::Entries::iterator HttpCache::Find(const Entry* pEntry) {
+	std::pair<Entries::iterator, Entries::iterator> range = m_entries.equal_range(pEntry->url);
+	for (Entries::iterator it = range.first; it != range.second; it++) {
+		if (&it->second == pEntry)
+			return it;
+	}
+	IwAssert(HTTP_CLIENT, false); // Every entry is in m_entries
+	return m_entries.end();
+}
+
+bool HttpCache::IsFresh(const Entry& entry) const {
+	return entry.maxAgeMs > 0 && s3eTimerGetUTC() < entry.storedMs + entry.maxAgeMs;
+}
+
+string HttpCache::GetBodyPath(const Entry& entry) const {
+	return entry.packId ? GetPackPath(entry.packId) : m_folder + HttpCache_BodyName(entry.fileId);
+}
+
+string HttpCache::GetPackPath(uint64 packId) const {
+	return m_folder + HttpCache_PackName(packId);
+}
+
+string HttpCache::NewBodyPath(uint64& fileId) {
+	fileId = m_nextFileId++;
+	m_dirty = true;
+	return m_folder + HttpCache_BodyName(fileId);
+}
+
+bool HttpCache::Store(HttpRequest& request, uint64 fileId, const HttpHeaders& responseHeaders) {
+	int64 max_age_ms;
+	bool no_store, no_cache;
+	ParseCacheControl(responseHeaders.Find("Cache-Control"), max_age_ms, no_store, no_cache);
+	const char* p_etag = responseHeaders.Find("ETag");
+	const char* p_last_modified = responseHeaders.Find("Last-Modified");
+	const char* p_vary = responseHeaders.Find("Vary");
+	if (no_store || (p_vary && strchr(p_vary, '*')))
+		return false;
+	if (no_cache)
+		max_age_ms = 0;
+	if (max_age_ms <= 0 && !p_etag && !p_last_modified)
+		return false; // We'd have to fetch it again every time anyway
+
+	Entry entry;
+	entry.url = request.GetURL();
+	if (p_vary) {
+		// e.g. "Accept-Encoding, Accept-Language"
+		const string vary(p_vary);
+		size_t pos = 0;
+		while (pos < vary.size()) {
+			size_t end = vary.find(',', pos);
+			if (end == string::npos)
+				end = vary.size();
+			while (pos < end && vary[pos] == ' ')
+				pos++;
+			size_t name_end = end;
+			while (name_end > pos && vary[name_end - 1] == ' ')
+				name_end--;
+			if (name_end > pos) {
+				const string name = HttpCache_Lower(vary.substr(pos, name_end - pos));
+				const char* p_value = request.FindRequestHeader(name.data(), name.size());
+				entry.vary[name] = p_value ? p_value : "";
+			}
+			pos = end + 1;
+		}
+	}
+	entry.headers = responseHeaders; // (The status line isn't saved)
+	StripContentEncoding(entry.headers);
+	entry.etag = p_etag ? p_etag : "";
+	entry.lastModified = p_last_modified ? p_last_modified : "";
+	entry.fileId = fileId;
+	entry.storedMs = entry.usedMs = s3eTimerGetUTC();
+	entry.maxAgeMs = max_age_ms > 0 ? max_age_ms : 0;
+	entry.pins = 0;
+	entry.dead = false;
+	entry.verified = true;
+	entry.pOlder = entry.pNewer = nullptr;
+	entry.packId = entry.offset = 0;
+	const int64 size = s3eFileGetFileInt(GetBodyPath(entry).c_str(), S3E_FILE_SIZE);
+	entry.size = size > 0 ? size : 0;
+	if (entry.size > m_maxBytes)
+		return false;
+	if (entry.size > 0 && entry.size <= m_packThreshold) {
+		// Small enough to go in a pack, and then we don't need its file:
+		bool packed = false;
+		try {
+			const FileData body(GetBodyPath(entry).c_str());
+			packed = body.Size() == entry.size && PackBody(entry, body.Data(), body.Size());
+		} catch (const std::exception& e) {
+			s3eDebugTracePrintf("HttpCache: %s", e.what());
+		}
+		if (packed)
+			DeleteBody(fileId);
+	}
+
+	// This replaces any response that we had for the same request:
+	std::pair<Entries::iterator, Entries::iterator> range = m_entries.equal_range(entry.url);
+	for (Entries::iterator it = range.first; it != range.second;) {
+		Entries::iterator old = it++;
+		if (!old->second.dead && old->second.vary == entry.vary)
+			Remove(old);
+	}
+	LinkNewest(&m_entries.insert(std::make_pair(entry.url, entry))->second);
+	m_numBytes += entry.size;
+	m_dirty = true;
+	Evict();
+	Compact();
+	PruneDeletions();
+	return true;
+}
+
+void HttpCache::Refresh(Entry* pEntry, const HttpHeaders& responseHeaders) {
+	// The 304's headers update the ones we stored (RFC 7234, 4.3.4):
+	for (size_t i = 0; i < responseHeaders.Size(); i++)
+		pEntry->headers.Set(responseHeaders.GetName(i), responseHeaders.GetNameLength(i), responseHeaders.GetValue(i), responseHeaders.GetValueLength(i));
+	int64 max_age_ms;
+	bool no_store, no_cache;
+	ParseCacheControl(pEntry->headers.Find("Cache-Control"), max_age_ms, no_store, no_cache);
+	if (const char* p_etag = pEntry->headers.Find("ETag"))
+		pEntry->etag = p_etag;
+	if (const char* p_last_modified = pEntry->headers.Find("Last-Modified"))
+		pEntry->lastModified = p_last_modified;
+	pEntry->storedMs = s3eTimerGetUTC();
+	pEntry->maxAgeMs = no_cache || max_age_ms < 0 ? 0 : max_age_ms;
+	Touch(pEntry); // (Which also marks the index as changed)
+}
+
+void HttpCache::Touch(Entry* pEntry) {
+	pEntry->usedMs = s3eTimerGetUTC();
+	if (!pEntry->dead) {
+		Unlink(pEntry);
+		LinkNewest(pEntry);
+	}
+	m_dirty = true;
+}
+
+const string* HttpCache::FindRedirect(const string& url) const {
+	auto it = m_redirects.find(url);
+	return it != m_redirects.end() ? &it->second : nullptr;
+}
+
+void HttpCache::SetRedirect(const string& url, const string& target) {
+	if (target.empty()) {
+		if (m_redirects.erase(url))
+			m_dirty = true;
+		return;
+	}
+	auto it = m_redirects.find(url);
+	if (it != m_redirects.end() && it->second == target)
+		return;
+	if (it == m_redirects.end() && m_redirects.size() >= MAX_REDIRECTS)
+		m_redirects.erase(m_redirects.begin()); // (Any one will do: it is only a shortcut)
+	m_redirects[url] = target;
+	m_dirty = true;
+}
+
+void HttpCache::SetMissing(const string& url, int statusCode, uint64 untilUtcMs) {
+	if (statusCode)
+		m_missing.Add(url, statusCode, untilUtcMs);
+	else if (!m_missing.Remove(url))
+		return;
+	m_dirty = true;
+}
+
+void HttpCache::Remove(Entries::iterator it) {
+	Entry& entry = it->second;
+	if (!entry.dead) {
+		m_numBytes -= entry.size;
+		Unlink(&entry);
+	}
+	if (entry.pins > 0) {
+		entry.dead = true; // Release() will finish the job
+		return;
+	}
+	if (entry.packId)
+		ReleasePackBytes(entry.packId, entry.size);
+	else
+		DeleteBody(entry.fileId);
+	m_entries.erase(it);
+	m_dirty = true;
+}
+
+void HttpCache::Evict() {
+	// From the least recently used response, skipping any that are being served right now:
+	Entry* p_entry = m_pOldest;
+	while (p_entry && m_numBytes > m_maxBytes) {
+		Entry* p_newer = p_entry->pNewer;
+		if (p_entry->pins == 0)
+			Remove(Find(p_entry));
+		p_entry = p_newer;
+	}
+}
+
+void HttpCache::LinkNewest(Entry* pEntry) {
+	pEntry->pOlder = m_pNewest;
+	pEntry->pNewer = nullptr;
+	if (m_pNewest)
+		m_pNewest->pNewer = pEntry;
+	else
+		m_pOldest = pEntry;
+	m_pNewest = pEntry;
+}
+
+void HttpCache::Unlink(Entry* pEntry) {
+	(pEntry->pOlder ? pEntry->pOlder->pNewer : m_pOldest) = pEntry->pNewer;
+	(pEntry->pNewer ? pEntry->pNewer->pOlder : m_pNewest) = pEntry->pOlder;
+	pEntry->pOlder = pEntry->pNewer = nullptr;
+}
+
+void HttpCache::DeleteBody(uint64 fileId) {
+	QueueDeletion(m_deletions, fileId, m_folder + HttpCache_BodyName(fileId));
+}
+
+void HttpCache::DeletePack(uint64 packId) {
+	QueueDeletion(m_packDeletions, packId, GetPackPath(packId));
+}
+
+void HttpCache::QueueDeletion(Deletions& deletions, uint64 fileId, const string& path) {
+	// Deleting thousands of files (e.g. for Clear(), or a smaller SetMaxSize()) can take a while, so it's
+	// done in the background. Until it's done, the index keeps the file ID, so that it gets done eventually.
+	try {
+		deletions.push_back(std::make_pair(fileId, m_deleter.Delete(path)));
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpCache: %s", e.what());
+		s3eFileDelete(path.c_str());
+	}
+}
+
+void HttpCache::PruneDeletions() {
+	m_deleter.Update();
+	Deletions* lists[] = { &m_deletions, &m_packDeletions };
+	for (size_t l = 0; l < sizeof(lists) / sizeof(lists[0]); l++) {
+		Deletions& deletions = *lists[l];
+		size_t num_kept = 0;
+		for (size_t i = 0; i < deletions.size(); i++) {
+			const FileOp::Status status = deletions[i].second->GetStatus();
+			if (status != FileOp::DONE && status != FileOp::FAILED)
+				deletions[num_kept++] = deletions[i];
+		}
+		deletions.erase(deletions.begin() + num_kept, deletions.end());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Packs: bodies are only ever appended to one, and each one's live bytes are counted, so that we know when it is
+// worth compacting, and when it can be deleted.
+
+bool HttpCache::PackBody(Entry& entry, const char* pData, size_t size) {
+	if (m_currentPack == 0 || m_packs[m_currentPack].size + size > MAX_PACK_SIZE) {
+		m_currentPack = m_nextFileId++;
+		Pack& pack = m_packs[m_currentPack];
+		pack.size = pack.liveBytes = 0;
+		m_dirty = true;
+	}
+	// (The file may be longer than we know, if bodies were appended after the index was last saved)
+	const string path = GetPackPath(m_currentPack);
+	const int64 file_size = s3eFileGetFileInt(path.c_str(), S3E_FILE_SIZE);
+	const uint64 offset = file_size > 0 ? file_size : 0;
+	s3eFile* p_file = s3eFileOpen(path.c_str(), "ab");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpCache: Unable to write %s", path.c_str());
+		return false;
+	}
+	const bool written = s3eFileWrite(pData, 1, size, p_file) == size;
+	s3eFileClose(p_file);
+	Pack& pack = m_packs[m_currentPack];
+	pack.size = offset + size; // (Even if it's only partly written: that part is just garbage)
+	if (!written)
+		return false;
+	pack.liveBytes += size;
+	entry.packId = m_currentPack;
+	entry.offset = offset;
+	m_dirty = true;
+	return true;
+}
+
+void HttpCache::ReleasePackBytes(uint64 packId, uint64 size) {
+	auto it = m_packs.find(packId);
+	IwAssert(HTTP_CLIENT, it != m_packs.end() && it->second.liveBytes >= size);
+	it->second.liveBytes -= size;
+	if (it->second.liveBytes > 0)
+		return;
+	if (packId == m_currentPack)
+		m_currentPack = 0; // (Starting afresh costs no more than appending to garbage)
+	m_packs.erase(it);
+	DeletePack(packId);
+	m_dirty = true;
+}
+
+void HttpCache::Compact() {
+	// The first pack (other than the one we're appending to) that is more than half garbage:
+	uint64 pack_id = 0;
+	for (auto it = m_packs.begin(); it != m_packs.end() && !pack_id; it++) {
+		if (it->first != m_currentPack && it->second.liveBytes * 2 < it->second.size)
+			pack_id = it->first;
+	}
+	if (!pack_id)
+		return;
+	// Move some of its bodies to the current pack. Pinned ones are left for a later step, as they may be being read.
+	// Once the last one has gone, so has the pack.
+	m_packs[pack_id].liveBytes++; // (So that it isn't deleted while it's open)
+	s3eFile* p_file = s3eFileOpen(GetPackPath(pack_id).c_str(), "rb");
+	string body;
+	uint64 num_moved = 0;
+	for (Entry* p_entry = m_pOldest; p_entry && num_moved < COMPACT_STEP_BYTES;) {
+		Entry* p_newer = p_entry->pNewer;
+		if (p_entry->packId == pack_id && p_entry->pins == 0) {
+			const size_t size = (size_t)p_entry->size;
+			body.resize(size);
+			if (!p_file || s3eFileSeek(p_file, (int32)p_entry->offset, S3E_FILESEEK_SET) != S3E_RESULT_SUCCESS || s3eFileRead(&body[0], 1, size, p_file) != size) {
+				Remove(Find(p_entry)); // Its body is gone
+			} else {
+				if (!PackBody(*p_entry, body.data(), size))
+					break; // (e.g. the drive is full: moving the rest won't work either)
+				ReleasePackBytes(pack_id, size);
+				num_moved += size;
+			}
+		}
+		p_entry = p_newer;
+	}
+	if (p_file)
+		s3eFileClose(p_file);
+	ReleasePackBytes(pack_id, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The index: a binary file in the cache folder, in the device's own byte order (it never leaves the device):
+//   "HCI2", nextFile, the number of bodies still to be deleted and their file IDs, the number of packs still to
+//   be deleted and their IDs, the current pack, the number of packs and for each, its ID and size,
+//   then the number of entries, and for each, from the least recently used:
+//   url, the number of Vary headers and their names and values, the number of response headers and their
+//   names and values, etag, lastModified, file, size, stored, maxAge, used, pack, offset
+//   then the number of redirects and for each, its URL and target,
+//   then the number of missing URLs and for each, its hash, expiry (a 32-bit count of seconds) and status (32 bits).
+// Counts are 32 bits and other numbers 64 bits; strings are a 32-bit length followed by their bytes.
+// "HCI1" indexes, from before there were packs, have none of the pack fields; they are still loaded.
+
+static const char HTTP_CACHE_INDEX_MAGIC[4] = { 'H', 'C', 'I', '2' };
+
+static void HttpCache_PutU32(string& out, uint32 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpCache_PutU64(string& out, uint64 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpCache_PutString(string& out, const char* pData, size_t length) {
+	HttpCache_PutU32(out, (uint32)length);
+	out.append(pData, length);
+}
+static void HttpCache_PutString(string& out, const string& value) { HttpCache_PutString(out, value.data(), value.size()); }
+
+namespace {
+	class HttpCacheIndexReader {
+	public:
+		HttpCacheIndexReader(const char* pData, size_t size) : m_p(pData), m_pEnd(pData + size) {}
+		void Read(void* pDest, size_t size) { memcpy(pDest, Skip(size), size); }
+		bool AtEnd() const { return m_p == m_pEnd; }
+		uint32 ReadU32() { uint32 value; Read(&value, sizeof(value)); return value; }
+		uint64 ReadU64() { uint64 value; Read(&value, sizeof(value)); return value; }
+		// A string, in place:
+		const char* ReadString(size_t& length) { length = ReadU32(); return Skip(length); }
+		string ReadString() { size_t length; const char* p_data = ReadString(length); return string(p_data, length); }
+	private:
+		const char* m_p;
+		const char* m_pEnd;
+		const char* Skip(size_t size) {
+			if ((size_t)(m_pEnd - m_p) < size)
+				throw std::runtime_error("index is truncated");
+			const char* p = m_p;
+			m_p += size;
+			return p;
+		}
+	};
+}
+
+void HttpCache::Save() {
+	Compact();
+	PruneDeletions();
+	if (!m_dirty)
+		return;
+	string data;
+	data.append(HTTP_CACHE_INDEX_MAGIC, sizeof(HTTP_CACHE_INDEX_MAGIC));
+	HttpCache_PutU64(data, m_nextFileId);
+	HttpCache_PutU32(data, (uint32)m_deletions.size());
+	for (auto it = m_deletions.begin(); it != m_deletions.end(); it++)
+		HttpCache_PutU64(data, it->first);
+	HttpCache_PutU32(data, (uint32)m_packDeletions.size());
+	for (auto it = m_packDeletions.begin(); it != m_packDeletions.end(); it++)
+		HttpCache_PutU64(data, it->first);
+	HttpCache_PutU64(data, m_currentPack);
+	HttpCache_PutU32(data, (uint32)m_packs.size());
+	for (auto it = m_packs.begin(); it != m_packs.end(); it++) {
+		HttpCache_PutU64(data, it->first);
+		HttpCache_PutU64(data, it->second.size);
+	}
+	const size_t count_pos = data.size();
+	HttpCache_PutU32(data, 0); // (Filled in below)
+	uint32 count = 0;
+	for (const Entry* p_entry = m_pOldest; p_entry; p_entry = p_entry->pNewer, count++) { // (Dead entries aren't in the list)
+		const Entry& entry = *p_entry;
+		HttpCache_PutString(data, entry.url);
+		HttpCache_PutU32(data, (uint32)entry.vary.size());
+		for (auto it = entry.vary.begin(); it != entry.vary.end(); it++) {
+			HttpCache_PutString(data, it->first);
+			HttpCache_PutString(data, it->second);
+		}
+		HttpCache_PutU32(data, (uint32)entry.headers.Size());
+		for (size_t i = 0; i < entry.headers.Size(); i++) {
+			HttpCache_PutString(data, entry.headers.GetName(i), entry.headers.GetNameLength(i));
+			HttpCache_PutString(data, entry.headers.GetValue(i), entry.headers.GetValueLength(i));
+		}
+		HttpCache_PutString(data, entry.etag);
+		HttpCache_PutString(data, entry.lastModified);
+		HttpCache_PutU64(data, entry.fileId);
+		HttpCache_PutU64(data, entry.size);
+		HttpCache_PutU64(data, entry.storedMs);
+		HttpCache_PutU64(data, (uint64)entry.maxAgeMs);
+		HttpCache_PutU64(data, entry.usedMs);
+		HttpCache_PutU64(data, entry.packId);
+		HttpCache_PutU64(data, entry.offset);
+	}
+	memcpy(&data[count_pos], &count, sizeof(count));
+	// (Indexes written before there were redirects end here)
+	HttpCache_PutU32(data, (uint32)m_redirects.size());
+	for (auto it = m_redirects.begin(); it != m_redirects.end(); it++) {
+		HttpCache_PutString(data, it->first);
+		HttpCache_PutString(data, it->second);
+	}
+	// (And those written before there were missing URLs end here)
+	const std::vector<HttpNegativeCache::Entry>& missing = m_missing.GetEntries();
+	HttpCache_PutU32(data, (uint32)missing.size());
+	for (auto it = missing.begin(); it != missing.end(); it++) {
+		HttpCache_PutU64(data, it->hash);
+		HttpCache_PutU32(data, it->expiresS);
+		HttpCache_PutU32(data, it->statusCode);
+	}
+
+	// Write a new index and then replace the old one, so that we never leave half an index behind:
+	const string tmp_path = GetIndexPath() + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpCache: Unable to write %s", tmp_path.c_str());
+		return;
+	}
+	const bool written = s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	s3eFileClose(p_file);
+	if (written) {
+		s3eFileDelete(GetIndexPath().c_str());
+		s3eFileRename(tmp_path.c_str(), GetIndexPath().c_str());
+		if (IsFile(GetLegacyIndexPath()))
+			s3eFileDelete(GetLegacyIndexPath().c_str());
+		m_dirty = false;
+	}
+}
+
+void HttpCache::Load() {
+	if (!IsFile(GetIndexPath())) {
+		LoadLegacyIndex();
+		Evict();
+		return;
+	}
+	try {
+		const FileData data(GetIndexPath().c_str());
+		HttpCacheIndexReader in(data.Data(), data.Size());
+		char magic[sizeof(HTTP_CACHE_INDEX_MAGIC)];
+		in.Read(magic, sizeof(magic));
+		if (memcmp(magic, HTTP_CACHE_INDEX_MAGIC, 3) != 0 || (magic[3] != '1' && magic[3] != HTTP_CACHE_INDEX_MAGIC[3]))
+			throw std::runtime_error("unknown index format");
+		const bool has_packs = magic[3] != '1';
+		m_nextFileId = in.ReadU64();
+		for (uint32 num_deletions = in.ReadU32(); num_deletions > 0; num_deletions--) {
+			const uint64 file_id = in.ReadU64();
+			if (file_id < m_nextFileId)
+				DeleteBody(file_id); // The last session didn't get round to it
+		}
+		if (has_packs) {
+			for (uint32 num_deletions = in.ReadU32(); num_deletions > 0; num_deletions--) {
+				const uint64 pack_id = in.ReadU64();
+				if (pack_id < m_nextFileId)
+					DeletePack(pack_id);
+			}
+			m_currentPack = in.ReadU64();
+			for (uint32 num_packs = in.ReadU32(); num_packs > 0; num_packs--) {
+				const uint64 pack_id = in.ReadU64();
+				Pack& pack = m_packs[pack_id];
+				pack.size = in.ReadU64();
+				pack.liveBytes = 0; // (Counted from the entries)
+			}
+		}
+		for (uint32 num_entries = in.ReadU32(); num_entries > 0; num_entries--) {
+			Entry entry;
+			entry.url = in.ReadString();
+			for (uint32 num_vary = in.ReadU32(); num_vary > 0; num_vary--) {
+				const string name = in.ReadString();
+				entry.vary[name] = in.ReadString();
+			}
+			for (uint32 num_headers = in.ReadU32(); num_headers > 0; num_headers--) {
+				size_t name_length, value_length;
+				const char* p_name = in.ReadString(name_length);
+				const char* p_value = in.ReadString(value_length);
+				entry.headers.Add(p_name, name_length, p_value, value_length);
+			}
+			entry.etag = in.ReadString();
+			entry.lastModified = in.ReadString();
+			entry.fileId = in.ReadU64();
+			entry.size = in.ReadU64();
+			entry.storedMs = in.ReadU64();
+			entry.maxAgeMs = (int64)in.ReadU64();
+			entry.usedMs = in.ReadU64();
+			entry.packId = has_packs ? in.ReadU64() : 0;
+			entry.offset = has_packs ? in.ReadU64() : 0;
+			entry.pins = 0;
+			entry.dead = false;
+			entry.verified = false;
+			entry.pOlder = entry.pNewer = nullptr;
+			if (entry.fileId >= m_nextFileId)
+				continue;
+			if (entry.packId) {
+				auto pack_it = m_packs.find(entry.packId);
+				if (pack_it == m_packs.end() || entry.offset + entry.size > pack_it->second.size)
+					continue;
+				pack_it->second.liveBytes += entry.size;
+			}
+			LinkNewest(&m_entries.insert(std::make_pair(entry.url, entry))->second); // (They are in order of use)
+			m_numBytes += entry.size;
+		}
+		for (uint32 num_redirects = in.AtEnd() ? 0 : in.ReadU32(); num_redirects > 0; num_redirects--) {
+			const string url = in.ReadString();
+			m_redirects[url] = in.ReadString();
+		}
+		const uint32 now_s = (uint32)(s3eTimerGetUTC() / 1000);
+		for (uint32 num_missing = in.AtEnd() ? 0 : in.ReadU32(); num_missing > 0; num_missing--) {
+			const uint64 hash = in.ReadU64();
+			const uint32 expires_s = in.ReadU32();
+			const uint32 status_code = in.ReadU32();
+			if (expires_s > now_s)
+				m_missing.Add(hash, (int)status_code, expires_s);
+		}
+		// Any pack that no entry is in any more (e.g. all of them were appended after the index was last saved):
+		for (auto it = m_packs.begin(); it != m_packs.end();) {
+			auto pack_it = it++;
+			if (pack_it->second.liveBytes == 0) {
+				if (pack_it->first == m_currentPack)
+					m_currentPack = 0;
+				DeletePack(pack_it->first);
+				m_packs.erase(pack_it);
+			}
+		}
+		if (!m_packs.count(m_currentPack))
+			m_currentPack = 0;
+	} catch (const std::exception& e) {
+		// A damaged index just means an empty cache. (Bodies it referred to get overwritten as new ones are stored.)
+		s3eDebugTracePrintf("HttpCache: Ignoring damaged index (%s)", e.what());
+		m_entries.clear();
+		m_redirects.clear();
+		m_missing.Clear();
+		m_packs.clear();
+		m_currentPack = 0;
+		m_pOldest = m_pNewest = nullptr;
+		m_numBytes = 0;
+	}
+	Evict();
+}
+
+// The JSON index of older versions, which the next Save() replaces:
+
+static Vary HttpCache_VaryFromJson(const json::Object& object) {
+	Vary vary;
+	for (json::Object::const_iterator it = object.Begin(); it != object.End(); it++)
+		vary[it->name] = ((const json::String&)it->element).Value();
+	return vary;
+}
+
+static void HttpCache_HeadersFromJson(const json::Object& object, HttpHeaders& headers) {
+	for (json::Object::const_iterator it = object.Begin(); it != object.End(); it++)
+		headers.Add(it->name, ((const json::String&)it->element).Value());
+}
+
+static bool HttpCache_UsedBefore(const HttpCache::Entry* a, const HttpCache::Entry* b) {
+	return a->usedMs < b->usedMs;
+}
+
+void HttpCache::LoadLegacyIndex() {
+	if (!IsFile(GetLegacyIndexPath()))
+		return;
+	m_dirty = true;
+	try {
+		json::Object index;
+		json::ReadFile(index, GetLegacyIndexPath());
+		m_nextFileId = index.GetOrDefault("nextFile", 1LL);
+		const json::Array& entries = index["entries"];
+		std::vector<Entry*> by_use;
+		for (json::Array::const_iterator it = entries.Begin(); it != entries.End(); it++) {
+			const json::Object& object = *it;
+			Entry entry;
+			entry.url = object.GetOrDefault("url", string());
+			entry.vary = HttpCache_VaryFromJson(object["vary"]);
+			HttpCache_HeadersFromJson(object["headers"], entry.headers);
+			entry.etag = object.GetOrDefault("etag", string());
+			entry.lastModified = object.GetOrDefault("lastModified", string());
+			entry.fileId = object.GetOrDefault("file", 0LL);
+			entry.size = object.GetOrDefault("size", 0LL);
+			entry.storedMs = object.GetOrDefault("stored", 0LL);
+			entry.maxAgeMs = object.GetOrDefault("maxAge", 0LL);
+			entry.usedMs = object.GetOrDefault("used", 0LL);
+			entry.packId = entry.offset = 0;
+			entry.pins = 0;
+			entry.dead = false;
+			entry.verified = false;
+			entry.pOlder = entry.pNewer = nullptr;
+			if (entry.fileId >= m_nextFileId)
+				continue;
+			by_use.push_back(&m_entries.insert(std::make_pair(entry.url, entry))->second);
+			m_numBytes += entry.size;
+		}
+		std::sort(by_use.begin(), by_use.end(), HttpCache_UsedBefore);
+		for (auto it = by_use.begin(); it != by_use.end(); it++)
+			LinkNewest(*it);
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpCache: Ignoring damaged index (%s)", e.what());
+		m_entries.clear();
+		m_pOldest = m_pNewest = nullptr;
+		m_numBytes = 0;
+	}
+}
@@ -0,0 +1,159 @@
+// HttpCache:
+// An on-disk cache of HTTP responses, for use with HttpClient::SetCache().
+// Responses to GET requests are stored in a folder on any s3e drive (e.g.
+// "cache://http", if CheckDriveSupport("cache://") says the device has one),
+// keyed by URL and the request headers named by the response's Vary header.
+// A cached response is served without touching the network for as long as
+// its Cache-Control max-age says it is fresh. After that, the request is sent
+// with If-None-Match/If-Modified-Since, and if the server answers
+// 304 Not Modified, the request gets the cached body.
+// Requests see no difference between a cached response and a network one,
+// except for HttpRequest::IsFromCache().
+// The index is a compact binary file, which is loaded without looking at the
+// bodies: each body is only checked for the first time it is needed. The
+// entries are kept in least recently used order, so eviction never has to
+// search them, and evicted bodies are deleted on a background thread.
+// Small bodies (see SetPackThreshold()) aren't given a file each, but are
+// appended to a few pack files, so that thousands of thumbnails and JSON
+// responses don't make for thousands of files to open, close and delete. A
+// pack whose bodies have mostly been replaced or evicted is compacted, a step
+// at a time, by moving the rest of them to the pack that is being appended to.
+// The index also keeps the permanent redirects that HttpClient has followed
+// (see HttpClientConfig::maxRedirects), and the URLs it has found missing (see
+// HttpClient::SetNegativeCacheTtl()), so that they last across launches.
+// All methods must be called from the app thread. The cache must outlive any
+// HttpClient that uses it.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HttpNegativeCache.h"
+#include "HttpRequest.h"
+#include "util/fileops.h"
+
+class HttpCache {
+public:
+	// folder is created if it doesn't exist. Once the bodies take up more than maxBytes, the least
+	// recently used responses are evicted.
+	HttpCache(const std::string& folder, uint64 maxBytes = 64 * 1024 * 1024);
+	~HttpCache(); // Saves the index
+
+	void SetMaxSize(uint64 maxBytes) { m_maxBytes = maxBytes; Evict(); }
+	// Bodies of up to maxBytes (32 KB by default) are stored in pack files; 0 gives every body a file of its own.
+	// Either way, the bodies that are already stored stay where they are.
+	void SetPackThreshold(uint64 maxBytes) { m_packThreshold = maxBytes; }
+	uint64 GetSize() const { return m_numBytes; } // Total size of the cached bodies
+	size_t GetNumEntries() const { return m_entries.size(); }
+	// Forget every response (apart from those that are being served right now):
+	void Clear();
+	// The index is kept in memory and written to disk by the destructor. Call Save() to write it
+	// sooner, e.g. when the app is suspended, as it may never be destroyed.
+	void Save();
+
+	/////// Internal methods used by HttpClient ///////
+	struct Entry {
+		std::string url;
+		std::map<std::string, std::string> vary; // Lower-case request header name -> value, for each header named by Vary
+		HttpHeaders headers; // The response headers
+		std::string etag, lastModified; // Validators for conditional requests; either may be empty
+		uint64 fileId; // The body is in "<folder>/<fileId>.body", unless it has been packed
+		uint64 size;
+		uint64 packId; // If non-zero, the body is bytes [offset, offset + size) of "<folder>/<packId>.pack" instead
+		uint64 offset;
+		uint64 storedMs; // UTC time at which the response was received or last revalidated
+		int64 maxAgeMs; // How long after storedMs it stays fresh
+		uint64 usedMs; // UTC time at which the response was last used, for eviction
+		uint pins; // Number of transfers that are reading the body right now
+		bool dead; // Replaced or evicted, but still pinned: deleted once the last transfer releases it
+		bool verified; // The body has been seen to exist since the index was loaded
+		Entry* pOlder; // In order of usedMs, for eviction (unless it is dead)
+		Entry* pNewer;
+	};
+	// Find the response to request, or nullptr. The result is pinned (so its body won't be deleted), and
+	// must be released with Release():
+	Entry* Acquire(HttpRequest& request);
+	void Release(Entry* pEntry);
+	// The most recently used fresh responses (up to maxEntries of them, of up to maxEntrySize bytes each, and
+	// maxBytes between them) that vary by no request header but Accept-Encoding, the most recent first, e.g. to
+	// preload them (see HttpClient::PreloadMemoryCache()). Each is pinned, as by Acquire(), and must be released.
+	void AcquireHottest(std::vector<Entry*>& entries, size_t maxEntries, uint64 maxEntrySize, uint64 maxBytes);
+	bool IsFresh(const Entry& entry) const;
+	std::string GetBodyPath(const Entry& entry) const; // (See Entry::packId for where in it the body is)
+	// A path that a new body can be written to, for Store():
+	std::string NewBodyPath(uint64& fileId);
+	// Store the response to request, whose body has been written to the path returned by NewBodyPath().
+	// Returns false (and the caller should delete the body) if the response can't be cached.
+	bool Store(HttpRequest& request, uint64 fileId, const HttpHeaders& responseHeaders);
+	// Update a cached response with the headers of a 304 Not Modified response, or mark it as used:
+	void Refresh(Entry* pEntry, const HttpHeaders& responseHeaders);
+	void Touch(Entry* pEntry);
+
+	// Parse a Cache-Control header (which may be nullptr). maxAgeMs is -1 if there is no max-age.
+	static void ParseCacheControl(const char* pCacheControl, int64& maxAgeMs, bool& noStore, bool& noCache);
+	// Bodies are cached as the request received them, i.e. after decompression, so a stored response
+	// mustn't claim to be compressed: this drops Content-Encoding, and the Content-Length that went with it.
+	static void StripContentEncoding(HttpHeaders& headers);
+
+	// Permanent redirects (301 and 308), by the URL they were from: where a GET for it ends up, or nullptr. Setting
+	// an empty target forgets it. Once there are MAX_REDIRECTS, setting another forgets one of the others.
+	enum { MAX_REDIRECTS = 256 };
+	const std::string* FindRedirect(const std::string& url) const;
+	void SetRedirect(const std::string& url, const std::string& target);
+	// URLs that are known to be missing (see HttpNegativeCache): the status a GET for it was answered with, or 0.
+	// Setting a status of 0 forgets it. The ones that have expired by the next launch aren't loaded.
+	int FindMissing(const std::string& url, uint64 nowUtcMs) const { return m_missing.Find(url, nowUtcMs); }
+	void SetMissing(const std::string& url, int statusCode, uint64 untilUtcMs);
+
+private:
+	typedef std::multimap<std::string, Entry> Entries; // By URL
+	enum {
+		MAX_PACK_SIZE = 4 * 1024 * 1024, // Once the pack that bodies are appended to is this big, another is started
+		COMPACT_STEP_BYTES = 256 * 1024  // How much of a pack that is being compacted each Store() and Save() moves
+	};
+	struct Pack {
+		uint64 size; // Bytes appended to it
+		uint64 liveBytes; // Of the bodies that entries (dead ones included) are in it for: once none are, it is deleted
+	};
+	typedef std::vector< std::pair<uint64, Ptr<FileOp> > > Deletions; // By file ID: the ones that m_deleter may not have finished
+	const std::string m_folder;
+	Entries m_entries;
+	std::map<std::string, std::string> m_redirects; // See FindRedirect()
+	HttpNegativeCache m_missing; // See FindMissing()
+	uint64 m_numBytes;
+	uint64 m_maxBytes;
+	uint64 m_nextFileId; // (Packs get their IDs from it too)
+	uint64 m_packThreshold;
+	std::map<uint64, Pack> m_packs; // By ID
+	uint64 m_currentPack; // The one that bodies are appended to, or 0 if the next body starts a new one
+	bool m_dirty; // The index has changed since it was last saved
+	Entry* m_pOldest; // The ends of the list in order of usedMs
+	Entry* m_pNewest;
+	FileOpQueue m_deleter; // Deletes the bodies of removed entries
+	Deletions m_deletions; // Bodies
+	Deletions m_packDeletions;
+
+	bool Matches(const Entry& entry, HttpRequest& request) const;
+	Entries::iterator Find(const Entry* pEntry);
+	void Remove(Entries::iterator it); // Deletes the entry, or marks it dead if it is pinned
+	void Evict();
+	void LinkNewest(Entry* pEntry);
+	void Unlink(Entry* pEntry);
+	void DeleteBody(uint64 fileId);
+	void DeletePack(uint64 packId);
+	void QueueDeletion(Deletions& deletions, uint64 fileId, const std::string& path);
+	void PruneDeletions();
+	bool PackBody(Entry& entry, const char* pData, size_t size);
+	void ReleasePackBytes(uint64 packId, uint64 size);
+	void Compact();
+	std::string GetPackPath(uint64 packId) const;
+	void Load();
+	void LoadLegacyIndex();
+	std::string GetIndexPath() const { return m_folder + "/index.bin"; }
+	std::string GetLegacyIndexPath() const { return m_folder + "/index.json"; } // Written by older versions
+};
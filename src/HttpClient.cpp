@@ -5,214 +5,1146 @@
 // Public domain
 
 #include "HttpClient.h"
+#include "HttpClientWorker.h"
+#include "HttpCpuPool.h"
+#include "HttpDiskWriter.h"
+#include "HttpMemoryBudget.h"
+#include "HttpMemoryDownload.h"
+#include "HttpRecording.h"
+#include "HttpTlsSessionCache.h"
+#include "HttpWorkPool.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
-#include <pthread.h>
-#include <curl/curl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include <IwMath.h>
+#include <s3eDevice.h>
+#include <s3eSocket.h>
+#include <s3eTimer.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
 #include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <algorithm>
 #include <stdexcept>
+#include "util/iohelpers.h"
 
 using std::string;
 
-// Data for the Worker threads - shared by the worker thread and the HttpClient master thread:
-//
-// Note: it's really important to understand that the worker threads and the app threads are
-// in totally different memory environments. They can each read each other's memory no problem
-// but they must never modify any non-POD data belonging to the other thread, or bad things happen.
-// This is because the app thread uses the s3e malloc/realloc/free pool, while the worker threads
-// use the system's default memory methods.
-// BWM: I tried changing the threads to use the same s3e memory methods, but it caused issues
-// on debug builds due to the high number of memory operations the worker threads make.
-//
-// All communication between worker threads and the app thread happens using the following struct:
-struct HttpClient_Worker {
-	const char* userAgent;
-	
-	CURL *pCurl; // Re-usable worker, created in app thread, modified by worker thread.
-	pthread_t thread_id;
-	Ptr<HttpRequest> pRequest; // Set by app thread; must never by modified when status is ACTIVE
-	pthread_cond_t wakeCond; // Condition used to wake the worker thread so that it will start the next job or quit.
-	pthread_mutex_t wakeMutex; // Mutex that gets locked when we access or modify wakeCond
-	volatile bool cancelAndQuit; // If set true by app thread, cancel and quit ASAP, interrupting downloads if needed.
-	volatile enum StatusCode {// Worker Status:
-		UNUSED, // initialized to UNUSED in app thread. This means the worker thread has not been created yet.
-		ACTIVE, // The worker thread is processing a request
-		DONE,   // The worker thread has finished processing a request. It has gone to sleep and is waiting for the app thread to finish processing the result.
-		CLEANUP,// The app thread has finished processing the result, and is now waking the worker thread up so it can cleanup and get ready for a new request.
-		READY   // The worker thread has completed and cleaned up its first request and is ready to process a new request.
-	} status;
-	// Response Headers: Managed by the worker thread as a super simple one-way linked list of key-value pairs:
-	volatile bool responseHeadersDone; // Set true by the worker once we've received the response headers
-	typedef HttpRequest::RH RH;
-	RH* pResponseHeaders; // The headers get stored in this linked list by the worker
-	CURLcode result; // CURL's result code. Should be CURLE_OK
-	long responseStatusCode; // Http response status code, e.g. 200
-	// The worker thread needs to reset this worker data instance before starting each request:
-	void Reset() { responseHeadersDone = false; RH* p_rh = pResponseHeaders; while(p_rh) { RH* del = p_rh; p_rh = p_rh->next; delete del; } pResponseHeaders = nullptr; responseStatusCode = 0; }
-	// Constructor and methods for use by the app thread:
-	HttpClient_Worker() : status(UNUSED), pRequest(nullptr), pCurl(nullptr), cancelAndQuit(false), pResponseHeaders(nullptr), responseHeadersDone(false), responseStatusCode(0), result(CURLE_OK) {}
-	void CancelAndQuit() { pthread_mutex_lock(&wakeMutex); cancelAndQuit = true; pthread_cond_signal(&wakeCond); pthread_mutex_unlock(&wakeMutex); /* Wake just in case we are currently sleeping */ }
-	void WakeToStatus(StatusCode sc) { pthread_mutex_lock(&wakeMutex); status = sc; pthread_cond_signal(&wakeCond); pthread_mutex_unlock(&wakeMutex); }
-};
-
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Our libcurl callbacks. We need to specify extern C since libcurl and pthreads expect C calling convention to be used.
 extern "C"  {
 
+// Hand response data to the request, keeping copies for the caches as needed:
+static size_t HttpClient_Worker_HandleData(HttpClient_Worker* pWorker, const unsigned char* contents, size_t size) {
+	HTTP_ALLOC_SCOPE(SITE_BODY, &pWorker->allocStats);
+	HttpWorkerArena::Scope arena_scope(pWorker->arena);
+	if (!pWorker->pRequest->Worker_CheckSize(size)) {
+		HTTP_LOG(pWorker->log, INFO, "HttpClient: Rejected the response to %s: over %u bytes", pWorker->pRequest->GetURL().c_str(), (uint)pWorker->pRequest->GetMaxResponseSize());
+		return 0; // (See HttpRequest::SetMaxResponseSize())
+	}
+	const size_t handled = pWorker->pRequest->Worker_HandleData(contents, size);
+	if (handled != size)
+		return handled;
+	if (!pWorker->pRequest->Worker_WriteSink(contents, size))
+		return 0;
+	pWorker->pRequest->Worker_AddDownloadedBytes(size);
+	if (HTTP_PROBES && !pWorker->tracedFirstByte) {
+		pWorker->tracedFirstByte = true;
+		pWorker->Trace(HttpTracer::EVENT_FIRST_BYTE);
+	}
+	const uint num_followers = pWorker->NumFollowers();
+	for (uint i = 0; i < num_followers; i++) {
+		// A follower that can't take the data just fails by itself:
+		if (!pWorker->followerFailed[i] && (!pWorker->followers[i]->Worker_CheckSize(size) || pWorker->followers[i]->Worker_HandleData(contents, size) != size
+			|| !pWorker->followers[i]->Worker_WriteSink(contents, size)))
+			pWorker->followerFailed[i] = true;
+		pWorker->followers[i]->Worker_AddDownloadedBytes(size);
+	}
+	if (pWorker->pCacheFile && s3eFileWrite(contents, 1, size, pWorker->pCacheFile) != size) {
+		// Not worth failing the request over; it just won't be cached:
+		s3eFileClose(pWorker->pCacheFile);
+		pWorker->pCacheFile = nullptr;
+		pWorker->cacheStoreFailed = true;
+	}
+	if (pWorker->memoryCacheLimit && !pWorker->memoryBodyTooBig) {
+		if (pWorker->memoryBody.size() + size > pWorker->memoryCacheLimit) {
+			pWorker->memoryBodyTooBig = true;
+			std::string().swap(pWorker->memoryBody);
+		} else {
+			pWorker->memoryBody.append((const char*)contents, size);
+		}
+	}
+	if (pWorker->recordTransfer) {
+		const HttpRecording::Chunk chunk = { (uint32)(HttpClient_NowMs() - pWorker->transferStartMs), (uint32)size };
+		pWorker->recordChunks.push_back(chunk);
+		pWorker->recordBody.append((const char*)contents, size);
+	}
+	return handled;
+}
+
+// Hand over what has been coalesced (see HttpClientConfig::coalesceBytes), if anything. Returns false if the request didn't take it:
+static bool HttpClient_Worker_FlushCoalesced(HttpClient_Worker* pWorker) {
+	std::vector<unsigned char>& coalesced = pWorker->coalesced;
+	if (coalesced.empty())
+		return true;
+	const bool handled = HttpClient_Worker_HandleData(pWorker, &coalesced[0], coalesced.size()) == coalesced.size();
+	coalesced.clear(); // (Keeping its capacity)
+	return handled;
+}
+
+// Collect pieces smaller than coalesceBytes into blocks of that size; anything bigger goes straight through:
+static size_t HttpClient_Worker_Coalesce(HttpClient_Worker* pWorker, const unsigned char* contents, size_t size) {
+	const size_t block_size = (size_t)pWorker->config.coalesceBytes;
+	std::vector<unsigned char>& coalesced = pWorker->coalesced;
+	size_t offset = 0;
+	if (!coalesced.empty()) {
+		offset = MIN(block_size - coalesced.size(), size);
+		coalesced.insert(coalesced.end(), contents, contents + offset); // (Never beyond the capacity reserved for it)
+		if (coalesced.size() >= block_size && !HttpClient_Worker_FlushCoalesced(pWorker))
+			return 0;
+	}
+	if (size - offset >= block_size)
+		return HttpClient_Worker_HandleData(pWorker, contents + offset, size - offset) == size - offset ? size : 0;
+	if (offset < size) {
+		if (coalesced.empty())
+			pWorker->coalescedSinceMs = HttpClient_NowMs();
+		coalesced.insert(coalesced.end(), contents + offset, contents + size);
+	}
+	return size;
+}
+
 static size_t HttpClient_WorkerThread_WriteCallback(void *contents, size_t size, size_t nmemb, void *_pWorker) {
 	HttpClient_Worker* pWorker = reinterpret_cast<HttpClient_Worker*>(_pWorker);
-	if (pWorker->cancelAndQuit)
+	HttpClient_CpuScope cpu_scope(pWorker);
+	if (pWorker->ShouldAbort())
 		return 0;
+	if (HttpClient_Worker_ShouldPause(pWorker)) {
+		// curl keeps this data, and passes it to us again once the progress callback has unpaused the transfer:
+		pWorker->paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
 	size_t realsize = size * nmemb;
-	return pWorker->pRequest->Worker_HandleData((const unsigned char*)contents, realsize);
+	if (pWorker->config.coalesceBytes > 0)
+		return HttpClient_Worker_Coalesce(pWorker, (const unsigned char*)contents, realsize);
+	return HttpClient_Worker_HandleData(pWorker, (const unsigned char*)contents, realsize);
 }
 
 static size_t HttpClient_WorkerThread_ReadCallback(void *data, size_t size, size_t nmemb, void *_pWorker) {
 	HttpClient_Worker* pWorker = reinterpret_cast<HttpClient_Worker*>(_pWorker);
-	if (pWorker->cancelAndQuit)
+	HttpClient_CpuScope cpu_scope(pWorker);
+	if (pWorker->ShouldAbort())
 		return CURL_READFUNC_ABORT;
 	size_t realsize = size * nmemb;
+	if (!pWorker->uploadStarted) {
+		pWorker->uploadStarted = true;
+		pWorker->timings.uploadWaitMs = (double)(HttpClient_NowMs() - pWorker->transferStartMs);
+	}
+	HTTP_ALLOC_SCOPE(SITE_REQUEST, &pWorker->allocStats);
 	return pWorker->pRequest->Worker_HandleUpload((const unsigned char*)data, realsize);
 }
 
+// At the end of a response's headers: whether curl is going to follow it as a redirect (see HttpClientConfig::maxRedirects),
+// in which case it skips the body, and the request only sees the response that the redirects end with. Also notes where a
+// chain of permanent redirects leads, for HttpClient's memo of them.
+static bool HttpClient_Worker_IsRedirectHop(HttpClient_Worker* pWorker, long statusCode) {
+	if (pWorker->numRedirectHops > 0 && pWorker->permanentHopsOnly && statusCode >= 200) {
+		const char* p_url = nullptr;
+		if (curl_easy_getinfo(pWorker->pCurl, CURLINFO_EFFECTIVE_URL, &p_url) == CURLE_OK && p_url)
+			pWorker->permanentUrl = p_url; // Where the permanent redirects so far have led
+	}
+	if (pWorker->config.maxRedirects <= 0 || statusCode < 300 || statusCode >= 400 || statusCode == 304 || !pWorker->responseHeaders.Find("Location"))
+		return false;
+	if (statusCode != 301 && statusCode != 308)
+		pWorker->permanentHopsOnly = false; // (What a temporary one leads to isn't for remembering, nor anything after it)
+	pWorker->numRedirectHops++;
+	HTTP_LOG(pWorker->log, VERBOSE, "HttpClient: Following a %ld redirect for %s", statusCode, pWorker->pRequest->GetURL().c_str());
+	return true;
+}
+
+// Start the sinks (see HttpRequest::SetSink()) of the request and its followers, for the response whose headers are
+// in. A follower whose sink can't take the body just fails by itself. Returns false if the request's can't.
+static bool HttpClient_Worker_OpenSinks(HttpClient_Worker* pWorker, int statusCode, uint numFollowers) {
+	for (uint i = 0; i < numFollowers; i++) {
+		if (!pWorker->followerFailed[i] && !pWorker->followers[i]->Worker_OpenSink(pWorker->responseHeaders, statusCode))
+			pWorker->followerFailed[i] = true;
+	}
+	if (pWorker->pRequest->Worker_OpenSink(pWorker->responseHeaders, statusCode))
+		return true;
+	HTTP_LOG(pWorker->log, WARNING, "HttpClient: The sink for %s can't take its response", pWorker->pRequest->GetURL().c_str());
+	return false;
+}
+
 static size_t HttpClient_WorkerThread_HeaderCallback(void *pHeader, size_t size, size_t nmemb, void *_pWorker) {
 	HttpClient_Worker* pWorker = reinterpret_cast<HttpClient_Worker*>(_pWorker);
-	if (pWorker->cancelAndQuit)
+	HttpClient_CpuScope cpu_scope(pWorker);
+	if (pWorker->ShouldAbort())
 		return 0;
 	size_t realsize = size * nmemb;
-	std::string header((const char*)pHeader, realsize);
+	HTTP_ALLOC_SCOPE(SITE_HEADERS, &pWorker->allocStats);
+	HttpWorkerArena::Scope arena_scope(pWorker->arena); // (The request may make room for its body once it knows how big it is)
 	// We want to store the response headers in the HttpRequest
 	// Tricky since we're in a different memory environment (on the worker thread).
 	// So for now we store the headers in pWorker, and let the HttpClient
 	// later copy them into the request, while on the app thread.
-	//s3eDebugTracePrintf("Header: %s", header.c_str());
-	if (header.size() >= 2 && header.substr(header.size()-2, 2) == "\r\n")
-		header.resize(header.size() - 2); // Drop the trailing \r\n
-	auto colon_pos = header.find(':');
-	if (header.empty()) {
+	// Each line is parsed where curl has put it, straight into the worker's header buffer.
+	const char* p_line = (const char*)pHeader;
+	size_t length = realsize;
+	while (length > 0 && (p_line[length - 1] == '\n' || p_line[length - 1] == '\r'))
+		length--; // Drop the trailing \r\n
+	if (length == 0) {
 		// This indicates the end of the headers.
-		//s3eDebugTracePrintf("ALL HEADERS RECEIVED");
-		pWorker->responseHeadersDone = true;
-	} else if (colon_pos != string::npos) {
-		string key = header.substr(0, colon_pos++);
-		while (header[colon_pos] == ' ')
-			colon_pos++;
-		string val = header.substr(colon_pos, header.size() - colon_pos);
-		pWorker->pResponseHeaders = new HttpClient_Worker::RH(key, val, pWorker->pResponseHeaders);
-	} else {
-		// This is probably the first line of the headers - e.g. 'HTTP/1.1 200 OK'
-		if (header.substr(0,4) == "HTTP") {
-			pWorker->pResponseHeaders = new HttpClient_Worker::RH("HTTP", header, pWorker->pResponseHeaders);
-		} else {
-			s3eDebugTracePrintf("HttpClient: Unexpected/invalid header: %s", header.c_str());
+		long status_code = 0;
+		curl_easy_getinfo(pWorker->pCurl, CURLINFO_RESPONSE_CODE, &status_code);
+		HTTP_LOG(pWorker->log, VERBOSE, "HttpClient: Headers received for %s (HTTP status %ld)", pWorker->pRequest->GetURL().c_str(), status_code);
+		if (HttpClient_Worker_IsRedirectHop(pWorker, status_code))
+			return realsize; // (The next response's status line clears these headers)
+		// Interim responses such as "100 Continue" have headers of their own, which the final response's status line
+		// clears in turn. The app thread mustn't take them for the response's (or read them while that happens): an
+		// upload that is slow to send, e.g. because of a speed limit, can leave a long gap before the final response.
+		if (status_code > 0 && status_code < 200)
+			return realsize;
+		if (status_code >= 200 && !pWorker->ClaimRequest())
+			return 0; // Hedging: the other worker sending this request got its response first
+		if (status_code == 304 && pWorker->cacheMode == HttpClient_Worker::CACHE_REVALIDATE) {
+			// Our cached copy is still good. As far as the request can tell, this is that 200 response:
+			// the cached headers are added to the 304's (which take precedence), and FinishRequest() supplies the body.
+			const HttpHeaders& cached = pWorker->cacheHeaders;
+			for (size_t i = 0; i < cached.Size(); i++) {
+				if (!pWorker->responseHeaders.Find(cached.GetName(i), cached.GetNameLength(i)))
+					pWorker->responseHeaders.Add(cached.GetName(i), cached.GetNameLength(i), cached.GetValue(i), cached.GetValueLength(i));
+			}
+			pWorker->cacheServed = true;
+			status_code = 200;
+		} else if (status_code == 200 && (pWorker->cacheMode == HttpClient_Worker::CACHE_STORE || pWorker->cacheMode == HttpClient_Worker::CACHE_REVALIDATE)) {
+			pWorker->pCacheFile = s3eFileOpen(pWorker->cacheStoreFile.c_str(), "w");
+			pWorker->cacheStoreFailed = !pWorker->pCacheFile;
+		}
+		if (status_code >= 200) {
+			// From now on, identical requests can't join in, as they'd miss the headers:
+			const uint num_followers = pWorker->CloseFollowers();
+			// Turn the body down now, if nobody wants it (see HttpRequest::SetMaxResponseSize()), rather than download it all
+			// before the app thread gets to look at the headers. A follower that doesn't want it just fails by itself:
+			for (uint i = 0; i < num_followers; i++) {
+				if (!pWorker->followerFailed[i] && pWorker->followers[i]->Worker_CheckResponse(pWorker->responseHeaders, (int)status_code) != HttpRequest::REJECTED_NONE)
+					pWorker->followerFailed[i] = true;
+			}
+			if (const HttpRequest::Rejection rejection = pWorker->pRequest->Worker_CheckResponse(pWorker->responseHeaders, (int)status_code)) {
+				HTTP_LOG(pWorker->log, INFO, "HttpClient: Rejected the response to %s (HTTP status %ld, reason %d)", pWorker->pRequest->GetURL().c_str(), status_code, (int)rejection);
+				pWorker->responseHeadersDone = true;
+				return 0; // (curl stops the transfer with CURLE_WRITE_ERROR)
+			}
+			if (!HttpClient_Worker_OpenSinks(pWorker, (int)status_code, num_followers)) {
+				pWorker->responseHeadersDone = true;
+				return 0;
+			}
+			pWorker->pRequest->Worker_HandleResponseHeaders(pWorker->responseHeaders, (int)status_code);
+			for (uint i = 0; i < num_followers; i++)
+				pWorker->followers[i]->Worker_HandleResponseHeaders(pWorker->responseHeaders, (int)status_code);
+			pWorker->Trace(HttpTracer::EVENT_HEADERS);
+			if (pWorker->recordTransfer)
+				pWorker->recordHeadersMs = (uint32)(HttpClient_NowMs() - pWorker->transferStartMs);
 		}
+		pWorker->responseHeadersDone = true;
+	} else if (!pWorker->responseHeaders.ParseLine(p_line, length)) {
+		// Neither a header nor a status line (e.g. 'HTTP/1.1 200 OK', which starts the headers of each response)
+		HTTP_LOG(pWorker->log, WARNING, "HttpClient: Unexpected/invalid header: %.*s", (int)length, p_line);
 	}
 	return realsize;
 }
 
+// Tell curl about any change to the worker's speed limits, when a transfer starts (the handle keeps its options from one
+// transfer to the next, so only if they differ from the last one's) and as it goes. curl only reads them between reads
+// and writes, so this is safe to do from within its callbacks. The options only come as curl_off_t (see "Curl patch notes" in the README).
+static void HttpClient_Worker_ApplySpeedLimits(HttpClient_Worker* pWorker) {
+	const uint64 recv_speed = atomic::LoadRelaxed(pWorker->maxRecvSpeed);
+	const uint64 send_speed = atomic::LoadRelaxed(pWorker->maxSendSpeed);
+	if (recv_speed != pWorker->appliedRecvSpeed) {
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)recv_speed);
+		pWorker->appliedRecvSpeed = recv_speed;
+	}
+	if (send_speed != pWorker->appliedSendSpeed) {
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t)send_speed);
+		pWorker->appliedSendSpeed = send_speed;
+	}
+}
+
+// Hand the worker's latest progress to its request and any followers:
+static void HttpClient_Worker_PublishProgress(HttpClient_Worker* pWorker, uint64 nowMs) {
+	const HttpRequest::Progress& progress = pWorker->progress;
+	// The request's progress has one writer: whichever worker owns it. The first worker claims it before publishing
+	// (having data to publish means it has a response anyway), so that a hedge can't claim it part way through an
+	// update and start writing too. A hedge leaves the progress to the first worker until it has claimed the response:
+	const bool owner = pWorker->hedgeRole == HttpClient_Worker::HEDGE_SECOND ? pWorker->OwnsRequest() : pWorker->ClaimRequest();
+	if (owner)
+		pWorker->pRequest->Worker_UpdateProgress(progress);
+	const uint num_followers = pWorker->NumFollowers();
+	for (uint i = 0; i < num_followers; i++)
+		pWorker->followers[i]->Worker_UpdateProgress(progress);
+	pWorker->publishedProgress = progress;
+	pWorker->publishedProgressMs = nowMs;
+}
+
 static int HttpClient_WorkerThread_ProgressCallback(void *_pWorker, double dltotal, double dlnow, double ultotal, double ulnow) {
 	HttpClient_Worker* pWorker = reinterpret_cast<HttpClient_Worker*>(_pWorker);
-	if (pWorker->cancelAndQuit)
+	if (pWorker->ShouldAbort())
 		return 1; // Return non-zero to indicate that we want to abort the transfer
-	//s3eDebugTracePrintf("Progress: %f/%f, %f/%f", ulnow, ultotal, dlnow, dltotal);
-	pWorker->pRequest->Worker_UpdateProgress(dltotal, dlnow, ultotal, ulnow);
-	// During the request, we should yield this thread from time to time, so the progress callback seems like a good chance:
-	s3eDeviceYield();
-	pthread_yield();
+	if (pWorker->paused && !HttpClient_Worker_ShouldPause(pWorker)) {
+		// The app has caught up (curl goes on calling us while the transfer is paused):
+		pWorker->paused = false;
+		curl_easy_pause(pWorker->pCurl, CURLPAUSE_CONT); // (Which may pass the held-back data to the write callback straight away)
+	}
+	HttpClient_Worker_ApplySpeedLimits(pWorker);
+	const uint64 now_ms = HttpClient_NowMs();
+	if (!pWorker->coalesced.empty() && now_ms - pWorker->coalescedSinceMs >= HttpClient_Worker::COALESCE_WAIT_MS && !HttpClient_Worker_ShouldPause(pWorker)
+		&& !HttpClient_Worker_FlushCoalesced(pWorker)) {
+		pWorker->coalesceFailed = true;
+		return 1;
+	}
+	// curl calls this for every read and write, which on a fast link is thousands of times a second, so only tell
+	// the request once progressIntervalMs have passed and progressMinBytes have moved since it was last told (or
+	// straight away, if the size of the transfer has become known, or it has all been sent and received):
+	HttpRequest::Progress& progress = pWorker->progress;
+	const HttpRequest::Progress& published = pWorker->publishedProgress;
+	progress.downloadBytesNow = dlnow;
+	progress.downloadBytesTotal = dltotal;
+	progress.uploadBytesNow = ulnow;
+	progress.uploadBytesTotal = ultotal;
+	const double moved = (dlnow - published.downloadBytesNow) + (ulnow - published.uploadBytesNow);
+	const bool totals_changed = dltotal != published.downloadBytesTotal || ultotal != published.uploadBytesTotal;
+	const bool complete = (dltotal > 0 && dlnow == dltotal && published.downloadBytesNow != dlnow) || (ultotal > 0 && ulnow == ultotal && published.uploadBytesNow != ulnow);
+	if (totals_changed || complete || (moved > 0 && moved >= pWorker->progressMinBytes && now_ms - pWorker->publishedProgressMs >= pWorker->progressIntervalMs))
+		HttpClient_Worker_PublishProgress(pWorker, now_ms);
+	// A worker thread should yield from time to time during the request, and this is a good chance, but doing so
+	// on every call costs a lot of throughput. (The I/O threads of ENGINE_MULTI yield in their own loop instead.)
+	if (!pWorker->IsMulti() && now_ms - pWorker->yieldedMs >= HttpClient_Worker::YIELD_INTERVAL_MS) {
+		pWorker->yieldedMs = now_ms;
+		s3eDeviceYield();
+		pthread_yield();
+	}
 	return 0;
 }
 
-static void* HttpClient_WorkerThread(void *_pWorker) {
-	HttpClient_Worker* pWorker = reinterpret_cast<HttpClient_Worker*>(_pWorker);
-	
+static void HttpClient_Share_Lock(CURL *pCurl, curl_lock_data data, curl_lock_access access, void *_pShare) {
+	pthread_mutex_lock(&reinterpret_cast<HttpClient_Share*>(_pShare)->locks[data]);
+}
+
+static void HttpClient_Share_Unlock(CURL *pCurl, curl_lock_data data, void *_pShare) {
+	pthread_mutex_unlock(&reinterpret_cast<HttpClient_Share*>(_pShare)->locks[data]);
+}
+
+static void* HttpClient_Share_Init(void *_pShare) {
+	HttpClient_Share* pShare = reinterpret_cast<HttpClient_Share*>(_pShare);
+	pShare->pShare = curl_share_init();
+	if (!pShare->pShare)
+		return 0;
+	curl_share_setopt(pShare->pShare, CURLSHOPT_LOCKFUNC, HttpClient_Share_Lock);
+	curl_share_setopt(pShare->pShare, CURLSHOPT_UNLOCKFUNC, HttpClient_Share_Unlock);
+	curl_share_setopt(pShare->pShare, CURLSHOPT_USERDATA, pShare);
+	curl_share_setopt(pShare->pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(pShare->pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	// Connection sharing is not supported by older versions of libcurl (including the
+	// vendored 7.34), in which case this fails harmlessly and each handle (or multi handle)
+	// keeps its own connection cache.
+	curl_share_setopt(pShare->pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	return 0;
+}
+
+static void* HttpClient_Share_Cleanup(void *_pShare) {
+	HttpClient_Share* pShare = reinterpret_cast<HttpClient_Share*>(_pShare);
+	if (pShare->pCookies)
+		curl_easy_cleanup(pShare->pCookies);
+	pShare->pCookies = nullptr;
+	if (pShare->pShare)
+		curl_share_cleanup(pShare->pShare);
+	pShare->pShare = nullptr;
+	return 0;
+}
+
+// The cookie jar (see HttpClient::EnableCookies()). curl keeps it in the share, so the app thread works on it
+// through the share's cookie handle, in the worker memory environment:
+struct HttpClient_CookieOp {
+	HttpClient_Share* pShare;
+	char* pLines; // For HttpClient_Cookies_Load(): a file's contents (null-terminated), cut into lines in place
+	const char* command; // For HttpClient_Cookies_Command(): "ALL" or "SESS"
+	curl_slist* pCookies; // From HttpClient_Cookies_Get(), until HttpClient_Cookies_Free()
+	bool ok;
+	HttpClient_CookieOp(HttpClient_Share* pShare) : pShare(pShare), pLines(nullptr), command(nullptr), pCookies(nullptr), ok(false) {}
+};
+
+static void* HttpClient_Cookies_Enable(void* _pOp) {
+	HttpClient_CookieOp* p_op = reinterpret_cast<HttpClient_CookieOp*>(_pOp);
+	HttpClient_Share* p_share = p_op->pShare;
+	if (!p_share->pShare || curl_share_setopt(p_share->pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE) != CURLSHE_OK)
+		return 0;
+	p_share->pCookies = curl_easy_init();
+	if (p_share->pCookies)
+		p_op->ok = curl_easy_setopt(p_share->pCookies, CURLOPT_SHARE, p_share->pShare) == CURLE_OK;
+	return 0;
+}
+
+static void* HttpClient_Cookies_Load(void* _pOp) {
+	HttpClient_CookieOp* p_op = reinterpret_cast<HttpClient_CookieOp*>(_pOp);
+	for (char* p_line = p_op->pLines; *p_line;) {
+		char* p_end = strchr(p_line, '\n');
+		char* p_next = p_end ? p_end + 1 : p_line + strlen(p_line);
+		if (!p_end)
+			p_end = p_next;
+		if (p_end > p_line && p_end[-1] == '\r')
+			p_end--;
+		*p_end = '\0';
+		if (*p_line) // (curl skips the comments, but not the "#HttpOnly_" lines)
+			curl_easy_setopt(p_op->pShare->pCookies, CURLOPT_COOKIELIST, p_line);
+		p_line = p_next;
+	}
+	return 0;
+}
+
+static void* HttpClient_Cookies_Command(void* _pOp) {
+	HttpClient_CookieOp* p_op = reinterpret_cast<HttpClient_CookieOp*>(_pOp);
+	curl_easy_setopt(p_op->pShare->pCookies, CURLOPT_COOKIELIST, p_op->command);
+	return 0;
+}
+
+static void* HttpClient_Cookies_Get(void* _pOp) {
+	HttpClient_CookieOp* p_op = reinterpret_cast<HttpClient_CookieOp*>(_pOp);
+	p_op->ok = curl_easy_getinfo(p_op->pShare->pCookies, CURLINFO_COOKIELIST, &p_op->pCookies) == CURLE_OK;
+	return 0;
+}
+
+static void* HttpClient_Cookies_Free(void* _pOp) {
+	HttpClient_CookieOp* p_op = reinterpret_cast<HttpClient_CookieOp*>(_pOp);
+	curl_slist_free_all(p_op->pCookies);
+	p_op->pCookies = nullptr;
+	return 0;
+}
+
+// Looking up the hosts that SetDnsSnapshot() loaded again, on a thread of its own, so that their addresses are fresh
+// by the time the snapshot's run out. Plain data, which the thread fills in; the app thread reads it once done is set:
+struct HttpClient_HostRefresh {
+	enum { MAX_HOSTS = 16 };
+	struct Host {
+		char name[256];
+		uint port;
+		char addresses[128]; // Comma separated, or "" if the lookup failed
+	};
+	Host hosts[MAX_HOSTS];
+	uint numHosts;
+	pthread_t threadId;
+	volatile uint done;
+	HttpClient_HostRefresh() : numHosts(0), done(0) {}
+};
+
+static void* HttpClient_HostRefresh_Main(void* _pRefresh) {
+	HttpClient_HostRefresh* p_refresh = reinterpret_cast<HttpClient_HostRefresh*>(_pRefresh);
+	for (uint i = 0; i < p_refresh->numHosts; i++) {
+		HttpClient_HostRefresh::Host& host = p_refresh->hosts[i];
+		host.addresses[0] = '\0';
+		// IPv4 only, with gethostbyname(), as the bundled libcurl resolves on Marmalade:
+		const hostent* p_entry = gethostbyname(host.name);
+		if (!p_entry || p_entry->h_addrtype != AF_INET || p_entry->h_length != 4)
+			continue;
+		size_t length = 0;
+		for (char** p_address = p_entry->h_addr_list; *p_address; p_address++) {
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(*p_address);
+			char address[20];
+			const int address_length = snprintf(address, sizeof(address), "%s%u.%u.%u.%u", length ? "," : "", p[0], p[1], p[2], p[3]);
+			if (length + address_length >= sizeof(host.addresses))
+				break;
+			memcpy(host.addresses + length, address, address_length + 1);
+			length += address_length;
+		}
+	}
+	atomic::StoreRelease(p_refresh->done, 1u);
+	return 0;
+}
+
+// The CA certificates passed to GlobalInit(), parsed once and shared (read only) by every handle:
+static X509_STORE* s_pCaStore = nullptr;
+
+struct HttpClient_CaBundle {
+	const void* pData;
+	size_t size;
+	X509_STORE* pStore;
+	int numCerts;
+};
+
+// Parse a PEM bundle into a new X509_STORE. Run in the worker environment, since that's where
+// OpenSSL will be using (and adding to the reference count of) the store.
+static void* HttpClient_CaBundle_Parse(void* _pBundle) {
+	HttpClient_CaBundle* pBundle = reinterpret_cast<HttpClient_CaBundle*>(_pBundle);
+	pBundle->pStore = nullptr;
+	pBundle->numCerts = 0;
+	BIO* p_bio = BIO_new_mem_buf(const_cast<void*>(pBundle->pData), (int)pBundle->size);
+	X509_STORE* p_store = p_bio ? X509_STORE_new() : nullptr;
+	if (p_store) {
+		while (X509* p_cert = PEM_read_bio_X509(p_bio, nullptr, nullptr, nullptr)) {
+			if (X509_STORE_add_cert(p_store, p_cert))
+				pBundle->numCerts++;
+			X509_free(p_cert);
+		}
+		ERR_clear_error(); // The end of the bundle is reported as an error
+		if (pBundle->numCerts)
+			pBundle->pStore = p_store;
+		else
+			X509_STORE_free(p_store);
+	}
+	if (p_bio)
+		BIO_free(p_bio);
+	return 0;
+}
+
+static void* HttpClient_FreeReleasedBuffers(void*) {
+	HttpBuffer::Worker_FreeReleased();
+	return 0;
+}
+
+static void* HttpClient_CaBundle_Free(void* pStore) {
+	X509_STORE_free(reinterpret_cast<X509_STORE*>(pStore));
+	return 0;
+}
+
+static string s_tlsSessionCacheFile; // See HttpClient::SetTlsSessionCacheFile()
+
+// Called by curl for every new SSL connection, before the handshake. The SSL_CTX takes a reference to
+// the shared store (freeing the SSL_CTX releases it), so the store itself is only freed by GlobalCleanup().
+static CURLcode HttpClient_Worker_SslCtx(CURL* pCurl, void* pSslCtx, void*) {
+	SSL_CTX* p_ctx = reinterpret_cast<SSL_CTX*>(pSslCtx);
+	if (X509_STORE* p_store = s_pCaStore) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		X509_STORE_up_ref(p_store);
+#else
+		CRYPTO_add(&p_store->references, 1, CRYPTO_LOCK_X509_STORE);
+#endif
+		SSL_CTX_set_cert_store(p_ctx, p_store);
+	}
+	HttpTlsSessionCache::Install(p_ctx);
+	return CURLE_OK;
+}
+
+// Called by curl for every socket it opens, before connecting (see HttpClientConfig::receiveBufferSize):
+static int HttpClient_Worker_SockOpt(void* pData, curl_socket_t socket, curlsocktype purpose) {
+	HttpClient_Worker* p_worker = reinterpret_cast<HttpClient_Worker*>(pData);
+	const int size = p_worker->config.receiveBufferSize;
+	if (purpose == CURLSOCKTYPE_IPCXN && size > 0 && setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size)) != 0)
+		HTTP_LOG(p_worker->log, WARNING, "HttpClient: Unable to set the socket's receive buffer to %d bytes", size); // (Not worth failing the transfer for)
+	return CURL_SOCKOPT_OK;
+}
+
+} // End of extern "C"
+
+void HttpClient_RunInWorkerEnvironment(void* (*fn)(void*), void* arg) {
+	pthread_t thread_id;
+	if (pthread_create(&thread_id, nullptr, fn, arg) != 0)
+		throw std::runtime_error("Unable to spawn a HttpClient helper thread.");
+	pthread_join(thread_id, nullptr);
+}
+
+int HttpClient_CreateThread(pthread_t& threadId, const HttpThreadOptions& options, void* (*fn)(void*), void* arg) {
+	if (!options.stackSize)
+		return pthread_create(&threadId, nullptr, fn, arg);
+	static const size_t STACK_GRANULE = 16 * 1024; // (Some platforms want a multiple of the page size; this is one of all the usual ones)
+	size_t stack_size = (options.stackSize + STACK_GRANULE - 1) / STACK_GRANULE * STACK_GRANULE;
+#ifdef PTHREAD_STACK_MIN
+	stack_size = MAX(stack_size, (size_t)PTHREAD_STACK_MIN);
+#endif
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (pthread_attr_setstacksize(&attr, stack_size) != 0)
+		s3eDebugTracePrintf("HttpClient: Unable to set a stack size of %u bytes; using the default", (uint)stack_size);
+	const int result = pthread_create(&threadId, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return result;
+}
+
+void HttpClient_ApplyThreadOptions(const HttpThreadOptions& options, HttpLogRing& log) {
+#ifdef __linux__
+	// Linux (and so Android) schedules each thread as a task of its own, with its own nice value and affinity:
+	const pid_t tid = (pid_t)syscall(SYS_gettid);
+	if (options.setNiceness && setpriority(PRIO_PROCESS, tid, options.niceness) != 0)
+		HTTP_LOG(log, WARNING, "HttpClient: Unable to set a worker thread's niceness to %d (errno %d)", options.niceness, errno);
+	if (options.cpuMask) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (uint i = 0; i < 32; i++) {
+			if (options.cpuMask & (1u << i))
+				CPU_SET(i, &cpus);
+		}
+		if (sched_setaffinity(tid, sizeof(cpus), &cpus) != 0)
+			HTTP_LOG(log, WARNING, "HttpClient: Unable to set a worker thread's CPUs to 0x%x (errno %d)", (uint)options.cpuMask, errno);
+	}
+#else
+	if (options.setNiceness || options.cpuMask)
+		HTTP_LOG(log, INFO, "HttpClient: Thread priorities and CPUs can't be set on this platform; ignoring them");
+#endif
+}
+
+void HttpClient_Worker_InitHandle(HttpClient_Worker* pWorker) {
 	pWorker->pCurl = curl_easy_init();
 	curl_easy_setopt(pWorker->pCurl, CURLOPT_USERAGENT, pWorker->userAgent);
+	// Several of these handles resolve and time out at once, so curl must not use signals (SIGALRM) for that:
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_NOSIGNAL, 1L);
+	if (pWorker->pShare && pWorker->pShare->pShare)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_SHARE, pWorker->pShare->pShare);
+	if (pWorker->pShare && pWorker->pShare->pCookies)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_COOKIEFILE, ""); // Turns the cookie engine on (for the share's cookies): no file to read
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_REDIR_PROTOCOLS, (long)(CURLPROTO_HTTP | CURLPROTO_HTTPS)); // (When following redirects)
 	
-	// SSL: certificates must be configured correctly (not done out of the box by us),
+	// SSL: certificates must be configured correctly, e.g. by passing a CA bundle to GlobalInit(),
+	// whose certificates are then used instead of curl's own (file based) CA settings,
 	// OR for testing purposes, you can disable peer certificate verification with this 
 	// line (obviously, this is insecure and should not be used in production apps):
 	//curl_easy_setopt(pWorker->pCurl, CURLOPT_SSL_VERIFYPEER, 0L);
+	if (s_pCaStore) {
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_CAINFO, (const char*)nullptr);
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_CAPATH, (const char*)nullptr);
+	}
+	if (s_pCaStore || HttpTlsSessionCache::IsEnabled())
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_SSL_CTX_FUNCTION, HttpClient_Worker_SslCtx);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_SOCKOPTFUNCTION, HttpClient_Worker_SockOpt);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_SOCKOPTDATA, pWorker);
+	// The callbacks, which link the transfers to the HttpRequest virtuals. The read callback is only called for POST and PUT:
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_WRITEFUNCTION, HttpClient_WorkerThread_WriteCallback);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_WRITEDATA, pWorker);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_HEADERFUNCTION, HttpClient_WorkerThread_HeaderCallback);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_HEADERDATA, pWorker);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_READFUNCTION, HttpClient_WorkerThread_ReadCallback);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_READDATA, pWorker);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_PROGRESSFUNCTION, HttpClient_WorkerThread_ProgressCallback);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_PROGRESSDATA, pWorker);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_NOPROGRESS, 0L);
+	pWorker->ForgetHandleOptions(); // Everything else is set by HttpClient_Worker_BeginRequest(), as each request needs it
+}
+
+// Add a node to the worker's request header list for each of headers, apart from those that pExcept has:
+static void HttpClient_Worker_AddRequestHeaders(HttpClient_Worker* pWorker, const HttpHeaders& headers, const HttpHeaders* pExcept) {
+	for (size_t i = 0; i < headers.Size(); i++) {
+		if (pExcept && pExcept->Find(headers.GetName(i), headers.GetNameLength(i)))
+			continue;
+		curl_slist node;
+		node.data = const_cast<char*>(headers.GetLine(i));
+		node.next = nullptr; // (Linked once they're all in place)
+		pWorker->requestHeaderList.push_back(node);
+	}
+}
+
+// Set one of the options that HttpClient_Worker::handleOptions keeps track of, if it has changed:
+static void HttpClient_Worker_SetOption(HttpClient_Worker* pWorker, HttpClient_Worker::HandleOption option, CURLoption curlOption, long value) {
+	if (pWorker->handleOptions[option] != value) {
+		curl_easy_setopt(pWorker->pCurl, curlOption, value);
+		pWorker->handleOptions[option] = value;
+	}
+}
+
+// Format a size for a header without printf, whose handling of 64-bit varargs can't be trusted on some Marmalade
+// toolchains (see "Curl patch notes" in the README). Returns the number of digits written to pOut (at least 21 chars):
+static size_t HttpClient_FormatSize(uint64 size, char* pOut) {
+	char digits[20];
+	size_t num_digits = 0;
+	do {
+		digits[num_digits++] = (char)('0' + size % 10);
+		size /= 10;
+	} while (size);
+	for (size_t i = 0; i < num_digits; i++)
+		pOut[i] = digits[num_digits - 1 - i];
+	pOut[num_digits] = '\0';
+	return num_digits;
+}
+
+// Unless the request has set them itself, add the headers that describe a POST or PUT body to the worker's:
+// its Content-Length, which curl 7.34 (as patched) would truncate to 32 bits, or if its size isn't known, a
+// chunked transfer (which curl only does by itself for a PUT); and any Expect that HttpRequest::SetExpectContinue()
+// or the client's policy asks for. An empty "Expect:" stops curl adding its own "Expect: 100-continue".
+static void HttpClient_Worker_AddUploadHeaders(HttpClient_Worker* pWorker, int64 uploadSize) {
+	const HttpHeaders& own = pWorker->pRequest->GetRequestHeaders();
+	HttpHeaders& headers = pWorker->transferHeaders;
+	if (uploadSize >= 0) {
+		if (!own.Find("Content-Length")) {
+			char length[24];
+			headers.Add("Content-Length", 14, length, HttpClient_FormatSize((uint64)uploadSize, length));
+		}
+	} else if (!own.Find("Transfer-Encoding")) {
+		headers.Add("Transfer-Encoding", 17, "chunked", 7);
+	}
+	HttpRequest::ExpectContinue expect = pWorker->pRequest->GetExpectContinue();
+	if (expect == HttpRequest::EXPECT_CONTINUE_DEFAULT && pWorker->expectContinueMinSize >= 0) // See HttpClient::SetExpectContinuePolicy()
+		expect = uploadSize < 0 || uploadSize >= pWorker->expectContinueMinSize ? HttpRequest::EXPECT_CONTINUE_ALWAYS : HttpRequest::EXPECT_CONTINUE_NEVER;
+	if (expect != HttpRequest::EXPECT_CONTINUE_DEFAULT && !own.Find("Expect")) {
+		if (expect == HttpRequest::EXPECT_CONTINUE_ALWAYS)
+			headers.Add("Expect", 6, "100-continue", 12);
+		else
+			headers.Add("Expect", 6, "", 0);
+	}
+}
+
+// Switch the handle to the request's method, undoing what the last one set up that this one would inherit:
+static void HttpClient_Worker_SetMethod(HttpClient_Worker* pWorker, HttpRequest::Method method) {
+	const long previous = pWorker->handleOptions[HttpClient_Worker::OPT_METHOD];
+	if (previous == method)
+		return;
+	if (previous == HttpRequest::POST)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_POSTFIELDSIZE, -1L);
+	else if (previous == HttpRequest::PUT)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_INFILESIZE, -1L);
+	else if (previous == HttpRequest::DELETE)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_CUSTOMREQUEST, nullptr);
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_HTTPGET, 1L); // Back to a plain GET, which also clears CURLOPT_NOBODY and CURLOPT_UPLOAD
+	if (method == HttpRequest::HEAD)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_NOBODY, 1L);
+	else if (method == HttpRequest::PUT)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_UPLOAD, 1L);
+	else if (method == HttpRequest::POST)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_POST, 1L);
+	else if (method == HttpRequest::DELETE)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_CUSTOMREQUEST, "DELETE"); // (A GET otherwise, which has no body either)
+	pWorker->handleOptions[HttpClient_Worker::OPT_METHOD] = method;
+}
+
+void HttpClient_Worker_BeginRequest(HttpClient_Worker* pWorker) {
+	const Ptr<HttpRequest>& pRequest = pWorker->pRequest; // Note, it's very important that we don't change the HttpRequest object's reference count from this thread
+	HTTP_ALLOC_SCOPE(SITE_REQUEST, &pWorker->allocStats);
+	pWorker->transferStartMs = HttpClient_NowMs();
+	pWorker->uploadStarted = false;
+
+	// The handle keeps its options from one transfer to the next, so we only set those that have changed
+	// (see HttpClient_Worker::handleOptions), apart from the URL:
+	HttpClient_Worker_SetMethod(pWorker, pRequest->GetMethod());
+	curl_easy_setopt(pWorker->pCurl, CURLOPT_URL, pWorker->transferUrl.empty() ? pRequest->GetURL().c_str() : pWorker->transferUrl.c_str());
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_FOLLOW_LOCATION, CURLOPT_FOLLOWLOCATION, pWorker->config.maxRedirects > 0 ? 1L : 0L);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_MAX_REDIRS, CURLOPT_MAXREDIRS, pWorker->config.maxRedirects > 0 ? (long)pWorker->config.maxRedirects : -1L);
+	pWorker->numRedirectHops = 0;
+	pWorker->permanentHopsOnly = true;
+	pWorker->permanentUrl.clear();
+	// "" asks for every encoding that curl can decode (gzip and deflate, since it is built with zlib); the data is
+	// decompressed before it reaches the write callback:
+	if (pWorker->handleOptions[HttpClient_Worker::OPT_ACCEPT_ENCODING] != (long)pWorker->acceptEncoding) {
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_ACCEPT_ENCODING, pWorker->acceptEncoding ? "" : nullptr);
+		pWorker->handleOptions[HttpClient_Worker::OPT_ACCEPT_ENCODING] = pWorker->acceptEncoding;
+	}
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_DNS_CACHE_TIMEOUT, CURLOPT_DNS_CACHE_TIMEOUT, pWorker->dnsCacheTtl);
+	if (pWorker->appliedHostListVersion != pWorker->hostListVersion) {
+		const HttpHostTable::List* p_hosts = pWorker->pHostList.ptr();
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_RESOLVE, p_hosts ? p_hosts->GetList() : nullptr);
+		pWorker->appliedHostListVersion = pWorker->hostListVersion;
+	}
+	// Connection settings (see HttpClient::SetConfig()). The receive buffer is set by HttpClient_Worker_SockOpt():
+	const HttpClientConfig& config = pWorker->config;
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_CONNECT_TIMEOUT, CURLOPT_CONNECTTIMEOUT_MS, config.connectTimeoutMs);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_LOW_SPEED_LIMIT, CURLOPT_LOW_SPEED_LIMIT, config.lowSpeedLimit);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_LOW_SPEED_TIME, CURLOPT_LOW_SPEED_TIME, config.lowSpeedTimeS);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_TCP_NODELAY, CURLOPT_TCP_NODELAY, config.tcpNoDelay ? 1L : 0L);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_TCP_KEEPALIVE, CURLOPT_TCP_KEEPALIVE, config.tcpKeepAlive ? 1L : 0L);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_TCP_KEEPIDLE, CURLOPT_TCP_KEEPIDLE, config.keepAliveIdleS);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_TCP_KEEPINTVL, CURLOPT_TCP_KEEPINTVL, config.keepAliveIntervalS);
+	static const long s_ip_resolve[] = { CURL_IPRESOLVE_WHATEVER, CURL_IPRESOLVE_V4, CURL_IPRESOLVE_V6 };
+	const uint family = (uint)config.addressFamily < sizeof(s_ip_resolve) / sizeof(s_ip_resolve[0]) ? config.addressFamily : HttpClientConfig::ADDRESS_ANY;
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_IP_RESOLVE, CURLOPT_IPRESOLVE, s_ip_resolve[family]);
+#if LIBCURL_VERSION_NUM >= 0x073b00 // (7.59, which made the head start configurable; 7.34's is always 200 ms)
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_HAPPY_EYEBALLS, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, config.happyEyeballsMs > 0 ? config.happyEyeballsMs : 200L);
+#endif
+	// curl 7.34 can't limit how long a connection is reused for, so we go by when this worker last connected:
+	const bool too_old = config.maxConnectionAgeS > 0 && pWorker->connectedMs
+		&& HttpClient_NowMs() - pWorker->connectedMs >= (uint64)config.maxConnectionAgeS * 1000;
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_FRESH_CONNECT, CURLOPT_FRESH_CONNECT, too_old ? 1L : 0L);
+	HttpClient_Worker_SetOption(pWorker, HttpClient_Worker::OPT_BUFFER_SIZE, CURLOPT_BUFFERSIZE, config.curlBufferSize > 0 ? (long)config.curlBufferSize : (long)CURL_MAX_WRITE_SIZE);
+	// A buffer for coalescing, big enough that it never grows during the transfer (or none, if it doesn't coalesce):
+	IwAssert(HTTP_CLIENT, pWorker->coalesced.empty());
+	if (config.coalesceBytes > 0)
+		pWorker->coalesced.reserve((size_t)config.coalesceBytes);
+	else if (pWorker->coalesced.capacity())
+		std::vector<unsigned char>().swap(pWorker->coalesced);
 	
-	while (!pWorker->cancelAndQuit) {
-		const Ptr<HttpRequest>& pRequest = pWorker->pRequest; // Note, it's very important that we don't change the HttpRequest object's reference count from this thread
-
-		// Set request type:
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_HTTPGET, pRequest->GetMethod() == HttpRequest::GET ? 1L : 0L);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_NOBODY, pRequest->GetMethod() == HttpRequest::HEAD ? 1L : 0L);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_UPLOAD, pRequest->GetMethod() == HttpRequest::PUT ? 1L : 0L);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_POST, pRequest->GetMethod() == HttpRequest::POST ? 1L : 0L);
-		// Set the URL:
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_URL, pRequest->GetURL().c_str());
-		
-		// Set the request headers
-		curl_slist *p_hdr_list = nullptr;
-		for (auto it = pWorker->pRequest->GetRequestHeaders().begin(); it != pWorker->pRequest->GetRequestHeaders().end(); it++) {
-			p_hdr_list = curl_slist_append(p_hdr_list, string(it->first).append(": ").append(it->second).c_str());
-		}
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_HTTPHEADER, p_hdr_list);
-
-		// Set callbacks, link them to the HttpRequest virtuals
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_WRITEFUNCTION, HttpClient_WorkerThread_WriteCallback);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_WRITEDATA, _pWorker);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_HEADERFUNCTION, HttpClient_WorkerThread_HeaderCallback);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_HEADERDATA, _pWorker);
-		
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_PROGRESSFUNCTION, HttpClient_WorkerThread_ProgressCallback);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_PROGRESSDATA, _pWorker);
-		curl_easy_setopt(pWorker->pCurl, CURLOPT_NOPROGRESS, 0L);
-		
-		if (pRequest->GetMethod() == HttpRequest::POST) {
-			curl_easy_setopt(pWorker->pCurl, CURLOPT_READFUNCTION, HttpClient_WorkerThread_ReadCallback);
-			curl_easy_setopt(pWorker->pCurl, CURLOPT_READDATA, _pWorker);
-			curl_easy_setopt(pWorker->pCurl, CURLOPT_POSTFIELDSIZE, pWorker->pRequest->Worker_GetUploadSize());
+	// Set the request headers. curl only reads the list, so rather than building one with curl_slist_append() (two
+	// allocations per header), we point our own nodes at the "Name: value" lines that the headers are kept as, and
+	// finish with the HttpClient's default headers, which are compiled into a list of their own once for every request:
+	IwAssert(HTTP_CLIENT, pWorker->requestHeaderList.empty() && pWorker->transferHeaders.Empty());
+	if (pWorker->cacheMode == HttpClient_Worker::CACHE_REVALIDATE) {
+		// Only send us the response if it has changed since we cached it:
+		if (!pWorker->cacheETag.empty())
+			pWorker->transferHeaders.Add("If-None-Match", pWorker->cacheETag);
+		if (!pWorker->cacheLastModified.empty())
+			pWorker->transferHeaders.Add("If-Modified-Since", pWorker->cacheLastModified);
+	}
+	const bool is_post = pRequest->GetMethod() == HttpRequest::POST;
+	const bool is_upload = is_post || pRequest->GetMethod() == HttpRequest::PUT;
+	if (is_upload)
+		pRequest->Worker_PrepareUpload();
+	const int64 upload_size = is_upload ? pRequest->Worker_GetUploadSize() : 0;
+	if (is_upload)
+		HttpClient_Worker_AddUploadHeaders(pWorker, upload_size);
+	HttpClient_Worker_AddRequestHeaders(pWorker, pRequest->GetRequestHeaders(), nullptr);
+	HttpClient_Worker_AddRequestHeaders(pWorker, pWorker->transferHeaders, nullptr);
+	const HttpHeaderTemplate* p_defaults = pRequest->GetDefaultHeaders();
+	curl_slist* p_tail = p_defaults ? p_defaults->GetList() : nullptr;
+	if (p_tail && p_defaults->IsOverriddenBy(pRequest->GetRequestHeaders())) {
+		// The request replaces some of the defaults, so we need our own nodes for the rest:
+		HttpClient_Worker_AddRequestHeaders(pWorker, p_defaults->GetHeaders(), &pRequest->GetRequestHeaders());
+		p_tail = nullptr;
+	}
+	std::vector<curl_slist>& list = pWorker->requestHeaderList;
+	for (size_t i = 0; i < list.size(); i++)
+		list[i].next = i + 1 < list.size() ? &list[i + 1] : p_tail;
+	const curl_slist* p_headers = list.empty() ? p_tail : &list[0];
+	if (p_headers != pWorker->pHandleHeaders) { // (Often the same: the default headers alone, or our own nodes in the same place as last time)
+		curl_easy_setopt(pWorker->pCurl, CURLOPT_HTTPHEADER, p_headers);
+		pWorker->pHandleHeaders = p_headers;
+	}
+
+	pWorker->progress = pWorker->publishedProgress = HttpRequest::Progress(); // As the request's own, since it is new or requeued
+	pWorker->publishedProgressMs = 0;
+	HttpClient_Worker_ApplySpeedLimits(pWorker);
+	
+	if (is_upload) {
+		// Passing a curl_off_t through curl_easy_setopt()'s varargs is unreliable on some Marmalade toolchains
+		// (see "Curl patch notes" in the README), so the _LARGE options are only used for sizes that need them:
+		if (upload_size <= LONG_MAX)
+			curl_easy_setopt(pWorker->pCurl, is_post ? CURLOPT_POSTFIELDSIZE : CURLOPT_INFILESIZE, (long)upload_size);
+		else
+			curl_easy_setopt(pWorker->pCurl, is_post ? CURLOPT_POSTFIELDSIZE_LARGE : CURLOPT_INFILESIZE_LARGE, (curl_off_t)upload_size);
+	}
+	HTTP_LOG(pWorker->log, VERBOSE, "HttpClient: Sending %s %s", pWorker->pRequest->GetMethodStr(), pWorker->pRequest->GetURL().c_str());
+}
+
+// The transfer is over: let the request and its followers know.
+static void HttpClient_Worker_HandleDone(HttpClient_Worker* pWorker) {
+	if (!pWorker->ClaimRequest())
+		return; // Hedging: the other worker has the response, and will finish the request
+	const uint num_followers = pWorker->CloseFollowers(); // (In case we never got as far as the headers)
+	// Finish the sinks first: a stage that can't (e.g. a digest that doesn't match) fails the request
+	for (uint i = 0; i < num_followers; i++) {
+		if (!pWorker->followers[i]->Worker_CloseSink(pWorker->result == CURLE_OK && !pWorker->followerFailed[i]))
+			pWorker->followerFailed[i] = true;
+	}
+	if (!pWorker->pRequest->Worker_CloseSink(pWorker->result == CURLE_OK)) {
+		HTTP_LOG(pWorker->log, WARNING, "HttpClient: The sink for %s failed to finish", pWorker->pRequest->GetURL().c_str());
+		pWorker->result = CURLE_WRITE_ERROR;
+		pWorker->cacheStored = false;
+	}
+	const bool success = pWorker->result == CURLE_OK;
+	pWorker->pRequest->Worker_HandleDone(success, (int)pWorker->responseStatusCode);
+	for (uint i = 0; i < num_followers; i++)
+		pWorker->followers[i]->Worker_HandleDone(success && !pWorker->followerFailed[i], (int)pWorker->responseStatusCode);
+	// Then any worker callbacks, for a response that HandleWorkerDone() will pass on as it is (an error status may be retried):
+	const bool complete = success && pWorker->responseStatusCode < 400;
+	pWorker->pRequest->Worker_NotifyDone(complete, (int)pWorker->responseStatusCode);
+	for (uint i = 0; i < num_followers; i++)
+		pWorker->followers[i]->Worker_NotifyDone(complete && !pWorker->followerFailed[i], (int)pWorker->responseStatusCode);
+}
+
+// Feed the cached body to the request, as if it were arriving from the network:
+static CURLcode HttpClient_Worker_ReplayCachedBody(HttpClient_Worker* pWorker) {
+	s3eFile* p_file = s3eFileOpen(pWorker->cacheBodyFile.c_str(), "rb");
+	if (!p_file)
+		return CURLE_READ_ERROR;
+	if (pWorker->cacheBodyOffset > 0 && s3eFileSeek(p_file, (int32)pWorker->cacheBodyOffset, S3E_FILESEEK_SET) != S3E_RESULT_SUCCESS) {
+		s3eFileClose(p_file);
+		return CURLE_READ_ERROR;
+	}
+	CURLcode result = CURLE_OK;
+	unsigned char buffer[16 * 1024];
+	uint64 num_left = pWorker->cacheBodySize >= 0 ? pWorker->cacheBodySize : ULLONG_MAX; // (A packed body is followed by others)
+	while (result == CURLE_OK) {
+		if (num_left == 0)
+			break;
+		const size_t num_read = s3eFileRead(buffer, 1, (size_t)MIN((uint64)sizeof(buffer), num_left), p_file);
+		if (num_read == 0) {
+			if (!s3eFileEOF(p_file) || pWorker->cacheBodySize >= 0)
+				result = CURLE_READ_ERROR;
+			break;
 		}
-		
-		//s3eDebugTracePrintf("Performing request from thread %ld", pWorker->thread_id);
-		
-		pWorker->result = curl_easy_perform(pWorker->pCurl);
-		curl_easy_getinfo(pWorker->pCurl, CURLINFO_RESPONSE_CODE, &pWorker->responseStatusCode);
-		if (pWorker->result != CURLE_OK) {
-			s3eDebugTracePrintf("HttpClient: Error occurred: %s", curl_easy_strerror(pWorker->result));
+		num_left -= num_read;
+		if (pWorker->ShouldAbort())
+			result = CURLE_ABORTED_BY_CALLBACK;
+		else if (HttpClient_Worker_HandleData(pWorker, buffer, num_read) != num_read)
+			result = CURLE_WRITE_ERROR;
+	}
+	s3eFileClose(p_file);
+	return result;
+}
+
+// Where the time went, according to curl. Its times are cumulative, in seconds, from the start of the transfer:
+static void HttpClient_Worker_GetTimings(HttpClient_Worker* pWorker) {
+	double name_lookup = 0, connect = 0, app_connect = 0, start_transfer = 0, total = 0;
+	long num_connects = 0;
+	HttpRequest::Timings& timings = pWorker->timings;
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_NAMELOOKUP_TIME, &name_lookup);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_APPCONNECT_TIME, &app_connect);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_STARTTRANSFER_TIME, &start_transfer);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_NUM_CONNECTS, &num_connects);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_REDIRECT_COUNT, &timings.numRedirects);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_SIZE_UPLOAD, &timings.bytesUploaded);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_SIZE_DOWNLOAD, &timings.bytesDownloaded);
+	timings.dnsMs = name_lookup * 1000;
+	timings.connectMs = connect > name_lookup ? (connect - name_lookup) * 1000 : 0;
+	timings.tlsMs = app_connect > connect ? (app_connect - connect) * 1000 : 0;
+	timings.ttfbMs = start_transfer * 1000;
+	timings.totalMs = total * 1000;
+	timings.connectionReused = num_connects == 0 && pWorker->result == CURLE_OK;
+	if (num_connects > 0)
+		pWorker->connectedMs = HttpClient_NowMs(); // (See HttpClientConfig::maxConnectionAgeS)
+}
+
+void HttpClient_Worker_FinishRequest(HttpClient_Worker* pWorker) {
+	HTTP_ALLOC_SCOPE(SITE_FINISH, &pWorker->allocStats);
+	HttpWorkerArena::Scope arena_scope(pWorker->arena);
+	curl_easy_getinfo(pWorker->pCurl, CURLINFO_RESPONSE_CODE, &pWorker->responseStatusCode);
+	HttpClient_Worker_GetTimings(pWorker);
+	const char* primary_ip = nullptr;
+	if (pWorker->result != CURLE_OK || curl_easy_getinfo(pWorker->pCurl, CURLINFO_PRIMARY_IP, &primary_ip) != CURLE_OK || !primary_ip)
+		primary_ip = "";
+	strncpy(pWorker->primaryIp, primary_ip, sizeof(pWorker->primaryIp) - 1);
+	pWorker->primaryIp[sizeof(pWorker->primaryIp) - 1] = '\0';
+	// The end of what was coalesced (even after an error: e.g. a resumable download keeps what it has):
+	if (!pWorker->coalesced.empty() && !pWorker->ShouldAbort() && !HttpClient_Worker_FlushCoalesced(pWorker) && pWorker->result == CURLE_OK)
+		pWorker->result = CURLE_WRITE_ERROR;
+	pWorker->coalesced.clear();
+	if (pWorker->coalesceFailed && pWorker->result == CURLE_ABORTED_BY_CALLBACK)
+		pWorker->result = CURLE_WRITE_ERROR; // (As if the write callback had failed)
+	pWorker->coalesceFailed = false;
+	const HttpRequest::Progress& progress = pWorker->progress;
+	const HttpRequest::Progress& published = pWorker->publishedProgress;
+	if (progress.downloadBytesNow != published.downloadBytesNow || progress.uploadBytesNow != published.uploadBytesNow)
+		HttpClient_Worker_PublishProgress(pWorker, HttpClient_NowMs()); // What the last progress callbacks held back
+	if (pWorker->pCacheFile) {
+		s3eFileClose(pWorker->pCacheFile);
+		pWorker->pCacheFile = nullptr;
+		pWorker->cacheStored = pWorker->result == CURLE_OK && !pWorker->cacheStoreFailed;
+	}
+	if (pWorker->cacheServed && pWorker->result == CURLE_OK) {
+		pWorker->responseStatusCode = 200;
+		pWorker->result = HttpClient_Worker_ReplayCachedBody(pWorker);
+	}
+	if (pWorker->result == CURLE_WRITE_ERROR && pWorker->responseStatusCode >= 400 && pWorker->pRequest->GetRejection() != HttpRequest::REJECTED_NONE)
+		pWorker->result = CURLE_OK; // An error response whose body was turned down is still that response, to retry or pass on
+	if (pWorker->result != CURLE_OK) {
+		HTTP_LOG(pWorker->log, ERROR, "HttpClient: Error occurred: %s", curl_easy_strerror(pWorker->result));
+	}
+	HTTP_LOG(pWorker->log, VERBOSE, "HttpClient: Finished %s (curl result %d, HTTP status %ld, %.0f ms)", pWorker->pRequest->GetURL().c_str(),
+		(int)pWorker->result, pWorker->responseStatusCode, pWorker->timings.totalMs);
+	HttpClient_Worker_HandleDone(pWorker);
+
+	pWorker->requestHeaderList.clear(); // (Keeping the memory, like transferHeaders)
+	pWorker->transferHeaders.Clear();
+}
+
+void HttpClient_Worker_ServeFromCache(HttpClient_Worker* pWorker) {
+	IwAssert(HTTP_CLIENT, pWorker->cacheMode == HttpClient_Worker::CACHE_SERVE);
+	HTTP_ALLOC_SCOPE(SITE_HEADERS, &pWorker->allocStats);
+	HttpWorkerArena::Scope arena_scope(pWorker->arena);
+	// Fill in the headers just as HttpClient_WorkerThread_HeaderCallback() would have done, status line first:
+	static const char s_status_line[] = "HTTP/1.1 200 OK";
+	pWorker->responseHeaders.SetStatusLine(s_status_line, sizeof(s_status_line) - 1);
+	const HttpHeaders& cached = pWorker->cacheHeaders;
+	for (size_t i = 0; i < cached.Size(); i++)
+		pWorker->responseHeaders.Add(cached.GetName(i), cached.GetNameLength(i), cached.GetValue(i), cached.GetValueLength(i));
+	const uint num_followers = pWorker->CloseFollowers();
+	const bool sink_open = HttpClient_Worker_OpenSinks(pWorker, 200, num_followers);
+	pWorker->pRequest->Worker_HandleResponseHeaders(pWorker->responseHeaders, 200);
+	for (uint i = 0; i < num_followers; i++)
+		pWorker->followers[i]->Worker_HandleResponseHeaders(pWorker->responseHeaders, 200);
+	pWorker->Trace(HttpTracer::EVENT_HEADERS);
+	pWorker->responseHeadersDone = true;
+	pWorker->responseStatusCode = 200;
+	pWorker->cacheServed = true;
+	pWorker->result = sink_open ? HttpClient_Worker_ReplayCachedBody(pWorker) : CURLE_WRITE_ERROR;
+	if (pWorker->result != CURLE_OK) {
+		HTTP_LOG(pWorker->log, ERROR, "HttpClient: Error occurred serving from the cache: %s", curl_easy_strerror(pWorker->result));
+	}
+	{
+		HTTP_ALLOC_SCOPE(SITE_FINISH, nullptr);
+		HttpClient_Worker_HandleDone(pWorker);
+	}
+}
+
+void HttpClient_Worker_BeginReplay(HttpClient_Worker* pWorker) {
+	IwAssert(HTTP_CLIENT, pWorker->transport == HttpClient_Worker::TRANSPORT_REPLAY);
+	pWorker->transferStartMs = HttpClient_NowMs();
+	pWorker->replayStep = 0;
+	pWorker->replayBytes = 0;
+	pWorker->result = CURLE_OK;
+	if (!pWorker->pReplay) {
+		HTTP_LOG(pWorker->log, ERROR, "HttpClient: No recorded response for %s %s", pWorker->pRequest->GetMethodStr(), pWorker->pRequest->GetURL().c_str());
+		pWorker->result = CURLE_COULDNT_CONNECT;
+	}
+}
+
+long HttpClient_Worker_StepReplay(HttpClient_Worker* pWorker) {
+	const HttpRecording::Exchange* p_exchange = pWorker->pReplay;
+	const size_t num_chunks = p_exchange ? p_exchange->chunks.size() : 0;
+	// Step 0 is the headers, then one for each chunk, and the last is the end of the transfer:
+	while (pWorker->result == CURLE_OK && pWorker->replayStep <= num_chunks + 1) {
+		if (pWorker->ShouldAbort()) {
+			pWorker->result = CURLE_ABORTED_BY_CALLBACK;
+			break;
+		}
+		const uint32 step = pWorker->replayStep;
+		const uint32 offset_ms = step == 0 ? p_exchange->headersMs : step <= num_chunks ? p_exchange->chunks[step - 1].offsetMs : p_exchange->totalMs;
+		const uint64 now_ms = HttpClient_NowMs();
+		const uint64 due_ms = pWorker->replaySpeed > 0 ? pWorker->transferStartMs + (uint64)(offset_ms / pWorker->replaySpeed) : 0;
+		if (now_ms < due_ms)
+			return (long)(due_ms - now_ms);
+		if (step == 0) {
+			if (!pWorker->ClaimRequest()) {
+				pWorker->result = CURLE_WRITE_ERROR; // Hedging: as HttpClient_WorkerThread_HeaderCallback() would have
+				break;
+			}
+			HTTP_ALLOC_SCOPE(SITE_HEADERS, &pWorker->allocStats);
+			HttpWorkerArena::Scope arena_scope(pWorker->arena);
+			pWorker->responseHeaders.SetStatusLine(p_exchange->statusLine.data(), p_exchange->statusLine.size());
+			const HttpHeaders& recorded = p_exchange->headers;
+			for (size_t i = 0; i < recorded.Size(); i++)
+				pWorker->responseHeaders.Add(recorded.GetName(i), recorded.GetNameLength(i), recorded.GetValue(i), recorded.GetValueLength(i));
+			pWorker->responseStatusCode = p_exchange->statusCode;
+			const uint num_followers = pWorker->CloseFollowers();
+			if (!HttpClient_Worker_OpenSinks(pWorker, p_exchange->statusCode, num_followers)) {
+				pWorker->result = CURLE_WRITE_ERROR;
+				break;
+			}
+			pWorker->pRequest->Worker_HandleResponseHeaders(pWorker->responseHeaders, p_exchange->statusCode);
+			for (uint i = 0; i < num_followers; i++)
+				pWorker->followers[i]->Worker_HandleResponseHeaders(pWorker->responseHeaders, p_exchange->statusCode);
+			pWorker->Trace(HttpTracer::EVENT_HEADERS);
+			pWorker->responseHeadersDone = true;
+			pWorker->timings.ttfbMs = (double)(now_ms - pWorker->transferStartMs);
+			pWorker->progress.downloadBytesTotal = (double)p_exchange->body.size();
+		} else if (step <= num_chunks) {
+			if (HttpClient_Worker_ShouldPause(pWorker))
+				return HttpClient_Worker::YIELD_INTERVAL_MS; // Flow control: until the app has consumed some of it
+			const HttpRecording::Chunk& chunk = p_exchange->chunks[step - 1];
+			if (HttpClient_Worker_HandleData(pWorker, (const unsigned char*)p_exchange->body.data() + pWorker->replayBytes, chunk.size) != chunk.size) {
+				pWorker->result = CURLE_WRITE_ERROR;
+				break;
+			}
+			pWorker->replayBytes += chunk.size;
+			pWorker->progress.downloadBytesNow = (double)pWorker->replayBytes;
 		}
-		pRequest->Worker_HandleDone(pWorker->result == CURLE_OK, (int)pWorker->responseStatusCode);
+		pWorker->replayStep++;
+	}
+	HTTP_ALLOC_SCOPE(SITE_FINISH, &pWorker->allocStats);
+	HttpWorkerArena::Scope arena_scope(pWorker->arena);
+	const HttpRequest::Progress& progress = pWorker->progress;
+	if (progress.downloadBytesNow != pWorker->publishedProgress.downloadBytesNow || progress.downloadBytesTotal != pWorker->publishedProgress.downloadBytesTotal)
+		HttpClient_Worker_PublishProgress(pWorker, HttpClient_NowMs());
+	pWorker->timings.totalMs = (double)(HttpClient_NowMs() - pWorker->transferStartMs);
+	pWorker->timings.bytesDownloaded = (double)pWorker->replayBytes;
+	pWorker->timings.connectionReused = pWorker->result == CURLE_OK;
+	if (pWorker->result != CURLE_OK && p_exchange) {
+		HTTP_LOG(pWorker->log, ERROR, "HttpClient: Error occurred replaying a response: %s", curl_easy_strerror(pWorker->result));
+	}
+	HttpClient_Worker_HandleDone(pWorker);
+	return -1;
+}
+
+bool HttpClient_Worker_ShouldPause(HttpClient_Worker* pWorker) {
+	const size_t buffered = pWorker->pRequest->Worker_GetUnconsumed();
+	if (buffered != pWorker->reportedBuffered) {
+		atomic::FetchAdd(pWorker->pFlow->bufferedBytes, buffered - pWorker->reportedBuffered); // (Which wraps around to a subtraction if it has gone down)
+		pWorker->reportedBuffered = buffered;
+	}
+	// (A worker with a thread of its own just waits in Worker_HandleData() instead, which stops it reading its socket
+	// just the same, without sitting out the second that curl can take to call the progress callback of a paused transfer)
+	if (pWorker->IsMulti() && pWorker->pRequest->Worker_IsBackedUp())
+		return true;
+	if (!buffered)
+		return false; // There's nothing for the app to consume, so waiting for it wouldn't free anything
+	const size_t max_request = pWorker->pRequest->GetMaxUnconsumed();
+	const size_t max_total = atomic::LoadRelaxed(pWorker->pFlow->maxBufferedBytes);
+	return (max_request && buffered >= max_request) || (max_total && atomic::LoadRelaxed(pWorker->pFlow->bufferedBytes) >= max_total);
+}
+
+void HttpClient_Worker_HandleCleanup(HttpClient_Worker* pWorker) {
+	HTTP_ALLOC_SCOPE(SITE_FINISH, nullptr); // (The request has already been given the worker's counts)
+	if (!pWorker->cleanupPending)
+		pWorker->PrepareCleanup(); // e.g. we're quitting, and the app thread never got to it
+	const HttpClient_Worker::Finished& finished = pWorker->finished;
+	if (finished.ownsRequest) {
+		finished.pRequest->Worker_HandleCleanup();
+		finished.pRequest->Worker_CleanupSink();
+	}
+	for (uint i = 0; i < finished.numFollowers; i++) {
+		finished.followers[i]->Worker_HandleCleanup();
+		finished.followers[i]->Worker_CleanupSink();
+	}
+	if (pWorker->reportedBuffered) {
+		atomic::FetchSub(pWorker->pFlow->bufferedBytes, pWorker->reportedBuffered);
+		pWorker->reportedBuffered = 0;
+	}
+	pWorker->arena.Reset(); // Their bodies and tapes are gone, so their scratch memory can go to the next request
+	HttpBuffer::Worker_FreeReleased(); // Any that the app has finished with, while we're in this memory environment
+	if (HTTP_PROBES && pWorker->pTraceRing)
+		HttpTracer::Trace(pWorker->pTraceRing, HttpTracer::EVENT_CLEANUP, finished.traceId);
+	pWorker->finished.pRequest = nullptr;
+	pWorker->cleanupPending = false; // (The app thread may let go of the requests now, or give us the next one)
+}
+
+extern "C" {
+
+void* HttpClient_WorkerThread(void *_pWorker) {
+	HttpClient_Worker* pWorker = reinterpret_cast<HttpClient_Worker*>(_pWorker);
 	
-		curl_slist_free_all(p_hdr_list);
+	HttpClient_ApplyThreadOptions(pWorker->threadOptions, pWorker->log);
+	HttpClient_Worker_InitHandle(pWorker);
+	
+	while (!pWorker->cancelAndQuit) {
+		// Sleep until we have something to do (a worker that was pre-warmed starts out READY).
+		// There is no need for periodic wakeups here: the app thread always wakes us
+		// when it gives us a new request, retires us, or asks us to quit.
+		pWorker->SleepWhileStatus(HttpClient_Worker::READY);
+		const bool retire = (pWorker->status == HttpClient_Worker::RETIRE);
+		s3eDeviceYield(); // We must call s3eDeviceYield from time to time, or other threads might be blocked waiting for this thread to yield.
+		if (retire || pWorker->cancelAndQuit)
+			break;
+		IwAssert(HTTP_CLIENT, pWorker->status == HttpClient_Worker::ACTIVE);
+		
+		const uint64 cpu_start_us = HttpClient_ThreadCpuUs(); // (This thread does nothing else until the transfer is over)
+		if (pWorker->cacheMode == HttpClient_Worker::CACHE_SERVE) {
+			HttpClient_Worker_ServeFromCache(pWorker);
+		} else if (pWorker->transport == HttpClient_Worker::TRANSPORT_REPLAY) {
+			HttpClient_Worker_BeginReplay(pWorker);
+			for (long wait_ms; (wait_ms = HttpClient_Worker_StepReplay(pWorker)) >= 0;)
+				s3eDeviceYield((int32)MIN(wait_ms, (long)HttpClient_Worker::YIELD_INTERVAL_MS)); // (Checking for an abort as often as the progress callback would)
+		} else {
+			HttpClient_Worker_BeginRequest(pWorker);
+			pWorker->result = curl_easy_perform(pWorker->pCurl);
+			HttpClient_Worker_FinishRequest(pWorker);
+		}
+		pWorker->timings.workerCpuMs = (double)(HttpClient_ThreadCpuUs() - cpu_start_us) / 1000;
 		
 		// Now, we need go to sleep and wait for the app thread to process any response data
-		// it needs before we finish cleaning up the request response data
-		pthread_mutex_lock(&pWorker->wakeMutex);
-		pWorker->status = HttpClient_Worker::DONE;
-		pthread_cond_wait(&pWorker->wakeCond, &pWorker->wakeMutex); // unlocks the mutex and waits for the condition, then locks the mutex again
-		pthread_mutex_unlock(&pWorker->wakeMutex);
-		IwAssert(HTTP_CLIENT, pWorker->status == HttpClient_Worker::CLEANUP); // Status should be set back to this by the app
+		// it needs before we finish cleaning up the request response data. It wakes us to CLEANUP,
+		// or straight to ACTIVE if it has our next request for us already.
+		pWorker->SetDone(); // Notify the app thread via the completion queue
+		pWorker->SleepWhileStatus(HttpClient_Worker::DONE);
+		const HttpClient_Worker::StatusCode status = pWorker->status;
+		IwAssert(HTTP_CLIENT, status == HttpClient_Worker::CLEANUP || status == HttpClient_Worker::ACTIVE || pWorker->cancelAndQuit); // Status should be set to one of these by the app
 		
 		// Do any cleanup that must be done on the worker thread, after the app thread has processed the response:
-		pRequest->Worker_HandleCleanup();
+		HttpClient_Worker_HandleCleanup(pWorker);
 		// Reset our cached response headers, etc.:
 		pWorker->Reset();
-		if (pWorker->cancelAndQuit)
-			break;
 		
-		// Sleep until we have something else to do:
-		pthread_mutex_lock(&pWorker->wakeMutex);
-		pWorker->status = HttpClient_Worker::READY;
-		while (pWorker->status == HttpClient_Worker::READY && !pWorker->cancelAndQuit) {
-			timespec ts;
-			clock_gettime(CLOCK_REALTIME, &ts);
-			ts.tv_nsec += 100 * 1E6; // sleep 100 ms
-			int rc = pthread_cond_timedwait(&pWorker->wakeCond, &pWorker->wakeMutex, &ts); // unlocks the mutex and waits for the condition
-			//if (rc == ETIMEDOUT)
-			//	s3eDebugTracePrintf("(Worker thread %ld is sleeping)", pWorker->thread_id);
-			s3eDeviceYield(); // We must call s3eDeviceYield from time to time, or other threads might be blocked waiting for this thread to yield.
-		}
-		// Now, the condition is set and the mutex has automatically been locked again
-		IwAssert(HTTP_CLIENT, (pWorker->status == HttpClient_Worker::ACTIVE) || (pWorker->cancelAndQuit));
-		pthread_mutex_unlock(&pWorker->wakeMutex);
+		if (!pWorker->cancelAndQuit && status == HttpClient_Worker::CLEANUP)
+			pWorker->status = HttpClient_Worker::READY; // (The app thread won't change our status until it sees this)
 	}
 	
 	curl_easy_cleanup(pWorker->pCurl);
 	pWorker->pCurl = nullptr;
+	pWorker->FreeBuffers();
+	if (!pWorker->cancelAndQuit)
+		pWorker->status = HttpClient_Worker::RETIRED; // The app thread will now join this thread
 	
 	return 0;
 }
@@ -220,123 +1152,2416 @@ static void* HttpClient_WorkerThread(void *_pWorker) {
 } // End of extern "C"
   /////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void HttpClient::GlobalInit() {
+// GlobalInitAsync(): the thread doing curl's (and OpenSSL's) global init, and the CA bundle it parses after that.
+// The bundle's data belongs to the app thread, which keeps it until the init thread has been joined.
+struct HttpClient_AsyncInit {
+	HttpClient_AsyncInit() : hasBundle(false), done(0) { memset(&bundle, 0, sizeof(bundle)); }
+	pthread_t thread_id;
+	FileData bundleFile; // Or:
+	std::vector<char> bundleData;
+	bool hasBundle;
+	HttpClient_CaBundle bundle;
+	volatile int done; // Set by the init thread as it finishes
+};
+static HttpClient_AsyncInit* s_pAsyncInit = nullptr; // While the init thread is running, or hasn't been joined yet
+static bool s_asyncInitUsed = false; // Then curl's global state was allocated in the worker environment, and is freed in it too
+static bool s_asyncInitFailed = false; // The CA bundle had no certificates
+
+static void* HttpClient_AsyncInit_Main(void* _pInit) {
+	HttpClient_AsyncInit* pInit = reinterpret_cast<HttpClient_AsyncInit*>(_pInit);
 	curl_global_init(CURL_GLOBAL_SSL);
+	if (pInit->hasBundle)
+		HttpClient_CaBundle_Parse(&pInit->bundle);
+	atomic::StoreRelease(pInit->done, 1);
+	return 0;
 }
 
-void HttpClient::GlobalCleanup() {
+// Join the init thread, once it has finished (or straight away, if wait), and do the rest of the init on the app thread.
+// Returns whether the init is complete.
+static bool HttpClient_FinishAsyncInit(bool wait) {
+	HttpClient_AsyncInit* p_init = s_pAsyncInit;
+	if (!p_init)
+		return true;
+	if (!wait && !atomic::LoadAcquire(p_init->done))
+		return false;
+	pthread_join(p_init->thread_id, nullptr);
+	s_pAsyncInit = nullptr;
+	if (p_init->hasBundle) {
+		if (p_init->bundle.pStore) {
+			if (s_pCaStore)
+				HttpClient_RunInWorkerEnvironment(HttpClient_CaBundle_Free, s_pCaStore);
+			s_pCaStore = p_init->bundle.pStore;
+			s3eDebugTracePrintf("HttpClient: loaded %d CA certificates", p_init->bundle.numCerts);
+		} else {
+			s_asyncInitFailed = true;
+			s3eDebugTracePrintf("HttpClient: the CA bundle passed to GlobalInitAsync() doesn't contain any certificates.");
+		}
+	}
+	delete p_init;
+	if (!s_tlsSessionCacheFile.empty() && !HttpTlsSessionCache::IsEnabled())
+		HttpTlsSessionCache::Load(s_tlsSessionCacheFile.c_str());
+	return true;
+}
+
+static void* HttpClient_GlobalCleanup_Curl(void*) {
 	curl_global_cleanup();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L // (Newer versions, e.g. a native build's system OpenSSL, free it themselves)
 	// Unfortunately there is a memory leak in CURL+OpenSSL
 	// so we have to specifically free the OpenSSL compression methods stack:
 	CRYPTO_w_lock(CRYPTO_LOCK_SSL);
 	if (STACK_OF(SSL_COMP) *ssl_comp_methods = SSL_COMP_get_compression_methods())
 		sk_SSL_COMP_free(ssl_comp_methods);
 	CRYPTO_w_unlock(CRYPTO_LOCK_SSL);
+#endif
+	return 0;
 }
 
-HttpClient::HttpClient(uint numWorkers, const char* userAgentStr)
-	: NUM_WORKERS(numWorkers), m_userAgent(userAgentStr)
-{
-	m_workers = new Worker[NUM_WORKERS];
+static void HttpClient_StartAsyncInit(HttpClient_AsyncInit* pInit) {
+#ifdef HTTP_ALLOC_STATS
+	HttpAllocStats::Init();
+#endif
+	s_asyncInitUsed = true;
+	s_asyncInitFailed = false;
+	if (pthread_create(&pInit->thread_id, nullptr, HttpClient_AsyncInit_Main, pInit) != 0) {
+		delete pInit;
+		throw std::runtime_error("Unable to spawn the HttpClient init thread.");
+	}
+	s_pAsyncInit = pInit;
 }
 
-HttpClient::~HttpClient() {
-	for (uint i = 0; i < NUM_WORKERS; i++) {
-		if (m_workers[i].status != Worker::UNUSED) {
-			// Signal to the thread to cancel any pending requests:
-			m_workers[i].CancelAndQuit();
-			pthread_join(m_workers[i].thread_id, nullptr); // Wait for the thread to finish and then free its resources
-			pthread_mutex_destroy(&m_workers[i].wakeMutex);
-			pthread_cond_destroy(&m_workers[i].wakeCond);
-			m_workers[i].pCurl = nullptr;
-		}
-	}
-	delete[] m_workers;
-	if (!m_pendingRequests.empty()) {
-		s3eDebugTraceLine("HttpClient: WARNING: Terminating HttpClient instance before all requests were processed.");
-		while (!m_pendingRequests.empty())
-			m_pendingRequests.pop();
+void HttpClient::GlobalInit() {
+	IwAssert(HTTP_CLIENT, !s_pAsyncInit); // GlobalInitAsync() has already been called
+#ifdef HTTP_ALLOC_STATS
+	HttpAllocStats::Init();
+#endif
+	curl_global_init(CURL_GLOBAL_SSL);
+	if (!s_tlsSessionCacheFile.empty() && !HttpTlsSessionCache::IsEnabled())
+		HttpTlsSessionCache::Load(s_tlsSessionCacheFile.c_str());
+}
+
+void HttpClient::GlobalInitAsync() {
+	GlobalInitAsync(nullptr, 0);
+}
+
+void HttpClient::GlobalInitAsync(const char* caBundleFile) {
+	IwAssert(HTTP_CLIENT, !s_pAsyncInit); // GlobalInitAsync() has already been called
+	HttpClient_AsyncInit* p_init = new HttpClient_AsyncInit;
+	try {
+		p_init->bundleFile.Open(caBundleFile);
+	} catch (...) {
+		delete p_init;
+		throw;
 	}
-	m_pendingCallbacks.clear();
+	p_init->hasBundle = true;
+	p_init->bundle.pData = p_init->bundleFile.Data();
+	p_init->bundle.size = p_init->bundleFile.Size();
+	HttpClient_StartAsyncInit(p_init);
 }
 
-void HttpClient::Update() {
-	Worker* p_free_worker = nullptr;
-	// First, check if any of our worker threads are free (not currently processing a request)
-	// or have recently finished:
-	for (uint i=0; i < NUM_WORKERS; i++) {
-		Worker& worker = m_workers[i];
-		if (worker.status == Worker::ACTIVE) {
-			if (worker.pRequest->GetStatus() == HttpRequest::SENDING && worker.responseHeadersDone) {
-				// We have now received all the response headers.
-				// Since we are on the app thread, we can now update the reqest "responseHeaders" map:
-				worker.pRequest->HandleResponseHeaders(m_workers[i].pResponseHeaders);
-				// The above method should also mark the request's status as HttpRequest::HEADERS
-			}
-		} else if (worker.status == Worker::DONE) {
-			// This request has *just* finished.
-			// If the response was returned all at once, we may not yet have called HandleResponseHeaders()
-			if (worker.pRequest->GetStatus() == HttpRequest::SENDING)
-				worker.pRequest->HandleResponseHeaders(m_workers[i].pResponseHeaders);
-			// Now call the request's response handling code:
-			bool success = (worker.result == CURLE_OK) && (worker.responseStatusCode < 400);
-			worker.pRequest->HandleResponse(success, (int)worker.responseStatusCode);
-			// Now call any registered callbacks:
-			for (auto it = m_pendingCallbacks.begin(); it != m_pendingCallbacks.end();) {
-				if (it->first == worker.pRequest) {
-					it->second->Call(worker.pRequest);
-					it = m_pendingCallbacks.erase(it);
-				} else {
-					it++;
-				}
-			}
-			// Now, wake the worker up and tell it to cleanup:
-			worker.WakeToStatus(Worker::CLEANUP);
-		} else if (worker.status == Worker::CLEANUP) {
-			// We are waiting for the worker to finish cleaning up the request it just finished.
-		} else {
-			// Worker status is either UNUSED or READY. This worker can receive a new request:
-			if (!p_free_worker)
-				p_free_worker = &worker; // This worker is free
-			if (worker.pRequest)
-				worker.pRequest = nullptr; // Free the HttpRequest object, which we no longer need.
-		}
+void HttpClient::GlobalInitAsync(const void* pCaBundle, size_t size) {
+	IwAssert(HTTP_CLIENT, !s_pAsyncInit); // GlobalInitAsync() has already been called
+	HttpClient_AsyncInit* p_init = new HttpClient_AsyncInit;
+	if (pCaBundle) {
+		p_init->bundleData.assign((const char*)pCaBundle, (const char*)pCaBundle + size);
+		p_init->hasBundle = true;
+		p_init->bundle.pData = p_init->bundleData.empty() ? "" : &p_init->bundleData[0];
+		p_init->bundle.size = size;
 	}
-	
-	if (p_free_worker && !m_pendingRequests.empty()) {
-		auto p_request = m_pendingRequests.front();
-		m_pendingRequests.pop();
-		if (p_request->GetStatus() == HttpRequest::PENDING) {
-			p_free_worker->pRequest = p_request;
-			p_free_worker->pRequest->HandleRequestStart();
-
-			if (p_free_worker->status == Worker::UNUSED) {
-				// This worker has not been initialized
-				// We're now going to create a new worker thread
-				IwAssert(HTTP_CLIENT, p_free_worker->pCurl == nullptr);
-				p_free_worker->userAgent = m_userAgent.c_str(); // We want the thread to be able to read this userAgent string, so we pass it via the Worker struct
-				
-				// We'll need a mutex and a condition that we can use to wake up the
-				// worker thread when/if it's sleeping:
-				pthread_mutex_init(&p_free_worker->wakeMutex, nullptr);
-				pthread_cond_init(&p_free_worker->wakeCond, nullptr);
-				
-				p_free_worker->status = Worker::ACTIVE;
-				int result = pthread_create(&p_free_worker->thread_id, nullptr, HttpClient_WorkerThread, (void *)p_free_worker);
-				if (result != 0) {
-					p_free_worker->status = Worker::DONE;
-					throw std::runtime_error("Unable to spawn a new HttpClient worker thread.");
-				} else {
-					s3eDebugTracePrintf("HttpClient: Spawned worker thread (TID %ld)", p_free_worker->thread_id);
-				}
-			} else {
-				IwAssert(HTTP_CLIENT, p_free_worker->status == Worker::READY);
-				// The worker was sleeping. Wake it up and put it to work:
-				p_free_worker->WakeToStatus(Worker::ACTIVE);
-			}
-		} else {
-			// This request was cancelled. Remove it from the queue but don't do anything with it.
-			IwAssert(HTTP_CLIENT, p_request->GetStatus() == HttpRequest::CANCELLED);
-		}
+	HttpClient_StartAsyncInit(p_init);
+}
+
+bool HttpClient::IsGlobalInitDone() {
+	return !s_pAsyncInit || atomic::LoadAcquire(s_pAsyncInit->done);
+}
+
+void HttpClient::WaitForGlobalInit() {
+	HttpClient_FinishAsyncInit(true);
+	if (s_asyncInitFailed)
+		throw std::runtime_error("HttpClient: the CA bundle doesn't contain any certificates.");
+}
+
+void HttpClient::SetTlsSessionCacheFile(const char* filePath) {
+	s_tlsSessionCacheFile = filePath ? filePath : "";
+}
+
+void HttpClient::GlobalInit(const char* caBundleFile) {
+	const FileData bundle(caBundleFile);
+	GlobalInit(bundle.Data(), bundle.Size());
+}
+
+void HttpClient::GlobalInit(const void* pCaBundle, size_t size) {
+	GlobalInit();
+	HttpClient_CaBundle bundle = { pCaBundle, size, nullptr, 0 };
+	HttpClient_RunInWorkerEnvironment(HttpClient_CaBundle_Parse, &bundle);
+	if (!bundle.pStore)
+		throw std::runtime_error("HttpClient: the CA bundle doesn't contain any certificates.");
+	if (s_pCaStore)
+		HttpClient_RunInWorkerEnvironment(HttpClient_CaBundle_Free, s_pCaStore);
+	s_pCaStore = bundle.pStore;
+	s3eDebugTracePrintf("HttpClient: loaded %d CA certificates", bundle.numCerts);
+}
+
+void HttpClient::GlobalCleanup() {
+	HttpClient_FinishAsyncInit(true);
+	HttpTlsSessionCache::Save();
+	HttpClient_RunInWorkerEnvironment(HttpClient_FreeReleasedBuffers, nullptr);
+	if (s_pCaStore)
+		HttpClient_RunInWorkerEnvironment(HttpClient_CaBundle_Free, s_pCaStore);
+	s_pCaStore = nullptr;
+	if (s_asyncInitUsed)
+		HttpClient_RunInWorkerEnvironment(HttpClient_GlobalCleanup_Curl, nullptr);
+	else
+		HttpClient_GlobalCleanup_Curl(nullptr);
+	s_asyncInitUsed = false;
+	HttpSlab::Trim(); // (All the requests should be gone by now)
+}
+
+// Whether engine is the multi one, allowing for HTTP_ENGINES (see HttpClientWorker.h):
+static bool HttpClient_IsMulti(HttpClient::Engine engine) {
+	return HTTP_ENGINES == HTTP_ENGINES_MULTI || (HTTP_ENGINES != HTTP_ENGINES_THREADS && engine == HttpClient::ENGINE_MULTI);
+}
+
+// Reads a cached response's body on one of the CPU pool's threads, for PreloadMemoryCache():
+class HttpClient::PreloadJob : public HttpJob {
+public:
+	PreloadJob(HttpClient* pClient, HttpCache* pCache, HttpCache::Entry* pEntry) :
+		m_pClient(pClient), m_pCache(pCache), m_pEntry(pEntry), m_path(pCache->GetBodyPath(*pEntry)), m_offset(pEntry->offset), m_size((size_t)pEntry->size), m_read(false) {}
+	~PreloadJob() {
+		// Dropped by the pool before it was done (the pool was destroyed), while the client still waited for it:
+		if (m_pClient)
+			m_pClient->FinishPreload(this, false);
+	}
+	void Detach() { m_pClient = nullptr; } // The client no longer waits for us (and may be gone)
+	HttpCache* GetCache() const { return m_pCache; }
+	HttpCache::Entry* GetEntry() const { return m_pEntry; } // (Pinned until the client releases it)
+	const string& GetBody() const { return m_body; }
+
+	virtual void Worker_Run() {
+		s3eFile* p_file = s3eFileOpen(m_path.c_str(), "rb");
+		if (!p_file)
+			return;
+		m_body.resize(m_size);
+		m_read = (m_offset == 0 || s3eFileSeek(p_file, (int32)m_offset, S3E_FILESEEK_SET) == S3E_RESULT_SUCCESS) &&
+			(m_size == 0 || s3eFileRead(&m_body[0], 1, m_size, p_file) == m_size);
+		s3eFileClose(p_file);
+	}
+	virtual void Worker_Cleanup() {
+		string().swap(m_body); // (Allocated by Worker_Run())
+	}
+	virtual void HandleDone() {
+		HttpClient* p_client = m_pClient;
+		m_pClient = nullptr;
+		p_client->FinishPreload(this, m_read);
+	}
+
+private:
+	HttpClient* m_pClient; // App thread only
+	HttpCache* const m_pCache;
+	HttpCache::Entry* const m_pEntry;
+	const string m_path;
+	const uint64 m_offset;
+	const size_t m_size;
+	string m_body; // In the worker memory environment
+	bool m_read;
+};
+
+HttpClient::HttpClient(uint numWorkers, const char* userAgentStr, Engine engine, uint numIoThreads)
+	: m_userAgent(userAgentStr), m_engine(HttpClient_IsMulti(engine) ? ENGINE_MULTI : ENGINE_THREADS), NUM_WORKERS(numWorkers), m_ioThreads(nullptr), NUM_IO_THREADS(HttpClient_IsMulti(engine) ? MAX(1u, MIN(numIoThreads, numWorkers)) : 0), m_pEventLoop(nullptr),
+	  m_dnsSnapshotTtlMs(0), m_pHostRefresh(nullptr), m_negativeTtlMs(0), m_logPending(0), m_scheduler(m_timers), m_preemption(false), m_suspended(false), m_autoSuspend(false), m_numPreempting(0), m_hedgePercentile(0), m_hedgeMinDelayMs(50), m_retrySeed((uint32)s3eTimerGetUST() | 1), m_minWorkers(0), m_idleTimeoutMs(0), m_pCache(nullptr), m_pMemoryCache(nullptr), m_pRecording(nullptr), m_acceptCompressed(true), m_dnsCacheTtl(60), m_progressIntervalMs(100), m_progressMinBytes(0), m_defaultHeadersVersion(0), m_defaultHeadersChanged(false), m_pTracer(nullptr), m_pTraceRing(nullptr), m_maxEndpoints(0), m_pBudget(nullptr), m_sizeHintsEnabled(false), m_pWorkPool(nullptr), m_pCpuPool(nullptr), m_pDiskWriter(nullptr), m_bandwidthLimit(0),
+	  m_concurrencyLimit(numWorkers), m_windowResponses(0), m_windowFinished(0), m_windowErrors(0), m_windowResponseMs(0), m_windowLimited(false), m_lastFinishedRate(0), m_lastBytesRate(0), m_baselineResponseMs(0),
+	  m_networkProfilesEnabled(false), m_networkType(NETWORK_UNKNOWN), m_networkCheckMs(0), m_numBackgroundTransfers(0), m_numLargeTransfers(0), m_maxLargeTransfers(0)
+{
+	ResetStats();
+	SetBandwidthLimit(0);
+	m_scheduler.SetExpireDelegate(fastdelegate::MakeDelegate(this, &HttpClient::ExpireRequest));
+	m_networkProfiles[NETWORK_MOBILE_FAST] = NetworkProfile(NetworkProfile::NO_LIMIT, 2, true, false);
+	m_networkProfiles[NETWORK_MOBILE_SLOW] = NetworkProfile(2, 0, true, false, 1);
+	// All of our worker handles share a DNS cache and TLS sessions, so that each worker
+	// doesn't pay for its own lookup and full handshake with the same host:
+	m_pShare = new HttpClient_Share;
+	for (uint i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&m_pShare->locks[i], nullptr);
+	HttpClient_RunInWorkerEnvironment(HttpClient_Share_Init, m_pShare);
+
+	m_pCompletions = new HttpClient_CompletionQueue(NUM_WORKERS);
+	m_pFlow = new HttpClient_FlowControl;
+
+	m_workers = new Worker[NUM_WORKERS];
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		m_workers[i].pShare = m_pShare;
+		m_workers[i].pCompletions = m_pCompletions;
+		m_workers[i].pFlow = m_pFlow;
+		m_workers[i].log.pPending = &m_logPending;
+	}
+	if (HttpClient_IsMulti(m_engine)) {
+		// Share the worker slots out between the I/O threads. The threads themselves get spawned
+		// once there is some work for them to do.
+		m_ioThreads = new IoThread[NUM_IO_THREADS];
+		for (uint t = 0; t < NUM_IO_THREADS; t++) {
+			IoThread& io_thread = m_ioThreads[t];
+			io_thread.userAgent = m_userAgent.c_str();
+			io_thread.log.pPending = &m_logPending;
+			io_thread.pWorkers = new Worker*[NUM_WORKERS / NUM_IO_THREADS + 1];
+		}
+		for (uint i = 0; i < NUM_WORKERS; i++) {
+			IoThread& io_thread = m_ioThreads[i % NUM_IO_THREADS];
+			m_workers[i].pIoThread = &io_thread;
+			m_workers[i].userAgent = m_userAgent.c_str();
+			io_thread.pWorkers[io_thread.numWorkers++] = &m_workers[i];
+		}
+	}
+}
+
+HttpClient::~HttpClient() {
+	SetWorkPool(nullptr);
+	SetAutoSuspend(false);
+	for (uint i = 0; i < NUM_WORKERS; i++)
+		ChargeMemory(m_workers[i], 0); // (A budget that other clients share must only count theirs from now on)
+	if (HttpClient_IsMulti(m_engine)) {
+		// Tell every I/O thread to abort its transfers, then wait for them all:
+		for (uint i = 0; i < NUM_WORKERS; i++)
+			m_workers[i].CancelAndQuit();
+		for (uint t = 0; t < NUM_IO_THREADS; t++) {
+			if (m_ioThreads[t].started)
+				m_ioThreads[t].Quit();
+		}
+		for (uint t = 0; t < NUM_IO_THREADS; t++) {
+			IoThread& io_thread = m_ioThreads[t];
+			if (io_thread.started) {
+				if (io_thread.pLoop)
+					IwAssert(HTTP_CLIENT, !io_thread.pMulti); // The loop must have called Io_Stop() by now
+				else
+					pthread_join(io_thread.thread_id, nullptr);
+				close(io_thread.wakePipe[0]);
+				close(io_thread.wakePipe[1]);
+			}
+			delete[] io_thread.pWorkers;
+		}
+		delete[] m_ioThreads;
+	} else {
+		// Signal every thread to cancel its transfer first, so that they all wind down at once, rather than one by one:
+		for (uint i = 0; i < NUM_WORKERS; i++) {
+			if (m_workers[i].status != Worker::UNUSED)
+				m_workers[i].CancelAndQuit();
+		}
+		for (uint i = 0; i < NUM_WORKERS; i++) {
+			if (m_workers[i].status != Worker::UNUSED) {
+				pthread_join(m_workers[i].thread_id, nullptr); // Wait for the thread to finish and then free its resources
+				pthread_mutex_destroy(&m_workers[i].wakeMutex);
+				pthread_cond_destroy(&m_workers[i].wakeCond);
+				m_workers[i].pCurl = nullptr;
+			}
+		}
+	}
+	DrainLogs(); // (The threads have all gone, so this is everything they logged)
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		if (!m_workers[i].pRequest || m_workers[i].hedgeRole == Worker::HEDGE_SECOND)
+			continue; // (A hedge's request is the first worker's to finish, or has been finished already)
+		FinishCache(m_workers[i], false);
+		std::vector< Ptr<HttpRequest> >& followers = m_workers[i].pRequest->m_followers;
+		if (m_workers[i].requeue) {
+			m_workers[i].pRequest->ForgetCallbacks(); // Preempted request that will now never be sent
+			for (auto it = followers.begin(); it != followers.end(); it++)
+				(*it)->ForgetCallbacks();
+		}
+		followers.clear();
+		m_scheduler.RemoveLeader(m_workers[i].pRequest.ptr()); // (Borrowed requests were handed back by SetWorkPool())
+		m_scheduler.HandleFinished(m_workers[i].pRequest.ptr());
+	}
+	for (auto it = m_memoryHits.begin(); it != m_memoryHits.end(); it++)
+		it->first->ForgetCallbacks(); // Never completed
+	m_memoryHits.clear();
+	for (auto it = m_failingFast.begin(); it != m_failingFast.end(); it++)
+		(*it)->ForgetCallbacks();
+	m_failingFast.clear();
+	for (auto it = m_preloads.begin(); it != m_preloads.end(); it++) {
+		(*it)->Detach();
+		(*it)->Cancel();
+		(*it)->GetCache()->Release((*it)->GetEntry());
+	}
+	m_preloads.clear();
+	delete[] m_workers;
+	delete m_pCompletions;
+	delete m_pFlow;
+	// All handles using the share are gone now:
+	if (!m_cookieFile.empty())
+		SaveCookies();
+	if (m_pHostRefresh) {
+		pthread_join(m_pHostRefresh->threadId, nullptr);
+		delete m_pHostRefresh;
+	}
+	if (!m_dnsSnapshotFile.empty())
+		SaveDnsSnapshot();
+	HttpClient_RunInWorkerEnvironment(HttpClient_Share_Cleanup, m_pShare);
+	for (uint i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_destroy(&m_pShare->locks[i]);
+	delete m_pShare;
+	if (!m_scheduler.Empty()) {
+		s3eDebugTraceLine("HttpClient: WARNING: Terminating HttpClient instance before all requests were processed.");
+		m_scheduler.Clear();
+	}
+}
+
+bool HttpClient::EnableCookies(const char* filePath) {
+	IwAssert(HTTP_CLIENT, !m_pShare->pCookies);
+	// curl can only share another kind of data before any handle is using the share:
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		if (m_workers[i].status != Worker::UNUSED) {
+			s3eDebugTraceLine("HttpClient: Cookies must be enabled before any requests are queued");
+			return false;
+		}
+	}
+	HttpClient_CookieOp op(m_pShare);
+	HttpClient_RunInWorkerEnvironment(HttpClient_Cookies_Enable, &op);
+	if (!op.ok) {
+		s3eDebugTraceLine("HttpClient: Unable to share cookies between the workers");
+		return false;
+	}
+	m_cookieFile = filePath ? filePath : "";
+	if (m_cookieFile.empty())
+		return true;
+	s3eFile* p_file = s3eFileOpen(m_cookieFile.c_str(), "rb");
+	if (!p_file)
+		return true; // (Nothing saved yet)
+	const int32 size = s3eFileGetSize(p_file);
+	std::vector<char> lines(size > 0 ? size + 1 : 1, '\0');
+	const bool read = size > 0 && s3eFileRead(&lines[0], 1, size, p_file) == (size_t)size;
+	s3eFileClose(p_file);
+	if (read) {
+		op.pLines = &lines[0];
+		HttpClient_RunInWorkerEnvironment(HttpClient_Cookies_Load, &op);
+	}
+	return true;
+}
+
+bool HttpClient::SaveCookies() {
+	IwAssert(HTTP_CLIENT, m_pShare->pCookies && !m_cookieFile.empty());
+	if (!m_pShare->pCookies || m_cookieFile.empty())
+		return false;
+	HttpClient_CookieOp op(m_pShare);
+	HttpClient_RunInWorkerEnvironment(HttpClient_Cookies_Get, &op);
+	if (!op.ok)
+		return false;
+	string data = "# Netscape HTTP Cookie File\n";
+	for (const curl_slist* p_cookie = op.pCookies; p_cookie; p_cookie = p_cookie->next)
+		data.append(p_cookie->data).append(1, '\n');
+	HttpClient_RunInWorkerEnvironment(HttpClient_Cookies_Free, &op);
+	// Write a new file and then replace the old one, so that we never leave half of one behind:
+	const string tmp_path = m_cookieFile + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpClient: Unable to write %s", tmp_path.c_str());
+		return false;
+	}
+	const bool written = s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	s3eFileClose(p_file);
+	if (!written) {
+		s3eFileDelete(tmp_path.c_str());
+		return false;
+	}
+	s3eFileDelete(m_cookieFile.c_str());
+	return s3eFileRename(tmp_path.c_str(), m_cookieFile.c_str()) == S3E_RESULT_SUCCESS;
+}
+
+void HttpClient::ClearCookies(bool sessionOnly) {
+	if (!m_pShare->pCookies)
+		return;
+	HttpClient_CookieOp op(m_pShare);
+	op.command = sessionOnly ? "SESS" : "ALL";
+	HttpClient_RunInWorkerEnvironment(HttpClient_Cookies_Command, &op);
+}
+
+void HttpClient::SetHostAddresses(const string& host, uint port, const string& addresses) {
+	m_hostTable.Set(host, port, addresses);
+}
+
+bool HttpClient::LoadHostAddresses(const char* filePath) {
+	if (m_hostTable.Load(filePath, s3eTimerGetUTC()))
+		return true;
+	s3eDebugTracePrintf("HttpClient: Unable to read the host addresses in %s", filePath);
+	return false;
+}
+
+bool HttpClient::SetDnsSnapshot(const char* filePath, uint ttlS) {
+	IwAssert(HTTP_CLIENT, m_dnsSnapshotFile.empty()); // Only once
+	m_dnsSnapshotFile = filePath;
+	m_dnsSnapshotTtlMs = (uint64)ttlS * 1000;
+	if (!m_hostTable.Load(filePath, s3eTimerGetUTC()))
+		return false; // e.g. the first launch: the hosts are looked up as usual, and saved for next time
+	StartHostRefresh();
+	return true;
+}
+
+bool HttpClient::SaveDnsSnapshot() {
+	IwAssert(HTTP_CLIENT, !m_dnsSnapshotFile.empty());
+	if (m_dnsSnapshotFile.empty())
+		return false;
+	return m_hostTable.Save(m_dnsSnapshotFile.c_str(), m_dnsSnapshotTtlMs);
+}
+
+void HttpClient::StartHostRefresh() {
+	std::vector<string> keys;
+	m_hostTable.GetTemporaryKeys(keys);
+	if (keys.empty())
+		return;
+	HttpClient_HostRefresh* p_refresh = new HttpClient_HostRefresh;
+	for (auto it = keys.begin(); it != keys.end() && p_refresh->numHosts < HttpClient_HostRefresh::MAX_HOSTS; it++) {
+		HttpClient_HostRefresh::Host& host = p_refresh->hosts[p_refresh->numHosts];
+		string name;
+		if (!HttpHostTable::SplitKey(*it, name, host.port) || name.size() >= sizeof(host.name))
+			continue;
+		memcpy(host.name, name.c_str(), name.size() + 1);
+		p_refresh->numHosts++;
+	}
+	if (pthread_create(&p_refresh->threadId, nullptr, HttpClient_HostRefresh_Main, p_refresh) != 0) {
+		s3eDebugTraceLine("HttpClient: Unable to spawn a thread to look up the snapshot's hosts; they'll keep their addresses until they expire");
+		delete p_refresh;
+		return;
+	}
+	m_pHostRefresh = p_refresh;
+}
+
+void HttpClient::FinishHostRefresh() {
+	if (!m_pHostRefresh || !atomic::LoadAcquire(m_pHostRefresh->done))
+		return;
+	pthread_join(m_pHostRefresh->threadId, nullptr);
+	const uint64 expires_ms = s3eTimerGetUTC() + m_dnsSnapshotTtlMs;
+	for (uint i = 0; i < m_pHostRefresh->numHosts; i++) {
+		const HttpClient_HostRefresh::Host& host = m_pHostRefresh->hosts[i];
+		const HttpHostTable::Entry* p_entry = m_hostTable.Find(host.name, host.port);
+		if (host.addresses[0] && p_entry && p_entry->expiresMs) // (Unless the app has pinned it since, or it has expired)
+			m_hostTable.Set(host.name, host.port, host.addresses, expires_ms);
+	}
+	delete m_pHostRefresh;
+	m_pHostRefresh = nullptr;
+}
+
+void HttpClient::LearnHostAddress(const Worker& worker) {
+	// Only from transfers that weren't redirected, as the address is that of the last host connected to:
+	if (!worker.primaryIp[0] || worker.timings.numRedirects || strchr(worker.primaryIp, ':'))
+		return; // (Or IPv6, which the bundled libcurl can't use)
+	const HttpUrl url(worker.pRequest->GetURL());
+	const string host = url.GetHost();
+	if (host.empty() || host[0] == '[' || host == worker.primaryIp)
+		return; // An address already
+	m_hostTable.Learn(host, url.GetPort(), worker.primaryIp, s3eTimerGetUTC());
+}
+
+void HttpClient::ApplyAddressFamily(Worker& worker) {
+	worker.addressFamilyMemo = Worker::FAMILY_FIXED;
+	if (worker.config.addressFamily != HttpClientConfig::ADDRESS_ANY || !worker.config.rememberAddressFamily)
+		return;
+	auto it = m_addressFamilies.find(worker.pRequest->GetOrigin());
+	if (it == m_addressFamilies.end()) {
+		worker.addressFamilyMemo = Worker::FAMILY_LEARN; // curl races the families (see HttpClientConfig::happyEyeballsMs)
+		return;
+	}
+	worker.config.addressFamily = it->second;
+	worker.addressFamilyMemo = Worker::FAMILY_REMEMBERED;
+}
+
+void HttpClient::LearnAddressFamily(const Worker& worker) {
+	const string& origin = worker.pRequest->GetOrigin();
+	if (worker.addressFamilyMemo == Worker::FAMILY_LEARN) {
+		// The family of the connection this transfer made, if it made one (and to the request's own host):
+		if (worker.primaryIp[0] && !worker.timings.connectionReused && !worker.timings.numRedirects)
+			m_addressFamilies[origin] = strchr(worker.primaryIp, ':') ? HttpClientConfig::ADDRESS_IPV6 : HttpClientConfig::ADDRESS_IPV4;
+		return;
+	}
+	// The remembered family no longer works, e.g. the host has dropped it: race both again next time
+	const bool not_connected = worker.result == CURLE_COULDNT_RESOLVE_HOST || worker.result == CURLE_COULDNT_CONNECT
+		|| (worker.result == CURLE_OPERATION_TIMEDOUT && !worker.timings.connectionReused && worker.timings.connectMs == 0);
+	if (not_connected)
+		m_addressFamilies.erase(origin);
+}
+
+const string* HttpClient::FindRedirect(const string& url) const {
+	if (m_pCache)
+		return m_pCache->FindRedirect(url);
+	auto it = m_redirects.find(url);
+	return it != m_redirects.end() ? &it->second : nullptr;
+}
+
+void HttpClient::SetRedirect(const string& url, const string& target) {
+	if (m_pCache) {
+		m_pCache->SetRedirect(url, target);
+		return;
+	}
+	// As HttpCache keeps them:
+	if (target.empty()) {
+		m_redirects.erase(url);
+		return;
+	}
+	if (m_redirects.size() >= HttpCache::MAX_REDIRECTS && m_redirects.find(url) == m_redirects.end())
+		m_redirects.erase(m_redirects.begin());
+	m_redirects[url] = target;
+}
+
+int HttpClient::FindMissing(const string& url) const {
+	const uint64 now_ms = s3eTimerGetUTC();
+	return m_pCache ? m_pCache->FindMissing(url, now_ms) : m_missing.Find(url, now_ms);
+}
+
+void HttpClient::SetMissing(const string& url, int statusCode, uint64 untilUtcMs) {
+	if (m_pCache)
+		m_pCache->SetMissing(url, statusCode, untilUtcMs);
+	else if (statusCode)
+		m_missing.Add(url, statusCode, untilUtcMs);
+	else
+		m_missing.Remove(url);
+}
+
+void HttpClient::LearnMissing(const Worker& worker) {
+	const HttpRequest& request = *worker.pRequest.ptr();
+	if (worker.responseStatusCode < 400) {
+		SetMissing(request.GetURL(), 0, 0); // (If it was missing, it isn't any more, e.g. the app has uploaded it since)
+		return;
+	}
+	if ((worker.responseStatusCode != 404 && worker.responseStatusCode != 410) || !m_negativeTtlMs
+		|| (request.GetMethod() != HttpRequest::GET && request.GetMethod() != HttpRequest::HEAD))
+		return;
+	int64 max_age_ms;
+	bool no_store, no_cache;
+	HttpCache::ParseCacheControl(request.GetResponseHeaders().Find("Cache-Control"), max_age_ms, no_store, no_cache);
+	const int64 ttl_ms = max_age_ms >= 0 && max_age_ms < (int64)m_negativeTtlMs ? max_age_ms : (int64)m_negativeTtlMs;
+	if (!no_store && ttl_ms > 0)
+		SetMissing(request.GetURL(), (int)worker.responseStatusCode, s3eTimerGetUTC() + ttl_ms);
+}
+
+void HttpClient::ApplyRedirect(Worker& worker) {
+	worker.transferUrl.clear();
+	const HttpRequest& request = *worker.pRequest.ptr();
+	if (worker.config.maxRedirects <= 0 || (request.GetMethod() != HttpRequest::GET && request.GetMethod() != HttpRequest::HEAD))
+		return;
+	if (const string* p_target = FindRedirect(request.GetURL()))
+		worker.transferUrl = *p_target;
+}
+
+void HttpClient::LearnRedirect(const Worker& worker) {
+	const HttpRequest& request = *worker.pRequest.ptr();
+	if (request.GetMethod() != HttpRequest::GET && request.GetMethod() != HttpRequest::HEAD)
+		return;
+	if (!worker.transferUrl.empty() && (worker.result == CURLE_COULDNT_RESOLVE_HOST || worker.result == CURLE_COULDNT_CONNECT || worker.result == CURLE_TOO_MANY_REDIRECTS
+		|| (worker.result == CURLE_OK && worker.responseStatusCode >= 400))) {
+		// Where it used to lead doesn't work any more: start from the request's own URL again
+		s3eDebugTracePrintf("HttpClient: Forgetting the redirect of %s to %s (curl result %d, HTTP status %ld)", request.GetURL().c_str(), worker.transferUrl.c_str(),
+			(int)worker.result, worker.responseStatusCode);
+		SetRedirect(request.GetURL(), "");
+		return;
+	}
+	if (!worker.permanentUrl.empty() && worker.permanentUrl != request.GetURL())
+		SetRedirect(request.GetURL(), worker.permanentUrl); // (Copied into our memory environment)
+}
+
+bool HttpClient::IsAsyncDns() {
+	return (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_ASYNCHDNS) != 0;
+}
+
+void HttpClient::StartIoThread(IoThread& ioThread) {
+	IwAssert(HTTP_CLIENT, !ioThread.started);
+	if (pipe(ioThread.wakePipe) != 0)
+		throw std::runtime_error("Unable to create the wake pipe for a HttpClient I/O thread.");
+	fcntl(ioThread.wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(ioThread.wakePipe[1], F_SETFL, O_NONBLOCK);
+	if (ioThread.pLoop) {
+		// Driven by the app's own event loop, from Io_Start() on: there is no thread to spawn
+		ioThread.started = true;
+		return;
+	}
+	ioThread.threadOptions = m_threadOptions;
+	int result = HttpClient_CreateThread(ioThread.thread_id, ioThread.threadOptions, HttpClient_IoThreadMain, (void *)&ioThread);
+	if (result != 0) {
+		close(ioThread.wakePipe[0]);
+		close(ioThread.wakePipe[1]);
+		throw std::runtime_error("Unable to spawn a new HttpClient I/O thread.");
+	}
+	ioThread.started = true;
+	s3eDebugTracePrintf("HttpClient: Spawned I/O thread (TID %ld)", ioThread.thread_id);
+}
+
+void HttpClient::SetExternalEventLoop(HttpEventLoop* pLoop) {
+	if (!HttpClient_IsMulti(m_engine)) {
+		s3eDebugTraceLine("HttpClient: SetExternalEventLoop() needs ENGINE_MULTI; ignoring it");
+		return;
+	}
+	IwAssert(HTTP_CLIENT, pLoop && !m_pEventLoop);
+	m_pEventLoop = pLoop;
+	for (uint t = 0; t < NUM_IO_THREADS; t++) {
+		IwAssert(HTTP_CLIENT, !m_ioThreads[t].started); // Before the first request
+		m_ioThreads[t].pLoop = pLoop;
+		StartIoThread(m_ioThreads[t]); // (Which just makes its wake pipe, for the loop to watch)
+	}
+}
+
+void HttpClient::Io_Start() {
+	IwAssert(HTTP_CLIENT, m_pEventLoop);
+	for (uint t = 0; t < NUM_IO_THREADS; t++)
+		HttpClient_IoThread_Begin(&m_ioThreads[t]);
+	Io_Continue();
+}
+
+void HttpClient::Io_HandleSocket(int fd, int events) {
+	const int mask = ((events & HttpEventLoop::EVENT_IN) ? CURL_CSELECT_IN : 0)
+	               | ((events & HttpEventLoop::EVENT_OUT) ? CURL_CSELECT_OUT : 0)
+	               | ((events & HttpEventLoop::EVENT_ERROR) ? CURL_CSELECT_ERR : 0);
+	for (uint t = 0; t < NUM_IO_THREADS; t++) {
+		if (HttpClient_IoThread_HandleSocket(&m_ioThreads[t], fd, mask))
+			break;
+	}
+	Io_Continue();
+}
+
+void HttpClient::Io_HandleTimeout() {
+	Io_Continue(); // (Each I/O thread runs curl's timer if it's due, and sees to the rest)
+}
+
+void HttpClient::Io_Continue() {
+	long timeout_ms = -1;
+	for (uint t = 0; t < NUM_IO_THREADS; t++) {
+		IoThread& io_thread = m_ioThreads[t];
+		HttpClient_IoThread_HandleTimeout(&io_thread);
+		const long wait_ms = HttpClient_IoThread_Prepare(&io_thread);
+		if (wait_ms >= 0 && (timeout_ms < 0 || wait_ms < timeout_ms))
+			timeout_ms = wait_ms;
+	}
+	m_pEventLoop->SetTimeout(timeout_ms);
+}
+
+void HttpClient::Io_Stop() {
+	IwAssert(HTTP_CLIENT, m_pEventLoop);
+	for (uint t = 0; t < NUM_IO_THREADS; t++) {
+		if (m_ioThreads[t].pMulti)
+			HttpClient_IoThread_End(&m_ioThreads[t]);
+	}
+	m_pEventLoop->SetTimeout(-1);
+}
+
+HttpClient::Pipelining::Pipelining(bool enabled)
+	: enabled(enabled), maxLength(5), maxHostConnections(0), contentLengthPenalty(0), chunkLengthPenalty(0)
+{
+	// Servers that browsers have found to mishandle pipelined requests:
+	static const char* const BROKEN_SERVERS[] = {
+		"Microsoft-IIS/4.", "Microsoft-IIS/5.", "Netscape-Enterprise/3.", "Netscape-Enterprise/4.", "Netscape-Enterprise/5.",
+		"Netscape-Enterprise/6.", "WebLogic 3.", "WebLogic 4.", "WebLogic 5.", "WebLogic 6.", "Winstone Servlet Engine v0.", "EFAServer/"
+	};
+	serverBlacklist.assign(BROKEN_SERVERS, BROKEN_SERVERS + sizeof(BROKEN_SERVERS) / sizeof(*BROKEN_SERVERS));
+}
+
+void HttpClient::SetPipelining(const Pipelining& pipelining) {
+	if (!HttpClient_IsMulti(m_engine)) {
+		s3eDebugTraceLine("HttpClient: SetPipelining() needs ENGINE_MULTI; ignoring it");
+		return;
+	}
+	for (uint t = 0; t < NUM_IO_THREADS; t++)
+		IwAssert(HTTP_CLIENT, !m_ioThreads[t].started); // Each I/O thread reads the settings as it starts
+	m_pipelining = pipelining;
+	m_pipeliningSiteBlacklist.clear();
+	for (auto it = m_pipelining.siteBlacklist.begin(); it != m_pipelining.siteBlacklist.end(); it++)
+		m_pipeliningSiteBlacklist.push_back(it->c_str());
+	m_pipeliningSiteBlacklist.push_back(nullptr);
+	m_pipeliningServerBlacklist.clear();
+	for (auto it = m_pipelining.serverBlacklist.begin(); it != m_pipelining.serverBlacklist.end(); it++)
+		m_pipeliningServerBlacklist.push_back(it->c_str());
+	m_pipeliningServerBlacklist.push_back(nullptr);
+	for (uint t = 0; t < NUM_IO_THREADS; t++) {
+		IoThread& io_thread = m_ioThreads[t];
+		io_thread.pipelining = m_pipelining.enabled ? 1 : 0;
+		io_thread.maxPipelineLength = m_pipelining.maxLength;
+		io_thread.maxHostConnections = m_pipelining.maxHostConnections;
+		io_thread.contentLengthPenalty = (curl_off_t)m_pipelining.contentLengthPenalty;
+		io_thread.chunkLengthPenalty = (curl_off_t)m_pipelining.chunkLengthPenalty;
+		io_thread.pSiteBlacklist = m_pipelining.siteBlacklist.empty() ? nullptr : &m_pipeliningSiteBlacklist[0];
+		io_thread.pServerBlacklist = m_pipelining.serverBlacklist.empty() ? nullptr : &m_pipeliningServerBlacklist[0];
+	}
+}
+
+void HttpClient::SetExpectContinuePolicy(const ExpectContinuePolicy& policy) {
+	m_expectContinuePolicy = policy;
+	std::vector<string>& origins = m_expectContinuePolicy.trustedOrigins;
+	for (auto it = origins.begin(); it != origins.end(); it++)
+		*it = HttpUrl::GetOrigin(it->find("://") == string::npos ? string("https://").append(*it) : *it); // As HttpRequest::GetOrigin() has it
+}
+
+int64 HttpClient::GetExpectContinueMinSize(const HttpRequest& request) const {
+	const ExpectContinuePolicy& policy = m_expectContinuePolicy;
+	if (!policy.enabled || (request.GetMethod() != HttpRequest::POST && request.GetMethod() != HttpRequest::PUT))
+		return -1;
+	const std::vector<string>& trusted = policy.trustedOrigins;
+	return std::find(trusted.begin(), trusted.end(), request.GetOrigin()) != trusted.end() ? policy.trustedMinBodySize : policy.minBodySize;
+}
+
+void HttpClient::SetCompletionSignal(void (*pfnSignal)(void* userData), void* userData) {
+	m_pCompletions->pSignalUserData = userData;
+	m_pCompletions->pfnSignal = pfnSignal;
+}
+
+HttpFuture HttpClient::QueueRequest(Ptr<HttpRequest> pRequest, HttpRequest::CallbackDelegate delegate, IObservable* pGuard) {
+	HttpFuture future = QueueRequest(pRequest);
+	pRequest->m_callbackDelegate = delegate;
+	pRequest->m_pCallbackGuard = pGuard;
+	pRequest->m_callbackGuarded = pGuard != nullptr;
+	return future;
+}
+
+HttpFuture HttpClient::QueueRequest(Ptr<HttpRequest> pRequest, Ptr<HttpCallbackBase> pCallback) {
+	HTTP_ALLOC_SCOPE(SITE_REQUEST, &pRequest->m_allocStats);
+	IwAssert(HTTP_CLIENT, pRequest->GetStatus() == HttpRequest::BUILDING || pRequest->GetStatus() == HttpRequest::PENDING);
+	pRequest->ForgetCallbacks(); // (Of any earlier time it was queued)
+	pRequest->m_pCallback = pCallback;
+	pRequest->m_numRetries = 0;
+	pRequest->m_numFailovers = 0;
+	pRequest->m_failedFast = false;
+	if (!WaitForDependencies(pRequest))
+		Submit(pRequest);
+	return HttpFuture(this, pRequest);
+}
+
+bool HttpClient::WaitForDependencies(const Ptr<HttpRequest>& pRequest) {
+	if (pRequest->m_dependencies.empty())
+		return false;
+	IwAssert(HTTP_CLIENT, pRequest->GetStatus() == HttpRequest::BUILDING && !pRequest->m_pWaitingClient); // (Its bind may still change it)
+	uint num_waiting_for = 0;
+	for (auto it = pRequest->m_dependencies.begin(); it != pRequest->m_dependencies.end(); it++) {
+		const HttpRequest::Status status = (*it)->GetStatus();
+		if (status == HttpRequest::DONE)
+			continue;
+		if (status == HttpRequest::ERROR || status == HttpRequest::CANCELLED) {
+			num_waiting_for = 0; // Failed already: no need to wait for the others
+			break;
+		}
+		(*it)->m_dependents.push_back(pRequest);
+		num_waiting_for++;
+	}
+	pRequest->m_numWaitingFor = num_waiting_for;
+	pRequest->m_pWaitingClient = this;
+	if (!num_waiting_for)
+		m_readyDependents.push_back(pRequest); // Released on the next Update(): the caller may not expect its callback yet
+	return true;
+}
+
+void HttpClient::ReleaseDependent(const Ptr<HttpRequest>& pRequest) {
+	IwAssert(HTTP_CLIENT, pRequest->m_pWaitingClient == this && pRequest->GetStatus() == HttpRequest::BUILDING);
+	pRequest->m_pWaitingClient = nullptr;
+	bool cancelled = false, failed = false;
+	for (auto it = pRequest->m_dependencies.begin(); it != pRequest->m_dependencies.end(); it++) {
+		const HttpRequest::Status status = (*it)->GetStatus();
+		cancelled = cancelled || status == HttpRequest::CANCELLED;
+		failed = failed || status == HttpRequest::ERROR;
+	}
+	if (cancelled) {
+		pRequest->m_status = HttpRequest::CANCELLED;
+		pRequest->ForgetCallbacks();
+		pRequest->ReleaseDependents();
+		return;
+	}
+	if (!failed && pRequest->m_bind) {
+		HTTP_ALLOC_SCOPE(SITE_CALLBACK, &pRequest->m_allocStats);
+		failed = !pRequest->m_bind(pRequest.ptr(), pRequest->m_dependencies);
+	}
+	if (failed) {
+		// Never sent, so there is no response to handle; the callback (and then its dependents) hear about it as usual:
+		pRequest->m_status = HttpRequest::ERROR;
+		pRequest->NotifyDone();
+		return;
+	}
+	Submit(pRequest);
+}
+
+void HttpClient::Submit(const Ptr<HttpRequest>& pRequest) {
+	if (pRequest->GetStatus() == HttpRequest::BUILDING)
+		pRequest->CompileRequest();
+	IwAssert(HTTP_CLIENT, pRequest->GetStatus() == HttpRequest::PENDING);
+	if (m_defaultHeadersChanged) {
+		m_pDefaultHeaderTemplate = m_defaultHeaders.Empty() ? nullptr : new HttpHeaderTemplate(m_defaultHeaders, ++m_defaultHeadersVersion);
+		m_defaultHeadersChanged = false;
+	}
+	pRequest->m_pDefaultHeaders = m_pDefaultHeaderTemplate;
+	pRequest->m_sizeHint = m_sizeHintsEnabled && pRequest->GetMethod() != HttpRequest::HEAD ? m_sizeHints.Find(HttpUrl::GetEndpoint(pRequest->GetURL())) : 0;
+	Ptr<HttpMemoryCache::Entry> p_hit;
+	if (m_pMemoryCache && !pRequest->GetSink()) { // (A sink runs on the worker thread: see HttpRequest::SetSink())
+		const string key = pRequest->GetMemoryCacheKey();
+		if (!key.empty())
+			p_hit = m_pMemoryCache->Find(key);
+	}
+	if (!p_hit && m_negativeTtlMs && !pRequest->GetSink() && (pRequest->GetMethod() == HttpRequest::GET || pRequest->GetMethod() == HttpRequest::HEAD)) {
+		if (const int status_code = FindMissing(pRequest->GetURL())) {
+			// Known to be missing: answered as a memory cache hit is, with an empty response of the same status
+			p_hit = new HttpMemoryCache::Entry;
+			const string status_line = status_code == 410 ? "HTTP/1.1 410 Gone" : "HTTP/1.1 404 Not Found";
+			p_hit->headers.SetStatusLine(status_line.data(), status_line.size());
+			p_hit->statusCode = status_code;
+		}
+	}
+	if (p_hit) {
+		// Completed on the next Update(), rather than right now: the caller may not expect its callback yet.
+		pRequest->m_queuedMs = s3eTimerGetMs();
+		if (m_pTracer) {
+			pRequest->m_traceId = m_pTracer->NewId(*pRequest.ptr());
+			Trace(*pRequest.ptr(), HttpTracer::EVENT_QUEUED);
+		}
+		m_memoryHits.push_back(std::make_pair(pRequest, p_hit));
+		return;
+	}
+	Enqueue(pRequest);
+}
+
+uint HttpClient::PreloadMemoryCache(uint numEntries) {
+	if (!m_pCache || !m_pMemoryCache || !m_pCpuPool)
+		return 0;
+	std::vector<HttpCache::Entry*> entries;
+	m_pCache->AcquireHottest(entries, numEntries, m_pMemoryCache->GetMaxEntrySize(), m_pMemoryCache->GetMaxSize());
+	for (auto it = entries.rbegin(); it != entries.rend(); it++) { // (The hottest last, so that it ends up the most recently used)
+		Ptr<PreloadJob> p_job = new PreloadJob(this, m_pCache, *it);
+		m_preloads.push_back(p_job.ptr());
+		m_pCpuPool->Submit(p_job);
+	}
+	return (uint)entries.size();
+}
+
+void HttpClient::FinishPreload(PreloadJob* pJob, bool success) {
+	m_preloads.erase(std::find(m_preloads.begin(), m_preloads.end(), pJob));
+	HttpCache::Entry* p_entry = pJob->GetEntry();
+	if (success && m_pMemoryCache && !p_entry->dead) {
+		const string key = string("GET ").append(p_entry->url); // (As HttpRequest::GetMemoryCacheKey() makes it)
+		const int64 fresh_ms = (int64)(p_entry->storedMs + p_entry->maxAgeMs) - (int64)s3eTimerGetUTC();
+		if (fresh_ms > 0 && !m_pMemoryCache->Find(key)) // (One that got there first is at least as new)
+			m_pMemoryCache->Store(key, p_entry->headers, pJob->GetBody().data(), pJob->GetBody().size(), fresh_ms);
+	}
+	pJob->GetCache()->Release(p_entry);
+}
+
+void HttpClient::SetDefaultHeader(const string& header, const string& value) {
+	if (value.empty())
+		m_defaultHeaders.Remove(header.data(), header.size());
+	else
+		m_defaultHeaders.Set(header, value);
+	m_defaultHeadersChanged = true;
+}
+
+void HttpClient::SetDefaultHeaders(const HttpHeaders& headers) {
+	m_defaultHeaders = headers;
+	m_defaultHeadersChanged = true;
+}
+
+void HttpClient::QueueRequests(const std::vector< Ptr<HttpRequest> >& requests, Ptr<HttpRequestGroup> pGroup) {
+	pGroup->Add(requests);
+	const HttpRequest::Priority priority = pGroup->GetPriority();
+	for (auto it = requests.begin(); it != requests.end(); it++) {
+		(*it)->SetPriority(priority);
+		QueueRequest(*it, pGroup);
+	}
+	pGroup->NotifyIfDone();
+}
+
+void HttpClient::Enqueue(const Ptr<HttpRequest>& pRequest, uint64 notBeforeMs) {
+	pRequest->m_queuedMs = s3eTimerGetMs();
+	if (m_pTracer) {
+		if (!pRequest->m_traceId)
+			pRequest->m_traceId = m_pTracer->NewId(*pRequest.ptr());
+		Trace(*pRequest.ptr(), HttpTracer::EVENT_QUEUED);
+	}
+	const uint64 open_until_ms = m_scheduler.GetOpenUntil(pRequest->GetOrigin(), pRequest->m_queuedMs);
+	if (open_until_ms && notBeforeMs < open_until_ms) {
+		m_failingFast.push_back(pRequest); // Failed on the next Update(), rather than right now: the caller may not expect its callback yet
+		return;
+	}
+	const string key = pRequest->GetCoalesceKey();
+	if (!key.empty()) {
+		if (HttpRequest* p_leader = m_scheduler.FindLeader(key)) {
+			if (AddFollower(*p_leader, pRequest))
+				return;
+		}
+	}
+	m_scheduler.Push(pRequest, notBeforeMs);
+	if (!key.empty())
+		m_scheduler.SetLeader(pRequest.ptr(), key);
+}
+
+bool HttpClient::AddFollower(HttpRequest& leader, const Ptr<HttpRequest>& pFollower) {
+	if (leader.m_followers.size() >= Worker::MAX_FOLLOWERS || leader.m_abortRequested || leader.m_hedged)
+		return false; // (A hedged request may get its response from either of two workers, so it can't be followed)
+	if (leader.GetStatus() == HttpRequest::PENDING) {
+		// Still queued: the followers get handed to the worker along with it
+		leader.m_followers.push_back(pFollower);
+		if (pFollower->GetPriority() > leader.GetPriority())
+			leader.SetPriority(pFollower->GetPriority());
+		return true;
+	}
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		Worker& worker = m_workers[i];
+		if (worker.status != Worker::ACTIVE || worker.pRequest.ptr() != &leader)
+			continue;
+		// In flight: it can still be followed if its response headers haven't arrived yet
+		pFollower->m_timings.queueMs = s3eTimerGetMs() - pFollower->m_queuedMs;
+		Trace(*pFollower.ptr(), HttpTracer::EVENT_STARTED);
+		pFollower->HandleRequestStart();
+		if (worker.AddFollower(pFollower.ptr())) {
+			leader.m_followers.push_back(pFollower);
+			return true;
+		}
+		pFollower->HandleRequeue(); // Too late; it goes back to being an ordinary PENDING request
+		break;
+	}
+	return false;
+}
+
+// The app thread's CPU time since startUs (see HttpClient_ThreadCpuUs()), for HttpRequest::Timings::appCpuMs:
+static double HttpClient_CpuMsSince(uint64 startUs) {
+	return (double)(HttpClient_ThreadCpuUs() - startUs) / 1000;
+}
+
+void HttpClient::CompleteFromMemory(HttpRequest& request, const Ptr<HttpMemoryCache::Entry>& pEntry) {
+	request.m_fromCache = true;
+	CompleteLocally(request, pEntry->statusCode, pEntry->headers, pEntry->body.data(), pEntry->body.size());
+}
+
+void HttpClient::CompleteLocally(HttpRequest& request, int httpStatusCode, const HttpHeaders& headers, const char* pBody, size_t bodySize) {
+	// Everything that a worker and HandleWorkerDone() would do, but all on this thread, so every
+	// Worker_ method of the request runs in the app's memory environment, consistently:
+	HTTP_ALLOC_SCOPE(SITE_CALLBACK, &request.m_allocStats);
+	const uint64 cpu_start_us = HttpClient_ThreadCpuUs();
+	request.m_timings.queueMs = s3eTimerGetMs() - request.m_queuedMs;
+	Trace(request, HttpTracer::EVENT_STARTED);
+	request.HandleRequestStart();
+	request.Worker_HandleResponseHeaders(headers, httpStatusCode);
+	bool success = !bodySize || request.Worker_HandleData((const unsigned char*)pBody, bodySize) == bodySize;
+	request.Worker_HandleDone(success, httpStatusCode);
+	success = success && httpStatusCode > 0 && httpStatusCode < 400;
+	request.Worker_NotifyDone(success, httpStatusCode);
+	request.HandleResponseHeaders(headers);
+	request.HandleResponse(success, httpStatusCode);
+	RecordResult(request, success);
+	if (request.GetStatus() != HttpRequest::HEADERS) {
+		request.NotifyDone();
+		Trace(request, HttpTracer::EVENT_CALLBACK);
+	}
+	request.Worker_HandleCleanup();
+	request.m_timings.appCpuMs += HttpClient_CpuMsSince(cpu_start_us);
+	RecordEndpointCpu(request);
+	Trace(request, HttpTracer::EVENT_CLEANUP);
+}
+
+// Latency histogram buckets: 0-3 ms get a bucket each; above that, each power of two is split into four.
+static uint HttpClient_LatencyBucket(uint64 ms) {
+	if (ms < 4)
+		return (uint)ms;
+	uint exponent = 2;
+	while (exponent < 40 && (ms >> (exponent + 1)) != 0)
+		exponent++;
+	return 4 * (exponent - 1) + (uint)((ms >> (exponent - 2)) & 3);
+}
+
+// The lowest latency that goes in a bucket:
+static uint64 HttpClient_LatencyBucketStart(uint bucket) {
+	if (bucket < 4)
+		return bucket;
+	const uint exponent = bucket / 4 + 1;
+	return (uint64)(4 + bucket % 4) << (exponent - 2);
+}
+
+void HttpClient::HandleResponseHeaders(Worker& worker) {
+	const uint64 response_ms = s3eTimerGetMs() - worker.startedMs;
+	m_responseBuckets[MIN(HttpClient_LatencyBucket(response_ms), (uint)NUM_LATENCY_BUCKETS - 1)]++;
+	m_numResponses++;
+	RecordResponseTime(response_ms);
+	if (worker.hedgeRole == Worker::HEDGE_SECOND)
+		m_numHedgeWins++;
+	uint64 cpu_start_us = HttpClient_ThreadCpuUs();
+	worker.pRequest->HandleResponseHeaders(worker.responseHeaders);
+	worker.pRequest->m_timings.appCpuMs += HttpClient_CpuMsSince(cpu_start_us);
+	if (m_pBudget && worker.status == Worker::ACTIVE) {
+		// Now we know how big the body is (when the transfer is already over, its charge has gone):
+		const char* p_length = worker.responseHeaders.Find("Content-Length");
+		ChargeMemory(worker, worker.pRequest->EstimateMemory(p_length ? strtoll(p_length, nullptr, 10) : -1));
+	}
+	const uint num_followers = worker.NumFollowers(); // (Final, now that the headers have arrived)
+	for (uint i = 0; i < num_followers; i++) {
+		if (worker.followers[i]->GetStatus() != HttpRequest::SENDING)
+			continue;
+		cpu_start_us = HttpClient_ThreadCpuUs();
+		worker.followers[i]->HandleResponseHeaders(worker.responseHeaders);
+		worker.followers[i]->m_timings.appCpuMs += HttpClient_CpuMsSince(cpu_start_us);
+	}
+}
+
+void HttpClient::SetTimings(HttpRequest& request, const HttpRequest::Timings& timings) {
+	const uint64 queue_ms = request.m_timings.queueMs; // Our own measurements
+	const double app_cpu_ms = request.m_timings.appCpuMs;
+	request.m_timings = timings;
+	request.m_timings.queueMs = queue_ms;
+	request.m_timings.appCpuMs = app_cpu_ms;
+}
+
+void HttpClient::HandleWorkerDone(Worker& worker) {
+	IwAssert(HTTP_CLIENT, worker.status == Worker::DONE);
+	if (!m_dnsSnapshotFile.empty())
+		LearnHostAddress(worker);
+	if (worker.addressFamilyMemo != Worker::FAMILY_FIXED)
+		LearnAddressFamily(worker);
+	ChargeMemory(worker, 0); // The response is about to be handed to the request, or dropped
+	HttpScheduler& scheduler = GetScheduler(worker);
+	if (worker.hedgeRole != Worker::HEDGE_SECOND) // (The request only counts against its host once, for the first worker)
+		scheduler.HandleFinished(worker.pRequest.ptr()); // Its host can now start another request
+	scheduler.RemoveLeader(worker.pRequest.ptr()); // Any identical requests that are queued from now on must be sent again
+	if (!worker.OwnsRequest()) {
+		// Hedging: the other worker sending this request got its response first, and has handled it or will do.
+		// This one aborted its transfer, and just cleans up.
+		FinishCache(worker, false);
+		worker.memoryCacheKey.clear();
+		DeferCleanup(worker);
+		return;
+	}
+	if (worker.wasAborted && worker.pRequest->Worker_IsAborted()) {
+		// HttpRequest::Abort(): nobody wants the response any more (the followers, if any, have all been aborted too).
+		// The worker just cleans up, and is then free for the next request.
+		if (worker.preempted) {
+			worker.preempted = false;
+			m_numPreempting--;
+		}
+		FinishCache(worker, false);
+		worker.memoryCacheKey.clear();
+		worker.pRequest->m_status = HttpRequest::CANCELLED;
+		worker.pRequest->ReleaseDependents();
+		for (uint i = 0; i < worker.NumFollowers(); i++) {
+			worker.followers[i]->m_status = HttpRequest::CANCELLED;
+			worker.followers[i]->ReleaseDependents();
+		}
+		DeferCleanup(worker);
+		return;
+	}
+	if (worker.preempted) {
+		worker.preempted = false;
+		m_numPreempting--;
+		if (worker.wasAborted) {
+			// The transfer was aborted to make room for a more important request. Don't report
+			// anything to the requestee: once the worker has cleaned up, the request gets queued again.
+			FinishCache(worker, false);
+			worker.memoryCacheKey.clear();
+			worker.requeue = true;
+			worker.PrepareCleanup();
+			worker.WakeToStatus(Worker::CLEANUP); // (It must have cleaned up before the request can be sent again)
+			return;
+		}
+		// Otherwise, it finished before noticing that it had been preempted.
+	}
+	RecordCongestion(worker);
+	if (worker.mirrorOriginId)
+		LearnMirror(worker); // (Before a retry or failover, which then goes elsewhere if this origin failed)
+	else if (worker.config.maxRedirects > 0)
+		LearnRedirect(worker); // (Before a retry, which then goes to the request's own URL if a remembered redirect failed)
+	if (!worker.mirrorOriginId)
+		LearnCircuit(worker); // (Before a retry, which then waits if the request's host has just tripped its breaker)
+	if (ShouldFailOver(worker)) {
+		// The request's mirror set has another origin that is up: try that one straight away, rather than backing off.
+		s3eDebugTracePrintf("HttpClient: Failing over %s %s to another mirror (curl result %d, HTTP status %ld)", worker.pRequest->GetMethodStr(), worker.pRequest->GetURL().c_str(),
+			(int)worker.result, worker.responseStatusCode);
+		FinishCache(worker, false);
+		worker.memoryCacheKey.clear();
+		worker.pRequest->m_numFailovers++;
+		m_numRetries++;
+		m_numFailovers++;
+		worker.requeue = true;
+		worker.PrepareCleanup();
+		worker.WakeToStatus(Worker::CLEANUP);
+		return;
+	}
+	if (const uint64 retry_delay_ms = GetRetryDelayMs(worker)) {
+		// A failure that may well go away. Again, don't report it: once the worker has cleaned up, the request gets
+		// queued again, but held back until the delay is over.
+		s3eDebugTracePrintf("HttpClient: Retrying %s %s in %u ms (curl result %d, HTTP status %ld)", worker.pRequest->GetMethodStr(), worker.pRequest->GetURL().c_str(),
+			(uint)retry_delay_ms, (int)worker.result, worker.responseStatusCode);
+		FinishCache(worker, false);
+		worker.memoryCacheKey.clear();
+		worker.pRequest->m_numRetries++;
+		m_numRetries++;
+		worker.requeue = true;
+		// (Not before its host's breaker lets a probe through, if it is open; otherwise it would just fail fast)
+		worker.requeueNotBeforeMs = MAX(s3eTimerGetMs() + retry_delay_ms, scheduler.GetOpenUntil(worker.pRequest->GetOrigin(), s3eTimerGetMs()));
+		worker.PrepareCleanup();
+		worker.WakeToStatus(Worker::CLEANUP);
+		return;
+	}
+	// This request has *just* finished.
+	// If the response was returned all at once, we may not yet have called HandleResponseHeaders()
+	if (worker.pRequest->GetStatus() == HttpRequest::SENDING)
+		HandleResponseHeaders(worker);
+	FinishCache(worker, true);
+	if (!worker.memoryCacheKey.empty()) {
+		if (worker.result == CURLE_OK && worker.responseStatusCode == 200 && !worker.memoryBodyTooBig)
+			m_pMemoryCache->Store(worker.memoryCacheKey, worker.pRequest->GetResponseHeaders(), worker.memoryBody.data(), worker.memoryBody.size()); // (Copied into our memory environment)
+		worker.memoryCacheKey.clear();
+	}
+	if (worker.recordTransfer && worker.result == CURLE_OK && !worker.cacheServed)
+		RecordResponse(worker);
+	if (m_sizeHintsEnabled && worker.result == CURLE_OK && worker.responseStatusCode == 200 && !worker.cacheServed && worker.pRequest->GetMethod() != HttpRequest::HEAD)
+		m_sizeHints.Learn(HttpUrl::GetEndpoint(worker.pRequest->GetURL()), (size_t)worker.pRequest->GetDownloadedBytes());
+	if (worker.result == CURLE_OK && !worker.cacheServed)
+		LearnMissing(worker);
+	// Now call the request's response handling code:
+	bool success = (worker.result == CURLE_OK) && (worker.responseStatusCode < 400);
+	SetTimings(*worker.pRequest.ptr(), worker.timings);
+#ifdef HTTP_ALLOC_STATS
+	worker.pRequest->m_allocStats.Add(worker.allocStats);
+#endif
+	{
+		HTTP_ALLOC_SCOPE(SITE_CALLBACK, &worker.pRequest->m_allocStats);
+		const uint64 cpu_start_us = HttpClient_ThreadCpuUs();
+		if (HttpSink* p_sink = worker.pRequest->GetSink())
+			p_sink->HandleDone(success);
+		worker.pRequest->HandleResponse(success, (int)worker.responseStatusCode);
+		RecordResult(*worker.pRequest.ptr(), success);
+		// Now call the registered callback, if any (unless the request isn't finished yet; see HttpRequest::HandleResponse()):
+		if (worker.pRequest->GetStatus() != HttpRequest::HEADERS) {
+			worker.pRequest->NotifyDone();
+			Trace(*worker.pRequest.ptr(), HttpTracer::EVENT_CALLBACK);
+		}
+		worker.pRequest->m_timings.appCpuMs += HttpClient_CpuMsSince(cpu_start_us);
+		RecordEndpointCpu(*worker.pRequest.ptr());
+	}
+	m_bytesFinished += worker.timings.bytesUploaded + worker.timings.bytesDownloaded; // (Once, however many followers there are)
+	// Followers get the same response, unless they failed to take the data:
+	const uint num_followers = worker.NumFollowers();
+	for (uint i = 0; i < num_followers; i++) {
+		HttpRequest* p_follower = worker.followers[i];
+		HTTP_ALLOC_SCOPE(SITE_CALLBACK, &p_follower->m_allocStats);
+		const uint64 cpu_start_us = HttpClient_ThreadCpuUs();
+		p_follower->m_fromCache = worker.pRequest->m_fromCache;
+		SetTimings(*p_follower, worker.timings);
+		if (HttpSink* p_sink = p_follower->GetSink())
+			p_sink->HandleDone(success && !worker.followerFailed[i]);
+		p_follower->HandleResponse(success && !worker.followerFailed[i], (int)worker.responseStatusCode);
+		RecordResult(*p_follower, success && !worker.followerFailed[i]);
+		if (p_follower->GetStatus() != HttpRequest::HEADERS) {
+			p_follower->NotifyDone();
+			Trace(*p_follower, HttpTracer::EVENT_CALLBACK);
+		}
+		p_follower->m_timings.appCpuMs += HttpClient_CpuMsSince(cpu_start_us);
+		RecordEndpointCpu(*p_follower);
+	}
+	// The worker can clean up now. Update() wakes it, with its next request if there is one:
+	DeferCleanup(worker);
+}
+
+void HttpClient::DeferCleanup(Worker& worker) {
+	worker.PrepareCleanup();
+	worker.cleanupDeferred = true;
+}
+
+void HttpClient::DrainLogs() {
+	if (!HttpLogRing::TakePending(m_logPending))
+		return;
+	for (uint i = 0; i < NUM_WORKERS; i++)
+		m_workers[i].log.Drain();
+	for (uint t = 0; t < NUM_IO_THREADS; t++)
+		m_ioThreads[t].log.Drain();
+}
+
+// The microseconds left of an Update()'s budget (see HttpClient::Update()); at least 1, so that it still handles one more
+static uint HttpClient_BudgetLeft(uint64 deadlineUs) {
+	const uint64 now_us = HttpTracer::NowUs();
+	return now_us + 1 < deadlineUs ? (uint)(deadlineUs - now_us) : 1;
+}
+
+void HttpClient::Update(uint maxMicroseconds) {
+	const uint64 start_us = HttpTracer::NowUs();
+	const uint64 deadline_us = maxMicroseconds ? start_us + maxMicroseconds : 0;
+	if (!HttpClient_FinishAsyncInit(false))
+		return; // Nothing can be sent until GlobalInitAsync() has finished; until then, requests wait in the queue
+	DrainLogs(); // What the workers have logged since the last update
+	// First, process any requests that have finished since the last update, in the order they finished (as many as
+	// the budget allows: the rest stay in the queue, and their workers DONE, until the next update):
+	bool over_budget = false;
+	while (Worker* p_done_worker = m_pCompletions->Pop()) {
+		HandleWorkerDone(*p_done_worker);
+		if (deadline_us && HttpTracer::NowUs() >= deadline_us) {
+			over_budget = !m_pCompletions->IsEmpty();
+			break;
+		}
+	}
+	if (m_pCpuPool)
+		m_pCpuPool->Update(deadline_us ? HttpClient_BudgetLeft(deadline_us) : 0); // The jobs that have finished, e.g. those that the callbacks above handed it last time
+	if (m_pDiskWriter)
+		m_pDiskWriter->Update(); // The downloads whose files it has finished
+	// Then the memory cache hits. (Any that their callbacks queue will be completed next time.)
+	if (!m_memoryHits.empty()) {
+		MemoryHits hits;
+		hits.swap(m_memoryHits);
+		uint num_hits = 0;
+		for (auto it = hits.begin(); it != hits.end(); it++) {
+			if (deadline_us && num_hits && HttpTracer::NowUs() >= deadline_us) {
+				// Out of time: the rest go first next time, ahead of any that the callbacks queued
+				m_memoryHits.insert(m_memoryHits.begin(), it, hits.end());
+				over_budget = true;
+				break;
+			}
+			if (it->first->GetStatus() == HttpRequest::PENDING) { // i.e. not cancelled
+				CompleteFromMemory(*it->first.ptr(), it->second);
+				num_hits++;
+			}
+		}
+	}
+	// And the requests to hosts whose breaker is open:
+	if (!m_failingFast.empty()) {
+		std::vector< Ptr<HttpRequest> > failing;
+		failing.swap(m_failingFast);
+		for (auto it = failing.begin(); it != failing.end(); it++) {
+			if ((*it)->GetStatus() == HttpRequest::PENDING) // i.e. not cancelled
+				FailFast(*it->ptr());
+		}
+	}
+	if (over_budget)
+		m_numOverBudget++;
+	
+	// And the requests queued with dependencies that had all completed already:
+	if (!m_readyDependents.empty()) {
+		std::vector< Ptr<HttpRequest> > ready;
+		ready.swap(m_readyDependents);
+		for (auto it = ready.begin(); it != ready.end(); it++) {
+			if ((*it)->m_pWaitingClient == this) // i.e. not cancelled
+				ReleaseDependent(*it);
+		}
+	}
+	
+	FinishHostRefresh(); // (If there is one, and it's done)
+	const uint64 now_ms = s3eTimerGetMs();
+	m_timers.Advance(now_ms); // Retries whose backoff is over can go now, and queued requests past their deadline expire
+	if (m_networkProfilesEnabled)
+		CheckNetworkType(now_ms);
+	const uint concurrency_limit = GetConcurrencyLimit();
+	uint num_transfers = NumTransfers();
+	const bool limit_background = GetNetworkProfile().maxBackgroundTransfers != NetworkProfile::NO_LIMIT;
+	const bool limit_large = m_sizeLanes.largeBytes != 0;
+	m_numBackgroundTransfers = m_numLargeTransfers = 0; // (For AcceptByProfile() and AcceptToStart())
+	m_maxLargeTransfers = concurrency_limit > m_sizeLanes.reservedWorkers ? concurrency_limit - m_sizeLanes.reservedWorkers : 1;
+	for (uint i = 0; i < NUM_WORKERS && (limit_background || limit_large); i++) {
+		const Worker& worker = m_workers[i];
+		const Worker::StatusCode status = worker.status;
+		if (status != Worker::ACTIVE && (status != Worker::DONE || worker.cleanupDeferred))
+			continue;
+		if (worker.pRequest->GetPriority() == HttpRequest::PRIORITY_BACKGROUND)
+			m_numBackgroundTransfers++;
+		if (limit_large && IsLarge(*worker.pRequest.ptr()))
+			m_numLargeTransfers++;
+	}
+	uint num_live_workers = 0; // Workers that have a thread/handle and aren't being retired
+	for (uint i=0; i < NUM_WORKERS; i++) {
+		const Worker::StatusCode status = m_workers[i].status;
+		if (status != Worker::UNUSED && status != Worker::RETIRE && status != Worker::RETIRED)
+			num_live_workers++;
+	}
+	
+	// Next, check if any of our worker threads have received their response headers, or are
+	// free (not currently processing a request). Every free worker can be given a new request:
+	for (uint i=0; i < NUM_WORKERS; i++) {
+		Worker& worker = m_workers[i];
+		const Worker::StatusCode status = worker.status; // (One acquire per worker; what the worker may change it to next is handled next time)
+		if (worker.pCleanupRequest && !worker.cleanupPending) {
+			// The worker has cleaned up after its last request, so we can let go of it and its followers:
+			worker.pCleanupRequest = nullptr;
+			worker.cleanupFollowers.clear();
+		}
+		if (status == Worker::ACTIVE) {
+			const uint64 deadline_ms = worker.pRequest->m_deadlineMs;
+			if (deadline_ms && now_ms >= deadline_ms && !worker.pRequest->m_aborted) {
+				// Too late to be of any use: stop the transfer (unless a follower without a deadline still wants it)
+				worker.pRequest->m_expired = true;
+				worker.pRequest->Abort();
+				m_numExpired++;
+			}
+			if (worker.pRequest->GetStatus() == HttpRequest::SENDING && worker.responseHeadersDone) {
+				// We have now received all the response headers.
+				// Since we are on the app thread, we can now update the reqest "responseHeaders" map:
+				HandleResponseHeaders(worker);
+				// The above method should also mark the request's status as HttpRequest::HEADERS
+			}
+			if (worker.pRequest->GetStatus() == HttpRequest::HEADERS) {
+				const uint64 cpu_start_us = HttpClient_ThreadCpuUs();
+				worker.pRequest->HandleReceiving();
+				worker.pRequest->m_timings.appCpuMs += HttpClient_CpuMsSince(cpu_start_us);
+			}
+		} else if (status == Worker::DONE && !worker.cleanupDeferred) {
+			// This worker has finished but it hasn't come off the completion queue yet; we'll handle it next time.
+		} else if (status == Worker::CLEANUP) {
+			// We are waiting for the worker to finish cleaning up the request it just finished.
+		} else if (status == Worker::RETIRE) {
+			// We are waiting for this idle worker to free its resources.
+		} else if (status == Worker::RETIRED) {
+			FinishRetiringWorker(worker);
+		} else {
+			// Worker status is either UNUSED or READY, or DONE with its response processed, in which case it cleans up
+			// after that as it starts the next request. This worker can receive a new request:
+			if (worker.pRequest) {
+				std::vector< Ptr<HttpRequest> > followers;
+				followers.swap(worker.pRequest->m_followers); // Their worker cleanup has been done too, unless it has been deferred
+				if (worker.requeue) {
+					// This request was preempted or is to be retried; now that the worker has cleaned up, it can be sent
+					// again later (and so can its followers, which will most likely follow it again), by the client
+					// it was queued with:
+					HttpClient& owner = worker.pOwner ? *worker.pOwner : *this;
+					worker.requeue = false;
+					worker.pRequest->HandleRequeue();
+					owner.Enqueue(worker.pRequest, worker.requeueNotBeforeMs);
+					worker.requeueNotBeforeMs = 0;
+					for (auto it = followers.begin(); it != followers.end(); it++) {
+						(*it)->HandleRequeue();
+						owner.Enqueue(*it);
+					}
+				}
+				if (worker.cleanupDeferred) {
+					// The worker hasn't cleaned up after them yet, so they have to stay alive until it has:
+					worker.pCleanupRequest = std::move(worker.pRequest);
+					worker.cleanupFollowers.swap(followers);
+				}
+				worker.pRequest = nullptr; // Free the HttpRequest object, which we no longer need.
+				worker.pOwner = nullptr;
+				worker.hedgeRole = Worker::HEDGE_NONE;
+			}
+			// Cancelled requests are removed from the scheduler immediately, so anything we get is PENDING.
+			// (We may get nothing even if requests are waiting, if their hosts are all at their limit.)
+			Ptr<HttpRequest> p_request;
+			if (num_transfers < concurrency_limit && !m_suspended) {
+				p_request = PopRequest(limit_background || limit_large || m_pBudget);
+				if (!p_request && m_pWorkPool && (worker.status == Worker::READY || worker.cleanupDeferred))
+					p_request = m_pWorkPool->Borrow(*this, worker.pOwner); // Help out a client that has no worker for it
+			} else if (!m_scheduler.Empty()) {
+				m_windowLimited = true; // (See SetAdaptiveConcurrency())
+			}
+			if (p_request) {
+				IwAssert(HTTP_CLIENT, p_request->GetStatus() == HttpRequest::PENDING);
+				if (worker.status == Worker::UNUSED)
+					num_live_workers++;
+				num_transfers++;
+				if (p_request->GetPriority() == HttpRequest::PRIORITY_BACKGROUND)
+					m_numBackgroundTransfers++;
+				if (limit_large && IsLarge(*p_request.ptr()))
+					m_numLargeTransfers++;
+				worker.idleSinceMs = 0;
+				StartRequest(worker, p_request); // (Which wakes a DONE worker straight to ACTIVE)
+				worker.cleanupDeferred = false;
+			} else if (worker.cleanupDeferred) {
+				// Nothing for it to do next, so it just cleans up:
+				worker.cleanupDeferred = false;
+				worker.WakeToStatus(Worker::CLEANUP);
+			} else if (worker.status == Worker::READY) {
+				// Nothing to do. If this worker has been idle for long enough, or we're suspended, shrink the pool:
+				if (m_suspended) {
+					num_live_workers--;
+					worker.idleSinceMs = 0;
+					worker.WakeToStatus(Worker::RETIRE);
+				} else if (worker.idleSinceMs == 0)
+					worker.idleSinceMs = now_ms;
+				else if (m_idleTimeoutMs && now_ms - worker.idleSinceMs >= m_idleTimeoutMs && num_live_workers > m_minWorkers) {
+					num_live_workers--;
+					worker.idleSinceMs = 0;
+					worker.WakeToStatus(Worker::RETIRE);
+				}
+			}
+		}
+	}
+	
+	if (m_preemption && !m_scheduler.Empty() && !m_suspended)
+		PreemptForCriticalRequests();
+	if (IsHedging() && m_scheduler.Empty() && !m_suspended)
+		StartHedges(now_ms);
+	SampleRate(now_ms);
+	const uint64 elapsed_us = HttpTracer::NowUs() - start_us;
+	m_lastUpdateUs = elapsed_us < UINT_MAX ? (uint)elapsed_us : UINT_MAX;
+	m_maxUpdateUs = MAX(m_maxUpdateUs, m_lastUpdateUs);
+}
+
+void HttpClient::ExpireRequest(HttpRequest* pRequest) {
+	// (If identical requests were following it, the first takes its place in the queue, and its deadline timer is
+	// called in this same Advance() if it has passed too)
+	pRequest->m_expired = true;
+	pRequest->Cancel();
+	m_numExpired++;
+}
+
+void HttpClient::RecordResult(const HttpRequest& request, bool success) {
+	if (request.GetStatus() == HttpRequest::HEADERS)
+		return; // Not finished yet (e.g. an HttpSegmentedDownload's probe)
+	success = success && request.GetStatus() == HttpRequest::DONE;
+	if (success)
+		m_numCompleted++;
+	else
+		m_numFailed++;
+	const uint bucket = MIN(HttpClient_LatencyBucket(s3eTimerGetMs() - request.m_queuedMs), (uint)NUM_LATENCY_BUCKETS - 1);
+	m_latencyBuckets[bucket]++;
+	if (HTTP_PROBES && m_maxEndpoints)
+		RecordEndpoint(request, success, bucket);
+}
+
+void HttpClient::RecordEndpoint(const HttpRequest& request, bool success, uint latencyBucket) {
+	string endpoint = HttpUrl::GetEndpoint(request.GetURL());
+	auto it = m_endpoints.find(endpoint);
+	if (it == m_endpoints.end()) {
+		// (Counting "*" as one of them)
+		if (m_endpoints.size() + 1 >= m_maxEndpoints)
+			endpoint = "*";
+		it = m_endpoints.find(endpoint);
+		if (it == m_endpoints.end()) {
+			EndpointEntry entry;
+			memset(&entry, 0, sizeof(entry));
+			it = m_endpoints.insert(std::make_pair(endpoint, entry)).first;
+		}
+	}
+	EndpointEntry& entry = it->second;
+	entry.numRequests++;
+	if (!success)
+		entry.numFailed++;
+	entry.bytesDown += request.GetDownloadedWireBytes();
+	entry.bytesUp += request.GetUploadedBytes();
+	entry.latencyBuckets[latencyBucket]++;
+}
+
+void HttpClient::RecordEndpointCpu(const HttpRequest& request) {
+	if (!HTTP_PROBES || !m_maxEndpoints || request.GetStatus() == HttpRequest::HEADERS)
+		return; // (Not recorded by RecordResult() either)
+	auto it = m_endpoints.find(HttpUrl::GetEndpoint(request.GetURL()));
+	if (it == m_endpoints.end())
+		it = m_endpoints.find("*");
+	if (it == m_endpoints.end())
+		return; // The stats were reset by the callback
+	it->second.workerCpuMs += request.m_timings.workerCpuMs;
+	it->second.appCpuMs += request.m_timings.appCpuMs;
+}
+
+void HttpClient::SampleRate(uint64 nowMs) {
+	if (nowMs - m_rateSampleMs < 1000)
+		return;
+	// Everything that has finished, plus what is in flight so far:
+	double total = m_bytesFinished;
+	const double seconds = m_rateSampleMs ? (nowMs - m_rateSampleMs) / 1000.0 : 0;
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		Worker& worker = m_workers[i];
+		if (worker.status == Worker::ACTIVE && worker.pRequest) {
+			total += worker.pRequest->GetDownloadedWireBytes() + worker.pRequest->GetUploadedBytes();
+			SampleWorkerRate(worker, seconds);
+		}
+	}
+	if (m_rateSampleMs) {
+		// (A requeued transfer starts counting again from zero, so this can briefly go backwards)
+		const double delta = total - m_rateSampleBytes;
+		m_bytesPerSecond = delta > 0 ? delta * 1000 / (nowMs - m_rateSampleMs) : 0;
+	}
+	if (m_rateSampleMs && m_adaptive.enabled)
+		AdjustConcurrency(seconds);
+	m_rateSampleBytes = total;
+	m_rateSampleMs = nowMs;
+	UpdateBandwidth();
+}
+
+void HttpClient::SetAdaptiveConcurrency(const AdaptiveConcurrency& settings) {
+	m_adaptive = settings;
+	m_adaptive.minConcurrency = MAX(1u, MIN(m_adaptive.minConcurrency, NUM_WORKERS));
+	m_concurrencyLimit = MAX(m_adaptive.minConcurrency, MIN(m_adaptive.initialConcurrency, NUM_WORKERS));
+	m_windowResponses = m_windowFinished = m_windowErrors = 0;
+	m_windowResponseMs = 0;
+	m_windowLimited = false;
+	m_lastFinishedRate = m_lastBytesRate = 0;
+	m_baselineResponseMs = 0;
+}
+
+uint HttpClient::GetConcurrencyLimit() const {
+	const uint limit = m_adaptive.enabled ? (uint)m_concurrencyLimit : NUM_WORKERS;
+	return MAX(1u, MIN(limit, GetNetworkProfile().maxConcurrency));
+}
+
+uint HttpClient::NumTransfers() const {
+	uint num_transfers = 0;
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		const Worker::StatusCode status = m_workers[i].status;
+		if (status == Worker::ACTIVE || (status == Worker::DONE && !m_workers[i].cleanupDeferred))
+			num_transfers++;
+	}
+	return num_transfers;
+}
+
+void HttpClient::SetNetworkProfiles(bool enabled) {
+	m_networkProfilesEnabled = enabled;
+	m_networkType = NETWORK_UNKNOWN;
+	m_networkCheckMs = 0; // So that the next Update() checks
+}
+
+const HttpClient::NetworkProfile& HttpClient::GetNetworkProfile() const {
+	static const NetworkProfile s_unlimited;
+	return m_networkProfilesEnabled ? m_networkProfiles[m_networkType] : s_unlimited;
+}
+
+static HttpClient::NetworkType HttpClient_GetNetworkType() {
+	switch (s3eSocketGetInt(S3E_SOCKET_NETWORK_TYPE)) {
+		case S3E_NETWORK_TYPE_NONE: return HttpClient::NETWORK_NONE;
+		case S3E_NETWORK_TYPE_UNKNOWN: return HttpClient::NETWORK_UNKNOWN;
+		case S3E_NETWORK_TYPE_LAN: case S3E_NETWORK_TYPE_WLAN: return HttpClient::NETWORK_WIFI;
+		case S3E_NETWORK_TYPE_GPRS: case S3E_NETWORK_TYPE_EDGE: return HttpClient::NETWORK_MOBILE_SLOW;
+		default: return HttpClient::NETWORK_MOBILE_FAST; // Every other kind of mobile network is 3G or later
+	}
+}
+
+void HttpClient::CheckNetworkType(uint64 nowMs) {
+	if (m_networkCheckMs && nowMs - m_networkCheckMs < 1000)
+		return;
+	m_networkCheckMs = nowMs;
+	const NetworkType type = HttpClient_GetNetworkType();
+	if (type == m_networkType)
+		return;
+	static const char* const s_names[NUM_NETWORK_TYPES] = { "unknown", "none", "Wi-Fi", "fast mobile", "slow mobile" };
+	s3eDebugTracePrintf("HttpClient: Network changed from %s to %s; switching profiles", s_names[m_networkType], s_names[type]);
+	m_networkType = type; // (Transfers already under way carry on; the new profile applies from the next one that starts)
+	ForgetAddressFamilies(); // (The new network's IPv6 may work, or not)
+}
+
+bool HttpClient::AcceptByProfile(const HttpRequest& request, const void* pClient) {
+	const HttpClient& client = *(const HttpClient*)pClient;
+	return request.GetPriority() != HttpRequest::PRIORITY_BACKGROUND || client.m_numBackgroundTransfers < client.GetNetworkProfile().maxBackgroundTransfers;
+}
+
+bool HttpClient::AcceptToStart(const HttpRequest& request, const void* pClient) {
+	const HttpClient& client = *(const HttpClient*)pClient;
+	if (client.m_sizeLanes.largeBytes && client.m_numLargeTransfers >= client.m_maxLargeTransfers && client.IsLarge(request))
+		return false; // The large lane is full; the rest of the workers are for small requests
+	return AcceptByProfile(request, pClient) && (!client.m_pBudget || client.m_pBudget->CanStart(request.EstimateMemory(-1)));
+}
+
+bool HttpClient::IsLarge(const HttpRequest& request) const {
+	if (!m_sizeLanes.largeBytes || request.GetMethod() == HttpRequest::HEAD || request.GetMethod() == HttpRequest::DELETE)
+		return false;
+	const uint64 download_size = request.GetExpectedSize() ? request.GetExpectedSize() : request.GetSizeHint();
+	return download_size >= m_sizeLanes.largeBytes || (uint64)MAX(request.GetUploadSize(), (int64)0) >= m_sizeLanes.largeBytes;
+}
+
+void HttpClient::SetMemoryBudget(HttpMemoryBudget* pBudget) {
+	IwAssert(HTTP_CLIENT, NumTransfers() == 0);
+	m_pBudget = pBudget;
+}
+
+void HttpClient::ChargeMemory(Worker& worker, size_t bytes) {
+	if (m_pBudget && bytes != worker.memoryCharge)
+		m_pBudget->Recharge(worker.memoryCharge, bytes);
+	worker.memoryCharge = m_pBudget ? bytes : 0;
+}
+
+void HttpClient::RecordResponseTime(uint64 ms) {
+	m_windowResponses++;
+	m_windowResponseMs += ms;
+}
+
+void HttpClient::AdjustConcurrency(double seconds) {
+	// Additive increase, multiplicative decrease: the limit creeps up for as long as that helps, and falls back
+	// quickly once the network or the servers show signs of having more than they can take.
+	bool congested = m_windowErrors > 0 && m_windowErrors >= m_adaptive.errorThreshold * m_windowFinished;
+	if (m_windowResponses) {
+		const double mean_ms = (double)m_windowResponseMs / m_windowResponses;
+		if (m_baselineResponseMs > 0 && mean_ms > m_baselineResponseMs * m_adaptive.latencyTolerance)
+			congested = true;
+		// The baseline follows a faster network at once, and a slower one gradually (so that e.g. a
+		// move from Wi-Fi to 3G only cuts the limit until it has become the new normal):
+		if (m_baselineResponseMs <= 0 || mean_ms < m_baselineResponseMs)
+			m_baselineResponseMs = mean_ms;
+		else
+			m_baselineResponseMs += (mean_ms - m_baselineResponseMs) / 16;
+	}
+	const double finished_rate = seconds > 0 ? m_windowFinished / seconds : 0;
+	const bool improved = finished_rate > m_lastFinishedRate * 1.05 || m_bytesPerSecond > m_lastBytesRate * 1.05;
+	const double old_limit = m_concurrencyLimit;
+	if (congested)
+		m_concurrencyLimit = MAX((double)m_adaptive.minConcurrency, m_concurrencyLimit * m_adaptive.backoff);
+	else if (m_windowLimited && improved)
+		m_concurrencyLimit = MIN((double)NUM_WORKERS, m_concurrencyLimit + 1);
+	if ((uint)m_concurrencyLimit != (uint)old_limit)
+		s3eDebugTracePrintf("HttpClient: Concurrency limit now %u (%s)", (uint)m_concurrencyLimit, congested ? "backing off" : "throughput improved");
+	m_lastFinishedRate = finished_rate;
+	m_lastBytesRate = m_bytesPerSecond;
+	m_windowResponses = m_windowFinished = m_windowErrors = 0;
+	m_windowResponseMs = 0;
+	m_windowLimited = false;
+}
+
+void HttpClient::SetBandwidthLimit(uint64 bytesPerSecond) {
+	m_bandwidthLimit = bytesPerSecond;
+	for (int p = 0; p < HttpRequest::NUM_PRIORITIES; p++)
+		m_bandwidthRecvBudget[p] = m_bandwidthSendBudget[p] = bytesPerSecond; // Until the next UpdateBandwidth()
+}
+
+// The smaller of two speed limits, either of which may be 0 for none:
+static uint64 HttpClient_MinSpeed(uint64 a, uint64 b) {
+	return !a ? b : !b ? a : MIN(a, b);
+}
+
+void HttpClient::SampleWorkerRate(Worker& worker, double seconds) {
+	const double recv = worker.pRequest->GetDownloadedWireBytes(), send = worker.pRequest->GetUploadedBytes();
+	// (A requeued transfer starts counting again from zero)
+	worker.recvRate = seconds > 0 && recv > worker.rateSampleRecv ? (recv - worker.rateSampleRecv) / seconds : 0;
+	worker.sendRate = seconds > 0 && send > worker.rateSampleSend ? (send - worker.rateSampleSend) / seconds : 0;
+	worker.rateSampleRecv = recv;
+	worker.rateSampleSend = send;
+}
+
+void HttpClient::UpdateBandwidth() {
+	// Strict priority: each level gets whatever the levels above it left of the budget last second, split
+	// evenly between its transfers. Levels that aren't using their share leave it to those below them.
+	double recv_left = (double)m_bandwidthLimit, send_left = (double)m_bandwidthLimit;
+	for (int p = HttpRequest::NUM_PRIORITIES - 1; p >= 0; p--) {
+		m_bandwidthRecvBudget[p] = m_bandwidthLimit ? (uint64)MAX(recv_left, (double)BANDWIDTH_MIN_SHARE) : 0;
+		m_bandwidthSendBudget[p] = m_bandwidthLimit ? (uint64)MAX(send_left, (double)BANDWIDTH_MIN_SHARE) : 0;
+		uint num_transfers = 0;
+		for (uint i = 0; i < NUM_WORKERS; i++) {
+			const Worker& worker = m_workers[i];
+			if (worker.status == Worker::ACTIVE && worker.pRequest->GetPriority() == p)
+				num_transfers++;
+		}
+		if (!num_transfers)
+			continue;
+		for (uint i = 0; i < NUM_WORKERS; i++) {
+			Worker& worker = m_workers[i];
+			if (worker.status != Worker::ACTIVE || worker.pRequest->GetPriority() != p)
+				continue;
+			SetWorkerSpeed(worker, num_transfers);
+			recv_left -= worker.recvRate;
+			send_left -= worker.sendRate;
+		}
+	}
+}
+
+void HttpClient::StartBandwidth(Worker& worker) {
+	worker.rateSampleRecv = worker.rateSampleSend = worker.recvRate = worker.sendRate = 0;
+	uint num_transfers = 1; // (Including this one)
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		if (&m_workers[i] != &worker && m_workers[i].status == Worker::ACTIVE && m_workers[i].pRequest->GetPriority() == worker.pRequest->GetPriority())
+			num_transfers++;
+	}
+	SetWorkerSpeed(worker, num_transfers); // Until the next UpdateBandwidth()
+}
+
+void HttpClient::SetWorkerSpeed(Worker& worker, uint numTransfers) {
+	const HttpRequest& request = *worker.pRequest.ptr();
+	const HttpRequest::Priority priority = request.GetPriority();
+	const uint64 recv_share = m_bandwidthLimit ? MAX(m_bandwidthRecvBudget[priority] / numTransfers, (uint64)BANDWIDTH_MIN_SHARE) : 0;
+	const uint64 send_share = m_bandwidthLimit ? MAX(m_bandwidthSendBudget[priority] / numTransfers, (uint64)BANDWIDTH_MIN_SHARE) : 0;
+	worker.maxRecvSpeed = HttpClient_MinSpeed(recv_share, request.m_maxRecvSpeed);
+	worker.maxSendSpeed = HttpClient_MinSpeed(send_share, request.m_maxSendSpeed);
+}
+
+uint HttpClient::GetLatencyPercentile(const uint* pBuckets, uint64 numRequests, double fraction) {
+	if (numRequests == 0)
+		return 0;
+	const uint64 target = (uint64)(numRequests * fraction) + 1; // The request that the percentile falls on, counting from 1
+	uint64 count = 0;
+	for (uint i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+		count += pBuckets[i];
+		if (count >= target)
+			return (uint)HttpClient_LatencyBucketStart(i + 1);
+	}
+	return (uint)HttpClient_LatencyBucketStart(NUM_LATENCY_BUCKETS);
+}
+
+void HttpClient::SetMaxBufferedBytes(size_t maxBytes) {
+	atomic::StoreRelaxed(m_pFlow->maxBufferedBytes, maxBytes); // (The workers see it in their next callback)
+}
+
+HttpClient::Stats HttpClient::GetStats() const {
+	Stats stats;
+	stats.numPending = (uint)(m_scheduler.Size() + m_memoryHits.size() + m_failingFast.size());
+	stats.numRetrying = (uint)m_scheduler.NumDelayed();
+	stats.numActive = stats.numIdle = stats.numCleanup = stats.numWorkers = stats.numLargeActive = 0;
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		switch (m_workers[i].status) {
+			case Worker::ACTIVE: case Worker::DONE: stats.numActive++; stats.numLargeActive += m_workers[i].pRequest && IsLarge(*m_workers[i].pRequest.ptr()) ? 1 : 0; break;
+			case Worker::READY: stats.numIdle++; break;
+			case Worker::CLEANUP: case Worker::RETIRE: stats.numCleanup++; break;
+			default: continue; // UNUSED or RETIRED: no thread/handle
+		}
+		stats.numWorkers++;
+	}
+	stats.numCompleted = m_numCompleted;
+	stats.numFailed = m_numFailed;
+	stats.numRetries = m_numRetries;
+	stats.numFailovers = m_numFailovers;
+	stats.numExpired = m_numExpired;
+	stats.numFailedFast = m_numFailedFast;
+	stats.bytesPerSecond = m_bytesPerSecond;
+	const uint64 num_requests = m_numCompleted + m_numFailed;
+	stats.latencyP50Ms = GetLatencyPercentile(m_latencyBuckets, num_requests, 0.5);
+	stats.latencyP90Ms = GetLatencyPercentile(m_latencyBuckets, num_requests, 0.9);
+	stats.latencyP99Ms = GetLatencyPercentile(m_latencyBuckets, num_requests, 0.99);
+	stats.responseP95Ms = GetLatencyPercentile(m_responseBuckets, m_numResponses, 0.95);
+	stats.numHedges = m_numHedges;
+	stats.numHedgeWins = m_numHedgeWins;
+	stats.numLent = m_numLent;
+	stats.numBorrowed = m_numBorrowed;
+	stats.concurrencyLimit = GetConcurrencyLimit();
+	stats.bufferedBytes = atomic::LoadRelaxed(m_pFlow->bufferedBytes);
+	stats.lastUpdateUs = m_lastUpdateUs;
+	stats.maxUpdateUs = m_maxUpdateUs;
+	stats.numOverBudget = m_numOverBudget;
+	return stats;
+}
+
+void HttpClient::SetTracer(HttpTracer* pTracer) {
+	IwAssert(HTTP_CLIENT, !m_pTracer && m_scheduler.Empty());
+	if (!pTracer)
+		return;
+	if (!HTTP_PROBES) {
+		s3eDebugTracePrintf("HttpClient: Built with HTTP_PROBES=0, so there is nothing to trace");
+		return;
+	}
+	static uint s_numClients = 0; // To tell the tracks of several clients apart
+	const uint client = ++s_numClients;
+	char name[64];
+	m_pTracer = pTracer;
+	snprintf(name, sizeof(name), "HttpClient %u", client);
+	m_pTraceRing = pTracer->AddRing(name);
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		snprintf(name, sizeof(name), "HttpClient %u worker %u", client, i);
+		m_workers[i].pTraceRing = pTracer->AddRing(name); // (No worker has a request yet, so none is using this)
+	}
+}
+
+void HttpClient::ResetStats() {
+	memset(m_latencyBuckets, 0, sizeof(m_latencyBuckets));
+	memset(m_responseBuckets, 0, sizeof(m_responseBuckets));
+	m_numCompleted = m_numFailed = 0;
+	m_numResponses = m_numHedges = m_numHedgeWins = m_numRetries = m_numFailovers = m_numExpired = m_numFailedFast = 0;
+	m_numLent = m_numBorrowed = 0;
+	m_lastUpdateUs = m_maxUpdateUs = 0;
+	m_numOverBudget = 0;
+	m_bytesFinished = m_rateSampleBytes = m_bytesPerSecond = 0;
+	m_rateSampleMs = 0;
+	m_endpoints.clear();
+}
+
+void HttpClient::SetEndpointStats(uint maxEndpoints) {
+	m_maxEndpoints = HTTP_PROBES ? maxEndpoints : 0; // (See HttpProbes.h)
+	if (!m_maxEndpoints)
+		m_endpoints.clear();
+}
+
+void HttpClient::GetEndpointStats(std::vector<EndpointStats>& stats) const {
+	stats.clear();
+	stats.reserve(m_endpoints.size());
+	for (auto it = m_endpoints.begin(); it != m_endpoints.end(); it++) {
+		const EndpointEntry& entry = it->second;
+		EndpointStats endpoint;
+		endpoint.endpoint = it->first;
+		endpoint.numRequests = entry.numRequests;
+		endpoint.numFailed = entry.numFailed;
+		endpoint.latencyP50Ms = GetLatencyPercentile(entry.latencyBuckets, entry.numRequests, 0.5);
+		endpoint.latencyP95Ms = GetLatencyPercentile(entry.latencyBuckets, entry.numRequests, 0.95);
+		endpoint.latencyP99Ms = GetLatencyPercentile(entry.latencyBuckets, entry.numRequests, 0.99);
+		endpoint.meanBytesDown = entry.bytesDown / entry.numRequests;
+		endpoint.meanBytesUp = entry.bytesUp / entry.numRequests;
+		endpoint.meanWorkerCpuMs = entry.workerCpuMs / entry.numRequests;
+		endpoint.meanAppCpuMs = entry.appCpuMs / entry.numRequests;
+		stats.push_back(endpoint);
+	}
+	std::stable_sort(stats.begin(), stats.end(), [](const EndpointStats& a, const EndpointStats& b) { return a.numRequests > b.numRequests; });
+}
+
+json::Object HttpClient::GetEndpointStatsJson() const {
+	std::vector<EndpointStats> stats;
+	GetEndpointStats(stats);
+	json::Array endpoints;
+	endpoints.Reserve(stats.size());
+	for (auto it = stats.begin(); it != stats.end(); it++) {
+		json::Object endpoint;
+		endpoint["endpoint"] = json::String(it->endpoint);
+		endpoint["count"] = json::Number::FromInteger((int64)it->numRequests);
+		endpoint["errorRate"] = json::Number((double)it->numFailed / it->numRequests);
+		endpoint["p50Ms"] = json::Number::FromInteger(it->latencyP50Ms);
+		endpoint["p95Ms"] = json::Number::FromInteger(it->latencyP95Ms);
+		endpoint["p99Ms"] = json::Number::FromInteger(it->latencyP99Ms);
+		endpoint["meanBytesDown"] = json::Number(it->meanBytesDown);
+		endpoint["meanBytesUp"] = json::Number(it->meanBytesUp);
+		endpoint["meanWorkerCpuMs"] = json::Number(it->meanWorkerCpuMs);
+		endpoint["meanAppCpuMs"] = json::Number(it->meanAppCpuMs);
+		endpoints.Insert(std::move(endpoint));
+	}
+	json::Object object;
+	object["endpoints"] = std::move(endpoints);
+	return object;
+}
+
+void HttpClient::SetWorkPool(HttpWorkPool* pPool) {
+	if (pPool == m_pWorkPool)
+		return;
+	if (m_pWorkPool)
+		m_pWorkPool->Detach(this);
+	m_pWorkPool = pPool;
+	if (m_pWorkPool)
+		m_pWorkPool->Attach(this);
+}
+
+bool HttpClient::CanLendTo(const HttpClient& borrower) const {
+	if (m_suspended)
+		return false;
+	// Only while all of our workers are busy:
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		if (m_workers[i].status == Worker::UNUSED || m_workers[i].status == Worker::READY)
+			return false;
+	}
+	// and only to a client that would treat the requests like we do. A bandwidth limit would be bypassed:
+	return borrower.m_pCache == m_pCache && borrower.m_pMemoryCache == m_pMemoryCache && borrower.m_pTracer == m_pTracer
+		&& borrower.m_userAgent == m_userAgent && m_bandwidthLimit == 0;
+}
+
+bool HttpClient::IsLendable(const HttpRequest& request, const void* pBorrower) {
+	const HttpClient& borrower = *(const HttpClient*)pBorrower;
+	if (request.m_pScheduleHost->pBreaker && request.m_pScheduleHost->pBreaker->IsTripped())
+		return false; // Left to its own client, which fails it fast or sends it as its host's probe
+	if (borrower.m_sizeLanes.largeBytes && borrower.m_numLargeTransfers >= borrower.m_maxLargeTransfers && borrower.IsLarge(request))
+		return false; // (The borrower's large lane is full)
+	return !(request.m_hedge && borrower.IsHedging()); // Hedging goes by the latencies of the request's own client
+}
+
+void HttpClient::ReturnBorrowed(HttpClient* pOwner) {
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		Worker& worker = m_workers[i];
+		if (!worker.pOwner || (pOwner && worker.pOwner != pOwner))
+			continue;
+		// Its host no longer counts it, and identical requests no longer follow it. It just completes here:
+		worker.pOwner->m_scheduler.RemoveLeader(worker.pRequest.ptr());
+		worker.pOwner->m_scheduler.HandleFinished(worker.pRequest.ptr());
+		worker.pOwner = nullptr;
+	}
+}
+
+HttpScheduler& HttpClient::GetScheduler(const Worker& worker) {
+	return worker.pOwner ? worker.pOwner->m_scheduler : m_scheduler;
+}
+
+void HttpClient::SetIdleTimeout(uint minWorkers, uint idleTimeoutMs) {
+	m_minWorkers = MIN(minWorkers, NUM_WORKERS);
+	m_idleTimeoutMs = idleTimeoutMs;
+}
+
+// A request that is only sent to leave a connection open (see HttpClient::Prewarm()):
+class HttpClient_PrewarmRequest : public HttpRequest {
+public:
+	HttpClient_PrewarmRequest(const string& url) : HttpRequest(HEAD, url.c_str()) {
+		SetUseCache(false);
+		SetCoalesce(false); // (Or they would all share the one connection)
+		SetMaxRetries(0);
+	}
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) { return size; }
+};
+
+void HttpClient::Prewarm(const string& origin, uint numConnections, Ptr<HttpGroupCallbackBase> pDoneCallback) {
+	const string url = HttpUrl::GetOrigin(origin.find("://") == string::npos ? string("https://").append(origin) : origin).append("/");
+	numConnections = MIN(numConnections, NUM_WORKERS);
+	std::vector< Ptr<HttpRequest> > requests;
+	for (uint i = 0; i < numConnections; i++)
+		requests.push_back(new HttpClient_PrewarmRequest(url));
+	Ptr<HttpRequestGroup> p_group = new HttpRequestGroup(nullptr, pDoneCallback);
+	p_group->SetPriority(HttpRequest::PRIORITY_LOW);
+	QueueRequests(requests, p_group);
+}
+
+void HttpClient::Prewarm(uint numWorkers) {
+	numWorkers = MIN(numWorkers, NUM_WORKERS);
+	for (uint i = 0; i < NUM_WORKERS && numWorkers > 0; i++) {
+		Worker& worker = m_workers[i];
+		if (worker.status == Worker::RETIRED)
+			FinishRetiringWorker(worker);
+		if (worker.status == Worker::UNUSED) {
+			if (worker.IsMulti()) {
+				// Multi engine: the I/O thread creates the curl handle for any READY worker that lacks one
+				if (!worker.pIoThread->started)
+					StartIoThread(*worker.pIoThread);
+				worker.WakeToStatus(Worker::READY);
+			} else {
+				SpawnWorkerThread(worker, Worker::READY);
+			}
+		}
+		if (worker.status == Worker::READY || worker.status == Worker::ACTIVE)
+			numWorkers--;
+	}
+}
+
+void HttpClient::FinishRetiringWorker(Worker& worker) {
+	IwAssert(HTTP_CLIENT, worker.status == Worker::RETIRED);
+	if (!worker.IsMulti()) {
+		// The thread has freed its curl handle and is exiting, so this won't block for long:
+		pthread_join(worker.thread_id, nullptr);
+		pthread_mutex_destroy(&worker.wakeMutex);
+		pthread_cond_destroy(&worker.wakeCond);
+		s3eDebugTracePrintf("HttpClient: Retired idle worker thread (TID %ld)", worker.thread_id);
+	}
+	worker.status = Worker::UNUSED;
+}
+
+void HttpClient::PreemptForCriticalRequests() {
+	// Every worker is busy, but PRIORITY_CRITICAL requests are waiting. Workers that are already
+	// finishing up will be free soon, so only preempt as many transfers as we still need:
+	uint num_needed = m_scheduler.NumRunnable(HttpRequest::PRIORITY_CRITICAL);
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		if (m_workers[i].status == Worker::DONE || m_workers[i].status == Worker::CLEANUP)
+			num_needed = num_needed ? num_needed - 1 : 0;
+	}
+	while (m_numPreempting < num_needed) {
+		// Pick the least important preemptible transfer:
+		Worker* p_victim = nullptr;
+		for (uint i = 0; i < NUM_WORKERS; i++) {
+			Worker& worker = m_workers[i];
+			if (worker.status != Worker::ACTIVE || worker.preempted || worker.pRequest->GetPriority() > HttpRequest::PRIORITY_LOW || worker.pRequest->m_hedged)
+				continue;
+			if (!p_victim || worker.pRequest->GetPriority() < p_victim->pRequest->GetPriority())
+				p_victim = &worker;
+		}
+		if (!p_victim)
+			break;
+		s3eDebugTracePrintf("HttpClient: Preempting %s %s for a critical request", p_victim->pRequest->GetMethodStr(), p_victim->pRequest->GetURL().c_str());
+		p_victim->preempted = true;
+		p_victim->abortRequest = true; // The worker will abort the transfer from within its next curl callback
+		m_numPreempting++;
+	}
+}
+
+void HttpClient::Suspend() {
+	if (m_suspended)
+		return;
+	m_suspended = true;
+	uint num_aborted = 0;
+	for (uint i = 0; i < NUM_WORKERS; i++) {
+		Worker& worker = m_workers[i];
+		if (worker.status != Worker::ACTIVE || worker.preempted || worker.pRequest->m_hedged)
+			continue;
+		// As for preemption: the request is queued again once the worker has cleaned up
+		worker.preempted = true;
+		worker.abortRequest = true; // The worker will abort the transfer from within its next curl callback
+		m_numPreempting++;
+		num_aborted++;
+	}
+	for (uint t = 0; t < NUM_IO_THREADS; t++) {
+		m_ioThreads[t].closeConnections = true;
+		if (m_ioThreads[t].started)
+			m_ioThreads[t].Wake();
+	}
+	s3eDebugTracePrintf("HttpClient: Suspended, aborting %u transfers", num_aborted);
+}
+
+void HttpClient::Resume() {
+	if (!m_suspended)
+		return;
+	m_suspended = false;
+	for (uint t = 0; t < NUM_IO_THREADS; t++)
+		m_ioThreads[t].closeConnections = false; // (If they haven't got round to it, there's no need now)
+	s3eDebugTraceLine("HttpClient: Resumed");
+}
+
+// The clients that SetAutoSuspend() has been called for, which one pair of s3e callbacks serves (app thread only):
+static std::vector<HttpClient*> s_autoSuspendClients;
+
+void HttpClient::SetAutoSuspend(bool enabled) {
+	if (enabled == m_autoSuspend)
+		return;
+	m_autoSuspend = enabled;
+	if (enabled) {
+		if (s_autoSuspendClients.empty()) {
+			s3eDeviceRegister(S3E_DEVICE_PAUSE, HandleDevicePause, nullptr);
+			s3eDeviceRegister(S3E_DEVICE_UNPAUSE, HandleDeviceUnpause, nullptr);
+		}
+		s_autoSuspendClients.push_back(this);
+	} else {
+		s_autoSuspendClients.erase(std::find(s_autoSuspendClients.begin(), s_autoSuspendClients.end(), this));
+		if (s_autoSuspendClients.empty()) {
+			s3eDeviceUnRegister(S3E_DEVICE_PAUSE, HandleDevicePause);
+			s3eDeviceUnRegister(S3E_DEVICE_UNPAUSE, HandleDeviceUnpause);
+		}
+	}
+}
+
+int32 HttpClient::HandleDevicePause(void*, void*) {
+	for (auto it = s_autoSuspendClients.begin(); it != s_autoSuspendClients.end(); it++)
+		(*it)->Suspend();
+	return 0;
+}
+
+int32 HttpClient::HandleDeviceUnpause(void*, void*) {
+	for (auto it = s_autoSuspendClients.begin(); it != s_autoSuspendClients.end(); it++)
+		(*it)->Resume();
+	return 0;
+}
+
+void HttpClient::StartRequest(Worker& worker, const Ptr<HttpRequest>& pRequest) {
+	const uint64 now_ms = s3eTimerGetMs();
+	HTTP_ALLOC_SCOPE(SITE_REQUEST, &pRequest->m_allocStats);
+	worker.pRequest = pRequest;
+	worker.startedMs = now_ms;
+	ChargeMemory(worker, pRequest->EstimateMemory(-1));
+	worker.hedgeRole = IsHedging() && pRequest->m_hedge ? Worker::HEDGE_FIRST : Worker::HEDGE_NONE;
+	pRequest->m_hedged = false;
+	pRequest->m_hedgeOwner = 0;
+	pRequest->m_timings.queueMs = now_ms - pRequest->m_queuedMs;
+	worker.traceId = pRequest->m_traceId;
+#ifdef HTTP_ALLOC_STATS
+	HttpAllocStats::Reset(worker.allocStats); // (The worker is idle, so it isn't counting)
+#endif
+	Trace(*pRequest.ptr(), HttpTracer::EVENT_STARTED);
+	worker.pRequest->HandleRequestStart();
+	// Hand any identical requests that were queued while this one was waiting to the worker too:
+	std::vector< Ptr<HttpRequest> >& followers = pRequest->m_followers;
+	uint num_followers = 0;
+	for (auto it = followers.begin(); it != followers.end(); it++) {
+		if ((*it)->GetStatus() != HttpRequest::PENDING)
+			continue; // Cancelled
+		(*it)->m_timings.queueMs = now_ms - (*it)->m_queuedMs;
+		Trace(*it->ptr(), HttpTracer::EVENT_STARTED);
+		(*it)->HandleRequestStart();
+		followers[num_followers] = *it;
+		worker.followers[num_followers++] = it->ptr();
+	}
+	followers.resize(num_followers);
+	worker.followerState = num_followers;
+	PrepareCache(worker);
+	PrepareRecording(worker);
+	// A ranged request must get exactly the bytes it asked for, so it's never compressed, and neither is a HEAD request,
+	// whose Content-Length is taken as the size of the body that a GET would get (e.g. by HttpSegmentedDownload):
+	const HttpRequest::Compression compression = pRequest->GetCompression();
+	worker.acceptEncoding = (compression == HttpRequest::COMPRESSION_ACCEPT || (compression == HttpRequest::COMPRESSION_CLIENT_DEFAULT && (m_acceptCompressed || GetNetworkProfile().acceptCompressed)))
+		&& pRequest->GetMethod() != HttpRequest::HEAD && !pRequest->FindRequestHeader("Range");
+	worker.memoryCacheKey = m_pMemoryCache && !pRequest->GetSink() ? pRequest->GetMemoryCacheKey() : string();
+	worker.memoryCacheLimit = worker.memoryCacheKey.empty() ? 0 : m_pMemoryCache->GetMaxEntrySize();
+	StartBandwidth(worker);
+	ActivateWorker(worker);
+}
+
+// What a failed attempt says about sending the request again:
+enum HttpClient_RetryClass {
+	HTTP_CLIENT_RETRY_NEVER,      // It worked, or failed in a way that would just happen again (e.g. a 404, or the request refusing the data)
+	HTTP_CLIENT_RETRY_IDEMPOTENT, // The server may have acted on the request, so only if it is safe to repeat
+	HTTP_CLIENT_RETRY_ALWAYS      // It never reached the server, so it is safe to send again whatever the method
+};
+
+static HttpClient_RetryClass HttpClient_ClassifyFailure(CURLcode result, long statusCode) {
+	switch (result) {
+		case CURLE_OK:
+			switch (statusCode) {
+				case 408: case 429: case 500: case 502: case 503: case 504:
+					return HTTP_CLIENT_RETRY_IDEMPOTENT;
+				default:
+					return HTTP_CLIENT_RETRY_NEVER;
+			}
+		case CURLE_COULDNT_RESOLVE_PROXY:
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+			return HTTP_CLIENT_RETRY_ALWAYS;
+		case CURLE_PARTIAL_FILE:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SSL_CONNECT_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+			return HTTP_CLIENT_RETRY_IDEMPOTENT;
+		default:
+			return HTTP_CLIENT_RETRY_NEVER;
+	}
+}
+
+void HttpClient::RecordCongestion(const Worker& worker) {
+	m_windowFinished++;
+	if (HttpClient_ClassifyFailure(worker.result, worker.responseStatusCode) != HTTP_CLIENT_RETRY_NEVER)
+		m_windowErrors++; // (The failures that a retry might fix are the ones that load can cause)
+}
+
+uint64 HttpClient::GetRetryDelayMs(const Worker& worker) {
+	const HttpRequest& request = *worker.pRequest.ptr();
+	const RetryPolicy& policy = worker.pOwner ? worker.pOwner->m_retryPolicy : m_retryPolicy; // That of the request's own client
+	const int max_retries = request.m_maxRetries >= 0 ? request.m_maxRetries : (int)policy.maxRetries;
+	if ((int)request.m_numRetries >= max_retries || request.IsAborted() || request.m_hedged)
+		return 0; // (A hedged request's other worker may still be finishing with it)
+	const HttpClient_RetryClass retry_class = HttpClient_ClassifyFailure(worker.result, worker.responseStatusCode);
+	if (retry_class == HTTP_CLIENT_RETRY_NEVER)
+		return 0;
+	// Unless the request says it may be repeated, only the idempotent methods are, if the server may have seen it:
+	if (retry_class == HTTP_CLIENT_RETRY_IDEMPOTENT && request.m_maxRetries < 0 && request.GetMethod() == HttpRequest::POST)
+		return 0;
+	// Exponential backoff with "full jitter": anywhere up to the doubled delay, so that a burst of requests that
+	// failed together (e.g. on a 503) don't come back together:
+	const uint64 cap_ms = MIN((uint64)policy.maxDelayMs, (uint64)policy.baseDelayMs << MIN(request.m_numRetries, 20u));
+	m_retrySeed ^= m_retrySeed << 13; // xorshift32
+	m_retrySeed ^= m_retrySeed >> 17;
+	m_retrySeed ^= m_retrySeed << 5;
+	uint64 delay_ms = m_retrySeed % (cap_ms + 1);
+	if (const char* p_retry_after = worker.responseHeaders.Find("Retry-After")) {
+		// In seconds (an HTTP date is possible too, but nobody sends one):
+		const long seconds = strtol(p_retry_after, nullptr, 10);
+		if (seconds > 0)
+			delay_ms = MAX(delay_ms, MIN((uint64)seconds * 1000, (uint64)policy.maxDelayMs));
+	}
+	return MAX(delay_ms, (uint64)1); // (0 means no retry)
+}
+
+void HttpClient::ApplyMirror(Worker& worker) {
+	const uint avoid_id = worker.hedgeRole == Worker::HEDGE_SECOND ? worker.mirrorOriginId : 0;
+	worker.mirrorOriginId = 0;
+	HttpMirrors& mirrors = worker.pOwner ? worker.pOwner->m_mirrors : m_mirrors; // Those of the request's own client
+	const HttpRequest& request = *worker.pRequest.ptr();
+	if (mirrors.Empty() || (request.GetMethod() != HttpRequest::GET && request.GetMethod() != HttpRequest::HEAD))
+		return;
+	string transfer_url;
+	if (const uint id = mirrors.Choose(request.GetURL(), request.GetExpectedSize() ? request.GetExpectedSize() : request.GetSizeHint(), avoid_id, s3eTimerGetMs(), transfer_url)) {
+		worker.mirrorOriginId = id;
+		worker.transferUrl = transfer_url; // (Instead of any remembered redirect)
+	}
+}
+
+void HttpClient::LearnMirror(const Worker& worker) {
+	HttpMirrors& mirrors = worker.pOwner ? worker.pOwner->m_mirrors : m_mirrors;
+	const bool failed = HttpClient_ClassifyFailure(worker.result, worker.responseStatusCode) != HTTP_CLIENT_RETRY_NEVER;
+	if (failed || worker.result == CURLE_OK)
+		mirrors.HandleResult(worker.mirrorOriginId, failed, worker.timings, s3eTimerGetMs());
+	// (Other failures, e.g. a body that was too big, say nothing about the origin)
+}
+
+bool HttpClient::ShouldFailOver(const Worker& worker) {
+	const HttpRequest& request = *worker.pRequest.ptr();
+	if (!worker.mirrorOriginId || request.m_maxRetries == 0 || request.IsAborted() || request.m_hedged)
+		return false;
+	const HttpMirrors& mirrors = worker.pOwner ? worker.pOwner->m_mirrors : m_mirrors;
+	return HttpClient_ClassifyFailure(worker.result, worker.responseStatusCode) != HTTP_CLIENT_RETRY_NEVER
+		&& request.m_numFailovers + 1 < mirrors.GetSetSize(worker.mirrorOriginId) && mirrors.HasAlternative(worker.mirrorOriginId, s3eTimerGetMs());
+}
+
+void HttpClient::SetCircuitBreaker(const CircuitBreaker& breaker) {
+	m_circuitBreaker = breaker;
+	m_scheduler.SetCircuitBreaker(breaker.failureThreshold, breaker.coolDownMs);
+}
+
+void HttpClient::LearnCircuit(const Worker& worker) {
+	HttpScheduler& scheduler = GetScheduler(worker); // That of the request's own client
+	const bool failed = HttpClient_ClassifyFailure(worker.result, worker.responseStatusCode) != HTTP_CLIENT_RETRY_NEVER;
+	if ((failed || worker.result == CURLE_OK) && !worker.cacheServed)
+		scheduler.HandleResult(worker.pRequest->GetOrigin(), failed, s3eTimerGetMs());
+	// (Other failures, e.g. a body that was too big, say nothing about the host)
+}
+
+Ptr<HttpRequest> HttpClient::PopRequest(bool accept) {
+	for (;;) {
+		Ptr<HttpRequest> p_request = accept ? m_scheduler.Pop(AcceptToStart, this) : m_scheduler.Pop();
+		if (!p_request || !m_scheduler.GetOpenUntil(p_request->GetOrigin(), s3eTimerGetMs()))
+			return p_request;
+		// Queued before its host's breaker tripped: it fails without taking the worker, and so do its followers
+		m_scheduler.RemoveLeader(p_request.ptr());
+		m_scheduler.HandleFinished(p_request.ptr());
+		m_failingFast.push_back(p_request);
+		m_failingFast.insert(m_failingFast.end(), p_request->m_followers.begin(), p_request->m_followers.end());
+		p_request->m_followers.clear();
+	}
+}
+
+void HttpClient::FailFast(HttpRequest& request) {
+	// Never sent, so there is no response to handle; the callback (and then its dependents) hear about it as usual:
+	request.m_failedFast = true;
+	request.m_status = HttpRequest::ERROR;
+	m_numFailedFast++;
+	RecordResult(request, false);
+	request.NotifyDone();
+	Trace(request, HttpTracer::EVENT_CALLBACK);
+}
+
+void HttpClient::StartHedges(uint64 nowMs) {
+	// Nothing is waiting for a worker. Requests that have been waiting for their response for longer than
+	// almost all of them do can try again on a spare one, in case it is the connection that is slow:
+	if (m_numResponses < HEDGE_MIN_RESPONSES)
+		return; // Not enough to go on yet
+	const uint64 delay_ms = MAX((uint64)m_hedgeMinDelayMs, (uint64)GetLatencyPercentile(m_responseBuckets, m_numResponses, m_hedgePercentile));
+	uint next_free = 0;
+	uint num_transfers = NumTransfers();
+	for (uint i = 0; i < NUM_WORKERS && num_transfers < GetConcurrencyLimit(); i++) {
+		Worker& worker = m_workers[i];
+		// Every follower would get its response from this worker, so requests with followers aren't hedged.
+		// Nor are those revalidating a cached response or being served from it, which a hedge couldn't do.
+		if (worker.status != Worker::ACTIVE || worker.hedgeRole != Worker::HEDGE_FIRST || worker.pRequest->m_hedged || worker.preempted
+			|| worker.pRequest->GetStatus() != HttpRequest::SENDING || worker.responseHeadersDone || worker.NumFollowers() || worker.pRequest->IsAborted()
+			|| worker.cacheMode == Worker::CACHE_REVALIDATE || worker.cacheMode == Worker::CACHE_SERVE || nowMs - worker.startedMs < delay_ms)
+			continue;
+		if (atomic::LoadAcquire(worker.pRequest->m_hedgeOwner))
+			continue; // Its response is arriving already
+		while (next_free < NUM_WORKERS && !((m_workers[next_free].status == Worker::READY || m_workers[next_free].status == Worker::UNUSED) && !m_workers[next_free].pRequest))
+			next_free++;
+		if (next_free == NUM_WORKERS)
+			return; // No spare workers
+		StartHedge(m_workers[next_free], worker, nowMs);
+		num_transfers++;
+	}
+}
+
+void HttpClient::StartHedge(Worker& worker, Worker& first, uint64 nowMs) {
+	HttpRequest& request = *first.pRequest.ptr();
+	s3eDebugTracePrintf("HttpClient: Hedging %s %s after %u ms without a response", request.GetMethodStr(), request.GetURL().c_str(), (uint)(nowMs - first.startedMs));
+	HTTP_ALLOC_SCOPE(SITE_REQUEST, &request.m_allocStats);
+	request.m_hedged = true;
+	m_numHedges++;
+	// The request has started already, so none of StartRequest() applies but the worker's own settings.
+	// The hedge doesn't use the caches: if it wins, the response just isn't cached.
+	worker.pRequest = first.pRequest;
+	worker.hedgeRole = Worker::HEDGE_SECOND;
+	worker.mirrorOriginId = first.mirrorOriginId; // (So that ApplyMirror() sends the hedge to another mirror, if it can)
+	worker.startedMs = nowMs;
+	worker.idleSinceMs = 0;
+	worker.traceId = request.m_traceId;
+#ifdef HTTP_ALLOC_STATS
+	HttpAllocStats::Reset(worker.allocStats);
+#endif
+	worker.followerState = 0;
+	worker.cacheMode = Worker::CACHE_NONE;
+	worker.acceptEncoding = first.acceptEncoding;
+	worker.memoryCacheKey.clear();
+	worker.memoryCacheLimit = 0;
+	// A replay serves the same response again; what a hedge gets isn't recorded:
+	worker.transport = first.transport;
+	worker.pReplay = first.pReplay;
+	worker.replaySpeed = first.replaySpeed;
+	worker.recordTransfer = false;
+	StartBandwidth(worker);
+	ActivateWorker(worker);
+}
+
+void HttpClient::ActivateWorker(Worker& worker) {
+	worker.config = m_config;
+	worker.config.Apply(worker.pRequest->m_configOverrides);
+	worker.expectContinueMinSize = GetExpectContinueMinSize(*worker.pRequest.ptr());
+	ApplyAddressFamily(worker);
+	ApplyRedirect(worker);
+	ApplyMirror(worker);
+	worker.dnsCacheTtl = m_dnsCacheTtl;
+	worker.pHostList = m_hostTable.GetList(s3eTimerGetUTC());
+	worker.hostListVersion = m_hostTable.GetVersion();
+	worker.primaryIp[0] = '\0'; // (Until the worker finishes a transfer)
+	worker.progressIntervalMs = m_progressIntervalMs;
+	worker.progressMinBytes = m_progressMinBytes;
+	if (worker.IsMulti()) {
+		// Multi engine: the worker has no thread of its own, so just hand it to its I/O thread:
+		if (!worker.pIoThread->started)
+			StartIoThread(*worker.pIoThread);
+		worker.WakeToStatus(Worker::ACTIVE);
+	} else if (worker.status == Worker::UNUSED) {
+		// This worker has not been initialized
+		// We're now going to create a new worker thread
+		SpawnWorkerThread(worker, Worker::ACTIVE);
+	} else {
+		IwAssert(HTTP_CLIENT, worker.status == Worker::READY || (worker.status == Worker::DONE && worker.cleanupDeferred));
+		// The worker was sleeping. Wake it up and put it to work (cleaning up after its last request first, if it is DONE):
+		worker.WakeToStatus(Worker::ACTIVE);
+	}
+}
+
+void HttpClient::PrepareCache(Worker& worker) {
+	HttpRequest& request = *worker.pRequest.ptr();
+	request.m_fromCache = false;
+	worker.cacheMode = Worker::CACHE_NONE;
+	if (!m_pCache || !request.UsesCache() || request.GetMethod() != HttpRequest::GET)
+		return;
+	if (request.FindRequestHeader("Range"))
+		return; // e.g. a resumed HttpDownload: we only cache whole responses
+	int64 max_age_ms;
+	bool no_store, no_cache;
+	HttpCache::ParseCacheControl(request.FindRequestHeader("Cache-Control"), max_age_ms, no_store, no_cache);
+	if (no_store)
+		return;
+
+	worker.cacheMode = Worker::CACHE_STORE;
+	if (HttpCache::Entry* p_entry = m_pCache->Acquire(request)) {
+		if (m_pCache->IsFresh(*p_entry) && !no_cache)
+			worker.cacheMode = Worker::CACHE_SERVE;
+		else if ((!p_entry->etag.empty() || !p_entry->lastModified.empty())
+			&& !request.FindRequestHeader("If-None-Match") && !request.FindRequestHeader("If-Modified-Since"))
+			worker.cacheMode = Worker::CACHE_REVALIDATE; // (Unless the request asks for itself, e.g. for HttpPost::SetJsonCache(): then the 304 is its own)
+		if (worker.cacheMode == Worker::CACHE_STORE) {
+			m_pCache->Release(p_entry); // Stale, and no way to check it: it will just be replaced
+		} else {
+			worker.pCacheEntry = p_entry;
+			worker.cacheBodyFile = m_pCache->GetBodyPath(*p_entry);
+			worker.cacheBodyOffset = p_entry->offset;
+			worker.cacheBodySize = p_entry->packId ? (int64)p_entry->size : -1;
+			worker.cacheETag = p_entry->etag;
+			worker.cacheLastModified = p_entry->lastModified;
+			worker.cacheHeaders = p_entry->headers;
+		}
+	}
+	if (worker.cacheMode != Worker::CACHE_SERVE)
+		worker.cacheStoreFile = m_pCache->NewBodyPath(worker.cacheFileId);
+}
+
+void HttpClient::FinishCache(Worker& worker, bool completed) {
+	if (worker.cacheMode == Worker::CACHE_NONE)
+		return;
+	HttpRequest& request = *worker.pRequest.ptr();
+	const bool ok = completed && worker.result == CURLE_OK && worker.responseStatusCode == 200;
+	bool stored = false;
+	if (ok && worker.cacheStored) {
+		// A new response (either we had none, or the server says ours has changed):
+		stored = m_pCache->Store(request, worker.cacheFileId, request.GetResponseHeaders());
+	} else if (ok && worker.cacheServed) {
+		if (worker.cacheMode == Worker::CACHE_REVALIDATE)
+			m_pCache->Refresh(worker.pCacheEntry, request.GetResponseHeaders());
+		else
+			m_pCache->Touch(worker.pCacheEntry);
+	}
+	if (!stored && !worker.cacheStoreFile.empty())
+		s3eFileDelete(worker.cacheStoreFile.c_str()); // (It may not even exist)
+	request.m_fromCache = ok && worker.cacheServed;
+	if (worker.pCacheEntry) {
+		m_pCache->Release(worker.pCacheEntry);
+		worker.pCacheEntry = nullptr;
+	}
+	worker.cacheMode = Worker::CACHE_NONE;
+	worker.cacheBodyFile.clear();
+	worker.cacheBodyOffset = 0;
+	worker.cacheBodySize = -1;
+	worker.cacheStoreFile.clear();
+	worker.cacheETag.clear();
+	worker.cacheLastModified.clear();
+	worker.cacheHeaders.Clear();
+}
+
+void HttpClient::PrepareRecording(Worker& worker) {
+	worker.transport = Worker::TRANSPORT_CURL;
+	worker.pReplay = nullptr;
+	worker.recordTransfer = false;
+	if (!m_pRecording || worker.cacheMode == Worker::CACHE_SERVE)
+		return; // (Fresh in the cache: the worker serves it from there either way)
+	const HttpRequest& request = *worker.pRequest.ptr();
+	if (m_pRecording->GetMode() == HttpRecording::MODE_REPLAY) {
+		worker.transport = Worker::TRANSPORT_REPLAY;
+		worker.pReplay = m_pRecording->Next(request.GetMethodStr(), request.GetURL());
+		worker.replaySpeed = m_pRecording->GetSpeed();
+	} else {
+		worker.recordTransfer = true;
+	}
+}
+
+void HttpClient::RecordResponse(const Worker& worker) {
+	// Copied from the worker's memory environment into ours:
+	const HttpRequest& request = *worker.pRequest.ptr();
+	HttpRecording::Exchange& exchange = m_pRecording->Add(request.GetMethodStr(), request.GetURL());
+	exchange.statusLine = worker.responseHeaders.GetStatusLine();
+	exchange.statusCode = (int)worker.responseStatusCode;
+	exchange.headers = worker.responseHeaders;
+	exchange.headersMs = worker.recordHeadersMs;
+	exchange.totalMs = (uint32)worker.timings.totalMs;
+	exchange.body = worker.recordBody;
+	exchange.chunks = worker.recordChunks;
+}
+
+void HttpClient::SpawnWorkerThread(Worker& worker, int initialStatus) {
+	IwAssert(HTTP_CLIENT, worker.status == Worker::UNUSED && worker.pCurl == nullptr);
+	worker.userAgent = m_userAgent.c_str(); // We want the thread to be able to read this userAgent string, so we pass it via the Worker struct
+	
+	// We'll need a mutex and a condition that we can use to wake up the
+	// worker thread when/if it's sleeping:
+	pthread_mutex_init(&worker.wakeMutex, nullptr);
+	pthread_cond_init(&worker.wakeCond, nullptr);
+	
+	worker.status = (Worker::StatusCode)initialStatus;
+	worker.threadOptions = m_threadOptions;
+	int result = HttpClient_CreateThread(worker.thread_id, worker.threadOptions, HttpClient_WorkerThread, (void *)&worker);
+	if (result != 0) {
+		pthread_mutex_destroy(&worker.wakeMutex);
+		pthread_cond_destroy(&worker.wakeCond);
+		worker.status = initialStatus == Worker::ACTIVE ? Worker::DONE : Worker::UNUSED;
+		throw std::runtime_error("Unable to spawn a new HttpClient worker thread.");
+	} else {
+		s3eDebugTracePrintf("HttpClient: Spawned worker thread (TID %ld)", worker.thread_id);
 	}
 }
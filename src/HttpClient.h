@@ -7,22 +7,41 @@
 #pragma once
 
 #include <list>
-#include <queue>
+#include <map>
+#include <vector>
 
-#include "util/fastdelegate.h"
+#include "util/FastDelegate.h"
+#include "HttpEventLoop.h"
+#include "HttpFuture.h"
+#include "HttpHostTable.h"
+#include "HttpMirrors.h"
+#include "HttpMemoryCache.h"
+#include "HttpNegativeCache.h"
+#include "HttpProbes.h"
 #include "HttpRequest.h"
+#include "HttpRequestGroup.h"
+#include "HttpScheduler.h"
+#include "HttpSizeHints.h"
+#include "HttpThreadOptions.h"
+#include "HttpTimerWheel.h"
+#include "HttpTracer.h"
 
 struct HttpClient_Worker;
+struct HttpClient_IoThread;
+struct HttpClient_Share;
+struct HttpClient_CompletionQueue;
+struct HttpClient_FlowControl;
+struct HttpClient_HostRefresh;
+class HttpCache;
+class HttpMemoryBudget;
+class HttpRecording;
+class HttpWorkPool;
+class HttpCpuPool;
+class HttpDiskWriter;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Callback types, used to notify the requestee when an HTTP request has
-// either finished or failed.
-
-class HttpCallbackBase : public IRefCounted {
-public:
-	HttpCallbackBase() {}
-	virtual void Call(Ptr<HttpRequest> pRequest)=0;
-};
+// either finished or failed. (HttpCallbackBase is declared in HttpRequest.h)
 
 template<typename WatcherType>
 class HttpCallback : public HttpCallbackBase {
@@ -49,25 +68,69 @@ private:
 class HttpClient {
 public:
 	static void GlobalInit(); // This must be called as early as possible in program execution
-	static void GlobalCleanup(); // Call as late as possible following program termination and after all instances of HttpClient are freed.
+	// Or, also trust the CA certificates of a PEM bundle (e.g. curl's cacert.pem), given as a file or in memory.
+	// The bundle is parsed once, and every handle of every HttpClient verifies servers against it (replacing
+	// curl's own CA file settings). Throws std::runtime_error if it can't be read or has no certificates.
+	// Call before creating any HttpClient.
+	static void GlobalInit(const char* caBundleFile);
+	static void GlobalInit(const void* pCaBundle, size_t size);
+	// Or, do curl's and OpenSSL's global init (and parse the CA bundle, if any) on a thread of its own, which
+	// takes it out of the app's startup. HttpClients can be created and requests queued meanwhile: Update()
+	// sends nothing until the init has finished, and then loads the TLS session cache (if any) and starts the
+	// requests. The bundle's data is copied (or the file read) straight away. Call instead of GlobalInit().
+	// Since the bundle is parsed later, one without any certificates is only reported by WaitForGlobalInit().
+	static void GlobalInitAsync();
+	static void GlobalInitAsync(const char* caBundleFile);
+	static void GlobalInitAsync(const void* pCaBundle, size_t size);
+	static bool IsGlobalInitDone(); // Whether the init thread has finished (true if GlobalInitAsync() wasn't used)
+	// Block until the init thread has finished and finish the init on this thread. Throws std::runtime_error if
+	// the CA bundle didn't contain any certificates.
+	static void WaitForGlobalInit();
+	// Keep TLS sessions in filePath (on any s3e drive, e.g. "cache://tls_sessions.json") between launches,
+	// so the first HTTPS connection of a launch can resume a session rather than make a full handshake.
+	// Call before GlobalInit(), which loads the file; GlobalCleanup() saves it. See HttpTlsSessionCache.h.
+	static void SetTlsSessionCacheFile(const char* filePath);
+	static void GlobalCleanup(); // Call as late as possible following program termination and after all instances of HttpClient are freed. (Waits for GlobalInitAsync(), if need be.)
+	
+	// Engine: how the transfers are driven. A build that only ever uses one can compile the choice out, with
+	// HTTP_ENGINES in the defines in HttpUtils.mkb, so the workers don't test for it (see HttpClientWorker.h); a
+	// client then always gets that engine, and GetEngine() says so.
+	enum Engine {
+		ENGINE_THREADS, // One thread per worker, each running a blocking curl_easy_perform() (default)
+		ENGINE_MULTI,   // All workers are driven by one (or a few) I/O threads using curl_multi_socket_action().
+		                // Allows a large numWorkers without paying for a thread, stack and condition per transfer.
+	};
 	
 	// Constructor:
 	// Call this to create a new HttpClient.
 	// numWorkers specifies the maximum number of worker threads that this
 	//            instance will use (Set >1 to allow concurrent requests)
-	//            Don't set higher than 3 if you're mostly using one server.
+	//            Don't set higher than 3 if you're mostly using one server, or
+	//            use SetMaxRequestsPerHost() to cap the load on any one server.
+	//            With ENGINE_MULTI, this is the max number of concurrent transfers.
 	// userAgent  specifies the HTTP User Agent header. (e.g. "MyApp API Client")
-	HttpClient(uint numWorkers, const char* userAgentStr); // Initialize
+	// engine     selects the threading model (see above)
+	// numIoThreads is the number of I/O threads that ENGINE_MULTI spreads the workers across.
+	HttpClient(uint numWorkers, const char* userAgentStr, Engine engine = ENGINE_THREADS, uint numIoThreads = 1); // Initialize
 	virtual ~HttpClient(); // Terminate
 	
 	// Update:
 	// Updates the request queue, calls callbacks, and manages worker threads.
 	// This must be called fairly regularly, although HTTP requests will
 	// still continue on worker threads even if you aren't calling this.
-	void Update();
+	// maxMicroseconds, if set, is a budget for handling the requests that have
+	// finished (their HandleResponse(), e.g. parsing JSON, and their callbacks),
+	// and the memory cache hits and the CPU pool's jobs: once it is spent, the
+	// rest wait for the next Update(), in the same order. At least one of each
+	// is handled, however long it takes, so that a frame-sized budget can't
+	// stall them. The rest of the update (starting requests etc.) always runs.
+	void Update(uint maxMicroseconds = 0);
+	// How long the last Update() took, in microseconds:
+	uint GetLastUpdateUs() const { return m_lastUpdateUs; }
 
 	// QueueRequest:
 	// Send the request pRequest as soon as a worker thread is available.
+	// Requests are sent in order of priority (see HttpRequest::SetPriority()).
 	// Will optionally call pCallback once a response has been received.
 	//
 	// Note: pCallback holds an ObservingPtr so if the instance of some
@@ -75,20 +138,706 @@ public:
 	// pCallback will never get called, even if the request completes.
 	// To avoid that, one option is to use a HttpStaticCallback
 	// which does not contain an observing pointer.
-	void QueueRequest(Ptr<HttpRequest> pRequest, Ptr<HttpCallbackBase> pCallback = nullptr) {
-		if (pRequest->GetStatus() == HttpRequest::BUILDING)
-			pRequest->CompileRequest();
-		IwAssert(HTTP_CLIENT, pRequest->GetStatus() == HttpRequest::PENDING);
-		m_pendingRequests.push(pRequest);
-		if (pCallback)
-			m_pendingCallbacks.push_back(std::pair< Ptr<HttpRequest>, Ptr<HttpCallbackBase> >(pRequest, pCallback));
-	}
+	//
+	// If the response is in the memory cache (see SetMemoryCache()), the request completes on the
+	// next Update() instead, without using a worker.
+	// If an identical GET or HEAD request is already queued or in flight, the request follows it
+	// instead of being sent (see HttpRequest::SetCoalesce()).
+	// Returns a future for the request, which can be polled, given continuations, or chained (see HttpFuture).
+	HttpFuture QueueRequest(Ptr<HttpRequest> pRequest, Ptr<HttpCallbackBase> pCallback = nullptr);
+	// Or, with a delegate instead of a callback object: it is kept in the request itself, so this costs no
+	// allocation. If pGuard is given, the delegate is only called if pGuard still exists, like the watcher
+	// of an HttpCallback, e.g.: client.QueueRequest(p_request, this, &MyClass::HandleResponse);
+	HttpFuture QueueRequest(Ptr<HttpRequest> pRequest, HttpRequest::CallbackDelegate delegate, IObservable* pGuard = nullptr);
+	template<typename WatcherType>
+	HttpFuture QueueRequest(Ptr<HttpRequest> pRequest, WatcherType* pWatcher, void (WatcherType::*pMethod)(Ptr<HttpRequest>)) { return QueueRequest(pRequest, fastdelegate::MakeDelegate(pWatcher, pMethod), pWatcher); }
+	// QueueRequests:
+	// Queue a batch of requests at the group's priority, with pGroup as the callback that they all share
+	// (see HttpRequestGroup). Rather than one callback object each, this costs just the group. If requests
+	// is empty, the group's done callback is called right away.
+	void QueueRequests(const std::vector< Ptr<HttpRequest> >& requests, Ptr<HttpRequestGroup> pGroup);
+
+	Engine GetEngine() const { return m_engine; }
+	
+	// SetIdleTimeout:
+	// Worker threads are spawned as needed, up to numWorkers. By default they then stay around
+	// until the HttpClient is destroyed. Set idleTimeoutMs to have workers that have been idle
+	// for that long shut down their thread and curl handle, but never shrink below minWorkers.
+	// (With ENGINE_MULTI, only the idle workers' curl handles are freed; the I/O threads remain.)
+	void SetIdleTimeout(uint minWorkers, uint idleTimeoutMs);
+	
+	// SetThreadOptions:
+	// The stack size, priority and CPUs of the worker threads (or the I/O threads, for ENGINE_MULTI) that are spawned
+	// from then on (see HttpThreadOptions.h), e.g. to keep them off the cores that the app renders on. Call it right
+	// after construction (before Prewarm()), so that it applies to all of them. By default, they get the platform's.
+	void SetThreadOptions(const HttpThreadOptions& options) { m_threadOptions = options; }
+	const HttpThreadOptions& GetThreadOptions() const { return m_threadOptions; }
+	
+	// SetWorkPool:
+	// Share workers with the other HttpClients attached to pPool (see HttpWorkPool.h): whenever Update() leaves
+	// some of ours idle, they may take requests that another client has queued but has no worker for, and
+	// theirs may take ours. nullptr (the default) detaches this client again; so does its destructor.
+	void SetWorkPool(HttpWorkPool* pPool);
+	
+	// SetCpuPool:
+	// Have Update() call pPool's Update() too (see HttpCpuPool.h), so that the jobs that the callbacks hand to the
+	// pool (to decode, inflate or hash a response, without holding up the app thread or a worker) come back to
+	// the app thread along with the requests. nullptr (the default) for none. The pool must outlive the client,
+	// or be detached first; several clients may share one.
+	void SetCpuPool(HttpCpuPool* pPool) { m_pCpuPool = pPool; }
+	HttpCpuPool* GetCpuPool() const { return m_pCpuPool; }
+	
+	// SetDiskWriter:
+	// Have Update() call pWriter's Update() too (see HttpDiskWriter.h), so that the downloads that write their files
+	// through it (see HttpDownload::SetDiskWriter()) finish along with the other requests. nullptr (the default) for
+	// none. The writer must outlive the client, or be detached first; several clients may share one.
+	void SetDiskWriter(HttpDiskWriter* pWriter) { m_pDiskWriter = pWriter; }
+	HttpDiskWriter* GetDiskWriter() const { return m_pDiskWriter; }
+	
+	// SetMemoryBudget:
+	// Hold back large requests while the transfers in progress are expected to hold more memory than pBudget
+	// allows (see HttpMemoryBudget.h), rather than run out of it. Several clients may share one budget.
+	// nullptr (the default) for no budget. Call this before queueing any requests.
+	void SetMemoryBudget(HttpMemoryBudget* pBudget);
+	HttpMemoryBudget* GetMemoryBudget() const { return m_pBudget; }
+
+	// SetSizeHints:
+	// Learn how big each endpoint's response bodies are (see HttpSizeHints.h), from the 200 responses that come in,
+	// and give each request that is queued the hint for its endpoint (see HttpRequest::GetSizeHint()), so that an
+	// HttpMemoryDownload or HttpPost reserves its buffer up front even if the response has no Content-Length (or a
+	// compressed one), rather than grow it as the body arrives, and the memory budget charges it about what it will
+	// hold. A request's own expected size (see HttpRequest::SetExpectedSize()) still comes first. Off by default.
+	void SetSizeHints(bool enabled) { m_sizeHintsEnabled = enabled; }
+	const HttpSizeHints& GetSizeHints() const { return m_sizeHints; }
+	
+	// Prewarm:
+	// Spawn numWorkers worker threads (or curl handles, for ENGINE_MULTI) right away, e.g. right
+	// after construction, so that the first burst of requests doesn't have to wait for them.
+	void Prewarm(uint numWorkers);
+	// Or, open up to numConnections connections to origin ("https://api.example.com", or just the host name
+	// for HTTPS) ahead of need, e.g. during a splash screen, so that the first real requests there skip the DNS
+	// lookup and the TCP and TLS handshakes. This sends that many HEAD requests for "/" at PRIORITY_LOW, whose
+	// responses are ignored; each worker that sends one keeps its connection open, and the DNS entry and TLS
+	// session are shared with every worker. pDoneCallback is called once they have all finished (see HttpRequestGroup).
+	void Prewarm(const std::string& origin, uint numConnections, Ptr<HttpGroupCallbackBase> pDoneCallback = nullptr);
+	
+	// SetMaxRequestsPerHost:
+	// Limit how many requests may be in progress at once to any one host ("scheme://host:port").
+	// Hosts that have requests waiting take turns at getting a free worker, so that one worker
+	// pool can serve e.g. a CDN and an API server at the same time. 0 means no limit (default).
+	// SetMaxRequestsForHost() overrides the limit for a single host, e.g. "https://api.example.com".
+	void SetMaxRequestsPerHost(uint maxRequests) { m_scheduler.SetMaxPerHost(maxRequests); }
+	void SetMaxRequestsForHost(const std::string& origin, uint maxRequests) { m_scheduler.SetHostLimit(origin, maxRequests); }
+	
+	// SetPipelining:
+	// ENGINE_MULTI only: let requests to the same host share connections with HTTP/1.1 pipelining, where each
+	// request is sent before the responses to those ahead of it have arrived, so that many small requests (e.g.
+	// to a CDN) don't each need a connection of their own. curl only ever pipelines GET and HEAD requests. It is
+	// off by default, as some servers and proxies get it wrong: hosts in siteBlacklist ("host" or "host:port")
+	// are never pipelined to, and nor are servers whose Server header starts with an entry of serverBlacklist,
+	// which lists some known offenders by default. Set maxHostConnections too, or curl may open a new connection
+	// rather than wait to pipeline on one that is busy. Must be called before the first request is queued.
+	struct Pipelining {
+		bool enabled;
+		uint maxLength; // How many requests may be outstanding on one connection
+		uint maxHostConnections; // Connections per host (pipelined or not); 0 means no limit
+		int64 contentLengthPenalty; // Don't pipeline behind a response whose Content-Length is larger than this (0 means no limit)
+		int64 chunkLengthPenalty; // Or behind a chunked response whose chunks are larger than this
+		std::vector<std::string> siteBlacklist;
+		std::vector<std::string> serverBlacklist;
+		Pipelining(bool enabled = false);
+	};
+	void SetPipelining(const Pipelining& pipelining);
+	
+	// SetExternalEventLoop:
+	// ENGINE_MULTI only: have pLoop, an event loop of the app's own (e.g. an epoll or select loop that already serves
+	// other sockets), drive the transfers in place of the I/O threads, so that HTTP needs no threads at all (see
+	// HttpEventLoop.h). The loop runs on a thread of the app's own, not the app thread, as curl's handles belong to
+	// the workers' memory environment. From there it calls Io_Start() once, then Io_HandleSocket() as each socket
+	// that pLoop has been told to watch becomes ready, and Io_HandleTimeout() whenever pLoop's timeout passes, and
+	// Io_Stop() before the client is destroyed. Each of them picks up whatever the app thread has queued since, and
+	// hands back what has finished, for Update() as usual. Must be called before the first request is queued, and
+	// after SetPipelining().
+	void SetExternalEventLoop(HttpEventLoop* pLoop);
+	HttpEventLoop* GetExternalEventLoop() const { return m_pEventLoop; }
+	// Only ever called on the loop's thread, one at a time (see SetExternalEventLoop()):
+	void Io_Start();
+	void Io_HandleSocket(int fd, int events); // events: what the socket is ready for (HttpEventLoop::EVENT_IN etc.)
+	void Io_HandleTimeout();
+	void Io_Stop(); // Aborts the transfers still in progress, and lets go of the sockets (and of pLoop)
+	
+	// SetExpectContinuePolicy:
+	// When POST and PUT requests wait for the server's "100 Continue" before sending their body. Waiting spares a
+	// large body that the server is going to refuse anyway (e.g. for want of authorisation), but costs a round trip,
+	// or curl's 1 s timeout if the server ignores the Expect. With the policy off (the default) curl decides: it
+	// waits for bodies over 1 KB, and for every PUT. Otherwise bodies of at least minBodySize wait, and so do those
+	// of unknown size. For trustedOrigins (e.g. your own API) the limit is trustedMinBodySize instead, so only huge
+	// uploads wait. An origin is e.g. "https://api.example.com", or just a host for https. A request's own
+	// HttpRequest::SetExpectContinue() overrides this. HttpRequest::GetTimings().uploadWaitMs shows the cost.
+	struct ExpectContinuePolicy {
+		bool enabled;
+		int64 minBodySize; // 64 KB by default
+		std::vector<std::string> trustedOrigins;
+		int64 trustedMinBodySize; // 16 MB by default
+		ExpectContinuePolicy(bool enabled = false) : enabled(enabled), minBodySize(64 * 1024), trustedMinBodySize(16 * 1024 * 1024) {}
+	};
+	void SetExpectContinuePolicy(const ExpectContinuePolicy& policy);
+	
+	// SetPreemption:
+	// If enabled, PRIORITY_CRITICAL requests that can't get a free worker will abort transfers of
+	// PRIORITY_LOW or PRIORITY_BACKGROUND requests to take their place. The aborted requests are
+	// queued again and restart from the beginning once a worker is free (see HttpRequest::HandleRequeue()).
+	// Disabled by default.
+	void SetPreemption(bool enabled) { m_preemption = enabled; }
+	
+	// Suspend, Resume:
+	// For when the app goes into the background (see also SetAutoSuspend()): Suspend() aborts the transfers in progress
+	// and queues them again, as preemption does (see SetPreemption()), starts no more, and has the idle workers let go
+	// of their curl handles (or, with ENGINE_MULTI, their I/O threads close their connections), so that no sockets are
+	// left open for the OS to kill, and nothing runs meanwhile. Resume() starts the requests again, from the front of
+	// their queues; they reconnect, but the DNS cache and TLS sessions (see SetTlsSessionCacheFile()) are kept, so that
+	// costs little, and a resumable HttpDownload (see HttpDownload::SetResumable()) continues its partial file with a
+	// Range request. Requests may be queued, and Update() called, while suspended; responses from the memory cache still
+	// complete. A hedged transfer (see SetHedging()) is left to finish. Retries and deadlines keep counting.
+	void Suspend();
+	void Resume();
+	bool IsSuspended() const { return m_suspended; }
+	// SetAutoSuspend:
+	// Have the client Suspend() and Resume() itself on the s3e pause events (S3E_DEVICE_PAUSE and S3E_DEVICE_UNPAUSE).
+	// Off by default.
+	void SetAutoSuspend(bool enabled);
+
+	// SetRetryPolicy:
+	// Have requests that fail for reasons that may well go away (a connection that couldn't be made or was lost,
+	// a timeout, or an HTTP 408, 429, 500, 502, 503 or 504) sent again, rather than failing straight away. The
+	// same request is queued again (see HttpRequest::HandleRequeue()) after a random delay of up to baseDelayMs,
+	// doubling with each retry up to maxDelayMs, or as long as the server's Retry-After asks (up to maxDelayMs),
+	// so that clients that failed together don't all come back together. Its callback is only called once it
+	// succeeds, fails for good, or has been retried maxRetries times. Which requests are retried depends on
+	// their method (see HttpRequest::SetMaxRetries()). maxRetries 0 turns retries off (the default).
+	struct RetryPolicy {
+		uint maxRetries;
+		uint baseDelayMs;
+		uint maxDelayMs;
+		RetryPolicy(uint maxRetries = 0, uint baseDelayMs = 250, uint maxDelayMs = 30000) : maxRetries(maxRetries), baseDelayMs(baseDelayMs), maxDelayMs(maxDelayMs) {}
+	};
+	void SetRetryPolicy(const RetryPolicy& policy) { m_retryPolicy = policy; }
+	const RetryPolicy& GetRetryPolicy() const { return m_retryPolicy; }
+	
+	// SetCircuitBreaker:
+	// Stop spending workers on a host (origin) that is down. Once failureThreshold requests to it in a row have
+	// failed in a way that counts against it (as for SetRetryPolicy(): a connection that couldn't be made or was
+	// lost, a timeout, or an HTTP 408, 429 or 5xx), its breaker trips: for coolDownMs, its requests fail fast
+	// (ERROR, with HttpRequest::IsFailedFast() set) instead of each holding a worker until it times out, while
+	// requests to other hosts carry on. Then its queued requests are let through one at a time, as probes, until
+	// one succeeds and closes the breaker; a probe that fails opens it for another coolDownMs. A retry of a request
+	// that tripped the breaker waits out the cool-down, and is then one of the probes. Requests that go to a mirror
+	// set (see SetMirrors()) aren't counted, as the mirrors have health of their own. failureThreshold 0 turns it
+	// off (the default).
+	struct CircuitBreaker {
+		uint failureThreshold;
+		uint coolDownMs;
+		CircuitBreaker(uint failureThreshold = 0, uint coolDownMs = 30000) : failureThreshold(failureThreshold), coolDownMs(coolDownMs) {}
+	};
+	void SetCircuitBreaker(const CircuitBreaker& breaker);
+	const CircuitBreaker& GetCircuitBreaker() const { return m_circuitBreaker; }
+	
+	// SetHedging:
+	// Cut the tail latency of latency-critical GET and HEAD requests (those that have opted in with
+	// HttpRequest::SetHedge()). Once one of them has been waiting longer for its response than the given
+	// fraction of this client's responses took to arrive (see Stats::responseP95Ms), but for at least
+	// minDelayMs, and a worker is free with nothing queued for it, the same request is sent again on that
+	// worker. Whichever transfer gets its response first is used, and the other is aborted. Nothing is hedged
+	// until there have been a few responses to go by. percentile 0 turns hedging off again (the default).
+	void SetHedging(double percentile = 0.95, uint minDelayMs = 50) { m_hedgePercentile = percentile; m_hedgeMinDelayMs = minDelayMs; }
+	
+	// SetBandwidthLimit:
+	// Cap this client's transfers at bytesPerSecond in total, in each direction (0, the default, for no limit),
+	// e.g. so that background prefetching doesn't slow down API calls sharing the radio. The most important
+	// requests (see HttpRequest::SetPriority()) get the budget first: each priority level may use whatever the
+	// levels above it are leaving, shared evenly between its transfers, so lower priorities fill the capacity that
+	// higher ones don't need (but never get less than 4 KB/s each, so they don't time out). The split is revised
+	// about once a second from what the transfers are actually doing. See also HttpRequest::SetMaxSpeed().
+	void SetBandwidthLimit(uint64 bytesPerSecond);
+	uint64 GetBandwidthLimit() const { return m_bandwidthLimit; }
+	
+	// SetMaxBufferedBytes:
+	// Flow control: cap how much of their responses this client's requests may hold that the app hasn't consumed
+	// yet (e.g. the records of an HttpStreamRequest that Update() hasn't delivered), in total (0, the default, for
+	// no limit). Once they hold that much, any transfer that is holding some is paused, and resumes as the app
+	// catches up; see also HttpRequest::SetMaxUnconsumed(). Each transfer may go over by what curl passes it in one
+	// go (16 KB) before it notices. Stats::bufferedBytes shows where the total is.
+	void SetMaxBufferedBytes(size_t maxBytes);
+	
+	// SetAdaptiveConcurrency:
+	// Have the client find out how many transfers to run at once, rather than always using all numWorkers of its
+	// workers: the best number depends on the network (Wi-Fi or 3G) and on the servers. About once a second, the limit
+	// goes up by one if requests had to wait for it and the throughput (requests finished, or bytes transferred, per
+	// second) has improved since the second before. It is cut by the backoff factor if the responses have started to
+	// take much longer to arrive than usual (latencyTolerance times the best recent average, from a worker starting a
+	// request to its response headers), or if errorThreshold or more of the requests that finished failed in a way
+	// that suggests overload (a timeout, a lost connection, or an HTTP 408, 429, 500, 502, 503 or 504). The limit stays
+	// between minConcurrency and numWorkers, starting at initialConcurrency; Stats::concurrencyLimit shows where it
+	// is. Hedges (see SetHedging()) count towards it, like any other transfer. Off by default.
+	struct AdaptiveConcurrency {
+		bool enabled;
+		uint minConcurrency;
+		uint initialConcurrency;
+		double backoff; // What the limit is multiplied by when it is cut
+		double latencyTolerance;
+		double errorThreshold; // A fraction of the requests finished in that second
+		AdaptiveConcurrency(bool enabled = false) : enabled(enabled), minConcurrency(1), initialConcurrency(2), backoff(0.75), latencyTolerance(2), errorThreshold(0.1) {}
+	};
+	void SetAdaptiveConcurrency(const AdaptiveConcurrency& settings);
+	const AdaptiveConcurrency& GetAdaptiveConcurrency() const { return m_adaptive; }
+	
+	// SetSizeLanes:
+	// Keep small requests (e.g. API calls) from waiting behind big transfers once those are under way, which
+	// priorities alone can't do. A request is large if it is expected to upload or download at least largeBytes:
+	// going by its upload size (see HttpRequest::GetUploadSize()), its expected size (see
+	// HttpRequest::SetExpectedSize()) or, failing that, its endpoint's size hint (see SetSizeHints()). HEAD and
+	// DELETE requests never are. Large requests get a lane of their own: they only ever take as many workers as
+	// leave reservedWorkers of the concurrency limit (see Stats::concurrencyLimit) for the rest, but always at
+	// least one, and wait in the queue for the others. Stats::numLargeActive shows how many are running.
+	// largeBytes 0 turns the lanes off (the default).
+	struct SizeLanes {
+		uint64 largeBytes;
+		uint reservedWorkers;
+		SizeLanes(uint64 largeBytes = 0, uint reservedWorkers = 2) : largeBytes(largeBytes), reservedWorkers(reservedWorkers) {}
+	};
+	void SetSizeLanes(const SizeLanes& lanes) { m_sizeLanes = lanes; }
+	const SizeLanes& GetSizeLanes() const { return m_sizeLanes; }
+	bool IsLarge(const HttpRequest& request) const; // As SetSizeLanes() judges it (false if it is off)
+	
+	// SetNetworkProfiles:
+	// Adjust the scheduling to the kind of network the device is on, switching by itself whenever that changes
+	// (Update() checks s3eSocketGetInt(S3E_SOCKET_NETWORK_TYPE) about once a second). Each kind of network has a
+	// profile that further limits what the client's own settings allow: how many transfers may run at once, how
+	// many of those may be PRIORITY_BACKGROUND (i.e. prefetching), whether responses are asked for compressed,
+	// whether requests are hedged (see SetHedging()), and how many segments an HttpSegmentedDownload may split a
+	// file into. By default there is no limit on Wi-Fi, a wired or an unknown connection; fast mobile networks (3G
+	// and up) allow 2 background transfers and no hedging; and slow ones (GPRS, EDGE) allow 2 transfers, none in
+	// the background, no hedging and unsegmented downloads, so that a prefetch burst can't stall the requests the
+	// user is waiting for. SetNetworkProfile() replaces one of them. Off by default.
+	enum NetworkType {
+		NETWORK_UNKNOWN,     // Including before the first check
+		NETWORK_NONE,
+		NETWORK_WIFI,        // Or a wired (LAN) connection
+		NETWORK_MOBILE_FAST, // 3G and up
+		NETWORK_MOBILE_SLOW, // GPRS, EDGE
+		NUM_NETWORK_TYPES
+	};
+	struct NetworkProfile {
+		enum { NO_LIMIT = 0xFFFFFFFFu };
+		uint maxConcurrency; // NO_LIMIT for numWorkers (or what SetAdaptiveConcurrency() allows, which is always kept within this)
+		uint maxBackgroundTransfers;
+		bool acceptCompressed; // false to leave it to SetAcceptCompressed()
+		bool hedging; // false to turn SetHedging() off on this network
+		uint maxSegments; // For HttpSegmentedDownload
+		NetworkProfile(uint maxConcurrency = NO_LIMIT, uint maxBackgroundTransfers = NO_LIMIT, bool acceptCompressed = false, bool hedging = true, uint maxSegments = NO_LIMIT)
+			: maxConcurrency(maxConcurrency), maxBackgroundTransfers(maxBackgroundTransfers), acceptCompressed(acceptCompressed), hedging(hedging), maxSegments(maxSegments) {}
+	};
+	void SetNetworkProfiles(bool enabled);
+	void SetNetworkProfile(NetworkType type, const NetworkProfile& profile) { m_networkProfiles[type] = profile; }
+	NetworkType GetNetworkType() const { return m_networkType; } // As of the last check; NETWORK_UNKNOWN if profiles are off
+	const NetworkProfile& GetNetworkProfile() const; // The one in force: if profiles are off, one without limits
+	
+	// SetConfig:
+	// The connection settings that every transfer starts from: timeouts, the low-speed abort, TCP keepalive and
+	// nodelay, socket buffers and how long connections are reused for (see HttpClientConfig for each, and their
+	// defaults). They apply to requests started from now on; a request can override any of them with
+	// HttpRequest::SetConfigOverrides().
+	void SetConfig(const HttpClientConfig& config) { m_config = config; }
+	const HttpClientConfig& GetConfig() const { return m_config; }
+	// SetConnectTimeout:
+	// How long a request may take to look up its host and connect, in ms (0, the default, for curl's 300 s).
+	// curl 7.34 has no separate resolve timeout: the lookup counts towards this one. A request that runs out
+	// of time fails with CURLE_OPERATION_TIMEDOUT, which SetRetryPolicy() treats as worth another try.
+	// Lookups can only be cut short if curl resolves asynchronously (see IsAsyncDns()); otherwise, a slow
+	// system resolver blocks the transfer (or, with ENGINE_MULTI, its whole I/O thread) until it returns.
+	void SetConnectTimeout(uint timeoutMs) { m_config.connectTimeoutMs = timeoutMs; } // (Shorthand for that field of SetConfig())
+	// SetDnsCacheTtl:
+	// How long, in seconds, host names stay in the DNS cache that all of this client's workers share (default 60).
+	// -1 keeps them forever, 0 turns the cache off.
+	void SetDnsCacheTtl(int seconds) { m_dnsCacheTtl = seconds; }
+	// Whether libcurl was built with an asynchronous resolver (the threaded one, or c-ares), so that lookups
+	// don't block and can time out. The bundled libcurl uses the threaded resolver on Marmalade unless it is
+	// built with CURL_MARMALADE_SYNC_RESOLVER (see config-marmalade.h).
+	static bool IsAsyncDns();
+	// EnableCookies:
+	// Keep the cookies that servers set, and send them back with later requests, in one cookie jar that all of this
+	// client's workers share (otherwise none of them keep cookies, so e.g. a session cookie that one worker got
+	// would be missing from the requests that the others send, costing another login). If filePath is given
+	// (e.g. "ram://cookies.txt"), the cookies that SaveCookies() wrote there are loaded, so that they last across
+	// launches; then they are saved again when the client is destroyed. Call this before queueing any requests.
+	// Returns false if cookies can't be turned on (e.g. too late, or libcurl was built without them); a missing
+	// or unreadable file only means that the jar starts empty.
+	bool EnableCookies(const char* filePath = nullptr);
+	// Write the cookies to the file given to EnableCookies() (in the Netscape format that curl uses, session
+	// cookies included), e.g. when the app is paused, in case it isn't resumed. Returns false if it can't.
+	bool SaveCookies();
+	// Forget all cookies, e.g. when the user logs out (or only the session cookies, as a browser does on exit):
+	void ClearCookies(bool sessionOnly = false);
+	// SetHostAddresses:
+	// Connect to host:port at addresses (e.g. "203.0.113.7", or "203.0.113.7,203.0.113.8" to try them in that order)
+	// instead of looking the host up, e.g. for the app's own API servers, so that its first requests don't wait for
+	// DNS. The addresses go into the DNS cache that the workers share, for as long as the client lives, from the next
+	// request on. Empty addresses remove the host's, after which it is looked up as usual again.
+	void SetHostAddresses(const std::string& host, uint port, const std::string& addresses);
+	// Set the addresses of the "host:port:addresses" lines in filePath (e.g. a "rom://hosts.txt" that comes with the
+	// app), as SetHostAddresses() would. A line may end with a space and an s3eTimerGetUTC() time, after which its
+	// addresses are dropped again (and from which they aren't used at all). Returns false if it can't be read.
+	bool LoadHostAddresses(const char* filePath);
+	// SetDnsSnapshot:
+	// Keep the addresses that the client's transfers were made to in filePath (e.g. "ram://dns.txt"), so that the
+	// next launch can connect to those hosts without waiting for DNS: they are loaded now, and used until ttlS after
+	// they were written (so a host that has moved is only missed for so long). Meanwhile they are looked up again on a
+	// thread of its own, and given what the lookups find for another ttlS. The snapshot is written again when the
+	// client is destroyed. Hosts given SetHostAddresses() aren't part of it. Call this once, before queueing any
+	// requests. Returns false if there is no snapshot yet (or it can't be read), when every host is looked up as usual.
+	bool SetDnsSnapshot(const char* filePath, uint ttlS = 3600);
+	// Write the snapshot now, e.g. when the app is paused, in case it isn't resumed. Returns false if it can't.
+	bool SaveDnsSnapshot();
+	// Forget which address family each host was connected to over (see HttpClientConfig::rememberAddressFamily), e.g.
+	// when the device changes networks, so that both are tried again. (Done by Update() itself if network profiles
+	// are enabled.)
+	void ForgetAddressFamilies() { m_addressFamilies.clear(); }
+	// SetMirrors:
+	// The same content is at prefix (e.g. "https://cdn1.example.com/assets/") and at each of mirrors (e.g.
+	// "https://cdn2.example.com/assets/"), so a request to any of them can be sent to whichever is doing best (see
+	// HttpMirrors.h): the client goes by each origin's recent time to the first byte and throughput, and sends each
+	// GET or HEAD request to the one that would deliver its expected size (see HttpRequest::GetSizeHint()) soonest,
+	// leaving out those that have just failed. A request that fails there in a way that a retry might fix (see
+	// SetRetryPolicy()) fails over: it is sent again straight away to the next best origin that is up, once for each
+	// other origin at most, without waiting for a backoff or counting against its retries (though it counts in
+	// Stats::numRetries, as well as Stats::numFailovers). A request that may not be retried (see
+	// HttpRequest::SetMaxRetries()) doesn't fail over either. The caches, coalescing and the request itself go by its
+	// own URL; remembered redirects aren't used or learned for it. No mirrors removes prefix's set.
+	void SetMirrors(const std::string& prefix, const std::vector<std::string>& mirrors) { m_mirrors.Set(prefix, mirrors); }
+	const HttpMirrors& GetMirrors() const { return m_mirrors; } // e.g. to show how the origins are doing
+	// SetProgressInterval:
+	// How often a request's progress (see HttpRequest::GetProgress()) is brought up to date while it transfers:
+	// at most every intervalMs (default 100), and only once at least minBytes more have been sent or received
+	// (default 0). The final figures, and the size of the transfer once it's known, are always published at once.
+	void SetProgressInterval(uint intervalMs, uint64 minBytes = 0) { m_progressIntervalMs = intervalMs; m_progressMinBytes = minBytes; }
+	
+	// SetCompletionSignal:
+	// Optionally, have pfnSignal(userData) called as soon as any request finishes, e.g. to wake
+	// the app's main loop so it can call Update() right away rather than on its next frame.
+	// Note that pfnSignal is called directly from a worker thread, so it must be thread-safe
+	// and must not allocate or free any memory or touch any HttpClient/HttpRequest objects.
+	void SetCompletionSignal(void (*pfnSignal)(void* userData), void* userData);
+	
+	// SetCache:
+	// Have GET requests use pCache (see HttpCache.h), which must outlive this HttpClient. Requests
+	// can opt out with HttpRequest::SetUseCache(false). Call this before queueing any requests.
+	// nullptr (the default) means no caching. The cache also keeps the permanent redirects that the client
+	// follows (see HttpClientConfig::maxRedirects), so that later launches go straight to where they lead.
+	void SetCache(HttpCache* pCache) { m_pCache = pCache; }
+	
+	// SetMemoryCache:
+	// Keep small responses in pCache (see HttpMemoryCache.h), which must outlive this HttpClient, so that
+	// identical requests made soon afterwards are answered without a transfer. This is checked before
+	// the disk cache, and works with or without it. nullptr (the default) means no memory cache.
+	void SetMemoryCache(HttpMemoryCache* pCache) { m_pMemoryCache = pCache; }
+	// SetNegativeCacheTtl:
+	// Remember for ttlMs which URLs a GET or HEAD was answered with 404 Not Found or 410 Gone (see HttpNegativeCache.h),
+	// e.g. the optional avatars and localized variants that mostly don't exist, and answer later requests for them
+	// with the same status on the next Update(), as memory cache hits are, without a worker or any network I/O. A
+	// shorter max-age in the response's Cache-Control applies instead, and no-store keeps it from being remembered at
+	// all. A response under 400 for the URL forgets it, and so does ForgetMissing(), e.g. once the app has uploaded
+	// the user's avatar. With SetCache(), the URLs are kept in its index across launches. 0 (the default) turns it off.
+	void SetNegativeCacheTtl(uint ttlMs) { m_negativeTtlMs = ttlMs; }
+	void ForgetMissing(const std::string& url) { SetMissing(url, 0, 0); }
+	// PreloadMemoryCache:
+	// Read the numEntries most recently used responses in the disk cache that are still fresh, and small enough for
+	// the memory cache, into the memory cache, on the threads of the CPU pool (see SetCpuPool()), e.g. at startup, so
+	// that the first screen's requests are answered from memory, rather than by a worker reading the disk. They
+	// only stay fresh for as long as they would have on disk, and a response that gets to the memory cache first is
+	// kept. Needs all of SetCache(), SetMemoryCache() and SetCpuPool(); returns how many responses are being read.
+	uint PreloadMemoryCache(uint numEntries);
+	
+	// SetRecording:
+	// Record this client's responses in pRecording, or replay them from it (see HttpRecording.h), depending on its mode.
+	// It must outlive this HttpClient. Call this before queueing any requests. nullptr (the default) means neither.
+	void SetRecording(HttpRecording* pRecording) { m_pRecording = pRecording; }
+	
+	// SetAcceptCompressed:
+	// Whether requests ask for gzip/deflate-compressed responses (Accept-Encoding), which are decompressed
+	// on the worker threads before the requests see them. Requests can override this with
+	// HttpRequest::SetCompression(). Enabled by default.
+	void SetAcceptCompressed(bool accept) { m_acceptCompressed = accept; }
+
+	// SetDefaultHeader:
+	// Headers that are sent with every request (e.g. Authorization, Accept, an API version), so that
+	// requests only need to set the headers that are their own. A request's own header replaces the
+	// default of the same name. An empty value removes the default. The defaults are compiled into
+	// curl's format once, when the next request is queued after a change, and shared by every request
+	// queued from then on; requests that are already queued keep the defaults that they were queued with.
+	void SetDefaultHeader(const std::string& header, const std::string& value);
+	void SetDefaultHeaders(const HttpHeaders& headers); // Replace all of them
+	const HttpHeaders& GetDefaultHeaders() const { return m_defaultHeaders; }
+
+	// SetTracer:
+	// Record the lifecycle events of this client's requests in pTracer (see HttpTracer.h), which must outlive
+	// this HttpClient. Call this before queueing any requests; it can't be changed afterwards. Does nothing in a
+	// build with HTTP_PROBES=0 (see HttpProbes.h).
+	void SetTracer(HttpTracer* pTracer);
+	
+	// GetStats:
+	// A snapshot of what this client is up to, cheap enough to call every frame (e.g. for a debug HUD).
+	// The totals and latencies count every request since the HttpClient was created or ResetStats() was called.
+	struct Stats {
+		uint numPending; // Requests waiting for a worker
+		uint numRetrying; // Of those, how many are waiting for their retry's backoff to end
+		uint numActive; // Workers with a request in progress (or just finished, waiting for Update())
+		uint numIdle; // Workers that are ready for a request
+		uint numCleanup; // Workers that are cleaning up after a request, or shutting down
+		uint numWorkers; // Of the numWorkers slots, how many currently have a thread/curl handle
+		uint numLargeActive; // Of the requests in progress, how many are large (see SetSizeLanes())
+		uint64 numCompleted; // Requests that got a successful response
+		uint64 numFailed; // Requests that failed (including HTTP errors)
+		uint64 numRetries; // Failed attempts that were sent again (see SetRetryPolicy())
+		uint64 numFailovers; // Of those, how many went to another mirror (see SetMirrors())
+		uint64 numExpired; // Requests dropped or aborted because their deadline passed (see HttpRequest::SetDeadline())
+		uint64 numFailedFast; // Requests failed without being sent because their host's breaker was open (see SetCircuitBreaker())
+		double bytesPerSecond; // Uploaded and downloaded on the wire, averaged over about the last second
+		// From QueueRequest() until the response was handled, in ms. These come from a histogram with
+		// buckets about 19% wide, and are the top of the bucket that the percentile falls in.
+		uint latencyP50Ms, latencyP90Ms, latencyP99Ms;
+		// From a worker starting a request until its response headers arrived (which is what SetHedging() goes by):
+		uint responseP95Ms;
+		uint64 numHedges; // Second transfers started by SetHedging()
+		uint64 numHedgeWins; // Of those, how many got their response first
+		uint64 numLent; // Of our requests, how many were sent by another client's worker (see SetWorkPool())
+		uint64 numBorrowed; // Requests of other clients that our workers sent
+		uint concurrencyLimit; // How many transfers may run at once: numWorkers, unless SetAdaptiveConcurrency() or SetNetworkProfiles() limit it
+		size_t bufferedBytes; // Held by requests in progress, not yet consumed by the app (see SetMaxBufferedBytes())
+		uint lastUpdateUs, maxUpdateUs; // The time taken by the last Update(), and by the longest
+		uint64 numOverBudget; // Update()s that left finished requests for the next one, their budget spent (see Update())
+	};
+	Stats GetStats() const;
+	void ResetStats(); // (And the endpoint stats, if they are kept)
+
+	// SetEndpointStats:
+	// Keep figures for each endpoint (see HttpUrl::GetEndpoint(), e.g. "https://api.example.com:443/users/*/avatar")
+	// that this client's requests have gone to, since it was enabled or ResetStats() was last called, so that the
+	// slow endpoints can be found from what the app sees out in the field. Up to maxEndpoints (0 turns it off, the
+	// default) are kept; those of any further endpoints are counted together, under "*". Cheap enough to leave on,
+	// but none are kept in a build with HTTP_PROBES=0 (see HttpProbes.h).
+	void SetEndpointStats(uint maxEndpoints);
+	struct EndpointStats {
+		std::string endpoint;
+		uint64 numRequests; // That finished, including those that failed
+		uint64 numFailed; // Including HTTP errors
+		// From QueueRequest() until the response was handled, in ms, as Stats::latencyP50Ms etc.:
+		uint latencyP50Ms, latencyP95Ms, latencyP99Ms;
+		double meanBytesDown, meanBytesUp; // On the wire, per request
+		double meanWorkerCpuMs, meanAppCpuMs; // CPU time per request (see HttpRequest::Timings::workerCpuMs and appCpuMs)
+	};
+	// The endpoints, those with the most requests first:
+	void GetEndpointStats(std::vector<EndpointStats>& stats) const;
+	// The same as JSON, to send with the app's own telemetry, e.g. (and then ResetStats(), to start afresh):
+	//     client.QueueRequest(&(new HttpPostJson(telemetryUrl))->SetPostData(client.GetEndpointStatsJson()), callback);
+	// {"endpoints": [{"endpoint": "...", "count": 120, "errorRate": 0.025, "p50Ms": 96, "p95Ms": 384, "p99Ms": 768,
+	// "meanBytesDown": 5120.5, "meanBytesUp": 310, "meanWorkerCpuMs": 1.8, "meanAppCpuMs": 0.4}, ...]}
+	json::Object GetEndpointStatsJson() const;
 
 private:
 	const std::string m_userAgent;
 	typedef HttpClient_Worker Worker;
+	typedef HttpClient_IoThread IoThread;
+	const Engine m_engine;
 	Worker* m_workers; // Array of Worker threads
 	const uint NUM_WORKERS;
-	std::queue< Ptr<HttpRequest> > m_pendingRequests;
-	std::list< std::pair< Ptr<HttpRequest>, Ptr<HttpCallbackBase> > > m_pendingCallbacks; // Callbacks to call once a request has finished.
+	IoThread* m_ioThreads; // ENGINE_MULTI only: array of I/O threads that drive m_workers
+	const uint NUM_IO_THREADS;
+	Pipelining m_pipelining; // See SetPipelining()
+	std::vector<const char*> m_pipeliningSiteBlacklist; // m_pipelining's blacklists as curl wants them (NULL-terminated), for the I/O threads to read
+	std::vector<const char*> m_pipeliningServerBlacklist;
+	void StartIoThread(IoThread& ioThread);
+	HttpEventLoop* m_pEventLoop; // See SetExternalEventLoop()
+	void Io_Continue(); // The end of each Io_ method: picks up the app thread's work, and gives the loop its next timeout
+	HttpClient_Share* m_pShare; // DNS cache and TLS sessions shared by all of our workers (and cookies, if enabled)
+	std::string m_cookieFile; // See EnableCookies()
+	HttpHostTable m_hostTable; // See SetHostAddresses() and SetDnsSnapshot()
+	std::string m_dnsSnapshotFile;
+	uint64 m_dnsSnapshotTtlMs;
+	HttpClient_HostRefresh* m_pHostRefresh; // The lookups started by SetDnsSnapshot(), until Update() has their results
+	void StartHostRefresh();
+	void FinishHostRefresh();
+	void LearnHostAddress(const Worker& worker); // For the snapshot
+	std::map<std::string, int> m_addressFamilies; // By origin: the HttpClientConfig::addressFamily that its connections were made over
+	void ApplyAddressFamily(Worker& worker);
+	void LearnAddressFamily(const Worker& worker);
+	// Permanent redirects, by the URL they were from (see HttpClientConfig::maxRedirects): in m_pCache's index, if
+	// there is a cache, otherwise in m_redirects:
+	std::map<std::string, std::string> m_redirects;
+	const std::string* FindRedirect(const std::string& url) const;
+	void SetRedirect(const std::string& url, const std::string& target);
+	void ApplyRedirect(Worker& worker);
+	void LearnRedirect(const Worker& worker);
+	// URLs that are known to be missing (see SetNegativeCacheTtl()): likewise in m_pCache's index, or in m_missing:
+	uint m_negativeTtlMs;
+	HttpNegativeCache m_missing;
+	int FindMissing(const std::string& url) const;
+	void SetMissing(const std::string& url, int statusCode, uint64 untilUtcMs);
+	void LearnMissing(const Worker& worker);
+	HttpMirrors m_mirrors; // See SetMirrors()
+	void ApplyMirror(Worker& worker); // After ApplyRedirect(), which it overrides
+	void LearnMirror(const Worker& worker);
+	bool ShouldFailOver(const Worker& worker);
+	HttpClient_CompletionQueue* m_pCompletions; // Workers that have finished a request and are waiting for HandleWorkerDone()
+	HttpClient_FlowControl* m_pFlow; // See SetMaxBufferedBytes()
+	volatile uint m_logPending; // Set by the workers and I/O threads when they have written to their logs (see HttpLog.h)
+	void DrainLogs();
+	void HandleWorkerDone(Worker& worker);
+	void DeferCleanup(Worker& worker); // Once a response has been processed: Update() wakes the worker to clean up, or to start its next request
+	HttpTimerWheel m_timers; // Advanced by Update(). (Before m_scheduler, which sets timers on it.)
+	HttpScheduler m_scheduler; // Requests waiting for a free worker
+	void StartRequest(Worker& worker, const Ptr<HttpRequest>& pRequest);
+	void Enqueue(const Ptr<HttpRequest>& pRequest, uint64 notBeforeMs = 0); // Queue pRequest with the scheduler, or have it follow an identical request
+	bool AddFollower(HttpRequest& leader, const Ptr<HttpRequest>& pFollower);
+	void HandleResponseHeaders(Worker& worker); // For the worker's request and its followers
+	bool m_preemption;
+	bool m_suspended; // See Suspend()
+	bool m_autoSuspend; // See SetAutoSuspend()
+	static int32 HandleDevicePause(void* systemData, void* userData);
+	static int32 HandleDeviceUnpause(void* systemData, void* userData);
+	uint m_numPreempting; // Number of workers that have been asked to abort their transfer for a PRIORITY_CRITICAL request
+	void PreemptForCriticalRequests();
+	void ExpireRequest(HttpRequest* pRequest); // Cancel a queued request whose deadline has passed (see HttpRequest::SetDeadline())
+	double m_hedgePercentile; // 0 if hedging is off
+	uint m_hedgeMinDelayMs;
+	enum { HEDGE_MIN_RESPONSES = 20 };
+	RetryPolicy m_retryPolicy;
+	uint32 m_retrySeed; // For the backoff's jitter
+	uint64 GetRetryDelayMs(const Worker& worker); // 0 if the worker's request shouldn't be retried
+	CircuitBreaker m_circuitBreaker;
+	std::vector< Ptr<HttpRequest> > m_failingFast; // Requests to a host whose breaker is open, to be failed on the next Update()
+	void LearnCircuit(const Worker& worker); // Tell the request's host's breaker how it went
+	Ptr<HttpRequest> PopRequest(bool accept); // From m_scheduler (accept for AcceptToStart()), failing fast any that are for an open breaker
+	void FailFast(HttpRequest& request);
+	void StartHedges(uint64 nowMs);
+	void StartHedge(Worker& worker, Worker& first, uint64 nowMs); // Send first's request on worker too
+	void ActivateWorker(Worker& worker); // Wake (or spawn) a worker once it has been given a request
+	ExpectContinuePolicy m_expectContinuePolicy; // With its trustedOrigins normalised by HttpUrl::GetOrigin()
+	int64 GetExpectContinueMinSize(const HttpRequest& request) const; // For Worker::expectContinueMinSize
+	uint m_minWorkers;
+	uint m_idleTimeoutMs; // 0 means idle workers are never retired
+	HttpThreadOptions m_threadOptions;
+	void SpawnWorkerThread(Worker& worker, int initialStatus); // initialStatus is a Worker::StatusCode: ACTIVE, or READY to pre-warm
+	void FinishRetiringWorker(Worker& worker);
+	HttpCache* m_pCache;
+	void PrepareCache(Worker& worker); // Decide how the worker's request uses the cache, before it starts
+	void FinishCache(Worker& worker, bool completed); // Store/refresh the response once it's done (or clean up if !completed)
+	HttpMemoryCache* m_pMemoryCache;
+	HttpRecording* m_pRecording;
+	void PrepareRecording(Worker& worker); // Decide whether the worker's request is recorded or replayed, once PrepareCache() has
+	void RecordResponse(const Worker& worker); // Add the worker's response to the recording, once it's done
+	bool m_acceptCompressed;
+	HttpClientConfig m_config;
+	int m_dnsCacheTtl;
+	uint m_progressIntervalMs;
+	uint64 m_progressMinBytes;
+	HttpHeaders m_defaultHeaders;
+	Ptr<HttpHeaderTemplate> m_pDefaultHeaderTemplate; // Compiled from m_defaultHeaders, or nullptr if there are none
+	uint m_defaultHeadersVersion;
+	bool m_defaultHeadersChanged; // Since m_pDefaultHeaderTemplate was compiled
+	typedef std::vector< std::pair< Ptr<HttpRequest>, Ptr<HttpMemoryCache::Entry> > > MemoryHits;
+	MemoryHits m_memoryHits; // Requests queued since the last Update() that the memory cache can answer, with their response
+	class PreloadJob;
+	std::vector<PreloadJob*> m_preloads; // See PreloadMemoryCache()
+	void FinishPreload(PreloadJob* pJob, bool success);
+	// Give a request a response that was got some other way (from the memory cache, or as part of a batch; see HttpBatcher):
+	friend class HttpBatcher;
+	void CompleteLocally(HttpRequest& request, int httpStatusCode, const HttpHeaders& headers, const char* pBody, size_t bodySize);
+	// Dependencies (see HttpRequest::AddDependency()):
+	friend class HttpRequest;
+	std::vector< Ptr<HttpRequest> > m_readyDependents; // Queued since the last Update() with nothing to wait for
+	bool WaitForDependencies(const Ptr<HttpRequest>& pRequest); // false if it has none, and can be sent now
+	void ReleaseDependent(const Ptr<HttpRequest>& pRequest); // Once its dependencies have completed, or one has failed
+	void Submit(const Ptr<HttpRequest>& pRequest); // The rest of QueueRequest(), once the callback is set
+	void CompleteFromMemory(HttpRequest& request, const Ptr<HttpMemoryCache::Entry>& pEntry);
+	static void SetTimings(HttpRequest& request, const HttpRequest::Timings& timings); // From the worker, keeping the queue time
+	HttpTracer* m_pTracer;
+	HttpTracer::Ring* m_pTraceRing; // For events on the app thread
+	void Trace(HttpRequest& request, HttpTracer::Event event) { if (HTTP_PROBES && m_pTraceRing) HttpTracer::Trace(m_pTraceRing, event, request.m_traceId); }
+	// Statistics for GetStats():
+	enum { NUM_LATENCY_BUCKETS = 80 }; // Four per power of two of milliseconds, up to about half an hour
+	uint m_latencyBuckets[NUM_LATENCY_BUCKETS];
+	uint m_responseBuckets[NUM_LATENCY_BUCKETS]; // Time to the response headers, for Stats::responseP95Ms
+	uint64 m_numCompleted, m_numFailed;
+	uint64 m_numResponses, m_numHedges, m_numHedgeWins, m_numRetries, m_numFailovers, m_numExpired, m_numFailedFast;
+	uint m_lastUpdateUs, m_maxUpdateUs;
+	uint64 m_numOverBudget;
+	// See SetEndpointStats():
+	struct EndpointEntry {
+		uint64 numRequests, numFailed;
+		double bytesDown, bytesUp;
+		double workerCpuMs, appCpuMs;
+		uint latencyBuckets[NUM_LATENCY_BUCKETS];
+	};
+	std::map<std::string, EndpointEntry> m_endpoints; // By HttpUrl::GetEndpoint(), or "*" once there are too many
+	uint m_maxEndpoints;
+	void RecordEndpoint(const HttpRequest& request, bool success, uint latencyBucket);
+	void RecordEndpointCpu(const HttpRequest& request); // Once its callback has returned, after RecordEndpoint()
+	// See SetMemoryBudget():
+	HttpMemoryBudget* m_pBudget;
+	bool m_sizeHintsEnabled; // See SetSizeHints()
+	HttpSizeHints m_sizeHints;
+	void ChargeMemory(Worker& worker, size_t bytes); // Change what worker's transfer is charged (0 once it is over)
+	static bool AcceptToStart(const HttpRequest& request, const void* pClient); // For HttpScheduler::Pop(): AcceptByProfile(), the size lanes, and the budget
+	// Sharing workers (see SetWorkPool()):
+	friend class HttpWorkPool;
+	HttpWorkPool* m_pWorkPool;
+	HttpCpuPool* m_pCpuPool; // See SetCpuPool()
+	HttpDiskWriter* m_pDiskWriter; // See SetDiskWriter()
+	uint64 m_numLent, m_numBorrowed;
+	bool CanLendTo(const HttpClient& borrower) const; // Whether our queued requests may go to borrower's idle workers
+	static bool IsLendable(const HttpRequest& request, const void* pBorrower); // For HttpScheduler::Pop()
+	void ReturnBorrowed(HttpClient* pOwner); // Hand back to pOwner's queue (or all owners, if nullptr) the requests our workers have of it
+	HttpScheduler& GetScheduler(const Worker& worker); // The queue that worker's request came from
+	double m_bytesFinished; // By requests that have finished
+	double m_rateSampleBytes; // Total bytes transferred when the rate was last sampled
+	uint64 m_rateSampleMs;
+	double m_bytesPerSecond;
+	void RecordResult(const HttpRequest& request, bool success); // Once a request's response has been handled
+	void SampleRate(uint64 nowMs);
+	// Bandwidth shaping (see SetBandwidthLimit()):
+	enum { BANDWIDTH_MIN_SHARE = 4096 };
+	uint64 m_bandwidthLimit;
+	uint64 m_bandwidthRecvBudget[HttpRequest::NUM_PRIORITIES]; // What each priority level had left to share, as of the last UpdateBandwidth()
+	uint64 m_bandwidthSendBudget[HttpRequest::NUM_PRIORITIES];
+	void SampleWorkerRate(Worker& worker, double seconds);
+	void UpdateBandwidth(); // Share the budget out again, once the rates have been sampled
+	// Adaptive concurrency (see SetAdaptiveConcurrency()). The figures for the current window, about a second, are
+	// gathered as requests get their response headers (RecordResponseTime()) and finish (RecordCongestion()):
+	AdaptiveConcurrency m_adaptive;
+	double m_concurrencyLimit;
+	uint m_windowResponses, m_windowFinished, m_windowErrors;
+	uint64 m_windowResponseMs;
+	bool m_windowLimited; // A worker was free, and a request waiting, but the limit held it back
+	double m_lastFinishedRate, m_lastBytesRate; // The previous window's throughput
+	double m_baselineResponseMs; // The best recent average time to the response headers, or 0 if there is none yet
+	uint GetConcurrencyLimit() const;
+	uint NumTransfers() const; // Workers with a request in progress (or finished, but not yet handled)
+	void RecordResponseTime(uint64 ms);
+	void RecordCongestion(const Worker& worker); // Once a worker has finished a request of its own
+	void AdjustConcurrency(double seconds); // Once the rates have been sampled
+	// Network profiles (see SetNetworkProfiles()):
+	bool m_networkProfilesEnabled;
+	NetworkProfile m_networkProfiles[NUM_NETWORK_TYPES];
+	NetworkType m_networkType;
+	uint64 m_networkCheckMs;
+	uint m_numBackgroundTransfers; // Only kept up to date during Update()
+	// Size lanes (see SetSizeLanes()):
+	SizeLanes m_sizeLanes;
+	uint m_numLargeTransfers, m_maxLargeTransfers; // Only kept up to date during Update()
+	void CheckNetworkType(uint64 nowMs);
+	bool IsHedging() const { return m_hedgePercentile > 0 && GetNetworkProfile().hedging; }
+	static bool AcceptByProfile(const HttpRequest& request, const void* pClient); // For HttpScheduler::Pop()
+	void StartBandwidth(Worker& worker); // Set the speed limits for a worker that is starting a request
+	void SetWorkerSpeed(Worker& worker, uint numTransfers);
+	static uint GetLatencyPercentile(const uint* pBuckets, uint64 numRequests, double fraction);
 };
@@ -0,0 +1,99 @@
+// HttpClientConfig:
+// The connection and transfer settings that an HttpClient applies to every
+// transfer (see HttpClient::SetConfig()), and that a request can override
+// one at a time (see HttpRequest::SetConfigOverrides()): timeouts, TCP
+// options, how long a connection may be reused for, which address family it
+// is made over, and whether redirects are followed. All plain data, so the app thread can copy it into a
+// worker along with each request.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+struct HttpClientConfig {
+	enum { INHERIT = -1 }; // In overrides: use the HttpClient's value
+
+	// How long a request may take to look up its host and connect, in ms (0 for curl's 300 s). See HttpClient::SetConnectTimeout().
+	int connectTimeoutMs;
+	// A transfer that averages less than lowSpeedLimit bytes per second for lowSpeedTimeS seconds is aborted with
+	// CURLE_OPERATION_TIMEDOUT (which HttpClient::SetRetryPolicy() treats as worth another try), so that a stalled
+	// connection can't keep a worker forever. 1 byte/s for 60 s by default; lowSpeedTimeS 0 turns it off, e.g.
+	// for a long poll that may stay silent for longer.
+	int lowSpeedLimit;
+	int lowSpeedTimeS;
+	// Send small writes straight away rather than waiting to fill a packet (Nagle's algorithm off). On by default.
+	int tcpNoDelay;
+	// Probe idle connections, so that one the network has silently dropped is noticed: after keepAliveIdleS seconds
+	// without traffic, then every keepAliveIntervalS seconds. On by default, every 60 and 30 seconds.
+	int tcpKeepAlive;
+	int keepAliveIdleS;
+	int keepAliveIntervalS;
+	// The socket's receive buffer (SO_RCVBUF) in bytes, e.g. larger for downloads over fast, high-latency
+	// links. 0 (the default) leaves it to the system.
+	int receiveBufferSize;
+	// The most that curl reads from a connection at a time (CURLOPT_BUFFERSIZE), in bytes: e.g. more for big
+	// downloads over fast links, for fewer reads. 0 (the default) for curl's 16 KB. curl 7.34 can't go above that;
+	// later versions go up to 512 KB. curl still hands the data over 16 KB at a time: see coalesceBytes.
+	int curlBufferSize;
+	// Collect what curl delivers into blocks of this many bytes before handing them to the request (and its sink and
+	// the caches), for fewer and bigger writes when a connection delivers in small pieces (e.g. TLS records, or a
+	// chunked response). Anything bigger is handed over as it comes, without a copy, and so is a block that has
+	// waited a tenth of a second, so that a slow response still arrives as it goes (not for streams that must see
+	// every byte at once, though: HttpEventStream turns it off). Costs each worker a buffer of that size. 0 (the
+	// default) hands over every piece as it comes.
+	int coalesceBytes;
+	// Once a worker's connection is this many seconds old, its next request opens a new one (e.g. so that
+	// the clients of a load-balanced service spread out again). 0 (the default) reuses connections for as
+	// long as the server keeps them open. curl 7.34 doesn't know when a pooled connection was opened, so this
+	// goes by when the worker last had to connect.
+	int maxConnectionAgeS;
+	// Which of a host's addresses to connect to (CURLOPT_IPRESOLVE): either family (the default), or only IPv4 or
+	// IPv6, e.g. ADDRESS_IPV4 on a network whose IPv6 is known to be broken.
+	enum { ADDRESS_ANY, ADDRESS_IPV4, ADDRESS_IPV6 };
+	int addressFamily;
+	// With ADDRESS_ANY, how long the first family the resolver lists is given to connect before the other one is
+	// tried alongside it ("happy eyeballs"), in ms; 0 (the default) for curl's 200 ms. curl 7.34 can't change it.
+	int happyEyeballsMs;
+	// With ADDRESS_ANY, once a host has been connected to over one family, connect to it over that one only (so
+	// at the first attempt) for the rest of the session, or until a connection that way fails. On by default.
+	int rememberAddressFamily;
+	// Follow up to this many redirects (so the request gets the response they lead to), or 0 (the default) to hand
+	// the request the redirect itself. The client remembers where permanent ones (301 and 308) to a GET or HEAD
+	// lead, and sends later requests for the same URL straight there (see HttpClient::SetCache() to keep them
+	// across launches); one that stops working there is forgotten, and sent to the URL it was for again.
+	int maxRedirects;
+
+	HttpClientConfig()
+		: connectTimeoutMs(0), lowSpeedLimit(1), lowSpeedTimeS(60), tcpNoDelay(1), tcpKeepAlive(1), keepAliveIdleS(60), keepAliveIntervalS(30),
+		  receiveBufferSize(0), curlBufferSize(0), coalesceBytes(0), maxConnectionAgeS(0), addressFamily(ADDRESS_ANY), happyEyeballsMs(0), rememberAddressFamily(1), maxRedirects(0) {}
+	// A set of overrides that changes nothing, to set just the fields that a request needs:
+	static HttpClientConfig Overrides() {
+		HttpClientConfig overrides;
+		overrides.connectTimeoutMs = overrides.lowSpeedLimit = overrides.lowSpeedTimeS = overrides.tcpNoDelay = overrides.tcpKeepAlive
+			= overrides.keepAliveIdleS = overrides.keepAliveIntervalS = overrides.receiveBufferSize = overrides.curlBufferSize = overrides.coalesceBytes
+			= overrides.maxConnectionAgeS
+			= overrides.addressFamily = overrides.happyEyeballsMs = overrides.rememberAddressFamily = overrides.maxRedirects = INHERIT;
+		return overrides;
+	}
+	// Take every field of overrides that isn't INHERIT:
+	void Apply(const HttpClientConfig& overrides) {
+		Apply(connectTimeoutMs, overrides.connectTimeoutMs);
+		Apply(lowSpeedLimit, overrides.lowSpeedLimit);
+		Apply(lowSpeedTimeS, overrides.lowSpeedTimeS);
+		Apply(tcpNoDelay, overrides.tcpNoDelay);
+		Apply(tcpKeepAlive, overrides.tcpKeepAlive);
+		Apply(keepAliveIdleS, overrides.keepAliveIdleS);
+		Apply(keepAliveIntervalS, overrides.keepAliveIntervalS);
+		Apply(receiveBufferSize, overrides.receiveBufferSize);
+		Apply(curlBufferSize, overrides.curlBufferSize);
+		Apply(coalesceBytes, overrides.coalesceBytes);
+		Apply(maxConnectionAgeS, overrides.maxConnectionAgeS);
+		Apply(addressFamily, overrides.addressFamily);
+		Apply(happyEyeballsMs, overrides.happyEyeballsMs);
+		Apply(rememberAddressFamily, overrides.rememberAddressFamily);
+		Apply(maxRedirects, overrides.maxRedirects);
+	}
+private:
+	static void Apply(int& value, int override) { if (override != INHERIT) value = override; }
+};
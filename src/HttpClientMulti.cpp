@@ -0,0 +1,344 @@
+// HttpClientMulti:
+// The ENGINE_MULTI implementation of HttpClient: instead of one thread per
+// worker, each I/O thread drives a group of workers through a single
+// curl_multi handle using curl_multi_socket_action().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpClientWorker.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+void HttpClient_IoThread::Wake() {
+	// Called from the app thread. If the pipe is full, the I/O thread is already due to wake up.
+	const char c = 0;
+	if (wakePipe[1] >= 0)
+		write(wakePipe[1], &c, 1);
+}
+
+// Tell an external event loop (see HttpEventLoop) what to watch fd for, by curl's CURL_POLL_ value what:
+static void HttpClient_IoThread_Watch(HttpClient_IoThread* pIoThread, curl_socket_t fd, int what) {
+	if (!pIoThread->pLoop)
+		return;
+	const int events = what == CURL_POLL_REMOVE ? 0 : ((what & CURL_POLL_IN) ? HttpEventLoop::EVENT_IN : 0) | ((what & CURL_POLL_OUT) ? HttpEventLoop::EVENT_OUT : 0);
+	pIoThread->pLoop->WatchSocket((int)fd, events);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// curl_multi callbacks.
+extern "C" {
+
+static int HttpClient_IoThread_SocketCallback(CURL *pCurl, curl_socket_t s, int what, void *_pIoThread, void *socketp) {
+	HttpClient_IoThread* pIoThread = reinterpret_cast<HttpClient_IoThread*>(_pIoThread);
+	std::vector<HttpClient_IoThread::Socket>& sockets = pIoThread->sockets;
+	for (auto it = sockets.begin(); it != sockets.end(); it++) {
+		if (it->fd == s) {
+			if (what == CURL_POLL_REMOVE)
+				sockets.erase(it);
+			else
+				it->what = what;
+			HttpClient_IoThread_Watch(pIoThread, s, what);
+			return 0;
+		}
+	}
+	if (what != CURL_POLL_REMOVE) {
+		HttpClient_IoThread::Socket socket = { s, what };
+		sockets.push_back(socket);
+		HttpClient_IoThread_Watch(pIoThread, s, what);
+	}
+	return 0;
+}
+
+static int HttpClient_IoThread_TimerCallback(CURLM *pMulti, long timeoutMs, void *_pIoThread) {
+	HttpClient_IoThread* pIoThread = reinterpret_cast<HttpClient_IoThread*>(_pIoThread);
+	pIoThread->timeoutMs = timeoutMs;
+	clock_gettime(CLOCK_MONOTONIC, &pIoThread->timeoutStart);
+	return 0;
+}
+
+} // End of extern "C"
+
+// How long poll() may sleep before curl's timer expires (-1 if curl has no timer running)
+static int HttpClient_IoThread_GetPollTimeout(HttpClient_IoThread* pIoThread) {
+	if (pIoThread->timeoutMs < 0)
+		return -1;
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long elapsed_ms = (now.tv_sec - pIoThread->timeoutStart.tv_sec) * 1000 + (now.tv_nsec - pIoThread->timeoutStart.tv_nsec) / 1000000;
+	return elapsed_ms >= pIoThread->timeoutMs ? 0 : (int)(pIoThread->timeoutMs - elapsed_ms);
+}
+
+// While a transfer is paused for flow control (see HttpClient_Worker_ShouldPause()), how often to see whether the app
+// has caught up with it. (curl's own timer may not fire for up to a second.)
+static const int HTTP_CLIENT_PAUSED_POLL_MS = 10;
+
+// Any transfers that curl reports as finished get handed back to the app thread:
+static void HttpClient_IoThread_CollectFinished(HttpClient_IoThread* pIoThread) {
+	int msgs_left;
+	while (CURLMsg* p_msg = curl_multi_info_read(pIoThread->pMulti, &msgs_left)) {
+		if (p_msg->msg != CURLMSG_DONE)
+			continue;
+		HttpClient_Worker* pWorker = nullptr;
+		curl_easy_getinfo(p_msg->easy_handle, CURLINFO_PRIVATE, (char**)&pWorker);
+		pWorker->result = p_msg->data.result;
+		{
+			HttpClient_CpuScope cpu_scope(pWorker);
+			curl_multi_remove_handle(pIoThread->pMulti, pWorker->pCurl);
+			HttpClient_Worker_FinishRequest(pWorker);
+		}
+		// The app thread will process the response on its next Update(), then set us to CLEANUP (or ACTIVE, with the next request):
+		pWorker->SetDone();
+	}
+}
+
+static void HttpClient_IoThread_InitMulti(HttpClient_IoThread* pIoThread) {
+	pIoThread->pMulti = curl_multi_init();
+	curl_multi_setopt(pIoThread->pMulti, CURLMOPT_SOCKETFUNCTION, HttpClient_IoThread_SocketCallback);
+	curl_multi_setopt(pIoThread->pMulti, CURLMOPT_SOCKETDATA, pIoThread);
+	curl_multi_setopt(pIoThread->pMulti, CURLMOPT_TIMERFUNCTION, HttpClient_IoThread_TimerCallback);
+	curl_multi_setopt(pIoThread->pMulti, CURLMOPT_TIMERDATA, pIoThread);
+	if (pIoThread->pipelining) {
+		// (curl copies the blacklists, in this memory environment)
+		curl_multi_setopt(pIoThread->pMulti, CURLMOPT_PIPELINING, pIoThread->pipelining);
+		curl_multi_setopt(pIoThread->pMulti, CURLMOPT_MAX_PIPELINE_LENGTH, pIoThread->maxPipelineLength);
+		curl_multi_setopt(pIoThread->pMulti, CURLMOPT_CONTENT_LENGTH_PENALTY_SIZE, pIoThread->contentLengthPenalty);
+		curl_multi_setopt(pIoThread->pMulti, CURLMOPT_CHUNK_LENGTH_PENALTY_SIZE, pIoThread->chunkLengthPenalty);
+		if (pIoThread->pSiteBlacklist)
+			curl_multi_setopt(pIoThread->pMulti, CURLMOPT_PIPELINING_SITE_BL, pIoThread->pSiteBlacklist);
+		if (pIoThread->pServerBlacklist)
+			curl_multi_setopt(pIoThread->pMulti, CURLMOPT_PIPELINING_SERVER_BL, pIoThread->pServerBlacklist);
+	}
+	if (pIoThread->maxHostConnections)
+		curl_multi_setopt(pIoThread->pMulti, CURLMOPT_MAX_HOST_CONNECTIONS, pIoThread->maxHostConnections);
+}
+
+// Let go of pMulti, which closes the connections it keeps open. Its sockets are forgotten first, so that none of
+// them is watched any more:
+static void HttpClient_IoThread_CleanupMulti(HttpClient_IoThread* pIoThread) {
+	for (auto it = pIoThread->sockets.begin(); it != pIoThread->sockets.end(); it++)
+		HttpClient_IoThread_Watch(pIoThread, it->fd, CURL_POLL_REMOVE);
+	pIoThread->sockets.clear();
+	curl_multi_cleanup(pIoThread->pMulti);
+	pIoThread->pMulti = nullptr;
+	pIoThread->timeoutMs = -1;
+}
+
+void HttpClient_IoThread_Begin(HttpClient_IoThread* pIoThread) {
+	HttpClient_IoThread_InitMulti(pIoThread);
+	pIoThread->inMulti.assign(pIoThread->numWorkers, false);
+	pIoThread->replaying.assign(pIoThread->numWorkers, false);
+	if (pIoThread->pLoop)
+		pIoThread->pLoop->WatchSocket(pIoThread->wakePipe[0], HttpEventLoop::EVENT_IN);
+}
+
+long HttpClient_IoThread_Prepare(HttpClient_IoThread* pIoThread) {
+	std::vector<bool>& in_multi = pIoThread->inMulti;
+	std::vector<bool>& replaying = pIoThread->replaying;
+	// Pick up any work that the app thread has handed to our workers:
+	for (uint i = 0; i < pIoThread->numWorkers; i++) {
+		HttpClient_Worker* pWorker = pIoThread->pWorkers[i];
+		if (pWorker->cleanupPending && (pWorker->status == HttpClient_Worker::CLEANUP || pWorker->status == HttpClient_Worker::ACTIVE)) {
+			// Do any cleanup that must be done in this memory environment, after the app thread has processed the response:
+			const bool next = (pWorker->status == HttpClient_Worker::ACTIVE); // It has given us the next request already
+			HttpClient_Worker_HandleCleanup(pWorker);
+			pWorker->Reset();
+			in_multi[i] = false;
+			if (!next) {
+				pWorker->status = HttpClient_Worker::READY;
+				continue;
+			}
+		}
+		if (pWorker->status == HttpClient_Worker::ACTIVE && !in_multi[i] && pWorker->cacheMode == HttpClient_Worker::CACHE_SERVE) {
+			// Fresh in the cache: there's nothing to transfer
+			{
+				HttpClient_CpuScope cpu_scope(pWorker);
+				HttpClient_Worker_ServeFromCache(pWorker);
+			}
+			in_multi[i] = true; // (Not really, but it mustn't be picked up again before its cleanup)
+			pWorker->SetDone();
+		} else if (pWorker->status == HttpClient_Worker::ACTIVE && !in_multi[i] && pWorker->transport == HttpClient_Worker::TRANSPORT_REPLAY) {
+			// A recorded response: passed on below, as it falls due
+			HttpClient_Worker_BeginReplay(pWorker);
+			in_multi[i] = true; // (Likewise)
+			replaying[i] = true;
+		} else if (pWorker->status == HttpClient_Worker::ACTIVE && !in_multi[i]) {
+			if (!pWorker->pCurl)
+				HttpClient_Worker_InitHandle(pWorker);
+			HttpClient_CpuScope cpu_scope(pWorker);
+			HttpClient_Worker_BeginRequest(pWorker);
+			curl_easy_setopt(pWorker->pCurl, CURLOPT_PRIVATE, (char*)pWorker);
+			curl_multi_add_handle(pIoThread->pMulti, pWorker->pCurl);
+			in_multi[i] = true;
+		} else if (pWorker->status == HttpClient_Worker::READY && !pWorker->pCurl) {
+			// Pre-warmed by the app thread: create the handle now so the first request doesn't have to
+			HttpClient_Worker_InitHandle(pWorker);
+		} else if (pWorker->status == HttpClient_Worker::RETIRE) {
+			// Idle for too long; the app thread wants the pool to shrink:
+			if (pWorker->pCurl) {
+				curl_easy_cleanup(pWorker->pCurl);
+				pWorker->pCurl = nullptr;
+			}
+			pWorker->FreeBuffers();
+			pWorker->status = HttpClient_Worker::RETIRED;
+		}
+	}
+
+	// Suspended (see HttpClient::Suspend()): once none of our workers has a transfer, close the connections that
+	// pMulti keeps open, by starting afresh with a new one:
+	if (pIoThread->closeConnections && std::find(in_multi.begin(), in_multi.end(), true) == in_multi.end()) {
+		HttpClient_IoThread_CleanupMulti(pIoThread);
+		HttpClient_IoThread_InitMulti(pIoThread);
+		pIoThread->closeConnections = false;
+		HTTP_LOG(pIoThread->log, INFO, "HttpClient: Closed the I/O thread's connections");
+	}
+
+	// Resume the transfers that were paused until the app consumed some of their data, if it has:
+	bool any_paused = false;
+	for (uint i = 0; i < pIoThread->numWorkers; i++) {
+		HttpClient_Worker* pWorker = pIoThread->pWorkers[i];
+		if (!pWorker->paused || !in_multi[i] || pWorker->status != HttpClient_Worker::ACTIVE)
+			continue;
+		if (HttpClient_Worker_ShouldPause(pWorker)) {
+			any_paused = true;
+		} else {
+			pWorker->paused = false;
+			curl_easy_pause(pWorker->pCurl, CURLPAUSE_CONT);
+		}
+	}
+
+	// Pass on what is due of the recorded responses being replayed, and wake up in time for the rest:
+	long replay_wait_ms = -1;
+	for (uint i = 0; i < pIoThread->numWorkers; i++) {
+		HttpClient_Worker* pWorker = pIoThread->pWorkers[i];
+		if (!replaying[i])
+			continue;
+		const long wait_ms = HttpClient_Worker_StepReplay(pWorker);
+		if (wait_ms < 0) {
+			replaying[i] = false;
+			pWorker->SetDone();
+		}
+		else if (replay_wait_ms < 0 || wait_ms < replay_wait_ms)
+			replay_wait_ms = wait_ms;
+	}
+
+	// Wake up in time for curl's timer, and for whichever of those comes first:
+	long timeout_ms = HttpClient_IoThread_GetPollTimeout(pIoThread);
+	if (any_paused && (timeout_ms < 0 || timeout_ms > HTTP_CLIENT_PAUSED_POLL_MS))
+		timeout_ms = HTTP_CLIENT_PAUSED_POLL_MS;
+	if (replay_wait_ms >= 0 && (timeout_ms < 0 || timeout_ms > replay_wait_ms))
+		timeout_ms = replay_wait_ms;
+	return timeout_ms;
+}
+
+bool HttpClient_IoThread_HandleSocket(HttpClient_IoThread* pIoThread, int fd, int curlMask) {
+	if (fd == pIoThread->wakePipe[0]) {
+		// Woken by the app thread: whatever it has for us is picked up by the next HttpClient_IoThread_Prepare()
+		char buffer[64];
+		while (read(pIoThread->wakePipe[0], buffer, sizeof(buffer)) > 0) {}
+		return true;
+	}
+	const std::vector<HttpClient_IoThread::Socket>& sockets = pIoThread->sockets;
+	for (size_t i = 0; i < sockets.size(); i++) {
+		if (sockets[i].fd == fd) {
+			curl_multi_socket_action(pIoThread->pMulti, fd, curlMask, &pIoThread->runningHandles);
+			return true;
+		}
+	}
+	return false; // (Or one that curl has let go of since the loop found it ready)
+}
+
+void HttpClient_IoThread_HandleTimeout(HttpClient_IoThread* pIoThread) {
+	if (HttpClient_IoThread_GetPollTimeout(pIoThread) == 0) {
+		pIoThread->timeoutMs = -1; // curl will set a new timer during the call if it needs one
+		curl_multi_socket_action(pIoThread->pMulti, CURL_SOCKET_TIMEOUT, 0, &pIoThread->runningHandles);
+	}
+	HttpClient_IoThread_CollectFinished(pIoThread);
+}
+
+void HttpClient_IoThread_End(HttpClient_IoThread* pIoThread) {
+	std::vector<bool>& in_multi = pIoThread->inMulti;
+	std::vector<bool>& replaying = pIoThread->replaying;
+	for (uint i = 0; i < pIoThread->numWorkers; i++) {
+		HttpClient_Worker* pWorker = pIoThread->pWorkers[i];
+		if (pWorker->cleanupPending) {
+			// A processed response (whether or not the next request has been handed over, which can now never start):
+			HttpClient_Worker_HandleCleanup(pWorker);
+			pWorker->Reset();
+		} else {
+			if (replaying[i]) {
+				pWorker->result = CURLE_ABORTED_BY_CALLBACK;
+				HttpClient_Worker_StepReplay(pWorker);
+				pWorker->status = HttpClient_Worker::DONE; // (As below)
+			} else if (pWorker->status == HttpClient_Worker::ACTIVE && in_multi[i]) {
+				curl_multi_remove_handle(pIoThread->pMulti, pWorker->pCurl);
+				pWorker->result = CURLE_ABORTED_BY_CALLBACK;
+				HttpClient_Worker_FinishRequest(pWorker);
+				pWorker->status = HttpClient_Worker::DONE; // Not pushed onto the completion queue: the app thread is being destroyed
+			}
+			if (pWorker->pRequest && pWorker->status == HttpClient_Worker::DONE) {
+				HttpClient_Worker_HandleCleanup(pWorker);
+				pWorker->Reset();
+			}
+		}
+		if (pWorker->pCurl) {
+			curl_easy_cleanup(pWorker->pCurl);
+			pWorker->pCurl = nullptr;
+		}
+		pWorker->FreeBuffers();
+	}
+	HttpClient_IoThread_CleanupMulti(pIoThread);
+	if (pIoThread->pLoop)
+		pIoThread->pLoop->WatchSocket(pIoThread->wakePipe[0], 0);
+	// Free in this memory environment:
+	std::vector<HttpClient_IoThread::Socket>().swap(pIoThread->sockets);
+	std::vector<bool>().swap(pIoThread->inMulti);
+	std::vector<bool>().swap(pIoThread->replaying);
+}
+
+extern "C" void* HttpClient_IoThreadMain(void *_pIoThread) {
+	HttpClient_IoThread* pIoThread = reinterpret_cast<HttpClient_IoThread*>(_pIoThread);
+	HttpClient_ApplyThreadOptions(pIoThread->threadOptions, pIoThread->log);
+
+	HttpClient_IoThread_Begin(pIoThread);
+	std::vector<pollfd> poll_fds;
+
+	while (!pIoThread->quit) {
+		const long timeout_ms = HttpClient_IoThread_Prepare(pIoThread);
+
+		// Wait until curl's sockets are ready, its timer expires or the app thread wakes us:
+		poll_fds.resize(pIoThread->sockets.size() + 1);
+		poll_fds[0].fd = pIoThread->wakePipe[0];
+		poll_fds[0].events = POLLIN;
+		poll_fds[0].revents = 0;
+		for (size_t i = 0; i < pIoThread->sockets.size(); i++) {
+			const HttpClient_IoThread::Socket& socket = pIoThread->sockets[i];
+			poll_fds[i+1].fd = socket.fd;
+			poll_fds[i+1].events = ((socket.what & CURL_POLL_IN) ? POLLIN : 0) | ((socket.what & CURL_POLL_OUT) ? POLLOUT : 0);
+			poll_fds[i+1].revents = 0;
+		}
+		// (If there is nothing to wait for but sockets and the wake pipe, we can sleep until one of them becomes ready)
+		const int num_ready = poll(&poll_fds[0], poll_fds.size(), (int)timeout_ms);
+		s3eDeviceYield(); // We must call s3eDeviceYield from time to time, or other threads might be blocked waiting for this thread to yield.
+		if (num_ready < 0 && errno != EINTR)
+			HTTP_LOG(pIoThread->log, ERROR, "HttpClient: poll() failed on I/O thread (errno %d)", errno);
+
+		for (size_t i = 0; num_ready > 0 && i < poll_fds.size(); i++) {
+			if (!poll_fds[i].revents)
+				continue;
+			const int mask = ((poll_fds[i].revents & POLLIN) ? CURL_CSELECT_IN : 0)
+			               | ((poll_fds[i].revents & POLLOUT) ? CURL_CSELECT_OUT : 0)
+			               | ((poll_fds[i].revents & (POLLERR | POLLHUP)) ? CURL_CSELECT_ERR : 0);
+			HttpClient_IoThread_HandleSocket(pIoThread, poll_fds[i].fd, mask);
+		}
+		HttpClient_IoThread_HandleTimeout(pIoThread);
+	}
+
+	// We are quitting. Abort anything still in progress, and clean up in this memory environment:
+	HttpClient_IoThread_End(pIoThread);
+	return 0;
+}
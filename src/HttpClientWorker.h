@@ -0,0 +1,561 @@
+// HttpClientWorker:
+// Internal data shared between HttpClient and the threads that drive its
+// transfers. Not intended to be included by application code.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+#include <curl/curl.h>
+
+#include "HttpCache.h"
+#include "HttpEventLoop.h"
+#include "HttpHostTable.h"
+#include "HttpLog.h"
+#include "HttpProbes.h"
+#include "HttpRecording.h"
+#include "HttpRequest.h"
+#include "HttpThreadOptions.h"
+#include "HttpTracer.h"
+#include "HttpWorkerArena.h"
+#include "util/atomic.h"
+
+// Which of HttpClient's engines are compiled in: HTTP_ENGINES (e.g. in the defines in HttpUtils.mkb) is
+// HTTP_ENGINES_THREADS or HTTP_ENGINES_MULTI for just the one, which makes the worker's and the client's tests for
+// which engine drives it constants that fold away, or both (the default). A client asked for an engine that isn't
+// compiled in gets the other.
+#define HTTP_ENGINES_THREADS 1
+#define HTTP_ENGINES_MULTI   2
+#ifndef HTTP_ENGINES
+#define HTTP_ENGINES (HTTP_ENGINES_THREADS | HTTP_ENGINES_MULTI)
+#endif
+
+struct HttpClient_Worker;
+class HttpClient;
+
+// Data that different threads write is kept this far apart, so that they don't share a cache line (64 bytes on
+// the ARM and x86 CPUs we run on; some older ARMs have 32):
+#define HTTP_CACHE_LINE_SIZE 64
+
+// Add a number of milliseconds to an absolute time for pthread_cond_timedwait() etc.,
+// keeping tv_nsec within [0, 1e9) as required:
+inline void HttpClient_AddMs(timespec& ts, long ms) {
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+}
+
+// Milliseconds on a monotonic clock, for the worker threads' own timekeeping:
+inline uint64 HttpClient_NowMs() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Microseconds of CPU time that the calling thread has used, for HttpRequest::Timings::workerCpuMs and appCpuMs; always 0
+// in a build with HTTP_PROBES=0, or where there is no CLOCK_THREAD_CPUTIME_ID:
+inline uint64 HttpClient_ThreadCpuUs() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	timespec now;
+	if (HTTP_PROBES && clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0)
+		return (uint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+	return 0;
+}
+
+// Completion queue: workers push themselves onto this lock-free multi-producer/single-consumer
+// queue as soon as they finish a request, and HttpClient::Update() pops them off, so the app
+// thread only has to look at workers that actually have something for it.
+// This is a bounded queue (after Dmitry Vyukov's design); the app thread allocates it with room
+// for every worker, and since each worker has at most one unprocessed completion at a time,
+// Push() can never fail. Only POD data is shared, so the memory environment rules are respected.
+struct HttpClient_CompletionQueue {
+	struct Cell { volatile size_t sequence; HttpClient_Worker* pWorker; };
+	Cell* cells;
+	size_t mask;
+	volatile size_t enqueuePos;
+	size_t dequeuePos; // Only touched by the app thread
+	// Optional: called on the worker thread after each push, e.g. to wake a sleeping app thread:
+	void (*pfnSignal)(void* userData);
+	void* pSignalUserData;
+
+	HttpClient_CompletionQueue(size_t minCapacity) : enqueuePos(0), dequeuePos(0), pfnSignal(nullptr), pSignalUserData(nullptr) {
+		size_t capacity = 2;
+		while (capacity < minCapacity)
+			capacity *= 2;
+		cells = new Cell[capacity];
+		mask = capacity - 1;
+		for (size_t i = 0; i < capacity; i++) {
+			cells[i].sequence = i;
+			cells[i].pWorker = nullptr;
+		}
+	}
+	~HttpClient_CompletionQueue() { delete[] cells; }
+
+	// Called by any worker/I/O thread:
+	void Push(HttpClient_Worker* pWorker) {
+		size_t pos = atomic::LoadRelaxed(enqueuePos);
+		Cell* p_cell;
+		for (;;) {
+			p_cell = &cells[pos & mask];
+			const size_t seq = atomic::LoadAcquire(p_cell->sequence);
+			const long diff = (long)seq - (long)pos;
+			if (diff == 0) {
+				if (atomic::CompareAndSwap(enqueuePos, pos, pos + 1))
+					break;
+			} else {
+				IwAssert(HTTP_CLIENT, diff > 0); // The queue is full; this should be impossible
+			}
+			pos = atomic::LoadRelaxed(enqueuePos);
+		}
+		p_cell->pWorker = pWorker;
+		atomic::StoreRelease(p_cell->sequence, pos + 1);
+		if (pfnSignal)
+			pfnSignal(pSignalUserData);
+	}
+	// Called by the app thread only. Returns nullptr if the queue is empty.
+	HttpClient_Worker* Pop() {
+		Cell* p_cell = &cells[dequeuePos & mask];
+		const size_t seq = atomic::LoadAcquire(p_cell->sequence);
+		if ((long)seq - (long)(dequeuePos + 1) < 0)
+			return nullptr;
+		HttpClient_Worker* p_worker = p_cell->pWorker;
+		atomic::StoreRelease(p_cell->sequence, dequeuePos + mask + 1);
+		dequeuePos++;
+		return p_worker;
+	}
+	// Called by the app thread only: whether Pop() would return nullptr.
+	bool IsEmpty() const { return (long)atomic::LoadAcquire(cells[dequeuePos & mask].sequence) - (long)(dequeuePos + 1) < 0; }
+};
+
+// Flow control (see HttpClient::SetMaxBufferedBytes()): how much of their responses the requests on one client's
+// workers hold that the app hasn't consumed yet. Each worker adds the changes in its own request's figure as it
+// goes, and takes it off again when it cleans up. Only POD data is shared.
+struct HttpClient_FlowControl {
+	volatile size_t bufferedBytes;
+	volatile size_t maxBufferedBytes; // Set by the app thread at any time; 0 for no limit
+	HttpClient_FlowControl() : bufferedBytes(0), maxBufferedBytes(0) {}
+};
+
+// Data for the Worker threads - shared by the worker thread and the HttpClient master thread:
+//
+// Note: it's really important to understand that the worker threads and the app threads are
+// in totally different memory environments. They can each read each other's memory no problem
+// but they must never modify any non-POD data belonging to the other thread, or bad things happen.
+// This is because the app thread uses the s3e malloc/realloc/free pool, while the worker threads
+// use the system's default memory methods.
+// BWM: I tried changing the threads to use the same s3e memory methods, but it caused issues
+// on debug builds due to the high number of memory operations the worker threads make.
+//
+// The same rules apply to the I/O threads of the multi engine (see HttpClientMulti.cpp), which
+// drive several of these workers at once instead of having one thread per worker.
+//
+// Data shared by all worker handles of one HttpClient via the curl share interface
+// (DNS cache, TLS session IDs, cookies if HttpClient::EnableCookies() was called, and, where
+// the curl version supports it, connections).
+// The CURLSH itself and everything curl stores in it live in the worker memory environment,
+// so it is created and destroyed via HttpClient_RunInWorkerEnvironment().
+struct HttpClient_Share {
+	CURLSH* pShare;
+	pthread_mutex_t locks[CURL_LOCK_DATA_LAST]; // One lock per type of shared data
+	CURL* pCookies; // If cookies are shared: a handle of the app thread's, through which it loads, saves and clears them
+	HttpClient_Share() : pShare(nullptr), pCookies(nullptr) {}
+};
+
+// All communication between worker threads and the app thread happens using the following struct:
+struct HttpClient_Worker {
+	const char* userAgent;
+	HttpClient_Share* pShare; // Shared DNS/TLS session cache, set by the app thread before the worker starts
+	HttpClient_CompletionQueue* pCompletions; // The worker pushes itself onto this queue each time it becomes DONE
+	HttpClient_FlowControl* pFlow; // The client's buffered bytes, which the worker keeps up to date
+
+	CURL *pCurl; // Re-usable worker, created in app thread, modified by worker thread.
+	pthread_t thread_id;
+	HttpThreadOptions threadOptions; // Thread-per-worker engine: set by the app thread before it spawns the thread
+	Ptr<HttpRequest> pRequest; // Set by app thread; must never by modified when status is ACTIVE
+	// Thread-per-worker engine: the worker sleeps on wakeCond only while it has nothing to do, and says so in sleeping,
+	// so that the app thread only locks wakeMutex and signals when the worker is actually asleep (see WakeToStatus()):
+	pthread_cond_t wakeCond;
+	pthread_mutex_t wakeMutex; // Held by the worker from announcing that it is going to sleep until it waits, and by the app thread to wake it
+	struct HttpClient_IoThread* pIoThread; // Multi engine only: the I/O thread that drives this worker. nullptr for the thread-per-worker engine.
+	bool IsMulti() const { return HTTP_ENGINES == HTTP_ENGINES_MULTI || (HTTP_ENGINES != HTTP_ENGINES_THREADS && pIoThread); }
+	bool preempted; // Only used by the app thread: true once it has set abortRequest to make room for a more important request
+	bool requeue; // Only used by the app thread: the request must be queued again once this worker has cleaned up
+	uint64 requeueNotBeforeMs; // Only used by the app thread: if requeue is set for a retry, when to send it (see HttpClient::SetRetryPolicy())
+	uint64 idleSinceMs; // Only used by the app thread: when this worker last became free, or 0 if it is busy
+	uint64 startedMs; // Only used by the app thread: when this worker was given its current request
+	size_t memoryCharge; // Only used by the app thread: what the current transfer is charged against the client's HttpMemoryBudget
+	HttpClient* pOwner; // Only used by the app thread: if pRequest was borrowed from another client (see HttpWorkPool), that client
+	// Hedging (see HttpClient::SetHedging()): while two workers are sending the same request, only the one that
+	// claims it first (on receiving its response headers, or finishing without any) may touch it. The other
+	// aborts its transfer, and leaves the request alone.
+	enum HedgeRole { HEDGE_NONE, HEDGE_FIRST, HEDGE_SECOND };
+	HedgeRole hedgeRole; // Set by the app thread along with pRequest
+	enum StatusCode {// Worker Status:
+		UNUSED, // initialized to UNUSED in app thread. This means the worker thread has not been created yet.
+		ACTIVE, // The worker thread is processing a request (having cleaned up after the last one first, if it was woken straight from DONE)
+		DONE,   // The worker thread has finished processing a request. It has gone to sleep and is waiting for the app thread to finish processing the result.
+		CLEANUP,// The app thread has finished processing the result, and is now waking the worker thread up so it can cleanup and get ready for a new request.
+		READY,  // The worker thread has completed and cleaned up its first request and is ready to process a new request.
+		RETIRE, // The app thread wants this idle worker to free its thread and curl handle.
+		RETIRED // The worker has freed its curl handle (and its thread is exiting). The app thread will set it back to UNUSED.
+	};
+	// The control block: the worker's status, and the flags that the app thread and the worker signal each other with.
+	// Both sides poll these (the app thread in every Update(), the worker in every curl callback), so they have a cache
+	// line to themselves, which nothing else is written to, by this worker or by its neighbours in HttpClient's array.
+	// Every read is an acquire and every write a release (see atomic::Published), so whatever a thread set up before
+	// changing one of them (e.g. the request, before ACTIVE, or the response, before DONE) is visible to the other once
+	// it sees the change, even on weakly ordered CPUs such as ARM.
+	char controlPadBefore[HTTP_CACHE_LINE_SIZE];
+	atomic::Published<StatusCode> status;
+	atomic::Published<bool> cancelAndQuit; // If set true by app thread, cancel and quit ASAP, interrupting downloads if needed.
+	atomic::Published<bool> abortRequest; // If set true by app thread, abort the current transfer only (e.g. it has been preempted). Cleared by Reset().
+	atomic::Published<bool> wasAborted; // Set true by the worker if it actually aborted the transfer because of abortRequest. Cleared by Reset().
+	atomic::Published<bool> responseHeadersDone; // Set true by the worker once we've received the response headers
+	volatile int sleeping; // Non-zero while the worker is (about to be) waiting on wakeCond. Accessed with full barriers only.
+	atomic::Published<bool> cleanupPending; // Set true by the app thread along with finished (see PrepareCleanup()), and false by the worker once it has cleaned up
+	char controlPadAfter[HTTP_CACHE_LINE_SIZE];
+	// The headers of the response, parsed in place by the worker. Cleared (keeping its memory) for each request, and
+	// only freed by the worker/I/O thread when it lets go of its curl handle (see FreeBuffers()).
+	HttpHeaders responseHeaders;
+	// The request headers in curl's format, built by the worker in Worker_BeginRequest() and cleared in Worker_FinishRequest().
+	// The nodes point at the lines of the request's headers (which only the app thread modifies, and not while we're ACTIVE)
+	// and of transferHeaders, so once these have grown to fit, passing headers to curl doesn't allocate at all:
+	std::vector<curl_slist> requestHeaderList;
+	HttpHeaders transferHeaders; // Added by the worker: If-None-Match/If-Modified-Since for CACHE_REVALIDATE, and the upload's (see HttpClient_Worker_AddUploadHeaders())
+	// Scratch memory for the request's response body and JSON tape. Worker memory environment: reset by the worker
+	// in HttpClient_Worker_HandleCleanup(), and released with the buffers above (see FreeBuffers()).
+	HttpWorkerArena arena;
+	CURLcode result; // CURL's result code. Should be CURLE_OK
+	long responseStatusCode; // Http response status code, e.g. 200
+	HttpRequest::Timings timings; // Filled in by the worker once the transfer is over (apart from queueMs, which the app thread measures)
+	// Tracing (see HttpTracer): pTraceRing is set by the app thread if there is a tracer, and only this worker writes to it.
+	// traceId is set by the app thread along with pRequest.
+	HttpTracer::Ring* pTraceRing;
+	uint traceId;
+	bool tracedFirstByte; // Only used by the worker
+	void Trace(HttpTracer::Event event) { if (HTTP_PROBES && pTraceRing) HttpTracer::Trace(pTraceRing, event, traceId); }
+	HttpLogRing log; // Written by the worker (see HTTP_LOG()), drained by the app thread in Update()
+#ifdef HTTP_ALLOC_STATS
+	// Allocations made by this worker for the current request: reset by the app thread in StartRequest(),
+	// counted by the worker, and added to the request's own in HandleWorkerDone().
+	HttpAllocStats::Counters allocStats;
+#endif
+	bool acceptEncoding; // Set by the app thread: ask for a compressed response (which curl decompresses for us)
+	// Set by the app thread with each request: the client's settings with the request's overrides (see HttpClient::SetConfig()),
+	HttpClientConfig config;
+	long dnsCacheTtl;
+	// Only used by the app thread: whether config.addressFamily is the one remembered for the request's origin, or
+	// the worker is to find out which family its connection is made over (see HttpClientConfig::rememberAddressFamily):
+	enum AddressFamilyMemo { FAMILY_FIXED, FAMILY_LEARN, FAMILY_REMEMBERED } addressFamilyMemo;
+	// The client's host addresses (see HttpClient::SetHostAddresses()), set by the app thread with each request, which
+	// keeps the list alive while we have it. curl takes the entries into the shared DNS cache once per CURLOPT_RESOLVE,
+	// so the worker only sets it when the version differs from the one it last applied (0 when pCurl is created):
+	Ptr<HttpHostTable::List> pHostList;
+	uint hostListVersion;
+	uint appliedHostListVersion;
+	char primaryIp[48]; // Set by the worker: the address the transfer was made to, or "" (e.g. if it failed)
+	// Redirects (see HttpClientConfig::maxRedirects). transferUrl is set by the app thread: where to send the request
+	// instead of its URL, which a permanent redirect was remembered for (otherwise empty). The others are only used by
+	// the worker, until the app thread reads them once it's DONE: how many redirects curl followed, whether they were
+	// all permanent, and if so, the URL they led to. (Worker memory environment: freed by FreeBuffers().)
+	std::string transferUrl;
+	// Mirrors (see HttpClient::SetMirrors()), set by the app thread: the HttpMirrors origin that transferUrl (or, if it's
+	// empty, the request's URL) is at, or 0 if the URL isn't in a mirror set.
+	uint mirrorOriginId;
+	uint numRedirectHops;
+	bool permanentHopsOnly;
+	std::string permanentUrl;
+	int64 expectContinueMinSize; // Set by the app thread with each request: see HttpClient::SetExpectContinuePolicy() (-1 if it is off)
+	uint64 transferStartMs; // Only used by the worker: when it began the current transfer...
+	bool uploadStarted; // ...and whether curl has asked for any of the body yet (see HttpRequest::Timings::uploadWaitMs)
+	uint64 connectedMs; // Only used by the worker: when it last had to open a connection (for HttpClientConfig::maxConnectionAgeS), or 0
+	// What pCurl has been told, so that each transfer only sets the options that differ from the last one's,
+	// and undoes what the last one set that this one doesn't want (see HttpClient_Worker_BeginRequest()).
+	// Only used by the worker; forgotten (OPTION_UNSET) when pCurl is created.
+	enum HandleOption {
+		OPT_METHOD, // An HttpRequest::Method
+		OPT_ACCEPT_ENCODING, OPT_DNS_CACHE_TIMEOUT,
+		OPT_CONNECT_TIMEOUT, OPT_LOW_SPEED_LIMIT, OPT_LOW_SPEED_TIME, OPT_TCP_NODELAY, OPT_TCP_KEEPALIVE, OPT_TCP_KEEPIDLE, OPT_TCP_KEEPINTVL, OPT_FRESH_CONNECT, OPT_IP_RESOLVE, OPT_HAPPY_EYEBALLS, OPT_FOLLOW_LOCATION, OPT_MAX_REDIRS, OPT_BUFFER_SIZE,
+		NUM_HANDLE_OPTIONS
+	};
+	static const long OPTION_UNSET = LONG_MIN;
+	long handleOptions[NUM_HANDLE_OPTIONS];
+	const curl_slist* pHandleHeaders;
+	void ForgetHandleOptions() { for (uint i = 0; i < NUM_HANDLE_OPTIONS; i++) handleOptions[i] = OPTION_UNSET; pHandleHeaders = nullptr; appliedRecvSpeed = appliedSendSpeed = 0; appliedHostListVersion = 0; }
+	// Progress reporting (see HttpClient::SetProgressInterval()). Set by the app thread with each request:
+	uint progressIntervalMs;
+	uint64 progressMinBytes;
+	// Only used by the worker: curl's latest figures, those last published to the request(s), and when:
+	HttpRequest::Progress progress, publishedProgress;
+	uint64 publishedProgressMs;
+	enum { YIELD_INTERVAL_MS = 10 };
+	uint64 yieldedMs; // When a worker thread last yielded from its progress callback (at most every YIELD_INTERVAL_MS)
+	// Speed limits in bytes per second, 0 for none (see HttpClient::SetBandwidthLimit()). Set by the app thread at any
+	// time; the worker applies them to pCurl when it starts a transfer and from its progress callback:
+	volatile uint64 maxRecvSpeed, maxSendSpeed;
+	uint64 appliedRecvSpeed, appliedSendSpeed; // Only used by the worker: what pCurl has been told
+	// Only used by the worker: what the request holds unconsumed, as last added to pFlow, and whether the worker has
+	// paused the transfer until the app has consumed some of it (see HttpClient_Worker_ShouldPause()):
+	size_t reportedBuffered;
+	bool paused;
+	// HttpClientConfig::coalesceBytes: what curl has delivered that hasn't been handed to the request yet, and since when.
+	// Only used by the worker (worker memory environment: kept from one transfer that coalesces to the next, and freed
+	// by FreeBuffers()). The progress callback hands it over once it has waited COALESCE_WAIT_MS:
+	enum { COALESCE_WAIT_MS = 100 };
+	std::vector<unsigned char> coalesced;
+	uint64 coalescedSinceMs;
+	bool coalesceFailed; // Handing it over from the progress callback failed, so the transfer was aborted
+	double rateSampleRecv, rateSampleSend; // Only used by the app thread: the request's bytes when its rate was last sampled
+	double recvRate, sendRate; // Only used by the app thread: bytes per second, as of that sample
+	// Response cache (see HttpCache). Set up by the app thread before the worker becomes ACTIVE, and only read by the worker:
+	enum CacheMode {
+		CACHE_NONE,       // Not cached: a normal transfer
+		CACHE_STORE,      // A normal transfer, and a 200 response's body is also written to cacheStoreFile
+		CACHE_REVALIDATE, // As CACHE_STORE, but with a conditional request; a 304 response gets the body from cacheBodyFile
+		CACHE_SERVE       // Fresh: the response comes straight from cacheBodyFile and cacheHeaders, without a transfer
+	} cacheMode;
+	std::string cacheBodyFile;
+	uint64 cacheBodyOffset; // Where in cacheBodyFile the body is (see HttpCache::Entry::packId)
+	int64 cacheBodySize; // Or -1 if it runs to the end of the file
+	std::string cacheStoreFile;
+	std::string cacheETag, cacheLastModified; // Validators for CACHE_REVALIDATE
+	HttpHeaders cacheHeaders; // The cached response headers
+	HttpCache::Entry* pCacheEntry; // Only used by the app thread: the entry that is pinned for this request, if any
+	uint64 cacheFileId; // Only used by the app thread: the ID that cacheStoreFile was made for
+	// Cache data managed by the worker thread:
+	s3eFile* pCacheFile; // The file that the body is being stored in
+	bool cacheServed; // The body was served from cacheBodyFile
+	bool cacheStored; // The body was stored, in full, in cacheStoreFile
+	bool cacheStoreFailed;
+	// Memory cache (see HttpMemoryCache): if memoryCacheLimit is non-zero (set by the app thread), the worker
+	// keeps a copy of the body in memoryBody for the app thread to copy, as long as it is no bigger than that.
+	size_t memoryCacheLimit;
+	std::string memoryCacheKey; // Only used by the app thread
+	std::string memoryBody; // Worker memory environment: only the worker may modify it
+	bool memoryBodyTooBig;
+	// Record/replay (see HttpClient::SetRecording()). Set by the app thread with each request:
+	enum Transport {
+		TRANSPORT_CURL,  // A real transfer
+		TRANSPORT_REPLAY // The response comes from pReplay (or the request fails, if it is nullptr), without a transfer
+	} transport;
+	const HttpRecording::Exchange* pReplay; // Belongs to the app thread; the worker only reads it
+	double replaySpeed; // See HttpRecording::SetSpeed()
+	bool recordTransfer; // Keep what arrives in recordBody and recordChunks, for the app thread to add to the recording
+	uint32 recordHeadersMs; // Only written by the worker: when the headers were in
+	uint32 replayStep; // Only used by the worker: how far the replay has got (see HttpClient_Worker_StepReplay())
+	size_t replayBytes; // Only used by the worker: how much of the body it has passed on
+	std::string recordBody; // Worker memory environment: only the worker may modify it
+	std::vector<HttpRecording::Chunk> recordChunks; // Likewise
+	// Coalescing (see HttpRequest::SetCoalesce()): identical requests that receive everything pRequest does.
+	// The app thread may add followers until the worker closes the list, which it does as soon as the response
+	// headers arrive, so that every follower sees the whole response. followerState holds the number of
+	// followers, plus FOLLOWERS_CLOSED once the list is closed. The app thread holds the references to them
+	// (in pRequest->m_followers); the worker only uses these pointers, never touching their reference counts.
+	enum { MAX_FOLLOWERS = 32, FOLLOWERS_CLOSED = 0x80000000u };
+	HttpRequest* followers[MAX_FOLLOWERS];
+	volatile uint followerState;
+	bool followerFailed[MAX_FOLLOWERS]; // Set by the worker if a follower didn't accept the data
+	// For the app thread: returns false (and pFollower is not added) if it's too late for pFollower to follow
+	bool AddFollower(HttpRequest* pFollower) {
+		for (;;) {
+			const uint state = atomic::LoadAcquire(followerState);
+			if ((state & FOLLOWERS_CLOSED) || state >= MAX_FOLLOWERS)
+				return false;
+			followers[state] = pFollower; // The worker doesn't look at this slot until we've published it
+			if (atomic::CompareAndSwap(followerState, state, state + 1))
+				return true;
+		}
+	}
+	// For the worker thread: stop any more followers being added, and return how many there are
+	uint CloseFollowers() {
+		for (;;) {
+			const uint state = atomic::LoadAcquire(followerState);
+			if ((state & FOLLOWERS_CLOSED) || atomic::CompareAndSwap(followerState, state, state | FOLLOWERS_CLOSED))
+				return state & ~FOLLOWERS_CLOSED;
+		}
+	}
+	uint NumFollowers() const { return atomic::LoadAcquire(followerState) & ~FOLLOWERS_CLOSED; }
+	// The request that the worker is to clean up after (see HttpClient_Worker_HandleCleanup()), and its followers.
+	// Once the app thread has processed a response, it moves all that the cleanup needs in here (see PrepareCleanup()),
+	// so that the rest of the worker's data is free for its next request: the app thread can wake the worker straight
+	// to ACTIVE with that, and the worker cleans up after the last request before it starts it. Set by the app thread
+	// while the worker is DONE, and only read by the worker until it clears cleanupPending.
+	struct Finished {
+		HttpRequest* pRequest; // The app thread holds the references (see pCleanupRequest)
+		bool ownsRequest; // OwnsRequest(), as of when the request finished
+		uint numFollowers;
+		HttpRequest* followers[MAX_FOLLOWERS];
+		uint traceId;
+	} finished;
+	// Only used by the app thread: the references to finished.pRequest and its followers, which are kept
+	// until the worker has cleaned up after them:
+	Ptr<HttpRequest> pCleanupRequest;
+	std::vector< Ptr<HttpRequest> > cleanupFollowers;
+	bool cleanupDeferred; // Only used by the app thread: DONE, and processed, but the worker hasn't been woken yet; see HttpClient::Update()
+	// Once the response has been processed. Normally called by the app thread, while the worker is DONE; the worker
+	// calls it itself if it has to clean up without that (e.g. because it's quitting):
+	void PrepareCleanup() {
+		finished.pRequest = pRequest.ptr();
+		finished.ownsRequest = pRequest && OwnsRequest();
+		finished.numFollowers = NumFollowers();
+		for (uint i = 0; i < finished.numFollowers; i++)
+			finished.followers[i] = followers[i];
+		finished.traceId = traceId;
+		// The flags that both threads use are reset here rather than in Reset(), so that the worker can't reset
+		// them after the app thread has started using them for the next request:
+		abortRequest = false;
+		wasAborted = false;
+		responseHeadersDone = false;
+		followerState = 0;
+		cleanupPending = true;
+	}
+	// The worker thread needs to reset this worker data instance before starting each request:
+	void Reset() { responseHeaders.Clear(); responseStatusCode = 0; timings = HttpRequest::Timings(); tracedFirstByte = false; pCacheFile = nullptr; cacheServed = cacheStored = cacheStoreFailed = false; std::string().swap(memoryBody); memoryBodyTooBig = false; std::string().swap(recordBody); std::vector<HttpRecording::Chunk>().swap(recordChunks); recordHeadersMs = 0; paused = false; for (uint i = 0; i < MAX_FOLLOWERS; i++) followerFailed[i] = false; } // (See also PrepareCleanup())
+	void FreeBuffers() { responseHeaders.Free(); transferHeaders.Free(); std::vector<curl_slist>().swap(requestHeaderList); arena.Release(); std::string().swap(permanentUrl); std::vector<unsigned char>().swap(coalesced); } // For the worker/I/O thread, along with curl_easy_cleanup()
+	// Constructor and methods for use by the app thread:
+	HttpClient_Worker() : pShare(nullptr), pCompletions(nullptr), pFlow(nullptr), pCurl(nullptr), pRequest(nullptr), pIoThread(nullptr), preempted(false), requeue(false), requeueNotBeforeMs(0), idleSinceMs(0), startedMs(0), memoryCharge(0), pOwner(nullptr), hedgeRole(HEDGE_NONE), status(UNUSED), cancelAndQuit(false), abortRequest(false), wasAborted(false), responseHeadersDone(false), sleeping(0), cleanupPending(false), result(CURLE_OK), responseStatusCode(0), pTraceRing(nullptr), traceId(0), tracedFirstByte(false), acceptEncoding(false), dnsCacheTtl(60), addressFamilyMemo(FAMILY_FIXED), hostListVersion(0), appliedHostListVersion(0), mirrorOriginId(0), numRedirectHops(0), permanentHopsOnly(true), expectContinueMinSize(-1), transferStartMs(0), uploadStarted(false), connectedMs(0), pHandleHeaders(nullptr), progressIntervalMs(0), progressMinBytes(0), publishedProgressMs(0), yieldedMs(0), maxRecvSpeed(0), maxSendSpeed(0), appliedRecvSpeed(0), appliedSendSpeed(0), reportedBuffered(0), paused(false), coalescedSinceMs(0), coalesceFailed(false), rateSampleRecv(0), rateSampleSend(0), recvRate(0), sendRate(0), cacheMode(CACHE_NONE), cacheBodyOffset(0), cacheBodySize(-1), pCacheEntry(nullptr), cacheFileId(0), pCacheFile(nullptr), cacheServed(false), cacheStored(false), cacheStoreFailed(false), memoryCacheLimit(0), memoryBodyTooBig(false), transport(TRANSPORT_CURL), pReplay(nullptr), replaySpeed(1), recordTransfer(false), recordHeadersMs(0), replayStep(0), replayBytes(0), followerState(0), cleanupDeferred(false) { for (uint i = 0; i < MAX_FOLLOWERS; i++) { followers[i] = nullptr; followerFailed[i] = false; } finished.pRequest = nullptr; finished.numFollowers = 0; primaryIp[0] = '\0'; ForgetHandleOptions(); }
+	inline void CancelAndQuit();
+	inline void WakeToStatus(StatusCode sc);
+	inline void SleepWhileStatus(StatusCode sc); // For the worker thread: wait until the app thread changes status from sc, or asks it to quit
+	// For use by the curl callbacks: returns true if the current transfer should be aborted.
+	bool ShouldAbort() { if (cancelAndQuit || LostRequest()) return true; if (abortRequest || pRequest->Worker_IsAborted()) { wasAborted = true; return true; } return false; }
+	// Hedging: returns false if the other worker has claimed the request. Either thread may check ownership:
+	bool ClaimRequest() { return hedgeRole == HEDGE_NONE || atomic::CompareAndSwap(pRequest->m_hedgeOwner, 0, (int)hedgeRole) || atomic::LoadAcquire(pRequest->m_hedgeOwner) == (int)hedgeRole; }
+	bool OwnsRequest() const { const int owner = atomic::LoadAcquire(pRequest->m_hedgeOwner); return owner == (int)hedgeRole || (owner == 0 && hedgeRole != HEDGE_SECOND); }
+	bool LostRequest() const { const int owner = atomic::LoadAcquire(pRequest->m_hedgeOwner); return hedgeRole != HEDGE_NONE && owner != 0 && owner != (int)hedgeRole; }
+	// For use by the worker/I/O thread once a request has finished:
+	void SetDone() { Trace(HttpTracer::EVENT_DONE); status = DONE; pCompletions->Push(this); }
+};
+
+// Multi engine: one I/O thread drives several workers using a curl_multi handle.
+// The app thread hands work to the workers exactly as it does for the thread-per-worker
+// engine (by setting their status to ACTIVE or CLEANUP); the I/O thread notices the change
+// after being woken via its wake pipe.
+struct HttpClient_IoThread {
+	pthread_t thread_id;
+	HttpThreadOptions threadOptions; // Set by the app thread before it spawns the thread
+	HttpClient_Worker** pWorkers; // The workers driven by this thread. Array allocated and freed by the app thread.
+	uint numWorkers;
+	const char* userAgent;
+	int wakePipe[2]; // Writing a byte to wakePipe[1] interrupts the I/O thread's poll()
+	atomic::Published<bool> started; // Set by the app thread once the thread has been spawned
+	atomic::Published<bool> quit; // If set true by app thread, cancel all transfers and quit ASAP.
+	atomic::Published<bool> closeConnections; // Set by the app thread (see HttpClient::Suspend()), and cleared by the I/O thread once it has
+	// Pipelining settings for pMulti (see HttpClient::SetPipelining()), set by the app thread before the thread starts.
+	// The blacklists are NULL-terminated arrays of strings that belong to the app thread, or nullptr.
+	long pipelining, maxPipelineLength, maxHostConnections;
+	curl_off_t contentLengthPenalty, chunkLengthPenalty;
+	const char* const* pSiteBlacklist;
+	const char* const* pServerBlacklist;
+	// Set by the app thread before it "starts" the thread, if it has none: the app's own event loop drives us instead
+	// (see HttpClient::SetExternalEventLoop()), calling the HttpClient_IoThread_ functions below from its thread,
+	// which counts as the I/O thread for everything that follows:
+	HttpEventLoop* pLoop;
+	// The following are only ever touched by the I/O thread itself:
+	CURLM* pMulti;
+	long timeoutMs; // As most recently requested by curl's timer callback, or -1 for none
+	struct timespec timeoutStart;
+	struct Socket { curl_socket_t fd; int what; };
+	std::vector<Socket> sockets; // Sockets that curl wants us to watch (system memory; freed by the I/O thread before it exits)
+	// For each worker, true while its easy handle is attached to pMulti; and true while it is replaying a recorded
+	// response that we have begun (not just one that the app thread has handed it since the last one finished,
+	// before we have picked it up):
+	std::vector<bool> inMulti;
+	std::vector<bool> replaying;
+	int runningHandles;
+	HttpLogRing log; // For the I/O thread's own messages (its workers' go in theirs)
+
+	HttpClient_IoThread() : pWorkers(nullptr), numWorkers(0), userAgent(nullptr), started(false), quit(false), closeConnections(false), pipelining(0), maxPipelineLength(0), maxHostConnections(0),
+		contentLengthPenalty(0), chunkLengthPenalty(0), pSiteBlacklist(nullptr), pServerBlacklist(nullptr), pLoop(nullptr), pMulti(nullptr), timeoutMs(-1), runningHandles(0) { wakePipe[0] = wakePipe[1] = -1; }
+	void Wake();
+	void Quit() { quit = true; Wake(); }
+};
+
+inline void HttpClient_Worker::CancelAndQuit() {
+	if (IsMulti()) {
+		cancelAndQuit = true; // The I/O thread will abort this worker's transfer from within the curl callbacks
+		return;
+	}
+	cancelAndQuit = true;
+	atomic::Fence();
+	if (atomic::LoadRelaxed(sleeping)) { pthread_mutex_lock(&wakeMutex); pthread_cond_signal(&wakeCond); pthread_mutex_unlock(&wakeMutex); }
+}
+
+// The handoff itself is lock-free: the new status is published first, and the worker is only signalled if it
+// has said that it is going to sleep. Each side makes its write (status here, sleeping in SleepWhileStatus())
+// and then reads the other's with a full barrier in between, so at least one of them sees the other's: either
+// the worker sees the new status and doesn't sleep, or we see that it is sleeping and wake it. Since the worker
+// holds wakeMutex from setting sleeping until it waits, the signal can't arrive before it is waiting.
+inline void HttpClient_Worker::WakeToStatus(StatusCode sc) {
+	status = sc;
+	if (IsMulti()) {
+		// Multi engine: there is no per-worker thread to signal
+		pIoThread->Wake();
+		return;
+	}
+	atomic::Fence();
+	if (atomic::LoadRelaxed(sleeping)) { pthread_mutex_lock(&wakeMutex); pthread_cond_signal(&wakeCond); pthread_mutex_unlock(&wakeMutex); }
+}
+
+inline void HttpClient_Worker::SleepWhileStatus(StatusCode sc) {
+	if (status != sc || cancelAndQuit)
+		return; // (The usual case when the app thread is quick, e.g. woken by the completion signal)
+	pthread_mutex_lock(&wakeMutex);
+	atomic::Exchange(sleeping, 1); // (A full barrier, before we look at status again)
+	while (status == sc && !cancelAndQuit)
+		pthread_cond_wait(&wakeCond, &wakeMutex);
+	atomic::StoreRelaxed(sleeping, 0); // (At worst the app thread signals once more than it needs to)
+	pthread_mutex_unlock(&wakeMutex);
+}
+
+// Multi engine: charge the CPU time that passes on the I/O thread while this is in scope to the worker's request (see
+// HttpRequest::Timings::workerCpuMs), as that thread shares its time between many transfers. A worker with a thread
+// of its own is charged for the whole of each transfer instead (see HttpClient_WorkerThread()), so this does nothing.
+struct HttpClient_CpuScope {
+	HttpClient_Worker* pWorker; // nullptr if nothing is charged
+	uint64 startUs;
+	HttpClient_CpuScope(HttpClient_Worker* pWorker) : pWorker(HTTP_PROBES && pWorker->IsMulti() ? pWorker : nullptr), startUs(this->pWorker ? HttpClient_ThreadCpuUs() : 0) {}
+	~HttpClient_CpuScope() { if (pWorker) pWorker->timings.workerCpuMs += (double)(HttpClient_ThreadCpuUs() - startUs) / 1000; }
+};
+
+// Run fn(arg) on a short-lived thread, so that any memory it allocates or frees belongs to the
+// worker memory environment rather than the app thread's s3e heap. Blocks until fn returns.
+void HttpClient_RunInWorkerEnvironment(void* (*fn)(void*), void* arg);
+
+// Spawn a worker or I/O thread with the stack size in options (see HttpThreadOptions). Returns pthread_create()'s result.
+int HttpClient_CreateThread(pthread_t& threadId, const HttpThreadOptions& options, void* (*fn)(void*), void* arg);
+// For the new thread, before anything else: apply the rest of its options, logging any that it can't.
+void HttpClient_ApplyThreadOptions(const HttpThreadOptions& options, HttpLogRing& log);
+
+// Shared by both engines; these must be called from the thread that owns pWorker->pCurl:
+void HttpClient_Worker_InitHandle(HttpClient_Worker* pWorker); // Create pCurl and apply the options that never change between requests, callbacks included
+void HttpClient_Worker_BeginRequest(HttpClient_Worker* pWorker); // Configure pCurl for pWorker->pRequest
+void HttpClient_Worker_FinishRequest(HttpClient_Worker* pWorker); // Collect results once a transfer has finished, and notify the request
+void HttpClient_Worker_ServeFromCache(HttpClient_Worker* pWorker); // Instead of all of the above, for CACHE_SERVE: hand the cached response to the request
+// Instead of a transfer, for TRANSPORT_REPLAY: hand the recorded response to the request just as the curl callbacks would have,
+// at the recording's pace. Each step passes on what is due, and returns the ms until the next part is, or -1 once the
+// response is done (and the request has been told). Setting result to an error first ends the replay with it.
+void HttpClient_Worker_BeginReplay(HttpClient_Worker* pWorker);
+long HttpClient_Worker_StepReplay(HttpClient_Worker* pWorker);
+void HttpClient_Worker_HandleCleanup(HttpClient_Worker* pWorker); // Once the app thread has processed the response: Worker_HandleCleanup() for pWorker->finished
+bool HttpClient_Worker_ShouldPause(HttpClient_Worker* pWorker); // Flow control: whether the request can't take any more data until the app has consumed some
+
+extern "C" {
+void* HttpClient_WorkerThread(void *_pWorker); // Thread-per-worker engine
+void* HttpClient_IoThreadMain(void *_pIoThread); // Multi engine
+// The steps of HttpClient_IoThreadMain(), for an external event loop to take in its place (see HttpEventLoop):
+void HttpClient_IoThread_Begin(HttpClient_IoThread* pIoThread); // Set up pMulti, and watch the wake pipe
+long HttpClient_IoThread_Prepare(HttpClient_IoThread* pIoThread); // Pick up the app thread's work; returns how long we may wait (-1 for as long as it takes)
+bool HttpClient_IoThread_HandleSocket(HttpClient_IoThread* pIoThread, int fd, int curlMask); // False if fd isn't one of ours
+void HttpClient_IoThread_HandleTimeout(HttpClient_IoThread* pIoThread); // Run curl's timer if it has expired, and hand back what has finished
+void HttpClient_IoThread_End(HttpClient_IoThread* pIoThread); // Abort anything still in progress, and clean up
+}
@@ -0,0 +1,283 @@
+// HttpCpuPool:
+// A few threads for the heavy work that a response needs once it has arrived.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpCpuPool.h"
+
+#include <stdexcept>
+
+#include <s3eDebug.h>
+#include <s3eDevice.h>
+#include <IwDebug.h>
+#include <IwMath.h>
+
+#include "HttpClientWorker.h"
+#include "HttpMemoryDownload.h"
+#include "HttpTracer.h"
+
+void HttpJob::Cancel() {
+	// A pool thread may be taking the job from WAITING to RUNNING at the same time:
+	for (;;) {
+		const int status = atomic::LoadAcquire(m_status);
+		if (status != WAITING && status != RUNNING)
+			return;
+		atomic::StoreRelease(m_cancelled, 1);
+		if (atomic::CompareAndSwap(m_status, status, (int)CANCELLED))
+			return;
+	}
+}
+
+HttpCpuPool::HttpCpuPool(uint numThreads, const HttpThreadOptions& options)
+	: NUM_THREADS(MAX(numThreads, 1u)), m_threadOptions(options), m_threads(nullptr), m_nextThread(0), m_numQueued(0), m_numSleeping(0), m_quit(0),
+	  m_pDone(nullptr), m_pFinished(nullptr), m_pFinishedTail(nullptr), m_pfnSignal(nullptr), m_pSignalUserData(nullptr), m_logPending(0), m_numJobs(0), m_closing(false)
+{
+	pthread_mutex_init(&m_wakeMutex, nullptr);
+	pthread_cond_init(&m_wakeCond, nullptr);
+	m_threads = new Thread[NUM_THREADS];
+	for (uint i = 0; i < NUM_THREADS; i++) {
+		Thread& thread = m_threads[i];
+		thread.pPool = this;
+		thread.index = i;
+		thread.started = false;
+		pthread_mutex_init(&thread.mutex, nullptr);
+		thread.head = thread.count = 0;
+		thread.log.pPending = &m_logPending;
+	}
+	uint num_started = 0;
+	for (uint i = 0; i < NUM_THREADS; i++) {
+		m_threads[i].started = HttpClient_CreateThread(m_threads[i].threadId, m_threadOptions, ThreadMain, &m_threads[i]) == 0;
+		if (m_threads[i].started)
+			num_started++;
+		else
+			s3eDebugTracePrintf("HttpCpuPool: Unable to spawn a thread");
+	}
+	if (!num_started) {
+		for (uint i = 0; i < NUM_THREADS; i++)
+			pthread_mutex_destroy(&m_threads[i].mutex);
+		delete[] m_threads;
+		pthread_cond_destroy(&m_wakeCond);
+		pthread_mutex_destroy(&m_wakeMutex);
+		throw std::runtime_error("HttpCpuPool: Unable to spawn any threads");
+	}
+}
+
+HttpCpuPool::~HttpCpuPool() {
+	// Whatever hasn't run yet is dropped, and what has is cleaned up, without calling back to the app:
+	m_closing = true;
+	for (auto it = m_overflow.begin(); it != m_overflow.end(); it++)
+		(*it)->Cancel();
+	for (uint i = 0; i < NUM_THREADS; i++) {
+		Thread& thread = m_threads[i];
+		pthread_mutex_lock(&thread.mutex);
+		for (uint j = 0; j < thread.count; j++)
+			thread.queue[(thread.head + j) % QUEUE_SIZE]->Cancel();
+		pthread_mutex_unlock(&thread.mutex);
+	}
+	for (;;) {
+		Update();
+		if (!m_numJobs)
+			break;
+		s3eDeviceYield(1); // The threads may need us to yield before they can run
+	}
+	atomic::StoreRelease(m_quit, 1);
+	pthread_mutex_lock(&m_wakeMutex);
+	pthread_cond_broadcast(&m_wakeCond);
+	pthread_mutex_unlock(&m_wakeMutex);
+	for (uint i = 0; i < NUM_THREADS; i++) {
+		if (m_threads[i].started)
+			pthread_join(m_threads[i].threadId, nullptr);
+		pthread_mutex_destroy(&m_threads[i].mutex);
+		m_threads[i].log.Drain();
+	}
+	delete[] m_threads;
+	pthread_cond_destroy(&m_wakeCond);
+	pthread_mutex_destroy(&m_wakeMutex);
+}
+
+void HttpCpuPool::Submit(Ptr<HttpJob> pJob) {
+	IwAssert(HTTP_CLIENT, pJob && !pJob->m_pPool && pJob->m_phase == HttpJob::PHASE_NONE);
+	IwAssert(HTTP_CLIENT, !m_closing);
+	pJob->m_status = HttpJob::WAITING;
+	pJob->m_cancelled = 0;
+	pJob->m_phase = HttpJob::PHASE_RUN;
+	pJob->m_pPool = this;
+	pJob->m_pSelf = pJob;
+	m_numJobs++;
+	if (!m_overflow.empty() || !Enqueue(pJob.ptr()))
+		m_overflow.push_back(pJob.ptr()); // (Behind the others that are waiting for room, to keep them in order)
+}
+
+void HttpCpuPool::SetCompletionSignal(void (*pfnSignal)(void* userData), void* userData) {
+	m_pSignalUserData = userData;
+	m_pfnSignal = pfnSignal;
+}
+
+bool HttpCpuPool::Enqueue(HttpJob* pJob) {
+	for (uint n = 0; n < NUM_THREADS; n++) {
+		Thread& thread = m_threads[m_nextThread];
+		m_nextThread = (m_nextThread + 1) % NUM_THREADS;
+		if (!thread.started)
+			continue;
+		pthread_mutex_lock(&thread.mutex);
+		const bool room = thread.count < QUEUE_SIZE;
+		if (room) {
+			thread.queue[(thread.head + thread.count++) % QUEUE_SIZE] = pJob;
+			atomic::FetchAdd(m_numQueued, 1u);
+		}
+		pthread_mutex_unlock(&thread.mutex);
+		if (!room)
+			continue;
+		// As for HttpClient_Worker::WakeToStatus(): we publish the job before we look for sleepers, and a thread
+		// says it is going to sleep before it looks for jobs, so at least one of us sees the other's:
+		if (atomic::LoadAcquire(m_numSleeping)) {
+			pthread_mutex_lock(&m_wakeMutex);
+			pthread_cond_signal(&m_wakeCond);
+			pthread_mutex_unlock(&m_wakeMutex);
+		}
+		return true;
+	}
+	return false;
+}
+
+void HttpCpuPool::Requeue(HttpJob* pJob) {
+	if (!m_overflow.empty() || !Enqueue(pJob))
+		m_overflow.push_back(pJob);
+}
+
+void HttpCpuPool::Update(uint maxMicroseconds) {
+	const uint64 deadline_us = maxMicroseconds ? HttpTracer::NowUs() + maxMicroseconds : 0;
+	if (HttpLogRing::TakePending(m_logPending)) {
+		for (uint i = 0; i < NUM_THREADS; i++)
+			m_threads[i].log.Drain();
+	}
+	// The jobs that were waiting for room in the queues, as far as there is room for them now:
+	size_t num_moved = 0;
+	while (num_moved < m_overflow.size() && Enqueue(m_overflow[num_moved]))
+		num_moved++;
+	m_overflow.erase(m_overflow.begin(), m_overflow.begin() + num_moved);
+
+	// The finished jobs, in the order they finished, behind any that the last update didn't have time for:
+	HttpJob* p_done = atomic::Exchange(m_pDone, (HttpJob*)nullptr);
+	HttpJob* p_ordered = nullptr;
+	HttpJob* p_ordered_tail = p_done;
+	while (p_done) {
+		HttpJob* p_next = p_done->m_pNextDone;
+		p_done->m_pNextDone = p_ordered;
+		p_ordered = p_done;
+		p_done = p_next;
+	}
+	if (p_ordered) {
+		if (m_pFinishedTail)
+			m_pFinishedTail->m_pNextDone = p_ordered;
+		else
+			m_pFinished = p_ordered;
+		m_pFinishedTail = p_ordered_tail;
+	}
+	uint num_handled = 0;
+	while (m_pFinished) {
+		HttpJob* p_job = m_pFinished;
+		const bool handle = p_job->m_phase == HttpJob::PHASE_RAN && !p_job->m_cancelled && !m_closing;
+		if (handle && deadline_us && num_handled && HttpTracer::NowUs() >= deadline_us)
+			break; // Out of time: the rest wait for the next update
+		m_pFinished = p_job->m_pNextDone;
+		if (!m_pFinished)
+			m_pFinishedTail = nullptr;
+		p_job->m_pNextDone = nullptr;
+		if (p_job->m_phase == HttpJob::PHASE_RAN) {
+			if (handle) {
+				num_handled++;
+				// (Nothing else changes the status now: its thread is done with it, and Cancel() is for this thread only)
+				atomic::StoreRelease(p_job->m_status, (int)HttpJob::DONE);
+				Ptr<HttpJob> p_keep = p_job; // (In case HandleDone() or the callback cancels it)
+				p_job->HandleDone();
+				if (p_job->m_callback)
+					p_job->m_callback(p_keep);
+			} else {
+				p_job->m_status = HttpJob::CANCELLED;
+			}
+			p_job->m_phase = HttpJob::PHASE_CLEANUP;
+			Requeue(p_job);
+			continue;
+		}
+		// Done with (PHASE_SKIPPED or PHASE_CLEANED):
+		IwAssert(HTTP_CLIENT, p_job->m_phase == HttpJob::PHASE_SKIPPED || p_job->m_phase == HttpJob::PHASE_CLEANED);
+		if (p_job->m_phase == HttpJob::PHASE_SKIPPED)
+			p_job->m_status = HttpJob::CANCELLED;
+		p_job->m_phase = HttpJob::PHASE_NONE;
+		p_job->m_pPool = nullptr;
+		m_numJobs--;
+		Ptr<HttpJob> p_self;
+		p_self.swap(p_job->m_pSelf); // (Which may be the last reference)
+	}
+}
+
+HttpJob* HttpCpuPool::Take(uint threadIndex) {
+	if (!atomic::LoadAcquire(m_numQueued))
+		return nullptr;
+	for (uint n = 0; n < NUM_THREADS; n++) {
+		Thread& thread = m_threads[(threadIndex + n) % NUM_THREADS];
+		HttpJob* p_job = nullptr;
+		pthread_mutex_lock(&thread.mutex);
+		if (thread.count) {
+			p_job = thread.queue[thread.head];
+			thread.head = (thread.head + 1) % QUEUE_SIZE;
+			thread.count--;
+			atomic::FetchSub(m_numQueued, 1u);
+		}
+		pthread_mutex_unlock(&thread.mutex);
+		if (p_job)
+			return p_job;
+	}
+	return nullptr;
+}
+
+void HttpCpuPool::Worker_Finish(HttpJob* pJob) {
+	HttpJob* p_head;
+	do {
+		p_head = atomic::LoadRelaxed(m_pDone);
+		pJob->m_pNextDone = p_head;
+	} while (!atomic::CompareAndSwap(m_pDone, p_head, pJob));
+	if (m_pfnSignal)
+		m_pfnSignal(m_pSignalUserData);
+}
+
+void HttpCpuPool::Worker_Main(Thread& thread) {
+	HttpClient_ApplyThreadOptions(m_threadOptions, thread.log);
+	for (;;) {
+		if (HttpJob* p_job = Take(thread.index)) {
+			if (p_job->m_phase == HttpJob::PHASE_RUN) {
+				if (atomic::CompareAndSwap(p_job->m_status, (int)HttpJob::WAITING, (int)HttpJob::RUNNING)) {
+					p_job->Worker_Run();
+					p_job->m_phase = HttpJob::PHASE_RAN;
+				} else {
+					p_job->m_phase = HttpJob::PHASE_SKIPPED; // Cancelled while it waited
+				}
+			} else {
+				IwAssert(HTTP_CLIENT, p_job->m_phase == HttpJob::PHASE_CLEANUP);
+				p_job->Worker_Cleanup();
+				p_job->m_phase = HttpJob::PHASE_CLEANED;
+			}
+			HttpBuffer::Worker_FreeReleased(); // Any that the app has finished with, while we're in this memory environment
+			Worker_Finish(p_job); // (After which the job is the app thread's again)
+			s3eDeviceYield(); // We must call s3eDeviceYield from time to time, or other threads might be blocked waiting for this thread to yield.
+			continue;
+		}
+		pthread_mutex_lock(&m_wakeMutex);
+		atomic::FetchAdd(m_numSleeping, 1u); // (A full barrier, before we look at m_numQueued again)
+		while (!atomic::LoadAcquire(m_numQueued) && !atomic::LoadAcquire(m_quit))
+			pthread_cond_wait(&m_wakeCond, &m_wakeMutex);
+		atomic::FetchSub(m_numSleeping, 1u);
+		pthread_mutex_unlock(&m_wakeMutex);
+		if (atomic::LoadAcquire(m_quit) && !atomic::LoadAcquire(m_numQueued))
+			break;
+	}
+	HttpBuffer::Worker_FreeReleased();
+}
+
+void* HttpCpuPool::ThreadMain(void* pThread) {
+	Thread& thread = *reinterpret_cast<Thread*>(pThread);
+	thread.pPool->Worker_Main(thread);
+	return nullptr;
+}
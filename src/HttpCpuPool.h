@@ -0,0 +1,162 @@
+// HttpCpuPool:
+// A few threads for the heavy work that a response needs once it has arrived,
+// e.g. decoding its JSON or its image, inflating it, or hashing it, so that
+// neither the app thread (which has frames to render) nor a worker (which
+// has the next transfer to get on with) has to do it. Each job is an HttpJob
+// subclass: Worker_Run() does the work on one of the pool's threads, and
+// HandleDone() hands the results over on the app thread, during Update():
+//     class DecodeJob : public HttpJob {
+//         virtual void Worker_Run() { ... decode m_pBody into m_pPixels ... }
+//         virtual void HandleDone() { ... make a texture of m_pPixels ... }
+//         virtual void Worker_Cleanup() { ... free m_pPixels ... }
+//     };
+//     void MyModule::HandleImage(Ptr<HttpRequest> pRequest) { // The request's callback
+//         m_cpuPool.Submit(new DecodeJob(static_cast<HttpMemoryDownload*>(pRequest.ptr())->TakeBuffer()));
+//     }
+// Each thread has a queue of its own, which Submit() fills in turn, and takes
+// its jobs from in the order they came; a thread that runs out takes the
+// oldest job from another's (so one long job doesn't hold up the ones queued
+// behind it). The finished jobs are handed back through a lock-free list that
+// Update() empties, in the order they finished.
+// The pool's threads are in the worker memory environment (see
+// HttpClientWorker.h), so whatever Worker_Run() allocates must be freed by
+// Worker_Cleanup(), which runs on one of them once HandleDone() has been
+// called (or the job was cancelled), or handed to the app thread as an
+// HttpBuffer (see HttpMemoryDownload.h), which the pool's threads free too.
+// Attach the pool to an HttpClient (see HttpClient::SetCpuPool()) to have
+// the client's Update() call the pool's, or call it yourself. Like
+// HttpClient, it must only be used from the app thread (except for the
+// Worker_ methods of its jobs). Its destructor waits for the jobs that are
+// running, and cancels the rest.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <pthread.h>
+#include <vector>
+
+#include "HttpLog.h"
+#include "HttpThreadOptions.h"
+#include "util/FastDelegate.h"
+#include "util/ptr.h"
+
+class HttpCpuPool;
+
+class HttpJob : public IRefCounted {
+public:
+	enum Status {
+		UNUSED, // Not submitted yet
+		WAITING, // Queued for a thread
+		RUNNING, // Worker_Run() is under way
+		DONE, // Worker_Run() has finished, and HandleDone() has been called
+		CANCELLED // Cancel()led, or the pool was destroyed, before it was DONE
+	};
+	typedef fastdelegate::FastDelegate1< Ptr<HttpJob> > Callback;
+	HttpJob() : m_status(UNUSED), m_cancelled(0), m_phase(PHASE_NONE), m_pNextDone(nullptr), m_pPool(nullptr) {}
+	virtual ~HttpJob() {}
+
+	Status GetStatus() const { return (Status)atomic::LoadAcquire(m_status); }
+	// Called (after HandleDone()) once the job is DONE, but not if it is cancelled:
+	void SetCallback(Callback callback) { m_callback = callback; }
+	template<typename WatcherType>
+	void SetCallback(WatcherType* pWatcher, void (WatcherType::*pMethod)(Ptr<HttpJob>)) { m_callback = fastdelegate::MakeDelegate(pWatcher, pMethod); }
+	// A job that is WAITING is dropped without being run. One that is RUNNING finishes (Worker_Run() may check
+	// Worker_IsCancelled() to finish early), but HandleDone() and the callback aren't called. Either way, the job is
+	// CANCELLED straight away, and Worker_Cleanup() is called as usual.
+	void Cancel();
+
+	/////// Pool thread (in the worker memory environment) ///////
+	virtual void Worker_Run() = 0;
+	// Once the app thread has called HandleDone(), or the job was cancelled after it ran: free what Worker_Run() left.
+	virtual void Worker_Cleanup() {}
+	bool Worker_IsCancelled() const { return atomic::LoadRelaxed(m_cancelled) != 0; }
+
+	/////// App thread ///////
+	// Worker_Run() has finished: take the results.
+	virtual void HandleDone() {}
+
+private:
+	friend class HttpCpuPool;
+	enum Phase {
+		PHASE_NONE,
+		PHASE_RUN, // Queued to run
+		PHASE_RAN, // Back from Worker_Run()
+		PHASE_SKIPPED, // Back without running: it was cancelled first
+		PHASE_CLEANUP, // Queued for Worker_Cleanup()
+		PHASE_CLEANED // Back from Worker_Cleanup()
+	};
+	volatile int m_status; // A Status: WAITING to RUNNING is set by the pool thread, the others by the app thread
+	volatile int m_cancelled;
+	Phase m_phase; // Handed over with the job, between the app thread and the pool thread that has it
+	HttpJob* m_pNextDone; // In the pool's list of finished jobs
+	HttpCpuPool* m_pPool;
+	Ptr<HttpJob> m_pSelf; // Keeps the job alive while it is with the pool
+	Callback m_callback;
+	HttpJob(const HttpJob&);
+	HttpJob& operator=(const HttpJob&);
+};
+
+class HttpCpuPool {
+public:
+	// numThreads: e.g. one fewer than the device has cores. options: as for HttpClient::SetThreadOptions(), e.g. a
+	// lower priority than the app's own threads. The threads are spawned straight away.
+	HttpCpuPool(uint numThreads, const HttpThreadOptions& options = HttpThreadOptions());
+	~HttpCpuPool();
+
+	// Queue pJob to be run (it must be UNUSED). The pool keeps it alive until it is done with it.
+	void Submit(Ptr<HttpJob> pJob);
+	// Call HandleDone() (and the callback) for each job that has finished since the last call, and release the jobs
+	// that the pool is done with. Called by HttpClient::Update() if the pool is attached to the client (with what is
+	// left of its budget). maxMicroseconds, if set, is a budget for the HandleDone()s and callbacks: once it is
+	// spent, the rest of the finished jobs wait for the next call (at least one is handled, however long it takes).
+	void Update(uint maxMicroseconds = 0);
+	// Optionally, have pfnSignal(userData) called on a pool thread as soon as a job finishes (as for
+	// HttpClient::SetCompletionSignal(), so it must be thread-safe and quick).
+	void SetCompletionSignal(void (*pfnSignal)(void* userData), void* userData);
+
+	uint NumThreads() const { return NUM_THREADS; }
+	size_t NumJobs() const { return m_numJobs; } // Submitted and not yet released: waiting, running or being cleaned up
+
+private:
+	enum { QUEUE_SIZE = 256 }; // Jobs per thread's queue; any more wait in m_overflow for room
+	// Everything a thread shares with the app thread and the other threads is POD, in the app's memory:
+	struct Thread {
+		HttpCpuPool* pPool;
+		uint index;
+		pthread_t threadId;
+		bool started;
+		pthread_mutex_t mutex; // For the queue
+		HttpJob* queue[QUEUE_SIZE];
+		uint head, count; // The oldest job, and how many there are
+		HttpLogRing log;
+	};
+	const uint NUM_THREADS;
+	const HttpThreadOptions m_threadOptions;
+	Thread* m_threads;
+	uint m_nextThread; // Round robin, for Submit()
+	std::vector<HttpJob*> m_overflow; // Jobs for which the queues had no room. App thread only.
+	pthread_mutex_t m_wakeMutex;
+	pthread_cond_t m_wakeCond;
+	volatile uint m_numQueued; // In all of the threads' queues
+	volatile uint m_numSleeping;
+	volatile int m_quit;
+	HttpJob* volatile m_pDone; // Finished jobs, the latest first: pushed by the threads, taken by Update()
+	HttpJob* m_pFinished; // Taken from m_pDone, the oldest first, and not yet handled for lack of time. App thread only.
+	HttpJob* m_pFinishedTail;
+	void (*m_pfnSignal)(void* userData);
+	void* m_pSignalUserData;
+	volatile uint m_logPending;
+	size_t m_numJobs;
+	bool m_closing; // The destructor is waiting for the jobs it has, which are all treated as cancelled
+
+	bool Enqueue(HttpJob* pJob); // Into one of the threads' queues; false if they're all full
+	void Requeue(HttpJob* pJob); // Enqueue(), or m_overflow
+	HttpJob* Take(uint threadIndex); // For a thread: the oldest job in its own queue, or else in another's, or nullptr
+	void Worker_Main(Thread& thread);
+	void Worker_Finish(HttpJob* pJob);
+	static void* ThreadMain(void* pThread);
+	HttpCpuPool(const HttpCpuPool&);
+	HttpCpuPool& operator=(const HttpCpuPool&);
+};
@@ -0,0 +1,118 @@
+// HttpDigest:
+// An MD5 or SHA-256 digest, computed incrementally as data arrives.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpDigest.h"
+
+#include <string.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L // (The names the contexts' constructor and destructor had before 1.1)
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+using std::string;
+
+bool HttpDigest::Begin(Type type) {
+	Abandon();
+	m_type = type;
+	if (type == DIGEST_NONE)
+		return true;
+	EVP_MD_CTX* p_context = EVP_MD_CTX_new();
+	if (!p_context)
+		return false;
+	if (!EVP_DigestInit_ex(p_context, type == DIGEST_MD5 ? EVP_md5() : EVP_sha256(), nullptr)) {
+		EVP_MD_CTX_free(p_context);
+		return false;
+	}
+	m_pContext = p_context;
+	return true;
+}
+
+void HttpDigest::Update(const void* pData, size_t size) {
+	if (!m_pContext || !size)
+		return;
+	EVP_DigestUpdate(static_cast<EVP_MD_CTX*>(m_pContext), pData, size);
+}
+
+size_t HttpDigest::Finish(unsigned char* pDigest) {
+	if (!m_pContext)
+		return 0;
+	EVP_DigestFinal_ex(static_cast<EVP_MD_CTX*>(m_pContext), pDigest, nullptr);
+	Abandon();
+	return GetSize(m_type);
+}
+
+void HttpDigest::Abandon() {
+	if (m_pContext)
+		EVP_MD_CTX_free(static_cast<EVP_MD_CTX*>(m_pContext));
+	m_pContext = nullptr;
+}
+
+static int HttpDigest_HexValue(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool HttpDigest::ParseHex(const char* pText, size_t length, unsigned char* pDigest, size_t size) {
+	if (length != size * 2)
+		return false;
+	for (size_t i = 0; i < size; i++) {
+		const int high = HttpDigest_HexValue(pText[i * 2]);
+		const int low = HttpDigest_HexValue(pText[i * 2 + 1]);
+		if (high < 0 || low < 0)
+			return false;
+		pDigest[i] = (unsigned char)(high * 16 + low);
+	}
+	return true;
+}
+
+static int HttpDigest_Base64Value(char c) {
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	return c == '+' ? 62 : c == '/' ? 63 : -1;
+}
+
+bool HttpDigest::ParseBase64(const char* pText, size_t length, unsigned char* pDigest, size_t size) {
+	while (length && pText[length - 1] == '=')
+		length--;
+	size_t num_bytes = 0;
+	unsigned int bits = 0;
+	int num_bits = 0;
+	for (size_t i = 0; i < length; i++) {
+		const int value = HttpDigest_Base64Value(pText[i]);
+		if (value < 0)
+			return false;
+		bits = (bits << 6) | (unsigned int)value;
+		num_bits += 6;
+		if (num_bits >= 8) {
+			num_bits -= 8;
+			if (num_bytes == size)
+				return false; // Too long
+			pDigest[num_bytes++] = (unsigned char)(bits >> num_bits);
+		}
+	}
+	return num_bytes == size;
+}
+
+string HttpDigest::ToHex(const unsigned char* pDigest, size_t size) {
+	static const char s_digits[] = "0123456789abcdef";
+	string hex(size * 2, '0');
+	for (size_t i = 0; i < size; i++) {
+		hex[i * 2] = s_digits[pDigest[i] >> 4];
+		hex[i * 2 + 1] = s_digits[pDigest[i] & 15];
+	}
+	return hex;
+}
@@ -0,0 +1,53 @@
+// HttpDigest:
+// An MD5 or SHA-256 digest, computed incrementally as data arrives (with the
+// OpenSSL that curl is linked with), e.g. to verify a download as it is
+// written rather than reading the file again afterwards (see
+// HttpDownload::SetExpectedDigest()).
+// The context is allocated by Begin() and freed by Finish() or Abandon(), so
+// a digest that is computed on a worker thread stays in the worker memory
+// environment: only call those from the thread that called Begin().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+#include <IwDebug.h>
+
+class HttpDigest {
+public:
+	enum Type {
+		DIGEST_NONE,
+		DIGEST_MD5,
+		DIGEST_SHA256
+	};
+	enum { MAX_SIZE = 32 }; // Bytes, for SHA-256
+
+	HttpDigest() : m_type(DIGEST_NONE), m_pContext(nullptr) {}
+	~HttpDigest() { IwAssert(HTTP_CLIENT, m_pContext == nullptr); } // Finish() or Abandon() must have been called
+
+	// Start a new digest of type (returns false if memory ran out):
+	bool Begin(Type type);
+	bool IsActive() const { return m_pContext != nullptr; }
+	Type GetType() const { return m_type; }
+	void Update(const void* pData, size_t size);
+	// Write the digest to pDigest (which must have room for MAX_SIZE bytes), and return its size:
+	size_t Finish(unsigned char* pDigest);
+	void Abandon();
+
+	static size_t GetSize(Type type) { return type == DIGEST_MD5 ? 16 : type == DIGEST_SHA256 ? 32 : 0; }
+	// Decode a digest written in hex (either case) or base64 (as in Content-MD5) to size bytes. Return false unless
+	// it is exactly that long:
+	static bool ParseHex(const char* pText, size_t length, unsigned char* pDigest, size_t size);
+	static bool ParseBase64(const char* pText, size_t length, unsigned char* pDigest, size_t size);
+	static std::string ToHex(const unsigned char* pDigest, size_t size); // Lower case
+
+private:
+	Type m_type;
+	void* m_pContext;
+	HttpDigest(const HttpDigest&);
+	HttpDigest& operator=(const HttpDigest&);
+};
@@ -0,0 +1,218 @@
+// HttpDiskWriter:
+// A thread that writes downloads to their files, so that a worker never waits for the disk.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpDiskWriter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+#include <s3eDevice.h>
+#include <IwDebug.h>
+#include <IwMath.h>
+
+#include "HttpClientWorker.h"
+
+HttpDiskWriter::HttpDiskWriter(uint numBuffers, size_t bufferSize, const HttpThreadOptions& options)
+	: NUM_BUFFERS(MAX(numBuffers, 1u)), BUFFER_SIZE(MAX(bufferSize, (size_t)1)), m_threadOptions(options), m_blocks(nullptr),
+	  m_pFirst(nullptr), m_pLast(nullptr), m_pFree(nullptr), m_quit(false), m_numFree(0), m_queuedBytes(0), m_logPending(0)
+{
+	m_log.pPending = &m_logPending;
+	m_blocks = new Block[NUM_BUFFERS];
+	for (uint i = 0; i < NUM_BUFFERS; i++)
+		m_blocks[i].pData = nullptr;
+	// The buffers are big, so they come out of the worker memory environment, as the workers' own do, rather than the app's heap:
+	HttpClient_RunInWorkerEnvironment(AllocateBuffers, this);
+	if (!m_blocks[NUM_BUFFERS - 1].pData) {
+		HttpClient_RunInWorkerEnvironment(FreeBuffers, this);
+		delete[] m_blocks;
+		throw std::runtime_error("HttpDiskWriter: Out of memory for its buffers");
+	}
+	for (uint i = 0; i < NUM_BUFFERS; i++) {
+		m_blocks[i].pNext = m_pFree;
+		m_pFree = &m_blocks[i];
+	}
+	m_numFree = NUM_BUFFERS;
+	pthread_mutex_init(&m_mutex, nullptr);
+	pthread_cond_init(&m_wakeCond, nullptr);
+	pthread_cond_init(&m_freeCond, nullptr);
+	if (HttpClient_CreateThread(m_thread, m_threadOptions, ThreadMain, this) != 0) {
+		pthread_cond_destroy(&m_freeCond);
+		pthread_cond_destroy(&m_wakeCond);
+		pthread_mutex_destroy(&m_mutex);
+		HttpClient_RunInWorkerEnvironment(FreeBuffers, this);
+		delete[] m_blocks;
+		throw std::runtime_error("HttpDiskWriter: Unable to spawn its thread");
+	}
+}
+
+HttpDiskWriter::~HttpDiskWriter() {
+	// The thread writes everything that has been queued before it quits:
+	pthread_mutex_lock(&m_mutex);
+	m_quit = true;
+	pthread_cond_signal(&m_wakeCond);
+	pthread_mutex_unlock(&m_mutex);
+	pthread_join(m_thread, nullptr);
+	IwAssert(HTTP_CLIENT, !m_pFirst && m_numFree == NUM_BUFFERS);
+	std::vector<Stream*> watched;
+	watched.swap(m_watched);
+	for (auto it = watched.begin(); it != watched.end(); it++) {
+		(*it)->m_pWatcher = nullptr;
+		(*it)->m_state = Stream::IDLE;
+		(*it)->HandleWritten(true);
+	}
+	m_log.Drain();
+	pthread_cond_destroy(&m_freeCond);
+	pthread_cond_destroy(&m_wakeCond);
+	pthread_mutex_destroy(&m_mutex);
+	HttpClient_RunInWorkerEnvironment(FreeBuffers, this);
+	delete[] m_blocks;
+}
+
+void* HttpDiskWriter::AllocateBuffers(void* pWriter) {
+	HttpDiskWriter& writer = *reinterpret_cast<HttpDiskWriter*>(pWriter);
+	for (uint i = 0; i < writer.NUM_BUFFERS; i++) {
+		writer.m_blocks[i].pData = (char*)malloc(writer.BUFFER_SIZE);
+		if (!writer.m_blocks[i].pData)
+			break; // (The constructor sees that the last one is missing)
+	}
+	return nullptr;
+}
+
+void* HttpDiskWriter::FreeBuffers(void* pWriter) {
+	HttpDiskWriter& writer = *reinterpret_cast<HttpDiskWriter*>(pWriter);
+	for (uint i = 0; i < writer.NUM_BUFFERS; i++) {
+		free(writer.m_blocks[i].pData);
+		writer.m_blocks[i].pData = nullptr;
+	}
+	return nullptr;
+}
+
+void HttpDiskWriter::Update() {
+	if (HttpLogRing::TakePending(m_logPending))
+		m_log.Drain();
+	for (size_t i = 0; i < m_watched.size();) {
+		Stream* p_stream = m_watched[i];
+		if (atomic::LoadAcquire(p_stream->m_state) != Stream::CLOSED) {
+			i++;
+			continue;
+		}
+		m_watched[i] = m_watched.back(); // (The order they're told in doesn't matter)
+		m_watched.pop_back();
+		p_stream->m_pWatcher = nullptr;
+		p_stream->m_state = Stream::IDLE;
+		p_stream->HandleWritten(false); // (Which may Watch() it again, as it starts over)
+	}
+}
+
+void HttpDiskWriter::Watch(Stream& stream) {
+	IwAssert(HTTP_CLIENT, !stream.m_pWatcher && stream.IsBusy());
+	stream.m_pWatcher = this;
+	m_watched.push_back(&stream);
+}
+
+void HttpDiskWriter::WaitFor(Stream& stream) {
+	IwAssert(HTTP_CLIENT, !stream.m_pWatcher);
+	while (atomic::LoadAcquire(stream.m_state) == Stream::QUEUED)
+		s3eDeviceYield(1); // The thread may need us to yield before it can run
+	stream.m_state = Stream::IDLE;
+}
+
+void HttpDiskWriter::Queue(Block* pBlock) {
+	pBlock->pNext = nullptr;
+	if (m_pLast)
+		m_pLast->pNext = pBlock;
+	else
+		m_pFirst = pBlock;
+	m_pLast = pBlock;
+	pthread_cond_signal(&m_wakeCond);
+}
+
+bool HttpDiskWriter::Worker_Write(Stream& stream, const void* pData, size_t size) {
+	if (stream.Worker_HasFailed())
+		return false;
+	const char* p_data = (const char*)pData;
+	pthread_mutex_lock(&m_mutex);
+	atomic::StoreRelease(stream.m_state, (int)Stream::QUEUED);
+	while (size) {
+		// Fill up the stream's last block, if the thread hasn't taken it yet, before starting another:
+		Block* p_block = m_pLast;
+		if (!p_block || p_block->pStream != &stream || !p_block->pData || p_block->size == BUFFER_SIZE) {
+			while (!m_pFree)
+				pthread_cond_wait(&m_freeCond, &m_mutex); // The disk has fallen behind
+			p_block = m_pFree;
+			m_pFree = p_block->pNext;
+			atomic::FetchSub(m_numFree, 1u);
+			p_block->pStream = &stream;
+			p_block->size = 0;
+			Queue(p_block);
+		}
+		const size_t num_copied = MIN(size, BUFFER_SIZE - p_block->size);
+		memcpy(p_block->pData + p_block->size, p_data, num_copied);
+		p_block->size += num_copied;
+		atomic::FetchAdd(m_queuedBytes, num_copied);
+		p_data += num_copied;
+		size -= num_copied;
+	}
+	pthread_mutex_unlock(&m_mutex);
+	return true;
+}
+
+void HttpDiskWriter::Worker_Close(Stream& stream) {
+	pthread_mutex_lock(&m_mutex);
+	atomic::StoreRelease(stream.m_state, (int)Stream::QUEUED);
+	Queue(&stream.m_close);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void HttpDiskWriter::Thread_Run() {
+	HttpClient_ApplyThreadOptions(m_threadOptions, m_log);
+	pthread_mutex_lock(&m_mutex);
+	for (;;) {
+		while (!m_pFirst && !m_quit)
+			pthread_cond_wait(&m_wakeCond, &m_mutex);
+		Block* p_block = m_pFirst;
+		if (!p_block)
+			break; // Quitting, and everything has been written
+		m_pFirst = p_block->pNext;
+		if (!m_pFirst)
+			m_pLast = nullptr; // (So no worker adds to this block while we write it)
+		pthread_mutex_unlock(&m_mutex);
+		Stream& stream = *p_block->pStream;
+		if (p_block->pData) {
+			if (!stream.m_failed) {
+				if (!stream.m_opened) {
+					stream.m_opened = true;
+					if (!stream.Writer_Open())
+						atomic::StoreRelease(stream.m_failed, 1);
+				}
+				if (!stream.m_failed && !stream.Writer_Write(p_block->pData, p_block->size))
+					atomic::StoreRelease(stream.m_failed, 1);
+			}
+			const size_t size = p_block->size;
+			pthread_mutex_lock(&m_mutex);
+			atomic::FetchSub(m_queuedBytes, size);
+			p_block->pNext = m_pFree;
+			m_pFree = p_block;
+			atomic::FetchAdd(m_numFree, 1u);
+			pthread_cond_broadcast(&m_freeCond);
+			pthread_mutex_unlock(&m_mutex);
+		} else {
+			stream.Writer_Close(stream.m_failed != 0);
+			stream.m_opened = false;
+			stream.m_failed = 0;
+			atomic::StoreRelease(stream.m_state, (int)Stream::CLOSED); // (After which the stream may be gone)
+		}
+		s3eDeviceYield(); // We must call s3eDeviceYield from time to time, or other threads might be blocked waiting for this thread to yield.
+		pthread_mutex_lock(&m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void* HttpDiskWriter::ThreadMain(void* pWriter) {
+	reinterpret_cast<HttpDiskWriter*>(pWriter)->Thread_Run();
+	return nullptr;
+}
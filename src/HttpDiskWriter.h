@@ -0,0 +1,145 @@
+// HttpDiskWriter:
+// A thread that writes downloads to their files, so that a worker never
+// waits for the disk: with a slow SD card, a write can take longer than the
+// data took to arrive, and while the worker waits for it, it isn't reading
+// its socket, and TCP slows the transfer down to match. A download that has a
+// writer (see HttpDownload::SetDiskWriter()) copies each block of its data
+// into one of the writer's buffers and goes straight back to reading; the
+// writer opens the file, writes the blocks in the order they were queued,
+// and then closes the file and renames it into place. Several clients and
+// any number of downloads may share one writer.
+// The buffers are all allocated up front, so the queue is bounded: while
+// they are all waiting to be written, Worker_IsFull() is true, and the multi
+// engine pauses the transfer (as it does for flow control; see
+// HttpRequest::Worker_IsBackedUp()) until the disk has caught up. A worker
+// that needs a buffer anyway (with a thread of its own, or for the last of a
+// chunk) waits for one.
+// Each file is an HttpDiskWriter::Stream, whose Writer_ methods run on the
+// writer's thread, in the worker memory environment (see HttpClientWorker.h).
+// Once a stream has been closed, Update() calls its HandleWritten() on the
+// app thread. Attach the writer to an HttpClient (see
+// HttpClient::SetDiskWriter()) to have the client's Update() call the
+// writer's, or call it yourself.
+// Its destructor waits for everything that has been queued to be written.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <pthread.h>
+#include <vector>
+
+#include "HttpLog.h"
+#include "HttpThreadOptions.h"
+
+class HttpDiskWriter {
+public:
+	// A file, as the writer sees it. Embedded in (or owned by) whatever is writing it, which must not destroy it
+	// while IsBusy(): see WaitFor().
+	class Stream {
+	public:
+		Stream() : m_state(IDLE), m_failed(0), m_opened(false), m_pWatcher(nullptr) { m_close.pStream = this; m_close.pData = nullptr; m_close.size = 0; }
+		virtual ~Stream() {}
+		// Data has been queued for the file (or its close, by Worker_Close()), and the writer hasn't closed it yet,
+		// or the app thread hasn't been told (by Update(), or WaitFor()):
+		bool IsBusy() const { return atomic::LoadAcquire(m_state) != IDLE; }
+		bool Worker_HasFailed() const { return atomic::LoadAcquire(m_failed) != 0; }
+
+		/////// Writer thread ///////
+		// Open the file, before its first block is written. Returns false if it can't be opened, after which the
+		// stream has failed: the rest of its blocks are dropped, and Worker_Write() returns false.
+		virtual bool Writer_Open() = 0;
+		// Returns false if the data couldn't all be written, after which the stream has failed.
+		virtual bool Writer_Write(const char* pData, size_t size) = 0;
+		// Once its blocks have all been written: close the file (if it was opened), and put it in its place.
+		// failed is whether the stream has failed.
+		virtual void Writer_Close(bool failed) = 0;
+
+		/////// App thread ///////
+		// Called by Update() once Writer_Close() has returned, if Watch() was called. abandoned is true if it is
+		// called by the writer's destructor instead.
+		virtual void HandleWritten(bool abandoned) {}
+
+	private:
+		friend class HttpDiskWriter;
+		enum State {
+			IDLE,
+			QUEUED, // Set by a worker, with the first block (or the close) that it queues
+			CLOSED // Set by the writer thread, after Writer_Close()
+		};
+		struct Block {
+			Stream* pStream;
+			char* pData; // nullptr for a stream's close
+			size_t size;
+			Block* pNext;
+		};
+		volatile int m_state; // A State
+		volatile int m_failed; // Written by the writer thread
+		bool m_opened; // Writer thread only
+		Block m_close; // Queued by Worker_Close()
+		HttpDiskWriter* m_pWatcher; // App thread only: see Watch()
+		Stream(const Stream&);
+		Stream& operator=(const Stream&);
+	};
+
+	// numBuffers of bufferSize bytes each: all the data that may be waiting to be written at once. options: as
+	// for HttpClient::SetThreadOptions(). The thread is spawned straight away; throws std::runtime_error if it
+	// can't be, or the buffers can't be allocated.
+	HttpDiskWriter(uint numBuffers = 8, size_t bufferSize = 256 * 1024, const HttpThreadOptions& options = HttpThreadOptions());
+	~HttpDiskWriter();
+
+	// Call HandleWritten() for each watched stream that has been closed since the last call. Called by
+	// HttpClient::Update() if the writer is attached to the client.
+	void Update();
+	// Have Update() tell stream (with HandleWritten()) once it has been closed. It must be busy.
+	void Watch(Stream& stream);
+	// For the app thread, before it reuses or destroys a stream that may still be busy: wait for the writer to
+	// close it, if a worker has queued anything for it (without calling HandleWritten()). Only ever blocks if the
+	// stream was abandoned before it was finished, e.g. a download was requeued, or dropped while it was still
+	// being written.
+	static void WaitFor(Stream& stream);
+
+	uint GetNumBuffers() const { return NUM_BUFFERS; }
+	size_t GetBufferSize() const { return BUFFER_SIZE; }
+	size_t GetQueuedBytes() const { return atomic::LoadRelaxed(m_queuedBytes); } // Waiting to be written
+
+	/////// Worker threads (any of them, or the app thread) ///////
+	// Copy size bytes into the writer's buffers (waiting for one, if none are free) and queue them to be written to
+	// stream. Returns false if the stream has failed.
+	bool Worker_Write(Stream& stream, const void* pData, size_t size);
+	// Queue the close of stream, once the data already queued for it have been written; Writer_Close() is called
+	// then, even if nothing was.
+	void Worker_Close(Stream& stream);
+	// All of the buffers are waiting to be written, so the next Worker_Write() would wait for the disk:
+	bool Worker_IsFull() const { return atomic::LoadAcquire(m_numFree) == 0; }
+
+private:
+	typedef Stream::Block Block;
+	const uint NUM_BUFFERS;
+	const size_t BUFFER_SIZE;
+	const HttpThreadOptions m_threadOptions;
+	Block* m_blocks; // In the app's memory; their buffers are in the worker memory environment
+	pthread_t m_thread;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_wakeCond; // For the thread: something has been queued
+	pthread_cond_t m_freeCond; // For the workers: a buffer has been written
+	// Guarded by m_mutex:
+	Block* m_pFirst; // Queued, the oldest first
+	Block* m_pLast;
+	Block* m_pFree;
+	bool m_quit;
+	volatile uint m_numFree;
+	volatile size_t m_queuedBytes;
+	std::vector<Stream*> m_watched; // App thread only
+	volatile uint m_logPending;
+	HttpLogRing m_log;
+
+	void Queue(Block* pBlock); // With m_mutex held
+	void Thread_Run();
+	static void* ThreadMain(void* pWriter);
+	static void* AllocateBuffers(void* pWriter);
+	static void* FreeBuffers(void* pWriter);
+	HttpDiskWriter(const HttpDiskWriter&);
+	HttpDiskWriter& operator=(const HttpDiskWriter&);
+};
@@ -0,0 +1,215 @@
+// HttpDownloadJournal:
+// A record, on an s3e drive, of the downloads that an HttpDownloader has queued and not yet finished.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpDownloadJournal.h"
+
+#include <string.h>
+#include <stdexcept>
+#include <zlib.h>
+#include "util/iohelpers.h"
+
+using std::string;
+
+///////////////////////////////////////////////////////////////////////////////
+// The journal: "HDJ1", then records of
+//   a 32-bit payload length, the payload's 32-bit CRC-32, and the payload, which is either
+//   'A', the download's 64-bit ID, its 32-bit priority, and its url and destFile, or
+//   'R' and a 64-bit ID: that download is done with.
+// Numbers are in the device's own byte order (the journal never leaves the device); strings are a 32-bit
+// length followed by their bytes.
+
+static const char HTTP_DOWNLOAD_JOURNAL_MAGIC[4] = { 'H', 'D', 'J', '1' };
+
+static void HttpDownloadJournal_PutU32(string& out, uint32 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpDownloadJournal_PutU64(string& out, uint64 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpDownloadJournal_PutString(string& out, const string& value) {
+	HttpDownloadJournal_PutU32(out, (uint32)value.size());
+	out.append(value);
+}
+
+static string HttpDownloadJournal_AddRecord(const HttpDownloadJournal::Entry& entry) {
+	string payload;
+	payload.reserve(1 + 8 + 4 + 8 + entry.url.size() + entry.destFile.size());
+	payload.append(1, 'A');
+	HttpDownloadJournal_PutU64(payload, entry.id);
+	HttpDownloadJournal_PutU32(payload, (uint32)entry.priority);
+	HttpDownloadJournal_PutString(payload, entry.url);
+	HttpDownloadJournal_PutString(payload, entry.destFile);
+	return payload;
+}
+
+// Append a record, header and all, to out:
+static void HttpDownloadJournal_PutRecord(string& out, const string& payload) {
+	HttpDownloadJournal_PutU32(out, (uint32)payload.size());
+	HttpDownloadJournal_PutU32(out, (uint32)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)payload.data(), (uInt)payload.size()));
+	out.append(payload);
+}
+
+namespace {
+	class HttpDownloadJournalReader {
+	public:
+		HttpDownloadJournalReader(const char* pData, size_t size) : m_p(pData), m_pEnd(pData + size) {}
+		bool AtEnd() const { return m_p == m_pEnd; }
+		void Read(void* pDest, size_t size) { memcpy(pDest, Skip(size), size); }
+		uint32 ReadU32() { uint32 value; Read(&value, sizeof(value)); return value; }
+		uint64 ReadU64() { uint64 value; Read(&value, sizeof(value)); return value; }
+		string ReadString() { const uint32 length = ReadU32(); const char* p_data = Skip(length); return string(p_data, length); }
+		const char* Skip(size_t size) {
+			if ((size_t)(m_pEnd - m_p) < size)
+				throw std::runtime_error("truncated");
+			const char* p = m_p;
+			m_p += size;
+			return p;
+		}
+	private:
+		const char* m_p;
+		const char* m_pEnd;
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpDownloadJournal:
+
+HttpDownloadJournal::HttpDownloadJournal(const string& journalPath)
+	: m_journalPath(journalPath), m_nextId(1), m_pJournal(nullptr), m_numJournalEntries(0)
+{
+	Load();
+}
+
+HttpDownloadJournal::~HttpDownloadJournal() {
+	if (m_pJournal)
+		s3eFileClose(m_pJournal);
+}
+
+uint64 HttpDownloadJournal::Add(const string& url, const string& destFile, HttpRequest::Priority priority) {
+	Entry entry;
+	entry.id = m_nextId++;
+	entry.url = url;
+	entry.destFile = destFile;
+	entry.priority = priority;
+	AppendRecord(HttpDownloadJournal_AddRecord(entry));
+	m_numJournalEntries++;
+	m_entries.push_back(std::move(entry));
+	return m_entries.back().id;
+}
+
+void HttpDownloadJournal::Remove(uint64 id) {
+	size_t i = 0;
+	while (i < m_entries.size() && m_entries[i].id != id)
+		i++;
+	if (i == m_entries.size())
+		return;
+	m_entries.erase(m_entries.begin() + i);
+	string payload(1, 'R');
+	HttpDownloadJournal_PutU64(payload, id);
+	AppendRecord(payload);
+	if (m_entries.empty() || m_numJournalEntries - m_entries.size() > 2 * m_entries.size() + 16)
+		RewriteJournal(); // Mostly finished downloads by now
+}
+
+void HttpDownloadJournal::AppendRecord(const string& payload) {
+	if (!m_pJournal) {
+		m_pJournal = s3eFileOpen(m_journalPath.c_str(), "ab");
+		if (!m_pJournal) {
+			s3eDebugTracePrintf("HttpDownloadJournal: Unable to open %s; downloads won't be resumed if the app exits before they finish", m_journalPath.c_str());
+			return;
+		}
+		if (s3eFileGetSize(m_pJournal) == 0)
+			s3eFileWrite(HTTP_DOWNLOAD_JOURNAL_MAGIC, 1, sizeof(HTTP_DOWNLOAD_JOURNAL_MAGIC), m_pJournal);
+	}
+	string record;
+	record.reserve(8 + payload.size());
+	HttpDownloadJournal_PutRecord(record, payload);
+	if (s3eFileWrite(record.data(), 1, record.size(), m_pJournal) != record.size() || s3eFileFlush(m_pJournal) != S3E_RESULT_SUCCESS)
+		s3eDebugTracePrintf("HttpDownloadJournal: Unable to write to %s", m_journalPath.c_str());
+}
+
+void HttpDownloadJournal::RewriteJournal() {
+	if (m_pJournal) {
+		s3eFileClose(m_pJournal);
+		m_pJournal = nullptr;
+	}
+	if (m_entries.empty()) {
+		s3eFileDelete(m_journalPath.c_str()); // The next download starts a new one
+		m_numJournalEntries = 0;
+		return;
+	}
+	string data(HTTP_DOWNLOAD_JOURNAL_MAGIC, sizeof(HTTP_DOWNLOAD_JOURNAL_MAGIC));
+	for (auto it = m_entries.begin(); it != m_entries.end(); it++)
+		HttpDownloadJournal_PutRecord(data, HttpDownloadJournal_AddRecord(*it));
+	// Write a new journal and then replace the old one, so that a crash can't lose both:
+	const string tmp_path = m_journalPath + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+	const bool written = p_file && s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	if (p_file)
+		s3eFileClose(p_file);
+	if (written) {
+		s3eFileDelete(m_journalPath.c_str());
+		s3eFileRename(tmp_path.c_str(), m_journalPath.c_str());
+		m_numJournalEntries = m_entries.size();
+	} else {
+		// The old journal is still there, so nothing is lost: this is tried again after the next removal.
+		s3eDebugTracePrintf("HttpDownloadJournal: Unable to write %s", tmp_path.c_str());
+		s3eFileDelete(tmp_path.c_str());
+	}
+}
+
+void HttpDownloadJournal::Load() {
+	if (!IsFile(m_journalPath))
+		return;
+	bool damaged = false;
+	try {
+		const FileData data(m_journalPath.c_str());
+		HttpDownloadJournalReader in(data.Data(), data.Size());
+		char magic[sizeof(HTTP_DOWNLOAD_JOURNAL_MAGIC)];
+		in.Read(magic, sizeof(magic));
+		if (memcmp(magic, HTTP_DOWNLOAD_JOURNAL_MAGIC, sizeof(magic)) != 0)
+			throw std::runtime_error("not a journal");
+		while (!in.AtEnd()) {
+			HttpDownloadJournalReader record(nullptr, 0);
+			try {
+				const uint32 length = in.ReadU32();
+				const uint32 crc = in.ReadU32();
+				const char* p_payload = in.Skip(length);
+				if (!length || crc != (uint32)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)p_payload, (uInt)length))
+					throw std::runtime_error("bad checksum");
+				record = HttpDownloadJournalReader(p_payload, length);
+			} catch (const std::exception&) {
+				damaged = true; // e.g. the app died while appending it: everything before it is fine
+				break;
+			}
+			char kind;
+			record.Read(&kind, 1);
+			if (kind == 'A') {
+				Entry entry;
+				entry.id = record.ReadU64();
+				const uint32 priority = record.ReadU32();
+				entry.priority = priority < HttpRequest::NUM_PRIORITIES ? (HttpRequest::Priority)priority : HttpRequest::PRIORITY_NORMAL;
+				entry.url = record.ReadString();
+				entry.destFile = record.ReadString();
+				if (entry.id >= m_nextId)
+					m_nextId = entry.id + 1;
+				m_entries.push_back(std::move(entry));
+				m_numJournalEntries++;
+			} else if (kind == 'R') {
+				const uint64 id = record.ReadU64();
+				for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+					if (it->id == id) {
+						m_entries.erase(it);
+						break;
+					}
+				}
+			}
+		}
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpDownloadJournal: Ignoring damaged journal %s (%s)", m_journalPath.c_str(), e.what());
+		m_entries.clear();
+		damaged = true;
+	}
+	// Start from a clean journal, rather than appending after a damaged record or a pile of finished downloads:
+	if (damaged || m_numJournalEntries > m_entries.size())
+		RewriteJournal();
+}
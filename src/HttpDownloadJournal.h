@@ -0,0 +1,63 @@
+// HttpDownloadJournal:
+// A record, on an s3e drive, of the downloads that an HttpDownloader has
+// queued and not yet finished (see HttpDownloader::SetJournal()), so that if
+// the app is killed part way through, e.g. by the OS while it's in the
+// background, the next launch can queue them again. Each entry is a URL, the
+// file it goes to, and the priority it was queued at; the bytes that reached
+// the file, and the validator to resume it with, are kept beside the file by
+// the download itself (see HttpDownload::SetResumable()), so a resumed
+// download only asks for the rest.
+// The journal is a sequence of records, as HttpOutbox's is: each a length and
+// a CRC-32, followed by either a download or a note that one is done with.
+// Adding or removing a download costs one append; a record that a crash left
+// half written is ignored. The journal is rewritten without the finished
+// downloads once they make up most of it.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "HttpRequest.h"
+
+class HttpDownloadJournal {
+public:
+	struct Entry {
+		uint64 id; // Consecutive, in the order they were added
+		std::string url;
+		std::string destFile;
+		HttpRequest::Priority priority;
+	};
+
+	// journalPath (e.g. "cache://downloads.journal") is read, if it exists, and created when first needed.
+	explicit HttpDownloadJournal(const std::string& journalPath);
+	~HttpDownloadJournal();
+
+	// Note a download; returns its ID, for Remove().
+	uint64 Add(const std::string& url, const std::string& destFile, HttpRequest::Priority priority);
+	// The download is done with, one way or another:
+	void Remove(uint64 id);
+
+	// The downloads that haven't been removed, in the order they were added:
+	const std::vector<Entry>& GetEntries() const { return m_entries; }
+	size_t Size() const { return m_entries.size(); }
+	bool Empty() const { return m_entries.empty(); }
+	const std::string& GetPath() const { return m_journalPath; }
+
+private:
+	const std::string m_journalPath;
+	std::vector<Entry> m_entries; // By id
+	uint64 m_nextId;
+	s3eFile* m_pJournal; // Opened for appending when first needed
+	size_t m_numJournalEntries; // Download records in the journal, whether or not they are done with
+
+	void Load();
+	void AppendRecord(const std::string& payload);
+	void RewriteJournal(); // Without the downloads that are done with
+	HttpDownloadJournal(const HttpDownloadJournal&);
+	HttpDownloadJournal& operator=(const HttpDownloadJournal&);
+};
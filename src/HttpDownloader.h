@@ -1,41 +1,275 @@
 // HttpDownloader:
-// Equivalent to HttpClient, except this makes sure you don't try to
-// download the same file simultaneously.
+// A HttpClient for file downloads. Downloads of the same URL at the same
+// time share one transfer (HttpClient coalesces identical requests).
+// Prefetch() queues speculative downloads in a lane of their own, which is
+// only fed to the client once nothing else is waiting for a worker.
+// SetJournal() keeps a record of the downloads in progress on disk, so that
+// those the app was killed in the middle of are picked up again next launch.
 //
 // Created by the Get to Know Society
 // Public domain
 
 #pragma once
 
+#include <vector>
+
+#include "HttpArchiveDownload.h"
 #include "HttpClient.h"
+#include "HttpDownloadJournal.h"
+#include "HttpMemoryDownload.h"
+#include "HttpSegmentedDownload.h"
 
 class HttpDownloader : private HttpClient, public IObservable {
 public:
-	HttpDownloader(const char* userAgentStr, uint numWorkers = 3) : HttpClient(numWorkers, userAgentStr), m_activeDownloads() {} // Initialize
-	virtual ~HttpDownloader() { m_activeDownloads.clear(); }
-	
-	Ptr<HttpRequest> DownloadFile(std::string url, std::string destFile) {
-		if (m_activeDownloads.count(url))
-			return m_activeDownloads[url];
-		Ptr<HttpRequest> p_request = new HttpDownload(url, destFile);
-		QueueRequest(p_request, new HttpCallback<HttpDownloader>(this, &HttpDownloader::HandleDownloadDone));
-		m_activeDownloads[url] = p_request;
+	HttpDownloader(const char* userAgentStr, uint numWorkers = 3) : HttpClient(numWorkers, userAgentStr), m_maxPrefetches(2), m_pJournal(nullptr) {} // Initialize
+	virtual ~HttpDownloader() { delete m_pJournal; } // (Downloads still in the journal are resumed by the next one)
+	
+	// Downloads of a URL that is already being downloaded share its transfer (see HttpRequest::SetCoalesce()),
+	// even if they are saving it to a different destFile: each file gets written as the data arrives.
+	// If resumable is set, a download that fails part way through continues where it left off
+	// the next time the same file is downloaded (see HttpDownload::SetResumable()). Resumable
+	// downloads always have a transfer of their own.
+	// A download that was prefetched (see Prefetch()) to the same destFile is promoted instead: it is
+	// queued, or kept going, at PRIORITY_NORMAL, and returned.
+	// With a journal (see SetJournal()), every download is resumable, and is journaled until it finishes.
+	Ptr<HttpRequest> DownloadFile(std::string url, std::string destFile, bool resumable = false) {
+		if (m_pJournal)
+			resumable = true;
+		Ptr<HttpRequest> p_request = PromotePrefetch(url, destFile, resumable);
+		if (!p_request) {
+			HttpDownload* p_download = new HttpDownload(url, destFile);
+			p_download->SetResumable(resumable);
+			p_request = p_download;
+			QueueRequest(p_request);
+		}
+		if (m_pJournal)
+			Journal(p_request, url, destFile);
 		return p_request;
 	}
 	
-	void Update() { HttpClient::Update(); }
+	// Journal:
+	// Keep a journal of the downloads that DownloadFile() queues in journalPath (e.g. "cache://downloads.journal";
+	// see HttpDownloadJournal), until each has finished, so that if the app is killed (e.g. by the OS while it's in
+	// the background) before they have, a later HttpDownloader that is given the same journal picks them up again.
+	// Those it finds in it are queued straight away, at the priority they were queued at, and returned. As journaled
+	// downloads are resumable (see HttpDownload::SetResumable()), each only asks the server for what its partial
+	// file is missing. Update() takes a download out of the journal once it is DONE or CANCELLED, or has failed
+	// with a response that another try won't change (e.g. 404); one that the network or the server (5xx, 408, 429)
+	// failed stays in it for the next launch. Set it before anything is downloaded, and only once.
+	std::vector< Ptr<HttpRequest> > SetJournal(const std::string& journalPath) {
+		IwAssert(HTTP_CLIENT, !m_pJournal);
+		m_pJournal = new HttpDownloadJournal(journalPath);
+		std::vector< Ptr<HttpRequest> > resumed;
+		const std::vector<HttpDownloadJournal::Entry> entries = m_pJournal->GetEntries();
+		for (auto it = entries.begin(); it != entries.end(); it++) {
+			HttpDownload* p_download = new HttpDownload(it->url, it->destFile);
+			p_download->SetResumable(true);
+			p_download->SetPriority(it->priority);
+			JournaledItem item;
+			item.id = it->id;
+			item.pRequest = p_download;
+			m_journaled.push_back(item);
+			resumed.push_back(item.pRequest);
+			QueueRequest(item.pRequest);
+		}
+		if (!resumed.empty())
+			s3eDebugTracePrintf("HttpDownloader: Resuming %u downloads from %s", (uint)resumed.size(), journalPath.c_str());
+		return resumed;
+	}
+	HttpDownloadJournal* GetJournal() const { return m_pJournal; }
+	
+	// Like DownloadFile(), but large files are fetched over up to numSegments connections at once
+	// (see HttpSegmentedDownload). Best used with numWorkers >= numSegments. Don't have two segmented
+	// downloads to the same destFile in progress at once, as each writes its segments into the same .tmp file.
+	Ptr<HttpRequest> DownloadFileSegmented(std::string url, std::string destFile, uint numSegments = 4) {
+		Ptr<HttpRequest> p_request = new HttpSegmentedDownload(*this, url, destFile, numSegments);
+		QueueRequest(p_request);
+		return p_request;
+	}
 	
-	void HandleDownloadDone(Ptr<HttpRequest> pRequest) {
-		// Whether the download succeeded or failed, we remove it from the list of active
-		// downloads:
-		for (auto it = m_activeDownloads.begin(); it != m_activeDownloads.end(); it++) {
-			if (it->second == pRequest) {
-				m_activeDownloads.erase(it);
-				break;
-			}
+	// Download into memory instead (e.g. for a texture): once it's DONE, the request's GetBuffer() has the body.
+	Ptr<HttpMemoryDownload> DownloadToMemory(std::string url) {
+		Ptr<HttpMemoryDownload> p_download = new HttpMemoryDownload(url);
+		QueueRequest(p_download.ptr());
+		return p_download;
+	}
+	
+	// Download a zip, tar or tar.gz and extract it into destFolder as it arrives (see HttpArchiveDownload):
+	Ptr<HttpArchiveDownload> DownloadArchive(std::string url, std::string destFolder) {
+		Ptr<HttpArchiveDownload> p_download = new HttpArchiveDownload(url, destFolder);
+		QueueRequest(p_download.ptr());
+		return p_download;
+	}
+	
+	// Prefetch:
+	// Download url to destFile ahead of time, e.g. the assets of the screens the user is likely to open next.
+	// Prefetches wait in a lane of their own, PREFETCH_SOON ones first, and Update() only hands one to the
+	// client when no other request is waiting for a worker, fewer than SetMaxPrefetches() are in progress, and
+	// the network profile (see SetNetworkProfiles()) allows background transfers; they are then sent at
+	// PRIORITY_BACKGROUND, so they can be preempted too. If DownloadFile() later asks for the same url and
+	// destFile, the prefetch becomes an ordinary download: one still waiting is queued right away, and one in
+	// progress carries on at PRIORITY_NORMAL. A later DownloadFile() of a url that has been prefetched to a
+	// different file follows the prefetch's transfer, which is promoted for it. Prefetching a url that is
+	// already in the lane changes nothing.
+	enum PrefetchHint {
+		PREFETCH_SOON,  // Likely to be wanted shortly
+		PREFETCH_LATER, // Might be wanted
+		NUM_PREFETCH_HINTS
+	};
+	Ptr<HttpRequest> Prefetch(std::string url, std::string destFile, PrefetchHint hint = PREFETCH_SOON) {
+		IwAssert(HTTP_CLIENT, hint >= 0 && hint < NUM_PREFETCH_HINTS);
+		if (PrefetchItem* p_item = FindPrefetch(url))
+			return p_item->pRequest;
+		PrefetchItem item;
+		item.url = url;
+		item.destFile = destFile;
+		item.pRequest = new HttpDownload(url, destFile);
+		m_prefetchLane[hint].push_back(item);
+		return item.pRequest;
+	}
+	// Forget the prefetches that are still waiting, and abort those in progress (except those DownloadFile() promoted),
+	// e.g. when the user leaves the screen they were for:
+	void ClearPrefetches() {
+		for (uint i = 0; i < NUM_PREFETCH_HINTS; i++)
+			m_prefetchLane[i].clear();
+		for (auto it = m_prefetching.begin(); it != m_prefetching.end(); it++) {
+			if (it->pRequest->GetPriority() == HttpRequest::PRIORITY_BACKGROUND)
+				it->pRequest->Abort();
 		}
+		m_prefetching.clear();
 	}
+	// How many prefetches may be in progress at once (default 2), within what the network profile allows:
+	void SetMaxPrefetches(uint maxPrefetches) { m_maxPrefetches = maxPrefetches; }
+	uint GetNumPrefetchesWaiting() const { return (uint)(m_prefetchLane[PREFETCH_SOON].size() + m_prefetchLane[PREFETCH_LATER].size()); }
 	
+	void Update() {
+		HttpClient::Update();
+		if (m_pJournal)
+			UpdateJournal();
+		StartPrefetches();
+	}
+	using HttpClient::QueueRequests; // e.g. for a batch of HttpDownloads (see HttpAssetSync)
+	using HttpClient::SetBandwidthLimit; // e.g. to keep prefetching from crowding out an app's API calls
+	using HttpClient::SetNetworkProfiles;
+	using HttpClient::SetNetworkProfile;
+	using HttpClient::SetNegativeCacheTtl; // e.g. for optional files that mostly don't exist
+	using HttpClient::ForgetMissing;
+
 private:
-	std::map<std::string, Ptr<HttpRequest> > m_activeDownloads;
+	struct PrefetchItem {
+		std::string url;
+		std::string destFile;
+		Ptr<HttpRequest> pRequest;
+	};
+	std::vector<PrefetchItem> m_prefetchLane[NUM_PREFETCH_HINTS]; // Waiting, in the order they were asked for
+	std::vector<PrefetchItem> m_prefetching; // Queued by StartPrefetches(), until they finish or are promoted
+	uint m_maxPrefetches;
+	struct JournaledItem {
+		uint64 id;
+		Ptr<HttpRequest> pRequest;
+	};
+	HttpDownloadJournal* m_pJournal; // Owned, or nullptr
+	std::vector<JournaledItem> m_journaled; // In the journal, until they finish
+	
+	void Journal(const Ptr<HttpRequest>& pRequest, const std::string& url, const std::string& destFile) {
+		for (auto it = m_journaled.begin(); it != m_journaled.end(); it++) {
+			if (it->pRequest == pRequest)
+				return; // e.g. a download that was resumed from the journal, asked for again
+		}
+		JournaledItem item;
+		item.id = m_pJournal->Add(url, destFile, pRequest->GetPriority());
+		item.pRequest = pRequest;
+		m_journaled.push_back(item);
+	}
+	
+	void UpdateJournal() {
+		for (auto it = m_journaled.begin(); it != m_journaled.end(); ) {
+			const HttpRequest::Status status = it->pRequest->GetStatus();
+			if (status < HttpRequest::DONE) {
+				it++;
+				continue;
+			}
+			bool retry = false; // At the next launch
+			if (status == HttpRequest::ERROR) {
+				const int http_status_code = static_cast<HttpDownload*>(it->pRequest.ptr())->GetHttpStatusCode();
+				retry = http_status_code == 0 || http_status_code >= 500 || http_status_code == 408 || http_status_code == 429;
+			}
+			if (!retry)
+				m_pJournal->Remove(it->id);
+			it = m_journaled.erase(it);
+		}
+	}
+	
+	PrefetchItem* FindPrefetch(const std::string& url) {
+		for (auto it = m_prefetching.begin(); it != m_prefetching.end(); it++) {
+			if (it->url == url)
+				return &*it;
+		}
+		for (uint i = 0; i < NUM_PREFETCH_HINTS; i++) {
+			for (auto it = m_prefetchLane[i].begin(); it != m_prefetchLane[i].end(); it++) {
+				if (it->url == url)
+					return &*it;
+			}
+		}
+		return nullptr;
+	}
+	
+	// The prefetch that DownloadFile() can use instead of a download of its own, promoted to PRIORITY_NORMAL, or nullptr.
+	Ptr<HttpRequest> PromotePrefetch(const std::string& url, const std::string& destFile, bool resumable) {
+		for (auto it = m_prefetching.begin(); it != m_prefetching.end(); it++) {
+			if (it->url != url)
+				continue;
+			Ptr<HttpRequest> p_request = it->pRequest;
+			const std::string prefetch_dest_file = it->destFile;
+			m_prefetching.erase(it);
+			if (p_request->GetStatus() >= HttpRequest::DONE)
+				return nullptr; // Finished (or failed) already: download it as usual
+			if (p_request->GetPriority() < HttpRequest::PRIORITY_NORMAL)
+				p_request->SetPriority(HttpRequest::PRIORITY_NORMAL);
+			// A download to another file coalesces with it (unless it is resumable), so keeping it going is enough
+			return destFile == prefetch_dest_file ? p_request : nullptr;
+		}
+		for (uint i = 0; i < NUM_PREFETCH_HINTS; i++) {
+			for (auto it = m_prefetchLane[i].begin(); it != m_prefetchLane[i].end(); it++) {
+				if (it->url != url)
+					continue;
+				if (it->destFile != destFile) {
+					m_prefetchLane[i].erase(it); // Wanted somewhere else after all
+					return nullptr;
+				}
+				Ptr<HttpRequest> p_request = it->pRequest;
+				m_prefetchLane[i].erase(it);
+				static_cast<HttpDownload*>(p_request.ptr())->SetResumable(resumable);
+				QueueRequest(p_request);
+				return p_request;
+			}
+		}
+		return nullptr;
+	}
+	
+	void StartPrefetches() {
+		for (auto it = m_prefetching.begin(); it != m_prefetching.end(); ) {
+			if (it->pRequest->GetStatus() >= HttpRequest::DONE)
+				it = m_prefetching.erase(it);
+			else
+				it++;
+		}
+		const NetworkProfile& profile = GetNetworkProfile();
+		const uint max_prefetches = m_maxPrefetches < profile.maxBackgroundTransfers ? m_maxPrefetches : profile.maxBackgroundTransfers;
+		if (GetNetworkType() == NETWORK_NONE || m_prefetching.size() >= max_prefetches)
+			return;
+		if (GetStats().numPending)
+			return; // Foreground requests (or the last prefetch) are still waiting for a worker
+		for (uint i = 0; i < NUM_PREFETCH_HINTS; i++) {
+			if (m_prefetchLane[i].empty())
+				continue;
+			// One at a time, so that a foreground request queued in the meantime never waits behind a burst of them
+			PrefetchItem item = m_prefetchLane[i].front();
+			m_prefetchLane[i].erase(m_prefetchLane[i].begin());
+			item.pRequest->SetPriority(HttpRequest::PRIORITY_BACKGROUND);
+			QueueRequest(item.pRequest);
+			m_prefetching.push_back(item);
+			return;
+		}
+	}
 };
@@ -0,0 +1,33 @@
+// HttpEventLoop:
+// The app's side of HttpClient::SetExternalEventLoop(): an event loop of the
+// app's own (e.g. an epoll or select loop that already serves other sockets)
+// that drives an ENGINE_MULTI client's transfers in place of its I/O threads.
+// The client tells the loop which sockets to watch, and for what, and when to
+// call it back if nothing happens; the loop calls HttpClient::Io_HandleSocket()
+// for each socket that becomes ready and Io_HandleTimeout() once the timeout
+// has passed. HTTP traffic then needs no threads of its own at all.
+// Every method is called on the loop's thread, from within the client's Io_
+// methods. The loop mustn't call those from within these.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+class HttpEventLoop {
+public:
+	// What a socket is watched for, and what it was found ready for:
+	enum {
+		EVENT_IN = 1,
+		EVENT_OUT = 2,
+		EVENT_ERROR = 4 // Only ever reported by the loop (e.g. for POLLERR or POLLHUP)
+	};
+	virtual ~HttpEventLoop() {}
+
+	// Watch fd for events (EVENT_IN, EVENT_OUT or both), in place of what it was watched for before, or stop
+	// watching it if events is 0:
+	virtual void WatchSocket(int fd, int events) = 0;
+	// Call HttpClient::Io_HandleTimeout() once timeoutMs have passed (0 for as soon as possible), unless the client
+	// sets another timeout first; -1 for no timeout:
+	virtual void SetTimeout(long timeoutMs) = 0;
+};
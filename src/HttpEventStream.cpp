@@ -0,0 +1,336 @@
+// HttpEventStream:
+// A subscription to a server-sent event stream, with the frames parsed on the worker.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpEventStream.h"
+
+#include <string.h>
+#include <IwMath.h>
+#include <s3eTimer.h>
+
+#include "HttpClient.h"
+
+using std::string;
+
+namespace {
+	// What the worker publishes for each event (or for fields that don't dispatch one, such as an "id:" on its
+	// own), followed by the type, the ID and the data, each NUL-terminated:
+	struct HttpEventStream_Frame {
+		uint32 typeSize;
+		uint32 dataSize;
+		int32 idSize; // -1 if the event had no "id:" field
+		int32 retryMs; // -1 if it had no "retry:" field
+		uint32 dispatch; // It had "data:", so it is an event for the app
+	};
+}
+
+// The GET that the events arrive on. The worker turns the text into frames, and hands those on to the
+// HttpStreamRequest as its chunks, so that each run in the queue holds whole events.
+class HttpEventStream::Connection : public HttpStreamRequest {
+public:
+	Connection(HttpEventStream& stream, const string& url) :
+		HttpStreamRequest(url, STREAM_CHUNKS), m_pStream(&stream), m_maxEventSize(stream.m_maxEventSize), m_httpStatusCode(0),
+		m_accepted(false), m_firstLine(true), m_skipLF(false), m_hasData(false), m_hasId(false), m_retryMs(-1), m_tooBig(false)
+	{
+		SetHeaders(stream.m_headers);
+		SetHeader("Accept", "text/event-stream");
+		SetHeader("Cache-Control", "no-cache");
+		if (!stream.m_lastEventId.empty())
+			SetHeader("Last-Event-ID", stream.m_lastEventId);
+		SetAcceptedContentTypes("text/event-stream");
+		SetUseCache(false);
+		SetMaxRetries(0); // We reconnect ourselves, after the server's retry time
+		HttpClientConfig overrides = HttpClientConfig::Overrides();
+		overrides.lowSpeedTimeS = 0; // Events may be minutes apart
+		overrides.coalesceBytes = 0; // Each event as soon as it arrives
+		SetConfigOverrides(overrides);
+	}
+
+	void Close() { m_pStream = nullptr; Abort(); }
+	int GetHttpStatusCode() const { return m_httpStatusCode; }
+
+	virtual void HandleRequestStart() {
+		m_accepted = false;
+		HttpStreamRequest::HandleRequestStart();
+	}
+	virtual void HandleResponseHeaders(const HttpHeaders& headers) {
+		HttpStreamRequest::HandleResponseHeaders(headers);
+		if (m_accepted && m_pStream)
+			m_pStream->HandleOpen();
+	}
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		m_httpStatusCode = httpStatusCode;
+		HttpStreamRequest::HandleResponse(success, httpStatusCode);
+	}
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+		// (Not called for a response that isn't text/event-stream, which is rejected)
+		m_accepted = httpStatusCode == 200;
+		HttpStreamRequest::Worker_HandleResponseHeaders(headers, httpStatusCode);
+	}
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
+	virtual void Worker_HandleDone(bool success, int httpStatusCode) {
+		if (success && m_accepted && m_retryMs >= 0) {
+			// A "retry:" field counts as soon as it has been read, even if its event never ended
+			m_hasData = m_hasId = false;
+			Worker_AddFrame();
+			HttpStreamRequest::Worker_HandleData(reinterpret_cast<const unsigned char*>(m_frames.data()), m_frames.size());
+		}
+		HttpStreamRequest::Worker_HandleDone(success, httpStatusCode);
+	}
+	virtual void Worker_HandleCleanup() {
+		// (Worker memory, so it must be freed here, not by our destructor on the app thread)
+		string().swap(m_line);
+		string().swap(m_type);
+		string().swap(m_data);
+		string().swap(m_id);
+		string().swap(m_frames);
+		m_firstLine = true;
+		m_skipLF = m_hasData = m_hasId = m_tooBig = false;
+		m_retryMs = -1;
+		HttpStreamRequest::Worker_HandleCleanup();
+	}
+
+protected:
+	virtual void HandleRecord(const char* pData, size_t size);
+
+private:
+	HttpEventStream* m_pStream; // Until Close()
+	const size_t m_maxEventSize;
+	int m_httpStatusCode;
+	volatile bool m_accepted; // Set by the worker when the headers are in: the response is the stream
+	// The worker's state, carried from one chunk of the response to the next:
+	string m_line; // A line that the chunks so far haven't finished
+	bool m_firstLine; // Which may start with a BOM
+	bool m_skipLF; // The last chunk ended with a CR, so an LF at the start of this one is part of that line break
+	// The event being read:
+	string m_type;
+	string m_data;
+	string m_id;
+	bool m_hasData;
+	bool m_hasId;
+	int m_retryMs;
+	bool m_tooBig; // More than m_maxEventSize: the connection is dropped
+	string m_frames; // Those that the latest chunk finished
+
+	void Worker_HandleLine(const char* pLine, size_t length);
+	void Worker_AddFrame();
+};
+
+size_t HttpEventStream::Connection::Worker_HandleData(const unsigned char* contents, size_t size) {
+	if (!m_accepted)
+		return HttpStreamRequest::Worker_HandleData(contents, size); // (An error page, which it discards)
+	m_frames.clear();
+	const char* p = reinterpret_cast<const char*>(contents);
+	const char* const p_end = p + size;
+	if (m_skipLF && p < p_end) {
+		if (*p == '\n')
+			p++;
+		m_skipLF = false;
+	}
+	while (p < p_end && !m_tooBig) {
+		const char* p_break = p;
+		while (p_break < p_end && *p_break != '\n' && *p_break != '\r')
+			p_break++;
+		if (p_break == p_end) {
+			// The rest of the line is in the chunks to come
+			m_line.append(p, p_end - p);
+			m_tooBig = m_line.size() > m_maxEventSize;
+			break;
+		}
+		if (m_line.empty()) {
+			Worker_HandleLine(p, p_break - p); // (Straight from the chunk, the usual case)
+		} else {
+			m_line.append(p, p_break - p);
+			Worker_HandleLine(m_line.data(), m_line.size());
+			m_line.clear();
+		}
+		if (*p_break == '\r') {
+			if (p_break + 1 == p_end)
+				m_skipLF = true;
+			else if (p_break[1] == '\n')
+				p_break++;
+		}
+		p = p_break + 1;
+	}
+	if (m_tooBig) {
+		s3eDebugTracePrintf("HttpEventStream: an event from %s is over %u bytes; dropping the connection", GetURL().c_str(), (uint)m_maxEventSize);
+		return 0;
+	}
+	if (m_frames.empty())
+		return size;
+	return HttpStreamRequest::Worker_HandleData(reinterpret_cast<const unsigned char*>(m_frames.data()), m_frames.size()) == m_frames.size() ? size : 0;
+}
+
+void HttpEventStream::Connection::Worker_HandleLine(const char* pLine, size_t length) {
+	if (m_firstLine) {
+		m_firstLine = false;
+		if (length >= 3 && memcmp(pLine, "\xEF\xBB\xBF", 3) == 0) {
+			pLine += 3;
+			length -= 3;
+		}
+	}
+	if (!length) {
+		// The end of the event:
+		if (m_hasData || m_hasId || m_retryMs >= 0)
+			Worker_AddFrame();
+		m_type.clear();
+		m_data.clear();
+		m_hasData = m_hasId = false;
+		m_retryMs = -1;
+		return;
+	}
+	if (pLine[0] == ':')
+		return; // A comment, e.g. a keep-alive
+	const char* p_colon = static_cast<const char*>(memchr(pLine, ':', length));
+	const size_t name_length = p_colon ? p_colon - pLine : length;
+	const char* p_value = p_colon ? p_colon + 1 : pLine + length;
+	if (p_value < pLine + length && *p_value == ' ')
+		p_value++;
+	const size_t value_length = pLine + length - p_value;
+	if (name_length == 4 && memcmp(pLine, "data", 4) == 0) {
+		if (m_hasData)
+			m_data.append(1, '\n');
+		m_data.append(p_value, value_length);
+		m_hasData = true;
+		m_tooBig = m_data.size() > m_maxEventSize;
+	} else if (name_length == 5 && memcmp(pLine, "event", 5) == 0) {
+		m_type.assign(p_value, value_length);
+	} else if (name_length == 2 && memcmp(pLine, "id", 2) == 0) {
+		if (!memchr(p_value, '\0', value_length)) {
+			m_id.assign(p_value, value_length);
+			m_hasId = true;
+		}
+	} else if (name_length == 5 && memcmp(pLine, "retry", 5) == 0) {
+		// Only a whole number of ms counts:
+		int retry_ms = value_length ? 0 : -1;
+		for (size_t i = 0; i < value_length && retry_ms >= 0; i++)
+			retry_ms = p_value[i] >= '0' && p_value[i] <= '9' ? MIN(retry_ms * 10 + (p_value[i] - '0'), (int)MAX_RECONNECT_DELAY_MS) : -1;
+		if (retry_ms >= 0)
+			m_retryMs = retry_ms;
+	}
+	// (Any other field is ignored)
+}
+
+void HttpEventStream::Connection::Worker_AddFrame() {
+	HttpEventStream_Frame frame;
+	frame.typeSize = (uint32)m_type.size();
+	frame.dataSize = m_hasData ? (uint32)m_data.size() : 0;
+	frame.idSize = m_hasId ? (int32)m_id.size() : -1;
+	frame.retryMs = m_retryMs;
+	frame.dispatch = m_hasData;
+	m_frames.append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+	m_frames.append(m_type).append(1, '\0');
+	if (m_hasId)
+		m_frames.append(m_id);
+	m_frames.append(1, '\0');
+	if (m_hasData)
+		m_frames.append(m_data);
+	m_frames.append(1, '\0');
+}
+
+void HttpEventStream::Connection::HandleRecord(const char* pData, size_t size) {
+	const char* const p_end = pData + size;
+	while (pData < p_end && m_pStream && !IsAborted()) {
+		HttpEventStream_Frame frame;
+		memcpy(&frame, pData, sizeof(frame));
+		const char* p_type = pData + sizeof(frame);
+		const char* p_id = p_type + frame.typeSize + 1;
+		const char* p_data = p_id + (frame.idSize >= 0 ? frame.idSize : 0) + 1;
+		pData = p_data + frame.dataSize + 1;
+		m_pStream->HandleFrame(p_type, frame.idSize >= 0 ? p_id : nullptr, frame.retryMs, frame.dispatch != 0, p_data, frame.dataSize);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpEventStream:
+
+HttpEventStream::HttpEventStream(HttpClient& client, const string& url) :
+	m_client(client), m_url(url), m_maxEventSize(1024 * 1024), m_state(CLOSED), m_retryMs(DEFAULT_RETRY_MS), m_numFailures(0), m_reconnectAtMs(0),
+	m_failed(false), m_httpStatusCode(0), m_numConnections(0), m_numEvents(0) {}
+
+HttpEventStream::~HttpEventStream() {
+	Close();
+}
+
+void HttpEventStream::Open() {
+	if (m_state != CLOSED)
+		return;
+	m_failed = false;
+	m_numFailures = 0;
+	Connect();
+}
+
+void HttpEventStream::Close() {
+	if (m_pConnection) {
+		m_pConnection->Close(); // (Its callback is guarded by this, and ignores it anyway once it isn't m_pConnection)
+		m_pConnection = nullptr;
+	}
+	m_state = CLOSED;
+	m_reconnectAtMs = 0;
+}
+
+void HttpEventStream::Update() {
+	if (m_state != WAITING || (m_reconnectAtMs && (uint64)s3eTimerGetMs() < m_reconnectAtMs))
+		return;
+	Connect();
+}
+
+void HttpEventStream::Connect() {
+	m_state = CONNECTING;
+	m_reconnectAtMs = 0;
+	m_numConnections++;
+	m_pConnection = new Connection(*this, m_url);
+	m_client.QueueRequest(m_pConnection.ptr(), this, &HttpEventStream::HandleConnectionDone);
+}
+
+void HttpEventStream::HandleOpen() {
+	m_state = OPEN;
+	m_numFailures = 0;
+}
+
+void HttpEventStream::HandleFrame(const char* type, const char* id, int retryMs, bool dispatch, const char* data, size_t dataSize) {
+	if (id)
+		m_lastEventId = id;
+	if (retryMs >= 0)
+		m_retryMs = (uint)retryMs;
+	if (!dispatch)
+		return;
+	m_numEvents++;
+	if (!m_eventCallback)
+		return;
+	Event event;
+	event.type = *type ? type : "message";
+	event.data = data;
+	event.dataSize = dataSize;
+	event.lastEventId = m_lastEventId.c_str();
+	m_eventCallback(this, event); // (Last, as it may destroy us)
+}
+
+void HttpEventStream::HandleConnectionDone(Ptr<HttpRequest> pRequest) {
+	if (pRequest.ptr() != m_pConnection.ptr())
+		return; // One that we have closed
+	Connection* p_connection = m_pConnection.ptr();
+	const bool opened = m_state == OPEN;
+	m_pConnection = nullptr;
+	m_httpStatusCode = p_connection->GetHttpStatusCode();
+	const int code = m_httpStatusCode;
+	if (p_connection->GetRejection() == HttpRequest::REJECTED_CONTENT_TYPE || code == 204 || (code >= 300 && code < 500 && code != 408 && code != 429)
+		|| (code / 100 == 2 && code != 200)) {
+		// Told to stop, or not an event stream at all:
+		s3eDebugTracePrintf("HttpEventStream: %s answered %d%s; closing the stream", m_url.c_str(), code, code != 204 && p_connection->GetRejection() == HttpRequest::REJECTED_CONTENT_TYPE ? ", not with an event stream" : "");
+		m_state = CLOSED;
+		m_failed = true;
+		return;
+	}
+	// The stream ended, or the connection failed: reconnect once the retry time is over, backing off while it
+	// keeps failing.
+	if (!opened)
+		m_numFailures++;
+	uint64 delay_ms = m_retryMs;
+	if (m_numFailures > 1)
+		delay_ms = MIN((uint64)MAX_RECONNECT_DELAY_MS, MAX(delay_ms, (uint64)DEFAULT_RETRY_MS) << MIN(m_numFailures - 1, 6u));
+	m_state = WAITING;
+	m_reconnectAtMs = (uint64)s3eTimerGetMs() + delay_ms;
+}
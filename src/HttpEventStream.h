@@ -0,0 +1,122 @@
+// HttpEventStream:
+// A subscription to a server-sent event stream (a text/event-stream
+// response, as an EventSource would read it), e.g. live scores or chat
+// messages, instead of polling an endpoint every few seconds. One GET stays
+// open, and the server sends each event down it as it happens.
+// The frames are parsed on the worker as the data arrives (line by line, with
+// LF, CR or CRLF line breaks, whichever chunks they are split across), and
+// each complete event is published to an HttpStreamRequest's delivery queue,
+// which HttpClient::Update() drains into the event callback. So an event
+// costs no request of its own, and reaches the app at its next Update().
+// When the connection ends, or fails in a way that another try might fix (the
+// network, a 5xx, 408 or 429 response), the stream reconnects once the retry
+// time is over: 3 s, or whatever the server's last "retry:" field asked for,
+// doubling with each failure in a row up to a minute. Each new connection
+// sends the ID of the last event received as a Last-Event-ID header, so the
+// server can carry on where the last one left off. A 204 response, any other
+// error status, or a response that isn't text/event-stream closes the stream
+// for good (see HasFailed()).
+//     HttpEventStream stream(client, "https://api.example.com/live");
+//     stream.SetEventCallback(fastdelegate::MakeDelegate(this, &Game::HandleEvent));
+//     stream.Open();
+//     ...
+//     stream.Update(); // Every frame, along with client.Update()
+// The connection has no low-speed timeout (see HttpClientConfig), since an
+// event stream may be quiet for minutes; TCP keep-alive still notices one
+// that the network has dropped, and servers usually send a comment every so
+// often to keep proxies from closing it.
+// Like HttpClient, it must only be used from the app thread. It must not
+// outlive its client.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+
+#include "HttpHeaders.h"
+#include "HttpStreamRequest.h"
+
+class HttpClient;
+
+class HttpEventStream : public IObservable {
+public:
+	enum State {
+		CLOSED, // Not opened yet, closed by the app, or failed (see HasFailed())
+		CONNECTING, // Waiting for the response
+		OPEN, // The response has started: events are arriving
+		WAITING // For the retry time to pass, before reconnecting
+	};
+	enum {
+		DEFAULT_RETRY_MS = 3000, // Until the server sends a "retry:" field
+		MAX_RECONNECT_DELAY_MS = 60000 // As the delay doubles with each failure in a row
+	};
+	// Only valid for the duration of the event callback:
+	struct Event {
+		const char* type; // "message", unless the server named another with an "event:" field
+		const char* data; // The event's "data:" lines, joined with LFs (and NUL-terminated)
+		size_t dataSize;
+		const char* lastEventId; // The ID of this event, or of the last one that had an ID ("" if none has)
+	};
+	// Called on the app thread with each event, during HttpClient::Update(). The callback may Close() the
+	// stream, or destroy it.
+	typedef fastdelegate::FastDelegate2<HttpEventStream*, const Event&> EventDelegate;
+
+	HttpEventStream(HttpClient& client, const std::string& url);
+	~HttpEventStream(); // Closes the stream
+
+	HttpEventStream& SetEventCallback(EventDelegate callback) { m_eventCallback = callback; return *this; }
+	// A header to send with every connection, e.g. Authorization. Takes effect from the next connection.
+	HttpEventStream& SetHeader(const std::string& name, const std::string& value) { m_headers.Set(name, value); return *this; }
+	// Start from the event after id, e.g. the last one that an earlier session received:
+	HttpEventStream& SetLastEventId(const std::string& id) { m_lastEventId = id; return *this; }
+	// The most that an event (or one line of one) may hold: a stream that sends more is dropped, and reconnects.
+	// 1 MB by default.
+	HttpEventStream& SetMaxEventSize(size_t maxBytes) { m_maxEventSize = maxBytes; return *this; }
+
+	void Open(); // Connect, unless the stream is open (or connecting, or waiting to reconnect) already
+	void Close(); // Drop the connection, if any, and don't reconnect; Open() starts it again
+	// Call regularly, e.g. along with HttpClient::Update(), to reconnect once the retry time is over:
+	void Update();
+	// Reconnect on the next Update() rather than once the retry time is over, e.g. when the app knows that the
+	// network is back:
+	void Resume() { m_reconnectAtMs = 0; m_numFailures = 0; }
+
+	State GetState() const { return m_state; }
+	bool IsOpen() const { return m_state == OPEN; }
+	// The stream was closed by a response that reconnecting won't fix; GetHttpStatusCode() tells which:
+	bool HasFailed() const { return m_failed; }
+	int GetHttpStatusCode() const { return m_httpStatusCode; } // Of the last connection to end (0 if none has, or it had no response)
+	const std::string& GetLastEventId() const { return m_lastEventId; }
+	uint GetRetryMs() const { return m_retryMs; }
+	uint GetNumConnections() const { return m_numConnections; } // Made so far, including the one under way
+	uint64 GetNumEvents() const { return m_numEvents; } // Delivered so far
+
+private:
+	class Connection;
+	HttpClient& m_client;
+	const std::string m_url;
+	HttpHeaders m_headers;
+	EventDelegate m_eventCallback;
+	size_t m_maxEventSize;
+	State m_state;
+	Ptr<Connection> m_pConnection; // While CONNECTING or OPEN
+	std::string m_lastEventId;
+	uint m_retryMs;
+	uint m_numFailures; // In a row, since a connection last opened
+	uint64 m_reconnectAtMs; // While WAITING: when to reconnect (s3eTimerGetMs()), or 0 for the next Update()
+	bool m_failed;
+	int m_httpStatusCode;
+	uint m_numConnections;
+	uint64 m_numEvents;
+
+	void Connect();
+	void HandleOpen(); // The response has started
+	// A frame from the connection: the event's fields (nullptr id, or -1 retryMs, if it had none), and whether it
+	// had any data to dispatch. The callback may destroy us, and then the connection has been aborted.
+	void HandleFrame(const char* type, const char* id, int retryMs, bool dispatch, const char* data, size_t dataSize);
+	void HandleConnectionDone(Ptr<HttpRequest> pRequest);
+	HttpEventStream(const HttpEventStream&);
+	HttpEventStream& operator=(const HttpEventStream&);
+};
@@ -0,0 +1,278 @@
+// HttpFileUpload:
+// Uploads a file as the body of a PUT (or POST) request.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpFileUpload.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <curl/curl.h>
+#include <s3eDevice.h>
+#include <s3eFile.h>
+#include <s3eTimer.h>
+
+using std::string;
+
+// Reads the file ahead into two buffers on its own thread. The worker (curl's read callback) drains one
+// buffer while the thread fills the other; each buffer is owned by whichever side it was last handed to,
+// so the mutex is only taken when a buffer changes hands.
+struct HttpFileUpload::Reader {
+	Reader(s3eFile* pFile, size_t capacity);
+	~Reader(); // Stops the thread and closes the file
+	size_t Read(unsigned char* pData, size_t size); // Blocks until data is available; returns less than size at the end of the file
+	bool Failed();
+private:
+	s3eFile* const m_pFile;
+	const size_t m_capacity;
+	char* m_pBuffers[2];
+	size_t m_sizes[2]; // Bytes read into each full buffer
+	bool m_full[2]; // The thread has filled the buffer and handed it to the worker
+	bool m_failed; // The last read failed (set along with the last m_full)
+	bool m_quit;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	pthread_t m_thread;
+	bool m_threadStarted;
+	// Only used by the worker:
+	int m_current; // The buffer being drained
+	size_t m_consumed; // How much of it has been handed to curl
+	bool m_haveCurrent; // Whether we have already waited for the current buffer to be full
+	static void* ThreadMain(void* pReader);
+};
+
+HttpFileUpload::Reader::Reader(s3eFile* pFile, size_t capacity)
+	: m_pFile(pFile), m_capacity(capacity), m_failed(false), m_quit(false), m_threadStarted(false), m_current(0), m_consumed(0), m_haveCurrent(false)
+{
+	for (int i = 0; i < 2; i++) {
+		m_pBuffers[i] = new char[capacity];
+		m_sizes[i] = 0;
+		m_full[i] = false;
+	}
+	pthread_mutex_init(&m_mutex, nullptr);
+	pthread_cond_init(&m_cond, nullptr);
+	m_threadStarted = pthread_create(&m_thread, nullptr, ThreadMain, this) == 0;
+	if (!m_threadStarted) // Read() then fills each buffer itself, which is still one large read per buffer
+		s3eDebugTracePrintf("HttpFileUpload: Unable to start the read-ahead thread; reading synchronously");
+}
+
+HttpFileUpload::Reader::~Reader() {
+	if (m_threadStarted) {
+		pthread_mutex_lock(&m_mutex);
+		m_quit = true;
+		pthread_cond_signal(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+		pthread_join(m_thread, nullptr);
+	}
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+	s3eFileClose(m_pFile);
+	delete[] m_pBuffers[0];
+	delete[] m_pBuffers[1];
+}
+
+void* HttpFileUpload::Reader::ThreadMain(void* _pReader) {
+	Reader* p_reader = reinterpret_cast<Reader*>(_pReader);
+	int next = 0;
+	pthread_mutex_lock(&p_reader->m_mutex);
+	while (!p_reader->m_quit) {
+		if (p_reader->m_full[next]) {
+			pthread_cond_wait(&p_reader->m_cond, &p_reader->m_mutex); // Wait for the worker to give it back
+			continue;
+		}
+		pthread_mutex_unlock(&p_reader->m_mutex);
+		const size_t num_read = s3eFileRead(p_reader->m_pBuffers[next], 1, p_reader->m_capacity, p_reader->m_pFile);
+		const bool failed = num_read < p_reader->m_capacity && !s3eFileEOF(p_reader->m_pFile);
+		s3eDeviceYield();
+		pthread_mutex_lock(&p_reader->m_mutex);
+		p_reader->m_sizes[next] = num_read;
+		p_reader->m_failed = failed;
+		p_reader->m_full[next] = true;
+		pthread_cond_signal(&p_reader->m_cond);
+		if (num_read < p_reader->m_capacity)
+			break; // That was the end of the file
+		next ^= 1;
+	}
+	pthread_mutex_unlock(&p_reader->m_mutex);
+	return nullptr;
+}
+
+size_t HttpFileUpload::Reader::Read(unsigned char* pData, size_t size) {
+	size_t copied = 0;
+	while (copied < size) {
+		if (!m_haveCurrent) {
+			if (m_threadStarted) {
+				pthread_mutex_lock(&m_mutex);
+				while (!m_full[m_current])
+					pthread_cond_wait(&m_cond, &m_mutex);
+				pthread_mutex_unlock(&m_mutex);
+			} else {
+				m_sizes[m_current] = s3eFileRead(m_pBuffers[m_current], 1, m_capacity, m_pFile);
+				m_failed = m_sizes[m_current] < m_capacity && !s3eFileEOF(m_pFile);
+			}
+			m_haveCurrent = true;
+		}
+		const size_t available = m_sizes[m_current] - m_consumed;
+		if (available == 0) {
+			if (m_sizes[m_current] < m_capacity)
+				break; // End of the file
+			// Hand the empty buffer back to be refilled, and move on to the other one:
+			pthread_mutex_lock(&m_mutex);
+			m_full[m_current] = false;
+			pthread_cond_signal(&m_cond);
+			pthread_mutex_unlock(&m_mutex);
+			m_current ^= 1;
+			m_consumed = 0;
+			m_haveCurrent = false;
+			continue;
+		}
+		const size_t num_copy = available < size - copied ? available : size - copied;
+		memcpy(pData + copied, m_pBuffers[m_current] + m_consumed, num_copy);
+		m_consumed += num_copy;
+		copied += num_copy;
+	}
+	return copied;
+}
+
+bool HttpFileUpload::Reader::Failed() {
+	pthread_mutex_lock(&m_mutex);
+	const bool failed = m_failed;
+	pthread_mutex_unlock(&m_mutex);
+	return failed;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+HttpFileUpload::HttpFileUpload(const string& url, const string& filePath, int64 fileSize, Method method, const char* contentType)
+	: HttpRequest(method, url.c_str()), m_filePath(filePath), m_fileSize(fileSize), m_offset(0), m_length(0), m_readAheadSize(512 * 1024), m_bytesUploaded(0), m_startMs(0),
+	m_readFailed(false), m_responseBody(true), m_responseAsTape(false), m_pReader(nullptr)
+{
+	IwAssert(HTTP_CLIENT, method == PUT || method == POST);
+	if (m_fileSize < 0) {
+		if (s3eFile* p_file = s3eFileOpen(m_filePath.c_str(), "rb")) {
+			m_fileSize = s3eFileGetSize(p_file);
+			s3eFileClose(p_file);
+		}
+		if (m_fileSize < 0)
+			throw std::runtime_error("Unable to open file for uploading!");
+	}
+	m_length = m_fileSize;
+	SetHeader("Content-Type", contentType);
+}
+
+HttpFileUpload& HttpFileUpload::SetRange(int64 offset, int64 length) {
+	IwAssert(HTTP_CLIENT, m_status == BUILDING && offset >= 0 && length >= 0 && offset + length <= m_fileSize);
+	m_offset = offset;
+	m_length = length;
+	return *this;
+}
+
+HttpFileUpload::~HttpFileUpload() {
+	IwAssert(HTTP_CLIENT, m_pReader == nullptr); // Worker_HandleDone() should have stopped it
+}
+
+double HttpFileUpload::GetUploadThroughput() const {
+	if (!m_startMs)
+		return 0;
+	const uint64 elapsed_ms = s3eTimerGetMs() - m_startMs;
+	return elapsed_ms ? GetUploadedBytes() * 1000.0 / elapsed_ms : 0;
+}
+
+void HttpFileUpload::HandleRequestStart() {
+	m_startMs = s3eTimerGetMs();
+	HttpRequest::HandleRequestStart();
+}
+
+void HttpFileUpload::HandleResponse(bool success, int httpStatusCode) {
+	if (m_readFailed)
+		s3eDebugTracePrintf("HttpFileUpload: Unable to read %s", m_filePath.c_str());
+	HttpRequest::HandleResponse(success && !m_readFailed, httpStatusCode);
+	if (m_status == DONE) {
+		ParseResponse(m_responseBody);
+	} else {
+		s3eDebugTracePrintf("Error uploading %s. Response code %d", m_filePath.c_str(), httpStatusCode);
+		if (!m_responseBody.Empty())
+			s3eDebugTraceLine(m_responseBody.Data());
+	}
+}
+
+void HttpFileUpload::ParseResponse(const HttpResponseBody& body) {
+	const char* response = body.Data();
+	if (body.Empty()) {
+		m_responseData = json::Null();
+	} else if (response[0] == '[' || response[0] == '{') {
+		// The response is a JSON object or array. The worker has already parsed it as it arrived:
+		if (m_responseAsTape && body.AdoptJson(m_responseTape)) {
+			// Nothing left to do on this thread
+		} else if (!body.ParseJson(m_responseData)) {
+			s3eDebugTracePrintf("Error: Unable to parse JSON response: %s", body.GetJsonError());
+			m_status = ERROR;
+		}
+	} else {
+		m_responseData = json::String(string(response, body.Size()));
+	}
+}
+
+void HttpFileUpload::HandleRequeue() {
+	m_bytesUploaded = 0;
+	m_startMs = 0;
+	m_readFailed = false;
+	m_responseTape.Clear();
+	HttpRequest::HandleRequeue();
+}
+
+// s3eFileSeek() only takes 32-bit offsets, so seek beyond 2 GB in steps:
+static bool HttpFileUpload_Seek(s3eFile* pFile, int64 offset) {
+	s3eFileSeekOrigin origin = S3E_FILESEEK_SET;
+	do {
+		const int32 step = offset > 0x7fffffff ? 0x7fffffff : (int32)offset;
+		if (s3eFileSeek(pFile, step, origin) != S3E_RESULT_SUCCESS)
+			return false;
+		offset -= step;
+		origin = S3E_FILESEEK_CUR;
+	} while (offset > 0);
+	return true;
+}
+
+size_t HttpFileUpload::Worker_HandleUpload(const unsigned char* pData, size_t fillSize) {
+	if (m_readFailed)
+		return CURL_READFUNC_ABORT;
+	if (!m_pReader) {
+		s3eFile* p_file = s3eFileOpen(m_filePath.c_str(), "rb");
+		if (!p_file || !HttpFileUpload_Seek(p_file, m_offset)) {
+			if (p_file)
+				s3eFileClose(p_file);
+			m_readFailed = true;
+			return CURL_READFUNC_ABORT;
+		}
+		m_pReader = new Reader(p_file, m_readAheadSize); // Freed in this memory environment by Worker_HandleDone()
+	}
+	const int64 remaining = m_length - m_bytesUploaded;
+	if ((int64)fillSize > remaining)
+		fillSize = (size_t)remaining; // The read-ahead may go past the end of our range, but we don't send it
+	if (fillSize == 0)
+		return 0;
+	const size_t num_read = m_pReader->Read(const_cast<unsigned char*>(pData), fillSize);
+	if (num_read < fillSize && m_pReader->Failed()) {
+		m_readFailed = true;
+		return CURL_READFUNC_ABORT;
+	}
+	m_bytesUploaded = m_bytesUploaded + num_read;
+	return num_read;
+}
+
+size_t HttpFileUpload::Worker_HandleData(const unsigned char* contents, size_t size) {
+	if (!m_responseBody.Worker_Append(contents, size))
+		return 0; // Out of memory: abort the transfer
+	return size;
+}
+
+void HttpFileUpload::Worker_HandleDone(bool success, int httpStatusCode) {
+	delete m_pReader; // Allocated in this memory environment by Worker_HandleUpload()
+	m_pReader = nullptr;
+	m_responseBody.Worker_Finish();
+	HttpRequest::Worker_HandleDone(success, httpStatusCode);
+}
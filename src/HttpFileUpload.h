@@ -0,0 +1,72 @@
+// HttpFileUpload:
+// Uploads a file as the body of a PUT (or POST) request, e.g. a video to a
+// resumable upload URI. The file is read ahead on a helper thread into two
+// large buffers, so curl's read callback only ever copies from memory and a
+// slow flash read doesn't stall the socket: while curl drains one buffer, the
+// other is being filled. Files over 2 GB are supported.
+// The response body is kept like HttpPost's: see GetResponse().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "HttpRequest.h"
+
+class HttpFileUpload : public HttpRequest {
+public:
+	// If fileSize is negative, the size is taken from the file system (which
+	// only reports sizes up to 2 GB; pass the size of larger files in).
+	HttpFileUpload(const std::string& url, const std::string& filePath, int64 fileSize = -1, Method method = PUT, const char* contentType = "application/octet-stream");
+	~HttpFileUpload();
+
+	// Size of each of the two read-ahead buffers (512 KB by default). Must be set before the request is queued.
+	HttpFileUpload& SetReadAheadSize(size_t bytes) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_readAheadSize = bytes; return *this; }
+	// Only upload length bytes of the file, starting at offset (e.g. one chunk of a resumable upload).
+	// Must be set before the request is queued.
+	HttpFileUpload& SetRange(int64 offset, int64 length);
+	const std::string& GetFilePath() const { return m_filePath; }
+	int64 GetFileSize() const { return m_fileSize; }
+	int64 GetBytesUploaded() const { return m_bytesUploaded; } // Bytes handed to curl so far
+	bool HasReadFailed() const { return m_readFailed; } // The file couldn't be opened or read
+	// Average upload speed of the current attempt so far, in bytes per second (0 before it has started)
+	double GetUploadThroughput() const;
+
+	const json::Object& GetResponse() const { return m_responseData; }
+	// If set, a JSON response is not turned into elements at all: GetResponse() stays empty, and
+	// GetResponseTape() holds the document instead (see HttpPost::SetResponseAsTape()).
+	HttpFileUpload& SetResponseAsTape(bool asTape) { m_responseAsTape = asTape; return *this; }
+	const json::TapeDocument& GetResponseTape() const { return m_responseTape; }
+	// The raw response body. Only valid until the request's callback returns.
+	const HttpResponseBody& GetResponseBody() const { return m_responseBody; }
+
+	virtual void HandleRequestStart();
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void HandleRequeue();
+	virtual int64 GetUploadSize() const { return m_length; }
+	virtual int64 Worker_GetUploadSize() const { return m_length; }
+	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize);
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
+	virtual void Worker_HandleDone(bool success, int httpStatusCode);
+	virtual void Worker_HandleCleanup() { m_responseBody.Worker_Free(); }
+
+protected:
+	const std::string m_filePath;
+	int64 m_fileSize;
+	int64 m_offset; // The part of the file that is sent: see SetRange()
+	int64 m_length;
+	size_t m_readAheadSize;
+	volatile int64 m_bytesUploaded;
+	uint64 m_startMs; // s3eTimerGetMs() when the current attempt started
+	bool m_readFailed; // Set by the worker thread if the file couldn't be opened or read
+	HttpResponseBody m_responseBody; // Used by the worker thread to store (and parse) the response as it comes in.
+
+	json::UnknownElement m_responseData;
+	bool m_responseAsTape;
+	json::TapeDocument m_responseTape;
+	void ParseResponse(const HttpResponseBody& body); // Sets m_responseData (or m_responseTape) from a successful response
+
+private:
+	struct Reader; // The read-ahead thread and its buffers, created and destroyed in the worker's memory environment
+	Reader* m_pReader;
+};
@@ -0,0 +1,217 @@
+// HttpFuture:
+// A handle on the completion of a queued request, which can be polled, chained and combined.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpFuture.h"
+
+#include "HttpClient.h"
+
+static bool HttpFuture_IsFinal(const HttpRequest& request) {
+	const HttpRequest::Status status = request.GetStatus();
+	return status == HttpRequest::DONE || status == HttpRequest::ERROR || status == HttpRequest::CANCELLED;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpFuture:
+
+HttpFuture::HttpFuture(Ptr<HttpFutureState> pState) : m_pClient(nullptr), m_pState(pState) {}
+
+bool HttpFuture::IsReady() const {
+	if (m_pState)
+		return m_pState->IsReady();
+	return m_pRequest && HttpFuture_IsFinal(*m_pRequest.ptr());
+}
+
+bool HttpFuture::IsCancelled() const {
+	if (m_pState)
+		return m_pState->IsCancelled();
+	return m_pRequest && m_pRequest->GetStatus() == HttpRequest::CANCELLED;
+}
+
+bool HttpFuture::Succeeded() const {
+	if (m_pState)
+		return m_pState->Succeeded();
+	return m_pRequest && m_pRequest->GetStatus() == HttpRequest::DONE;
+}
+
+Ptr<HttpRequest> HttpFuture::GetRequest() const {
+	return m_pState ? m_pState->GetRequest() : m_pRequest;
+}
+
+Ptr<HttpFutureState> HttpFuture::GetState() {
+	if (!m_pState) {
+		m_pState = new HttpFutureState(m_pClient);
+		if (m_pRequest && m_pRequest->m_then) {
+			// The continuation kept in the request goes first, so they are all called in order
+			m_pState->AddHandler(m_pRequest->m_then);
+			m_pRequest->m_then.clear();
+		}
+		if (m_pRequest)
+			m_pState->Wait(m_pRequest);
+		else
+			m_pState->Complete(false, false); // An invalid future
+		m_pRequest = nullptr;
+	}
+	return m_pState;
+}
+
+HttpFuture& HttpFuture::Then(Handler handler) {
+	if (!m_pState && m_pRequest) {
+		if (HttpFuture_IsFinal(*m_pRequest.ptr())) {
+			if (m_pRequest->GetStatus() != HttpRequest::CANCELLED)
+				handler(m_pRequest);
+			return *this;
+		}
+		if (!m_pRequest->m_then) {
+			m_pRequest->m_then = handler; // The common case: no allocation
+			return *this;
+		}
+	}
+	GetState()->AddHandler(handler);
+	return *this;
+}
+
+HttpFuture HttpFuture::AndThen(Step step) {
+	Ptr<HttpFutureState> p_source = GetState();
+	Ptr<HttpFutureState> p_target = new HttpFutureState(m_pClient);
+	p_target->SetSource(p_source.ptr());
+	p_source->AddStep(step, p_target);
+	HttpFuture future(p_target);
+	future.m_pClient = m_pClient;
+	return future;
+}
+
+HttpFuture HttpFuture::WhenAll(const std::vector<HttpFuture>& futures) {
+	Ptr<HttpFutureState> p_all = new HttpFutureState(futures.empty() ? nullptr : futures[0].m_pClient);
+	p_all->SetNumPending((uint)futures.size());
+	if (futures.empty())
+		p_all->Complete(true, false);
+	for (size_t i = 0; i < futures.size(); i++) {
+		HttpFuture future = futures[i];
+		future.GetState()->AddToAll(p_all);
+		p_all->AddChild(future);
+	}
+	HttpFuture future(p_all);
+	future.m_pClient = futures.empty() ? nullptr : futures[0].m_pClient;
+	return future;
+}
+
+void HttpFuture::Cancel() {
+	if (m_pState)
+		m_pState->Cancel();
+	else if (m_pRequest)
+		m_pRequest->Abort(); // (Cancels it if it hasn't started yet)
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpFutureState:
+
+void HttpFutureState::Wait(Ptr<HttpRequest> pRequest) {
+	m_pRequest = pRequest;
+	if (HttpFuture_IsFinal(*pRequest.ptr())) {
+		Complete(pRequest->GetStatus() == HttpRequest::DONE, pRequest->GetStatus() == HttpRequest::CANCELLED);
+		return;
+	}
+	m_pRequestCallback = pRequest->m_pCallback;
+	pRequest->m_pCallback = this;
+}
+
+void HttpFutureState::Call(Ptr<HttpRequest> pRequest) {
+	Ptr<HttpFutureState> p_self = this; // The request has just let go of us
+	if (Ptr<HttpCallbackBase> p_callback = m_pRequestCallback) {
+		m_pRequestCallback = nullptr;
+		p_callback->Call(pRequest);
+	}
+	Complete(pRequest->GetStatus() == HttpRequest::DONE, pRequest->GetStatus() == HttpRequest::CANCELLED);
+}
+
+void HttpFutureState::Complete(bool succeeded, bool cancelled) {
+	if (m_ready)
+		return;
+	Ptr<HttpFutureState> p_self = this; // A listener may release the last reference to us
+	m_ready = true;
+	m_succeeded = succeeded && !cancelled;
+	m_cancelled = cancelled;
+	m_children.clear();
+	std::vector<Listener> listeners;
+	listeners.swap(m_listeners);
+	for (size_t i = 0; i < listeners.size(); i++)
+		Notify(listeners[i]);
+}
+
+void HttpFutureState::Notify(Listener& listener) {
+	if (listener.handler) {
+		if (!m_cancelled)
+			listener.handler(m_pRequest);
+	} else if (listener.step) {
+		Ptr<HttpRequest> p_next;
+		if (m_succeeded && !listener.pTarget->m_cancelled)
+			p_next = listener.step(m_pRequest);
+		if (p_next) {
+			m_pClient->QueueRequest(p_next);
+			listener.pTarget->Wait(p_next);
+		} else {
+			listener.pTarget->m_pRequest = m_pRequest; // The chain ends with us
+			listener.pTarget->Complete(m_succeeded, m_cancelled);
+		}
+	} else if (listener.pTarget) {
+		listener.pTarget->HandleChildDone(m_succeeded);
+	}
+}
+
+void HttpFutureState::AddHandler(HttpFuture::Handler handler) {
+	Listener listener;
+	listener.handler = handler;
+	if (m_ready)
+		Notify(listener);
+	else
+		m_listeners.push_back(listener);
+}
+
+void HttpFutureState::AddStep(HttpFuture::Step step, Ptr<HttpFutureState> pTarget) {
+	Listener listener;
+	listener.step = step;
+	listener.pTarget = pTarget;
+	if (m_ready)
+		Notify(listener);
+	else
+		m_listeners.push_back(listener);
+}
+
+void HttpFutureState::AddToAll(Ptr<HttpFutureState> pAll) {
+	Listener listener;
+	listener.pTarget = pAll;
+	if (IsReady() && !m_ready)
+		Complete(false, true); // Our request was cancelled behind our back
+	if (m_ready)
+		Notify(listener);
+	else
+		m_listeners.push_back(listener);
+}
+
+void HttpFutureState::HandleChildDone(bool succeeded) {
+	if (m_ready)
+		return;
+	if (!succeeded)
+		m_childFailed = true;
+	if (--m_numPending == 0)
+		Complete(!m_childFailed, false);
+}
+
+void HttpFutureState::Cancel() {
+	if (m_ready)
+		return;
+	Ptr<HttpFutureState> p_self = this;
+	m_cancelled = true; // So that a step that completes meanwhile doesn't queue anything
+	if (m_pRequest) {
+		m_pRequestCallback = nullptr;
+		m_pRequest->Abort(); // Lets go of us as its callback
+	}
+	for (size_t i = 0; i < m_children.size(); i++)
+		m_children[i].Cancel();
+	if (m_pSource)
+		m_pSource->Cancel(); // Which completes us through our step, as cancelled
+	Complete(false, true);
+}
@@ -0,0 +1,117 @@
+// HttpFuture:
+// A handle on the completion of a queued request (see HttpClient::QueueRequest(),
+// which returns one), as an alternative to a callback object. It can be:
+//  - polled: IsReady(), Succeeded() and GetRequest(),
+//  - given a continuation with Then(), which is called once the request has
+//    completed, successful or not, like a callback,
+//  - chained with AndThen(): once the request has succeeded, the step is called
+//    with it, and returns the next request, which is queued with the same
+//    HttpClient. The future that AndThen() returns stands for the whole chain,
+//    e.g. for an OAuth login, then a session request, then an upload:
+//        client.QueueRequest(p_login)
+//            .AndThen(this, &MyModule::StartSession)  // Returns the session request
+//            .AndThen(this, &MyModule::StartUpload)   // Returns the upload request
+//            .Then(this, &MyModule::HandleUploadDone); // Called with whichever request ended the chain
+//    A failed request skips the rest of the chain, and the final Then() gets it.
+//  - combined with WhenAll().
+// Continuations run on the app thread, during HttpClient::Update(), as callbacks
+// do; one given to a future that is already ready is called straight away.
+// The first Then() on a request's own future is kept in the request itself, so
+// that (and polling) costs no allocation. Chains, combinations and further
+// continuations allocate one small HttpFutureState each.
+// Like HttpStaticCallback, continuations are plain delegates, not observing
+// pointers: Cancel() the future if the watcher goes away first. Cancel a chain
+// through its future (not just its current request), so that any WhenAll() of
+// it hears about it. Continuations aren't called for a cancelled future.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <vector>
+
+#include "util/FastDelegate.h"
+#include "HttpRequest.h"
+
+class HttpFutureState;
+
+class HttpFuture {
+public:
+	typedef fastdelegate::FastDelegate1< Ptr<HttpRequest> > Handler;
+	// Given a request that succeeded, returns the next request to queue, or nullptr to end the chain there:
+	typedef fastdelegate::FastDelegate1< Ptr<HttpRequest>, Ptr<HttpRequest> > Step;
+	
+	HttpFuture() : m_pClient(nullptr) {}
+	HttpFuture(HttpClient* pClient, Ptr<HttpRequest> pRequest) : m_pClient(pClient), m_pRequest(pRequest) {} // For a queued request
+	
+	bool IsValid() const { return m_pRequest || m_pState; }
+	bool IsReady() const; // Completed (successfully or not), or cancelled
+	bool IsCancelled() const;
+	bool Succeeded() const; // Ready, and the request (every request, for WhenAll()) is DONE
+	// The request that the future is waiting for, or completed with: for a chain, the one that ended it. nullptr for WhenAll().
+	Ptr<HttpRequest> GetRequest() const;
+	
+	HttpFuture& Then(Handler handler);
+	template<typename WatcherType>
+	HttpFuture& Then(WatcherType* pWatcher, void (WatcherType::*pMethod)(Ptr<HttpRequest>)) { return Then(fastdelegate::MakeDelegate(pWatcher, pMethod)); }
+	HttpFuture AndThen(Step step);
+	template<typename WatcherType>
+	HttpFuture AndThen(WatcherType* pWatcher, Ptr<HttpRequest> (WatcherType::*pMethod)(Ptr<HttpRequest>)) { return AndThen(fastdelegate::MakeDelegate(pWatcher, pMethod)); }
+	// Ready once all of futures are (an empty list is ready at once); succeeded if they all did.
+	static HttpFuture WhenAll(const std::vector<HttpFuture>& futures);
+	
+	// Cancel or abort the request it is waiting for (see HttpRequest::Abort()), and for WhenAll(), every one of its futures.
+	void Cancel();
+	
+private:
+	HttpClient* m_pClient; // That the request was queued with, and that AndThen() queues with
+	Ptr<HttpRequest> m_pRequest; // For the future of one queued request, unless it has been given m_pState
+	Ptr<HttpFutureState> m_pState; // For chains and combinations
+	explicit HttpFuture(Ptr<HttpFutureState> pState);
+	Ptr<HttpFutureState> GetState(); // Switch a request's future to an HttpFutureState, to have more than the request can hold
+};
+
+// The state of a chained or combined future. Internal: see HttpFuture.
+class HttpFutureState : public HttpCallbackBase {
+public:
+	HttpFutureState(HttpClient* pClient) : m_pClient(pClient), m_ready(false), m_succeeded(false), m_cancelled(false), m_numPending(0), m_childFailed(false) {}
+	
+	bool IsReady() const { return m_ready || (m_pRequest && m_pRequest->GetStatus() == HttpRequest::CANCELLED); }
+	bool IsCancelled() const { return m_cancelled || (!m_ready && m_pRequest && m_pRequest->GetStatus() == HttpRequest::CANCELLED); }
+	bool Succeeded() const { return m_ready && m_succeeded; }
+	const Ptr<HttpRequest>& GetRequest() const { return m_pRequest; }
+	
+	void Wait(Ptr<HttpRequest> pRequest); // Complete once pRequest has (taking over its callback, which is still called first)
+	void Complete(bool succeeded, bool cancelled);
+	void AddHandler(HttpFuture::Handler handler);
+	void AddStep(HttpFuture::Step step, Ptr<HttpFutureState> pTarget);
+	void AddToAll(Ptr<HttpFutureState> pAll); // For WhenAll(): count this future towards pAll
+	void SetNumPending(uint numPending) { m_numPending = numPending; }
+	void AddChild(const HttpFuture& future) { m_children.push_back(future); }
+	void SetSource(HttpFutureState* pSource) { m_pSource = pSource; }
+	void Cancel();
+	
+	virtual void Call(Ptr<HttpRequest> pRequest); // As the callback of m_pRequest
+	
+private:
+	struct Listener {
+		HttpFuture::Handler handler; // Called if we succeed or fail (but aren't cancelled)
+		HttpFuture::Step step; // Called if we succeed; whatever it returns is then waited for by pTarget
+		Ptr<HttpFutureState> pTarget; // Completes if step returns nullptr, or we fail; or, with no step, a WhenAll()
+	};
+	HttpClient* m_pClient;
+	Ptr<HttpRequest> m_pRequest;
+	Ptr<HttpCallbackBase> m_pRequestCallback; // The callback that m_pRequest had before us
+	bool m_ready;
+	bool m_succeeded;
+	bool m_cancelled;
+	uint m_numPending; // For WhenAll(): the futures that aren't ready yet
+	bool m_childFailed; // For WhenAll()
+	std::vector<HttpFuture> m_children; // For WhenAll()
+	ObservingPtr<HttpFutureState> m_pSource; // For AndThen(): the future whose step we wait for, so Cancel() can reach it
+	std::vector<Listener> m_listeners; // Released once we complete
+	void Notify(Listener& listener);
+	void HandleChildDone(bool succeeded);
+};
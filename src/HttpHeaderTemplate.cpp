@@ -0,0 +1,35 @@
+// HttpHeaderTemplate:
+// A set of request headers that many requests share, compiled once for curl.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpHeaderTemplate.h"
+
+#include <curl/curl.h>
+
+HttpHeaderTemplate::HttpHeaderTemplate(const HttpHeaders& headers, uint version)
+	: m_headers(headers), m_version(version), m_pList(nullptr)
+{
+	const size_t num_headers = m_headers.Size();
+	if (!num_headers)
+		return;
+	m_pList = new curl_slist[num_headers];
+	for (size_t i = 0; i < num_headers; i++) {
+		m_pList[i].data = const_cast<char*>(m_headers.GetLine(i));
+		m_pList[i].next = i + 1 < num_headers ? &m_pList[i + 1] : nullptr;
+	}
+}
+
+HttpHeaderTemplate::~HttpHeaderTemplate() {
+	delete[] m_pList;
+}
+
+bool HttpHeaderTemplate::IsOverriddenBy(const HttpHeaders& requestHeaders) const {
+	// Requests usually have far fewer headers of their own than there are defaults:
+	for (size_t i = 0; i < requestHeaders.Size(); i++) {
+		if (m_headers.Find(requestHeaders.GetName(i), requestHeaders.GetNameLength(i)))
+			return true;
+	}
+	return false;
+}
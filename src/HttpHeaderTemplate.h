@@ -0,0 +1,41 @@
+// HttpHeaderTemplate:
+// A set of request headers that many requests share, compiled once into the
+// list that curl takes, e.g. an HttpClient's default headers (see
+// HttpClient::SetDefaultHeader()). It can't be changed once it's made: a new
+// set of headers makes a new template with a new version, and requests that
+// were queued with the old one keep it until they're done.
+// Templates are made and released by the app thread. Workers only read them,
+// through the request that holds one.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <vector>
+
+#include "util/ptr.h"
+#include "HttpHeaders.h"
+
+struct curl_slist;
+
+class HttpHeaderTemplate : public IRefCounted {
+public:
+	HttpHeaderTemplate(const HttpHeaders& headers, uint version);
+	virtual ~HttpHeaderTemplate();
+
+	const HttpHeaders& GetHeaders() const { return m_headers; }
+	uint GetVersion() const { return m_version; }
+	// All of the headers, ready for CURLOPT_HTTPHEADER (or as the tail of a longer list). nullptr if there are none.
+	// curl only reads the list, so any number of transfers can use it at once.
+	curl_slist* GetList() const { return m_pList; }
+	// True if requestHeaders has a header of the same name as one of ours, so that GetList() can't be used as it is:
+	bool IsOverriddenBy(const HttpHeaders& requestHeaders) const;
+
+private:
+	HttpHeaderTemplate(const HttpHeaderTemplate&);
+	HttpHeaderTemplate& operator=(const HttpHeaderTemplate&);
+	const HttpHeaders m_headers;
+	const uint m_version;
+	curl_slist* m_pList; // One node per header, pointing at its line in m_headers
+};
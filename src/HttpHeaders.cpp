@@ -0,0 +1,134 @@
+// HttpHeaders:
+// A flat set of HTTP headers, kept as "Name: value" lines in one buffer.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpHeaders.h"
+
+#include <ctype.h>
+#include <string.h>
+
+void HttpHeaders::Clear() {
+	m_buffer.clear();
+	m_entries.clear();
+	m_statusLine = m_statusLineLength = m_garbage = 0;
+}
+
+void HttpHeaders::Free() {
+	std::vector<char>().swap(m_buffer);
+	std::vector<Entry>().swap(m_entries);
+	m_statusLine = m_statusLineLength = m_garbage = 0;
+}
+
+int HttpHeaders::CompareNames(const char* a, size_t aLength, const char* b, size_t bLength) {
+	const size_t length = aLength < bLength ? aLength : bLength;
+	for (size_t i = 0; i < length; i++) {
+		const int diff = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+		if (diff)
+			return diff;
+	}
+	return aLength < bLength ? -1 : aLength > bLength ? 1 : 0;
+}
+
+size_t HttpHeaders::LowerBound(const char* name, size_t nameLength) const {
+	size_t lo = 0, hi = m_entries.size();
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+		if (CompareNames(&m_buffer[m_entries[mid].name], m_entries[mid].nameLength, name, nameLength) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+bool HttpHeaders::ParseLine(const char* pLine, size_t length) {
+	if (length >= 5 && memcmp(pLine, "HTTP/", 5) == 0) {
+		Clear();
+		SetStatusLine(pLine, length);
+		return true;
+	}
+	const char* p_colon = (const char*)memchr(pLine, ':', length);
+	if (!p_colon || p_colon == pLine)
+		return false;
+	const char* p_value = p_colon + 1;
+	const char* p_end = pLine + length;
+	while (p_value < p_end && (*p_value == ' ' || *p_value == '\t'))
+		p_value++;
+	while (p_end > p_value && (p_end[-1] == ' ' || p_end[-1] == '\t'))
+		p_end--;
+	Add(pLine, p_colon - pLine, p_value, p_end - p_value);
+	return true;
+}
+
+void HttpHeaders::SetStatusLine(const char* pLine, size_t length) {
+	m_garbage += m_statusLineLength ? m_statusLineLength + 1 : 0;
+	m_statusLine = (uint32)m_buffer.size();
+	m_statusLineLength = (uint32)length;
+	m_buffer.insert(m_buffer.end(), pLine, pLine + length);
+	m_buffer.push_back('\0');
+}
+
+void HttpHeaders::Add(const char* name, size_t nameLength, const char* value, size_t valueLength) {
+	Entry entry;
+	entry.name = (uint32)m_buffer.size();
+	entry.nameLength = (uint32)nameLength;
+	entry.value = entry.name + (uint32)nameLength + 2;
+	entry.valueLength = (uint32)valueLength;
+	m_buffer.reserve(m_buffer.size() + nameLength + valueLength + 3);
+	m_buffer.insert(m_buffer.end(), name, name + nameLength);
+	m_buffer.push_back(':');
+	m_buffer.push_back(' ');
+	m_buffer.insert(m_buffer.end(), value, value + valueLength);
+	m_buffer.push_back('\0');
+	// After any headers of the same name (responses rarely have more than a couple of dozen headers, so
+	// the insertion is cheap):
+	size_t pos = LowerBound(name, nameLength);
+	while (pos < m_entries.size() && CompareNames(&m_buffer[m_entries[pos].name], m_entries[pos].nameLength, name, nameLength) == 0)
+		pos++;
+	m_entries.insert(m_entries.begin() + pos, entry);
+}
+
+void HttpHeaders::Set(const char* name, size_t nameLength, const char* value, size_t valueLength) {
+	Remove(name, nameLength);
+	Add(name, nameLength, value, valueLength);
+}
+
+void HttpHeaders::Remove(const char* name, size_t nameLength) {
+	const size_t pos = LowerBound(name, nameLength);
+	size_t end = pos;
+	while (end < m_entries.size() && CompareNames(&m_buffer[m_entries[end].name], m_entries[end].nameLength, name, nameLength) == 0) {
+		m_garbage += m_entries[end].nameLength + m_entries[end].valueLength + 3;
+		end++;
+	}
+	m_entries.erase(m_entries.begin() + pos, m_entries.begin() + end);
+	// Request headers that are changed for every attempt would otherwise keep growing the buffer:
+	if (m_garbage > m_buffer.size() / 2)
+		Compact();
+}
+
+void HttpHeaders::Compact() {
+	std::vector<char> buffer;
+	buffer.reserve(m_buffer.size() - m_garbage);
+	if (m_statusLineLength) {
+		buffer.insert(buffer.end(), m_buffer.begin() + m_statusLine, m_buffer.begin() + m_statusLine + m_statusLineLength + 1);
+		m_statusLine = 0;
+	}
+	for (size_t i = 0; i < m_entries.size(); i++) {
+		Entry& entry = m_entries[i];
+		const uint32 offset = (uint32)buffer.size();
+		buffer.insert(buffer.end(), m_buffer.begin() + entry.name, m_buffer.begin() + entry.value + entry.valueLength + 1);
+		entry.value = offset + (entry.value - entry.name);
+		entry.name = offset;
+	}
+	m_buffer.swap(buffer);
+	m_garbage = 0;
+}
+
+const char* HttpHeaders::Find(const char* name, size_t nameLength) const {
+	const size_t pos = LowerBound(name, nameLength);
+	if (pos < m_entries.size() && CompareNames(&m_buffer[m_entries[pos].name], m_entries[pos].nameLength, name, nameLength) == 0)
+		return &m_buffer[m_entries[pos].value];
+	return nullptr;
+}
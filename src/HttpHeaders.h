@@ -0,0 +1,79 @@
+// HttpHeaders:
+// A flat set of HTTP headers, used for both the request and the response
+// headers of an HttpRequest, and by the caches. Every header is kept as one
+// NUL-terminated "Name: value" line in a single contiguous buffer, with an
+// index of offset/length pairs sorted by name (case-insensitively, since
+// HTTP is case-insensitive about names and HTTP/2 servers send them in lower
+// case), so a whole set of headers takes two allocations rather than several
+// per header, copying one is two allocations too, and a lookup is a binary
+// search. The lines are already in the form that curl sends (see GetLine()),
+// so a worker can hand them to curl without building any strings of its own.
+// Clear() keeps the memory, so a worker that fills one for every response
+// stops allocating once it has seen its largest set of headers.
+// Like any non-POD data, an HttpHeaders belongs to the memory environment of
+// the thread that fills it: other threads may read it, but must not modify or
+// destroy it (see HttpClientWorker.h).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "s3eTypes.h"
+
+class HttpHeaders {
+public:
+	HttpHeaders() : m_statusLine(0), m_statusLineLength(0), m_garbage(0) {}
+
+	void Clear(); // Forget everything, but keep the memory for reuse
+	void Free(); // Forget everything, and free the memory
+
+	// Parse one line of a response's headers as received from the server, without its CRLF. A status line
+	// (e.g. "HTTP/1.1 200 OK") starts a new response, replacing the headers of any earlier one (such as a
+	// "100 Continue" or a redirect). Returns false if the line is neither a status line nor a header.
+	bool ParseLine(const char* pLine, size_t length);
+	void SetStatusLine(const char* pLine, size_t length);
+	// Headers with the same name are all kept, in the order they were added:
+	void Add(const char* name, size_t nameLength, const char* value, size_t valueLength);
+	void Add(const std::string& name, const std::string& value) { Add(name.data(), name.size(), value.data(), value.size()); }
+	// Replace every header called name (in any case) with this one:
+	void Set(const char* name, size_t nameLength, const char* value, size_t valueLength);
+	void Set(const std::string& name, const std::string& value) { Set(name.data(), name.size(), value.data(), value.size()); }
+	void Remove(const char* name, size_t nameLength);
+	void Remove(const char* name) { Remove(name, strlen(name)); }
+
+	// The returned strings stay valid until the headers are next modified.
+	const char* GetStatusLine() const { return m_statusLineLength ? &m_buffer[m_statusLine] : ""; }
+	// The value of the (first) header called name, or nullptr if there is none:
+	const char* Find(const char* name, size_t nameLength) const;
+	const char* Find(const char* name) const { return Find(name, strlen(name)); }
+	// In order of name. Names are not NUL-terminated (use GetNameLength()), values are:
+	size_t Size() const { return m_entries.size(); }
+	bool Empty() const { return m_entries.empty(); }
+	const char* GetName(size_t i) const { return &m_buffer[m_entries[i].name]; }
+	size_t GetNameLength(size_t i) const { return m_entries[i].nameLength; }
+	const char* GetValue(size_t i) const { return &m_buffer[m_entries[i].value]; }
+	size_t GetValueLength(size_t i) const { return m_entries[i].valueLength; }
+	const char* GetLine(size_t i) const { return GetName(i); } // "Name: value", NUL-terminated
+
+	static int CompareNames(const char* a, size_t aLength, const char* b, size_t bLength); // Case-insensitive, like strcasecmp()
+
+private:
+	struct Entry {
+		uint32 name; // Offset into m_buffer of the line, which starts with the name
+		uint32 nameLength;
+		uint32 value;
+		uint32 valueLength;
+	};
+	std::vector<char> m_buffer;
+	std::vector<Entry> m_entries; // Sorted by name
+	uint32 m_statusLine;
+	uint32 m_statusLineLength;
+	uint32 m_garbage; // Bytes of m_buffer that are no longer used by any header, since Set() or Remove()
+	size_t LowerBound(const char* name, size_t nameLength) const;
+	void Compact();
+};
@@ -0,0 +1,200 @@
+// HttpHostTable:
+// Addresses to use in place of DNS for some hosts, as CURLOPT_RESOLVE entries.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpHostTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include <s3eDebug.h>
+#include <s3eFile.h>
+
+using std::string;
+
+HttpHostTable::List::List(const std::vector<string>& lines)
+	: m_lines(lines), m_pList(nullptr)
+{
+	if (m_lines.empty())
+		return;
+	m_pList = new curl_slist[m_lines.size()];
+	for (size_t i = 0; i < m_lines.size(); i++) {
+		m_pList[i].data = const_cast<char*>(m_lines[i].c_str());
+		m_pList[i].next = i + 1 < m_lines.size() ? &m_pList[i + 1] : nullptr;
+	}
+}
+
+HttpHostTable::List::~List() {
+	delete[] m_pList;
+}
+
+void HttpHostTable::Set(const string& host, uint port, const string& addresses, uint64 expiresMs) {
+	const string key = GetKey(host, port);
+	if (addresses.empty()) {
+		Remove(key);
+		return;
+	}
+	Entry& entry = m_entries[key];
+	if (entry.addresses != addresses)
+		m_changed = true;
+	entry.addresses = addresses;
+	entry.expiresMs = expiresMs;
+	m_learned.erase(key);
+	if (expiresMs && (!m_nextExpiryMs || expiresMs < m_nextExpiryMs))
+		m_nextExpiryMs = expiresMs;
+}
+
+const HttpHostTable::Entry* HttpHostTable::Find(const string& host, uint port) const {
+	auto it = m_entries.find(GetKey(host, port));
+	return it != m_entries.end() ? &it->second : nullptr;
+}
+
+bool HttpHostTable::Load(const char* filePath, uint64 nowMs) {
+	s3eFile* p_file = s3eFileOpen(filePath, "rb");
+	if (!p_file)
+		return false;
+	const int32 size = s3eFileGetSize(p_file);
+	string data(size > 0 ? size : 0, '\0');
+	const bool read = size <= 0 || s3eFileRead(&data[0], 1, size, p_file) == (size_t)size;
+	s3eFileClose(p_file);
+	if (!read)
+		return false;
+	for (size_t pos = 0; pos < data.size();) {
+		size_t end = data.find('\n', pos);
+		if (end == string::npos)
+			end = data.size();
+		string line = data.substr(pos, end - pos);
+		pos = end + 1;
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.resize(line.size() - 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+		uint64 expires_ms = 0;
+		const size_t space = line.find(' ');
+		if (space != string::npos) {
+			expires_ms = strtoull(line.c_str() + space + 1, nullptr, 10);
+			line.resize(space);
+		}
+		const size_t colon = line.find(':');
+		const size_t second_colon = colon == string::npos ? string::npos : line.find(':', colon + 1);
+		const uint port = colon == string::npos ? 0 : (uint)strtoul(line.c_str() + colon + 1, nullptr, 10);
+		if (second_colon == string::npos || !port || colon == 0) {
+			s3eDebugTracePrintf("HttpHostTable: Ignoring \"%s\" in %s", line.c_str(), filePath);
+			continue;
+		}
+		if (expires_ms && expires_ms <= nowMs)
+			continue; // Out of date: the host will be looked up instead
+		Set(line.substr(0, colon), port, line.substr(second_colon + 1), expires_ms);
+	}
+	return true;
+}
+
+bool HttpHostTable::Save(const char* filePath, uint64 ttlMs) const {
+	string data = "# host:port:addresses, and until when they're good (ms since 1970)\n";
+	char expires[24];
+	for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+		if (!it->second.expiresMs)
+			continue; // (Pinned entries are the app's to set)
+		snprintf(expires, sizeof(expires), " %llu", (unsigned long long)it->second.expiresMs);
+		data.append(it->first).append(1, ':').append(it->second.addresses).append(expires).append(1, '\n');
+	}
+	for (auto it = m_learned.begin(); it != m_learned.end(); it++) {
+		snprintf(expires, sizeof(expires), " %llu", (unsigned long long)(it->second.learnedMs + ttlMs));
+		data.append(it->first).append(1, ':').append(it->second.address).append(expires).append(1, '\n');
+	}
+	// Write a new file and then replace the old one, so that we never leave half of one behind:
+	const string tmp_path = string(filePath) + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpHostTable: Unable to write %s", tmp_path.c_str());
+		return false;
+	}
+	const bool written = s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	s3eFileClose(p_file);
+	if (!written) {
+		s3eFileDelete(tmp_path.c_str());
+		return false;
+	}
+	s3eFileDelete(filePath);
+	return s3eFileRename(tmp_path.c_str(), filePath) == S3E_RESULT_SUCCESS;
+}
+
+void HttpHostTable::Learn(const string& host, uint port, const string& address, uint64 nowMs) {
+	const string key = GetKey(host, port);
+	if (m_entries.find(key) != m_entries.end())
+		return;
+	Learned& learned = m_learned[key];
+	learned.address = address;
+	learned.learnedMs = nowMs;
+}
+
+void HttpHostTable::GetTemporaryKeys(std::vector<string>& keys) const {
+	for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+		if (it->second.expiresMs)
+			keys.push_back(it->first);
+	}
+}
+
+const Ptr<HttpHostTable::List>& HttpHostTable::GetList(uint64 nowMs) {
+	Expire(nowMs);
+	if (m_changed) {
+		// The vendored curl (7.34) won't replace an entry that is in the DNS cache already, whether it was looked
+		// up or came from CURLOPT_RESOLVE, so each entry goes in after removing whatever is there. curl only takes
+		// the list in once per handle, until it is set again, so that only happens once for each worker:
+		std::vector<string> lines;
+		for (auto it = m_removed.begin(); it != m_removed.end(); it++)
+			lines.push_back('-' + *it);
+		for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+			lines.push_back('-' + it->first);
+			lines.push_back(it->first + ':' + it->second.addresses);
+		}
+		m_pList = lines.empty() ? nullptr : new List(lines);
+		m_version++;
+		m_removed.clear();
+		m_changed = false;
+	}
+	return m_pList;
+}
+
+string HttpHostTable::GetKey(const string& host, uint port) {
+	char port_str[16];
+	snprintf(port_str, sizeof(port_str), ":%u", port);
+	return host + port_str;
+}
+
+bool HttpHostTable::SplitKey(const string& key, string& host, uint& port) {
+	const size_t colon = key.rfind(':');
+	if (colon == string::npos || colon == 0)
+		return false;
+	host = key.substr(0, colon);
+	port = (uint)strtoul(key.c_str() + colon + 1, nullptr, 10);
+	return port != 0;
+}
+
+void HttpHostTable::Remove(const string& key) {
+	if (m_entries.erase(key)) {
+		m_removed.push_back(key);
+		m_changed = true;
+	}
+}
+
+void HttpHostTable::Expire(uint64 nowMs) {
+	if (!m_nextExpiryMs || nowMs < m_nextExpiryMs)
+		return;
+	m_nextExpiryMs = 0;
+	for (auto it = m_entries.begin(); it != m_entries.end();) {
+		const uint64 expires_ms = it->second.expiresMs;
+		if (expires_ms && expires_ms <= nowMs) {
+			m_removed.push_back(it->first);
+			m_entries.erase(it++);
+			m_changed = true;
+			continue;
+		}
+		if (expires_ms && (!m_nextExpiryMs || expires_ms < m_nextExpiryMs))
+			m_nextExpiryMs = expires_ms;
+		it++;
+	}
+}
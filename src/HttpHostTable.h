@@ -0,0 +1,96 @@
+// HttpHostTable:
+// Addresses for host names that an HttpClient's workers connect to without
+// looking the names up (see HttpClient::SetHostAddresses() and
+// SetDnsSnapshot()), so that the first requests of a launch to the app's own
+// servers don't wait for DNS, which on a carrier's network can take most of a
+// second. They are handed to curl as CURLOPT_RESOLVE entries, which go into
+// the DNS cache that all of the client's workers share. An entry is either
+// pinned (e.g. from a file that comes with the app) or good until a given
+// time (e.g. what a previous launch resolved), after which it is dropped, and
+// the host is looked up as usual again.
+// The entries are compiled into a List for the workers, like the default
+// headers are into an HttpHeaderTemplate: each change makes a new one, with a
+// new version, for the workers to pass to curl the next time they start a
+// transfer. The table also keeps the addresses that the client's transfers
+// were actually made to, so that Save() can write a snapshot of them for the
+// next launch.
+// App thread only, apart from the workers reading the lists.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util/ptr.h"
+#include "s3eTypes.h"
+
+struct curl_slist;
+
+class HttpHostTable {
+public:
+	struct Entry {
+		std::string addresses; // e.g. "203.0.113.7,203.0.113.8", tried in that order
+		uint64 expiresMs; // An s3eTimerGetUTC() time, or 0 for never (a pinned entry)
+		Entry() : expiresMs(0) {}
+	};
+	// What the workers hand to curl, which only reads it:
+	class List : public IRefCounted {
+	public:
+		List(const std::vector<std::string>& lines); // "host:port:addresses", or "-host:port" to drop an entry from the DNS cache
+		virtual ~List();
+		curl_slist* GetList() const { return m_pList; }
+	private:
+		List(const List&);
+		List& operator=(const List&);
+		const std::vector<std::string> m_lines;
+		curl_slist* m_pList; // One node per line
+	};
+
+	HttpHostTable() : m_version(0), m_changed(false), m_nextExpiryMs(0) {}
+
+	// Use addresses for host:port until expiresMs (0 for as long as the table lives). Empty addresses remove it.
+	void Set(const std::string& host, uint port, const std::string& addresses, uint64 expiresMs = 0);
+	const Entry* Find(const std::string& host, uint port) const;
+	bool Empty() const { return m_entries.empty(); }
+	// Read entries from a file of "host:port:addresses" lines, each optionally followed by a space and the time
+	// (as an s3eTimerGetUTC() one) until which it is good. Entries that are no longer good are skipped. Lines that
+	// start with '#' are comments. Returns false if the file can't be read.
+	bool Load(const char* filePath, uint64 nowMs);
+	// Write the entries that aren't pinned, and the addresses that were learned (each good until ttlMs after it
+	// was), to a file that Load() can read. Returns false if the file can't be written.
+	bool Save(const char* filePath, uint64 ttlMs) const;
+
+	// Note that a transfer to host:port was made to address, at nowMs, having looked the host up (so this does
+	// nothing for the hosts that have an entry):
+	void Learn(const std::string& host, uint port, const std::string& address, uint64 nowMs);
+	// The hosts of the entries that aren't pinned, as "host:port" (e.g. to look them up again):
+	void GetTemporaryKeys(std::vector<std::string>& keys) const;
+
+	// The entries (and the ones that have been removed since the last list) as a list for the workers, after
+	// dropping those that are no longer good at nowMs. nullptr if there is nothing to tell curl.
+	const Ptr<List>& GetList(uint64 nowMs);
+	uint GetVersion() const { return m_version; } // Of GetList()'s list, which changes with the list
+
+	// "host:port":
+	static std::string GetKey(const std::string& host, uint port);
+	static bool SplitKey(const std::string& key, std::string& host, uint& port);
+
+private:
+	struct Learned {
+		std::string address;
+		uint64 learnedMs;
+	};
+	std::map<std::string, Entry> m_entries; // By GetKey()
+	std::map<std::string, Learned> m_learned; // By GetKey(); none of them have an entry
+	std::vector<std::string> m_removed; // The keys of the entries that have gone since the last list
+	Ptr<List> m_pList;
+	uint m_version;
+	bool m_changed;
+	uint64 m_nextExpiryMs; // The earliest expiresMs of the entries, or 0 if they are all pinned
+	void Remove(const std::string& key);
+	void Expire(uint64 nowMs);
+};
@@ -0,0 +1,1288 @@
+// HttpImageDecoder:
+// Decodes a PNG or a JPEG into 8-bit RGBA pixels.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpImageDecoder.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "HttpMemoryDownload.h"
+
+static uint HttpImage_Read16(const unsigned char* p) {
+	return (uint)p[0] << 8 | p[1];
+}
+
+static uint32 HttpImage_Read32(const unsigned char* p) {
+	return (uint32)p[0] << 24 | (uint32)p[1] << 16 | (uint32)p[2] << 8 | p[3];
+}
+
+static unsigned char HttpImage_Clamp(int value) {
+	return value < 0 ? 0 : value > 255 ? 255 : (unsigned char)value;
+}
+
+static bool HttpImage_Fail(HttpImageDecoder::Result& result, const char* pError) {
+	result.pError = pError;
+	return false;
+}
+
+// Takes the image a row of RGBA pixels at a time, top row first, and scales it down into the output:
+struct HttpImage_Scaler {
+	uint srcWidth, srcHeight, width, height;
+	unsigned char* pPixels; // From HttpBuffer::Worker_Alloc()
+	uint row; // The next source row
+	// Only if it scales:
+	uint* pColumns; // For each source column, the output column it goes to
+	uint* pColumnCounts; // For each output column, how many source columns go to it
+	uint64* pSums; // For each output pixel of the row being made: the totals of R * A, G * A, B * A and A
+	uint boxRows; // How many source rows have been added to pSums
+
+	HttpImage_Scaler() : srcWidth(0), srcHeight(0), width(0), height(0), pPixels(nullptr), row(0), pColumns(nullptr), pColumnCounts(nullptr), pSums(nullptr), boxRows(0) {}
+	~HttpImage_Scaler() {
+		if (pPixels)
+			HttpBuffer::Worker_Free(pPixels);
+		free(pColumns);
+		free(pColumnCounts);
+		free(pSums);
+	}
+	bool Begin(uint sourceWidth, uint sourceHeight, uint outWidth, uint outHeight) {
+		srcWidth = sourceWidth;
+		srcHeight = sourceHeight;
+		width = outWidth;
+		height = outHeight;
+		pPixels = HttpBuffer::Worker_Alloc(nullptr, (size_t)width * height * 4);
+		if (!pPixels)
+			return false;
+		if (width == srcWidth && height == srcHeight)
+			return true;
+		pColumns = (uint*)malloc(srcWidth * sizeof(uint));
+		pColumnCounts = (uint*)calloc(width, sizeof(uint));
+		pSums = (uint64*)calloc((size_t)width * 4, sizeof(uint64));
+		if (!pColumns || !pColumnCounts || !pSums)
+			return false;
+		for (uint x = 0; x < srcWidth; x++) {
+			pColumns[x] = (uint)((uint64)x * width / srcWidth);
+			pColumnCounts[pColumns[x]]++;
+		}
+		return true;
+	}
+	void AddRow(const unsigned char* pRgba) {
+		if (row >= srcHeight)
+			return;
+		if (!pSums) {
+			memcpy(pPixels + (size_t)row * width * 4, pRgba, (size_t)width * 4);
+			row++;
+			return;
+		}
+		for (uint x = 0; x < srcWidth; x++, pRgba += 4) {
+			uint64* p_sum = pSums + pColumns[x] * 4;
+			const uint alpha = pRgba[3];
+			p_sum[0] += pRgba[0] * alpha;
+			p_sum[1] += pRgba[1] * alpha;
+			p_sum[2] += pRgba[2] * alpha;
+			p_sum[3] += alpha;
+		}
+		boxRows++;
+		const uint out_row = (uint)((uint64)row * height / srcHeight);
+		row++;
+		if (row == srcHeight || (uint)((uint64)row * height / srcHeight) != out_row) {
+			unsigned char* p_out = pPixels + (size_t)out_row * width * 4;
+			for (uint x = 0; x < width; x++, p_out += 4) {
+				uint64* p_sum = pSums + x * 4;
+				const uint64 count = (uint64)pColumnCounts[x] * boxRows;
+				const uint64 alpha = p_sum[3];
+				if (alpha) {
+					p_out[0] = (unsigned char)((p_sum[0] + alpha / 2) / alpha);
+					p_out[1] = (unsigned char)((p_sum[1] + alpha / 2) / alpha);
+					p_out[2] = (unsigned char)((p_sum[2] + alpha / 2) / alpha);
+				} else {
+					p_out[0] = p_out[1] = p_out[2] = 0;
+				}
+				p_out[3] = (unsigned char)((alpha + count / 2) / count);
+				p_sum[0] = p_sum[1] = p_sum[2] = p_sum[3] = 0;
+			}
+			boxRows = 0;
+		}
+	}
+	bool IsComplete() const { return row == srcHeight; }
+	void Finish(HttpImageDecoder::Result& result) {
+		result.pPixels = pPixels;
+		result.width = width;
+		result.height = height;
+		pPixels = nullptr;
+	}
+};
+
+static bool HttpImage_CheckSize(uint width, uint height, HttpImageDecoder::Result& result) {
+	result.sourceWidth = width;
+	result.sourceHeight = height;
+	if (!width || !height)
+		return HttpImage_Fail(result, "the image is empty");
+	if ((uint64)width * height > HttpImageDecoder::MAX_PIXELS)
+		return HttpImage_Fail(result, "the image has too many pixels");
+	return true;
+}
+
+/////// PNG ///////
+
+static const unsigned char PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+// The image data: the IDAT chunks' contents taken as one zlib stream, inflated a row at a time:
+struct HttpImage_PngStream {
+	const unsigned char* pData;
+	size_t size;
+	size_t pos; // Of the next chunk to feed in
+	z_stream stream;
+	bool initialised;
+
+	HttpImage_PngStream(const unsigned char* pData_, size_t size_, size_t firstData) : pData(pData_), size(size_), pos(firstData), initialised(false) {
+		memset(&stream, 0, sizeof(stream));
+	}
+	~HttpImage_PngStream() {
+		if (initialised)
+			inflateEnd(&stream);
+	}
+	bool Init() {
+		initialised = inflateInit(&stream) == Z_OK;
+		return initialised;
+	}
+	// Fill pDest with the next size bytes:
+	bool Read(unsigned char* pDest, size_t destSize) {
+		stream.next_out = pDest;
+		stream.avail_out = (uInt)destSize;
+		while (stream.avail_out) {
+			if (!stream.avail_in) {
+				// The next IDAT chunk, if the one before was one too (their CRCs have been checked already):
+				if (pos + 12 > size || memcmp(pData + pos + 4, "IDAT", 4) != 0)
+					return false;
+				const uint32 length = HttpImage_Read32(pData + pos);
+				stream.next_in = (Bytef*)(pData + pos + 8);
+				stream.avail_in = length;
+				pos += length + 12;
+				continue;
+			}
+			const int z_result = inflate(&stream, Z_NO_FLUSH);
+			if (z_result == Z_STREAM_END)
+				return !stream.avail_out;
+			if (z_result != Z_OK)
+				return false;
+		}
+		return true;
+	}
+};
+
+static unsigned char HttpImage_Paeth(int a, int b, int c) {
+	const int p = a + b - c;
+	const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return (unsigned char)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Undo a row's filter in place. pPrev is the row above, unfiltered (all zeros for the first row of a pass).
+static bool HttpImage_Unfilter(uint filter, unsigned char* pRow, const unsigned char* pPrev, size_t rowBytes, uint bpp) {
+	switch (filter) {
+	case 0:
+		break;
+	case 1:
+		for (size_t i = bpp; i < rowBytes; i++)
+			pRow[i] = (unsigned char)(pRow[i] + pRow[i - bpp]);
+		break;
+	case 2:
+		for (size_t i = 0; i < rowBytes; i++)
+			pRow[i] = (unsigned char)(pRow[i] + pPrev[i]);
+		break;
+	case 3:
+		for (size_t i = 0; i < rowBytes; i++)
+			pRow[i] = (unsigned char)(pRow[i] + (((i >= bpp ? pRow[i - bpp] : 0) + pPrev[i]) >> 1));
+		break;
+	case 4:
+		for (size_t i = 0; i < rowBytes; i++)
+			pRow[i] = (unsigned char)(pRow[i] + HttpImage_Paeth(i >= bpp ? pRow[i - bpp] : 0, pPrev[i], i >= bpp ? pPrev[i - bpp] : 0));
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+struct HttpImage_PngFormat {
+	uint depth, colourType, channels;
+	unsigned char palette[256 * 4];
+	uint paletteSize;
+	bool hasKey; // A tRNS colour key, for greyscale or RGB
+	uint key[3];
+};
+
+// One sample of pixel x, channel c, of an unfiltered row, at its full depth:
+static uint HttpImage_PngSample(const HttpImage_PngFormat& format, const unsigned char* pRow, uint x, uint c) {
+	switch (format.depth) {
+	case 8:
+		return pRow[x * format.channels + c];
+	case 16:
+		return HttpImage_Read16(pRow + (x * format.channels + c) * 2);
+	default: {
+		// (Only ever one channel)
+		const uint bit = x * format.depth;
+		return (pRow[bit / 8] >> (8 - format.depth - bit % 8)) & ((1u << format.depth) - 1);
+	}
+	}
+}
+
+static void HttpImage_PngToRgba(const HttpImage_PngFormat& format, const unsigned char* pRow, uint width, unsigned char* pRgba) {
+	const uint max = (1u << format.depth) - 1;
+	for (uint x = 0; x < width; x++, pRgba += 4) {
+		switch (format.colourType) {
+		case 0: { // Greyscale
+			const uint grey = HttpImage_PngSample(format, pRow, x, 0);
+			pRgba[0] = pRgba[1] = pRgba[2] = (unsigned char)(format.depth == 16 ? grey >> 8 : grey * 255 / max);
+			pRgba[3] = format.hasKey && grey == format.key[0] ? 0 : 255;
+			break;
+		}
+		case 2: { // RGB
+			const uint r = HttpImage_PngSample(format, pRow, x, 0), g = HttpImage_PngSample(format, pRow, x, 1), b = HttpImage_PngSample(format, pRow, x, 2);
+			const uint shift = format.depth == 16 ? 8 : 0;
+			pRgba[0] = (unsigned char)(r >> shift);
+			pRgba[1] = (unsigned char)(g >> shift);
+			pRgba[2] = (unsigned char)(b >> shift);
+			pRgba[3] = format.hasKey && r == format.key[0] && g == format.key[1] && b == format.key[2] ? 0 : 255;
+			break;
+		}
+		case 3: { // Palette
+			const uint index = HttpImage_PngSample(format, pRow, x, 0);
+			if (index < format.paletteSize)
+				memcpy(pRgba, format.palette + index * 4, 4);
+			else
+				pRgba[0] = pRgba[1] = pRgba[2] = pRgba[3] = 0;
+			break;
+		}
+		case 4: // Greyscale and alpha
+			if (format.depth == 16) {
+				pRgba[0] = pRgba[1] = pRgba[2] = pRow[x * 4];
+				pRgba[3] = pRow[x * 4 + 2];
+			} else {
+				pRgba[0] = pRgba[1] = pRgba[2] = pRow[x * 2];
+				pRgba[3] = pRow[x * 2 + 1];
+			}
+			break;
+		default: // RGBA
+			if (format.depth == 16) {
+				for (uint c = 0; c < 4; c++)
+					pRgba[c] = pRow[x * 8 + c * 2];
+			} else {
+				memcpy(pRgba, pRow + x * 4, 4);
+			}
+			break;
+		}
+	}
+}
+
+static bool HttpImage_DecodePng(const unsigned char* pData, size_t size, uint maxWidth, uint maxHeight, HttpImageDecoder::Result& result) {
+	// First, the chunks that say how to read the image data:
+	HttpImage_PngFormat format;
+	memset(&format, 0, sizeof(format));
+	uint width = 0, height = 0, interlace = 0;
+	bool have_header = false;
+	size_t first_data = 0;
+	for (size_t pos = sizeof(PNG_SIGNATURE); ; ) {
+		if (pos + 12 > size)
+			return HttpImage_Fail(result, "the PNG is truncated");
+		const uint32 length = HttpImage_Read32(pData + pos);
+		if (length > size - pos - 12)
+			return HttpImage_Fail(result, "the PNG is truncated");
+		const unsigned char* p_type = pData + pos + 4;
+		const unsigned char* p_chunk = pData + pos + 8;
+		if (crc32(crc32(0, Z_NULL, 0), p_type, length + 4) != HttpImage_Read32(p_chunk + length))
+			return HttpImage_Fail(result, "the PNG is corrupt (a chunk's CRC is wrong)");
+		if (!memcmp(p_type, "IHDR", 4)) {
+			if (length != 13 || have_header)
+				return HttpImage_Fail(result, "the PNG's header is invalid");
+			width = HttpImage_Read32(p_chunk);
+			height = HttpImage_Read32(p_chunk + 4);
+			format.depth = p_chunk[8];
+			format.colourType = p_chunk[9];
+			interlace = p_chunk[12];
+			if (p_chunk[10] != 0 || p_chunk[11] != 0 || interlace > 1)
+				return HttpImage_Fail(result, "the PNG's header is invalid");
+			switch (format.colourType) {
+			case 0: format.channels = 1; have_header = format.depth == 1 || format.depth == 2 || format.depth == 4 || format.depth == 8 || format.depth == 16; break;
+			case 2: format.channels = 3; have_header = format.depth == 8 || format.depth == 16; break;
+			case 3: format.channels = 1; have_header = format.depth == 1 || format.depth == 2 || format.depth == 4 || format.depth == 8; break;
+			case 4: format.channels = 2; have_header = format.depth == 8 || format.depth == 16; break;
+			case 6: format.channels = 4; have_header = format.depth == 8 || format.depth == 16; break;
+			default: break;
+			}
+			if (!have_header)
+				return HttpImage_Fail(result, "the PNG's bit depth or colour type is invalid");
+			if (!HttpImage_CheckSize(width, height, result))
+				return false;
+		} else if (!have_header) {
+			return HttpImage_Fail(result, "the PNG has no header");
+		} else if (!memcmp(p_type, "PLTE", 4)) {
+			if (length % 3 || length > 256 * 3)
+				return HttpImage_Fail(result, "the PNG's palette is invalid");
+			format.paletteSize = length / 3;
+			for (uint i = 0; i < format.paletteSize; i++) {
+				memcpy(format.palette + i * 4, p_chunk + i * 3, 3);
+				format.palette[i * 4 + 3] = 255;
+			}
+		} else if (!memcmp(p_type, "tRNS", 4)) {
+			if (format.colourType == 3) {
+				for (uint i = 0; i < length && i < format.paletteSize; i++)
+					format.palette[i * 4 + 3] = p_chunk[i];
+			} else if (format.colourType == 0 && length >= 2) {
+				format.hasKey = true;
+				format.key[0] = HttpImage_Read16(p_chunk);
+			} else if (format.colourType == 2 && length >= 6) {
+				format.hasKey = true;
+				for (uint c = 0; c < 3; c++)
+					format.key[c] = HttpImage_Read16(p_chunk + c * 2);
+			}
+		} else if (!memcmp(p_type, "IDAT", 4)) {
+			first_data = pos;
+			break; // (The chunks that matter come before the data)
+		} else if (!memcmp(p_type, "IEND", 4)) {
+			return HttpImage_Fail(result, "the PNG has no image data");
+		}
+		pos += length + 12;
+	}
+	if (format.colourType == 3 && !format.paletteSize)
+		return HttpImage_Fail(result, "the PNG has no palette");
+
+	uint out_width, out_height;
+	HttpImageDecoder::FitWithin(width, height, maxWidth, maxHeight, out_width, out_height);
+	HttpImage_Scaler scaler;
+	HttpImage_PngStream stream(pData, size, first_data);
+	const uint bits_per_pixel = format.depth * format.channels;
+	const uint bpp = (bits_per_pixel + 7) / 8; // The distance the filters look back, in bytes
+	const size_t max_row_bytes = ((size_t)width * bits_per_pixel + 7) / 8;
+	unsigned char* p_rows = (unsigned char*)malloc((max_row_bytes + 1) * 2 + (size_t)width * 4);
+	unsigned char* p_image = interlace ? (unsigned char*)malloc((size_t)width * height * 4) : nullptr;
+	bool ok = p_rows && (!interlace || p_image) && stream.Init() && scaler.Begin(width, height, out_width, out_height);
+	if (!ok)
+		result.pError = "out of memory";
+	unsigned char* p_row = p_rows;
+	unsigned char* p_prev = p_rows + max_row_bytes + 1;
+	unsigned char* p_rgba = p_rows + (max_row_bytes + 1) * 2;
+	// Adam7 (or, if it isn't interlaced, one pass of the whole image):
+	static const uint PASSES[7][4] = { { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } };
+	static const uint WHOLE[1][4] = { { 0, 0, 1, 1 } };
+	const uint num_passes = interlace ? 7 : 1;
+	for (uint pass = 0; pass < num_passes && ok; pass++) {
+		const uint* p_pass = interlace ? PASSES[pass] : WHOLE[0];
+		if (p_pass[0] >= width || p_pass[1] >= height)
+			continue;
+		const uint pass_width = (width - p_pass[0] + p_pass[2] - 1) / p_pass[2];
+		const uint pass_height = (height - p_pass[1] + p_pass[3] - 1) / p_pass[3];
+		const size_t row_bytes = ((size_t)pass_width * bits_per_pixel + 7) / 8;
+		memset(p_prev, 0, row_bytes + 1);
+		for (uint y = 0; y < pass_height && ok; y++) {
+			if (!stream.Read(p_row, row_bytes + 1)) {
+				ok = false;
+				result.pError = "the PNG's image data is corrupt or truncated";
+				break;
+			}
+			if (!HttpImage_Unfilter(p_row[0], p_row + 1, p_prev + 1, row_bytes, bpp)) {
+				ok = false;
+				result.pError = "the PNG has an invalid filter";
+				break;
+			}
+			HttpImage_PngToRgba(format, p_row + 1, pass_width, p_rgba);
+			if (!interlace) {
+				scaler.AddRow(p_rgba);
+			} else {
+				unsigned char* p_dest = p_image + ((size_t)(p_pass[1] + y * p_pass[3]) * width + p_pass[0]) * 4;
+				for (uint x = 0; x < pass_width; x++, p_dest += p_pass[2] * 4)
+					memcpy(p_dest, p_rgba + x * 4, 4);
+			}
+			unsigned char* p_swap = p_prev;
+			p_prev = p_row;
+			p_row = p_swap;
+		}
+	}
+	if (ok && interlace) {
+		for (uint y = 0; y < height; y++)
+			scaler.AddRow(p_image + (size_t)y * width * 4);
+	}
+	free(p_rows);
+	free(p_image);
+	if (!ok)
+		return false;
+	scaler.Finish(result);
+	return true;
+}
+
+/////// JPEG ///////
+
+static const unsigned char JPEG_ZIGZAG[64 + 15] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+	// (So that a corrupt run that goes past the end of a block lands harmlessly)
+	63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63
+};
+
+class HttpImage_Jpeg {
+public:
+	HttpImage_Jpeg(const unsigned char* pData, size_t size, uint maxWidth, uint maxHeight, HttpImageDecoder::Result& result);
+	~HttpImage_Jpeg();
+	bool Decode();
+
+private:
+	enum { FAST_BITS = 9, NO_MARKER = -1 };
+	struct Huffman {
+		unsigned char fast[1 << FAST_BITS]; // By the next FAST_BITS bits: the index of the code they start with, or 255
+		uint16 code[256];
+		unsigned char size[257];
+		unsigned char values[256];
+		uint32 maxCode[18]; // Per code length: one more than the longest code of that length, left-aligned in 16 bits
+		int delta[17]; // Per code length: the index of its first code, less the code itself
+		bool defined;
+	};
+	struct Component {
+		uint id, h, v, quant;
+		uint dcTable, acTable; // Of the current scan
+		int dcPrediction;
+		uint blocksWide, blocksHigh; // Padded to whole MCUs
+		uint rowsStored; // Of blocks: blocksHigh, or only the v rows of one MCU row if the image is decoded a row at a time
+		short* pCoefficients; // Quantised, in natural order
+		uint cellWidth, cellHeight; // Samples in pPlane per block: 8 x 8, or when decoding from the DC coefficients, as many as the block covers in the output
+		unsigned char* pPlane; // One MCU row of samples, blocksWide * cellWidth wide
+	};
+	const unsigned char* m_pData;
+	const size_t m_size;
+	size_t m_pos;
+	const uint m_maxWidth, m_maxHeight;
+	HttpImageDecoder::Result& m_result;
+	uint16 m_quant[4][64]; // In natural order
+	bool m_quantDefined[4];
+	Huffman m_dc[4], m_ac[4];
+	// The frame:
+	bool m_haveFrame, m_progressive;
+	uint m_width, m_height;
+	Component m_components[4];
+	uint m_numComponents;
+	uint m_hMax, m_vMax, m_mcusWide, m_mcusHigh;
+	uint m_restartInterval;
+	int m_adobeTransform; // From an Adobe APP14 marker, or -1
+	// Output:
+	bool m_began; // The coefficients and planes have been allocated, at the first scan
+	bool m_streaming; // One scan of every component: each MCU row is output as soon as it is decoded
+	uint m_scale; // 1, or 8 to make one pixel from each block's DC coefficient
+	uint m_outWidth, m_outHeight; // The image at that scale, before the scaler
+	unsigned char* m_pRgba; // A row of that
+	HttpImage_Scaler m_scaler;
+	// The entropy-coded data of the current scan:
+	uint32 m_bits; // Left-aligned
+	int m_numBits;
+	int m_marker; // The marker that ended the data, once it has been reached
+	bool m_truncated;
+	uint m_eobRun; // For progressive AC scans
+	uint m_scanComponents[4], m_numScanComponents;
+	uint m_spectralStart, m_spectralEnd, m_approxHigh, m_approxLow;
+
+	bool Fail(const char* pError) { m_result.pError = pError; return false; }
+	int NextMarker(); // Skip to the next marker, and return it; NO_MARKER at the end of the data
+	bool ReadSegment(const unsigned char*& pSegment, uint& length); // The marker segment at m_pos, which it moves past
+	bool ReadFrame(const unsigned char* p, uint length);
+	bool ReadHuffman(const unsigned char* p, uint length);
+	bool ReadQuant(const unsigned char* p, uint length);
+	bool ReadScan(const unsigned char* p, uint length);
+	bool Begin();
+	bool DecodeScan();
+	bool DecodeBlock(Component& component, short* pBlock);
+	bool Restart();
+	void Fill();
+	uint GetBits(int n);
+	int GetSigned(int n); // n bits, extended to a signed value as the coefficients are coded
+	int DecodeHuffman(const Huffman& table);
+	short* Block(Component& component, uint x, uint y) { return component.pCoefficients + ((size_t)(y % component.rowsStored) * component.blocksWide + x) * 64; }
+	void OutputMcuRow(uint mcuRow);
+	void Idct(const short* pBlock, const uint16* pQuant, unsigned char* pOut, size_t stride);
+};
+
+HttpImage_Jpeg::HttpImage_Jpeg(const unsigned char* pData, size_t size, uint maxWidth, uint maxHeight, HttpImageDecoder::Result& result)
+	: m_pData(pData), m_size(size), m_pos(0), m_maxWidth(maxWidth), m_maxHeight(maxHeight), m_result(result), m_haveFrame(false), m_progressive(false),
+	  m_width(0), m_height(0), m_numComponents(0), m_hMax(1), m_vMax(1), m_mcusWide(0), m_mcusHigh(0), m_restartInterval(0), m_adobeTransform(-1),
+	  m_began(false), m_streaming(false), m_scale(1), m_outWidth(0), m_outHeight(0), m_pRgba(nullptr),
+	  m_bits(0), m_numBits(0), m_marker(NO_MARKER), m_truncated(false), m_eobRun(0), m_numScanComponents(0),
+	  m_spectralStart(0), m_spectralEnd(0), m_approxHigh(0), m_approxLow(0)
+{
+	memset(m_quantDefined, 0, sizeof(m_quantDefined));
+	for (uint i = 0; i < 4; i++) {
+		m_dc[i].defined = m_ac[i].defined = false;
+		m_components[i].pCoefficients = nullptr;
+		m_components[i].pPlane = nullptr;
+	}
+}
+
+HttpImage_Jpeg::~HttpImage_Jpeg() {
+	for (uint i = 0; i < 4; i++) {
+		free(m_components[i].pCoefficients);
+		free(m_components[i].pPlane);
+	}
+	free(m_pRgba);
+}
+
+bool HttpImage_Jpeg::Decode() {
+	if (m_size < 4 || m_pData[0] != 0xff || m_pData[1] != 0xd8)
+		return Fail("the JPEG has no start of image");
+	m_pos = 2;
+	bool decoded_scan = false;
+	for (;;) {
+		const int marker = NextMarker();
+		if (marker == NO_MARKER || marker == 0xd9) {
+			// End of image. (Data that just stops after a complete scan is taken as the end too, as libjpeg does.)
+			if (!decoded_scan)
+				return Fail("the JPEG is truncated");
+			break;
+		}
+		if (marker >= 0xd0 && marker <= 0xd7) {
+			m_pos += 2; // A stray restart marker
+			continue;
+		}
+		const unsigned char* p_segment;
+		uint length;
+		if (!ReadSegment(p_segment, length))
+			return false;
+		switch (marker) {
+		case 0xc0: // Baseline
+		case 0xc1: // Extended (with Huffman coding, which is all that differs for 8-bit samples)
+		case 0xc2: // Progressive
+			m_progressive = marker == 0xc2;
+			if (!ReadFrame(p_segment, length))
+				return false;
+			break;
+		case 0xc3: case 0xc5: case 0xc6: case 0xc7: case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+			return Fail("the JPEG is lossless, hierarchical or arithmetic-coded, which isn't supported");
+		case 0xc4:
+			if (!ReadHuffman(p_segment, length))
+				return false;
+			break;
+		case 0xdb:
+			if (!ReadQuant(p_segment, length))
+				return false;
+			break;
+		case 0xdd:
+			if (length < 2)
+				return Fail("the JPEG's restart interval is invalid");
+			m_restartInterval = HttpImage_Read16(p_segment);
+			break;
+		case 0xda:
+			if (!ReadScan(p_segment, length) || !DecodeScan())
+				return false;
+			decoded_scan = true;
+			break;
+		case 0xee: // APP14: Adobe's, which says how the colours are encoded
+			if (length >= 12 && !memcmp(p_segment, "Adobe", 5))
+				m_adobeTransform = p_segment[11];
+			break;
+		default: // Other APPn (JFIF, EXIF, ICC profiles), comments...
+			break;
+		}
+	}
+	if (!m_streaming) {
+		for (uint row = 0; row < m_mcusHigh; row++)
+			OutputMcuRow(row);
+	}
+	if (!m_scaler.IsComplete())
+		return Fail("the JPEG is truncated");
+	m_scaler.Finish(m_result);
+	return true;
+}
+
+int HttpImage_Jpeg::NextMarker() {
+	while (m_pos + 1 < m_size) {
+		if (m_pData[m_pos] == 0xff && m_pData[m_pos + 1] != 0 && m_pData[m_pos + 1] != 0xff) {
+			m_pos++;
+			return m_pData[m_pos++];
+		}
+		m_pos++;
+	}
+	return NO_MARKER;
+}
+
+bool HttpImage_Jpeg::ReadSegment(const unsigned char*& pSegment, uint& length) {
+	if (m_pos + 2 > m_size)
+		return Fail("the JPEG is truncated");
+	length = HttpImage_Read16(m_pData + m_pos);
+	if (length < 2 || m_pos + length > m_size)
+		return Fail("the JPEG is truncated");
+	pSegment = m_pData + m_pos + 2;
+	length -= 2;
+	m_pos += length + 2;
+	return true;
+}
+
+bool HttpImage_Jpeg::ReadFrame(const unsigned char* p, uint length) {
+	if (m_haveFrame)
+		return Fail("the JPEG has more than one frame");
+	if (length < 6 || p[0] != 8)
+		return Fail("the JPEG's frame is invalid, or not of 8-bit samples");
+	m_height = HttpImage_Read16(p + 1);
+	m_width = HttpImage_Read16(p + 3);
+	m_numComponents = p[5];
+	if (!m_height)
+		return Fail("the JPEG has its height after the first scan (DNL), which isn't supported");
+	if (!HttpImage_CheckSize(m_width, m_height, m_result))
+		return false;
+	if ((m_numComponents != 1 && m_numComponents != 3 && m_numComponents != 4) || length < 6 + m_numComponents * 3)
+		return Fail("the JPEG's frame is invalid");
+	for (uint i = 0; i < m_numComponents; i++) {
+		Component& component = m_components[i];
+		component.id = p[6 + i * 3];
+		component.h = p[7 + i * 3] >> 4;
+		component.v = p[7 + i * 3] & 15;
+		component.quant = p[8 + i * 3];
+		if (!component.h || component.h > 4 || !component.v || component.v > 4 || component.quant > 3)
+			return Fail("the JPEG's frame is invalid");
+		if (m_numComponents == 1)
+			component.h = component.v = 1; // (A single component's MCU is one block, whatever it says)
+		m_hMax = component.h > m_hMax ? component.h : m_hMax;
+		m_vMax = component.v > m_vMax ? component.v : m_vMax;
+	}
+	for (uint i = 0; i < m_numComponents; i++) {
+		if (m_hMax % m_components[i].h || m_vMax % m_components[i].v)
+			return Fail("the JPEG's sampling factors aren't supported");
+	}
+	m_mcusWide = (m_width + m_hMax * 8 - 1) / (m_hMax * 8);
+	m_mcusHigh = (m_height + m_vMax * 8 - 1) / (m_vMax * 8);
+	for (uint i = 0; i < m_numComponents; i++) {
+		m_components[i].blocksWide = m_mcusWide * m_components[i].h;
+		m_components[i].blocksHigh = m_mcusHigh * m_components[i].v;
+	}
+	m_haveFrame = true;
+	return true;
+}
+
+bool HttpImage_Jpeg::ReadHuffman(const unsigned char* p, uint length) {
+	while (length) {
+		if (length < 17)
+			return Fail("the JPEG's Huffman table is invalid");
+		const uint table_class = p[0] >> 4, index = p[0] & 15;
+		if (table_class > 1 || index > 3)
+			return Fail("the JPEG's Huffman table is invalid");
+		Huffman& table = table_class ? m_ac[index] : m_dc[index];
+		uint num_codes = 0;
+		for (uint i = 0; i < 16; i++)
+			num_codes += p[1 + i];
+		if (num_codes > 256 || length < 17 + num_codes)
+			return Fail("the JPEG's Huffman table is invalid");
+		// The codes, as JPEG assigns them: in order of length, counting up
+		uint k = 0;
+		for (uint i = 0; i < 16; i++) {
+			for (uint j = 0; j < p[1 + i]; j++)
+				table.size[k++] = (unsigned char)(i + 1);
+		}
+		table.size[k] = 0;
+		uint code = 0;
+		k = 0;
+		for (uint bits = 1; bits <= 16; bits++) {
+			table.delta[bits] = (int)k - (int)code;
+			const uint first = k;
+			while (table.size[k] == bits)
+				table.code[k++] = (uint16)code++;
+			if (k != first && code - 1 >= (1u << bits))
+				return Fail("the JPEG's Huffman table is invalid"); // (More codes of this length than there is room for)
+			table.maxCode[bits] = code << (16 - bits);
+			code <<= 1;
+		}
+		table.maxCode[17] = 0xffffffff;
+		memset(table.fast, 255, sizeof(table.fast));
+		for (uint i = 0; i < num_codes; i++) {
+			if (table.size[i] <= FAST_BITS) {
+				const uint first = (uint)table.code[i] << (FAST_BITS - table.size[i]);
+				const uint count = 1u << (FAST_BITS - table.size[i]);
+				for (uint j = 0; j < count; j++)
+					table.fast[first + j] = (unsigned char)i;
+			}
+		}
+		memcpy(table.values, p + 17, num_codes);
+		table.defined = true;
+		p += 17 + num_codes;
+		length -= 17 + num_codes;
+	}
+	return true;
+}
+
+bool HttpImage_Jpeg::ReadQuant(const unsigned char* p, uint length) {
+	while (length) {
+		const uint precision = p[0] >> 4, index = p[0] & 15;
+		const uint table_size = 1 + 64 * (precision ? 2 : 1);
+		if (precision > 1 || index > 3 || length < table_size)
+			return Fail("the JPEG's quantisation table is invalid");
+		for (uint i = 0; i < 64; i++)
+			m_quant[index][JPEG_ZIGZAG[i]] = (uint16)(precision ? HttpImage_Read16(p + 1 + i * 2) : p[1 + i]);
+		m_quantDefined[index] = true;
+		p += table_size;
+		length -= table_size;
+	}
+	return true;
+}
+
+bool HttpImage_Jpeg::ReadScan(const unsigned char* p, uint length) {
+	if (!m_haveFrame)
+		return Fail("the JPEG has a scan before its frame");
+	if (length < 1)
+		return Fail("the JPEG's scan is invalid");
+	m_numScanComponents = p[0];
+	if (!m_numScanComponents || m_numScanComponents > m_numComponents || length < 4 + m_numScanComponents * 2)
+		return Fail("the JPEG's scan is invalid");
+	for (uint i = 0; i < m_numScanComponents; i++) {
+		const uint id = p[1 + i * 2];
+		uint c = 0;
+		while (c < m_numComponents && m_components[c].id != id)
+			c++;
+		if (c == m_numComponents)
+			return Fail("the JPEG's scan is invalid");
+		m_scanComponents[i] = c;
+		m_components[c].dcTable = p[2 + i * 2] >> 4;
+		m_components[c].acTable = p[2 + i * 2] & 15;
+		if (m_components[c].dcTable > 3 || m_components[c].acTable > 3 || !m_quantDefined[m_components[c].quant])
+			return Fail("the JPEG's scan is invalid");
+	}
+	p += 1 + m_numScanComponents * 2;
+	m_spectralStart = p[0];
+	m_spectralEnd = p[1];
+	m_approxHigh = p[2] >> 4;
+	m_approxLow = p[2] & 15;
+	if (m_progressive) {
+		if (m_spectralStart > m_spectralEnd || m_spectralEnd > 63 || (m_spectralStart == 0 && m_spectralEnd != 0) || (m_spectralStart && m_numScanComponents != 1) || m_approxLow > 13)
+			return Fail("the JPEG's scan is invalid");
+	} else {
+		m_spectralStart = 0;
+		m_spectralEnd = 63;
+		m_approxHigh = m_approxLow = 0;
+	}
+	for (uint i = 0; i < m_numScanComponents; i++) {
+		const Component& component = m_components[m_scanComponents[i]];
+		const bool needs_dc = m_spectralStart == 0 && m_approxHigh == 0;
+		const bool needs_ac = m_spectralEnd > 0;
+		if ((needs_dc && !m_dc[component.dcTable].defined) || (needs_ac && !m_ac[component.acTable].defined))
+			return Fail("the JPEG's scan uses a Huffman table that it hasn't defined");
+	}
+	if (!m_began) {
+		m_streaming = !m_progressive && m_numScanComponents == m_numComponents;
+		if (!Begin())
+			return false;
+	} else if (m_streaming) {
+		return Fail("the JPEG has more scans than its first one said it would");
+	}
+	return true;
+}
+
+bool HttpImage_Jpeg::Begin() {
+	m_began = true;
+	uint fit_width, fit_height;
+	HttpImageDecoder::FitWithin(m_width, m_height, m_maxWidth, m_maxHeight, fit_width, fit_height);
+	const uint eighth_width = (m_width + 7) / 8, eighth_height = (m_height + 7) / 8;
+	m_scale = fit_width <= eighth_width && fit_height <= eighth_height ? 8 : 1;
+	m_outWidth = (m_width + m_scale - 1) / m_scale;
+	m_outHeight = (m_height + m_scale - 1) / m_scale;
+	for (uint i = 0; i < m_numComponents; i++) {
+		Component& component = m_components[i];
+		component.rowsStored = m_streaming ? component.v : component.blocksHigh;
+		component.cellWidth = m_scale == 8 ? m_hMax / component.h : 8;
+		component.cellHeight = m_scale == 8 ? m_vMax / component.v : 8;
+		component.pCoefficients = (short*)calloc((size_t)component.blocksWide * component.rowsStored * 64, sizeof(short));
+		component.pPlane = (unsigned char*)malloc((size_t)component.blocksWide * component.cellWidth * component.v * component.cellHeight);
+		if (!component.pCoefficients || !component.pPlane)
+			return Fail("out of memory");
+	}
+	m_pRgba = (unsigned char*)malloc((size_t)m_outWidth * 4);
+	if (!m_pRgba || !m_scaler.Begin(m_outWidth, m_outHeight, fit_width, fit_height))
+		return Fail("out of memory");
+	return true;
+}
+
+void HttpImage_Jpeg::Fill() {
+	while (m_numBits <= 24) {
+		uint byte = 0;
+		if (m_marker == NO_MARKER) {
+			if (m_pos >= m_size) {
+				m_truncated = true;
+			} else if (m_pData[m_pos] != 0xff) {
+				byte = m_pData[m_pos++];
+			} else {
+				size_t next = m_pos + 1;
+				while (next < m_size && m_pData[next] == 0xff)
+					next++; // (Fill bytes)
+				if (next >= m_size) {
+					m_truncated = true;
+				} else if (m_pData[next] == 0) {
+					byte = 0xff; // Stuffed
+					m_pos = next + 1;
+				} else {
+					m_marker = m_pData[next]; // The end of the data: the rest is zeros. (m_pos stays at the marker.)
+					m_pos = next - 1;
+				}
+			}
+		}
+		m_bits |= byte << (24 - m_numBits);
+		m_numBits += 8;
+	}
+}
+
+uint HttpImage_Jpeg::GetBits(int n) {
+	if (!n)
+		return 0;
+	if (m_numBits < n)
+		Fill();
+	const uint value = m_bits >> (32 - n);
+	m_bits <<= n;
+	m_numBits -= n;
+	return value;
+}
+
+int HttpImage_Jpeg::GetSigned(int n) {
+	if (!n)
+		return 0;
+	const int value = (int)GetBits(n);
+	return value < (1 << (n - 1)) ? value - (1 << n) + 1 : value;
+}
+
+int HttpImage_Jpeg::DecodeHuffman(const Huffman& table) {
+	if (m_numBits < 16)
+		Fill();
+	int k = table.fast[m_bits >> (32 - FAST_BITS)];
+	if (k < 255) {
+		const int size = table.size[k];
+		m_bits <<= size;
+		m_numBits -= size;
+		return table.values[k];
+	}
+	const uint32 top = m_bits >> 16;
+	for (k = FAST_BITS + 1; k <= 16; k++) {
+		if (top < table.maxCode[k])
+			break;
+	}
+	if (k > 16)
+		return -1; // Not a code
+	const int index = (int)(m_bits >> (32 - k)) + table.delta[k];
+	if (index < 0 || index >= 256)
+		return -1;
+	m_bits <<= k;
+	m_numBits -= k;
+	return table.values[index];
+}
+
+bool HttpImage_Jpeg::Restart() {
+	m_bits = 0;
+	m_numBits = 0;
+	if (m_marker == NO_MARKER) {
+		// (If the data has run on past where the restart marker should be, skip to it)
+		const size_t pos = m_pos;
+		if (NextMarker() != NO_MARKER) {
+			m_pos -= 2;
+			m_marker = m_pData[m_pos + 1];
+		} else {
+			m_pos = pos;
+		}
+	}
+	if (m_marker >= 0xd0 && m_marker <= 0xd7) {
+		m_pos += 2;
+		m_marker = NO_MARKER;
+	}
+	for (uint i = 0; i < m_numComponents; i++)
+		m_components[i].dcPrediction = 0;
+	m_eobRun = 0;
+	return !m_truncated;
+}
+
+bool HttpImage_Jpeg::DecodeBlock(Component& component, short* pBlock) {
+	if (m_spectralStart == 0) {
+		// DC (with all of AC too, unless it's progressive):
+		if (m_approxHigh == 0) {
+			const int size = DecodeHuffman(m_dc[component.dcTable]);
+			if (size < 0 || size > 11)
+				return Fail("the JPEG's data is corrupt");
+			component.dcPrediction += GetSigned(size);
+			pBlock[0] = (short)(component.dcPrediction * (1 << m_approxLow));
+		} else if (GetBits(1)) {
+			pBlock[0] = (short)(pBlock[0] | (1 << m_approxLow));
+		}
+		if (m_progressive)
+			return true;
+		const Huffman& ac = m_ac[component.acTable];
+		for (uint k = 1; k < 64; ) {
+			const int rs = DecodeHuffman(ac);
+			if (rs < 0)
+				return Fail("the JPEG's data is corrupt");
+			const uint run = rs >> 4, size = rs & 15;
+			if (!size) {
+				if (run != 15)
+					break; // End of block
+				k += 16;
+				continue;
+			}
+			k += run;
+			pBlock[JPEG_ZIGZAG[k]] = (short)GetSigned(size);
+			k++;
+		}
+		return true;
+	}
+	const Huffman& ac = m_ac[component.acTable];
+	if (m_approxHigh == 0) {
+		// A band of AC coefficients, first time:
+		if (m_eobRun) {
+			m_eobRun--;
+			return true;
+		}
+		for (uint k = m_spectralStart; k <= m_spectralEnd; ) {
+			const int rs = DecodeHuffman(ac);
+			if (rs < 0)
+				return Fail("the JPEG's data is corrupt");
+			const uint run = rs >> 4, size = rs & 15;
+			if (!size) {
+				if (run < 15) {
+					m_eobRun = (1u << run) - 1 + GetBits(run);
+					break;
+				}
+				k += 16;
+				continue;
+			}
+			k += run;
+			pBlock[JPEG_ZIGZAG[k]] = (short)(GetSigned(size) * (1 << m_approxLow));
+			k++;
+		}
+		return true;
+	}
+	// A band of AC coefficients, refined by a bit:
+	const int plus = 1 << m_approxLow, minus = -1 * (1 << m_approxLow);
+	uint k = m_spectralStart;
+	if (!m_eobRun) {
+		for (; k <= m_spectralEnd; k++) {
+			const int rs = DecodeHuffman(ac);
+			if (rs < 0)
+				return Fail("the JPEG's data is corrupt");
+			int run = rs >> 4, value = 0;
+			if (rs & 15) {
+				value = GetBits(1) ? plus : minus; // A new coefficient, of magnitude 1
+			} else if (run != 15) {
+				m_eobRun = 1u << run;
+				if (run)
+					m_eobRun += GetBits(run);
+				break;
+			}
+			// Refine the coefficients that are already nonzero, up to the run'th zero one:
+			while (k <= m_spectralEnd) {
+				short& coefficient = pBlock[JPEG_ZIGZAG[k]];
+				if (coefficient) {
+					if (GetBits(1) && !(coefficient & plus))
+						coefficient = (short)(coefficient + (coefficient >= 0 ? plus : minus));
+				} else if (--run < 0) {
+					break;
+				}
+				k++;
+			}
+			if (value && k <= 63)
+				pBlock[JPEG_ZIGZAG[k]] = (short)value;
+		}
+	}
+	if (m_eobRun) {
+		// The rest of the block only refines the coefficients that are already nonzero:
+		for (; k <= m_spectralEnd; k++) {
+			short& coefficient = pBlock[JPEG_ZIGZAG[k]];
+			if (coefficient && GetBits(1) && !(coefficient & plus))
+				coefficient = (short)(coefficient + (coefficient >= 0 ? plus : minus));
+		}
+		m_eobRun--;
+	}
+	return true;
+}
+
+bool HttpImage_Jpeg::DecodeScan() {
+	m_bits = 0;
+	m_numBits = 0;
+	m_marker = NO_MARKER;
+	m_eobRun = 0;
+	for (uint i = 0; i < m_numComponents; i++)
+		m_components[i].dcPrediction = 0;
+	uint to_restart = m_restartInterval;
+	if (m_numScanComponents == 1) {
+		// Not interleaved: the component's blocks in order, only as many as cover the image
+		Component& component = m_components[m_scanComponents[0]];
+		const uint wide = ((m_width * component.h + m_hMax - 1) / m_hMax + 7) / 8;
+		const uint high = ((m_height * component.v + m_vMax - 1) / m_vMax + 7) / 8;
+		for (uint y = 0; y < high; y++) {
+			for (uint x = 0; x < wide; x++) {
+				if (!DecodeBlock(component, Block(component, x, y)))
+					return false;
+				if (m_restartInterval && --to_restart == 0) {
+					to_restart = m_restartInterval;
+					if (!Restart())
+						break;
+				}
+			}
+			if (m_truncated)
+				return Fail("the JPEG is truncated");
+			if (m_streaming) {
+				// (Only a greyscale image, whose MCU is one block)
+				OutputMcuRow(y);
+				memset(component.pCoefficients, 0, (size_t)component.blocksWide * component.rowsStored * 64 * sizeof(short));
+			}
+		}
+		return true;
+	}
+	for (uint y = 0; y < m_mcusHigh; y++) {
+		for (uint x = 0; x < m_mcusWide; x++) {
+			for (uint i = 0; i < m_numScanComponents; i++) {
+				Component& component = m_components[m_scanComponents[i]];
+				for (uint by = 0; by < component.v; by++) {
+					for (uint bx = 0; bx < component.h; bx++) {
+						if (!DecodeBlock(component, Block(component, x * component.h + bx, y * component.v + by)))
+							return false;
+					}
+				}
+			}
+			if (m_restartInterval && --to_restart == 0) {
+				to_restart = m_restartInterval;
+				if (!Restart())
+					break;
+			}
+		}
+		if (m_truncated)
+			return Fail("the JPEG is truncated");
+		if (m_streaming) {
+			OutputMcuRow(y);
+			for (uint i = 0; i < m_numComponents; i++)
+				memset(m_components[i].pCoefficients, 0, (size_t)m_components[i].blocksWide * m_components[i].rowsStored * 64 * sizeof(short));
+		}
+	}
+	return true;
+}
+
+// The islow IDCT of the IJG's libjpeg, as adapted by stb_image (12 bits of fraction):
+#define HTTP_IMAGE_F2F(x) ((int)((x) * 4096 + 0.5))
+#define HTTP_IMAGE_IDCT_1D(s0, s1, s2, s3, s4, s5, s6, s7) \
+	int t0, t1, t2, t3, p1, p2, p3, p4, p5, x0, x1, x2, x3; \
+	p2 = s2; \
+	p3 = s6; \
+	p1 = (p2 + p3) * HTTP_IMAGE_F2F(0.5411961f); \
+	t2 = p1 + p3 * HTTP_IMAGE_F2F(-1.847759065f); \
+	t3 = p1 + p2 * HTTP_IMAGE_F2F(0.765366865f); \
+	p2 = s0; \
+	p3 = s4; \
+	t0 = (p2 + p3) * 4096; \
+	t1 = (p2 - p3) * 4096; \
+	x0 = t0 + t3; \
+	x3 = t0 - t3; \
+	x1 = t1 + t2; \
+	x2 = t1 - t2; \
+	t0 = s7; \
+	t1 = s5; \
+	t2 = s3; \
+	t3 = s1; \
+	p3 = t0 + t2; \
+	p4 = t1 + t3; \
+	p1 = t0 + t3; \
+	p2 = t1 + t2; \
+	p5 = (p3 + p4) * HTTP_IMAGE_F2F(1.175875602f); \
+	t0 = t0 * HTTP_IMAGE_F2F(0.298631336f); \
+	t1 = t1 * HTTP_IMAGE_F2F(2.053119869f); \
+	t2 = t2 * HTTP_IMAGE_F2F(3.072711026f); \
+	t3 = t3 * HTTP_IMAGE_F2F(1.501321110f); \
+	p1 = p5 + p1 * HTTP_IMAGE_F2F(-0.899976223f); \
+	p2 = p5 + p2 * HTTP_IMAGE_F2F(-2.562915447f); \
+	p3 = p3 * HTTP_IMAGE_F2F(-1.961570560f); \
+	p4 = p4 * HTTP_IMAGE_F2F(-0.390180644f); \
+	t3 += p1 + p4; \
+	t2 += p2 + p3; \
+	t1 += p2 + p4; \
+	t0 += p1 + p3;
+
+// A coefficient times its quantisation. Those of a real image are within +-1024 or so (the DC coefficient being 8
+// times the mean, from -128 to 127); clamping them keeps a corrupt image's from overflowing the IDCT.
+static int HttpImage_Dequantise(short coefficient, uint16 quant) {
+	const int value = coefficient * (int)quant;
+	return value < -2048 ? -2048 : value > 2047 ? 2047 : value;
+}
+
+void HttpImage_Jpeg::Idct(const short* pBlock, const uint16* pQuant, unsigned char* pOut, size_t stride) {
+	int values[64];
+	// Columns:
+	for (uint i = 0; i < 8; i++) {
+		const short* p_in = pBlock + i;
+		const uint16* p_quant = pQuant + i;
+		int* p_value = values + i;
+		if (!p_in[8] && !p_in[16] && !p_in[24] && !p_in[32] && !p_in[40] && !p_in[48] && !p_in[56]) {
+			const int dc = HttpImage_Dequantise(p_in[0], p_quant[0]) * 4;
+			for (uint j = 0; j < 8; j++)
+				p_value[j * 8] = dc;
+			continue;
+		}
+		HTTP_IMAGE_IDCT_1D(HttpImage_Dequantise(p_in[0], p_quant[0]), HttpImage_Dequantise(p_in[8], p_quant[8]),
+			HttpImage_Dequantise(p_in[16], p_quant[16]), HttpImage_Dequantise(p_in[24], p_quant[24]),
+			HttpImage_Dequantise(p_in[32], p_quant[32]), HttpImage_Dequantise(p_in[40], p_quant[40]),
+			HttpImage_Dequantise(p_in[48], p_quant[48]), HttpImage_Dequantise(p_in[56], p_quant[56]))
+		x0 += 512; x1 += 512; x2 += 512; x3 += 512;
+		p_value[0] = (x0 + t3) >> 10;
+		p_value[56] = (x0 - t3) >> 10;
+		p_value[8] = (x1 + t2) >> 10;
+		p_value[48] = (x1 - t2) >> 10;
+		p_value[16] = (x2 + t1) >> 10;
+		p_value[40] = (x2 - t1) >> 10;
+		p_value[24] = (x3 + t0) >> 10;
+		p_value[32] = (x3 - t0) >> 10;
+	}
+	// Rows:
+	for (uint i = 0; i < 8; i++, pOut += stride) {
+		const int* p_value = values + i * 8;
+		HTTP_IMAGE_IDCT_1D(p_value[0], p_value[1], p_value[2], p_value[3], p_value[4], p_value[5], p_value[6], p_value[7])
+		// (The level shift and the rounding in one)
+		x0 += 65536 + (128 << 17);
+		x1 += 65536 + (128 << 17);
+		x2 += 65536 + (128 << 17);
+		x3 += 65536 + (128 << 17);
+		pOut[0] = HttpImage_Clamp((x0 + t3) >> 17);
+		pOut[7] = HttpImage_Clamp((x0 - t3) >> 17);
+		pOut[1] = HttpImage_Clamp((x1 + t2) >> 17);
+		pOut[6] = HttpImage_Clamp((x1 - t2) >> 17);
+		pOut[2] = HttpImage_Clamp((x2 + t1) >> 17);
+		pOut[5] = HttpImage_Clamp((x2 - t1) >> 17);
+		pOut[3] = HttpImage_Clamp((x3 + t0) >> 17);
+		pOut[4] = HttpImage_Clamp((x3 - t0) >> 17);
+	}
+}
+
+#undef HTTP_IMAGE_IDCT_1D
+#undef HTTP_IMAGE_F2F
+
+// (x * y / 255, near enough)
+static unsigned char HttpImage_Multiply(uint x, uint y) {
+	const uint t = x * y + 128;
+	return (unsigned char)((t + (t >> 8)) >> 8);
+}
+
+void HttpImage_Jpeg::OutputMcuRow(uint mcuRow) {
+	// Each component's samples for the row, from its blocks:
+	for (uint i = 0; i < m_numComponents; i++) {
+		Component& component = m_components[i];
+		const uint16* p_quant = m_quant[component.quant];
+		const uint cell_width = component.cellWidth, cell_height = component.cellHeight;
+		const size_t stride = (size_t)component.blocksWide * cell_width;
+		for (uint by = 0; by < component.v; by++) {
+			for (uint bx = 0; bx < component.blocksWide; bx++) {
+				const short* p_block = Block(component, bx, mcuRow * component.v + by);
+				unsigned char* p_out = component.pPlane + by * cell_height * stride + bx * cell_width;
+				if (cell_width == 8 && cell_height == 8) {
+					Idct(p_block, p_quant, p_out, stride);
+				} else if (cell_width == 1 && cell_height == 1) {
+					*p_out = HttpImage_Clamp((HttpImage_Dequantise(p_block[0], p_quant[0]) >> 3) + 128); // (The DC coefficient is 8 times the mean)
+				} else {
+					// A subsampled block, which covers more than one output pixel when scaled: the means of its parts.
+					unsigned char samples[64];
+					Idct(p_block, p_quant, samples, 8);
+					for (uint cy = 0; cy < cell_height; cy++) {
+						const uint top = cy * 8 / cell_height, bottom = (cy + 1) * 8 / cell_height;
+						for (uint cx = 0; cx < cell_width; cx++) {
+							const uint left = cx * 8 / cell_width, right = (cx + 1) * 8 / cell_width;
+							uint sum = 0;
+							for (uint y = top; y < bottom; y++) {
+								for (uint x = left; x < right; x++)
+									sum += samples[y * 8 + x];
+							}
+							const uint count = (bottom - top) * (right - left);
+							p_out[cy * stride + cx] = (unsigned char)((sum + count / 2) / count);
+						}
+					}
+				}
+			}
+		}
+	}
+	// Then the image's rows, in RGBA:
+	const bool rgb = m_numComponents == 3 && (m_adobeTransform == 0 || (m_components[0].id == 'R' && m_components[1].id == 'G' && m_components[2].id == 'B'));
+	const uint cell = 8 / m_scale; // Output pixels per block of the largest component, each way
+	const uint first = mcuRow * m_vMax * cell;
+	uint columns[4]; // Per output pixel, in the components' samples: x * columns[i] / (m_hMax * cell)
+	for (uint i = 0; i < m_numComponents; i++)
+		columns[i] = m_components[i].h * m_components[i].cellWidth;
+	for (uint line = 0; line < m_vMax * cell && first + line < m_outHeight; line++) {
+		const unsigned char* p_rows[4];
+		for (uint i = 0; i < m_numComponents; i++) {
+			const Component& component = m_components[i];
+			p_rows[i] = component.pPlane + (size_t)(line * component.v * component.cellHeight / (m_vMax * cell)) * component.blocksWide * component.cellWidth;
+		}
+		unsigned char* p_out = m_pRgba;
+		for (uint x = 0; x < m_outWidth; x++, p_out += 4) {
+			uint samples[4];
+			for (uint i = 0; i < m_numComponents; i++)
+				samples[i] = p_rows[i][x * columns[i] / (m_hMax * cell)];
+			if (m_numComponents == 1) {
+				p_out[0] = p_out[1] = p_out[2] = (unsigned char)samples[0];
+			} else if (rgb || (m_numComponents == 4 && m_adobeTransform != 2)) {
+				// RGB, or (Adobe's, inverted) CMYK:
+				p_out[0] = (unsigned char)samples[0];
+				p_out[1] = (unsigned char)samples[1];
+				p_out[2] = (unsigned char)samples[2];
+			} else {
+				// YCbCr (or the YCC of YCCK), with 16 bits of fraction:
+				const int y = (int)(samples[0] << 16) + 32768, cb = (int)samples[1] - 128, cr = (int)samples[2] - 128;
+				p_out[0] = HttpImage_Clamp((y + cr * 91881) >> 16);
+				p_out[1] = HttpImage_Clamp((y - cb * 22554 - cr * 46802) >> 16);
+				p_out[2] = HttpImage_Clamp((y + cb * 116130) >> 16);
+				if (m_numComponents == 4) {
+					p_out[0] = (unsigned char)(255 - p_out[0]);
+					p_out[1] = (unsigned char)(255 - p_out[1]);
+					p_out[2] = (unsigned char)(255 - p_out[2]);
+				}
+			}
+			if (m_numComponents == 4) {
+				p_out[0] = HttpImage_Multiply(p_out[0], samples[3]);
+				p_out[1] = HttpImage_Multiply(p_out[1], samples[3]);
+				p_out[2] = HttpImage_Multiply(p_out[2], samples[3]);
+			}
+			p_out[3] = 255;
+		}
+		m_scaler.AddRow(m_pRgba);
+	}
+}
+
+/////// HttpImageDecoder ///////
+
+HttpImageDecoder::Format HttpImageDecoder::Sniff(const unsigned char* pData, size_t size) {
+	if (size >= sizeof(PNG_SIGNATURE) && !memcmp(pData, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)))
+		return FORMAT_PNG;
+	if (size >= 3 && pData[0] == 0xff && pData[1] == 0xd8 && pData[2] == 0xff)
+		return FORMAT_JPEG;
+	return FORMAT_UNKNOWN;
+}
+
+void HttpImageDecoder::FitWithin(uint width, uint height, uint maxWidth, uint maxHeight, uint& fitWidth, uint& fitHeight) {
+	fitWidth = width;
+	fitHeight = height;
+	if (maxWidth && fitWidth > maxWidth) {
+		fitHeight = (uint)(((uint64)fitHeight * maxWidth + fitWidth / 2) / fitWidth);
+		fitWidth = maxWidth;
+	}
+	if (maxHeight && fitHeight > maxHeight) {
+		fitWidth = (uint)(((uint64)fitWidth * maxHeight + fitHeight / 2) / fitHeight);
+		fitHeight = maxHeight;
+	}
+	fitWidth = fitWidth ? fitWidth : 1;
+	fitHeight = fitHeight ? fitHeight : 1;
+}
+
+bool HttpImageDecoder::Worker_Decode(const unsigned char* pData, size_t size, uint maxWidth, uint maxHeight, Result& result) {
+	result = Result();
+	result.format = Sniff(pData, size);
+	bool ok;
+	switch (result.format) {
+	case FORMAT_PNG:
+		ok = HttpImage_DecodePng(pData, size, maxWidth, maxHeight, result);
+		break;
+	case FORMAT_JPEG: {
+		HttpImage_Jpeg jpeg(pData, size, maxWidth, maxHeight, result);
+		ok = jpeg.Decode();
+		break;
+	}
+	default:
+		return HttpImage_Fail(result, "the data isn't a PNG or a JPEG");
+	}
+	if (!ok && !result.pError)
+		result.pError = "the image is invalid";
+	return ok;
+}
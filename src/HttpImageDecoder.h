@@ -0,0 +1,58 @@
+// HttpImageDecoder:
+// Decodes a PNG or a JPEG into 8-bit RGBA pixels, ready to upload as a
+// texture, optionally scaled down on the way to fit within a box (e.g. a
+// thumbnail's), without ever holding the full size image unless it has to.
+// It is what HttpImageRequest decodes with, and it can be called from any
+// other code that has a whole image body on a worker or a pool thread, e.g. a
+// worker callback (see HttpRequest::SetWorkerCallback()) or an HttpJob.
+//  - PNG: any bit depth and colour type, including palettes, transparency
+//    (tRNS) and interlacing (which does need the full size image). Ancillary
+//    chunks (gamma, colour profiles, text) are ignored. Inflated with the zlib
+//    that curl is linked with, a row at a time.
+//  - JPEG: baseline and progressive Huffman-coded, greyscale, YCbCr, and
+//    Adobe's CMYK and YCCK, with any sampling factors. Chroma is upsampled by
+//    replicating it (as libjpeg does without "fancy" upsampling). A baseline
+//    image is decoded a row of MCUs at a time; a progressive one keeps all of
+//    its coefficients until the last scan. An image that is to be scaled down
+//    to an eighth of its size or less is decoded from the blocks' DC
+//    coefficients alone, skipping the IDCT. EXIF orientation is ignored.
+// Scaling averages each box of source pixels that makes an output pixel,
+// weighted by alpha. Images are only ever scaled down.
+// Everything it allocates is in the calling thread's memory environment, and
+// the pixels come from HttpBuffer::Worker_Alloc(), so it must be called in
+// the worker memory environment (see HttpClientWorker.h).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include "s3eTypes.h"
+
+class HttpImageDecoder {
+public:
+	enum Format {
+		FORMAT_UNKNOWN,
+		FORMAT_PNG,
+		FORMAT_JPEG
+	};
+	// An image with more pixels than this fails to decode, rather than use up the memory:
+	enum { MAX_PIXELS = 32 * 1024 * 1024 };
+	struct Result {
+		unsigned char* pPixels; // RGBA, width * 4 bytes per row, top row first; from HttpBuffer::Worker_Alloc()
+		uint width, height; // Of pPixels
+		uint sourceWidth, sourceHeight; // Of the image as it was encoded
+		Format format;
+		const char* pError; // If it failed: why (a string constant)
+		Result() : pPixels(nullptr), width(0), height(0), sourceWidth(0), sourceHeight(0), format(FORMAT_UNKNOWN), pError(nullptr) {}
+	};
+
+	// Which format the data is in, from its first bytes:
+	static Format Sniff(const unsigned char* pData, size_t size);
+	// The size that an image of width x height is scaled down to, to fit within maxWidth x maxHeight (keeping its
+	// aspect ratio; either may be 0 for no limit):
+	static void FitWithin(uint width, uint height, uint maxWidth, uint maxHeight, uint& fitWidth, uint& fitHeight);
+	// Decode size bytes of image data. Returns false (with result.pError set, and no pixels) if it can't.
+	static bool Worker_Decode(const unsigned char* pData, size_t size, uint maxWidth, uint maxHeight, Result& result);
+};
@@ -0,0 +1,124 @@
+// HttpImageRequest:
+// Downloads an image and decodes it into pixels, on the worker or a pool.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpImageRequest.h"
+
+#include "HttpAllocStats.h"
+#include "HttpCpuPool.h"
+
+using std::string;
+
+// Decodes a body on one of the pool's threads, for the request it came from:
+class HttpImageRequest::DecodeJob : public HttpJob {
+public:
+	DecodeJob(HttpImageRequest* pRequest, Ptr<HttpBuffer> pBody) :
+		m_pRequest(pRequest), m_pBody(pBody), m_maxWidth(pRequest->m_maxWidth), m_maxHeight(pRequest->m_maxHeight) {}
+	~DecodeJob() {
+		// Dropped by the pool before it was done (the pool was destroyed), while the request still waited for it:
+		if (m_pRequest)
+			m_pRequest->AbandonDecode();
+	}
+	void Detach() { m_pRequest = nullptr; } // The request no longer waits for us (and may be gone)
+
+	virtual void Worker_Run() {
+		HttpImageDecoder::Worker_Decode(m_pBody->Data(), m_pBody->Size(), m_maxWidth, m_maxHeight, m_result);
+	}
+	virtual void Worker_Cleanup() {
+		// (Unless the request took the pixels over)
+		HttpBuffer::Worker_Free(m_result.pPixels);
+		m_result.pPixels = nullptr;
+	}
+	virtual void HandleDone() {
+		HttpImageRequest* p_request = m_pRequest;
+		m_pRequest = nullptr;
+		m_pBody = nullptr; // (The app thread's to release)
+		p_request->FinishDecode(m_result);
+	}
+
+private:
+	HttpImageRequest* m_pRequest; // App thread only
+	Ptr<HttpBuffer> m_pBody;
+	const uint m_maxWidth, m_maxHeight;
+	HttpImageDecoder::Result m_result;
+};
+
+HttpImageRequest::HttpImageRequest(const string& url, uint maxWidth, uint maxHeight, size_t maxSize) :
+	HttpMemoryDownload(url, maxSize), m_maxWidth(maxWidth), m_maxHeight(maxHeight), m_pDecodePool(nullptr), m_pJob(nullptr)
+{
+}
+
+HttpImageRequest::~HttpImageRequest() {
+	IwAssert(HTTP_CLIENT, m_pJob == nullptr);
+}
+
+size_t HttpImageRequest::EstimateMemory(int64 contentLength) const {
+	const size_t pixels = m_maxWidth && m_maxHeight ? (size_t)m_maxWidth * m_maxHeight * 4 : 0;
+	return HttpMemoryDownload::EstimateMemory(contentLength) + pixels;
+}
+
+bool HttpImageRequest::Worker_HandleBody(unsigned char* pData, size_t size) {
+	if (m_pDecodePool)
+		return true; // The pool decodes it, once HandleResponse() has the body
+	HTTP_ALLOC_SCOPE(SITE_BODY, nullptr);
+	if (!HttpImageDecoder::Worker_Decode(pData, size, m_maxWidth, m_maxHeight, m_image))
+		return false;
+	Worker_SetBody(m_image.pPixels, (size_t)m_image.width * m_image.height * 4);
+	m_image.pPixels = nullptr;
+	return true;
+}
+
+void HttpImageRequest::HandleResponse(bool success, int httpStatusCode) {
+	HttpMemoryDownload::HandleResponse(success, httpStatusCode);
+	if (m_status != DONE || !m_pDecodePool)
+		return;
+	// Our status stays HEADERS until the pool has decoded the body, so our callback won't be called yet:
+	m_status = HEADERS;
+	m_pSelf = this;
+	Ptr<DecodeJob> p_job = new DecodeJob(this, TakeBuffer());
+	m_pJob = p_job.ptr();
+	m_pDecodePool->Submit(p_job);
+}
+
+void HttpImageRequest::FinishDecode(HttpImageDecoder::Result& result) {
+	m_pJob = nullptr;
+	m_image = result;
+	m_image.pPixels = nullptr;
+	if (result.pPixels) {
+		m_pBuffer = new HttpBuffer(result.pPixels, (size_t)result.width * result.height * 4);
+		result.pPixels = nullptr; // (Ours now, so the job's Worker_Cleanup() leaves it alone)
+	}
+	m_status = m_pBuffer ? DONE : ERROR;
+	Ptr<HttpImageRequest> p_this = m_pSelf; // We may be deleted once this goes out of scope
+	m_pSelf = nullptr;
+	NotifyDone();
+}
+
+void HttpImageRequest::AbandonDecode() {
+	m_pJob = nullptr;
+	m_image.pError = "the decode pool was destroyed";
+	m_status = ERROR;
+	Ptr<HttpImageRequest> p_this = m_pSelf;
+	m_pSelf = nullptr;
+}
+
+void HttpImageRequest::Abort() {
+	HttpMemoryDownload::Abort(); // (Which forgets the callbacks, if we're HEADERS)
+	if (!m_pJob)
+		return;
+	// The transfer is over, and the pool has the body: there's only the decoding to stop.
+	m_pJob->Cancel();
+	m_pJob->Detach();
+	m_pJob = nullptr;
+	m_status = ERROR;
+	Ptr<HttpImageRequest> p_this = m_pSelf;
+	m_pSelf = nullptr;
+	NotifyDone();
+}
+
+void HttpImageRequest::HandleRequeue() {
+	m_image = HttpImageDecoder::Result();
+	HttpMemoryDownload::HandleRequeue();
+}
@@ -0,0 +1,72 @@
+// HttpImageRequest:
+// Downloads a PNG or a JPEG and decodes it into RGBA pixels (see
+// HttpImageDecoder.h), optionally scaled down to fit within a box, so that
+// the app gets a buffer that it can upload as a texture as it is:
+//     client.QueueRequest(new HttpImageRequest(url, 256, 256), this, &MyModule::HandleThumbnail);
+//     void MyModule::HandleThumbnail(Ptr<HttpRequest> pRequest) {
+//         HttpImageRequest* p_image = static_cast<HttpImageRequest*>(pRequest.ptr());
+//         if (p_image->GetStatus() == HttpRequest::DONE)
+//             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, p_image->GetWidth(), p_image->GetHeight(), 0, GL_RGBA,
+//                 GL_UNSIGNED_BYTE, p_image->GetBuffer()->Data());
+//     }
+// The body is downloaded into memory as for an HttpMemoryDownload, and the
+// pixels replace it. By default the worker decodes it, once it is all in,
+// which holds up the worker's next transfer for as long as that takes. With
+// SetDecodePool(), an HttpCpuPool decodes it instead: the request stays
+// HEADERS while the pool has its body, and its callback is called from the
+// pool's Update() (e.g. HttpClient::Update(), with the pool attached) once the
+// pixels are ready.
+// A body that isn't a PNG or a JPEG, or that can't be decoded, fails the
+// request, and GetDecodeError() says why.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "HttpImageDecoder.h"
+#include "HttpMemoryDownload.h"
+
+class HttpCpuPool;
+
+class HttpImageRequest : public HttpMemoryDownload {
+public:
+	// maxWidth x maxHeight: the box to scale the image down to fit within, if it is bigger (either may be 0, for no
+	// limit). maxSize: of the encoded body, as for HttpMemoryDownload.
+	HttpImageRequest(const std::string& url, uint maxWidth = 0, uint maxHeight = 0, size_t maxSize = 16 * 1024 * 1024);
+	~HttpImageRequest();
+
+	// Decode on one of pPool's threads, rather than the worker. The pool must not be destroyed while the transfer is
+	// under way; if it is destroyed while it has the body, the request fails without its callback being called.
+	HttpImageRequest& SetDecodePool(HttpCpuPool* pPool) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_pDecodePool = pPool; return *this; }
+	// Once the request is DONE: the size of the pixels (GetBuffer() holds width * height * 4 bytes of RGBA, the top
+	// row first), and of the image as it was encoded.
+	uint GetWidth() const { return m_image.width; }
+	uint GetHeight() const { return m_image.height; }
+	uint GetSourceWidth() const { return m_image.sourceWidth; }
+	uint GetSourceHeight() const { return m_image.sourceHeight; }
+	HttpImageDecoder::Format GetFormat() const { return m_image.format; }
+	// If the body arrived but couldn't be decoded: why. Otherwise nullptr.
+	const char* GetDecodeError() const { return m_image.pError; }
+
+	// Cancels the decoding too, if the pool has the body.
+	virtual void Abort();
+	// The pixels, if we know how big they can be, as well as the body:
+	virtual size_t EstimateMemory(int64 contentLength) const;
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void HandleRequeue();
+
+protected:
+	virtual bool Worker_HandleBody(unsigned char* pData, size_t size);
+
+private:
+	class DecodeJob;
+	void FinishDecode(HttpImageDecoder::Result& result);
+	void AbandonDecode();
+
+	const uint m_maxWidth, m_maxHeight;
+	HttpCpuPool* m_pDecodePool;
+	HttpImageDecoder::Result m_image; // Without its pixels, which are in m_pBuffer
+	DecodeJob* m_pJob; // While the pool has our body (it keeps the job alive)
+	Ptr<HttpImageRequest> m_pSelf; // Keeps us alive meanwhile, even if nobody else holds on to us
+};
@@ -0,0 +1,54 @@
+// HttpJsonCache:
+// An in-memory cache of parsed JSON responses, revalidated by ETag.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpJsonCache.h"
+
+using std::string;
+
+void HttpJsonCache::Clear() {
+	m_index.clear();
+	m_lru.clear();
+	m_numBytes = 0;
+}
+
+Ptr<HttpJsonCache::Entry> HttpJsonCache::Find(const string& key) {
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+		return nullptr;
+	m_lru.splice(m_lru.begin(), m_lru, it->second); // Now the most recently used
+	return it->second->second;
+}
+
+void HttpJsonCache::Store(const string& key, const string& etag, const json::UnknownElement& response, size_t size) {
+	Remove(key);
+	if (etag.empty() || size > m_maxBytes)
+		return;
+	Ptr<Entry> p_entry = new Entry;
+	p_entry->etag = etag;
+	p_entry->response = response; // (Shared, not copied)
+	p_entry->size = size;
+	m_lru.push_front(std::make_pair(key, p_entry));
+	m_index[key] = m_lru.begin();
+	m_numBytes += size;
+	Evict();
+}
+
+void HttpJsonCache::Remove(const string& key) {
+	auto it = m_index.find(key);
+	if (it != m_index.end())
+		Remove(it);
+}
+
+void HttpJsonCache::Remove(std::map<string, Lru::iterator>::iterator it) {
+	m_numBytes -= it->second->second->size;
+	m_lru.erase(it->second);
+	m_index.erase(it);
+}
+
+void HttpJsonCache::Evict() {
+	while ((m_numBytes > m_maxBytes || m_index.size() > m_maxEntries) && !m_lru.empty())
+		Remove(m_index.find(m_lru.back().first));
+}
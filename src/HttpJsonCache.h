@@ -0,0 +1,66 @@
+// HttpJsonCache:
+// An in-memory cache of parsed JSON responses, for HttpPost requests that opt
+// in with HttpPost::SetJsonCache(), e.g. an endpoint that is polled every few
+// seconds and whose answer hardly ever changes. Each entry is the document
+// that a response was parsed into, with the response's ETag. The next request
+// for the same resource sends that ETag as If-None-Match, and when the server
+// answers 304 Not Modified, the request's GetResponse() is the cached
+// document: nothing is read or parsed. The same goes for a response that
+// comes out of the HttpClient's caches (see HttpClient::SetCache() and
+// SetMemoryCache()) with the ETag of the cached document.
+// The documents are shared, not copied: json::UnknownElement is
+// copy-on-write, so a request that changes its response (e.g. through a
+// subclass) gets a copy of its own, and the cached one stays as it was.
+// Entries are keyed by method and URL (plus the body, for POSTs that are
+// SetCacheable()). The least recently used are dropped once there are more
+// than maxEntries, or their responses' bodies add up to more than maxBytes.
+// It must outlive the requests that use it. App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "s3eTypes.h"
+#include "util/json.h"
+#include "util/ptr.h"
+
+class HttpJsonCache {
+public:
+	HttpJsonCache(size_t maxBytes = 4 * 1024 * 1024, uint maxEntries = 256) : m_numBytes(0), m_maxBytes(maxBytes), m_maxEntries(maxEntries), m_numReused(0) {}
+
+	size_t GetSize() const { return m_numBytes; } // Total size of the bodies that the documents were parsed from
+	size_t GetNumEntries() const { return m_index.size(); }
+	uint64 GetNumReused() const { return m_numReused; } // Responses that were answered with a cached document
+	void Clear();
+
+	/////// Internal methods used by HttpPost ///////
+	// Never changed once stored, so a request (or its worker) can hold on to one while it is replaced or evicted:
+	struct Entry : public IRefCounted {
+		std::string etag;
+		json::UnknownElement response;
+		size_t size;
+	};
+	Ptr<Entry> Find(const std::string& key);
+	void Store(const std::string& key, const std::string& etag, const json::UnknownElement& response, size_t size);
+	void Remove(const std::string& key);
+	void CountReused() { m_numReused++; }
+
+private:
+	typedef std::list< std::pair<std::string, Ptr<Entry> > > Lru; // Most recently used first
+	Lru m_lru;
+	std::map<std::string, Lru::iterator> m_index;
+	size_t m_numBytes;
+	const size_t m_maxBytes;
+	const uint m_maxEntries;
+	uint64 m_numReused;
+
+	void Remove(std::map<std::string, Lru::iterator>::iterator it);
+	void Evict();
+	HttpJsonCache(const HttpJsonCache&);
+	HttpJsonCache& operator=(const HttpJsonCache&);
+};
@@ -0,0 +1,39 @@
+// HttpLog:
+// Per-thread log rings for the workers, drained on the app thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpLog.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <s3eDebug.h>
+
+void HttpLogRing::Write(const char* format, ...) {
+	const uint position = atomic::LoadRelaxed(head);
+	if (position - atomic::LoadAcquire(tail) >= (uint)NUM_ENTRIES) {
+		atomic::StoreRelaxed(dropped, dropped + 1);
+	} else {
+		va_list args;
+		va_start(args, format);
+		vsnprintf(entries[position % NUM_ENTRIES].message, MESSAGE_SIZE, format, args);
+		va_end(args);
+		atomic::StoreRelease(head, position + 1);
+	}
+	if (pPending)
+		atomic::Exchange(*pPending, 1u); // (After the message: whoever clears it will see the message)
+}
+
+void HttpLogRing::Drain() {
+	const uint end = atomic::LoadAcquire(head);
+	for (uint position = tail; position != end; position++) {
+		s3eDebugTracePrintf("%s", entries[position % NUM_ENTRIES].message);
+		atomic::StoreRelease(tail, position + 1); // (Each one as soon as it's done with, so the slot can be written again)
+	}
+	const uint num_dropped = atomic::LoadRelaxed(dropped);
+	if (num_dropped != droppedReported) {
+		s3eDebugTracePrintf("HttpClient: %u messages from a worker thread were dropped (its log was full)", num_dropped - droppedReported);
+		droppedReported = num_dropped;
+	}
+}
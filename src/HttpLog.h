@@ -0,0 +1,64 @@
+// HttpLog:
+// Logging from the worker and I/O threads without waiting on the platform's log
+// sink. Each of those threads writes its messages into a small lock-free ring of
+// its own (formatted there, into a fixed-size slot, with no locks or
+// allocations), and HttpClient::Update() passes them on to s3eDebugTracePrintf()
+// on the app thread. The app thread only looks at the rings when one of them has
+// something in it (see HttpLogRing::pPending). A ring that fills up between two
+// Update()s drops what doesn't fit, and says how much it dropped once there is
+// room again.
+// Which messages are compiled in is set by HTTP_LOG_LEVEL (e.g. in the defines
+// in HttpUtils.mkb): HTTP_LOG() calls above it compile to nothing, arguments and
+// all. The default, HTTP_LOG_LEVEL_WARNING, keeps the errors and warnings that
+// the workers have always traced; HTTP_LOG_LEVEL_VERBOSE adds a line for each
+// step of each transfer, for debugging.
+// Not intended to be included by application code.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <s3eTypes.h>
+
+#include "util/atomic.h"
+
+#define HTTP_LOG_LEVEL_NONE    0
+#define HTTP_LOG_LEVEL_ERROR   1
+#define HTTP_LOG_LEVEL_WARNING 2
+#define HTTP_LOG_LEVEL_INFO    3
+#define HTTP_LOG_LEVEL_VERBOSE 4
+
+#ifndef HTTP_LOG_LEVEL
+#define HTTP_LOG_LEVEL HTTP_LOG_LEVEL_WARNING
+#endif
+
+// e.g. HTTP_LOG(pWorker->log, ERROR, "HttpClient: Error occurred: %s", curl_easy_strerror(result));
+#define HTTP_LOG(ring, level, ...) do { if (HTTP_LOG_LEVEL_##level <= HTTP_LOG_LEVEL) (ring).Write(__VA_ARGS__); } while (0)
+
+// One producer (a worker or I/O thread) and one consumer (the app thread). Only POD data, so it can live in the
+// app thread's memory and be written by the other thread, as the rules for sharing with the workers require.
+struct HttpLogRing {
+	enum { NUM_ENTRIES = 16, MESSAGE_SIZE = 128 }; // (Longer messages are cut short)
+	struct Entry { char message[MESSAGE_SIZE]; };
+	Entry entries[NUM_ENTRIES];
+	volatile uint head; // Written by the producer
+	volatile uint tail; // Written by the consumer
+	volatile uint dropped; // Written by the producer; the consumer only reads it
+	uint droppedReported; // Only touched by the consumer
+	volatile uint* pPending; // Shared by all the rings of one client: set by the producers, cleared by the consumer
+
+	HttpLogRing() : head(0), tail(0), dropped(0), droppedReported(0), pPending(nullptr) {}
+	// For the producer (printf-style; use HTTP_LOG(), so that it compiles away when its level is off):
+	void Write(const char* format, ...)
+#ifdef __GNUC__
+		__attribute__((format(printf, 2, 3)))
+#endif
+		;
+	// For the consumer: trace each message written since the last call, in order.
+	void Drain();
+	// For the consumer: whether any ring sharing pending has been written to since the last call (after which each
+	// of them should be drained).
+	static bool TakePending(volatile uint& pending) { return atomic::LoadRelaxed(pending) && atomic::Exchange(pending, 0u); }
+};
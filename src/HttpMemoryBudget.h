@@ -0,0 +1,54 @@
+// HttpMemoryBudget:
+// A ceiling on the memory that transfers in progress may hold: the response
+// bodies they keep in memory (and the JSON parsed from them), the bodies
+// they upload, their write buffers and headers. Give one to an HttpClient
+// with HttpClient::SetMemoryBudget(), or the same one to several clients for
+// a ceiling on all of the app's transfers together.
+// Each transfer is charged what its request expects to hold (see
+// HttpRequest::EstimateMemory()) from when it starts until its response has
+// been handled: at first from HttpRequest::SetExpectedSize(), if the app
+// knows roughly how big the response will be, then from the response's
+// Content-Length once its headers arrive. A request that would take the
+// charges over the limit isn't started, but waits in its client's queue
+// (letting other hosts' requests go ahead) until enough transfers have
+// finished. Small requests (up to smallRequestBytes) are never held back,
+// and neither is a request when nothing is charged, so that one bigger than
+// the whole budget still goes, by itself. The budget is only checked when
+// a transfer is about to start: one that turns out bigger than expected,
+// once its Content-Length is known, carries on.
+// App thread only. It must outlive the clients that use it.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+
+class HttpMemoryBudget {
+public:
+	HttpMemoryBudget(size_t maxBytes, size_t smallRequestBytes = 64 * 1024) : m_maxBytes(maxBytes), m_smallRequestBytes(smallRequestBytes), m_charged(0), m_peakCharged(0) {}
+
+	void SetLimit(size_t maxBytes) { m_maxBytes = maxBytes; }
+	size_t GetLimit() const { return m_maxBytes; }
+	size_t GetCharged() const { return m_charged; } // By the transfers in progress
+	size_t GetPeakCharged() const { return m_peakCharged; }
+
+	/////// Internal methods used by HttpClient ///////
+	// Whether a transfer expected to hold bytes may start now:
+	bool CanStart(size_t bytes) const { return bytes <= m_smallRequestBytes || m_charged == 0 || m_charged + bytes <= m_maxBytes; }
+	// Change a transfer's charge from oldBytes to newBytes (0 when it starts, and when it is over):
+	void Recharge(size_t oldBytes, size_t newBytes) {
+		m_charged = m_charged - oldBytes + newBytes;
+		if (m_charged > m_peakCharged)
+			m_peakCharged = m_charged;
+	}
+
+private:
+	size_t m_maxBytes;
+	const size_t m_smallRequestBytes;
+	size_t m_charged;
+	size_t m_peakCharged;
+	HttpMemoryBudget(const HttpMemoryBudget&);
+	HttpMemoryBudget& operator=(const HttpMemoryBudget&);
+};
@@ -0,0 +1,98 @@
+// HttpMemoryCache:
+// An in-memory cache of small responses, for use with HttpClient::SetMemoryCache().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpMemoryCache.h"
+
+#include <s3eTimer.h>
+#include "HttpCache.h"
+
+using std::string;
+
+HttpMemoryCache::HttpMemoryCache(size_t maxBytes, size_t maxEntrySize, uint defaultMaxAgeMs)
+	: m_numBytes(0), m_maxBytes(maxBytes), m_maxEntrySize(maxEntrySize), m_defaultMaxAgeMs(defaultMaxAgeMs)
+{
+}
+
+void HttpMemoryCache::Clear() {
+	m_index.clear();
+	m_lru.clear();
+	m_numBytes = 0;
+}
+
+Ptr<HttpMemoryCache::Entry> HttpMemoryCache::Find(const string& key) {
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+		return nullptr;
+	if (s3eTimerGetMs() >= it->second->second->expiresMs) {
+		Remove(it);
+		return nullptr;
+	}
+	m_lru.splice(m_lru.begin(), m_lru, it->second); // Now the most recently used
+	return it->second->second;
+}
+
+// We don't look at request headers, so we can only keep responses that don't vary by them. Accept-Encoding
+// is the exception, since we keep the body after it has been decompressed.
+static bool HttpMemoryCache_VariesByRequest(const char* pVary) {
+	if (!pVary)
+		return false;
+	const string vary(pVary);
+	size_t pos = 0;
+	while (pos < vary.size()) {
+		size_t end = vary.find(',', pos);
+		if (end == string::npos)
+			end = vary.size();
+		while (pos < end && vary[pos] == ' ')
+			pos++;
+		size_t name_end = end;
+		while (name_end > pos && vary[name_end - 1] == ' ')
+			name_end--;
+		if (name_end > pos && HttpHeaders::CompareNames(vary.data() + pos, name_end - pos, "Accept-Encoding", 15) != 0)
+			return true;
+		pos = end + 1;
+	}
+	return false;
+}
+
+void HttpMemoryCache::Store(const string& key, const HttpHeaders& responseHeaders, const char* pBody, size_t size, int64 maxAgeMs) {
+	if (size > m_maxEntrySize || HttpMemoryCache_VariesByRequest(responseHeaders.Find("Vary")))
+		return;
+	int64 max_age_ms;
+	bool no_store, no_cache;
+	HttpCache::ParseCacheControl(responseHeaders.Find("Cache-Control"), max_age_ms, no_store, no_cache);
+	if (maxAgeMs != -1)
+		max_age_ms = maxAgeMs;
+	else if (max_age_ms < 0)
+		max_age_ms = m_defaultMaxAgeMs;
+	if (no_store || no_cache || max_age_ms <= 0)
+		return;
+
+	auto it = m_index.find(key);
+	if (it != m_index.end())
+		Remove(it);
+	Ptr<Entry> p_entry = new Entry;
+	p_entry->headers = responseHeaders;
+	static const char s_status_line[] = "HTTP/1.1 200 OK";
+	p_entry->headers.SetStatusLine(s_status_line, sizeof(s_status_line) - 1);
+	HttpCache::StripContentEncoding(p_entry->headers);
+	p_entry->body.assign(pBody, size);
+	p_entry->expiresMs = s3eTimerGetMs() + max_age_ms;
+	m_lru.push_front(std::make_pair(key, p_entry));
+	m_index[key] = m_lru.begin();
+	m_numBytes += size;
+	Evict();
+}
+
+void HttpMemoryCache::Remove(std::map<string, Lru::iterator>::iterator it) {
+	m_numBytes -= it->second->second->body.size();
+	m_lru.erase(it->second);
+	m_index.erase(it);
+}
+
+void HttpMemoryCache::Evict() {
+	while (m_numBytes > m_maxBytes && !m_lru.empty())
+		Remove(m_index.find(m_lru.back().first));
+}
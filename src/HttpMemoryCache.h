@@ -0,0 +1,63 @@
+// HttpMemoryCache:
+// An in-memory cache of small responses, for use with HttpClient::SetMemoryCache().
+// Where HttpCache saves network round trips across screens and sessions, this
+// saves them between identical requests made within moments of each other (e.g.
+// the same API call and thumbnails being asked for again during a screen
+// transition): a hit never gets as far as a worker, and the request completes on
+// the next HttpClient::Update().
+// Entries are keyed by HttpRequest::GetMemoryCacheKey(), i.e. by method and URL
+// (plus the body, for HttpPost requests that opt in with SetCacheable()). They stay
+// fresh for the response's Cache-Control max-age, or defaultMaxAgeMs if it has none,
+// and the least recently used are evicted once the bodies exceed maxBytes.
+// Responses that vary by any request header but Accept-Encoding are never kept.
+// All methods must be called from the app thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "HttpRequest.h"
+
+class HttpMemoryCache {
+public:
+	// Responses bigger than maxEntrySize aren't kept at all.
+	HttpMemoryCache(size_t maxBytes = 4 * 1024 * 1024, size_t maxEntrySize = 64 * 1024, uint defaultMaxAgeMs = 0);
+
+	void SetMaxSize(size_t maxBytes) { m_maxBytes = maxBytes; Evict(); }
+	size_t GetMaxSize() const { return m_maxBytes; }
+	size_t GetMaxEntrySize() const { return m_maxEntrySize; }
+	size_t GetSize() const { return m_numBytes; } // Total size of the cached bodies
+	size_t GetNumEntries() const { return m_index.size(); }
+	void Clear();
+
+	/////// Internal methods used by HttpClient ///////
+	struct Entry : public IRefCounted {
+		HttpHeaders headers; // With a status line, ready to pass to the request
+		std::string body;
+		uint64 expiresMs; // s3eTimerGetMs() time after which it is no longer fresh
+		int statusCode; // 200, but for the 404s and 410s that HttpClient answers from its negative cache (see HttpClient::SetNegativeCacheTtl())
+		Entry() : expiresMs(0), statusCode(200) {}
+	};
+	// The fresh response for key, or nullptr. An entry that is held on to stays valid even if it is evicted.
+	Ptr<Entry> Find(const std::string& key);
+	// maxAgeMs, if not -1, is how long it stays fresh, instead of what its headers say (e.g. for a response that has
+	// been on disk for a while):
+	void Store(const std::string& key, const HttpHeaders& responseHeaders, const char* pBody, size_t size, int64 maxAgeMs = -1);
+
+private:
+	typedef std::list< std::pair<std::string, Ptr<Entry> > > Lru; // Most recently used first
+	Lru m_lru;
+	std::map<std::string, Lru::iterator> m_index;
+	size_t m_numBytes;
+	size_t m_maxBytes;
+	const size_t m_maxEntrySize;
+	const uint m_defaultMaxAgeMs;
+
+	void Remove(std::map<std::string, Lru::iterator>::iterator it);
+	void Evict();
+};
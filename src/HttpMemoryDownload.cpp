@@ -0,0 +1,154 @@
+// HttpMemoryDownload:
+// Downloads a response body into a buffer that the app can keep.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpMemoryDownload.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <IwMath.h>
+
+#include "HttpAllocStats.h"
+#include "util/atomic.h"
+
+using std::string;
+
+// The buffers released by the app thread, waiting for a worker to free them. Each one's first bytes hold the
+// pointer to the next: the app thread may write to the memory, just not free it. Only the app thread pushes,
+// and the workers take the whole list at once, so there is no ABA problem.
+static unsigned char* volatile s_pReleasedBuffers = nullptr;
+
+HttpBuffer::~HttpBuffer() {
+	Release(m_pData);
+}
+
+void HttpBuffer::Release(unsigned char* pData) {
+	unsigned char* p_next;
+	do {
+		p_next = atomic::LoadAcquire(s_pReleasedBuffers);
+		memcpy(pData, &p_next, sizeof(p_next));
+	} while (!atomic::CompareAndSwap(s_pReleasedBuffers, p_next, pData));
+}
+
+unsigned char* HttpBuffer::Worker_Alloc(unsigned char* pData, size_t size) {
+	if (size < sizeof(unsigned char*))
+		size = sizeof(unsigned char*); // Room for the link, once it's released
+	unsigned char* p_new = (unsigned char*)realloc(pData, size);
+	if (p_new)
+		HTTP_ALLOC_COUNT(size);
+	return p_new;
+}
+
+void HttpBuffer::Worker_Free(unsigned char* pData) {
+	free(pData);
+}
+
+void HttpBuffer::Worker_FreeReleased() {
+	if (!atomic::LoadRelaxed(s_pReleasedBuffers))
+		return;
+	unsigned char* p_buffer = atomic::Exchange(s_pReleasedBuffers, (unsigned char*)nullptr);
+	while (p_buffer) {
+		unsigned char* p_next;
+		memcpy(&p_next, p_buffer, sizeof(p_next));
+		free(p_buffer);
+		p_buffer = p_next;
+	}
+}
+
+HttpMemoryDownload::HttpMemoryDownload(const string& url, size_t maxSize) :
+	HttpRequest(GET, url.c_str()), m_maxSize(maxSize), m_pData(nullptr), m_size(0), m_capacity(0), m_discardData(false), m_failed(false)
+{
+}
+
+HttpMemoryDownload::~HttpMemoryDownload() {
+	IwAssert(HTTP_CLIENT, m_pData == nullptr); // Worker_HandleCleanup() must have been called from the worker thread
+}
+
+void HttpMemoryDownload::Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+	m_discardData = httpStatusCode / 100 != 2;
+	if (m_discardData)
+		return;
+	// Reserve the whole body now. For a compressed response, that's a lower bound: the data grows as curl decodes it.
+	// So without a Content-Length, or with a compressed one, reserve what the endpoint's bodies have needed too.
+	const char* p_length = headers.Find("Content-Length");
+	long long length = p_length ? strtoll(p_length, nullptr, 10) : -1;
+	if ((length < 0 || headers.Find("Content-Encoding")) && (long long)GetSizeHint() > length)
+		length = (long long)MIN(GetSizeHint(), m_maxSize);
+	if (length > 0 && (unsigned long long)length <= m_maxSize && (size_t)length > m_capacity) {
+		HTTP_ALLOC_SCOPE(SITE_BODY, nullptr);
+		if (unsigned char* p_data = HttpBuffer::Worker_Alloc(m_pData, (size_t)length)) {
+			m_pData = p_data;
+			m_capacity = (size_t)length;
+		}
+	}
+}
+
+size_t HttpMemoryDownload::Worker_HandleData(const unsigned char* contents, size_t size) {
+	if (m_discardData)
+		return size;
+	if (m_size + size > m_maxSize) {
+		m_failed = true;
+		return 0;
+	}
+	if (m_size + size > m_capacity) {
+		// No (or a wrong) Content-Length: grow geometrically
+		size_t new_capacity = m_capacity ? m_capacity : 64 * 1024;
+		while (new_capacity < m_size + size)
+			new_capacity *= 2;
+		if (new_capacity > m_maxSize)
+			new_capacity = m_maxSize;
+		HTTP_ALLOC_SCOPE(SITE_BODY, nullptr);
+		unsigned char* p_data = HttpBuffer::Worker_Alloc(m_pData, new_capacity);
+		if (!p_data) {
+			m_failed = true;
+			return 0;
+		}
+		m_pData = p_data;
+		m_capacity = new_capacity;
+	}
+	memcpy(m_pData + m_size, contents, size);
+	m_size += size;
+	return size;
+}
+
+void HttpMemoryDownload::Worker_HandleDone(bool success, int httpStatusCode) {
+	if (success && !m_discardData && !m_failed) {
+		if (!m_pData) // An empty body still gets a buffer
+			m_pData = HttpBuffer::Worker_Alloc(nullptr, 0);
+		if (!m_pData || !Worker_HandleBody(m_pData, m_size))
+			m_failed = true;
+	}
+	HttpRequest::Worker_HandleDone(success, httpStatusCode);
+}
+
+void HttpMemoryDownload::Worker_SetBody(unsigned char* pData, size_t size) {
+	if (pData != m_pData)
+		HttpBuffer::Worker_Free(m_pData);
+	m_pData = pData;
+	m_size = m_capacity = size;
+}
+
+void HttpMemoryDownload::HandleResponse(bool success, int httpStatusCode) {
+	success = success && !m_discardData && !m_failed && m_pData;
+	if (success) {
+		// The app thread takes the body over; Worker_HandleCleanup() leaves it alone.
+		m_pBuffer = new HttpBuffer(m_pData, m_size);
+		m_pData = nullptr;
+		m_size = m_capacity = 0;
+	}
+	HttpRequest::HandleResponse(success, httpStatusCode);
+}
+
+void HttpMemoryDownload::Worker_HandleCleanup() {
+	HttpBuffer::Worker_Free(m_pData);
+	m_pData = nullptr;
+	m_size = m_capacity = 0;
+}
+
+void HttpMemoryDownload::HandleRequeue() {
+	// Worker_HandleCleanup() has freed any partial body
+	m_discardData = m_failed = false;
+	HttpRequest::HandleRequeue();
+}
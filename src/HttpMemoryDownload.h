@@ -0,0 +1,96 @@
+// HttpMemoryDownload:
+// Downloads a response body into memory (e.g. a texture or a sound), and
+// hands it to the app as an HttpBuffer that it can keep for as long as it
+// likes, without copying it.
+// The worker allocates the buffer as soon as the response headers arrive,
+// sized from the Content-Length, and curl's data is written straight into
+// it: one allocation for the whole body, rather than a chain of reallocs
+// (only a response without a Content-Length, or a compressed one, grows the
+// buffer as it goes).
+//
+// The buffer is allocated in the worker memory environment (see
+// HttpClientWorker.h), so while the app thread may read and write its bytes
+// freely, it can't free it. When the last Ptr to an HttpBuffer goes, the
+// memory is handed back to the workers, and the next worker to finish a
+// request frees it (as does HttpClient::GlobalCleanup(), for any that are
+// left over).
+//
+// To process the body on the worker thread once it is all in, e.g. to decode
+// an image into a texture's pixels, subclass and override Worker_HandleBody().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+
+#include "HttpRequest.h"
+
+// A block of memory from the worker memory environment, owned by the app thread:
+class HttpBuffer : public IRefCounted {
+public:
+	~HttpBuffer(); // Hands the memory back to the workers to free
+	unsigned char* Data() { return m_pData; }
+	const unsigned char* Data() const { return m_pData; }
+	size_t Size() const { return m_size; }
+	
+	/////// Internal methods used by HttpMemoryDownload and HttpClient ///////
+	HttpBuffer(unsigned char* pData, size_t size) : m_pData(pData), m_size(size) {} // pData from Worker_Alloc()
+	// Allocate or resize memory for an HttpBuffer, on a worker thread (never returns nullptr for size 0):
+	static unsigned char* Worker_Alloc(unsigned char* pData, size_t size);
+	static void Worker_Free(unsigned char* pData);
+	// Hand memory from Worker_Alloc() back to the workers, from the app thread, without making an HttpBuffer of it:
+	static void Release(unsigned char* pData);
+	// Free the memory of every HttpBuffer that the app thread has released so far. Called by the workers once
+	// a request is cleaned up, and by HttpClient::GlobalCleanup() in the worker memory environment.
+	static void Worker_FreeReleased();
+private:
+	unsigned char* m_pData;
+	size_t m_size;
+	HttpBuffer(const HttpBuffer&);
+	HttpBuffer& operator=(const HttpBuffer&);
+};
+
+class HttpMemoryDownload : public HttpRequest {
+public:
+	// A response bigger than maxSize fails the request (with CURLE_WRITE_ERROR), rather than use up the memory.
+	HttpMemoryDownload(const std::string& url, size_t maxSize = 64 * 1024 * 1024);
+	~HttpMemoryDownload();
+	
+	// Once the request is DONE, the body (after any processing by Worker_HandleBody()). Otherwise nullptr.
+	const Ptr<HttpBuffer>& GetBuffer() const { return m_pBuffer; }
+	// Take the body over: the request no longer refers to it.
+	Ptr<HttpBuffer> TakeBuffer() { Ptr<HttpBuffer> p_buffer = m_pBuffer; m_pBuffer = nullptr; return p_buffer; }
+	// For a worker callback (see HttpRequest::SetWorkerCallback()), which gets here before GetBuffer() has been
+	// set: the body, for the duration of the callback. nullptr if Worker_HandleBody() failed.
+	const unsigned char* Worker_GetData() const { return m_failed || m_discardData ? nullptr : m_pData; }
+	size_t Worker_GetSize() const { return m_size; }
+	
+	// Never answered by an HttpMemoryCache: that runs the Worker_ methods on the app thread, which would
+	// allocate the body in the wrong memory environment (and the bodies are rarely small enough anyway).
+	virtual std::string GetMemoryCacheKey() const { return std::string(); }
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void HandleRequeue();
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode);
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
+	virtual void Worker_HandleDone(bool success, int httpStatusCode);
+	virtual void Worker_HandleCleanup();
+	
+protected:
+	// Called on the worker thread once the whole body of a successful response has arrived, before
+	// HandleResponse(). Subclasses may process the body in place, or replace it with Worker_SetBody().
+	// Return false to fail the request (e.g. if the image can't be decoded).
+	virtual bool Worker_HandleBody(unsigned char* pData, size_t size) { return true; }
+	// Replace the body with pData (from HttpBuffer::Worker_Alloc()), freeing the old one:
+	void Worker_SetBody(unsigned char* pData, size_t size);
+	
+	const size_t m_maxSize;
+	// Managed by the worker thread, until HandleResponse() wraps the body in m_pBuffer:
+	unsigned char* m_pData;
+	size_t m_size;
+	size_t m_capacity;
+	bool m_discardData; // The response is an error page, not the body we asked for
+	bool m_failed; // Set by the worker thread if the body was too big, memory ran out or Worker_HandleBody() failed
+	Ptr<HttpBuffer> m_pBuffer;
+};
@@ -0,0 +1,161 @@
+// HttpMirrors:
+// Sets of origins that serve the same content, and which of them to send each request to.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpMirrors.h"
+
+#include <IwMath.h>
+
+using std::string;
+
+static const double HTTP_MIRRORS_WEIGHT = 0.25; // Of each new response in an origin's averages
+
+void HttpMirrors::Set(const string& prefix, const std::vector<string>& mirrors) {
+	for (auto it = m_sets.begin(); it != m_sets.end(); it++) {
+		if ((*it)[0].prefix == prefix) {
+			m_sets.erase(it);
+			break;
+		}
+	}
+	if (mirrors.empty())
+		return;
+	std::vector<Origin> set(1 + mirrors.size());
+	set[0].prefix = prefix;
+	for (size_t i = 0; i < mirrors.size(); i++)
+		set[1 + i].prefix = mirrors[i];
+	for (auto it = set.begin(); it != set.end(); it++)
+		it->id = m_nextId++;
+	m_sets.push_back(set);
+}
+
+const std::vector<HttpMirrors::Origin>* HttpMirrors::Find(const string& url) const {
+	const std::vector<Origin>* p_found = nullptr;
+	size_t found_length = 0;
+	for (auto it = m_sets.begin(); it != m_sets.end(); it++) {
+		for (auto origin = it->begin(); origin != it->end(); origin++) {
+			// (The longest prefix wins, in case one set's origin is within another's)
+			if (origin->prefix.size() > found_length && url.compare(0, origin->prefix.size(), origin->prefix) == 0) {
+				p_found = &*it;
+				found_length = origin->prefix.size();
+			}
+		}
+	}
+	return p_found;
+}
+
+double HttpMirrors::Score(const Origin& origin, size_t expectedBytes) {
+	return origin.ttfbMs + (origin.bytesPerSecond > 0 ? expectedBytes * 1000.0 / origin.bytesPerSecond : 0);
+}
+
+uint HttpMirrors::Choose(const string& url, size_t expectedBytes, uint avoidId, uint64 nowMs, string& transferUrl) {
+	std::vector<Origin>* p_set = const_cast<std::vector<Origin>*>(Find(url));
+	if (!p_set)
+		return 0;
+	std::vector<Origin>& set = *p_set;
+	size_t own = 0, own_length = 0; // The origin that url is at
+	for (size_t i = 0; i < set.size(); i++) {
+		if (set[i].prefix.size() > own_length && url.compare(0, set[i].prefix.size(), set[i].prefix) == 0) {
+			own = i;
+			own_length = set[i].prefix.size();
+		}
+	}
+	if (!expectedBytes)
+		expectedBytes = DEFAULT_EXPECTED_BYTES;
+	const size_t NONE = set.size();
+	size_t chosen = NONE;
+	// First, an origin that is up but hasn't been tried for a while (or at all), so that we know how it is doing:
+	for (size_t i = 0; i < set.size() && chosen == NONE; i++) {
+		const Origin& origin = set[i];
+		if (origin.id != avoidId && origin.downUntilMs <= nowMs && (!origin.chosenMs || nowMs - origin.chosenMs >= PROBE_INTERVAL_MS))
+			chosen = i;
+	}
+	// Otherwise the quickest of those that are up, going by those that have answered...
+	if (chosen == NONE) {
+		double best_score = 0;
+		for (size_t i = 0; i < set.size(); i++) {
+			const Origin& origin = set[i];
+			if (origin.id == avoidId || origin.downUntilMs > nowMs || !origin.numResponses)
+				continue;
+			const double score = Score(origin, expectedBytes);
+			if (chosen == NONE || score < best_score) {
+				chosen = i;
+				best_score = score;
+			}
+		}
+	}
+	// ...or the first that is up, if none of them have answered yet (e.g. the first probes are still in progress)...
+	for (size_t i = 0; i < set.size() && chosen == NONE; i++) {
+		if (set[i].id != avoidId && set[i].downUntilMs <= nowMs)
+			chosen = i;
+	}
+	// ...or, if they are all down, the one that is due back soonest.
+	if (chosen == NONE) {
+		for (size_t i = 0; i < set.size(); i++) {
+			if (chosen == NONE || (set[i].id != avoidId && (set[chosen].id == avoidId || set[i].downUntilMs < set[chosen].downUntilMs)))
+				chosen = i;
+		}
+	}
+	Origin& origin = set[chosen];
+	origin.chosenMs = nowMs;
+	if (chosen == own)
+		transferUrl.clear();
+	else
+		transferUrl = string(origin.prefix).append(url, own_length, string::npos);
+	return origin.id;
+}
+
+void HttpMirrors::HandleResult(uint id, bool failed, const HttpRequest::Timings& timings, uint64 nowMs) {
+	std::vector<Origin>* p_set;
+	Origin* p_origin = FindOrigin(id, &p_set);
+	if (!p_origin)
+		return; // Its set has been replaced since
+	Origin& origin = *p_origin;
+	if (failed) {
+		origin.numFailures++;
+		origin.downUntilMs = nowMs + MIN((uint64)MAX_DOWN_MS, (uint64)BASE_DOWN_MS << MIN(origin.numFailures - 1, 6u));
+		return;
+	}
+	origin.numFailures = 0;
+	origin.downUntilMs = 0;
+	const double weight = origin.numResponses ? HTTP_MIRRORS_WEIGHT : 1;
+	origin.ttfbMs += (timings.ttfbMs - origin.ttfbMs) * weight;
+	const double body_ms = timings.totalMs - timings.ttfbMs;
+	if (timings.bytesDownloaded >= MIN_THROUGHPUT_BYTES && body_ms > 0) {
+		const double bytes_per_second = timings.bytesDownloaded * 1000 / body_ms;
+		origin.bytesPerSecond += (bytes_per_second - origin.bytesPerSecond) * (origin.bytesPerSecond > 0 ? HTTP_MIRRORS_WEIGHT : 1);
+	}
+	origin.numResponses++;
+}
+
+bool HttpMirrors::HasAlternative(uint id, uint64 nowMs) const {
+	const std::vector<Origin>* p_set;
+	if (!FindOrigin(id, &p_set))
+		return false;
+	for (auto it = p_set->begin(); it != p_set->end(); it++) {
+		if (it->id != id && it->downUntilMs <= nowMs)
+			return true;
+	}
+	return false;
+}
+
+uint HttpMirrors::GetSetSize(uint id) const {
+	const std::vector<Origin>* p_set;
+	return FindOrigin(id, &p_set) ? (uint)p_set->size() : 0;
+}
+
+HttpMirrors::Origin* HttpMirrors::FindOrigin(uint id, std::vector<Origin>** ppSet) {
+	for (auto it = m_sets.begin(); it != m_sets.end(); it++) {
+		// (IDs are handed out in order, so each set's are consecutive)
+		if (id >= it->front().id && id <= it->back().id) {
+			*ppSet = &*it;
+			return &(*it)[id - it->front().id];
+		}
+	}
+	return nullptr;
+}
+
+const HttpMirrors::Origin* HttpMirrors::FindOrigin(uint id, const std::vector<Origin>** ppSet) const {
+	return const_cast<HttpMirrors*>(this)->FindOrigin(id, const_cast<std::vector<Origin>**>(ppSet));
+}
@@ -0,0 +1,79 @@
+// HttpMirrors:
+// Sets of origins that serve the same content (e.g. the same assets on
+// several CDNs), for an HttpClient to choose between (see
+// HttpClient::SetMirrors()). A request whose URL starts with one of a set's
+// prefixes is sent to whichever origin of the set looks quickest: each
+// origin's time to the first byte, and its throughput (from responses big
+// enough to tell), are averaged over its recent responses, and the one that
+// would deliver the request's expected size (see
+// HttpRequest::GetSizeHint()) soonest wins. An origin that fails (in a way
+// that a retry might fix) is held out of the running for a while, which
+// doubles with each failure in a row, up to a minute; the others take its
+// requests meanwhile. Each origin that isn't winning still gets a request
+// every so often, so that the averages follow it if it gets better again.
+// Only the transfer goes to the chosen origin: the cache, coalescing and the
+// request itself still go by the request's own URL.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "HttpRequest.h"
+
+class HttpMirrors {
+public:
+	struct Origin {
+		std::string prefix; // e.g. "https://cdn2.example.com/assets/"
+		uint id; // Never 0, and never reused
+		// Averaged over its recent responses (0 until it has had any):
+		double ttfbMs;
+		double bytesPerSecond; // From those with a body of at least MIN_THROUGHPUT_BYTES
+		uint numResponses;
+		uint numFailures; // In a row
+		uint64 downUntilMs; // Since its last failure, it isn't chosen until then, unless every origin is down
+		uint64 chosenMs; // When it was last chosen, or 0
+		Origin() : id(0), ttfbMs(0), bytesPerSecond(0), numResponses(0), numFailures(0), downUntilMs(0), chosenMs(0) {}
+	};
+	enum {
+		MIN_THROUGHPUT_BYTES = 32 * 1024, // Smaller bodies say more about latency than throughput
+		DEFAULT_EXPECTED_BYTES = 64 * 1024, // Scored for a request whose size isn't known
+		PROBE_INTERVAL_MS = 30000, // How often each origin that isn't winning is given a request anyway
+		BASE_DOWN_MS = 1000, // How long an origin that has just failed is held out for, the first time...
+		MAX_DOWN_MS = 60000 // ...and at the most
+	};
+
+	HttpMirrors() : m_nextId(1) {}
+
+	// Requests to prefix (e.g. "https://cdn1.example.com/assets/") may be sent to any of mirrors instead (each ending
+	// as prefix does), and requests to any of mirrors to prefix or another of them. Replaces the set that prefix thus
+	// far belonged to; no mirrors removes it.
+	void Set(const std::string& prefix, const std::vector<std::string>& mirrors);
+	bool Empty() const { return m_sets.empty(); }
+	// The set of origins that url belongs to (in the order they were given, prefix first), or nullptr:
+	const std::vector<Origin>* Find(const std::string& url) const;
+
+	// Choose the origin to send url to at nowMs, which may not be avoidId (e.g. that of the transfer that a hedge is
+	// racing) unless it is the only one. Returns its ID, and sets transferUrl to url at that origin (or empty if it is
+	// url's own); returns 0, leaving transferUrl alone, if url isn't in a set.
+	uint Choose(const std::string& url, size_t expectedBytes, uint avoidId, uint64 nowMs, std::string& transferUrl);
+	// How the transfer that Choose() sent to origin id went. failed is true for failures that a retry might fix
+	// (a connection that couldn't be made or was lost, a timeout, or a 5xx, 408 or 429 response); an origin that
+	// answered with anything else (such as a 404) has still answered.
+	void HandleResult(uint id, bool failed, const HttpRequest::Timings& timings, uint64 nowMs);
+	// Whether another origin of id's set is up at nowMs, for a request that failed there to fail over to:
+	bool HasAlternative(uint id, uint64 nowMs) const;
+	// The number of origins in id's set (0 if it has been removed):
+	uint GetSetSize(uint id) const;
+
+private:
+	std::vector< std::vector<Origin> > m_sets;
+	uint m_nextId;
+	Origin* FindOrigin(uint id, std::vector<Origin>** ppSet);
+	const Origin* FindOrigin(uint id, const std::vector<Origin>** ppSet) const;
+	static double Score(const Origin& origin, size_t expectedBytes); // The ms it would take to deliver expectedBytes
+};
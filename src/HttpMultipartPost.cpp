@@ -0,0 +1,187 @@
+// HttpMultipartPost:
+// A multipart/form-data POST that streams its parts instead of building the body in memory.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpMultipartPost.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <curl/curl.h>
+#include <s3eFile.h>
+#include <s3eTimer.h>
+
+using std::string;
+
+// A boundary that is vanishingly unlikely to turn up in the data (which we can't check, since we don't read it up front):
+static string HttpMultipartPost_MakeBoundary() {
+	static uint s_counter = 0;
+	const uint64 now = s3eTimerGetUST();
+	char boundary[64];
+	snprintf(boundary, sizeof(boundary), "----HttpUtilsBoundary%08x%08x%04x", (uint)(now >> 32), (uint)now, (s_counter++ & 0xffff));
+	return boundary;
+}
+
+// Names and file names go in a quoted string, so quotes and line breaks must be escaped (as browsers do):
+static string HttpMultipartPost_Quote(const string& value) {
+	string quoted(1, '"');
+	for (size_t i = 0; i < value.size(); i++) {
+		switch (value[i]) {
+			case '"': quoted.append("%22"); break;
+			case '\r': quoted.append("%0D"); break;
+			case '\n': quoted.append("%0A"); break;
+			default: quoted.append(1, value[i]);
+		}
+	}
+	return quoted.append(1, '"');
+}
+
+HttpMultipartPost::HttpMultipartPost(const string& url) :
+	HttpPost(url), m_boundary(HttpMultipartPost_MakeBoundary()), m_contentLength(0), m_uploadPart(0), m_uploadOffset(0), m_pUploadFile(nullptr)
+{
+	SetHeader("Content-Type", string("multipart/form-data; boundary=").append(m_boundary));
+}
+
+HttpMultipartPost::~HttpMultipartPost() {
+	IwAssert(HTTP_CLIENT, m_pUploadFile == nullptr); // Worker_HandleDone() should have closed it
+}
+
+HttpMultipartPost::Part& HttpMultipartPost::AddPart(const string& name, const char* contentType, const string& fileName) {
+	IwAssert(HTTP_CLIENT, m_status == BUILDING);
+	m_parts.push_back(Part());
+	Part& part = m_parts.back();
+	part.header.append("Content-Disposition: form-data; name=").append(HttpMultipartPost_Quote(name));
+	if (!fileName.empty())
+		part.header.append("; filename=").append(HttpMultipartPost_Quote(fileName));
+	part.header.append("\r\n");
+	if (contentType && *contentType)
+		part.header.append("Content-Type: ").append(contentType).append("\r\n");
+	part.header.append("\r\n");
+	part.size = 0;
+	return part;
+}
+
+HttpMultipartPost& HttpMultipartPost::AddData(const string& name, const string& data, const char* contentType, const string& fileName) {
+	Part& part = AddPart(name, contentType, fileName);
+	part.data = data;
+	part.size = data.size();
+	return *this;
+}
+
+HttpMultipartPost& HttpMultipartPost::AddFile(const string& name, const string& filePath, const char* contentType, const string& fileName) {
+	s3eFile* p_file = s3eFileOpen(filePath.c_str(), "rb");
+	if (!p_file)
+		throw std::runtime_error("Unable to open file for uploading!");
+	const int64 size = s3eFileGetSize(p_file);
+	s3eFileClose(p_file);
+	if (size < 0)
+		throw std::runtime_error("Unable to open file for uploading!");
+	Part& part = AddPart(name, contentType, fileName.empty() ? filePath.substr(filePath.find_last_of("/\\") + 1) : fileName);
+	part.filePath = filePath;
+	part.size = size;
+	return *this;
+}
+
+HttpMultipartPost& HttpMultipartPost::AddSource(const string& name, Ptr<Source> pSource, const char* contentType, const string& fileName) {
+	Part& part = AddPart(name, contentType, fileName);
+	part.pSource = pSource;
+	part.size = pSource->GetSize();
+	return *this;
+}
+
+void HttpMultipartPost::CompileRequest() {
+	IwAssert(HTTP_CLIENT, !m_compressBody); // The body is streamed, so it can't be compressed up front
+	// The form fields go first, as small in-memory parts:
+	std::vector<Part> parts;
+	parts.reserve(m_data.size() + m_parts.size() + 1);
+	for (auto it = m_data.begin(); it != m_data.end(); it++) {
+		Part field;
+		field.header.append("Content-Disposition: form-data; name=").append(HttpMultipartPost_Quote(it->first)).append("\r\n\r\n");
+		field.data = it->second;
+		field.size = field.data.size();
+		parts.push_back(field);
+	}
+	parts.insert(parts.end(), m_parts.begin(), m_parts.end());
+	// Each part starts with a boundary line, on a line of its own after the previous part's body:
+	m_contentLength = 0;
+	for (size_t i = 0; i < parts.size(); i++) {
+		parts[i].header.insert(0, string(i ? "\r\n--" : "--").append(m_boundary).append("\r\n"));
+		m_contentLength += parts[i].header.size() + parts[i].size;
+	}
+	Part closing;
+	closing.header.append(parts.empty() ? "--" : "\r\n--").append(m_boundary).append("--\r\n");
+	closing.size = 0;
+	m_contentLength += closing.header.size();
+	parts.push_back(closing);
+	m_parts.swap(parts);
+	HttpRequest::CompileRequest();
+}
+
+void HttpMultipartPost::HandleRequeue() {
+	m_uploadPart = 0;
+	m_uploadOffset = 0;
+	HttpPost::HandleRequeue();
+}
+
+size_t HttpMultipartPost::Worker_HandleUpload(const unsigned char* pData, size_t fillSize) {
+	unsigned char* p_out = const_cast<unsigned char*>(pData);
+	size_t filled = 0;
+	while (filled < fillSize && m_uploadPart < m_parts.size()) {
+		const Part& part = m_parts[m_uploadPart];
+		const int64 header_size = part.header.size();
+		const int64 left = header_size + part.size - m_uploadOffset;
+		if (left == 0) {
+			Worker_CloseFile();
+			m_uploadPart++;
+			m_uploadOffset = 0;
+			continue;
+		}
+		const size_t want = (int64)(fillSize - filled) < left ? fillSize - filled : (size_t)left;
+		size_t num_copied;
+		if (m_uploadOffset < header_size) {
+			num_copied = (size_t)(header_size - m_uploadOffset) < want ? (size_t)(header_size - m_uploadOffset) : want;
+			memcpy(p_out + filled, part.header.data() + m_uploadOffset, num_copied);
+		} else {
+			const int64 body_offset = m_uploadOffset - header_size;
+			if (part.pSource) {
+				num_copied = part.pSource->Worker_Read(p_out + filled, want, body_offset);
+			} else if (!part.filePath.empty()) {
+				if (!m_pUploadFile) {
+					// Parts are only ever read from the start, so there is no need to seek:
+					IwAssert(HTTP_CLIENT, body_offset == 0);
+					m_pUploadFile = s3eFileOpen(part.filePath.c_str(), "rb");
+				}
+				num_copied = m_pUploadFile ? s3eFileRead(p_out + filled, 1, want, m_pUploadFile) : 0;
+			} else {
+				num_copied = want;
+				memcpy(p_out + filled, part.data.data() + body_offset, num_copied);
+			}
+			if (num_copied == 0) {
+				// E.g. the file has got shorter since the request was compiled: we can't send what we said we would
+				s3eDebugTracePrintf("HttpMultipartPost: Unable to read part %u of the upload to %s", (uint)m_uploadPart, m_url.c_str());
+				return CURL_READFUNC_ABORT;
+			}
+		}
+		filled += num_copied;
+		m_uploadOffset += num_copied;
+	}
+	return filled;
+}
+
+void HttpMultipartPost::Worker_HandleDone(bool success, int httpStatusCode) {
+	Worker_CloseFile();
+	for (auto it = m_parts.begin(); it != m_parts.end(); it++) {
+		if (it->pSource)
+			it->pSource->Worker_Done();
+	}
+	HttpPost::Worker_HandleDone(success, httpStatusCode);
+}
+
+void HttpMultipartPost::Worker_CloseFile() {
+	if (m_pUploadFile) {
+		s3eFileClose(m_pUploadFile);
+		m_pUploadFile = nullptr;
+	}
+}
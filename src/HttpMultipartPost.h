@@ -0,0 +1,74 @@
+// HttpMultipartPost:
+// A multipart/form-data POST (like an HTML form with file inputs). Each part
+// is streamed to the server straight from where it lives: form fields and
+// in-memory data from the request, files from the file system as they are
+// sent, and anything else from a Source that produces its data on the worker
+// thread. Only the part headers are built in memory, so uploading a large
+// file doesn't need a copy of it on the heap. The total length (and so the
+// Content-Length header) is worked out when the request is compiled.
+//
+//     Ptr<HttpMultipartPost> p_post = new HttpMultipartPost(url);
+//     p_post->SetValue("album", "Holidays");
+//     p_post->AddFile("photo", "photos/0001.jpg", "image/jpeg");
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <vector>
+
+#include "HttpRequest.h"
+
+class HttpMultipartPost : public HttpPost {
+public:
+	// The data of a part that is neither in memory nor a file, e.g. generated or encoded on the fly.
+	// GetSize() is called on the app thread when the part is added; Worker_Read() on the worker thread,
+	// so it must not touch any app thread data that can change during the transfer.
+	class Source : public IRefCounted {
+	public:
+		virtual ~Source() {}
+		virtual int64 GetSize() const = 0;
+		// Fill pData with size bytes of the data, starting at offset (which starts over from 0 if the request
+		// is sent again). Return the number of bytes filled, or 0 if the data can't be produced.
+		virtual size_t Worker_Read(unsigned char* pData, size_t size, int64 offset) = 0;
+		virtual void Worker_Done() {} // Called by the worker thread when the transfer is over
+	};
+
+	HttpMultipartPost(const std::string& url);
+	~HttpMultipartPost();
+
+	// Plain form fields are added with SetValue(), and sent before any of the parts below.
+	// fileName is optional for data and sources; for files it defaults to the file's own name.
+	HttpMultipartPost& AddData(const std::string& name, const std::string& data, const char* contentType = "application/octet-stream", const std::string& fileName = "");
+	HttpMultipartPost& AddFile(const std::string& name, const std::string& filePath, const char* contentType = "application/octet-stream", const std::string& fileName = ""); // Throws if the file can't be opened
+	HttpMultipartPost& AddSource(const std::string& name, Ptr<Source> pSource, const char* contentType = "application/octet-stream", const std::string& fileName = "");
+	int64 GetContentLength() const { return m_contentLength; } // The size of the whole body, once the request is compiled
+
+	virtual void CompileRequest();
+	virtual std::string GetMemoryCacheKey() const { return std::string(); } // The body isn't in memory to make a key of
+	virtual void HandleRequeue();
+	virtual int64 GetUploadSize() const { return m_contentLength; }
+	virtual int64 Worker_GetUploadSize() const { return m_contentLength; }
+	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize);
+	virtual void Worker_HandleDone(bool success, int httpStatusCode);
+
+protected:
+	struct Part {
+		std::string header; // The boundary line and part headers that come before the body
+		std::string data; // The body of an in-memory part
+		std::string filePath; // The body of a file part
+		Ptr<Source> pSource; // The body of a source part
+		int64 size; // Of the body
+	};
+	std::vector<Part> m_parts; // The last one is just the closing boundary, once compiled
+	const std::string m_boundary;
+	int64 m_contentLength;
+	// Where the upload has got to; only modified by the worker thread during the transfer:
+	size_t m_uploadPart;
+	int64 m_uploadOffset; // Within the part, counting its header
+	s3eFile* m_pUploadFile;
+
+	Part& AddPart(const std::string& name, const char* contentType, const std::string& fileName);
+	void Worker_CloseFile();
+};
@@ -0,0 +1,268 @@
+// HttpMultipartUpload:
+// Uploads one large file to S3-compatible object storage in parts, several at once.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpMultipartUpload.h"
+
+#include <string.h>
+#include <utility>
+
+#include "HttpFileUpload.h"
+#include "HttpUrl.h"
+
+using std::string;
+
+// The headers that sign a request to url for this attempt, as SetAttemptHeader() takes them:
+static std::vector< std::pair<string, string> > HttpMultipartUpload_Sign(const HttpS3Signer* pSigner, HttpRequest::Method method, const string& url) {
+	std::vector< std::pair<string, string> > signature;
+	if (pSigner) {
+		HttpHeaders headers;
+		pSigner->Sign(method, url, headers);
+		for (size_t i = 0; i < headers.Size(); i++)
+			signature.push_back(std::make_pair(string(headers.GetName(i), headers.GetNameLength(i)), string(headers.GetValue(i), headers.GetValueLength(i))));
+	}
+	return signature;
+}
+
+// PUT url?partNumber=n&uploadId=id, with the part's range of the file as the body:
+class HttpMultipartUpload::Part : public HttpFileUpload {
+public:
+	Part(const string& url, const string& filePath, int64 fileSize, Ptr<HttpS3Signer> pSigner, uint partNumber)
+		: HttpFileUpload(url, filePath, fileSize), m_pSigner(pSigner), m_partNumber(partNumber) {}
+	uint GetPartNumber() const { return m_partNumber; }
+	const string& GetETag() const { return m_etag; }
+	virtual void HandleRequestStart() {
+		const std::vector< std::pair<string, string> > signature = HttpMultipartUpload_Sign(m_pSigner.ptr(), m_method, m_url);
+		for (size_t i = 0; i < signature.size(); i++)
+			SetAttemptHeader(signature[i].first, signature[i].second);
+		HttpFileUpload::HandleRequestStart();
+	}
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		HttpFileUpload::HandleResponse(success, httpStatusCode);
+		const char* p_etag = GetResponseHeaders().Find("ETag");
+		if (m_status == DONE && !(p_etag && *p_etag)) {
+			s3eDebugTracePrintf("HttpMultipartUpload: No ETag for part %u of %s", m_partNumber, m_filePath.c_str());
+			m_status = ERROR; // We couldn't complete the upload without it
+		}
+		m_etag = m_status == DONE ? p_etag : "";
+	}
+private:
+	const Ptr<HttpS3Signer> m_pSigner;
+	const uint m_partNumber;
+	string m_etag;
+};
+
+// POST url?uploadId=id, listing the parts and their ETags:
+class HttpMultipartUpload::Completion : public HttpPost {
+public:
+	Completion(const string& url, Ptr<HttpS3Signer> pSigner, const std::vector< Ptr<Part> >& parts) : HttpPost(url), m_pSigner(pSigner) {
+		SetHeader("Content-Type", "application/xml");
+		for (auto it = parts.begin(); it != parts.end(); it++)
+			m_parts.push_back(std::make_pair((*it)->GetPartNumber(), (*it)->GetETag()));
+	}
+	const string& GetETag() const { return m_etag; }
+	virtual void HandleRequestStart() {
+		const std::vector< std::pair<string, string> > signature = HttpMultipartUpload_Sign(m_pSigner.ptr(), m_method, m_url);
+		for (size_t i = 0; i < signature.size(); i++)
+			SetAttemptHeader(signature[i].first, signature[i].second);
+		HttpPost::HandleRequestStart();
+	}
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		HttpPost::HandleResponse(success, httpStatusCode);
+		if (m_status != DONE)
+			return;
+		// S3 answers 200 as soon as it starts to put the parts together, so a failure after that is in the body:
+		const HttpResponseBody& body = GetResponseBody();
+		const string error = FindXmlElement(body.Data(), body.Size(), "Code");
+		if (!error.empty() || !strstr(string(body.Data(), body.Size()).c_str(), "CompleteMultipartUploadResult")) {
+			s3eDebugTracePrintf("HttpMultipartUpload: Unable to complete %s (%s)", m_url.c_str(), error.empty() ? "no result" : error.c_str());
+			m_status = ERROR;
+			return;
+		}
+		m_etag = FindXmlElement(body.Data(), body.Size(), "ETag");
+	}
+protected:
+	virtual void WriteBody(string& body) const {
+		body.reserve(64 + m_parts.size() * 80);
+		body.append("<CompleteMultipartUpload>");
+		for (auto it = m_parts.begin(); it != m_parts.end(); it++) {
+			char number[16];
+			snprintf(number, sizeof(number), "%u", it->first);
+			body.append("<Part><PartNumber>").append(number).append("</PartNumber><ETag>").append(it->second).append("</ETag></Part>");
+		}
+		body.append("</CompleteMultipartUpload>");
+	}
+private:
+	const Ptr<HttpS3Signer> m_pSigner;
+	std::vector< std::pair<uint, string> > m_parts;
+	string m_etag;
+};
+
+// DELETE url?uploadId=id, so that the storage drops the parts it has:
+class HttpMultipartUpload::Abort : public HttpRequest {
+public:
+	Abort(const string& url, Ptr<HttpS3Signer> pSigner) : HttpRequest(DELETE, url.c_str()), m_pSigner(pSigner) {}
+	virtual void HandleRequestStart() {
+		const std::vector< std::pair<string, string> > signature = HttpMultipartUpload_Sign(m_pSigner.ptr(), m_method, m_url);
+		for (size_t i = 0; i < signature.size(); i++)
+			SetAttemptHeader(signature[i].first, signature[i].second);
+		HttpRequest::HandleRequestStart();
+	}
+private:
+	const Ptr<HttpS3Signer> m_pSigner;
+};
+
+HttpMultipartUpload::HttpMultipartUpload(HttpClient& client, const string& url, const string& filePath, Ptr<HttpS3Signer> pSigner, int64 fileSize, const char* contentType) :
+	HttpRequest(POST, (url + "?uploads").c_str()),
+	m_client(client),
+	m_objectUrl(url),
+	m_filePath(filePath),
+	m_fileSize(fileSize),
+	m_pSigner(pSigner),
+	m_partSize(8 * 1024 * 1024),
+	m_partRetries(3),
+	m_failed(false)
+{
+	if (m_fileSize < 0) {
+		if (s3eFile* p_file = s3eFileOpen(m_filePath.c_str(), "rb")) {
+			m_fileSize = s3eFileGetSize(p_file);
+			s3eFileClose(p_file);
+		}
+		if (m_fileSize < 0)
+			throw std::runtime_error("Unable to open file for uploading!");
+	}
+	SetHeader("Content-Type", contentType); // The object's
+	SetUseCache(false);
+	SetMaxRetries(m_partRetries); // (Initiating twice just leaves an empty upload behind)
+}
+
+HttpMultipartUpload::~HttpMultipartUpload() {
+	// Parts that are still waiting for a worker are no use to anyone now:
+	if (m_pParts)
+		m_pParts->Cancel();
+}
+
+uint HttpMultipartUpload::GetNumPartsDone() const {
+	uint num_done = 0;
+	for (auto it = m_parts.begin(); it != m_parts.end(); it++)
+		num_done += (*it)->GetStatus() == DONE;
+	return num_done;
+}
+
+int64 HttpMultipartUpload::GetBytesUploaded() const {
+	int64 total = 0;
+	for (auto it = m_parts.begin(); it != m_parts.end(); it++)
+		total += (*it)->GetBytesUploaded();
+	return total;
+}
+
+string HttpMultipartUpload::FindXmlElement(const char* pXml, size_t length, const char* name) {
+	const string xml(pXml ? pXml : "", pXml ? length : 0);
+	const string open = string("<").append(name).append(1, '>');
+	const size_t start = xml.find(open);
+	if (start == string::npos)
+		return string();
+	const size_t end = xml.find("</", start + open.size());
+	if (end == string::npos)
+		return string();
+	static const char* const s_entities[][2] = { { "&quot;", "\"" }, { "&apos;", "'" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&amp;", "&" } };
+	string text;
+	for (size_t i = start + open.size(); i < end; i++) {
+		size_t entity = 0;
+		while (entity < 5 && xml.compare(i, strlen(s_entities[entity][0]), s_entities[entity][0]) != 0)
+			entity++;
+		if (entity < 5) {
+			text += s_entities[entity][1];
+			i += strlen(s_entities[entity][0]) - 1;
+		} else {
+			text += xml[i];
+		}
+	}
+	return text;
+}
+
+void HttpMultipartUpload::HandleRequestStart() {
+	const std::vector< std::pair<string, string> > signature = HttpMultipartUpload_Sign(m_pSigner.ptr(), m_method, m_url);
+	for (size_t i = 0; i < signature.size(); i++)
+		SetAttemptHeader(signature[i].first, signature[i].second);
+	HttpRequest::HandleRequestStart();
+}
+
+void HttpMultipartUpload::HandleResponse(bool success, int httpStatusCode) {
+	if (success)
+		m_uploadId = FindXmlElement(m_responseBody.Data(), m_responseBody.Size(), "UploadId");
+	if (!success || m_uploadId.empty()) {
+		s3eDebugTracePrintf("HttpMultipartUpload: Unable to initiate the upload of %s to %s (HTTP status %d)", m_filePath.c_str(), m_objectUrl.c_str(), httpStatusCode);
+		HttpRequest::HandleResponse(false, httpStatusCode);
+		return;
+	}
+
+	// At least MIN_PART_SIZE, and as many bytes as it takes to fit in MAX_PARTS:
+	int64 part_size = m_partSize > MIN_PART_SIZE ? m_partSize : (int64)MIN_PART_SIZE;
+	if ((m_fileSize + part_size - 1) / part_size > MAX_PARTS)
+		part_size = (m_fileSize + MAX_PARTS - 1) / MAX_PARTS;
+	const int64 num_parts = m_fileSize > 0 ? (m_fileSize + part_size - 1) / part_size : 1; // (An empty file is one empty part)
+	std::vector< Ptr<HttpRequest> > requests;
+	requests.reserve((size_t)num_parts);
+	for (int64 i = 0; i < num_parts; i++) {
+		HttpUrl url(m_objectUrl);
+		url.AddQuery("partNumber", i + 1).AddQuery("uploadId", m_uploadId);
+		const int64 offset = i * part_size;
+		const int64 length = offset + part_size < m_fileSize ? part_size : m_fileSize - offset;
+		Ptr<Part> p_part = new Part(url, m_filePath, m_fileSize, m_pSigner, (uint)(i + 1));
+		p_part->SetRange(offset, length);
+		p_part->SetMaxRetries(m_partRetries);
+		p_part->SetExpectedSize((size_t)length);
+		m_parts.push_back(p_part);
+		requests.push_back(p_part.ptr());
+	}
+	s3eDebugTracePrintf("HttpMultipartUpload: Uploading %s in %u parts", m_filePath.c_str(), (uint)num_parts);
+	// Our status stays HEADERS until the upload is complete, so our callback won't be called yet:
+	m_pSelf = this;
+	m_pParts = new HttpRequestGroup(new HttpCallback<HttpMultipartUpload>(this, &HttpMultipartUpload::HandlePartDone),
+		new HttpGroupCallback<HttpMultipartUpload>(this, &HttpMultipartUpload::HandlePartsDone));
+	m_pParts->SetPriority(GetPriority());
+	m_client.QueueRequests(requests, m_pParts);
+}
+
+void HttpMultipartUpload::HandlePartDone(Ptr<HttpRequest> pPart) {
+	if (pPart->GetStatus() != DONE && !m_failed) {
+		m_failed = true;
+		s3eDebugTracePrintf("HttpMultipartUpload: Part %u of %s failed", static_cast<Part*>(pPart.ptr())->GetPartNumber(), m_filePath.c_str());
+		m_pParts->Cancel(); // There's no point in sending the rest
+	}
+}
+
+void HttpMultipartUpload::HandlePartsDone(Ptr<HttpRequestGroup> pGroup) {
+	if (m_failed || pGroup->GetNumSucceeded() != pGroup->GetNumRequests()) {
+		// Let the storage drop the parts that did arrive (it doesn't matter to us whether it does):
+		HttpUrl url(m_objectUrl);
+		url.AddQuery("uploadId", m_uploadId);
+		m_client.QueueRequest(new Abort(url, m_pSigner));
+		Finish(false);
+		return;
+	}
+	HttpUrl url(m_objectUrl);
+	url.AddQuery("uploadId", m_uploadId);
+	Ptr<Completion> p_completion = new Completion(url, m_pSigner, m_parts);
+	p_completion->SetMaxRetries(m_partRetries);
+	p_completion->SetPriority(GetPriority());
+	m_client.QueueRequest(p_completion.ptr(), this, &HttpMultipartUpload::HandleCompletionDone);
+}
+
+void HttpMultipartUpload::HandleCompletionDone(Ptr<HttpRequest> pCompletion) {
+	const bool success = pCompletion->GetStatus() == DONE;
+	if (success)
+		m_etag = static_cast<Completion*>(pCompletion.ptr())->GetETag();
+	Finish(success);
+}
+
+void HttpMultipartUpload::Finish(bool success) {
+	m_status = success ? DONE : ERROR;
+	m_pParts = nullptr;
+	Ptr<HttpMultipartUpload> p_this = m_pSelf; // We may be deleted once this goes out of scope
+	m_pSelf = nullptr;
+	NotifyDone();
+}
@@ -0,0 +1,93 @@
+// HttpMultipartUpload:
+// Uploads one large file (e.g. a recording) to S3 or S3-compatible object
+// storage as a multipart upload, with several parts in flight at once, which
+// is much faster than a single PUT on one TCP stream.
+// The request itself initiates the upload (POST url?uploads). Once it has the
+// upload ID, it splits the file into parts and queues a PUT for each of them
+// (an HttpFileUpload of its range of the file) with the same HttpClient, as an
+// HttpRequestGroup, so as many go at once as the client has workers for.
+// Each part is retried by itself (see SetPartRetries()), and nothing else is
+// sent again. When every part is in, it completes the upload with the parts'
+// ETags (POST url?uploadId=...). If a part fails for good, the parts that are
+// still waiting are cancelled, and the upload is aborted (DELETE
+// url?uploadId=...), so the storage doesn't keep the parts that were sent.
+// Every request is signed by pSigner, if there is one (see HttpS3Signer),
+// again for each attempt.
+//
+// Queue it like any other request:
+//     client.QueueRequest(new HttpMultipartUpload(client, bucketUrl + "/videos/1.mp4", path, pSigner), pCallback);
+// pCallback is called once the upload is complete (or has failed), not when it
+// is initiated.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "HttpClient.h"
+#include "HttpRequestGroup.h"
+#include "HttpS3Signer.h"
+
+class HttpMultipartUpload : public HttpRequest {
+public:
+	enum {
+		MIN_PART_SIZE = 5 * 1024 * 1024, // What S3 accepts for every part but the last
+		MAX_PARTS = 10000
+	};
+	// url is the object's. If fileSize is negative, the size is taken from the file system (see HttpFileUpload).
+	HttpMultipartUpload(HttpClient& client, const std::string& url, const std::string& filePath, Ptr<HttpS3Signer> pSigner = nullptr,
+		int64 fileSize = -1, const char* contentType = "application/octet-stream");
+	~HttpMultipartUpload();
+
+	// The size of every part but the last (8 MB by default; at least MIN_PART_SIZE, and more if the file would
+	// take more than MAX_PARTS). Must be set before the request is queued.
+	HttpMultipartUpload& SetPartSize(int64 partSize) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_partSize = partSize; return *this; }
+	// How many times each part is sent again if it fails in a way that's worth another try (see HttpRequest::SetMaxRetries();
+	// 3 by default). Must be set before the request is queued.
+	HttpMultipartUpload& SetPartRetries(int maxRetries) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_partRetries = maxRetries; return *this; }
+
+	const std::string& GetObjectUrl() const { return m_objectUrl; }
+	const std::string& GetUploadId() const { return m_uploadId; } // Empty until the upload has been initiated
+	int64 GetFileSize() const { return m_fileSize; }
+	uint GetNumParts() const { return (uint)m_parts.size(); } // 0 until the upload has been initiated
+	uint GetNumPartsDone() const;
+	int64 GetBytesUploaded() const; // All parts' bytes handed to curl so far
+	// The ETag of the object that the parts became (from the completion's response), once the request is DONE:
+	const std::string& GetETag() const { return m_etag; }
+
+	virtual void HandleRequestStart();
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) { return m_responseBody.Worker_Append(contents, size) ? size : 0; }
+	virtual void Worker_HandleDone(bool success, int httpStatusCode) { m_responseBody.Worker_Finish(); HttpRequest::Worker_HandleDone(success, httpStatusCode); }
+	virtual void Worker_HandleCleanup() { m_responseBody.Worker_Free(); }
+
+	// The text of the first <name> element in xml, e.g. "UploadId" (with the five XML entities decoded), or "":
+	static std::string FindXmlElement(const char* pXml, size_t length, const char* name);
+
+private:
+	class Part;
+	class Completion;
+	class Abort;
+	void HandlePartDone(Ptr<HttpRequest> pPart);
+	void HandlePartsDone(Ptr<HttpRequestGroup> pGroup);
+	void HandleCompletionDone(Ptr<HttpRequest> pCompletion);
+	void Finish(bool success);
+
+	HttpClient& m_client;
+	const std::string m_objectUrl;
+	const std::string m_filePath;
+	int64 m_fileSize;
+	const Ptr<HttpS3Signer> m_pSigner;
+	int64 m_partSize;
+	int m_partRetries;
+	HttpResponseBody m_responseBody; // The initiation's response (and the worker's, until Worker_HandleCleanup())
+	std::string m_uploadId;
+	std::vector< Ptr<Part> > m_parts;
+	Ptr<HttpRequestGroup> m_pParts;
+	bool m_failed;
+	std::string m_etag;
+	Ptr<HttpMultipartUpload> m_pSelf; // Keeps us alive while the parts are in progress, even if nobody else holds on to us
+};
@@ -0,0 +1,83 @@
+// HttpNegativeCache:
+// The URLs that are known not to exist, as hashes in a sorted array.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpNegativeCache.h"
+
+#include <algorithm>
+#include <s3eTimer.h>
+
+using std::string;
+
+uint64 HttpNegativeCache::Hash(const string& url) {
+	uint64 hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < url.size(); i++)
+		hash = (hash ^ (unsigned char)url[i]) * 1099511628211ULL;
+	return hash;
+}
+
+std::vector<HttpNegativeCache::Entry>::iterator HttpNegativeCache::Lookup(uint64 hash) {
+	Entry key;
+	key.hash = hash;
+	return std::lower_bound(m_entries.begin(), m_entries.end(), key);
+}
+
+std::vector<HttpNegativeCache::Entry>::const_iterator HttpNegativeCache::Lookup(uint64 hash) const {
+	Entry key;
+	key.hash = hash;
+	return std::lower_bound(m_entries.begin(), m_entries.end(), key);
+}
+
+int HttpNegativeCache::Find(const string& url, uint64 nowUtcMs) const {
+	if (m_entries.empty())
+		return 0;
+	const uint64 hash = Hash(url);
+	auto it = Lookup(hash);
+	return it != m_entries.end() && it->hash == hash && it->expiresS > nowUtcMs / 1000 ? (int)it->statusCode : 0;
+}
+
+void HttpNegativeCache::Add(uint64 hash, int statusCode, uint32 expiresS) {
+	auto it = Lookup(hash);
+	if (it != m_entries.end() && it->hash == hash) {
+		it->expiresS = expiresS;
+		it->statusCode = (uint32)statusCode;
+		return;
+	}
+	if (m_entries.size() >= MAX_ENTRIES) {
+		Evict((uint32)(s3eTimerGetUTC() / 1000));
+		it = Lookup(hash);
+	}
+	Entry entry;
+	entry.hash = hash;
+	entry.expiresS = expiresS;
+	entry.statusCode = (uint32)statusCode;
+	m_entries.insert(it, entry);
+}
+
+bool HttpNegativeCache::Remove(const string& url) {
+	if (m_entries.empty())
+		return false;
+	const uint64 hash = Hash(url);
+	auto it = Lookup(hash);
+	if (it == m_entries.end() || it->hash != hash)
+		return false;
+	m_entries.erase(it);
+	return true;
+}
+
+void HttpNegativeCache::Evict(uint32 nowS) {
+	// The ones that have expired, in one pass; if none have, the one that expires soonest:
+	auto end = std::remove_if(m_entries.begin(), m_entries.end(), [nowS](const Entry& entry) { return entry.expiresS <= nowS; });
+	if (end == m_entries.end()) {
+		auto soonest = m_entries.begin();
+		for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+			if (it->expiresS < soonest->expiresS)
+				soonest = it;
+		}
+		m_entries.erase(soonest);
+		return;
+	}
+	m_entries.erase(end, m_entries.end());
+}
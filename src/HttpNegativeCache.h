@@ -0,0 +1,54 @@
+// HttpNegativeCache:
+// The URLs that are known not to exist, i.e. that a GET or HEAD was last
+// answered with 404 Not Found or 410 Gone, and until when to believe it (see
+// HttpClient::SetNegativeCacheTtl()), e.g. the optional avatars and localized
+// variants that mostly don't exist, so that asking for one again doesn't
+// cost a worker and a round trip.
+// Each URL is kept as a 64-bit hash with its expiry and status (16 bytes in
+// all), in one sorted array, so that tens of thousands of them take a few
+// hundred KB and a lookup is a binary search. Two URLs would have to share a
+// hash for a request to be answered with another's 404, which a Bloom filter
+// of the same size would do all the time. Once there are MAX_ENTRIES, those
+// that have expired make way for new ones, or else the one that would expire
+// soonest.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "s3eTypes.h"
+
+class HttpNegativeCache {
+public:
+	enum { MAX_ENTRIES = 16384 };
+
+	struct Entry {
+		uint64 hash; // See Hash()
+		uint32 expiresS; // UTC time, in seconds since 1970, from which it is no longer believed
+		uint32 statusCode; // 404 or 410
+		bool operator<(const Entry& other) const { return hash < other.hash; }
+	};
+
+	// The status that url was answered with, if it is still believed at nowUtcMs (see s3eTimerGetUTC()), or 0:
+	int Find(const std::string& url, uint64 nowUtcMs) const;
+	// Remember that url was answered with statusCode, until untilUtcMs:
+	void Add(const std::string& url, int statusCode, uint64 untilUtcMs) { Add(Hash(url), statusCode, (uint32)(untilUtcMs / 1000)); }
+	void Add(uint64 hash, int statusCode, uint32 expiresS); // (e.g. from a saved index)
+	bool Remove(const std::string& url); // Whether it was there
+	void Clear() { m_entries.clear(); }
+	bool Empty() const { return m_entries.empty(); }
+	size_t Size() const { return m_entries.size(); }
+	const std::vector<Entry>& GetEntries() const { return m_entries; } // In order of hash, e.g. to save them
+
+	static uint64 Hash(const std::string& url); // FNV-1a, as HttpUrl doesn't normalize URLs either
+
+private:
+	std::vector<Entry> m_entries; // In order of hash
+	std::vector<Entry>::iterator Lookup(uint64 hash);
+	std::vector<Entry>::const_iterator Lookup(uint64 hash) const;
+	void Evict(uint32 nowS);
+};
@@ -0,0 +1,300 @@
+// HttpOutbox:
+// A durable outbox for POSTs that must get through even if the device is
+// offline when they are made.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpOutbox.h"
+
+#include <string.h>
+#include <stdexcept>
+#include <s3eTimer.h>
+#include <zlib.h>
+#include "HttpClient.h"
+#include "util/iohelpers.h"
+
+using std::string;
+
+namespace {
+	// A POST of a body that is ready to send as it is:
+	class HttpOutboxPost : public HttpPost {
+	public:
+		HttpOutboxPost(const string& url, const string& contentType, string& body) : HttpPost(url), m_httpStatusCode(0) {
+			SetHeader("Content-Type", contentType);
+			m_body.swap(body);
+		}
+		int GetHttpStatusCode() const { return m_httpStatusCode; }
+		virtual void CompileRequest() {
+			m_postData = m_body;
+			if (m_compressBody)
+				CompressPostData();
+			HttpRequest::CompileRequest();
+		}
+		virtual void HandleResponse(bool success, int httpStatusCode) {
+			m_httpStatusCode = httpStatusCode;
+			HttpPost::HandleResponse(success, httpStatusCode);
+		}
+	private:
+		string m_body;
+		int m_httpStatusCode;
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The journal: "HOJ1", then records of
+//   a 32-bit payload length, the payload's 32-bit CRC-32, and the payload, which is either
+//   'P', the post's 64-bit ID, and its url, contentType and body, or
+//   'D' and a 64-bit ID: every post up to and including that one is done with.
+// Numbers are in the device's own byte order (the journal never leaves the device); strings are a 32-bit
+// length followed by their bytes.
+
+static const char HTTP_OUTBOX_JOURNAL_MAGIC[4] = { 'H', 'O', 'J', '1' };
+static const uint HTTP_OUTBOX_MAX_RETRY_DELAY_MS = 60 * 1000;
+static const uint HTTP_OUTBOX_MIN_RETRY_DELAY_MS = 2 * 1000;
+
+static void HttpOutbox_PutU32(string& out, uint32 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpOutbox_PutU64(string& out, uint64 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpOutbox_PutString(string& out, const string& value) {
+	HttpOutbox_PutU32(out, (uint32)value.size());
+	out.append(value);
+}
+
+static string HttpOutbox_PostRecord(uint64 id, const string& url, const string& contentType, const string& body) {
+	string payload;
+	payload.reserve(1 + 8 + 12 + url.size() + contentType.size() + body.size());
+	payload.append(1, 'P');
+	HttpOutbox_PutU64(payload, id);
+	HttpOutbox_PutString(payload, url);
+	HttpOutbox_PutString(payload, contentType);
+	HttpOutbox_PutString(payload, body);
+	return payload;
+}
+
+// Append a record, header and all, to out:
+static void HttpOutbox_PutRecord(string& out, const string& payload) {
+	HttpOutbox_PutU32(out, (uint32)payload.size());
+	HttpOutbox_PutU32(out, (uint32)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)payload.data(), (uInt)payload.size()));
+	out.append(payload);
+}
+
+namespace {
+	class HttpOutboxReader {
+	public:
+		HttpOutboxReader(const char* pData, size_t size) : m_p(pData), m_pEnd(pData + size) {}
+		bool AtEnd() const { return m_p == m_pEnd; }
+		void Read(void* pDest, size_t size) { memcpy(pDest, Skip(size), size); }
+		uint32 ReadU32() { uint32 value; Read(&value, sizeof(value)); return value; }
+		uint64 ReadU64() { uint64 value; Read(&value, sizeof(value)); return value; }
+		string ReadString() { const uint32 length = ReadU32(); const char* p_data = Skip(length); return string(p_data, length); }
+		const char* Skip(size_t size) {
+			if ((size_t)(m_pEnd - m_p) < size)
+				throw std::runtime_error("truncated");
+			const char* p = m_p;
+			m_p += size;
+			return p;
+		}
+	private:
+		const char* m_p;
+		const char* m_pEnd;
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpOutbox:
+
+HttpOutbox::HttpOutbox(HttpClient& client, const string& journalPath)
+	: m_client(client), m_journalPath(journalPath), m_nextId(1), m_maxBatchSize(1), m_batchSize(0), m_retryAtMs(0), m_retryDelayMs(0), m_pJournal(nullptr), m_numJournalPosts(0)
+{
+	Load();
+}
+
+HttpOutbox::~HttpOutbox() {
+	if (m_pBatch)
+		m_pBatch->Abort(); // (Its callback is guarded by this, so it won't be called now)
+	if (m_pJournal)
+		s3eFileClose(m_pJournal);
+}
+
+void HttpOutbox::Post(const string& url, const string& contentType, const string& body) {
+	Entry entry;
+	entry.id = m_nextId++;
+	entry.url = url;
+	entry.contentType = contentType;
+	entry.body = body;
+	AppendRecord(HttpOutbox_PostRecord(entry.id, url, contentType, body));
+	m_numJournalPosts++;
+	m_posts.push_back(std::move(entry));
+}
+
+void HttpOutbox::PostJson(const string& url, const json::Object& body) {
+	string data;
+	data.resize(json::BufferWriter::MeasureSize(body));
+	json::BufferWriter::Write(body, &data[0]);
+	Post(url, "application/json", data);
+}
+
+void HttpOutbox::Update() {
+	if (m_pBatch || m_posts.empty())
+		return;
+	if (m_retryAtMs) {
+		if ((uint64)s3eTimerGetMs() < m_retryAtMs)
+			return;
+		m_retryAtMs = 0;
+	}
+	SendBatch();
+}
+
+void HttpOutbox::SendBatch() {
+	const Entry& first = m_posts.front();
+	m_batchSize = 1;
+	while (m_batchSize < m_maxBatchSize && m_batchSize < m_posts.size()
+		&& m_posts[m_batchSize].url == first.url && m_posts[m_batchSize].contentType == first.contentType)
+		m_batchSize++;
+	string body;
+	if (m_batchSize == 1) {
+		body = first.body;
+	} else {
+		const bool json = first.contentType.compare(0, 16, "application/json") == 0;
+		size_t length = 2;
+		for (size_t i = 0; i < m_batchSize; i++)
+			length += m_posts[i].body.size() + 1;
+		body.reserve(length);
+		if (json)
+			body.append(1, '[');
+		for (size_t i = 0; i < m_batchSize; i++) {
+			if (i)
+				body.append(1, json ? ',' : '\n');
+			body.append(m_posts[i].body);
+		}
+		if (json)
+			body.append(1, ']');
+	}
+	m_pBatch = new HttpOutboxPost(first.url, first.contentType, body);
+	m_client.QueueRequest(m_pBatch, this, &HttpOutbox::HandleBatchDone);
+}
+
+void HttpOutbox::HandleBatchDone(Ptr<HttpRequest> pRequest) {
+	IwAssert(HTTP_CLIENT, pRequest == m_pBatch);
+	m_pBatch = nullptr;
+	const int code = static_cast<HttpOutboxPost*>(pRequest.ptr())->GetHttpStatusCode();
+	if (code == 0 || code >= 500 || code == 408 || code == 429) {
+		// Offline, or the server can't take it right now:
+		m_retryDelayMs = m_retryDelayMs ? m_retryDelayMs * 2 : HTTP_OUTBOX_MIN_RETRY_DELAY_MS;
+		if (m_retryDelayMs > HTTP_OUTBOX_MAX_RETRY_DELAY_MS)
+			m_retryDelayMs = HTTP_OUTBOX_MAX_RETRY_DELAY_MS;
+		m_retryAtMs = (uint64)s3eTimerGetMs() + m_retryDelayMs;
+		return;
+	}
+	if (code >= 300)
+		s3eDebugTracePrintf("HttpOutbox: %s rejected %u post(s) with %d; dropping them", pRequest->GetURL().c_str(), (uint)m_batchSize, code);
+	m_retryDelayMs = 0;
+	const uint64 last_id = m_posts[m_batchSize - 1].id;
+	m_posts.erase(m_posts.begin(), m_posts.begin() + m_batchSize);
+	m_batchSize = 0;
+	string payload(1, 'D');
+	HttpOutbox_PutU64(payload, last_id);
+	AppendRecord(payload);
+	if (m_posts.empty() || m_numJournalPosts - m_posts.size() > 2 * m_posts.size() + 16)
+		RewriteJournal(); // Mostly finished posts by now
+	Update(); // On to the next batch, if any
+}
+
+void HttpOutbox::AppendRecord(const string& payload) {
+	if (!m_pJournal) {
+		m_pJournal = s3eFileOpen(m_journalPath.c_str(), "ab");
+		if (!m_pJournal) {
+			s3eDebugTracePrintf("HttpOutbox: Unable to open %s; posts will be lost if the app exits before they are sent", m_journalPath.c_str());
+			return;
+		}
+		if (s3eFileGetSize(m_pJournal) == 0)
+			s3eFileWrite(HTTP_OUTBOX_JOURNAL_MAGIC, 1, sizeof(HTTP_OUTBOX_JOURNAL_MAGIC), m_pJournal);
+	}
+	string record;
+	record.reserve(8 + payload.size());
+	HttpOutbox_PutRecord(record, payload);
+	if (s3eFileWrite(record.data(), 1, record.size(), m_pJournal) != record.size() || s3eFileFlush(m_pJournal) != S3E_RESULT_SUCCESS)
+		s3eDebugTracePrintf("HttpOutbox: Unable to write to %s", m_journalPath.c_str());
+}
+
+void HttpOutbox::RewriteJournal() {
+	if (m_pJournal) {
+		s3eFileClose(m_pJournal);
+		m_pJournal = nullptr;
+	}
+	if (m_posts.empty()) {
+		s3eFileDelete(m_journalPath.c_str()); // The next post starts a new one
+		m_numJournalPosts = 0;
+		return;
+	}
+	string data(HTTP_OUTBOX_JOURNAL_MAGIC, sizeof(HTTP_OUTBOX_JOURNAL_MAGIC));
+	for (auto it = m_posts.begin(); it != m_posts.end(); it++)
+		HttpOutbox_PutRecord(data, HttpOutbox_PostRecord(it->id, it->url, it->contentType, it->body));
+	// Write a new journal and then replace the old one, so that a crash can't lose both:
+	const string tmp_path = m_journalPath + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+	const bool written = p_file && s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	if (p_file)
+		s3eFileClose(p_file);
+	if (written) {
+		s3eFileDelete(m_journalPath.c_str());
+		s3eFileRename(tmp_path.c_str(), m_journalPath.c_str());
+		m_numJournalPosts = m_posts.size();
+	} else {
+		// The old journal is still there, so nothing is lost: this is tried again after the next batch.
+		s3eDebugTracePrintf("HttpOutbox: Unable to write %s", tmp_path.c_str());
+		s3eFileDelete(tmp_path.c_str());
+	}
+}
+
+void HttpOutbox::Load() {
+	if (!IsFile(m_journalPath))
+		return;
+	bool damaged = false;
+	try {
+		const FileData data(m_journalPath.c_str());
+		HttpOutboxReader in(data.Data(), data.Size());
+		char magic[sizeof(HTTP_OUTBOX_JOURNAL_MAGIC)];
+		in.Read(magic, sizeof(magic));
+		if (memcmp(magic, HTTP_OUTBOX_JOURNAL_MAGIC, sizeof(magic)) != 0)
+			throw std::runtime_error("not a journal");
+		while (!in.AtEnd()) {
+			HttpOutboxReader record(nullptr, 0);
+			try {
+				const uint32 length = in.ReadU32();
+				const uint32 crc = in.ReadU32();
+				const char* p_payload = in.Skip(length);
+				if (!length || crc != (uint32)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)p_payload, (uInt)length))
+					throw std::runtime_error("bad checksum");
+				record = HttpOutboxReader(p_payload, length);
+			} catch (const std::exception&) {
+				damaged = true; // e.g. the app died while appending it: everything before it is fine
+				break;
+			}
+			char kind;
+			record.Read(&kind, 1);
+			if (kind == 'P') {
+				Entry entry;
+				entry.id = record.ReadU64();
+				entry.url = record.ReadString();
+				entry.contentType = record.ReadString();
+				entry.body = record.ReadString();
+				if (entry.id >= m_nextId)
+					m_nextId = entry.id + 1;
+				m_posts.push_back(std::move(entry));
+				m_numJournalPosts++;
+			} else if (kind == 'D') {
+				const uint64 last_id = record.ReadU64();
+				while (!m_posts.empty() && m_posts.front().id <= last_id)
+					m_posts.pop_front();
+			}
+		}
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpOutbox: Ignoring damaged journal %s (%s)", m_journalPath.c_str(), e.what());
+		m_posts.clear();
+		damaged = true;
+	}
+	// Start from a clean journal, rather than appending after a damaged record or a pile of finished posts:
+	if (damaged || m_numJournalPosts > m_posts.size())
+		RewriteJournal();
+}
@@ -0,0 +1,85 @@
+// HttpOutbox:
+// A durable outbox for POSTs that must get through even if the device is
+// offline when they are made, e.g. telemetry, or API calls whose responses
+// nobody waits for. Each post is appended to a journal file on an s3e drive
+// before it is sent. The outbox reads the journal back when it is created, so
+// a post survives failed attempts, the app being killed, and restarts.
+// Posts are sent one batch at a time, in the order they were made. A batch
+// that fails for want of a network is sent again after a delay, which backs
+// off up to a minute. So is one that the server can't take right now (a 5xx,
+// 408 or 429 response). Call Resume() when the app knows the network is back,
+// to try again at once. Any other response (2xx, or a 4xx that sending again
+// won't fix) takes the batch out of the journal. A batch that was under way
+// when the app died is sent again, so the server may see a post twice.
+// With SetMaxBatchSize(), consecutive posts to the same URL with the same
+// Content-Type are sent as one request: JSON bodies as a JSON array of them,
+// anything else one body per line. Only use this if the server accepts that.
+// The journal is a sequence of records, each a length and a CRC-32 followed by
+// either a post or a note of how many posts are done with. Posting costs one
+// append, and loading the journal one read. A record that a crash left half
+// written is ignored. The journal is rewritten without the finished posts once
+// they make up most of it.
+// Like HttpClient, it must only be used from the app thread. It must not
+// outlive its client.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <deque>
+#include <string>
+
+#include "HttpRequest.h"
+
+class HttpClient;
+
+class HttpOutbox : public IObservable {
+public:
+	// journalPath (e.g. "cache://outbox.journal") is created if it doesn't exist, and what it holds is sent
+	// on the next Update().
+	HttpOutbox(HttpClient& client, const std::string& journalPath);
+	~HttpOutbox(); // Aborts the batch under way, which stays in the journal for next time
+
+	void Post(const std::string& url, const std::string& contentType, const std::string& body);
+	void PostJson(const std::string& url, const json::Object& body);
+
+	// How many posts may go in one request (1 by default, for no batching):
+	HttpOutbox& SetMaxBatchSize(uint maxPosts) { m_maxBatchSize = maxPosts ? maxPosts : 1; return *this; }
+
+	// Call regularly, e.g. along with HttpClient::Update(), to send the next batch when it is due:
+	void Update();
+	// Send the next batch on the next Update(), rather than once the delay after a failure is over:
+	void Resume() { m_retryAtMs = 0; m_retryDelayMs = 0; }
+
+	size_t Size() const { return m_posts.size(); } // Posts not yet done with, including those being sent
+	bool Empty() const { return m_posts.empty(); }
+	bool IsWaiting() const { return m_retryAtMs != 0; } // A batch failed, and the next attempt is delayed
+
+private:
+	struct Entry {
+		uint64 id; // Consecutive, in the order they were posted
+		std::string url;
+		std::string contentType;
+		std::string body;
+	};
+	HttpClient& m_client;
+	const std::string m_journalPath;
+	std::deque<Entry> m_posts;
+	uint64 m_nextId;
+	uint m_maxBatchSize;
+	Ptr<HttpRequest> m_pBatch; // The request under way, if any
+	size_t m_batchSize; // How many of m_posts it is sending
+	uint64 m_retryAtMs; // When a failed batch may be sent again (s3eTimerGetMs()), or 0
+	uint m_retryDelayMs;
+	s3eFile* m_pJournal; // Opened for appending when first needed
+	size_t m_numJournalPosts; // Post records in the journal, whether or not they are done with
+
+	void SendBatch();
+	void HandleBatchDone(Ptr<HttpRequest> pRequest);
+	void Load();
+	void AppendRecord(const std::string& payload);
+	void RewriteJournal(); // Without the posts that are done with
+	HttpOutbox(const HttpOutbox&);
+	HttpOutbox& operator=(const HttpOutbox&);
+};
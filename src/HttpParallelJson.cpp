@@ -0,0 +1,200 @@
+// HttpParallelJson:
+// Reads a big top-level JSON array on an HttpCpuPool's threads as well as the app thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpParallelJson.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <IwMath.h>
+#include <s3eDevice.h>
+
+#include "HttpCpuPool.h"
+#include "util/atomic.h"
+#include "util/jsontape.h"
+
+// Parse the elements in [pBegin, pEnd) of pDocument's root array (which end with the array's ']' if closed) onto tape,
+// as an array of their own. Returns false, with a message in pError, if they aren't well-formed.
+static bool HttpParallelJson_ParseRange(const char* pDocument, const char* pBegin, const char* pEnd, bool closed, json::TapeWriter& tape, char* pError, size_t errorSize) {
+	size_t error_offset = pBegin - pDocument;
+	try {
+		// (A range that has no elements would parse as an empty array, whereas the document has a stray ',' there)
+		const char* p_first = json::Detail::SkipWhiteSpace(pBegin, pEnd);
+		if (p_first == pEnd || *p_first == ']' || *p_first == ',') {
+			error_offset = p_first - pDocument;
+			throw json::Exception("Expected a value");
+		}
+		json::PushParser parser(tape);
+		parser.Feed("[", 1);
+		parser.Feed(pBegin, pEnd - pBegin);
+		if (!closed)
+			parser.Feed("]", 1);
+		parser.Finish();
+		if (tape.OutOfMemory()) {
+			snprintf(pError, errorSize, "Out of memory for the tape");
+			return false;
+		}
+		return true;
+	} catch (const json::Reader::ScanException& e) {
+		error_offset += e.m_locError.m_nDocOffset - 1; // (Less our '[')
+		snprintf(pError, errorSize, "%s (at offset %u)", e.what(), (uint)error_offset);
+	} catch (const json::Reader::ParseException& e) {
+		error_offset += e.m_locTokenBegin.m_nDocOffset - 1;
+		snprintf(pError, errorSize, "%s (at offset %u)", e.what(), (uint)error_offset);
+	} catch (const json::Exception& e) {
+		snprintf(pError, errorSize, "%s (at offset %u)", e.what(), (uint)error_offset);
+	}
+	return false;
+}
+
+// One range of the root array's elements: parsed by whichever of a pool thread and the app thread claims it first.
+class HttpParallelJson::RangeJob : public HttpJob {
+public:
+	RangeJob(const char* pDocument, const char* pBegin, const char* pEnd, bool closed) :
+		m_pDocument(pDocument), m_pBegin(pBegin), m_pEnd(pEnd), m_closed(closed), m_claimed(0), m_parsed(0), m_claimedByApp(false), m_succeeded(false) { m_error[0] = '\0'; }
+
+	bool Claim() { return atomic::CompareAndSwap(m_claimed, 0, 1); }
+
+	virtual void Worker_Run() {
+		if (!Claim())
+			return; // The app thread got to it first
+		m_succeeded = HttpParallelJson_ParseRange(m_pDocument, m_pBegin, m_pEnd, m_closed, m_tape, m_error, sizeof(m_error));
+		atomic::StoreRelease(m_parsed, 1);
+	}
+	virtual void Worker_Cleanup() { m_tape.Free(); }
+
+	/////// App thread ///////
+	// Parse it here, if no pool thread has claimed it:
+	void ParseIfUnclaimed() {
+		if (!Claim())
+			return;
+		m_claimedByApp = true;
+		m_succeeded = HttpParallelJson_ParseRange(m_pDocument, m_pBegin, m_pEnd, m_closed, m_appTape, m_error, sizeof(m_error));
+		atomic::StoreRelease(m_parsed, 1);
+	}
+	// Wait for the pool thread that claimed it, if one did:
+	void WaitUntilParsed() const {
+		while (!atomic::LoadAcquire(m_parsed))
+			s3eDeviceYield(0);
+	}
+	bool Succeeded() const { return m_succeeded; }
+	const char* GetError() const { return m_error; }
+	const json::TapeWriter& GetTape() const { return m_claimedByApp ? m_appTape : m_tape; }
+	void FreeAppTape() { m_appTape.Free(); }
+
+private:
+	const char* const m_pDocument;
+	const char* const m_pBegin;
+	const char* const m_pEnd;
+	const bool m_closed;
+	volatile int m_claimed;
+	volatile int m_parsed; // Set once the tape (or the error) is ready
+	bool m_claimedByApp;
+	bool m_succeeded;
+	char m_error[160];
+	json::TapeWriter m_tape; // Recorded and freed by the pool thread...
+	json::TapeWriter m_appTape; // ...or by the app thread
+};
+
+void HttpParallelJson::Read(json::Array& array, const char* pData, size_t nSize) {
+	const char* p_array = FindArray(pData, nSize);
+	if (!p_array) {
+		m_numRanges = 1;
+		json::Array elements;
+		json::Reader::Read(elements, pData, nSize);
+		array.Reserve(array.Size() + elements.Size());
+		for (json::Array::iterator it = elements.Begin(); it != elements.End(); ++it)
+			array.Insert(std::move(*it));
+		return;
+	}
+	ReadRanges(array, pData, nSize, p_array);
+}
+
+void HttpParallelJson::Read(json::UnknownElement& element, const char* pData, size_t nSize) {
+	const char* p_array = FindArray(pData, nSize);
+	if (!p_array) {
+		m_numRanges = 1;
+		json::Reader::Read(element, pData, nSize);
+		return;
+	}
+	element = json::Array();
+	ReadRanges(element, pData, nSize, p_array);
+}
+
+const char* HttpParallelJson::FindArray(const char* pData, size_t nSize) const {
+	if (nSize < 2 * MIN_RANGE_SIZE || m_pool.NumThreads() == 0)
+		return nullptr;
+	const char* p = json::Detail::SkipWhiteSpace(pData, pData + nSize);
+	return p != pData + nSize && *p == '[' ? p : nullptr;
+}
+
+void HttpParallelJson::ReadRanges(json::Array& array, const char* pData, size_t nSize, const char* pArray) {
+	const char* p_end = pData + nSize;
+	const size_t max_ranges = MIN((size_t)m_pool.NumThreads() + 1, nSize / MIN_RANGE_SIZE);
+	const size_t range_size = nSize / max_ranges;
+	std::vector< Ptr<RangeJob> > ranges;
+	ranges.reserve(max_ranges);
+	// The structural scan: follow the nesting, skipping over strings, and split the array at the first top-level ','
+	// after each range_size of text. Each range goes to the pool as soon as its end has been found.
+	const char* p_range = pArray + 1;
+	const char* p_next_split = pData + range_size;
+	size_t depth = 1;
+	for (const char* p = p_range; p < p_end && ranges.size() + 1 < max_ranges; ++p) {
+		const char c = *p;
+		if (c == '"') {
+			for (++p; ; ) {
+				p = json::Detail::FindStringSpecial(p, p_end);
+				if (p == p_end || *p == '"')
+					break;
+				p = MIN(p + (*p == '\\' ? 2 : 1), p_end); // (An escape, or a (not allowed) newline, which the parser will find)
+			}
+			if (p == p_end)
+				break;
+		} else if (c == '[' || c == '{') {
+			depth++;
+		} else if (c == ']' || c == '}') {
+			if (--depth == 0)
+				break; // The end of the array: what is left is the last range
+		} else if (c == ',' && depth == 1 && p >= p_next_split) {
+			Ptr<RangeJob> p_job = new RangeJob(pData, p_range, p, false);
+			m_pool.Submit(p_job.ptr());
+			ranges.push_back(p_job);
+			p_range = p + 1;
+			p_next_split = p + range_size;
+		}
+	}
+	ranges.push_back(new RangeJob(pData, p_range, p_end, true)); // (The app thread's)
+	m_numRanges = (uint)ranges.size();
+	// Parse the last range here, and then any that are still waiting for a pool thread, the latest first (as the pool
+	// takes the oldest first). The pool must be done with the text before we return, come what may.
+	for (size_t i = ranges.size(); i-- > 0; )
+		ranges[i]->ParseIfUnclaimed();
+	size_t total = 0;
+	const RangeJob* p_failed = nullptr;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		ranges[i]->WaitUntilParsed();
+		if (!ranges[i]->Succeeded() && !p_failed)
+			p_failed = ranges[i].ptr();
+		else if (!p_failed)
+			total += json::TapeValue(ranges[i]->GetTape().Data()).Size();
+	}
+	try {
+		if (p_failed)
+			throw json::Exception(p_failed->GetError());
+		// Stitch the ranges back together:
+		array.Reserve(array.Size() + total);
+		for (size_t i = 0; i < ranges.size(); i++) {
+			const json::TapeValue range(ranges[i]->GetTape().Data());
+			for (json::TapeValue::Iterator it = range.Begin(), it_end = range.End(); it != it_end; ++it)
+				it.Value().ToElement(*array.Insert(json::UnknownElement()));
+			ranges[i]->FreeAppTape(); // (The pool threads free theirs, once the pool has finished with the jobs)
+		}
+	} catch (...) {
+		for (size_t i = 0; i < ranges.size(); i++)
+			ranges[i]->FreeAppTape();
+		throw;
+	}
+}
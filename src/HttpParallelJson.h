@@ -0,0 +1,54 @@
+// HttpParallelJson:
+// Reads a big JSON document whose root is an array of independent elements
+// (e.g. a catalogue of tens of thousands of objects) on several cores at
+// once: a structural scan of the text (strings and nesting only, nothing is
+// decoded) finds where the top-level elements begin, and splits the array
+// into ranges of about equal size, which the threads of an HttpCpuPool parse
+// onto tapes (see json::PushParser and jsontape.h) as soon as each range has
+// been found. The app thread parses the last range itself, and then any that
+// no pool thread has got round to yet, so it never waits for a pool that is
+// busy with something else. Finally, it builds the elements from the tapes,
+// in order, which is much quicker than parsing them.
+// The pool threads only ever make tapes, in their own memory environment
+// (see HttpClientWorker.h), and free them again themselves, so the elements
+// are all made on the app thread, from its heap or the json::Arena that is
+// current there (e.g. a json::Document's).
+// A document that isn't an array, or is too small to be worth splitting, is
+// just read with json::Reader. App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+
+#include "util/json.h"
+
+class HttpCpuPool;
+
+class HttpParallelJson {
+public:
+	// minRangeSize: the least text that is worth a range of its own (and a job on the pool).
+	explicit HttpParallelJson(HttpCpuPool& pool, size_t minRangeSize = 128 * 1024) : m_pool(pool), MIN_RANGE_SIZE(minRangeSize), m_numRanges(0) {}
+
+	// As json::Reader::Read(array, pData, nSize): the elements are appended to array. Throws json::Exception (or
+	// one of json::Reader's exceptions) if the document isn't an array, or isn't well-formed; either way, it doesn't
+	// return until the pool is done with pData.
+	void Read(json::Array& array, const char* pData, size_t nSize);
+	// Or, for a document that may not be an array after all:
+	void Read(json::UnknownElement& element, const char* pData, size_t nSize);
+
+	uint GetNumRanges() const { return m_numRanges; } // That the last Read() split the document into (1 if it didn't)
+
+private:
+	class RangeJob;
+	HttpCpuPool& m_pool;
+	const size_t MIN_RANGE_SIZE;
+	uint m_numRanges;
+	// Where the root array begins, if pData is one worth splitting, or nullptr:
+	const char* FindArray(const char* pData, size_t nSize) const;
+	void ReadRanges(json::Array& array, const char* pData, size_t nSize, const char* pArray);
+	HttpParallelJson(const HttpParallelJson&);
+	HttpParallelJson& operator=(const HttpParallelJson&);
+};
@@ -0,0 +1,26 @@
+// HttpProbes:
+// The build switch for the library's instrumentation: the request lifecycle
+// events that go to an HttpTracer (see HttpClient::SetTracer()), the
+// per-endpoint stats (see HttpClient::SetEndpointStats()), and each request's
+// CPU time (see HttpRequest::Timings::workerCpuMs). They are compiled
+// in by default, and only cost a branch on a pointer or a count where they
+// are off. HTTP_PROBES=0 (e.g. in the defines in HttpUtils.mkb, for a release
+// build) compiles them out altogether, so the workers' curl callbacks don't
+// so much as look for a tracer; SetTracer() and SetEndpointStats() then do
+// nothing. Each probe tests HTTP_PROBES in its condition, as HTTP_LOG() tests
+// HTTP_LOG_LEVEL, so that its code still compiles either way, e.g.
+//     if (HTTP_PROBES && pTraceRing)
+//         HttpTracer::Trace(pTraceRing, event, traceId);
+// Allocation counting has a switch of its own, HTTP_ALLOC_STATS (see
+// HttpAllocStats.h), and the workers' messages HTTP_LOG_LEVEL (see HttpLog.h),
+// as they are worth having separately; the first is off by default.
+// Not intended to be included by application code.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#ifndef HTTP_PROBES
+#define HTTP_PROBES 1
+#endif
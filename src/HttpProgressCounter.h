@@ -0,0 +1,70 @@
+// HttpProgressCounter:
+// The progress of many requests together, e.g. all those behind a loading
+// screen, kept as running totals that the workers add to as each transfer
+// goes (see HttpRequest::SetProgressCounter()). Reading it costs a few loads,
+// however many requests there are, rather than a GetProgress() of each of
+// them every frame. HttpRequestGroup keeps one for its requests.
+// Each request counts its expected size (HttpRequest::SetExpectedSize())
+// towards the download total until the real size is known, and once it is
+// done, the total and the bytes done count what it really took: so the
+// fraction only reaches 1 when everything has finished. A request that fails
+// or is cancelled counts what it had done by then. A retry takes back what
+// the failed attempt had counted.
+// The figures are updated separately (each one atomically), so a read may
+// catch one just before another, but each of them only ever moves by what a
+// request really did. Byte counts are size_t, so on 32-bit devices they are
+// good for up to 4 GB at a time.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+
+#include "util/atomic.h"
+#include "util/ptr.h"
+
+class HttpProgressCounter : public IRefCounted {
+public:
+	HttpProgressCounter() : m_numItems(0), m_numDone(0), m_downloadBytesTotal(0), m_downloadBytesDone(0), m_uploadBytesTotal(0), m_uploadBytesDone(0) {}
+
+	size_t GetNumItems() const { return atomic::LoadRelaxed(m_numItems); } // Requests counted
+	size_t GetNumDone() const { return atomic::LoadRelaxed(m_numDone); } // Of those, how many have finished (or failed, or been cancelled)
+	size_t GetDownloadBytesTotal() const { return atomic::LoadRelaxed(m_downloadBytesTotal); }
+	size_t GetDownloadBytesDone() const { return atomic::LoadRelaxed(m_downloadBytesDone); }
+	size_t GetUploadBytesTotal() const { return atomic::LoadRelaxed(m_uploadBytesTotal); }
+	size_t GetUploadBytesDone() const { return atomic::LoadRelaxed(m_uploadBytesDone); }
+	// By bytes if any are known, otherwise by requests:
+	double GetDownloadFraction() const {
+		const size_t total = GetDownloadBytesTotal();
+		const size_t items = GetNumItems();
+		if (total)
+			return GetDownloadBytesDone() >= total ? 1.0 : (double)GetDownloadBytesDone() / total;
+		return items ? (double)GetNumDone() / items : 0;
+	}
+	double GetUploadFraction() const { const size_t total = GetUploadBytesTotal(); return total ? (double)GetUploadBytesDone() / total : 0; }
+
+	/////// Internal methods used by HttpRequest, on either thread ///////
+	void AddItem() { atomic::FetchAdd(m_numItems, (size_t)1); }
+	void ItemDone() { atomic::FetchAdd(m_numDone, (size_t)1); }
+	// Each is a change, which wraps around to take away:
+	void Add(size_t downloadTotal, size_t downloadDone, size_t uploadTotal, size_t uploadDone) {
+		if (downloadTotal)
+			atomic::FetchAdd(m_downloadBytesTotal, downloadTotal);
+		if (downloadDone)
+			atomic::FetchAdd(m_downloadBytesDone, downloadDone);
+		if (uploadTotal)
+			atomic::FetchAdd(m_uploadBytesTotal, uploadTotal);
+		if (uploadDone)
+			atomic::FetchAdd(m_uploadBytesDone, uploadDone);
+	}
+
+private:
+	volatile size_t m_numItems;
+	volatile size_t m_numDone;
+	volatile size_t m_downloadBytesTotal;
+	volatile size_t m_downloadBytesDone;
+	volatile size_t m_uploadBytesTotal;
+	volatile size_t m_uploadBytesDone;
+};
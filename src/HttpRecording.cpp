@@ -0,0 +1,150 @@
+// HttpRecording:
+// Responses captured from real transfers, for HttpClient::SetRecording().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpRecording.h"
+
+#include <string.h>
+#include <stdexcept>
+#include <s3eDebug.h>
+#include <s3eFile.h>
+#include "util/iohelpers.h"
+
+using std::string;
+
+HttpRecording::Exchange& HttpRecording::Add(const string& method, const string& url) {
+	std::vector<Exchange>& list = m_exchanges[GetKey(method.c_str(), url)].list;
+	list.push_back(Exchange());
+	m_numExchanges++;
+	return list.back();
+}
+
+const HttpRecording::Exchange* HttpRecording::Next(const char* method, const string& url) {
+	auto it = m_exchanges.find(GetKey(method, url));
+	if (it == m_exchanges.end() || it->second.list.empty()) {
+		m_numMisses++;
+		return nullptr;
+	}
+	Exchanges& exchanges = it->second;
+	const Exchange* p_exchange = &exchanges.list[exchanges.next];
+	exchanges.next = (exchanges.next + 1) % exchanges.list.size();
+	return p_exchange;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The file: binary, in the device's own byte order (like HttpCache's index, it is meant for the machine that made it):
+//   "HRC1", the number of exchanges, and for each: method, url, statusLine, statusCode, the number of headers and their
+//   names and values, headersMs, totalMs, the number of chunks and each one's offsetMs and size, then the body.
+// Counts and numbers are 32 bits; strings are a 32-bit length followed by their bytes.
+
+static const char HTTP_RECORDING_MAGIC[4] = { 'H', 'R', 'C', '1' };
+
+static void HttpRecording_PutU32(string& out, uint32 value) { out.append((const char*)&value, sizeof(value)); }
+static void HttpRecording_PutString(string& out, const char* pData, size_t length) {
+	HttpRecording_PutU32(out, (uint32)length);
+	out.append(pData, length);
+}
+static void HttpRecording_PutString(string& out, const string& value) { HttpRecording_PutString(out, value.data(), value.size()); }
+
+namespace {
+	class HttpRecordingReader {
+	public:
+		HttpRecordingReader(const char* pData, size_t size) : m_p(pData), m_pEnd(pData + size) {}
+		void Read(void* pDest, size_t size) { memcpy(pDest, Skip(size), size); }
+		uint32 ReadU32() { uint32 value; Read(&value, sizeof(value)); return value; }
+		// A string, in place:
+		const char* ReadString(size_t& length) { length = ReadU32(); return Skip(length); }
+		string ReadString() { size_t length; const char* p_data = ReadString(length); return string(p_data, length); }
+	private:
+		const char* m_p;
+		const char* m_pEnd;
+		const char* Skip(size_t size) {
+			if ((size_t)(m_pEnd - m_p) < size)
+				throw std::runtime_error("recording is truncated");
+			const char* p = m_p;
+			m_p += size;
+			return p;
+		}
+	};
+}
+
+bool HttpRecording::Save(const char* filePath) const {
+	string data;
+	data.append(HTTP_RECORDING_MAGIC, sizeof(HTTP_RECORDING_MAGIC));
+	HttpRecording_PutU32(data, (uint32)m_numExchanges);
+	for (auto it = m_exchanges.begin(); it != m_exchanges.end(); it++) {
+		const size_t space = it->first.find(' ');
+		for (auto it_exchange = it->second.list.begin(); it_exchange != it->second.list.end(); it_exchange++) {
+			const Exchange& exchange = *it_exchange;
+			HttpRecording_PutString(data, it->first.data(), space);
+			HttpRecording_PutString(data, it->first.data() + space + 1, it->first.size() - space - 1);
+			HttpRecording_PutString(data, exchange.statusLine);
+			HttpRecording_PutU32(data, (uint32)exchange.statusCode);
+			HttpRecording_PutU32(data, (uint32)exchange.headers.Size());
+			for (size_t i = 0; i < exchange.headers.Size(); i++) {
+				HttpRecording_PutString(data, exchange.headers.GetName(i), exchange.headers.GetNameLength(i));
+				HttpRecording_PutString(data, exchange.headers.GetValue(i), exchange.headers.GetValueLength(i));
+			}
+			HttpRecording_PutU32(data, exchange.headersMs);
+			HttpRecording_PutU32(data, exchange.totalMs);
+			HttpRecording_PutU32(data, (uint32)exchange.chunks.size());
+			for (auto it_chunk = exchange.chunks.begin(); it_chunk != exchange.chunks.end(); it_chunk++) {
+				HttpRecording_PutU32(data, it_chunk->offsetMs);
+				HttpRecording_PutU32(data, it_chunk->size);
+			}
+			HttpRecording_PutString(data, exchange.body);
+		}
+	}
+	s3eFile* p_file = s3eFileOpen(filePath, "wb");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpRecording: Unable to write %s", filePath);
+		return false;
+	}
+	const bool written = s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	s3eFileClose(p_file);
+	return written;
+}
+
+bool HttpRecording::Load(const char* filePath) {
+	Clear();
+	try {
+		const FileData data(filePath);
+		HttpRecordingReader in(data.Data(), data.Size());
+		char magic[sizeof(HTTP_RECORDING_MAGIC)];
+		in.Read(magic, sizeof(magic));
+		if (memcmp(magic, HTTP_RECORDING_MAGIC, sizeof(magic)) != 0)
+			throw std::runtime_error("unknown format");
+		for (uint32 num_exchanges = in.ReadU32(); num_exchanges > 0; num_exchanges--) {
+			const string method = in.ReadString();
+			const string url = in.ReadString();
+			Exchange& exchange = Add(method, url);
+			exchange.statusLine = in.ReadString();
+			exchange.statusCode = (int)in.ReadU32();
+			for (uint32 num_headers = in.ReadU32(); num_headers > 0; num_headers--) {
+				size_t name_length, value_length;
+				const char* p_name = in.ReadString(name_length);
+				const char* p_value = in.ReadString(value_length);
+				exchange.headers.Add(p_name, name_length, p_value, value_length);
+			}
+			exchange.headersMs = in.ReadU32();
+			exchange.totalMs = in.ReadU32();
+			size_t body_size = 0;
+			exchange.chunks.resize(in.ReadU32());
+			for (auto it = exchange.chunks.begin(); it != exchange.chunks.end(); it++) {
+				it->offsetMs = in.ReadU32();
+				it->size = in.ReadU32();
+				body_size += it->size;
+			}
+			exchange.body = in.ReadString();
+			if (exchange.body.size() != body_size)
+				throw std::runtime_error("chunks don't match the body");
+		}
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpRecording: Unable to load %s (%s)", filePath, e.what());
+		Clear();
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,83 @@
+// HttpRecording:
+// Responses captured from real transfers, for serving again without the
+// network (see HttpClient::SetRecording()), so that benchmarks of Update(),
+// the callbacks, JSON parsing and header handling aren't at the mercy of a
+// server's latency. In MODE_RECORD, the client sends its requests as usual,
+// and adds each response (status line, headers, and the body as the chunks
+// it arrived in, each with when it did) to the recording, which Save() then
+// writes to a file. In MODE_REPLAY, the workers hand the requests the
+// responses in the recording instead of making transfers, with the timing
+// scaled by SetSpeed() (or as fast as they can, with a speed of 0). A request
+// that has no recorded response fails, as if it couldn't connect.
+// Responses are matched by method and URL. If the same request was recorded
+// several times (e.g. a poll), they are replayed in turn, then round again.
+// What is recorded is what the request got, so a compressed response's body
+// is kept decompressed, as it was passed to Worker_HandleData(). Responses
+// that came from the caches aren't recorded (record with them off), nor are
+// failed transfers. A replay doesn't read request bodies.
+// App thread only, apart from the workers reading the responses that the
+// client has handed them. It must outlive any HttpClient that uses it, and
+// must not be loaded or cleared while one has requests in progress.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HttpHeaders.h"
+
+class HttpRecording {
+public:
+	enum Mode { MODE_RECORD, MODE_REPLAY };
+	struct Chunk {
+		uint32 offsetMs; // From the start of the transfer
+		uint32 size;
+	};
+	struct Exchange {
+		Exchange() : statusCode(0), headersMs(0), totalMs(0) {}
+		std::string statusLine; // e.g. "HTTP/1.1 200 OK"
+		int statusCode;
+		HttpHeaders headers;
+		uint32 headersMs; // From the start of the transfer until the headers were in
+		uint32 totalMs;
+		std::string body; // The chunks, back to back
+		std::vector<Chunk> chunks;
+	};
+
+	HttpRecording(Mode mode) : m_mode(mode), m_speed(1), m_numExchanges(0), m_numMisses(0) {}
+
+	Mode GetMode() const { return m_mode; }
+	// How much faster than it was recorded to replay each response: 1 (the default) keeps the recorded timing,
+	// 0 serves each one as fast as possible. Hand it to requests queued from then on.
+	void SetSpeed(double speed) { m_speed = speed; }
+	double GetSpeed() const { return m_speed; }
+	// Replace the responses with those in a file written by Save(). Returns false if it can't be read.
+	bool Load(const char* filePath);
+	bool Save(const char* filePath) const;
+	void Clear() { m_exchanges.clear(); m_numExchanges = 0; }
+	size_t GetNumExchanges() const { return m_numExchanges; }
+	uint64 GetNumMisses() const { return m_numMisses; } // Requests replayed without a recorded response
+
+	Exchange& Add(const std::string& method, const std::string& url); // A new, empty one, to be filled in
+
+	/////// Internal methods used by HttpClient ///////
+	// The response to replay for a request, in turn, or nullptr (counted as a miss) if there is none:
+	const Exchange* Next(const char* method, const std::string& url);
+
+private:
+	struct Exchanges {
+		Exchanges() : next(0) {}
+		std::vector<Exchange> list;
+		size_t next; // The one to replay next
+	};
+	const Mode m_mode;
+	double m_speed;
+	std::map<std::string, Exchanges> m_exchanges; // By "<method> <url>"
+	size_t m_numExchanges;
+	uint64 m_numMisses;
+	static std::string GetKey(const char* method, const std::string& url) { return std::string(method) + ' ' + url; }
+};
@@ -6,157 +6,1098 @@
 // Public domain
 
 #include <IwMath.h>
+#include <zlib.h>
+#include <curl/curl.h>
 #include "HttpRequest.h"
+#include "HttpClient.h"
+#include "HttpDiskWriter.h"
+#include "HttpScheduler.h"
+#include "util/atomic.h"
 #include "util/iohelpers.h"
+#include "util/jsoncbor.h"
 
 using std::string;
-using std::ostringstream;
 
 ///////////////////////////////////////////////////////////////////////////////
 // HttpRequest:
 
-string HttpRequest::UrlEncode(const string& value, bool strict) {
+void HttpRequest::NotifyDone() {
+	FinishProgressCounter();
+	if (Ptr<HttpCallbackBase> p_callback = m_pCallback) {
+		m_pCallback = nullptr;
+		p_callback->Call(this);
+	}
+	if (m_callbackDelegate) {
+		const CallbackDelegate delegate = m_callbackDelegate;
+		const bool call = !m_callbackGuarded || m_pCallbackGuard;
+		m_callbackDelegate.clear();
+		m_pCallbackGuard = nullptr;
+		m_callbackGuarded = false;
+		if (call)
+			delegate(this);
+	}
+	if (m_then) {
+		const CallbackDelegate then = m_then;
+		m_then.clear();
+		then(this);
+	}
+	if (m_status != HEADERS)
+		ReleaseDependents();
+}
+
+void HttpRequest::Cancel() {
+	if (m_pWaitingClient) {
+		// Waiting for its dependencies, which will find it cancelled:
+		m_pWaitingClient = nullptr;
+		m_status = CANCELLED;
+		ForgetCallbacks();
+		FinishProgressCounter();
+		ReleaseDependents();
+		return;
+	}
+	if (m_status != PENDING)
+		return;
+	m_status = CANCELLED;
+	ForgetCallbacks();
+	FinishProgressCounter();
+	Ptr<HttpRequest> p_this(this); // (The scheduler may hold the last reference)
+	if (m_pScheduler)
+		m_pScheduler->Remove(this);
+	ReleaseDependents();
+}
+
+void HttpRequest::HandleNotBefore() {
+	m_pScheduler->HandleNotBefore(this);
+}
+
+void HttpRequest::HandleDeadline() {
+	m_pScheduler->HandleDeadline(this);
+}
+
+void HttpRequest::Abort() {
+	if (m_status == PENDING || m_pWaitingClient) {
+		Cancel();
+		return;
+	}
+	if (m_status != SENDING && m_status != HEADERS)
+		return;
+	ForgetCallbacks();
+	m_aborted = true;
+	for (auto it = m_followers.begin(); it != m_followers.end(); it++) {
+		if (!(*it)->m_aborted)
+			return; // Still wanted by a follower: the transfer carries on for its sake
+	}
+	m_abortRequested = true;
+}
+
+void HttpRequest::ReleaseDependents() {
+	if (m_dependents.empty())
+		return;
+	std::vector< Ptr<HttpRequest> > dependents;
+	dependents.swap(m_dependents);
+	for (auto it = dependents.begin(); it != dependents.end(); it++) {
+		HttpRequest* p_dependent = it->ptr();
+		// (One that has already been released, by another dependency failing, or cancelled, is passed over)
+		if (p_dependent->m_pWaitingClient && (m_status != DONE || --p_dependent->m_numWaitingFor == 0))
+			p_dependent->m_pWaitingClient->ReleaseDependent(*it);
+	}
+}
+
+void HttpRequest::SetPriority(Priority priority) {
+	IwAssert(HTTP_CLIENT, priority >= 0 && priority < NUM_PRIORITIES);
+	if (m_pScheduler)
+		m_pScheduler->Reprioritize(this, priority);
+	else
+		m_priority = priority;
+}
+
+HttpRequest::Progress HttpRequest::GetProgress() const {
+	// A sequence lock: retry if the worker was part way through an update, or made one while we were reading
+	Progress progress;
+	for (;;) {
+		const uint32 version = atomic::LoadAcquire(m_progressVersion);
+		if (!(version & 1)) {
+			progress.downloadBytesNow = m_downloadBytesNow;
+			progress.downloadBytesTotal = m_downloadBytesTotal;
+			progress.uploadBytesNow = m_uploadBytesNow;
+			progress.uploadBytesTotal = m_uploadBytesTotal;
+			atomic::Fence();
+			if (atomic::LoadRelaxed(m_progressVersion) == version)
+				return progress;
+		}
+	}
+}
+
+void HttpRequest::Worker_UpdateProgress(const Progress& progress) {
+	const uint32 version = m_progressVersion;
+	atomic::StoreRelaxed(m_progressVersion, version + 1);
+	atomic::Fence();
+	m_downloadBytesNow = progress.downloadBytesNow;
+	m_downloadBytesTotal = progress.downloadBytesTotal;
+	m_uploadBytesNow = progress.uploadBytesNow;
+	m_uploadBytesTotal = progress.uploadBytesTotal;
+	atomic::StoreRelease(m_progressVersion, version + 2);
+	if (HttpProgressCounter* p_counter = m_pProgressCounter.ptr()) {
+		// Add what has changed since the last update. The download counts as its expected size until its real size is known:
+		const size_t download_done = (size_t)progress.downloadBytesNow;
+		size_t download_total = progress.downloadBytesTotal > 0 ? (size_t)progress.downloadBytesTotal : m_expectedSize;
+		if (download_total < download_done)
+			download_total = download_done;
+		const size_t upload_done = (size_t)progress.uploadBytesNow;
+		const size_t upload_total = (size_t)progress.uploadBytesTotal > upload_done ? (size_t)progress.uploadBytesTotal : upload_done;
+		p_counter->Add(download_total - m_countedDownloadTotal, download_done - m_countedDownloadDone, upload_total - m_countedUploadTotal, upload_done - m_countedUploadDone);
+		m_countedDownloadTotal = download_total;
+		m_countedDownloadDone = download_done;
+		m_countedUploadTotal = upload_total;
+		m_countedUploadDone = upload_done;
+	}
+}
+
+void HttpRequest::SetExpectedSize(size_t bytes) {
+	if (m_pProgressCounter && (m_status == BUILDING || m_status == PENDING) && !m_countedDownloadDone) {
+		m_pProgressCounter->Add(bytes - m_countedDownloadTotal, 0, 0, 0);
+		m_countedDownloadTotal = bytes;
+	}
+	m_expectedSize = bytes;
+}
+
+// Whether the Content-Type value (e.g. "text/html; charset=utf-8") is one of types (e.g. "image/*, text/html"):
+static bool HttpRequest_ContentTypeMatches(const char* pValue, const string& types) {
+	while (*pValue == ' ')
+		pValue++;
+	size_t length = 0;
+	while (pValue[length] && pValue[length] != ';' && pValue[length] != ' ')
+		length++;
+	for (size_t pos = 0; pos < types.size();) {
+		size_t end = types.find(',', pos);
+		if (end == string::npos)
+			end = types.size();
+		size_t start = pos;
+		while (start < end && types[start] == ' ')
+			start++;
+		size_t type_end = end;
+		while (type_end > start && types[type_end - 1] == ' ')
+			type_end--;
+		pos = end + 1;
+		size_t type_length = type_end - start;
+		const bool wildcard = type_length >= 2 && types.compare(type_end - 2, 2, "/*") == 0;
+		if (wildcard)
+			type_length--; // "image/*" matches anything starting "image/"
+		if (wildcard ? length < type_length : length != type_length)
+			continue;
+		size_t i = 0;
+		while (i < type_length && tolower(pValue[i]) == tolower(types[start + i]))
+			i++;
+		if (i == type_length)
+			return true;
+	}
+	return false;
+}
+
+HttpRequest::Rejection HttpRequest::Worker_CheckResponse(const HttpHeaders& headers, int httpStatusCode) {
+	Rejection rejection = REJECTED_NONE;
+	if (httpStatusCode >= 400) {
+		// (The other limits are for the body that was asked for: an error response is up to the retries)
+		if (m_skipErrorBodies)
+			rejection = REJECTED_STATUS;
+	} else if (httpStatusCode / 100 == 2) {
+		const char* p_length = headers.Find("Content-Length");
+		const char* p_type = headers.Find("Content-Type");
+		if (m_maxResponseSize && m_method != HEAD && p_length && strtoull(p_length, nullptr, 10) > m_maxResponseSize)
+			rejection = REJECTED_SIZE;
+		else if (!m_acceptedContentTypes.empty() && !(p_type && HttpRequest_ContentTypeMatches(p_type, m_acceptedContentTypes)))
+			rejection = REJECTED_CONTENT_TYPE;
+	}
+	if (rejection == REJECTED_NONE && !Worker_AcceptResponse(headers, httpStatusCode))
+		rejection = REJECTED_BY_REQUEST;
+	m_rejection = rejection;
+	return rejection;
+}
+
+bool HttpRequest::Worker_CheckSize(size_t size) {
+	// (A compressed response's Content-Length is what's on the wire, so this counts what it decodes to)
+	if (!m_maxResponseSize || m_downloadBytesDecoded + size <= m_maxResponseSize)
+		return true;
+	m_rejection = REJECTED_SIZE;
+	return false;
+}
+
+bool HttpRequest::Worker_OpenSink(const HttpHeaders& headers, int httpStatusCode) {
+	m_sinkOpen = false;
+	if (!m_pSink || httpStatusCode / 100 != 2 || m_method == HEAD)
+		return true; // (An error page isn't the body that the sink is for)
+	const char* p_length = headers.Find("Content-Length");
+	int64 size = p_length ? strtoll(p_length, nullptr, 10) : -1;
+	if (headers.Find("Content-Encoding"))
+		size = -1; // That's the compressed length; curl decodes the body
+	if (!m_pSink->Worker_Begin(headers, size))
+		return false;
+	m_sinkOpen = true;
+	return true;
+}
+
+bool HttpRequest::Worker_CloseSink(bool success) {
+	if (!m_sinkOpen)
+		return true;
+	m_sinkOpen = false;
+	return m_pSink->Worker_End(success) || !success;
+}
+
+void HttpRequest::SetProgressCounter(Ptr<HttpProgressCounter> pCounter) {
+	IwAssert(HTTP_CLIENT, (m_status == BUILDING || m_status == PENDING) && !m_pScheduler && !m_pProgressCounter);
+	m_pProgressCounter = pCounter;
+	if (pCounter) {
+		pCounter->AddItem();
+		pCounter->Add(m_expectedSize, 0, 0, 0);
+		m_countedDownloadTotal = m_expectedSize;
+	}
+}
+
+void HttpRequest::FinishProgressCounter() {
+	if (!m_pProgressCounter || m_countedFinished)
+		return;
+	m_countedFinished = true;
+	if (m_status == DONE) {
+		// All of it has arrived (whether or not the worker's last progress update said so):
+		m_pProgressCounter->Add(0, m_countedDownloadTotal - m_countedDownloadDone, 0, m_countedUploadTotal - m_countedUploadDone);
+		m_countedDownloadDone = m_countedDownloadTotal;
+		m_countedUploadDone = m_countedUploadTotal;
+	} else {
+		// The rest never will:
+		m_pProgressCounter->Add(m_countedDownloadDone - m_countedDownloadTotal, 0, m_countedUploadDone - m_countedUploadTotal, 0);
+		m_countedDownloadTotal = m_countedDownloadDone;
+		m_countedUploadTotal = m_countedUploadDone;
+	}
+	m_pProgressCounter->ItemDone();
+}
+
+size_t HttpRequest::EstimateMemory(int64 contentLength) const {
+	const size_t body = m_method == HEAD ? 0 : contentLength >= 0 ? (size_t)contentLength : m_expectedSize ? m_expectedSize : m_sizeHint;
+	return 4 * 1024 + body; // (About what the headers, ours and the response's, take)
+}
+
+void HttpRequest::HandleRequeue() {
+	IwAssert(HTTP_CLIENT, m_status == SENDING || m_status == HEADERS);
+	m_status = PENDING;
+	m_responseHeaders.Clear();
+	m_uploadBytesNow = m_uploadBytesTotal = m_downloadBytesNow = m_downloadBytesTotal = m_downloadBytesDecoded = 0;
+	m_timings = Timings();
+	if (m_pProgressCounter) {
+		// The next attempt starts again from nothing:
+		m_pProgressCounter->Add(0, 0 - m_countedDownloadDone, 0, 0 - m_countedUploadDone);
+		m_countedDownloadDone = m_countedUploadDone = 0;
+	}
+}
+
+void HttpRequest::Reset() {
+	IwAssert(HTTP_CLIENT, m_status == BUILDING || m_status == DONE || m_status == ERROR || m_status == CANCELLED);
+	IwAssert(HTTP_CLIENT, m_pScheduler == nullptr && m_pCallback == nullptr && !m_callbackDelegate && m_followers.empty());
+	IwAssert(HTTP_CLIENT, m_pWaitingClient == nullptr && m_dependents.empty());
+	m_status = BUILDING;
+	m_requestHeaders.Clear();
+	m_responseHeaders.Clear();
+	m_pDefaultHeaders = nullptr;
+	m_priority = PRIORITY_NORMAL;
+	m_useCache = true;
+	m_fromCache = false;
+	m_coalesce = true;
+	m_compression = COMPRESSION_CLIENT_DEFAULT;
+	m_expectContinue = EXPECT_CONTINUE_DEFAULT;
+	m_timings = Timings();
+	m_queuedMs = 0;
+	m_traceId = 0;
+	m_maxRetries = -1;
+	m_numRetries = 0;
+	m_numFailovers = 0;
+	m_maxRecvSpeed = m_maxSendSpeed = 0;
+	m_maxUnconsumed = 0;
+	m_expectedSize = 0;
+	m_sizeHint = 0;
+	m_maxResponseSize = 0;
+	m_acceptedContentTypes.clear();
+	m_skipErrorBodies = false;
+	m_rejection = REJECTED_NONE;
+	m_pSink = nullptr;
+	m_configOverrides = HttpClientConfig::Overrides();
+	m_notBeforeMs = 0;
+	m_deadlineMs = 0;
+	m_expired = false;
+	m_failedFast = false;
+	m_dependencies.clear();
+	m_bind.clear();
+	m_numWaitingFor = 0;
+	m_abortRequested = false;
+	m_aborted = false;
+	m_hedge = m_hedged = false;
+	m_hedgeOwner = 0;
+	m_uploadBytesNow = m_uploadBytesTotal = m_downloadBytesNow = m_downloadBytesTotal = m_downloadBytesDecoded = 0;
+	m_pProgressCounter = nullptr;
+	m_countedDownloadTotal = m_countedDownloadDone = m_countedUploadTotal = m_countedUploadDone = 0;
+	m_countedFinished = false;
+#ifdef HTTP_ALLOC_STATS
+	HttpAllocStats::Reset(m_allocStats);
+#endif
+}
+
+string HttpRequest::GetCoalesceKey() const {
+	if (!m_coalesce || (m_method != GET && m_method != HEAD))
+		return string();
+	string key(GetMethodStr());
+	key.append(1, ' ').append(m_url);
+	for (size_t i = 0; i < m_requestHeaders.Size(); i++)
+		key.append(1, '\n').append(m_requestHeaders.GetLine(i));
+	if (m_pDefaultHeaders) {
+		// Requests sent with different defaults (e.g. another user's Authorization) must not share a response:
+		char version[32];
+		snprintf(version, sizeof(version), "\n(defaults %u)", m_pDefaultHeaders->GetVersion());
+		key.append(version);
+	}
+	if (m_compression != COMPRESSION_CLIENT_DEFAULT)
+		key.append(m_compression == COMPRESSION_ACCEPT ? "\n(compressed)" : "\n(uncompressed)");
+	return key;
+}
+
+const char* HttpRequest::FindRequestHeader(const char* name) const {
+	return FindRequestHeader(name, strlen(name));
+}
+
+const char* HttpRequest::FindRequestHeader(const char* name, size_t nameLength) const {
+	if (const char* p_value = m_requestHeaders.Find(name, nameLength))
+		return p_value;
+	return m_pDefaultHeaders ? m_pDefaultHeaders->GetHeaders().Find(name, nameLength) : nullptr;
+}
+
+bool HttpRequest::HeaderNameEquals(const string& name, const char* header) {
+	size_t i = 0;
+	while (i < name.size() && header[i] && tolower(name[i]) == tolower(header[i]))
+		i++;
+	return i == name.size() && !header[i];
+}
+
+// How UrlEncode() treats each byte: 0 = escape, 1 = keep, 2 = keep unless strict, 3 = '+' unless strict (a space)
+static const unsigned char HTTP_REQUEST_URL_CHARS[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	// Bytes 0x80 and up (UTF-8 sequences) are always escaped
+};
+static const char HTTP_REQUEST_HEX_DIGITS[] = "0123456789abcdef";
+
+void HttpRequest::UrlEncode(const char* pValue, size_t length, string& out, bool strict) {
 	// strict=true is better for POST data that is URL-encoded (application/x-www-form-urlencoded)
 	// strict=false is better for URL-encoding data to put in an actual URL.
-    ostringstream escaped;
-    escaped.fill('0');
-    escaped << std::hex;
-	for (auto i = value.begin(); i != value.end(); i++) {
-		const char c = (*i);
-		if (isalnum(c)) {
-			escaped << c;
-		} else if ((c == '-' || c == '_' || c == '.') && !strict) {
-			escaped << c;
-		} else if (c == ' ' && !strict)  {
-			escaped << '+';
+	const unsigned char* p_value = (const unsigned char*)pValue;
+	const unsigned char keep_below = strict ? 2 : 4; // Table values below this aren't escaped
+	// Measure first, so that the output grows at most once:
+	size_t encoded_length = length;
+	for (size_t i = 0; i < length; i++) {
+		const unsigned char c = HTTP_REQUEST_URL_CHARS[p_value[i]];
+		if (c == 0 || c >= keep_below)
+			encoded_length += 2;
+	}
+	size_t pos = out.size();
+	out.resize(pos + encoded_length);
+	char* p_out = &out[0];
+	for (size_t i = 0; i < length; i++) {
+		const unsigned char byte = p_value[i];
+		const unsigned char c = HTTP_REQUEST_URL_CHARS[byte];
+		if (c != 0 && c < keep_below) {
+			p_out[pos++] = c == 3 ? '+' : (char)byte;
+		} else {
+			p_out[pos++] = '%';
+			p_out[pos++] = HTTP_REQUEST_HEX_DIGITS[byte >> 4];
+			p_out[pos++] = HTTP_REQUEST_HEX_DIGITS[byte & 15];
+		}
+	}
+}
+
+string HttpRequest::UrlEncode(const string& value, bool strict) {
+	string escaped;
+	UrlEncode(value.data(), value.size(), escaped, strict);
+	return escaped;
+}
+
+static int HttpRequest_HexValue(char c) {
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+bool HttpRequest::UrlDecode(const char* pValue, size_t length, string& out) {
+	// '+' is a space, as in application/x-www-form-urlencoded data (and what UrlEncode(strict=false) writes)
+	bool valid = true;
+	out.reserve(out.size() + length); // Decoding never makes it longer
+	for (size_t i = 0; i < length; i++) {
+		const char c = pValue[i];
+		if (c == '+') {
+			out.append(1, ' ');
+		} else if (c == '%' && i + 2 < length && HttpRequest_HexValue(pValue[i + 1]) >= 0 && HttpRequest_HexValue(pValue[i + 2]) >= 0) {
+			out.append(1, (char)(HttpRequest_HexValue(pValue[i + 1]) * 16 + HttpRequest_HexValue(pValue[i + 2])));
+			i += 2;
 		} else {
-			escaped << '%' << std::setw(2) << ((int) c) << std::setw(0);
+			valid = valid && c != '%';
+			out.append(1, c); // (A stray '%' is kept as it is)
 		}
 	}
-    return escaped.str();
+	return valid;
+}
+
+string HttpRequest::UrlDecode(const string& value) {
+	string decoded;
+	UrlDecode(value.data(), value.size(), decoded);
+	return decoded;
+}
+
+void HttpRequest::AppendQueryParam(string& query, const string& key, const string& value, bool strict) {
+	query.reserve(query.size() + 2 + key.size() + value.size()); // (More if anything needs escaping)
+	if (!query.empty())
+		query.append(1, '&');
+	UrlEncode(key.data(), key.size(), query, strict);
+	query.append(1, '=');
+	UrlEncode(value.data(), value.size(), query, strict);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // HttpDownload:
 
+// Our file, as the disk writer sees it (see SetDiskWriter()). Its Writer_ methods run on the writer's thread, after
+// the worker has handed over everything they use:
+class HttpDownload::DiskStream : public HttpDiskWriter::Stream {
+public:
+	DiskStream(HttpDownload* pOwner) : m_pOwner(pOwner) {}
+	virtual bool Writer_Open() { return m_pOwner->Worker_OpenTmpFile(); }
+	virtual bool Writer_Write(const char* pData, size_t size) { return s3eFileWrite(pData, 1, size, m_pOwner->m_pTmpFile) == size; }
+	virtual void Writer_Close(bool failed) {
+		HttpDownload& download = *m_pOwner;
+		const bool wrote_tmp = download.m_pTmpFile != nullptr;
+		if (failed)
+			download.m_writeFailed = true;
+		bool success = download.m_finishSuccess && !download.m_writeFailed;
+		if (wrote_tmp)
+			success = download.Worker_CloseTmpFile(success);
+		download.Worker_FinishTmpFile(success, download.m_finishStatus, wrote_tmp);
+	}
+	virtual void HandleWritten(bool abandoned) { m_pOwner->FinishWrite(abandoned); }
+private:
+	HttpDownload* const m_pOwner;
+};
+
 HttpDownload::HttpDownload(const string& url, const string& destFile) :
 	HttpRequest(GET, url.c_str()),
 	m_destFile(destFile),
-	m_pTmpFile(nullptr)
+	m_pTmpFile(nullptr),
+	m_resumable(false),
+	m_resumeFrom(0),
+	m_appendToTmp(false),
+	m_discardData(false),
+	m_discardTmp(false),
+	m_contentLength(-1),
+	m_writeBufferSize(256 * 1024),
+	m_preallocate(false),
+	m_pWriteBuffer(nullptr),
+	m_writeBufferUsed(0),
+	m_writeFailed(false),
+	m_pDiskWriter(nullptr),
+	m_pDiskStream(nullptr),
+	m_finishSuccess(false),
+	m_finishStatus(0),
+	m_responseSuccess(false),
+	m_responseStatus(0),
+	m_expectedType(HttpDigest::DIGEST_NONE),
+	m_etagIsDigest(false),
+	m_digestType(HttpDigest::DIGEST_NONE),
+	m_digestChecked(false),
+	m_digestMismatch(false)
 {
-	string download_folder = DirName(m_destFile);
-	if (!IsDir(download_folder))
-		MakePath(download_folder);
 	m_status = PENDING;
 }
 
-HttpDownload::~HttpDownload() {}
+HttpDownload& HttpDownload::SetExpectedDigest(HttpDigest::Type type, const string& hexDigest) {
+	if (!HttpDigest::ParseHex(hexDigest.data(), hexDigest.size(), m_expectedDigest, HttpDigest::GetSize(type)))
+		throw std::runtime_error(string("HttpDownload: Not a digest of that type: ").append(hexDigest));
+	m_expectedType = type;
+	return *this;
+}
+
+HttpDownload::~HttpDownload() {
+	if (m_pDiskStream) {
+		HttpDiskWriter::WaitFor(*m_pDiskStream); // (If we were dropped before the writer had finished the file)
+		delete m_pDiskStream;
+	}
+}
+
+HttpDownload& HttpDownload::SetDiskWriter(HttpDiskWriter* pWriter) {
+	IwAssert(HTTP_CLIENT, m_status == PENDING && !m_pSelf);
+	if (pWriter && !m_pDiskStream)
+		m_pDiskStream = new DiskStream(this);
+	m_pDiskWriter = pWriter;
+	return *this;
+}
+
+void HttpDownload::HandleRequestStart() {
+	if (m_pDiskStream)
+		HttpDiskWriter::WaitFor(*m_pDiskStream); // The last attempt's file must be finished before we look at it
+	// This is called before every attempt, so work out from scratch whether we can resume:
+	m_resumeFrom = 0;
+	m_appendToTmp = m_discardData = m_discardTmp = m_writeFailed = false;
+	m_digestChecked = m_digestMismatch = false;
+	const string tmp_file = string(m_destFile).append(".tmp");
+	const string validator_file = string(tmp_file).append(".validator");
+	string validator;
+	if (m_resumable && IsFile(tmp_file) && IsFile(validator_file)) {
+		validator = ReadFileToString(validator_file);
+		if (!validator.empty())
+			m_resumeFrom = s3eFileGetFileInt(tmp_file.c_str(), S3E_FILE_SIZE);
+	}
+	if (m_resumeFrom > 0) {
+		char range[40];
+		snprintf(range, sizeof(range), "bytes=%lld-", (long long)m_resumeFrom);
+		SetAttemptHeader("Range", range);
+		SetAttemptHeader("If-Range", validator);
+	} else {
+		m_resumeFrom = 0;
+		SetAttemptHeader("Range", "");
+		SetAttemptHeader("If-Range", "");
+	}
+	HttpRequest::HandleRequestStart();
+}
+
+void HttpDownload::Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+	const char* p_length = headers.Find("Content-Length");
+	m_contentLength = p_length ? strtoll(p_length, nullptr, 10) : -1;
+	if (headers.Find("Content-Encoding"))
+		m_contentLength = -1; // That's the compressed length; the file will be bigger
+	m_appendToTmp = false;
+	m_discardData = httpStatusCode != 200 && httpStatusCode != 206;
+	if (httpStatusCode == 206) {
+		// Make sure that this really continues our partial file: "Content-Range: bytes <start>-<end>/<size>"
+		const char* p_range = headers.Find("Content-Range");
+		long long start = -1;
+		if (m_resumeFrom > 0 && p_range && sscanf(p_range, "bytes %lld-", &start) == 1 && start == m_resumeFrom) {
+			m_appendToTmp = true;
+		} else {
+			m_discardData = true;
+			m_discardTmp = true;
+		}
+	} else if (httpStatusCode == 416) {
+		m_discardTmp = true; // Range Not Satisfiable: the partial file is no use to us
+	} else if (httpStatusCode == 200 && m_resumable) {
+		// We're getting the whole file, so the partial file will be overwritten. Remember which version
+		// of the file this is, so that we can resume it if this attempt fails too. Weak ETags
+		// aren't allowed in If-Range.
+		const string validator_file = string(m_destFile).append(".tmp.validator");
+		const char* p_etag = headers.Find("ETag");
+		const char* p_validator = p_etag && strncmp(p_etag, "W/", 2) != 0 ? p_etag : headers.Find("Last-Modified");
+		if (p_validator && *p_validator && Worker_MakeDestFolder()) {
+			if (s3eFile* p_file = s3eFileOpen(validator_file.c_str(), "w")) {
+				s3eFileWrite(p_validator, 1, strlen(p_validator), p_file);
+				s3eFileClose(p_file);
+			}
+		} else if (IsFile(validator_file)) {
+			s3eFileDelete(validator_file.c_str()); // The server gave us nothing to resume this version with
+		}
+	}
+	if (!m_discardData)
+		Worker_BeginDigest(headers, httpStatusCode);
+}
+
+void HttpDownload::Worker_BeginDigest(const HttpHeaders& headers, int httpStatusCode) {
+	// Which digest to check the file against: the app's, or else one that the server has given us. (A compressed
+	// response's Content-MD5 and ETag are of what was sent, not of the file, and a 206's Content-MD5 is of the part.)
+	m_digestType = m_expectedType;
+	if (m_digestType != HttpDigest::DIGEST_NONE) {
+		memcpy(m_digestWanted, m_expectedDigest, sizeof(m_digestWanted));
+	} else if (!headers.Find("Content-Encoding")) {
+		const char* p_md5 = headers.Find("Content-MD5");
+		const char* p_etag = m_etagIsDigest ? headers.Find("ETag") : nullptr;
+		if (p_md5 && httpStatusCode == 200 && HttpDigest::ParseBase64(p_md5, strlen(p_md5), m_digestWanted, HttpDigest::GetSize(HttpDigest::DIGEST_MD5)))
+			m_digestType = HttpDigest::DIGEST_MD5;
+		else if (p_etag && *p_etag == '"' && HttpDigest::ParseHex(p_etag + 1, strcspn(p_etag + 1, "\""), m_digestWanted, HttpDigest::GetSize(HttpDigest::DIGEST_MD5)))
+			m_digestType = HttpDigest::DIGEST_MD5; // (A weak ETag starts with W/, and a multipart upload's has a "-<parts>" suffix)
+	}
+	if (m_digestType == HttpDigest::DIGEST_NONE)
+		return;
+	if (!m_digest.Begin(m_digestType)) {
+		m_digestType = HttpDigest::DIGEST_NONE;
+		return;
+	}
+	if (m_appendToTmp) {
+		// The digest is of the whole file, so it starts with the part that we already have:
+		bool read_all = false;
+		if (s3eFile* p_file = s3eFileOpen(string(m_destFile).append(".tmp").c_str(), "rb")) {
+			char buffer[16 * 1024];
+			int64 left = m_resumeFrom;
+			while (left > 0) {
+				const size_t size = (size_t)(left < (int64)sizeof(buffer) ? left : (int64)sizeof(buffer));
+				if (s3eFileRead(buffer, 1, size, p_file) != size)
+					break;
+				m_digest.Update(buffer, size);
+				left -= size;
+			}
+			read_all = left == 0;
+			s3eFileClose(p_file);
+		}
+		if (!read_all) {
+			// We can't vouch for the partial file, so this attempt fails, and the next one starts over:
+			m_digest.Abandon();
+			m_digestType = HttpDigest::DIGEST_NONE;
+			m_digestMismatch = true;
+			m_discardData = m_discardTmp = true;
+		}
+	}
+}
 
 size_t HttpDownload::Worker_HandleData(const unsigned char* contents, size_t size) {
-	if (!m_pTmpFile) {
-		m_pTmpFile = s3eFileOpen(string(m_destFile).append(".tmp").c_str(), "w");
-		if (m_pTmpFile == nullptr)
-			throw std::runtime_error("Unable to open file for downloading!");
+	if (m_discardData)
+		return size;
+	m_digest.Update(contents, size); // (If there is one)
+	if (!m_pTmpFile && !m_pDiskWriter && !Worker_OpenTmpFile()) { // (The disk writer opens it itself)
+		m_writeFailed = true;
+		return 0; // Abort the transfer
+	}
+	if (size >= m_writeBufferSize) {
+		// Too big to be worth buffering:
+		if (!FlushWriteBuffer() || !Worker_WriteOut(contents, size)) {
+			m_writeFailed = true;
+			return 0; // Abort the transfer
+		}
+		return size;
 	}
-	if (m_pTmpFile)
-		s3eFileWrite(contents, 1, size, m_pTmpFile);
+	if (!m_pWriteBuffer)
+		m_pWriteBuffer = new char[m_writeBufferSize];
+	if (m_writeBufferUsed + size > m_writeBufferSize && !FlushWriteBuffer()) {
+		m_writeFailed = true;
+		return 0;
+	}
+	memcpy(m_pWriteBuffer + m_writeBufferUsed, contents, size);
+	m_writeBufferUsed += size;
 	return size;
 }
 
+bool HttpDownload::Worker_IsBackedUp() const {
+	return m_pDiskWriter && !m_discardData && m_pDiskWriter->Worker_IsFull();
+}
+
+bool HttpDownload::Worker_OpenTmpFile() {
+	if (Worker_MakeDestFolder())
+		m_pTmpFile = s3eFileOpen(string(m_destFile).append(".tmp").c_str(), m_appendToTmp ? "a" : "w");
+	if (m_pTmpFile == nullptr)
+		return false;
+	if (m_preallocate && !m_resumable && !m_appendToTmp && m_contentLength > 1) {
+		// Grow the file to its final size now, then go back and fill it in:
+		const char zero = 0;
+		if (s3eFileSeek(m_pTmpFile, (int32)(m_contentLength - 1), S3E_FILESEEK_SET) == S3E_RESULT_SUCCESS)
+			s3eFileWrite(&zero, 1, 1, m_pTmpFile);
+		s3eFileSeek(m_pTmpFile, 0, S3E_FILESEEK_SET);
+	}
+	return true;
+}
+
+bool HttpDownload::Worker_MakeDestFolder() {
+	// (MakePath() remembers the folders it has made, so this only costs stats for the first download into each)
+	try {
+		MakePath(DirName(m_destFile));
+		return true;
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpDownload: %s", e.what());
+		return false;
+	}
+}
+
+bool HttpDownload::FlushWriteBuffer() {
+	const size_t used = m_writeBufferUsed;
+	m_writeBufferUsed = 0;
+	return used == 0 || Worker_WriteOut(m_pWriteBuffer, used);
+}
+
+bool HttpDownload::Worker_WriteOut(const void* pData, size_t size) {
+	if (m_pDiskWriter)
+		return m_pDiskWriter->Worker_Write(*m_pDiskStream, pData, size); // (Which copies it)
+	return s3eFileWrite(pData, 1, size, m_pTmpFile) == size;
+}
+
+void HttpDownload::HandleResponse(bool success, int httpStatusCode) {
+	m_responseSuccess = success;
+	m_responseStatus = httpStatusCode;
+	if (m_pDiskWriter && m_pDiskStream->IsBusy()) {
+		// Our status stays HEADERS until the writer has finished the file, so our callback won't be called yet:
+		m_pSelf = this;
+		m_pDiskWriter->Watch(*m_pDiskStream);
+		return;
+	}
+	if (m_writeFailed)
+		s3eDebugTracePrintf("HttpDownload: Unable to write %s.tmp", m_destFile.c_str());
+	if (m_digestMismatch)
+		s3eDebugTracePrintf("HttpDownload: %s from %s isn't the file expected; it has been deleted", m_destFile.c_str(), m_url.c_str());
+	HttpRequest::HandleResponse(success && !m_writeFailed && !m_digestMismatch, httpStatusCode);
+}
+
+void HttpDownload::FinishWrite(bool abandoned) {
+	Ptr<HttpDownload> p_this = m_pSelf; // We may be deleted once this goes out of scope
+	m_pSelf = nullptr;
+	if (abandoned) {
+		s3eDebugTracePrintf("HttpDownload: The disk writer was destroyed before %s was finished", m_destFile.c_str());
+		m_status = ERROR;
+		return;
+	}
+	HandleResponse(m_responseSuccess, m_responseStatus);
+	NotifyDone();
+}
+
 void HttpDownload::Worker_HandleDone(bool success, int httpStatusCode) {
-	if (m_pTmpFile) {
-		s3eFileClose(m_pTmpFile);
-		m_pTmpFile = nullptr;
-		if (success && httpStatusCode == 200)
-			s3eFileRename(string(m_destFile).append(".tmp").c_str(), m_destFile.c_str());
-		else
-			s3eFileDelete(string(m_destFile).append(".tmp").c_str());
+	const bool wrote_tmp = m_pTmpFile != nullptr;
+	if (m_pDiskWriter) {
+		if (!FlushWriteBuffer())
+			m_writeFailed = true;
+		success = success && !m_writeFailed;
+	} else if (m_pTmpFile) {
+		// Even if the transfer failed, what we have may be worth keeping (see SetResumable()):
+		if (!FlushWriteBuffer())
+			m_writeFailed = true;
+		success = Worker_CloseTmpFile(success);
+	}
+	delete[] m_pWriteBuffer; // Allocated in this memory environment by Worker_HandleData()
+	m_pWriteBuffer = nullptr;
+	Worker_FinishDigest(success); // (The data has all been hashed, even if the writer hasn't written it yet)
+	if (m_pDiskWriter) {
+		// The writer closes the file and puts it in its place (see DiskStream::Writer_Close()), once it has written
+		// the rest of it:
+		m_finishSuccess = success;
+		m_finishStatus = httpStatusCode;
+		m_pDiskWriter->Worker_Close(*m_pDiskStream);
+	} else {
+		Worker_FinishTmpFile(success, httpStatusCode, wrote_tmp);
 	}
 	HttpRequest::Worker_HandleDone(success, httpStatusCode);
 }
 
+bool HttpDownload::Worker_CloseTmpFile(bool success) {
+	if (m_writeFailed)
+		m_discardTmp = true; // We can't tell how much of the data made it to the file
+	s3eFileClose(m_pTmpFile);
+	m_pTmpFile = nullptr;
+	return success && !m_writeFailed;
+}
+
+void HttpDownload::Worker_FinishDigest(bool& success) {
+	if (!m_digest.IsActive())
+		return;
+	if (success && !m_discardData) {
+		const size_t size = m_digest.Finish(m_digestResult);
+		m_digestChecked = true;
+		if (memcmp(m_digestResult, m_digestWanted, size) != 0) {
+			m_digestMismatch = true;
+			m_discardTmp = true; // Resuming it wouldn't make it right
+			success = false;
+		}
+	} else {
+		m_digest.Abandon(); // The next attempt starts again
+	}
+}
+
+void HttpDownload::Worker_FinishTmpFile(bool success, int httpStatusCode, bool wroteTmp) {
+	const string tmp_file = string(m_destFile).append(".tmp");
+	if (success && !m_discardData && (httpStatusCode == 200 || httpStatusCode == 206)) {
+		if (wroteTmp)
+			s3eFileRename(tmp_file.c_str(), m_destFile.c_str());
+		if (m_resumable)
+			s3eFileDelete(string(tmp_file).append(".validator").c_str());
+	} else if (m_resumable && !m_discardTmp) {
+		// Keep whatever we have so far; the next attempt will ask for the rest.
+	} else if (wroteTmp || m_discardTmp) {
+		s3eFileDelete(tmp_file.c_str());
+		if (m_resumable)
+			s3eFileDelete(string(tmp_file).append(".validator").c_str());
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // HttpPost:
 
-HttpPost::HttpPost(const std::string& url)
-	: HttpRequest(POST, url.c_str()), m_bytesUploaded(0), m_workerResponseSize(0), m_workerResponseBuffer(NULL)
+HttpPost::HttpPost(const std::string& url) : HttpPost(POST, url) {}
+
+HttpPost::HttpPost(Method method, const std::string& url)
+	: HttpRequest(method, url.c_str()), m_pBody(nullptr), m_bodySize(0), m_compileOnWorker(false), m_workerBodyFailed(false), m_bytesUploaded(0), m_cacheable(false), m_compressBody(false), m_responseBody(true), m_responseAsTape(false), m_pJsonCache(nullptr), m_jsonReused(false)
 {
-	SetHeader("Content-Type", "application/x-www-form-urlencoded");
+	IwAssert(HTTP_CLIENT, method == POST || method == GET);
+	if (method == POST)
+		SetHeader("Content-Type", "application/x-www-form-urlencoded");
+}
+
+void HttpPost::Reset() {
+	HttpRequest::Reset();
+	if (m_method == POST)
+		SetHeader("Content-Type", "application/x-www-form-urlencoded");
+	m_data.clear();
+	m_postData.clear(); // (Keeping its capacity)
+	m_pBodyOwner = nullptr;
+	m_pBody = nullptr;
+	m_bodySize = 0;
+	m_compileOnWorker = m_workerBodyFailed = false;
+	IwAssert(HTTP_CLIENT, m_workerBody.empty()); // (The worker has cleaned up)
+	m_bytesUploaded = 0;
+	m_cacheable = m_compressBody = m_responseAsTape = false;
+	m_responseData = json::UnknownElement();
+	m_responseTape.Clear();
+	m_pJsonCache = nullptr;
+	m_pJsonEntry = nullptr;
+	m_jsonETag.clear();
+	m_jsonReused = false;
+}
+
+HttpPost& HttpPost::SetBody(Ptr<IRefCounted> pOwner, const void* pData, size_t size, const char* contentType) {
+	IwAssert(HTTP_CLIENT, m_status == BUILDING && pOwner);
+	m_pBodyOwner = pOwner;
+	m_pBody = static_cast<const unsigned char*>(pData);
+	m_bodySize = size;
+	SetHeader("Content-Type", contentType);
+	return *this;
 }
 
 void HttpPost::CompileRequest() {
 	IwAssert(HTTP_CLIENT, m_postData.empty());
-	for (auto it = m_data.begin(); it != m_data.end(); it++) {
-		if (it != m_data.begin())
-			m_postData.append("&");
-		std::string key = UrlEncode(it->first);
-		std::string val = UrlEncode(it->second);
-		m_postData.append(key).append("=").append(val);
-	}
-	// Now m_postData should look like "name=bob&age=35&gender=M" ...
-	//Trace("Compiled request post body:%s", m_postData.c_str());
+	if (m_pBodyOwner) {
+		// The body is sent from where it is
+		if (m_compressBody)
+			CompressPostData();
+	} else if (m_compileOnWorker) {
+		// The worker writes the body out (see Worker_PrepareUpload())
+		if (m_compressBody)
+			SetHeader("Content-Encoding", "gzip");
+	} else {
+		WriteBody(m_postData);
+		if (m_compressBody)
+			CompressPostData();
+	}
 	HttpRequest::CompileRequest();
 }
 
+void HttpPost::WriteBody(string& body) const {
+	size_t length = 0;
+	for (auto it = m_data.begin(); it != m_data.end(); it++)
+		length += it->first.size() + it->second.size() + 2;
+	body.reserve(length); // Enough unless something needs escaping; UrlEncode() grows it at most once per field then
+	for (auto it = m_data.begin(); it != m_data.end(); it++)
+		AppendQueryParam(body, it->first, it->second);
+	// Now the body should look like "name=bob&age=35&gender=M" ...
+}
+
+bool HttpPost::Gzip(const unsigned char* pData, size_t size, string& compressed) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// windowBits 15 + 16 produces a gzip stream rather than a raw zlib one:
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+	compressed.resize(deflateBound(&stream, (uLong)size));
+	stream.next_in = (Bytef*)pData;
+	stream.avail_in = (uInt)size;
+	stream.next_out = (Bytef*)&compressed[0];
+	stream.avail_out = (uInt)compressed.size();
+	const int result = deflate(&stream, Z_FINISH); // deflateBound() guarantees that it all fits in one go
+	compressed.resize(stream.total_out);
+	deflateEnd(&stream);
+	return result == Z_STREAM_END;
+}
+
+void HttpPost::CompressPostData() {
+	const size_t size = GetBodySize();
+	if (size < 256)
+		return; // Not worth it: the gzip header and trailer alone are 18 bytes
+	string compressed;
+	if (!Gzip(GetBodyData(), size, compressed)) {
+		s3eDebugTracePrintf("HttpPost: Unable to compress the body; sending it uncompressed");
+		return;
+	}
+	if (compressed.size() >= size)
+		return;
+	m_postData.swap(compressed);
+	m_pBodyOwner = nullptr; // The compressed copy is sent instead of the body from SetBody(), if that was it
+	SetHeader("Content-Encoding", "gzip");
+}
+
+void HttpPost::Worker_PrepareUpload() {
+	if (!m_compileOnWorker || m_pBodyOwner || !m_workerBody.empty())
+		return; // (A retry sends the body that the first attempt wrote out)
+	m_workerBodyFailed = false;
+	WriteBody(m_workerBody);
+	if (m_compressBody) {
+		// CompileRequest() has already said that it is gzipped:
+		string compressed;
+		m_workerBodyFailed = !Gzip((const unsigned char*)m_workerBody.data(), m_workerBody.size(), compressed);
+		m_workerBody.swap(compressed);
+	}
+}
+
 size_t HttpPost::Worker_HandleUpload(const unsigned char* pData, size_t fillSize) {
-	size_t ncopy = MIN(m_postData.size() - m_bytesUploaded, fillSize);
-	memcpy((void*)pData, (void*)(m_postData.c_str() + m_bytesUploaded), ncopy);
+	if (m_workerBodyFailed)
+		return CURL_READFUNC_ABORT;
+	size_t ncopy = MIN(GetBodySize() - m_bytesUploaded, fillSize);
+	memcpy((void*)pData, (void*)(GetBodyData() + m_bytesUploaded), ncopy);
 	m_bytesUploaded += ncopy;
 	return ncopy;
 }
 
-size_t HttpPost::Worker_HandleData(const unsigned char* contents, size_t size) {
-	if (size > 0) {
-		m_workerResponseBuffer = (const char*)realloc((void*)m_workerResponseBuffer, m_workerResponseSize + size);
-		if (m_workerResponseBuffer) {
-			memcpy((void*)(m_workerResponseBuffer + m_workerResponseSize), (void*)contents, size);
-			m_workerResponseSize += size;
-		}
+string HttpPost::GetJsonCacheKey() const {
+	if (m_method == GET)
+		return string("GET ").append(m_url);
+	return m_cacheable && !m_compileOnWorker ? string("POST ").append(m_url).append(1, '\n').append((const char*)GetBodyData(), GetBodySize()) : string();
+}
+
+void HttpPost::HandleRequestStart() {
+	m_pJsonEntry = nullptr;
+	m_jsonReused = false;
+	if (m_pJsonCache && !m_responseAsTape) {
+		const string key = GetJsonCacheKey();
+		if (!key.empty())
+			m_pJsonEntry = m_pJsonCache->Find(key);
+		// (Only touching If-None-Match if we sent it before, in case it is the caller's own)
+		if (m_pJsonEntry || !m_jsonETag.empty())
+			SetAttemptHeader("If-None-Match", m_pJsonEntry ? m_pJsonEntry->etag : string());
 	}
+	m_jsonETag = m_pJsonEntry ? m_pJsonEntry->etag : string();
+	HttpRequest::HandleRequestStart();
+}
+
+void HttpPost::Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+	if (!m_jsonETag.empty()) {
+		// Not modified, or a cached response (see HttpClient::SetCache() and SetMemoryCache()) that we have parsed before:
+		const char* p_etag = headers.Find("ETag");
+		m_jsonReused = httpStatusCode == 304 || (httpStatusCode == 200 && p_etag && m_jsonETag == p_etag);
+		if (m_jsonReused)
+			return; // (The body is dropped, whatever its type)
+	}
+	// Compare the media type only, e.g. of "application/cbor; charset=binary":
+	const char* p_type = headers.Find("Content-Type");
+	if (!p_type)
+		return;
+	size_t length = 0;
+	while (p_type[length] && p_type[length] != ';' && p_type[length] != ' ')
+		length++;
+	if (HttpHeaders::CompareNames(p_type, length, json::Cbor::MEDIA_TYPE, sizeof(json::Cbor::MEDIA_TYPE) - 1) == 0)
+		m_responseBody.Worker_SetCbor();
+}
+
+size_t HttpPost::Worker_HandleData(const unsigned char* contents, size_t size) {
+	if (m_jsonReused)
+		return size; // We already have the document
+	// If the server told us the length of the response, allocate it all up front:
+	// Or, if it didn't, as much as the endpoint's responses have needed before:
+	if (m_responseBody.Empty() && (m_downloadBytesTotal > 0 || GetSizeHint()))
+		m_responseBody.Worker_Reserve(m_downloadBytesTotal > 0 ? (size_t)m_downloadBytesTotal : GetSizeHint());
+	if (!m_responseBody.Worker_Append(contents, size))
+		return 0; // Out of memory: abort the transfer
 	return size;
 }
 
 void HttpPost::HandleResponse(bool success, int httpStatusCode) {
 	HttpRequest::HandleResponse(success, httpStatusCode);
-	string response(m_workerResponseBuffer, m_workerResponseSize);
-	if (success) {
+	const char* response = m_responseBody.Data();
+	if (success && m_jsonReused) {
+		s3eDebugTracePrintf("API Request succeeded (%s %s), with the document we had", GetMethodStr(), m_url.c_str());
+		m_responseData = m_pJsonEntry->response; // (Shared until either is changed)
+		m_pJsonCache->CountReused();
+	} else if (success) {
 		s3eDebugTracePrintf("API Request succeeded (%s %s)", GetMethodStr(), m_url.c_str());
-		if (response.empty()) {
+		if (m_responseBody.Empty()) {
 			s3eDebugTracePrintf("Warning: Empty response body from API call.");
 			m_responseData = json::Null();
-		} else if (response[0] == '[' || response[0] == '{') {
-			// Parse the response as a JSON object or array:
-			try {
-				std::istringstream json_istream(response);
-				json::Reader::Read(m_responseData, json_istream);
-			} catch(const json::Exception &e) {
-				s3eDebugTracePrintf("Error: Unable to parse JSON response: %s", e.what());
+		} else if (m_responseBody.IsCbor() || response[0] == '[' || response[0] == '{') {
+			// The response is a JSON (or CBOR) object or array. The worker has already parsed it as it arrived:
+			if (m_responseAsTape && m_responseBody.AdoptJson(m_responseTape)) {
+				// Nothing left to do on this thread
+			} else if (!m_responseBody.ParseJson(m_responseData)) {
+				s3eDebugTracePrintf("Error: Unable to parse JSON response: %s", m_responseBody.GetJsonError());
 				m_status = ERROR;
 			}
 		} else {
-			m_responseData = json::String(response);
+			m_responseData = json::String(string(response, m_responseBody.Size()));
+		}
+		if (m_pJsonCache && !m_responseAsTape && httpStatusCode == 200) {
+			// Keep the document for next time, if the server has given us a way to ask whether it has changed:
+			const string key = GetJsonCacheKey();
+			const char* p_etag = GetResponseHeaders().Find("ETag");
+			const bool parsed = m_status == DONE && (m_responseData.IsOfType<json::Object>() || m_responseData.IsOfType<json::Array>());
+			if (!key.empty() && parsed && p_etag)
+				m_pJsonCache->Store(key, p_etag, m_responseData, m_responseBody.Size());
+			else if (!key.empty())
+				m_pJsonCache->Remove(key);
 		}
 		
 	} else {
+		m_jsonReused = false;
 		s3eDebugTracePrintf("Error with API call. Response code %d", httpStatusCode);
-		s3eDebugTraceLine(response.c_str());
+		s3eDebugTraceLine(response);
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 //HttpPostJson
 HttpPostJson::HttpPostJson(const std::string& url) :
-	HttpPost(url)
+	HttpPost(url), m_cbor(false), m_streamBody(false), m_pStreamWriter(nullptr)
 {
 	SetHeader("Content-Type", "application/json");
 }
 
+void HttpPostJson::Reset() {
+	HttpPost::Reset();
+	SetHeader("Content-Type", "application/json");
+	IwAssert(HTTP_CLIENT, !m_pStreamWriter); // (The worker has cleaned up)
+	m_postDataJson.Clear();
+	m_cbor = m_streamBody = false;
+}
+
+HttpPostJson& HttpPostJson::SetCbor(bool cbor) {
+	IwAssert(API_CLIENT, m_status == BUILDING);
+	m_cbor = cbor;
+	if (cbor) {
+		SetHeader("Content-Type", json::Cbor::MEDIA_TYPE);
+		SetHeader("Accept", string(json::Cbor::MEDIA_TYPE).append(", application/json;q=0.5")); // Servers that don't know CBOR can still answer
+	} else {
+		SetHeader("Content-Type", "application/json");
+		RemoveHeader("Accept");
+	}
+	return *this;
+}
+
 void HttpPostJson::CompileRequest() {
-	std::ostringstream str_stream;
-	json::Writer::Write(m_postDataJson, str_stream);
-	m_postData = str_stream.str();
-	
-	char size_as_string[40];
-	snprintf(size_as_string, sizeof(size_as_string), "%zu", m_postData.size()),
-	SetHeader("Content-Length", size_as_string);
-	HttpRequest::CompileRequest();
+	if (m_streamBody && !m_pBodyOwner) {
+		// The worker writes the body as it goes (see Worker_HandleUpload())
+		SetHeader("Content-Type", "application/json");
+		RemoveHeader("Accept");
+		HttpRequest::CompileRequest();
+		return;
+	}
+	HttpPost::CompileRequest();
+}
+
+void HttpPostJson::WriteBody(string& body) const {
+	// Serialize straight into the upload buffer, which Worker_HandleUpload() then reads from:
+	if (m_cbor) {
+		body.resize(json::CborWriter::MeasureSize(m_postDataJson));
+		json::CborWriter::Write(m_postDataJson, &body[0]);
+	} else {
+		body.resize(json::BufferWriter::MeasureSize(m_postDataJson));
+		json::BufferWriter::Write(m_postDataJson, &body[0]);
+	}
+}
+
+size_t HttpPostJson::Worker_HandleUpload(const unsigned char* pData, size_t fillSize) {
+	if (!m_streamBody || m_pBodyOwner)
+		return HttpPost::Worker_HandleUpload(pData, fillSize);
+	if (!m_bytesUploaded) {
+		// A new attempt starts the document over (in the worker memory environment, as the writer's stack grows here):
+		delete m_pStreamWriter;
+		m_pStreamWriter = new json::StreamWriter(m_postDataJson);
+	}
+	const size_t num_written = m_pStreamWriter->Write((char*)pData, fillSize);
+	m_bytesUploaded += num_written;
+	return num_written; // 0 at the end
+}
+
+void HttpPostJson::Worker_HandleCleanup() {
+	delete m_pStreamWriter;
+	m_pStreamWriter = nullptr;
+	HttpPost::Worker_HandleCleanup();
 }
@@ -7,23 +7,56 @@
 
 #pragma once
 
+#include <list>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <IwDebug.h>
 
-#include "util/Ptr.h"
+#include "util/ptr.h"
 #include "util/json.h"
+#include "HttpAllocStats.h"
+#include "HttpClientConfig.h"
+#include "HttpHeaderTemplate.h"
+#include "HttpDigest.h"
+#include "HttpHeaders.h"
+#include "HttpJsonCache.h"
+#include "HttpProgressCounter.h"
+#include "HttpResponseBody.h"
+#include "HttpSink.h"
+#include "HttpSlab.h"
+#include "HttpTimerWheel.h"
+#include "util/FastDelegate.h"
+#include "HttpUrl.h"
 
 struct s3eFile;
+class HttpRequest;
+class HttpClient;
+class HttpScheduler;
+class HttpDiskWriter;
+struct HttpScheduler_Host;
+
+// Base callback type, used to notify the requestee when an HTTP request has
+// either finished or failed. See HttpClient.h for the implementations.
+class HttpCallbackBase : public IRefCounted {
+public:
+	HttpCallbackBase() {}
+	virtual void Call(Ptr<HttpRequest> pRequest)=0;
+	// These are created with every request, so they come from HttpSlab's free lists:
+	static void* operator new(size_t size) { return HttpSlab::Alloc(size); }
+	static void operator delete(void* p, size_t size) { HttpSlab::Free(p, size); }
+};
 
 class HttpRequest : public IRefCounted {
 public:
+	typedef fastdelegate::FastDelegate1< Ptr<HttpRequest> > CallbackDelegate;
 	enum Method {
 		GET,
 		POST,
 		HEAD,
-		PUT
+		PUT,
+		DELETE // Without a body
 	};
 	
 	enum Status {
@@ -36,29 +69,272 @@ public:
 		CANCELLED // Request was cancelled before receiving any response
 	};
 	
-	HttpRequest(Method method, const char* url) : m_status(BUILDING), m_method(method), m_url(url) {}
+	// Requests with a higher priority are always sent first. Within the same
+	// priority level, requests are sent in the order they were queued.
+	enum Priority {
+		PRIORITY_BACKGROUND, // e.g. prefetching. May be preempted (see HttpClient::SetPreemption())
+		PRIORITY_LOW,        // May be preempted (see HttpClient::SetPreemption())
+		PRIORITY_NORMAL,     // The default
+		PRIORITY_HIGH,
+		PRIORITY_CRITICAL,   // e.g. user-visible API calls. Can preempt PRIORITY_LOW and PRIORITY_BACKGROUND transfers.
+		NUM_PRIORITIES
+	};
+	
+	HttpRequest(Method method, const char* url) : m_method(method), m_url(url), m_status(BUILDING), m_uploadBytesNow(0), m_uploadBytesTotal(0), m_downloadBytesNow(0), m_downloadBytesTotal(0), m_downloadBytesDecoded(0), m_progressVersion(0), m_countedDownloadTotal(0), m_countedDownloadDone(0), m_countedUploadTotal(0), m_countedUploadDone(0), m_countedFinished(false), m_abortRequested(false), m_aborted(false), m_priority(PRIORITY_NORMAL), m_useCache(true), m_fromCache(false), m_coalesce(true), m_compression(COMPRESSION_CLIENT_DEFAULT), m_expectContinue(EXPECT_CONTINUE_DEFAULT), m_queuedMs(0), m_traceId(0),
+		m_maxRetries(-1), m_numRetries(0), m_numFailovers(0), m_maxRecvSpeed(0), m_maxSendSpeed(0), m_maxUnconsumed(0), m_expectedSize(0), m_sizeHint(0), m_maxResponseSize(0), m_skipErrorBodies(false), m_rejection(REJECTED_NONE), m_configOverrides(HttpClientConfig::Overrides()), m_sinkOpen(false), m_callbackGuarded(false), m_pScheduler(nullptr), m_notBeforeMs(0), m_deadlineMs(0), m_expired(false), m_failedFast(false), m_pScheduleHost(nullptr), m_numWaitingFor(0), m_pWaitingClient(nullptr), m_hedge(false), m_hedged(false), m_hedgeOwner(0) {}
 	virtual ~HttpRequest() {}
+	// Requests of every subclass come from HttpSlab's free lists (see HttpSlab.h), rather than the heap:
+	static void* operator new(size_t size) { return HttpSlab::Alloc(size); }
+	static void operator delete(void* p, size_t size) { HttpSlab::Free(p, size); }
 	
 	Status GetStatus() const { return m_status; }
 	
-	const std::map<std::string, std::string>& GetResponseHeaders() const { return m_responseHeaders; }
+	const HttpHeaders& GetResponseHeaders() const { return m_responseHeaders; }
 	
-	// If actively uploading or downloading data, you can use this to get the progress, if known:
-	double GetUploadFraction() const { return m_uploadBytesTotal ? m_uploadBytesNow / m_uploadBytesTotal : 0; }
-	double GetDownloadFraction() const { return m_downloadBytesTotal ? m_downloadBytesNow / m_downloadBytesTotal : 0; }
+	// If actively uploading or downloading data, you can use this to get the progress, if known.
+	// The worker publishes all four figures together, at most every HttpClient::SetProgressInterval(),
+	// and GetProgress() always returns a set that belongs together (the doubles can't be read or written
+	// in one go on 32-bit ARM, so reading them one by one could mix two updates).
+	struct Progress {
+		double downloadBytesNow, downloadBytesTotal; // Total is 0 if not known
+		double uploadBytesNow, uploadBytesTotal;
+		Progress() : downloadBytesNow(0), downloadBytesTotal(0), uploadBytesNow(0), uploadBytesTotal(0) {}
+	};
+	Progress GetProgress() const;
+	double GetUploadFraction() const { const Progress progress = GetProgress(); return progress.uploadBytesTotal ? progress.uploadBytesNow / progress.uploadBytesTotal : 0; }
+	double GetDownloadFraction() const { const Progress progress = GetProgress(); return progress.downloadBytesTotal ? progress.downloadBytesNow / progress.downloadBytesTotal : 0; }
+	// The download progress is measured in bytes on the wire, which for a compressed response is less
+	// than the number of bytes that have been decompressed and passed to Worker_HandleData() so far:
+	double GetDownloadedWireBytes() const { return GetProgress().downloadBytesNow; }
+	double GetDownloadedBytes() const { return m_downloadBytesDecoded; }
+	double GetUploadedBytes() const { return GetProgress().uploadBytesNow; }
 	
 	const std::string& GetURL() const { return m_url; }
+	// The URL's origin, e.g. "https://www.example.com:443" (see HttpUrl::GetOrigin()), worked out the first time it's needed:
+	const std::string& GetOrigin() const { if (m_origin.empty()) m_origin = HttpUrl::GetOrigin(m_url); return m_origin; }
 	Method GetMethod() const { return m_method; };
-	const char* GetMethodStr() const { return m_method == GET ? "GET" : m_method == POST ? "POST" : m_method == HEAD ? "HEAD" : m_method == PUT ? "PUT" : "???"; }
-	const std::map<std::string, std::string>& GetRequestHeaders() { return m_requestHeaders; }
-	// Get the response headers, if available:
-	const std::map<std::string, std::string>& GetResponseHeaders() { IwAssert(HTTP_CLIENT, m_status == HEADERS || m_status == DONE || m_status == ERROR); return m_responseHeaders; }
+	const char* GetMethodStr() const { return m_method == GET ? "GET" : m_method == POST ? "POST" : m_method == HEAD ? "HEAD" : m_method == PUT ? "PUT" : m_method == DELETE ? "DELETE" : "???"; }
+	const HttpHeaders& GetRequestHeaders() const { return m_requestHeaders; } // This request's own headers, not the HttpClient's defaults
+	// The HttpClient's default headers that will be sent along with ours (see HttpClient::SetDefaultHeader()), once we are queued:
+	const HttpHeaderTemplate* GetDefaultHeaders() const { return m_pDefaultHeaders.ptr(); }
+	// The value of the header called name that is sent with this request: our own, or else the HttpClient's default. nullptr if neither.
+	const char* FindRequestHeader(const char* name) const;
+	const char* FindRequestHeader(const char* name, size_t nameLength) const;
+	// Get the response headers, if available (e.g. GetResponseHeaders().Find("Location")):
+	const HttpHeaders& GetResponseHeaders() { IwAssert(HTTP_CLIENT, m_status == HEADERS || m_status == DONE || m_status == ERROR); return m_responseHeaders; }
 	
-	// You can attempt to cancel an API call if it hasn't started yet:
-	virtual void Cancel() { if (m_status == PENDING) m_status = CANCELLED; }
+	// You can attempt to cancel an API call if it hasn't started yet.
+	// The request is removed from the HttpClient's queue right away and its callback will not be called.
+	virtual void Cancel();
+	// Cancel the request whether or not it has started. A request that is still waiting is cancelled as by Cancel().
+	// A transfer that is under way is aborted from within the worker's next curl callback, without stopping the worker,
+	// which goes on to the next request (curl calls its progress callback at least once a second, even if the server
+	// has gone quiet); the request ends up CANCELLED, and its callback isn't called. A request that other requests are
+	// following (see SetCoalesce()) only stops once they have all been aborted too.
+	virtual void Abort();
+	bool IsAborted() const { return m_aborted || m_status == CANCELLED; }
+	
+	// Set the priority of this request. If it is already queued but has not
+	// started yet, it moves to the back of the queue for its new priority (in
+	// O(1), e.g. for each thumbnail that scrolls into view), along with any
+	// requests that are following it. A transfer that is under way keeps its
+	// worker, but its share of the bandwidth (see HttpClient::SetBandwidthLimit())
+	// and whether it can be preempted follow its new priority.
+	void SetPriority(Priority priority);
+	Priority GetPriority() const { return m_priority; }
+	// Deadlines: a request that is no use after a certain time (e.g. search-as-you-type, or a thumbnail for a
+	// list that has been scrolled past) can say so with an s3eTimerGetMs() time, e.g. s3eTimerGetMs() + 500.
+	// Within its priority level, it is sent before requests with a later deadline or none (earliest deadline
+	// first). Once the deadline has passed, the HttpClient's Update() drops it from the queue without sending
+	// it, or aborts its transfer as by Abort(); either way it ends up CANCELLED, with IsExpired() set, and its
+	// callback isn't called. 0 (the default) means no deadline. Must be set before it is queued.
+	void SetDeadline(uint64 deadlineMs) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_deadlineMs = deadlineMs; }
+	uint64 GetDeadline() const { return m_deadlineMs; }
+	bool IsExpired() const { return m_expired; }
+	// Whether it failed (ERROR) without being sent, because its host's circuit breaker was open (see
+	// HttpClient::SetCircuitBreaker()):
+	bool IsFailedFast() const { return m_failedFast; }
+	// Dependencies: a request that needs the responses of others (e.g. an API call that needs an OAuth token) can
+	// be queued along with them, before they have finished. It waits, unsent, until every request it depends on
+	// (which must be queued too, with any HttpClient) has completed; then bind (if set) is called with it and
+	// them, to fill in its URL, headers or body from their responses, and it is sent. That happens during the
+	// same HttpClient::Update() that handled the last of their responses, right after their callbacks, so it is
+	// given a worker that same Update(): waiting for a dependency costs no extra frame. If a dependency fails,
+	// or bind returns false, the request fails too (ERROR, without being sent) and its callback is called; if
+	// one is cancelled, so is the request. Either way the requests that depend on it do the same in turn.
+	// Cancelling or aborting a waiting request stops it from being sent. Must be set up before it is queued.
+	typedef fastdelegate::FastDelegate2<HttpRequest*, const std::vector< Ptr<HttpRequest> >&, bool> BindDelegate; // (request, dependencies)
+	void AddDependency(Ptr<HttpRequest> pDependency) { IwAssert(HTTP_CLIENT, m_status == BUILDING && pDependency.ptr() != this); m_dependencies.push_back(pDependency); }
+	void SetBind(BindDelegate bind) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_bind = bind; }
+	const std::vector< Ptr<HttpRequest> >& GetDependencies() const { return m_dependencies; }
+	bool IsWaitingForDependencies() const { return m_pWaitingClient != nullptr; }
 
-	// Set a header for this request:
-	void SetHeader(const std::string& header, const std::string& value) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_requestHeaders[header] = value; }
+	// Set a header for this request, replacing any header of the same name (in any case), including the HttpClient's default:
+	void SetHeader(const std::string& header, const std::string& value) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_requestHeaders.Set(header, value); }
+	// Remove a header that this request set (the HttpClient's default, if any, is then sent instead):
+	void RemoveHeader(const char* header) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_requestHeaders.Remove(header); }
+	// Replace all of this request's headers with a set prepared earlier, which many requests can share:
+	// copying one is just two allocations, however many headers it has.
+	void SetHeaders(const HttpHeaders& headers) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_requestHeaders = headers; }
+	
+	// If the HttpClient has a cache (see HttpClient::SetCache()), GET requests use it unless this is set false:
+	void SetUseCache(bool useCache) { m_useCache = useCache; }
+	bool UsesCache() const { return m_useCache; }
+	// True once the request is done if its response came from the cache (including after a 304 Not Modified):
+	bool IsFromCache() const { return m_fromCache; }
+	// The key that identifies this request's response in an HttpMemoryCache, or "" if the response
+	// must not be shared with other requests. By default, "GET <url>" for a GET request that uses the cache.
+	virtual std::string GetMemoryCacheKey() const { return m_method == GET && UsesCache() ? std::string("GET ").append(m_url) : std::string(); }
+	// Coalescing: while a GET or HEAD request is queued or in flight, identical requests (same method, URL
+	// and headers) queued with the same HttpClient don't get sent; they follow it instead, receiving the
+	// same response as it arrives. Set false to always send this request on its own.
+	void SetCoalesce(bool coalesce) { m_coalesce = coalesce; }
+	// Hedging: for latency-critical GET or HEAD requests, which are safe to send twice. If the HttpClient hedges
+	// (see HttpClient::SetHedging()) and this request has had no response for unusually long, the same request is
+	// also sent on a spare worker, and whichever response starts first is used. Must be set before it is queued.
+	void SetHedge(bool hedge) { IwAssert(HTTP_CLIENT, !hedge || m_method == GET || m_method == HEAD); m_hedge = hedge; }
+	bool IsHedged() const { return m_hedged; } // A second transfer was started for (the latest attempt at) this request
+	// Retries (see HttpClient::SetRetryPolicy()): by default, GET, HEAD, PUT and DELETE requests, which are idempotent, are
+	// retried as often as the client's policy allows, and POST requests only if they never reached the server. Set
+	// maxRetries to retry this request up to that many times whatever its method (e.g. a POST that is safe to
+	// repeat), or 0 never to retry it; -1 goes back to the default.
+	void SetMaxRetries(int maxRetries) { m_maxRetries = maxRetries; }
+	int GetMaxRetries() const { return m_maxRetries; }
+	uint GetNumRetries() const { return m_numRetries; } // How many times it has been sent again after failing
+	uint GetNumFailovers() const { return m_numFailovers; } // Of those, how many went to another mirror straight away (see HttpClient::SetMirrors())
+	// Speed limits for this request's transfer, in bytes per second (0, the default, for none), on top of the
+	// HttpClient's bandwidth limit (see HttpClient::SetBandwidthLimit()). They can be changed while it is in
+	// progress, and take effect within about a second.
+	void SetMaxSpeed(uint64 recvBytesPerSecond, uint64 sendBytesPerSecond = 0) { m_maxRecvSpeed = recvBytesPerSecond; m_maxSendSpeed = sendBytesPerSecond; }
+	uint64 GetMaxRecvSpeed() const { return m_maxRecvSpeed; }
+	uint64 GetMaxSendSpeed() const { return m_maxSendSpeed; }
+	// Flow control: pause this request's transfer while it holds maxBytes or more of its response that the app
+	// hasn't consumed yet (0, the default, for no limit; see also HttpClient::SetMaxBufferedBytes()). Only requests
+	// that hand their response over as it arrives (see Worker_GetUnconsumed()) hold any. Can be changed at any time.
+	void SetMaxUnconsumed(size_t maxBytes) { m_maxUnconsumed = maxBytes; }
+	size_t GetMaxUnconsumed() const { return m_maxUnconsumed; }
+	// Memory budget (see HttpClient::SetMemoryBudget()): roughly how big the response is expected to be (0, the
+	// default, if it's small or unknown), which is what the transfer is charged until its Content-Length arrives.
+	void SetExpectedSize(size_t bytes);
+	size_t GetExpectedSize() const { return m_expectedSize; }
+	// What the client expects the body to be from the responses that its endpoint has sent before, if it keeps
+	// hints (see HttpClient::SetSizeHints()), or 0. Memory-bodied requests reserve this much for a body of unknown
+	// length, and the memory budget charges it if there is no expected size.
+	size_t GetSizeHint() const { return m_sizeHint; }
+	// How much it has to upload, if that is known on the app thread before it is sent (0 if it isn't, or if there
+	// is nothing to upload), once it has been compiled; e.g. for HttpClient::SetSizeLanes():
+	virtual int64 GetUploadSize() const { return 0; }
+	// Limits on the response, which the worker checks as soon as the headers are in (and, for the size, as the body
+	// arrives), so that a body nobody wants isn't downloaded only to be thrown away at the next Update(). A response
+	// that is rejected stops the transfer there (and closes its connection), and fails the request, with the HTTP status
+	// it came with: see GetRejection(). Identical requests that have joined it (see SetCoalesce()) check their own.
+	// At most maxBytes of body (0, the default, for no limit), going by the Content-Length if there is one:
+	void SetMaxResponseSize(size_t maxBytes) { m_maxResponseSize = maxBytes; }
+	size_t GetMaxResponseSize() const { return m_maxResponseSize; }
+	// Only the given Content-Types, e.g. "image/*, application/json" (empty, the default, for any). A response without
+	// a Content-Type is rejected.
+	void SetAcceptedContentTypes(const std::string& types) { m_acceptedContentTypes = types; }
+	const std::string& GetAcceptedContentTypes() const { return m_acceptedContentTypes; }
+	// Don't download the body of an error response (a status of 400 or more), e.g. a big error page: the request
+	// fails with the response's status and headers, as it would have anyway, and is retried as usual (see
+	// HttpClient::SetRetryPolicy()), but its body is empty.
+	void SetSkipErrorBodies(bool skip) { m_skipErrorBodies = skip; }
+	bool GetSkipErrorBodies() const { return m_skipErrorBodies; }
+	enum Rejection {
+		REJECTED_NONE,
+		REJECTED_STATUS,       // An error response, with SetSkipErrorBodies()
+		REJECTED_CONTENT_TYPE, // Not one of SetAcceptedContentTypes()
+		REJECTED_SIZE,         // Bigger than SetMaxResponseSize()
+		REJECTED_BY_REQUEST    // Worker_AcceptResponse() returned false
+	};
+	// Why the last attempt's response was rejected, once the request has finished:
+	Rejection GetRejection() const { return m_rejection; }
+	// Count this request towards pCounter, along with others (e.g. those behind a loading screen), which the
+	// worker then keeps up to date as the transfer goes (see HttpProgressCounter). Set it before the request is
+	// queued; HttpClient::QueueRequests() sets its group's.
+	void SetProgressCounter(Ptr<HttpProgressCounter> pCounter);
+	HttpProgressCounter* GetProgressCounter() const { return m_pProgressCounter.ptr(); }
+	// How much memory the transfer will hold while it is in progress, given the response's Content-Length (or -1
+	// if that isn't known yet). By default, the headers, and the whole body (for anything but a HEAD request).
+	virtual size_t EstimateMemory(int64 contentLength) const;
+	// Response compression: whether to ask for a gzip/deflate-compressed response (see
+	// HttpClient::SetAcceptCompressed()). It is decompressed on the worker thread before Worker_HandleData().
+	enum Compression {
+		COMPRESSION_CLIENT_DEFAULT, // Whatever the HttpClient does (the default)
+		COMPRESSION_ACCEPT,
+		COMPRESSION_REFUSE // e.g. for a download that should be saved exactly as the server has it
+	};
+	void SetCompression(Compression compression) { m_compression = compression; }
+	Compression GetCompression() const { return m_compression; }
+	// Uploads (POST and PUT): whether to send "Expect: 100-continue" and wait for the server's go-ahead before sending
+	// the body, which costs a round trip but spares a large body that the server would refuse anyway. By default, the
+	// HttpClient's policy decides (see HttpClient::SetExpectContinuePolicy()).
+	enum ExpectContinue {
+		EXPECT_CONTINUE_DEFAULT,
+		EXPECT_CONTINUE_ALWAYS,
+		EXPECT_CONTINUE_NEVER // Send the body straight away
+	};
+	void SetExpectContinue(ExpectContinue expect) { m_expectContinue = expect; }
+	ExpectContinue GetExpectContinue() const { return m_expectContinue; }
+	// Connection settings for this request that differ from its HttpClient's (see HttpClient::SetConfig()), e.g.
+	// a longer connect timeout, or no low-speed abort for a long poll. Start from HttpClientConfig::Overrides(),
+	// which changes nothing, and set just those fields. Read each time the request is started.
+	void SetConfigOverrides(const HttpClientConfig& overrides) { m_configOverrides = overrides; }
+	const HttpClientConfig& GetConfigOverrides() const { return m_configOverrides; }
+	// The key that identifies identical requests, or "" if this request can't be coalesced:
+	virtual std::string GetCoalesceKey() const;
+	// Where the time went, for the latest attempt at this request. Filled in once the response has arrived,
+	// before HandleResponse(). A response served from a cache has no network times.
+	struct Timings {
+		uint64 queueMs; // Waiting in the HttpClient's queue, from QueueRequest() (or being requeued) until a worker took it
+		// The transfer, as measured by curl:
+		double dnsMs; // Resolving the host name
+		double connectMs; // The TCP handshake
+		double tlsMs; // The TLS handshake (0 for plain HTTP)
+		double ttfbMs; // From the start of the transfer until the first byte of the response arrived
+		double totalMs; // The whole transfer, including any redirects
+		double bytesUploaded; // On the wire, not counting headers
+		double bytesDownloaded;
+		long numRedirects;
+		bool connectionReused; // An existing connection was used, so there was no DNS lookup or handshake
+		// POST and PUT: from the start of the transfer until curl asked for the first of the body, including any wait for
+		// "100 Continue" (see HttpClient::SetExpectContinuePolicy()). Measured by the worker, to the ms.
+		double uploadWaitMs;
+		// CPU time, to tell the client's own overhead apart from the network's (0 in a build with HTTP_PROBES=0, or
+		// where the platform has no per-thread CPU clock). On the worker's thread, from the start of the transfer to
+		// its end: curl (e.g. TLS, decompression) and the request's Worker_ methods. With ENGINE_MULTI, whose I/O
+		// threads drive many transfers at once, only what runs in this request's curl callbacks, and as it starts and
+		// finishes, is counted. Identical requests that followed it (see SetCoalesce()) get the same figure.
+		double workerCpuMs;
+		// On the app thread: HandleResponseHeaders(), HandleReceiving(), HandleResponse() and the callback (or, for a
+		// response that was got some other way, e.g. from an HttpMemoryCache, all of its handling). Only complete once
+		// the callback has returned, e.g. for HttpClient::GetEndpointStats().
+		double appCpuMs;
+		Timings() : queueMs(0), dnsMs(0), connectMs(0), tlsMs(0), ttfbMs(0), totalMs(0), bytesUploaded(0), bytesDownloaded(0), numRedirects(0), connectionReused(false), uploadWaitMs(0), workerCpuMs(0), appCpuMs(0) {}
+	};
+	const Timings& GetTimings() const { return m_timings; }
+	// Worker completion, for consumers that are thread-safe and shouldn't wait up to a frame for the next
+	// HttpClient::Update() (e.g. an audio streamer). The delegate is called on the worker thread as soon as a
+	// successful response has all arrived, just after Worker_HandleDone(), and before the worker tells the app
+	// thread; HandleResponse() and the callback still follow there as usual. Failures aren't reported to it,
+	// as the app thread decides whether they are retried. It runs in the worker memory environment: it may
+	// read the request (e.g. whatever its Worker_HandleData() kept) and write POD data of its own, but must not
+	// allocate or free anything the app thread owns, hold on to the request, or call the HttpClient. Neither
+	// may it block for long: the worker can't start another request until it returns. A response from an
+	// HttpMemoryCache calls it on the app thread instead, during Update(). Must be set before it is queued.
+	typedef fastdelegate::FastDelegate2<HttpRequest*, int> WorkerCallbackDelegate; // (request, httpStatusCode)
+	void SetWorkerCallback(WorkerCallbackDelegate callback) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_workerCallback = callback; }
+	// Pass the body of a successful (2xx) response through pSink as it arrives, as well as to Worker_HandleData(), e.g.
+	// to inflate it, check its digest and write it to a file, in one pass (see HttpSink.h). So a plain HttpRequest
+	// (whose Worker_HandleData() ignores the data) can be any kind of download. Must be set before it is queued.
+	// A request with a sink is never answered by an HttpMemoryCache.
+	void SetSink(Ptr<HttpSink> pSink) { IwAssert(HTTP_CLIENT, m_status == BUILDING || m_status == PENDING); m_pSink = pSink; }
+	HttpSink* GetSink() const { return m_pSink.ptr(); }
+#ifdef HTTP_ALLOC_STATS
+	// The heap allocations made for this request so far, by site (see HttpAllocStats.h). The worker's
+	// are added once the transfer is over. Identical requests that followed this one only count their own.
+	const HttpAllocStats::Counters& GetAllocStats() const { return m_allocStats; }
+#endif
 	
 	
 	
@@ -68,35 +344,81 @@ public:
 	// requests queue.
 	virtual void CompileRequest() { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_status = PENDING; }
 	// Called immediately as the request begins to be transmitted:
-	virtual void HandleRequestStart() { IwAssert(HTTP_CLIENT, m_status == PENDING); m_status = SENDING; }
+	virtual void HandleRequestStart() { IwAssert(HTTP_CLIENT, m_status == PENDING); m_status = SENDING; m_rejection = REJECTED_NONE; }
 	// Called to handle response headers once they are all received:
-	struct RH { const std::string header; const std::string value; RH* next; RH(std::string h, std::string v, RH* next) : header(h), value(v), next(next) {} };
-	virtual void HandleResponseHeaders(const RH* pFirstHeader) {
+	virtual void HandleResponseHeaders(const HttpHeaders& headers) {
 		IwAssert(HTTP_CLIENT, m_status == SENDING);
 		m_status = HEADERS;
-		// We must copy the headers from the RH* struct in the worker thread's memory environment to m_responseHeaders in the app's memory environment:
-		for (const RH* p_header = pFirstHeader; p_header != nullptr; p_header = p_header->next) { m_responseHeaders[p_header->header] = p_header->value; }
+		// We must copy the headers from the worker thread's memory environment to m_responseHeaders in the app's memory environment
+		// (the status line, e.g. "HTTP/1.1 200 OK", comes too: see GetStatusLine()):
+		m_responseHeaders = headers;
 	}
+	// Called by HttpClient::Update() while the body is arriving (from HEADERS until the worker is done), for a request
+	// that passes its response on to the app as it comes (see HttpStreamRequest):
+	virtual void HandleReceiving() {}
 	// Called after the request has finished. Process the data that Worker_HandleData() has been receiving.
 	// Success will be true unless the HTTP response code was >400 or an error occurred. If a network/curl/ApiClient error occured, httpStatusCode will be zero.
+	// A request that has more work to do once this transfer is over (e.g. HttpSegmentedDownload) may leave its status
+	// as HEADERS instead of setting DONE or ERROR; its callback then isn't called until it calls NotifyDone() itself.
 	virtual void HandleResponse(bool success, int httpStatusCode) { IwAssert(HTTP_CLIENT, m_status == HEADERS); m_status = success ? DONE : ERROR; }
+	// Called if the HttpClient has to send this request again from the start, e.g. because its transfer was
+	// preempted by a more important request. Worker_HandleDone() and Worker_HandleCleanup() have already been
+	// called. Subclasses should reset any state kept from the previous attempt, and must call this base method.
+	virtual void HandleRequeue();
 	///////////////////////////////////////////////////////
 	// Note - these are called from a worker thread!
 	// ** The Worker_ methods must NOT modify any of the members not marked as "volatile". **
-	virtual void Worker_UpdateProgress(double dltotal, double dlnow, double ultotal, double ulnow) { m_downloadBytesNow = dlnow; m_downloadBytesTotal = dltotal; m_uploadBytesNow = ulnow; m_uploadBytesTotal = ultotal;
-		//Trace("Worker_UpdateProgress m_downloadBytesNow %d, m_downloadBytesTotal %d, m_uploadBytesNow %d m_pUploadBytesTotal %d", m_downloadBytesNow, m_downloadBytesTotal, m_uploadBytesNow, m_uploadBytesTotal);
-	}
+	virtual void Worker_UpdateProgress(const Progress& progress); // Only ever called by one worker at a time
+	bool Worker_IsAborted() const { return m_abortRequested; } // Abort() has been called for a transfer in progress
+	void Worker_AddDownloadedBytes(size_t size) { m_downloadBytesDecoded = m_downloadBytesDecoded + size; } // Called by the HttpClient as data is passed to Worker_HandleData()
+	// Called once all the headers of the final response have been received, before any of its data.
+	// headers are in the worker's memory environment, so they can only be read (e.g. with headers.Find()), not kept.
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {}
+	// Called just before that, for a subclass to look at the headers and turn the response down, e.g. an image that
+	// is bigger than it can decode. Return false to reject it (see SetMaxResponseSize()), and its body isn't downloaded.
+	virtual bool Worker_AcceptResponse(const HttpHeaders& headers, int httpStatusCode) { return true; }
+	// Called by the HttpClient: check the response against the limits, and then Worker_AcceptResponse(). Returns what
+	// the rejection was for, if it was, for the caller to stop the transfer.
+	Rejection Worker_CheckResponse(const HttpHeaders& headers, int httpStatusCode);
+	// Called by the HttpClient before each Worker_HandleData(): false if size more bytes would break the size limit.
+	bool Worker_CheckSize(size_t size);
+	// For flow control (see SetMaxUnconsumed()): how much of the response data this request holds that the app thread
+	// could consume before the transfer is over, but hasn't yet. Called before each Worker_HandleData().
+	virtual size_t Worker_GetUnconsumed() const { return 0; }
+	// Also for flow control: whether whatever the response goes to can't take any more of it for now, e.g. a disk
+	// that has fallen behind (see HttpDownload::SetDiskWriter()). Called with Worker_GetUnconsumed() by the multi
+	// engine, which pauses the transfer until it is false again, so that its I/O thread can get on with the others;
+	// the thread-per-worker engine leaves it to Worker_HandleData() to wait.
+	virtual bool Worker_IsBackedUp() const { return false; }
 	// For receiving data:
-	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) = 0; // Process response data from the server. Should return value of "size" if successful.
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) { return size; } // Process response data from the server. Should return value of "size" if successful.
 	// For sending data:
-	virtual long Worker_GetUploadSize() const { return 0L; } /* For POST/PUT requests, return the length of the body data that we are planning to upload */
+	// For POST/PUT requests, return the length of the body data that we are planning to upload, or -1 if it isn't known in advance
+	// (it is then sent chunked, until Worker_HandleUpload() returns 0). The HttpClient sends the Content-Length header for it.
+	virtual void Worker_PrepareUpload() {} // Called before each attempt at a POST or PUT, before Worker_GetUploadSize()
+	virtual int64 Worker_GetUploadSize() const { return 0; }
 	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize) { return 0; } // Fill memory area pData with next "fillSize" bytes of data to upload. Return a non-zero # of bytes actually filled.
 	// If any cleanup needs to be done by the worker thread:
 	virtual void Worker_HandleDone(bool success, int httpStatusCode) {} // Note: this gets called before the app thread calls HandleResponse()
 	virtual void Worker_HandleCleanup() {} // This gets called after the app thread has done HandleResponse()
+	void Worker_NotifyDone(bool success, int httpStatusCode) { if (success && m_workerCallback) m_workerCallback(this, httpStatusCode); } // See SetWorkerCallback()
+	// Called by the HttpClient to run the sink, if there is one (see SetSink()): from the response headers (returns
+	// false if the sink can't take the body), for each piece of the body, at the end (returns false if the sink
+	// failed to finish), and once the app thread has handled the response.
+	bool Worker_OpenSink(const HttpHeaders& headers, int httpStatusCode);
+	bool Worker_WriteSink(const unsigned char* contents, size_t size) { return !m_sinkOpen || m_pSink->Worker_Write(contents, size); }
+	bool Worker_CloseSink(bool success);
+	void Worker_CleanupSink() { if (m_pSink) m_pSink->Worker_Cleanup(); m_sinkOpen = false; }
 	
 	// Helper methods:
 	static std::string UrlEncode(const std::string &value, bool strict = true); // URL-Encode a string (e.g. "test test&t" becomes "test+test%26t" or "test%20test%26t" (strict mode)
+	static void UrlEncode(const char* pValue, size_t length, std::string& out, bool strict = true); // Appends to out, growing it at most once
+	// The reverse of UrlEncode() (either mode). Returns false if there was a '%' without two hex digits, which is kept as it is.
+	static bool UrlDecode(const char* pValue, size_t length, std::string& out); // Appends to out
+	static std::string UrlDecode(const std::string& value);
+	// Append "key=value" to a query string or form body, URL-encoded, with a '&' first unless query is empty:
+	static void AppendQueryParam(std::string& query, const std::string& key, const std::string& value, bool strict = true);
+	static bool HeaderNameEquals(const std::string& name, const char* header); // Case-insensitive
 	///////////////////////////////////////////////////////
 	
 protected:
@@ -108,9 +430,100 @@ protected:
 	volatile double m_uploadBytesTotal; // How many bytes will be uploaded total, if known. Otherwise this will be 0.
 	volatile double m_downloadBytesNow; // How many bytes have been uploaded so far
 	volatile double m_downloadBytesTotal; // How many bytes will be uploaded total, if known. Otherwise this will be 0.
+	volatile double m_downloadBytesDecoded; // How many bytes have been passed to Worker_HandleData() so far
+	volatile uint32 m_progressVersion; // Odd while Worker_UpdateProgress() is changing the four figures above
+	// What this request has counted towards its HttpProgressCounter, if it has one: set by the app thread until the
+	// request starts, then by the worker until it's done, then by the app thread again:
+	Ptr<HttpProgressCounter> m_pProgressCounter;
+	size_t m_countedDownloadTotal, m_countedDownloadDone;
+	size_t m_countedUploadTotal, m_countedUploadDone;
+	bool m_countedFinished; // Its final figures have been counted
+	volatile bool m_abortRequested; // Set by Abort() on the app thread (once the request has started), read by the worker
+	bool m_aborted; // Abort() has been called, whether or not the transfer has been told to stop yet
+	// For subclasses that can be reused (see HttpPost::Reset()): make this request BUILDING again, as if it were
+	// new, with the same method and URL, but keeping the memory of its headers.
+	void Reset();
+	// For subclasses that adjust their headers for each attempt, e.g. in HandleRequestStart(). An empty value removes the header.
+	void SetAttemptHeader(const std::string& header, const std::string& value) { if (value.empty()) m_requestHeaders.Remove(header.data(), header.size()); else m_requestHeaders.Set(header, value); }
+	// Call the callback that this request was queued with, if it hasn't been called yet:
+	// or the delegate (unless its guard has gone), and then the continuation that HttpFuture::Then() kept here, if any:
+	void NotifyDone();
+	// Forget the callback, delegate and continuation, e.g. because the request has been cancelled:
+	void ForgetCallbacks() { m_pCallback = nullptr; m_callbackDelegate.clear(); m_pCallbackGuard = nullptr; m_callbackGuarded = false; m_then.clear(); }
+	// Once the request has finished, been cancelled or failed: count what it really took towards its HttpProgressCounter
+	void FinishProgressCounter();
 private:
-	std::map<std::string, std::string> m_requestHeaders;
-	std::map<std::string, std::string> m_responseHeaders;
+	HttpHeaders m_requestHeaders;
+	HttpHeaders m_responseHeaders;
+	Ptr<HttpHeaderTemplate> m_pDefaultHeaders; // Set by the HttpClient when we are queued
+	mutable std::string m_origin; // Cached by GetOrigin(), on the app thread
+	Priority m_priority;
+	bool m_useCache;
+	bool m_fromCache; // Set by the HttpClient
+	bool m_coalesce;
+	Compression m_compression;
+	ExpectContinue m_expectContinue;
+	Timings m_timings; // Set by the HttpClient
+	uint64 m_queuedMs; // Set by the HttpClient: when we were (last) queued
+	uint m_traceId; // Set by the HttpClient if it has an HttpTracer
+	int m_maxRetries;
+	uint m_numRetries; // Counted by the HttpClient
+	uint m_numFailovers; // Likewise
+	uint64 m_maxRecvSpeed, m_maxSendSpeed;
+	size_t m_maxUnconsumed;
+	size_t m_expectedSize;
+	size_t m_sizeHint; // Set by the HttpClient when we are queued
+	size_t m_maxResponseSize;
+	std::string m_acceptedContentTypes;
+	bool m_skipErrorBodies;
+	volatile Rejection m_rejection; // Set by the worker (and cleared by HandleRequestStart())
+	HttpClientConfig m_configOverrides;
+	WorkerCallbackDelegate m_workerCallback; // Only read by the worker
+	Ptr<HttpSink> m_pSink;
+	volatile bool m_sinkOpen; // Set by the worker, while the sink is taking a body
+#ifdef HTTP_ALLOC_STATS
+	HttpAllocStats::Counters m_allocStats; // Counted by the app thread; the HttpClient adds the worker's
+#endif
+	// Scheduling data, owned by the HttpClient that this request has been queued with:
+	friend class HttpClient;
+	friend class HttpScheduler;
+	friend struct HttpScheduler_Host;
+	Ptr<HttpCallbackBase> m_pCallback; // Called once the response has been handled. Held by the request itself so completion dispatch is O(1).
+	friend class HttpFuture;
+	friend class HttpFutureState;
+	friend class HttpBatcher;
+	// Or, instead of m_pCallback, a delegate that needs no callback object (see HttpClient::QueueRequest()):
+	CallbackDelegate m_callbackDelegate;
+	ObservingPtr<IObservable> m_pCallbackGuard; // If m_callbackGuarded, m_callbackDelegate is only called while this is alive
+	bool m_callbackGuarded;
+	CallbackDelegate m_then; // The first continuation of our HttpFuture, called after m_pCallback
+	typedef std::list< Ptr<HttpRequest>, HttpSlabAllocator< Ptr<HttpRequest> > > ScheduleQueue;
+	HttpScheduler* m_pScheduler; // The queue this request is waiting in, or nullptr if it is not queued
+	ScheduleQueue::iterator m_scheduleIt; // Our position in that queue, so that we can be removed in O(1)
+	uint64 m_notBeforeMs; // While we are held back by the scheduler (e.g. a retry that is backing off): until when
+	HttpTimer m_notBeforeTimer; // Set for m_notBeforeMs while we are held back
+	uint64 m_deadlineMs; // See SetDeadline()
+	HttpTimer m_deadlineTimer; // Set for m_deadlineMs while we are queued
+	bool m_expired; // Cancelled because m_deadlineMs passed
+	bool m_failedFast; // See IsFailedFast()
+	void HandleNotBefore(); // (m_notBeforeTimer's delegate; tells m_pScheduler)
+	void HandleDeadline(); // (m_deadlineTimer's)
+	HttpScheduler_Host* m_pScheduleHost; // The host that we are queued for or counted against (see HttpScheduler)
+	// Coalescing data, owned by the HttpClient:
+	std::string m_coalesceKey; // Set while we are the request that identical requests follow
+	std::vector< Ptr<HttpRequest> > m_followers; // The requests following us
+	// Dependency data (see AddDependency()), owned by the HttpClient:
+	std::vector< Ptr<HttpRequest> > m_dependencies;
+	BindDelegate m_bind;
+	std::vector< Ptr<HttpRequest> > m_dependents; // Queued requests that are waiting for us
+	uint m_numWaitingFor; // How many of m_dependencies haven't completed yet
+	HttpClient* m_pWaitingClient; // That we were queued with, while we wait for m_dependencies
+	void ReleaseDependents(); // Once we have completed or been cancelled: tell m_dependents
+	// Hedging data (see SetHedge()):
+	friend struct HttpClient_Worker;
+	bool m_hedge;
+	bool m_hedged; // Set by the HttpClient once a second worker is sending us too
+	volatile int m_hedgeOwner; // Which of those workers may pass the response to us: 0 until one of them claims it
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -121,18 +534,107 @@ private:
 // HttpDownload: Simple request to download a file.
 class HttpDownload : public HttpRequest {
 public:
+	// destFile's folder is made (if need be) by the worker, once the response starts to arrive.
 	HttpDownload(const std::string& url, const std::string& destFile);
 	~HttpDownload();
 	
+	// Resume mode: if the download fails part way through (or is preempted), the partial file
+	// "<destFile>.tmp" is kept, and the next attempt, or a later HttpDownload of the same file, only
+	// asks the server for the rest of it using a Range request. The ETag or Last-Modified date of the
+	// original response is kept in "<destFile>.tmp.validator" and sent as If-Range, so if the file has
+	// changed on the server in the meantime, it sends all of it (200 instead of 206) and we start over.
+	// Must be set before the request is queued.
+	HttpDownload& SetResumable(bool resumable) { m_resumable = resumable; return *this; }
+	bool IsResumable() const { return m_resumable; }
+	// (A resumable download isn't coalesced with others, as each continues its own partial file.)
+	// Data is collected in a write-behind buffer of this size (256 KB by default) and written to the
+	// file in large blocks, rather than once per network chunk. 0 writes every chunk straight through.
+	HttpDownload& SetWriteBufferSize(size_t bytes) { m_writeBufferSize = bytes; return *this; }
+	// If set, the file is grown to its full size (from Content-Length) before any data is written, which
+	// avoids fragmentation on some filesystems. Ignored in resume mode, as the partial file's size must
+	// always be the number of bytes received.
+	HttpDownload& SetPreallocate(bool preallocate) { m_preallocate = preallocate; return *this; }
+	// Integrity: the file is hashed as it is written, and only renamed from "<destFile>.tmp" to destFile if its
+	// digest is the one expected (otherwise the request fails, and the partial file is deleted). hexDigest is the
+	// MD5 or SHA-256 of the whole file, in hex; throws std::runtime_error if it isn't one. Without one of these,
+	// a 200 response's Content-MD5 header is checked if it has one, and so is a strong ETag that is an MD5 in
+	// hex if SetETagIsDigest() is set (as it is for single-part uploads to S3 and Google Cloud Storage).
+	// A resumed download hashes the partial file first. Must be set before the request is queued.
+	HttpDownload& SetExpectedDigest(HttpDigest::Type type, const std::string& hexDigest);
+	HttpDownload& SetETagIsDigest(bool etagIsDigest) { m_etagIsDigest = etagIsDigest; return *this; }
+	// Once the request is DONE: the digest of the file in hex, if it was checked. Otherwise empty.
+	std::string GetDigest() const { return m_digestChecked ? HttpDigest::ToHex(m_digestResult, HttpDigest::GetSize(m_digestType)) : std::string(); }
+	bool IsDigestMismatch() const { return m_digestMismatch; } // The request failed because the file wasn't the one expected
+	// Hand the data to pWriter's thread to write to the file (see HttpDiskWriter.h), as each write-behind buffer
+	// fills, instead of writing it on the worker; the file is closed and renamed into place on that thread too. The
+	// transfer pauses while the writer's buffers are all waiting for the disk. The request stays HEADERS until the
+	// file has been finished, and finishes in the writer's Update() (so it must be attached to the client, or
+	// updated by the app; a worker callback, see SetWorkerCallback(), may be called before the file is in place).
+	// nullptr (the default) for none. The writer must outlive the transfer; if it is destroyed while the request
+	// waits for it, the request fails without its callback being called. Must be set before the request is queued.
+	HttpDownload& SetDiskWriter(HttpDiskWriter* pWriter);
+	HttpDiskWriter* GetDiskWriter() const { return m_pDiskWriter; }
+	// Once the request is DONE or ERROR: the response's HTTP status, or 0 if there wasn't one (e.g. the network failed).
+	int GetHttpStatusCode() const { return m_responseStatus; }
+	
+	virtual void HandleRequestStart();
+	virtual std::string GetCoalesceKey() const { return m_resumable ? std::string() : HttpRequest::GetCoalesceKey(); }
+	virtual size_t EstimateMemory(int64 contentLength) const { return HttpRequest::EstimateMemory(0) + m_writeBufferSize; } // The body goes to the file
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode);
 	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
 	virtual void Worker_HandleDone(bool success, int httpStatusCode);
+	virtual bool Worker_IsBackedUp() const;
 protected:
 	const std::string m_destFile;
 	s3eFile* m_pTmpFile;
+	bool m_resumable;
+	int64 m_resumeFrom; // Set by the app thread before each attempt: the size of the partial file we asked the server to continue, or 0
+	// Set by the worker thread once the response headers have arrived:
+	bool m_appendToTmp; // The server is sending the rest of the partial file (206 Partial Content)
+	bool m_discardData; // The response body is not (part of) the file, e.g. it's an error page
+	bool m_discardTmp; // The partial file can't be resumed, so it must be deleted rather than kept
+	int64 m_contentLength; // From the response headers, or -1 if unknown
+	// Write-behind buffer, allocated and freed by the worker thread:
+	size_t m_writeBufferSize;
+	bool m_preallocate;
+	char* m_pWriteBuffer;
+	size_t m_writeBufferUsed;
+	bool m_writeFailed; // Set by the worker thread (or the disk writer's) if the file couldn't be written
+	// The disk writer (see SetDiskWriter()), and our file as it sees it. The stream is made and destroyed by the app
+	// thread, and only otherwise used by the writer:
+	class DiskStream;
+	HttpDiskWriter* m_pDiskWriter;
+	DiskStream* m_pDiskStream;
+	bool m_finishSuccess; // Set by the worker for the writer, with the close: how the transfer went
+	int m_finishStatus;
+	bool m_responseSuccess; // What HandleResponse() was given (kept while we wait for the writer)
+	int m_responseStatus;
+	Ptr<HttpDownload> m_pSelf; // Keeps us alive meanwhile
+	// Integrity (see SetExpectedDigest()). The expected digest is set by the app thread, or by the worker from
+	// the response headers; the worker does the rest:
+	HttpDigest::Type m_expectedType;
+	unsigned char m_expectedDigest[HttpDigest::MAX_SIZE];
+	bool m_etagIsDigest;
+	HttpDigest::Type m_digestType; // For this attempt
+	unsigned char m_digestWanted[HttpDigest::MAX_SIZE];
+	HttpDigest m_digest;
+	unsigned char m_digestResult[HttpDigest::MAX_SIZE];
+	bool m_digestChecked;
+	bool m_digestMismatch;
+	bool FlushWriteBuffer(); // Returns false if the data couldn't be written
+	bool Worker_WriteOut(const void* pData, size_t size); // To the file, or to the disk writer
+	bool Worker_OpenTmpFile();
+	bool Worker_CloseTmpFile(bool success); // Returns whether the file was written whole, or false if the transfer failed
+	void Worker_FinishDigest(bool& success);
+	void Worker_FinishTmpFile(bool success, int httpStatusCode, bool wroteTmp); // Rename it into place, keep it, or delete it
+	void FinishWrite(bool abandoned); // The writer has finished the file: finish the response
+	void Worker_BeginDigest(const HttpHeaders& headers, int httpStatusCode);
+	bool Worker_MakeDestFolder(); // Returns false if it couldn't be made
 };
 
 
-// HttpPost: Simple URL-encoded POST request (like a normal HTML form; cannot upload files)
+// HttpPost: Simple URL-encoded POST request (like a normal HTML form; to upload files, see HttpMultipartPost)
 class HttpPost : public HttpRequest {
 public:
 	HttpPost(const std::string& url);
@@ -140,25 +642,100 @@ public:
 	
 	virtual HttpPost& SetValue(const char* key, const char* value) { m_data[key] = value; return *this; }
 	const std::string& GetValue(const char* key) { return m_data[key]; }
+	// POST responses are never cached, unless this is set: then a POST of the same data to the same URL
+	// can be answered by an HttpMemoryCache (see HttpClient::SetMemoryCache()), e.g. for idempotent API calls.
+	HttpPost& SetCacheable(bool cacheable) { m_cacheable = cacheable; return *this; }
+	// If set, the body is gzip-compressed when the request is compiled and sent with "Content-Encoding: gzip"
+	// (if that makes it any smaller). Only use this if the server is known to accept compressed request bodies.
+	HttpPost& SetCompressBody(bool compress) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_compressBody = compress; return *this; }
+	// Send size bytes at pData as the body, instead of the values, e.g. a screenshot or a save game that is already
+	// in memory. The body isn't copied: the request keeps a reference to pOwner (whatever object the memory belongs
+	// to, e.g. an HttpBuffer from an HttpMemoryDownload) until it is done, and the worker reads the memory straight
+	// from there, so it mustn't change until then. (Unless the body is compressed: see SetCompressBody().)
+	HttpPost& SetBody(Ptr<IRefCounted> pOwner, const void* pData, size_t size, const char* contentType = "application/octet-stream");
+	// If set, the body is written out (the values URL-encoded, or an HttpPostJson's object serialised) by the worker,
+	// just before it is sent, rather than when the request is queued, so that queuing even a big form costs the app
+	// thread next to nothing. The worker reads the values (or the object), so they mustn't change until the request
+	// is done. GetPostBody() stays empty, and the request is never answered by an HttpMemoryCache. With
+	// SetCompressBody(), the body is always sent gzipped, as whether that's worth it isn't known when it's queued.
+	HttpPost& SetCompileOnWorker(bool compileOnWorker) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_compileOnWorker = compileOnWorker; return *this; }
+	bool IsCompileOnWorker() const { return m_compileOnWorker; }
+	// Get a finished request (DONE, ERROR or CANCELLED) ready to be built and queued again, as if it were new,
+	// with the same URL. The memory of its headers and body is kept, so a request that is sent over and over
+	// (see HttpRequestPool) stops allocating for them. Only once no HttpClient holds it any more: not from its
+	// own callback, as the worker still cleans up after that.
+	virtual void Reset();
 	
 	virtual void CompileRequest();
+	virtual std::string GetMemoryCacheKey() const { return m_method == GET ? HttpRequest::GetMemoryCacheKey() : m_cacheable && UsesCache() && !m_compileOnWorker ? std::string("POST ").append(m_url).append(1, '\n').append((const char*)GetBodyData(), GetBodySize()) : std::string(); }
 	
-	virtual long Worker_GetUploadSize() const { return m_postData.size(); }
+	virtual size_t EstimateMemory(int64 contentLength) const { return m_postData.size() + 2 * HttpRequest::EstimateMemory(contentLength); } // The body (if it's our own), and the response with the document parsed from it
+	virtual void Worker_PrepareUpload();
+	virtual int64 GetUploadSize() const { return m_compileOnWorker ? 0 : (int64)GetBodySize(); } // (Not known until the worker has compiled it)
+	virtual int64 Worker_GetUploadSize() const { return GetBodySize(); }
 	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize);
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode);
 	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
-	virtual void Worker_HandleCleanup() { if (m_workerResponseBuffer) free((void*)m_workerResponseBuffer); }
+	virtual void Worker_HandleDone(bool success, int httpStatusCode) { m_responseBody.Worker_Finish(); HttpRequest::Worker_HandleDone(success, httpStatusCode); }
+	virtual void Worker_HandleCleanup() { m_responseBody.Worker_Free(); std::string().swap(m_workerBody); }
+	virtual void HandleRequestStart();
 	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void HandleRequeue() { m_bytesUploaded = 0; m_responseTape.Clear(); m_pJsonEntry = nullptr; m_jsonReused = false; HttpRequest::HandleRequeue(); }
 	
+	// A JSON response, or a CBOR one (Content-Type: application/cbor, see HttpPostJson::SetCbor()), which reads the same:
 	const json::Object& GetResponse() const { return m_responseData; }
+	// If set, a JSON response is not turned into elements at all: GetResponse() stays empty, and
+	// GetResponseTape() holds the document instead, for lazy access to just the fields you need
+	// (e.g. GetResponseTape().Root()["items"][0].GetOrDefault("id", 0LL)).
+	HttpPost& SetResponseAsTape(bool asTape) { m_responseAsTape = asTape; return *this; }
+	const json::TapeDocument& GetResponseTape() const { return m_responseTape; }
+	// If set, the document parsed from a response with an ETag is kept in pCache, and the next request for it (a GET,
+	// or a POST that is SetCacheable()) sends If-None-Match: a 304 Not Modified, or a response from the client's caches
+	// with the same ETag, gets the cached document as GetResponse(), shared rather than copied, and the body is never
+	// read or parsed. Not with SetResponseAsTape(), which keeps no elements to share. See HttpJsonCache.
+	HttpPost& SetJsonCache(HttpJsonCache* pCache) { IwAssert(HTTP_CLIENT, m_status == BUILDING); m_pJsonCache = pCache; return *this; }
+	bool IsResponseReused() const { return m_jsonReused; } // GetResponse() came from the HttpJsonCache
+	// The raw response body. Only valid until the request's callback returns.
+	const HttpResponseBody& GetResponseBody() const { return m_responseBody; }
+	// The body that is sent, once the request has been compiled (see CompileRequest()). Empty if it is the one given
+	// to SetBody(), as it was given:
+	const std::string& GetPostBody() const { return m_postData; }
 protected:
+	// For a subclass that GETs a JSON document (e.g. an API's read calls), with the same handling of the response:
+	// it has no body, so the values (if any) belong in the URL's query instead.
+	HttpPost(Method method, const std::string& url);
 	std::map<std::string, std::string> m_data; // Key-value pairs that we want to submit as the POST data
 	//std::string m_postDataUrlEncoded;
 	std::string m_postData;
+	// The body from SetBody(), if it is sent from there rather than from m_postData:
+	Ptr<IRefCounted> m_pBodyOwner;
+	const unsigned char* m_pBody;
+	size_t m_bodySize;
+	// For SetCompileOnWorker(): the body, as written out by the worker (in the worker memory environment):
+	bool m_compileOnWorker;
+	std::string m_workerBody;
+	bool m_workerBodyFailed;
+	const unsigned char* GetBodyData() const { return m_pBodyOwner ? m_pBody : (const unsigned char*)(m_compileOnWorker ? m_workerBody : m_postData).data(); }
+	size_t GetBodySize() const { return m_pBodyOwner ? m_bodySize : (m_compileOnWorker ? m_workerBody : m_postData).size(); }
+	// Writes the body out to body, for CompileRequest() or the worker: the values, URL-encoded (or whatever a subclass sends)
+	virtual void WriteBody(std::string& body) const;
+	static bool Gzip(const unsigned char* pData, size_t size, std::string& compressed);
 	size_t m_bytesUploaded;
-	const char* m_workerResponseBuffer; // Buffer used by the worker thread to store the response as it comes in.
-	size_t m_workerResponseSize;
+	bool m_cacheable;
+	bool m_compressBody;
+	void CompressPostData(); // For CompileRequest(), if m_compressBody is set
+	HttpResponseBody m_responseBody; // Used by the worker thread to store (and parse) the response as it comes in.
 	
 	json::UnknownElement m_responseData;
+	bool m_responseAsTape;
+	json::TapeDocument m_responseTape;
+	// For SetJsonCache(): the entry whose ETag this attempt sent (the ETag is copied, for the worker to compare with
+	// the response's), and whether the response turned out to be that entry's:
+	HttpJsonCache* m_pJsonCache;
+	Ptr<HttpJsonCache::Entry> m_pJsonEntry;
+	std::string m_jsonETag;
+	volatile bool m_jsonReused;
+	std::string GetJsonCacheKey() const;
 };
 
 //HttpPostJson: Sends JSON objects in POST request
@@ -167,10 +744,33 @@ public:
 	HttpPostJson(const std::string& url);
 	~HttpPostJson() {};
 	HttpPostJson& SetPostData(const json::Object& jsonObj) { IwAssert(API_CLIENT, m_status == BUILDING); m_postDataJson = jsonObj; return *this; }
+	HttpPostJson& SetPostData(json::Object&& jsonObj) { IwAssert(API_CLIENT, m_status == BUILDING); m_postDataJson = std::move(jsonObj); return *this; } // Takes the tree over instead of copying it
 	const json::Object& GetPostData() const { return m_postDataJson; }
+	// If set, the body is sent as CBOR (Content-Type: application/cbor; see util/jsoncbor.h) instead of JSON,
+	// and the server is asked to answer in CBOR too (Accept: application/cbor), which is smaller and
+	// quicker to write and read at both ends. Whichever the server answers in, GetResponse() and
+	// GetResponseTape() read the same. Only use this with servers that accept CBOR, e.g. our own API.
+	HttpPostJson& SetCbor(bool cbor);
+	bool IsCbor() const { return m_cbor; }
+	// If set, the body isn't written out when the request is compiled, but by the worker as it is sent, a piece at a
+	// time (see json::StreamWriter), e.g. for a big save state: it is sent chunked, as its length isn't known, and the
+	// whole of it is never in memory at once. The object from SetPostData() is read by the worker, so it mustn't be
+	// changed until the request is done. Only for JSON: SetCbor() and SetCompressBody() are ignored with this.
+	HttpPostJson& SetStreamBody(bool streamBody) { IwAssert(API_CLIENT, m_status == BUILDING); m_streamBody = streamBody; return *this; }
+	bool IsStreamBody() const { return m_streamBody; }
 	
 	virtual void CompileRequest();
+	virtual void Reset();
+	virtual void WriteBody(std::string& body) const;
+	virtual std::string GetMemoryCacheKey() const { return m_streamBody ? std::string() : HttpPost::GetMemoryCacheKey(); }
+	virtual void Worker_PrepareUpload() { if (!m_streamBody) HttpPost::Worker_PrepareUpload(); }
+	virtual int64 Worker_GetUploadSize() const { return m_streamBody ? -1 : HttpPost::Worker_GetUploadSize(); }
+	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize);
+	virtual void Worker_HandleCleanup();
 	
 protected:
 	json::Object m_postDataJson;
+	bool m_cbor;
+	bool m_streamBody;
+	json::StreamWriter* m_pStreamWriter; // For m_streamBody: made and deleted by the worker, for each attempt
 };
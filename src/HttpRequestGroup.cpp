@@ -0,0 +1,61 @@
+// HttpRequestGroup:
+// A batch of requests that are queued together, with one callback.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpRequestGroup.h"
+
+void HttpRequestGroup::SetPriority(HttpRequest::Priority priority) {
+	m_priority = priority;
+	for (size_t i = 0; i < m_requests.size(); i++) {
+		if (m_requests[i]->GetStatus() == HttpRequest::PENDING)
+			m_requests[i]->SetPriority(priority);
+	}
+}
+
+void HttpRequestGroup::Cancel() {
+	Ptr<HttpRequestGroup> p_this(this); // (In case the requests hold the last references to us)
+	for (size_t i = 0; i < m_requests.size(); i++) {
+		HttpRequest& request = *m_requests[i].ptr();
+		const HttpRequest::Status status = request.GetStatus();
+		if ((status == HttpRequest::PENDING || status == HttpRequest::SENDING || status == HttpRequest::HEADERS) && !request.IsAborted()) {
+			request.Abort();
+			m_numCancelled++;
+			m_numCompleted++;
+		}
+	}
+	// A leader whose followers were all in the group only stops once they have been aborted
+	// too, which may be after the leader itself was (Abort() is cheap to repeat):
+	for (size_t i = 0; i < m_requests.size(); i++) {
+		HttpRequest& request = *m_requests[i].ptr();
+		if (request.GetStatus() == HttpRequest::SENDING || request.GetStatus() == HttpRequest::HEADERS)
+			request.Abort();
+	}
+	NotifyIfDone();
+}
+
+void HttpRequestGroup::Add(const std::vector< Ptr<HttpRequest> >& requests) {
+	m_requests.insert(m_requests.end(), requests.begin(), requests.end());
+	for (auto it = requests.begin(); it != requests.end(); it++)
+		(*it)->SetProgressCounter(m_pProgress);
+}
+
+void HttpRequestGroup::NotifyIfDone() {
+	if (IsDone()) {
+		if (Ptr<HttpGroupCallbackBase> p_callback = m_pDoneCallback) {
+			m_pDoneCallback = nullptr;
+			p_callback->Call(this);
+		}
+	}
+}
+
+void HttpRequestGroup::Call(Ptr<HttpRequest> pRequest) {
+	Ptr<HttpRequestGroup> p_this(this);
+	m_numCompleted++;
+	if (pRequest->GetStatus() == HttpRequest::DONE)
+		m_numSucceeded++;
+	if (m_pItemCallback)
+		m_pItemCallback->Call(pRequest);
+	NotifyIfDone();
+}
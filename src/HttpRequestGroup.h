@@ -0,0 +1,82 @@
+// HttpRequestGroup:
+// A batch of requests that are queued together (see HttpClient::QueueRequests()),
+// e.g. the 500 thumbnails of a gallery screen. The group is the one callback that
+// all of its requests share, so queueing them doesn't need a callback object
+// each. It calls pItemCallback (if any) as each request completes, and
+// pDoneCallback (if any) once they all have, and it can change the priority of,
+// or cancel, all of its requests at once.
+// Cancel requests through the group, not one by one: a request that is
+// cancelled by itself doesn't tell the group, which then never completes.
+// GetProgress() has the group's progress as a whole, which the workers keep
+// up to date as they go (see HttpProgressCounter), so a loading screen can
+// show it every frame without looking at a single request.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <vector>
+
+#include "util/FastDelegate.h"
+#include "HttpRequest.h"
+
+class HttpRequestGroup;
+
+// Called once every request in a group has completed (or been cancelled):
+class HttpGroupCallbackBase : public IRefCounted {
+public:
+	virtual void Call(Ptr<HttpRequestGroup> pGroup) = 0;
+};
+
+template<typename WatcherType>
+class HttpGroupCallback : public HttpGroupCallbackBase {
+public:
+	HttpGroupCallback(ObservingPtr<WatcherType> pWatcher, void (WatcherType::*pMethod)(Ptr<HttpRequestGroup>))
+	: m_pWatcher(pWatcher), m_pDelegate(fastdelegate::MakeDelegate(pWatcher.ptr(), pMethod)) {}
+	virtual void Call(Ptr<HttpRequestGroup> pGroup) { if (m_pWatcher) m_pDelegate(pGroup); }
+private:
+	ObservingPtr<WatcherType> m_pWatcher;
+	fastdelegate::FastDelegate1< Ptr<HttpRequestGroup> > m_pDelegate;
+};
+
+class HttpRequestGroup : public HttpCallbackBase {
+public:
+	HttpRequestGroup(Ptr<HttpCallbackBase> pItemCallback = nullptr, Ptr<HttpGroupCallbackBase> pDoneCallback = nullptr)
+		: m_pItemCallback(pItemCallback), m_pDoneCallback(pDoneCallback), m_numCompleted(0), m_numSucceeded(0), m_numCancelled(0), m_priority(HttpRequest::PRIORITY_NORMAL), m_pProgress(new HttpProgressCounter) {}
+
+	// The priority that HttpClient::QueueRequests() gives every request of the group. Changing it once
+	// they are queued moves those that haven't started yet (see HttpRequest::SetPriority()).
+	void SetPriority(HttpRequest::Priority priority);
+	HttpRequest::Priority GetPriority() const { return m_priority; }
+	// Cancel every request of the group that hasn't started yet, and abort those that are being sent
+	// (see HttpRequest::Abort()), e.g. when the user leaves the screen that wanted them. They count as
+	// completed, but their callbacks aren't called. The workers stay up, and go on to the next requests.
+	void Cancel();
+
+	const std::vector< Ptr<HttpRequest> >& GetRequests() const { return m_requests; }
+	size_t GetNumRequests() const { return m_requests.size(); }
+	size_t GetNumCompleted() const { return m_numCompleted; } // Including the cancelled ones
+	size_t GetNumSucceeded() const { return m_numSucceeded; } // i.e. DONE
+	size_t GetNumCancelled() const { return m_numCancelled; }
+	size_t GetNumFailed() const { return m_numCompleted - m_numSucceeded - m_numCancelled; }
+	bool IsDone() const { return m_numCompleted == m_requests.size(); }
+	// The requests' bytes and completions, all together (each request's expected size counts until its real size is
+	// known: see HttpRequest::SetExpectedSize()):
+	const HttpProgressCounter& GetProgress() const { return *m_pProgress.ptr(); }
+
+	/////// Internal methods used by HttpClient ///////
+	void Add(const std::vector< Ptr<HttpRequest> >& requests);
+	void NotifyIfDone(); // If everything has completed (e.g. an empty group), call pDoneCallback
+	virtual void Call(Ptr<HttpRequest> pRequest); // Each request's callback
+
+private:
+	Ptr<HttpCallbackBase> m_pItemCallback;
+	Ptr<HttpGroupCallbackBase> m_pDoneCallback; // Released once it has been called
+	// Held until the group is released. Each request holds the group too, as its callback, until it completes.
+	std::vector< Ptr<HttpRequest> > m_requests;
+	size_t m_numCompleted, m_numSucceeded, m_numCancelled;
+	HttpRequest::Priority m_priority;
+	Ptr<HttpProgressCounter> m_pProgress; // Shared with the requests, which may outlive the group
+};
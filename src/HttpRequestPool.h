@@ -0,0 +1,58 @@
+// HttpRequestPool:
+// Recycles requests that are sent over and over to the same URL (e.g.
+// telemetry pings, several a second), so that each one doesn't cost a new
+// request object with new headers and a new body buffer:
+//     HttpRequestPool<HttpPostJson> pings("https://telemetry.example.com/ping");
+//     Ptr<HttpPostJson> p_ping = pings.Rent();
+//     p_ping->SetPostData(event);
+//     client.QueueRequest(p_ping, pCallback);
+//     ...
+//     pings.Return(p_ping); // e.g. in the callback
+// A returned request is only rented out again once nothing else holds it (the
+// HttpClient lets go of it after the worker has cleaned up, which is after
+// the callback), and then it is Reset() first. T must have a public Reset()
+// and a constructor that takes the URL, like HttpPost and HttpPostJson.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "HttpRequest.h"
+
+template <class T>
+class HttpRequestPool {
+public:
+	// At most maxSize returned requests are kept; any more are just released.
+	HttpRequestPool(const std::string& url, size_t maxSize = 8) : m_url(url), m_maxSize(maxSize) { m_returned.reserve(maxSize); }
+
+	// A request that is BUILDING, either recycled or new:
+	Ptr<T> Rent() {
+		for (size_t i = 0; i < m_returned.size(); i++) {
+			if (m_returned[i].count() == 1) { // Only we hold it: the HttpClient, and anyone else, is done with it
+				Ptr<T> p_request = m_returned[i];
+				m_returned.erase(m_returned.begin() + i);
+				p_request->Reset();
+				return p_request;
+			}
+		}
+		return new T(m_url);
+	}
+	// Give a request back once its callback has been called (or it has been cancelled, or never queued).
+	void Return(const Ptr<T>& pRequest) {
+		IwAssert(HTTP_CLIENT, pRequest->GetURL() == m_url);
+		if (m_returned.size() < m_maxSize)
+			m_returned.push_back(pRequest);
+	}
+	size_t GetNumReturned() const { return m_returned.size(); }
+	void Clear() { m_returned.clear(); }
+
+private:
+	const std::string m_url;
+	const size_t m_maxSize;
+	std::vector< Ptr<T> > m_returned;
+};
@@ -0,0 +1,288 @@
+// HttpResponseBody:
+// A buffer for receiving a response body on a worker thread, which the app
+// thread can then read in place.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpResponseBody.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <IwMath.h>
+
+#include "HttpAllocStats.h"
+#include "HttpWorkerArena.h"
+#include "util/jsoncbor.h"
+#include "util/jsontape.h"
+
+void* HttpResponseBody::Worker_Realloc(void* p, size_t oldSize, size_t newSize) {
+	if (m_pArena)
+		return m_pArena->Realloc(p, oldSize, newSize); // (Which counts what it takes from the heap)
+	void* p_new = realloc(p, newSize);
+	if (p_new)
+		HTTP_ALLOC_COUNT(newSize);
+	return p_new;
+}
+
+void HttpResponseBody::Worker_FreeBlock(void* p, size_t size) {
+	if (m_pArena)
+		m_pArena->Free(p, size);
+	else
+		free(p);
+}
+
+bool HttpResponseBody::Worker_Reserve(size_t size) {
+	if (size + 1 <= m_capacity)
+		return true;
+	if (!m_pData)
+		m_pArena = HttpWorkerArena::Current();
+	char* p_new = (char*)Worker_Realloc(m_pData, m_capacity, size + 1);
+	if (!p_new)
+		return false;
+	m_pData = p_new;
+	m_capacity = size + 1;
+	return true;
+}
+
+bool HttpResponseBody::Worker_AppendContiguous(const unsigned char* pData, size_t size) {
+	if (m_dataSize + size + 1 > m_capacity) {
+		// Grow geometrically so that the total cost of copying stays linear in the body size:
+		size_t new_capacity = m_capacity ? m_capacity : 4096;
+		while (new_capacity < m_dataSize + size + 1)
+			new_capacity *= 2;
+		if (!Worker_Reserve(new_capacity - 1))
+			return false;
+	}
+	memcpy(m_pData + m_dataSize, pData, size);
+	m_dataSize += size;
+	m_pData[m_dataSize] = '\0';
+	m_size = m_dataSize;
+	return true;
+}
+
+bool HttpResponseBody::Worker_AppendChunked(const unsigned char* pData, size_t size) {
+	// Fill up the first chunk (m_pData), or the last one, and then start another:
+	const size_t head_room = m_capacity - 1 - m_dataSize;
+	if (m_chunks.empty() && head_room) {
+		const size_t n = MIN(size, head_room);
+		memcpy(m_pData + m_dataSize, pData, n);
+		m_dataSize += n;
+		m_pData[m_dataSize] = '\0';
+		m_size += n;
+		pData += n;
+		size -= n;
+	}
+	if (!m_chunks.empty() && size) {
+		Chunk& last = m_chunks.back();
+		const size_t n = MIN(size, last.capacity - last.size);
+		memcpy(last.pData + last.size, pData, n);
+		last.size += n;
+		m_size += n;
+		pData += n;
+		size -= n;
+	}
+	if (size) {
+		// As much again as we have so far, so that there are only ever a few chunks, but at most 1 MB
+		// at a time, so that the last one wastes little:
+		size_t capacity = MIN(MAX(m_size, (size_t)16384), (size_t)1 << 20);
+		capacity = MAX(capacity, size);
+		Chunk chunk = { (char*)Worker_Realloc(nullptr, 0, capacity), size, capacity };
+		if (!chunk.pData)
+			return false;
+		memcpy(chunk.pData, pData, size);
+		m_chunks.push_back(chunk);
+		m_size += size;
+	}
+	return true;
+}
+
+bool HttpResponseBody::Worker_Append(const unsigned char* pData, size_t size) {
+	// Only text that the parser has already seen may be left in pieces:
+	if (m_jsonStatus == JSON_PARSING && !m_cbor && m_pData) {
+		if (!Worker_AppendChunked(pData, size))
+			return false;
+	} else if (!Worker_AppendContiguous(pData, size)) {
+		return false;
+	}
+	const char* p_parse = (const char*)pData;
+	
+	if (m_parseJson && m_jsonStatus == JSON_UNKNOWN && m_cbor) {
+		// CBOR can't be decoded in pieces (see Worker_Finish()), so only make the tape for it:
+		HTTP_ALLOC_SCOPE(SITE_JSON, nullptr);
+		m_pTape = new json::TapeWriter(m_pArena);
+		m_jsonStatus = JSON_PARSING;
+	} else if (m_parseJson && m_jsonStatus == JSON_UNKNOWN) {
+		// Decide whether to parse the body from its first non-whitespace character:
+		const char* p = m_pData;
+		while (*p && isspace(*p))
+			p++;
+		if (*p == '{' || *p == '[') {
+			HTTP_ALLOC_SCOPE(SITE_JSON, nullptr);
+			m_pTape = new json::TapeWriter(m_pArena);
+			m_pParser = new json::PushParser(*m_pTape);
+			m_jsonStatus = JSON_PARSING;
+			p_parse = m_pData; // Parse everything we've received so far
+			size = m_size;
+		} else if (*p) {
+			m_jsonStatus = JSON_NOT_PARSED;
+		}
+	}
+	if (m_jsonStatus == JSON_PARSING && m_pParser) {
+		HTTP_ALLOC_SCOPE(SITE_JSON, nullptr);
+		try {
+			m_pParser->Feed(p_parse, size); // (Straight from the caller's buffer, wherever we copied it to)
+		} catch (const json::Exception& e) {
+			Worker_FailJson(e.what());
+		}
+	}
+	return true;
+}
+
+void HttpResponseBody::Worker_Finish() {
+	if (m_jsonStatus == JSON_PARSING) {
+		HTTP_ALLOC_SCOPE(SITE_JSON, nullptr);
+		try {
+			if (m_cbor)
+				json::CborParser::Parse(m_pData, m_size, *m_pTape);
+			else
+				m_pParser->Finish();
+			if (m_pTape->OutOfMemory())
+				Worker_FailJson("Out of memory");
+			else
+				m_jsonStatus = JSON_PARSED;
+		} catch (const json::Exception& e) {
+			Worker_FailJson(e.what());
+		}
+	}
+	delete m_pParser; // We no longer need the parser's state, only the tape
+	m_pParser = nullptr;
+}
+
+void HttpResponseBody::Worker_Join() {
+	if (m_chunks.empty())
+		return;
+	if (Worker_Reserve(m_size)) {
+		for (size_t i = 0; i < m_chunks.size(); i++) {
+			memcpy(m_pData + m_dataSize, m_chunks[i].pData, m_chunks[i].size);
+			m_dataSize += m_chunks[i].size;
+		}
+		m_pData[m_dataSize] = '\0';
+	}
+	m_size = m_dataSize; // If we ran out of memory, all that's left is the first chunk
+	for (size_t i = 0; i < m_chunks.size(); i++)
+		Worker_FreeBlock(m_chunks[i].pData, m_chunks[i].capacity);
+	std::vector<Chunk>().swap(m_chunks);
+}
+
+void HttpResponseBody::Worker_FailJson(const char* error) {
+	snprintf(m_jsonError, sizeof(m_jsonError), "%s", error);
+	m_jsonStatus = JSON_FAILED;
+	Worker_Join(); // Nothing but the text is left to read, so it must be in one piece again (e.g. to show it)
+	delete m_pParser;
+	m_pParser = nullptr;
+	if (m_pTape)
+		m_pTape->Free();
+}
+
+void HttpResponseBody::Worker_Free() {
+	Worker_FreeBlock(m_pData, m_capacity);
+	m_pData = nullptr;
+	m_size = m_capacity = m_dataSize = 0;
+	for (size_t i = 0; i < m_chunks.size(); i++)
+		Worker_FreeBlock(m_chunks[i].pData, m_chunks[i].capacity);
+	std::vector<Chunk>().swap(m_chunks); // (Its memory is ours too)
+	m_cbor = false;
+	delete m_pParser;
+	m_pParser = nullptr;
+	delete m_pTape;
+	m_pTape = nullptr;
+	m_pArena = nullptr;
+	m_jsonStatus = JSON_UNKNOWN;
+	m_jsonError[0] = '\0';
+}
+
+const char* HttpResponseBody::GetChunk(size_t i, size_t& size) const {
+	if (i == 0) {
+		size = m_dataSize;
+		return Data();
+	}
+	size = m_chunks[i - 1].size;
+	return m_chunks[i - 1].pData;
+}
+
+HttpResponseBody::IStream::ChunkStreamBuf::int_type HttpResponseBody::IStream::ChunkStreamBuf::underflow() {
+	while (m_nextChunk < m_body.NumChunks()) {
+		size_t size;
+		char* p = const_cast<char*>(m_body.GetChunk(m_nextChunk++, size)); // std::streambuf wants char*, but the get area is never written to
+		if (size) {
+			setg(p, p, p + size);
+			return traits_type::to_int_type(*p);
+		}
+	}
+	return traits_type::eof();
+}
+
+json::TapeValue HttpResponseBody::GetJsonTape() const {
+	if (m_jsonStatus != JSON_PARSED)
+		return json::TapeValue();
+	return json::TapeValue(m_pTape->Data());
+}
+
+bool HttpResponseBody::AdoptJson(json::TapeDocument& doc) const {
+	doc.Clear();
+	if (m_jsonStatus == JSON_PARSED) {
+		doc.Assign(m_pTape->Data(), m_pTape->Size());
+		return true;
+	}
+	if (m_jsonStatus == JSON_FAILED)
+		return false;
+	// The worker didn't parse it, so index it now, on this thread. This is a single scan of the
+	// body, with no elements built:
+	HTTP_ALLOC_SCOPE(SITE_JSON, nullptr);
+	try {
+		json::TapeWriter tape;
+		if (m_cbor) {
+			json::CborParser::Parse(Data(), Size(), tape);
+		} else {
+			json::PushParser parser(tape);
+			parser.Feed(Data(), Size());
+			parser.Finish();
+		}
+		doc.Adopt(tape);
+	} catch (const json::Exception& e) {
+		snprintf(m_jsonError, sizeof(m_jsonError), "%s", e.what());
+		doc.Clear();
+		return false;
+	}
+	return true;
+}
+
+bool HttpResponseBody::ParseJson(json::UnknownElement& element) const {
+	HTTP_ALLOC_SCOPE(SITE_JSON, nullptr);
+	try {
+		if (m_jsonStatus == JSON_PARSED) {
+			json::DomBuilder builder(element);
+			json::ReplayTape(m_pTape->Data(), m_pTape->Size(), builder);
+		} else if (m_jsonStatus == JSON_FAILED) {
+			return false;
+		} else if (m_cbor) {
+			json::DomBuilder builder(element);
+			json::CborParser::Parse(Data(), Size(), builder);
+		} else {
+			json::Reader::Read(element, Data(), Size());
+		}
+	} catch (const json::Exception& e) {
+		snprintf(m_jsonError, sizeof(m_jsonError), "%s", e.what());
+		return false;
+	}
+	return true;
+}
+
+bool HttpResponseBody::ParseJson(json::Document& document) const {
+	document.Clear();
+	json::Arena::Scope scope(document.GetArena());
+	return ParseJson(document.Root());
+}
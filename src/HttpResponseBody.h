@@ -0,0 +1,153 @@
+// HttpResponseBody:
+// A buffer for receiving a response body on a worker thread, which the app
+// thread can then read in place.
+//
+// The buffer grows geometrically, so receiving a large response costs a
+// constant number of copies per byte rather than a realloc() of the whole
+// body for every chunk that curl hands us. A body that is being parsed as
+// JSON on the worker (see below) is not even copied that much: once it
+// outgrows the buffer, the rest is kept in a list of further chunks as it
+// arrives, since the tape holds the document and the text needn't be in one
+// piece. That saves copying it all again, and having both the old and the
+// new buffer at once, which for a multi-megabyte response is most of the
+// peak memory it takes. It lives in the worker memory
+// environment: only the worker may append to it or free it, and it must be
+// freed from Worker_HandleCleanup(). In between (from HandleResponse()
+// until the request's callback returns), the app thread may read it.
+//
+// Optionally, if the body turns out to be a JSON object or array, it is also
+// parsed on the worker thread as it arrives (see json::PushParser), so that
+// by the time the response is handled, all that is left for the app thread
+// to do is to build the elements from the recorded tape (see ParseJson()),
+// or not even that: the tape can be read in place (see GetJsonTape()), or
+// adopted by the app thread with a single memcpy (see AdoptJson()).
+// A CBOR body (see Worker_SetCbor()) is read through the same calls: it is
+// decoded onto a tape on the worker thread once it has all arrived, so that
+// the app thread can't tell it from JSON.
+// The body and its tape come out of the worker's scratch arena, if it is
+// receiving on a worker that has one (see HttpWorkerArena), and otherwise
+// from malloc().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <istream>
+#include <streambuf>
+#include <vector>
+
+#include <IwDebug.h>
+
+#include "util/ptr.h"
+#include "util/json.h"
+#include "util/jsontape.h"
+
+class HttpWorkerArena;
+
+class HttpResponseBody {
+public:
+	// parseJson: parse the body on the worker thread as it arrives, if it is JSON.
+	HttpResponseBody(bool parseJson = false) : m_pData(nullptr), m_size(0), m_capacity(0), m_dataSize(0), m_parseJson(parseJson), m_cbor(false), m_jsonStatus(JSON_UNKNOWN), m_pParser(nullptr), m_pTape(nullptr), m_pArena(nullptr) { m_jsonError[0] = '\0'; }
+	~HttpResponseBody() { IwAssert(HTTP_CLIENT, m_pData == nullptr && m_pTape == nullptr && m_chunks.capacity() == 0); } // Worker_Free() must have been called from the worker thread
+	
+	///////////////////////////////////////////////////////
+	// For use from the worker thread only:
+	// Append data; returns false if we have run out of memory.
+	bool Worker_Append(const unsigned char* pData, size_t size);
+	// Make room for at least "size" bytes in total, e.g. once the Content-Length is known:
+	bool Worker_Reserve(size_t size);
+	// The body is CBOR (its Content-Type is application/cbor), rather than JSON or anything else. Call
+	// before appending any of it:
+	void Worker_SetCbor() { IwAssert(HTTP_CLIENT, m_size == 0); m_cbor = true; }
+	// Call once the whole body has been received (e.g. from Worker_HandleDone()):
+	void Worker_Finish();
+	void Worker_Free();
+	
+	///////////////////////////////////////////////////////
+	// Read-only view, for any thread:
+	// The data is always followed by a '\0', so Data() can be used as a C string (for text responses).
+	// Data() is the whole body, unless the worker parsed it as JSON and it overflowed into further chunks
+	// (see IsContiguous()); then Data() is just the first chunk, and the whole document is on the tape.
+	const char* Data() const { return m_pData ? m_pData : ""; }
+	size_t Size() const { return m_size; } // Of the whole body, in however many chunks
+	bool Empty() const { return m_size == 0; }
+	bool IsContiguous() const { return m_chunks.empty(); }
+	// The body in the chunks it is held in, in order: Data() first, then the ones it overflowed into.
+	// (IStream reads them all.)
+	size_t NumChunks() const { return 1 + m_chunks.size(); }
+	const char* GetChunk(size_t i, size_t& size) const;
+	bool IsCbor() const { return m_cbor; }
+	
+	// Parse the body as JSON (or CBOR, if IsCbor()) into element. If the worker thread already parsed
+	// it, this just builds the elements; otherwise the body is parsed in place. Returns false if the
+	// body is not valid JSON, in which case GetJsonError() describes the problem.
+	bool ParseJson(json::UnknownElement& element) const;
+	// The same, but building the elements in the document's arena (see json::Document):
+	bool ParseJson(json::Document& document) const;
+	const char* GetJsonError() const { return m_jsonError; }
+	// If the worker thread parsed the body, a view of the recorded document, which can be read
+	// without building any elements. Invalid (see TapeValue::IsValid()) otherwise.
+	// Like Data(), only valid until the request's callback returns.
+	json::TapeValue GetJsonTape() const;
+	// Get the body as a tape in doc (in the calling thread's memory environment), so that it can be
+	// kept after the request has finished and read lazily via doc.Root(). If the worker thread
+	// parsed the body, this is a single memcpy; otherwise the body is indexed now, in one scan,
+	// without building any elements. Returns false, leaving doc empty, if the body is not valid
+	// JSON, in which case GetJsonError() describes the problem.
+	bool AdoptJson(json::TapeDocument& doc) const;
+	
+	// A std::istream that reads the body in place, without copying it, chunk by chunk:
+	class IStream : public std::istream {
+	public:
+		IStream(const HttpResponseBody& body) : std::istream(nullptr), m_buf(body) { rdbuf(&m_buf); }
+	private:
+		class ChunkStreamBuf : public std::streambuf {
+		public:
+			ChunkStreamBuf(const HttpResponseBody& body) : m_body(body), m_nextChunk(0) {}
+		protected:
+			virtual int_type underflow();
+		private:
+			const HttpResponseBody& m_body;
+			size_t m_nextChunk;
+		};
+		ChunkStreamBuf m_buf;
+	};
+	
+private:
+	char* m_pData;
+	size_t m_size;
+	size_t m_capacity; // Bytes allocated at m_pData, including room for the trailing '\0'
+	size_t m_dataSize; // Bytes of the body at m_pData: all of it, unless it has overflowed into m_chunks
+	struct Chunk {
+		char* pData;
+		size_t size;
+		size_t capacity;
+	};
+	std::vector<Chunk> m_chunks; // Allocated and freed by the worker thread
+	// Parsing on the worker thread:
+	const bool m_parseJson;
+	bool m_cbor;
+	enum JsonStatus {
+		JSON_UNKNOWN, // We haven't seen the start of the body yet
+		JSON_PARSING, // The body looks like JSON, and m_pParser is parsing it into m_pTape (or it is CBOR, which is decoded all at once)
+		JSON_PARSED,  // m_pTape holds the whole document
+		JSON_FAILED,  // Not valid JSON; see m_jsonError
+		JSON_NOT_PARSED, // The body does not start like a JSON object or array, or we are not parsing it
+	};
+	JsonStatus m_jsonStatus;
+	json::PushParser* m_pParser; // Allocated and freed by the worker thread
+	json::TapeWriter* m_pTape;   // Allocated and freed by the worker thread
+	mutable char m_jsonError[128];
+	HttpWorkerArena* m_pArena; // Where the buffers and the tape come from, if not malloc(): the arena that was current when the first one was allocated
+	void* Worker_Realloc(void* p, size_t oldSize, size_t newSize);
+	void Worker_FreeBlock(void* p, size_t size);
+	bool Worker_AppendContiguous(const unsigned char* pData, size_t size);
+	bool Worker_AppendChunked(const unsigned char* pData, size_t size);
+	void Worker_Join(); // Gather the chunks back into m_pData
+	void Worker_FailJson(const char* error);
+	
+	HttpResponseBody(const HttpResponseBody&); // Not copyable: the data belongs to the worker memory environment
+	HttpResponseBody& operator=(const HttpResponseBody&);
+};
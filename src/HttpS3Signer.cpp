@@ -0,0 +1,209 @@
+// HttpS3Signer:
+// AWS Signature Version 4 for S3 and S3-compatible object storage.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpS3Signer.h"
+
+#include <s3eTimer.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "HttpDigest.h"
+#include "HttpUrl.h"
+
+using std::string;
+
+static const char HTTP_S3_SIGNER_HEX_DIGITS[] = "0123456789ABCDEF"; // (SigV4 wants upper case)
+static const char HTTP_S3_SIGNER_UNSIGNED_PAYLOAD[] = "UNSIGNED-PAYLOAD";
+
+static string HttpS3Signer_Hmac(const string& key, const string& data) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	if (!HMAC(EVP_sha256(), key.data(), (int)key.size(), (const unsigned char*)data.data(), data.size(), digest, &length))
+		throw std::runtime_error("HttpS3Signer: Unable to compute an HMAC");
+	return string((const char*)digest, length);
+}
+
+static string HttpS3Signer_Sha256Hex(const string& text) {
+	HttpDigest digest;
+	if (!digest.Begin(HttpDigest::DIGEST_SHA256))
+		throw std::runtime_error("HttpS3Signer: Unable to compute a digest");
+	digest.Update(text.data(), text.size());
+	unsigned char result[HttpDigest::MAX_SIZE];
+	const size_t size = digest.Finish(result);
+	return HttpDigest::ToHex(result, size);
+}
+
+static int HttpS3Signer_HexValue(char c) {
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Undo the URL's own %-encoding (whichever case or set of characters it used), so that it can be encoded again the way
+// SigV4 does; plusIsSpace for a query, which HttpUrl::AddQuery() encodes spaces in as '+':
+static string HttpS3Signer_Decode(const char* pText, size_t length, bool plusIsSpace) {
+	string decoded;
+	decoded.reserve(length);
+	for (size_t i = 0; i < length; i++) {
+		const int high = pText[i] == '%' && i + 2 < length ? HttpS3Signer_HexValue(pText[i + 1]) : -1;
+		const int low = high >= 0 ? HttpS3Signer_HexValue(pText[i + 2]) : -1;
+		if (low >= 0) {
+			decoded += (char)(high * 16 + low);
+			i += 2;
+		} else {
+			decoded += plusIsSpace && pText[i] == '+' ? ' ' : pText[i];
+		}
+	}
+	return decoded;
+}
+
+static const char* HttpS3Signer_MethodName(HttpRequest::Method method) {
+	static const char* const s_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE" }; // (In the order of HttpRequest::Method)
+	return s_names[method];
+}
+
+HttpS3Signer::HttpS3Signer(const string& accessKeyId, const string& secretKey, const string& region, const string& sessionToken, const string& service)
+	: m_accessKeyId(accessKeyId), m_secretKey(secretKey), m_sessionToken(sessionToken), m_region(region), m_service(service), m_clockOffsetMs(0)
+{
+}
+
+void HttpS3Signer::SetCredentials(const string& accessKeyId, const string& secretKey, const string& sessionToken) {
+	m_accessKeyId = accessKeyId;
+	m_secretKey = secretKey;
+	m_sessionToken = sessionToken;
+}
+
+string HttpS3Signer::FormatTime(uint64 utcMs) {
+	// From days since 1970 to a civil date (Howard Hinnant's days_from_civil, in reverse), without gmtime(), whose
+	// time_t may be 32 bits:
+	const uint64 seconds = utcMs / 1000;
+	const int64 days = (int64)(seconds / 86400);
+	const uint second_of_day = (uint)(seconds % 86400);
+	const int64 z = days + 719468;
+	const int64 era = z / 146097;
+	const uint day_of_era = (uint)(z - era * 146097);
+	const uint year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	const uint day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	const uint mp = (5 * day_of_year + 2) / 153;
+	const uint day = day_of_year - (153 * mp + 2) / 5 + 1;
+	const uint month = mp < 10 ? mp + 3 : mp - 9;
+	const uint year = (uint)(year_of_era + era * 400 + (month <= 2));
+	char text[17];
+	const uint fields[] = { year / 100, year % 100, month, day, 0, second_of_day / 3600, second_of_day / 60 % 60, second_of_day % 60 };
+	char* p_out = text;
+	for (uint i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (i == 4) {
+			*p_out++ = 'T';
+			continue;
+		}
+		*p_out++ = (char)('0' + fields[i] / 10);
+		*p_out++ = (char)('0' + fields[i] % 10);
+	}
+	*p_out++ = 'Z';
+	return string(text, p_out - text);
+}
+
+void HttpS3Signer::AppendEncoded(string& out, const char* pText, size_t length, bool keepSlashes) {
+	out.reserve(out.size() + length);
+	for (size_t i = 0; i < length; i++) {
+		const unsigned char c = (unsigned char)pText[i];
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keepSlashes)) {
+			out += (char)c;
+		} else {
+			out += '%';
+			out += HTTP_S3_SIGNER_HEX_DIGITS[c >> 4];
+			out += HTTP_S3_SIGNER_HEX_DIGITS[c & 15];
+		}
+	}
+}
+
+string HttpS3Signer::CanonicalQuery(const char* pQuery, size_t length) {
+	// Each parameter as "key=value" (a bare "uploads" is "uploads="), encoded, in order of key and then value:
+	std::vector< std::pair<string, string> > params;
+	size_t start = 0;
+	while (start < length) {
+		size_t end = start;
+		while (end < length && pQuery[end] != '&')
+			end++;
+		if (end > start) {
+			size_t equals = start;
+			while (equals < end && pQuery[equals] != '=')
+				equals++;
+			std::pair<string, string> param;
+			const string key = HttpS3Signer_Decode(pQuery + start, equals - start, true);
+			AppendEncoded(param.first, key.data(), key.size(), false);
+			if (equals < end) {
+				const string value = HttpS3Signer_Decode(pQuery + equals + 1, end - equals - 1, true);
+				AppendEncoded(param.second, value.data(), value.size(), false);
+			}
+			params.push_back(param);
+		}
+		start = end + 1;
+	}
+	std::sort(params.begin(), params.end());
+	string canonical;
+	for (size_t i = 0; i < params.size(); i++) {
+		if (i)
+			canonical += '&';
+		canonical.append(params[i].first).append(1, '=').append(params[i].second);
+	}
+	return canonical;
+}
+
+void HttpS3Signer::Sign(HttpRequest::Method method, const string& url, HttpHeaders& headers) const {
+	SignAt(method, url, (uint64)((int64)s3eTimerGetUTC() + m_clockOffsetMs), headers);
+}
+
+void HttpS3Signer::SignAt(HttpRequest::Method method, const string& url, uint64 utcMs, HttpHeaders& headers) const {
+	const HttpUrl parsed(url);
+	string host = parsed.GetHost();
+	std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+	const uint port = parsed.GetPort();
+	if (port && port != (parsed.IsHttps() ? 443u : 80u)) {
+		// (As curl sends it in the Host header)
+		char digits[8];
+		size_t num_digits = 0;
+		for (uint n = port; n && num_digits < sizeof(digits); n /= 10)
+			digits[num_digits++] = (char)('0' + n % 10);
+		host += ':';
+		while (num_digits)
+			host += digits[--num_digits];
+	}
+	const string path_and_query = parsed.GetPathAndQuery();
+	const size_t query_start = std::min(path_and_query.find('?'), path_and_query.size());
+	const string path = HttpS3Signer_Decode(path_and_query.data(), query_start, false);
+	const string date_time = FormatTime(utcMs);
+	const string date = date_time.substr(0, 8);
+	const string scope = string(date).append(1, '/').append(m_region).append(1, '/').append(m_service).append("/aws4_request");
+
+	// The canonical request, whose digest is what gets signed:
+	string canonical;
+	canonical.reserve(512);
+	canonical.append(HttpS3Signer_MethodName(method)).append(1, '\n');
+	AppendEncoded(canonical, path.data(), path.size(), true);
+	canonical += '\n';
+	canonical.append(query_start < path_and_query.size() ? CanonicalQuery(path_and_query.data() + query_start + 1, path_and_query.size() - query_start - 1) : string()).append(1, '\n');
+	canonical.append("host:").append(host).append(1, '\n');
+	canonical.append("x-amz-content-sha256:").append(HTTP_S3_SIGNER_UNSIGNED_PAYLOAD).append(1, '\n');
+	canonical.append("x-amz-date:").append(date_time).append(1, '\n');
+	if (!m_sessionToken.empty())
+		canonical.append("x-amz-security-token:").append(m_sessionToken).append(1, '\n');
+	const char* signed_headers = m_sessionToken.empty() ? "host;x-amz-content-sha256;x-amz-date" : "host;x-amz-content-sha256;x-amz-date;x-amz-security-token";
+	canonical.append(1, '\n').append(signed_headers).append(1, '\n').append(HTTP_S3_SIGNER_UNSIGNED_PAYLOAD);
+
+	const string string_to_sign = string("AWS4-HMAC-SHA256\n").append(date_time).append(1, '\n').append(scope).append(1, '\n').append(HttpS3Signer_Sha256Hex(canonical));
+	const string key = HttpS3Signer_Hmac(HttpS3Signer_Hmac(HttpS3Signer_Hmac(HttpS3Signer_Hmac(string("AWS4").append(m_secretKey), date), m_region), m_service), "aws4_request");
+	const string signature = HttpS3Signer_Hmac(key, string_to_sign);
+
+	headers.Set("x-amz-date", date_time);
+	headers.Set("x-amz-content-sha256", HTTP_S3_SIGNER_UNSIGNED_PAYLOAD);
+	if (!m_sessionToken.empty())
+		headers.Set("x-amz-security-token", m_sessionToken);
+	headers.Set("Authorization", string("AWS4-HMAC-SHA256 Credential=").append(m_accessKeyId).append(1, '/').append(scope)
+		.append(", SignedHeaders=").append(signed_headers).append(", Signature=").append(HttpDigest::ToHex((const unsigned char*)signature.data(), signature.size())));
+}
@@ -0,0 +1,55 @@
+// HttpS3Signer:
+// Signs requests to S3 and S3-compatible object storage (MinIO, Ceph, R2,
+// Spaces, ...) with AWS Signature Version 4, as headers to add to a request:
+// x-amz-date, x-amz-content-sha256, x-amz-security-token (for temporary
+// credentials) and Authorization. The body isn't signed (UNSIGNED-PAYLOAD,
+// which S3 accepts over HTTPS), so a request can be signed without reading
+// the file it uploads, and must be signed again for each attempt, as the
+// signature is only good for 15 minutes (see HttpMultipartUpload, whose
+// requests do that). Only the host and the x-amz- headers are signed, so
+// the headers that curl adds don't matter.
+// Prefer short-lived credentials from your own backend (e.g. from STS) over
+// keys that are shipped with the app; SetCredentials() swaps them when they
+// are renewed. Subclass it and override Sign() for other schemes, e.g. a
+// bearer token for a gateway of your own.
+// App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+
+#include "HttpHeaders.h"
+#include "HttpRequest.h"
+#include "util/ptr.h"
+
+class HttpS3Signer : public IRefCounted {
+public:
+	HttpS3Signer(const std::string& accessKeyId, const std::string& secretKey, const std::string& region, const std::string& sessionToken = std::string(), const std::string& service = "s3");
+	virtual ~HttpS3Signer() {}
+
+	void SetCredentials(const std::string& accessKeyId, const std::string& secretKey, const std::string& sessionToken = std::string());
+	// Add clockOffsetMs to the device's clock when signing, e.g. the difference from a server's Date header, as
+	// requests more than 15 minutes out are refused (RequestTimeTooSkewed):
+	void SetClockOffset(int64 clockOffsetMs) { m_clockOffsetMs = clockOffsetMs; }
+
+	// Add the headers that sign a method request to url, sent now, to headers:
+	virtual void Sign(HttpRequest::Method method, const std::string& url, HttpHeaders& headers) const;
+	// As Sign(), at utcMs (ms since 1970), e.g. to check against published test vectors:
+	void SignAt(HttpRequest::Method method, const std::string& url, uint64 utcMs, HttpHeaders& headers) const;
+
+	// The pieces, for other uses of the same scheme:
+	static std::string FormatTime(uint64 utcMs); // ISO 8601 basic format, e.g. "20130524T000000Z"
+	static void AppendEncoded(std::string& out, const char* pText, size_t length, bool keepSlashes); // SigV4's URI encoding
+	static std::string CanonicalQuery(const char* pQuery, size_t length); // Decoded, encoded again and sorted
+
+private:
+	std::string m_accessKeyId;
+	std::string m_secretKey;
+	std::string m_sessionToken;
+	const std::string m_region;
+	const std::string m_service;
+	int64 m_clockOffsetMs;
+};
@@ -0,0 +1,362 @@
+// HttpScheduler:
+// The queue of requests that are waiting for a free HttpClient worker.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpScheduler.h"
+
+#include <IwMath.h>
+#include <s3eDebug.h>
+
+using std::string;
+
+HttpScheduler::Queue::iterator HttpScheduler::FindPlace(Queue& queue, uint64 deadlineMs) {
+	auto it = queue.end();
+	if (!deadlineMs)
+		return it;
+	while (it != queue.begin()) {
+		auto prev = it;
+		if ((*--prev)->m_deadlineMs && (*prev)->m_deadlineMs <= deadlineMs)
+			break;
+		it = prev;
+	}
+	return it;
+}
+
+void HttpScheduler::Push(const Ptr<HttpRequest>& pRequest, uint64 notBeforeMs) {
+	IwAssert(HTTP_CLIENT, pRequest->m_pScheduler == nullptr && pRequest->m_pScheduleHost == nullptr); // A request can only be queued once at a time
+	if (notBeforeMs)
+		pRequest->m_notBeforeMs = notBeforeMs;
+	if (pRequest->m_deadlineMs)
+		m_timers.Set(pRequest->m_deadlineTimer, pRequest->m_deadlineMs, fastdelegate::MakeDelegate(pRequest.ptr(), &HttpRequest::HandleDeadline));
+	if (pRequest->m_notBeforeMs) {
+		// (Kept when the request is moved, e.g. by SetPriority(), until its timer lets it go)
+		pRequest->m_scheduleIt = m_delayed.insert(m_delayed.end(), pRequest);
+		pRequest->m_pScheduler = this;
+		m_size++;
+		m_timers.Set(pRequest->m_notBeforeTimer, pRequest->m_notBeforeMs, fastdelegate::MakeDelegate(pRequest.ptr(), &HttpRequest::HandleNotBefore));
+		return;
+	}
+	const string& origin = pRequest->GetOrigin();
+	auto host_it = m_hosts.find(origin);
+	if (host_it == m_hosts.end()) {
+		host_it = m_hosts.insert(std::make_pair(origin, Host())).first;
+		host_it->second.origin = origin;
+		host_it->second.maxActive = GetLimit(origin);
+		auto breaker_it = m_breakers.find(origin);
+		if (breaker_it != m_breakers.end())
+			host_it->second.pBreaker = &breaker_it->second;
+	}
+	Host* p_host = &host_it->second;
+	const HttpRequest::Priority priority = pRequest->GetPriority();
+	Queue& queue = p_host->queues[priority];
+	if (queue.empty())
+		p_host->ringIt[priority] = m_rings[priority].insert(m_rings[priority].end(), p_host);
+	if (pRequest->m_deadlineMs)
+		m_numDeadlines[priority]++;
+	pRequest->m_scheduleIt = queue.insert(FindPlace(queue, pRequest->m_deadlineMs), pRequest);
+	pRequest->m_pScheduler = this;
+	pRequest->m_pScheduleHost = p_host;
+	m_size++;
+}
+
+Ptr<HttpRequest> HttpScheduler::Pop(bool (*pfnAccept)(const HttpRequest& request, const void* pContext), const void* pContext) {
+	for (int p = HttpRequest::NUM_PRIORITIES - 1; p >= 0; p--) {
+		Ring& ring = m_rings[p];
+		auto chosen = ring.end();
+		if (m_numDeadlines[p]) {
+			// The earliest deadline goes first, whichever host it is for (each host's requests with deadlines
+			// are at the front of its queue):
+			uint64 earliest_ms = 0;
+			for (auto it = ring.begin(); it != ring.end(); it++) {
+				Host* p_host = *it;
+				const HttpRequest& front = *p_host->queues[p].front().ptr();
+				if (!front.m_deadlineMs || (earliest_ms && front.m_deadlineMs >= earliest_ms) || !p_host->CanStart())
+					continue;
+				if (pfnAccept && !pfnAccept(front, pContext))
+					continue;
+				chosen = it;
+				earliest_ms = front.m_deadlineMs;
+			}
+		}
+		for (auto it = ring.begin(); it != ring.end() && chosen == ring.end(); it++) {
+			Host* p_host = *it;
+			if (!p_host->CanStart())
+				continue;
+			if (pfnAccept && !pfnAccept(*p_host->queues[p].front().ptr(), pContext))
+				continue;
+			chosen = it;
+		}
+		if (chosen == ring.end())
+			continue;
+		Host* p_host = *chosen;
+		Queue& queue = p_host->queues[p];
+		Ptr<HttpRequest> p_request = std::move(queue.front());
+		queue.pop_front();
+		if (p_request->m_deadlineMs) {
+			m_numDeadlines[p]--;
+			p_request->m_deadlineTimer.Cancel(); // (The client checks it from here on)
+		}
+		// Let the other hosts have a turn before this one gets another request:
+		if (queue.empty())
+			ring.erase(chosen);
+		else
+			ring.splice(ring.end(), ring, chosen);
+		p_host->numActive++;
+		p_request->m_pScheduler = nullptr; // Note: m_pScheduleHost stays set until HandleFinished()
+		m_size--;
+		return p_request;
+	}
+	return nullptr;
+}
+
+void HttpScheduler::Remove(HttpRequest* pRequest) {
+	IwAssert(HTTP_CLIENT, pRequest->m_pScheduler == this);
+	// Keep the request alive until we're done with it; the queue may hold the last reference:
+	Ptr<HttpRequest> p_request(pRequest);
+	Ptr<HttpRequest> p_successor = nullptr;
+	if (!pRequest->m_followers.empty() || !pRequest->m_coalesceKey.empty()) {
+		// The first of its followers that hasn't been cancelled too takes over, along with the others:
+		const string key = pRequest->m_coalesceKey; // (Empty if new requests already follow something else)
+		RemoveLeader(pRequest);
+		std::vector< Ptr<HttpRequest> > followers;
+		followers.swap(pRequest->m_followers);
+		for (auto it = followers.begin(); it != followers.end(); it++) {
+			if ((*it)->GetStatus() != HttpRequest::PENDING)
+				continue;
+			if (!p_successor)
+				p_successor = std::move(*it);
+			else
+				p_successor->m_followers.push_back(std::move(*it));
+		}
+		if (p_successor && !key.empty())
+			SetLeader(p_successor.ptr(), key);
+	}
+	if (Host* p_host = pRequest->m_pScheduleHost) {
+		const HttpRequest::Priority priority = pRequest->GetPriority();
+		Queue& queue = p_host->queues[priority];
+		queue.erase(pRequest->m_scheduleIt);
+		if (pRequest->m_deadlineMs)
+			m_numDeadlines[priority]--;
+		if (queue.empty())
+			m_rings[priority].erase(p_host->ringIt[priority]);
+		pRequest->m_pScheduleHost = nullptr;
+		ReleaseHost(p_host);
+	} else {
+		m_delayed.erase(pRequest->m_scheduleIt); // (Its m_notBeforeMs is kept, in case it is pushed again)
+		pRequest->m_notBeforeTimer.Cancel();
+	}
+	pRequest->m_deadlineTimer.Cancel();
+	pRequest->m_pScheduler = nullptr;
+	m_size--;
+	if (p_successor)
+		Push(p_successor);
+}
+
+void HttpScheduler::Reprioritize(HttpRequest* pRequest, HttpRequest::Priority priority) {
+	IwAssert(HTTP_CLIENT, pRequest->m_pScheduler == this);
+	const HttpRequest::Priority old_priority = pRequest->m_priority;
+	pRequest->m_priority = priority;
+	Host* p_host = pRequest->m_pScheduleHost;
+	if (!p_host || priority == old_priority)
+		return; // (A request that is held back only goes into a queue once its timer lets it go)
+	// The request's node moves from one of its host's queues to the other, so its iterator stays valid:
+	Queue& from = p_host->queues[old_priority];
+	Queue& to = p_host->queues[priority];
+	if (to.empty())
+		p_host->ringIt[priority] = m_rings[priority].insert(m_rings[priority].end(), p_host);
+	to.splice(FindPlace(to, pRequest->m_deadlineMs), from, pRequest->m_scheduleIt);
+	if (from.empty())
+		m_rings[old_priority].erase(p_host->ringIt[old_priority]);
+	if (pRequest->m_deadlineMs) {
+		m_numDeadlines[old_priority]--;
+		m_numDeadlines[priority]++;
+	}
+}
+
+void HttpScheduler::HandleFinished(HttpRequest* pRequest) {
+	Host* p_host = pRequest->m_pScheduleHost;
+	if (!p_host)
+		return;
+	IwAssert(HTTP_CLIENT, pRequest->m_pScheduler == nullptr && p_host->numActive > 0);
+	p_host->numActive--;
+	pRequest->m_pScheduleHost = nullptr;
+	ReleaseHost(p_host);
+}
+
+void HttpScheduler::Clear() {
+	for (auto host_it = m_hosts.begin(); host_it != m_hosts.end(); host_it++) {
+		for (int p = 0; p < HttpRequest::NUM_PRIORITIES; p++) {
+			Queue& queue = host_it->second.queues[p];
+			for (auto it = queue.begin(); it != queue.end(); it++) {
+				(*it)->m_pScheduler = nullptr;
+				(*it)->m_pScheduleHost = nullptr;
+				(*it)->m_deadlineTimer.Cancel();
+				(*it)->ForgetCallbacks();
+				for (auto follower_it = (*it)->m_followers.begin(); follower_it != (*it)->m_followers.end(); follower_it++)
+					(*follower_it)->ForgetCallbacks();
+				(*it)->m_followers.clear();
+				(*it)->m_coalesceKey.clear();
+			}
+			queue.clear();
+		}
+	}
+	for (int p = 0; p < HttpRequest::NUM_PRIORITIES; p++) {
+		m_rings[p].clear();
+		m_numDeadlines[p] = 0;
+	}
+	for (auto it = m_delayed.begin(); it != m_delayed.end(); it++) {
+		(*it)->m_pScheduler = nullptr;
+		(*it)->m_notBeforeTimer.Cancel();
+		(*it)->m_deadlineTimer.Cancel();
+		(*it)->ForgetCallbacks();
+		for (auto follower_it = (*it)->m_followers.begin(); follower_it != (*it)->m_followers.end(); follower_it++)
+			(*follower_it)->ForgetCallbacks();
+		(*it)->m_followers.clear();
+		(*it)->m_coalesceKey.clear();
+	}
+	m_delayed.clear();
+	for (auto it = m_leaders.begin(); it != m_leaders.end(); it++)
+		it->second->m_coalesceKey.clear();
+	m_leaders.clear();
+	// Hosts with requests still in progress are kept, so that HandleFinished() still works for them:
+	for (auto host_it = m_hosts.begin(); host_it != m_hosts.end();) {
+		if (host_it->second.numActive == 0)
+			m_hosts.erase(host_it++);
+		else
+			host_it++;
+	}
+	m_size = 0;
+}
+
+size_t HttpScheduler::NumRunnable(HttpRequest::Priority priority) const {
+	size_t count = 0;
+	const Ring& ring = m_rings[priority];
+	for (auto it = ring.begin(); it != ring.end(); it++) {
+		const Host* p_host = *it;
+		const size_t num_queued = p_host->queues[priority].size();
+		if (p_host->pBreaker && p_host->pBreaker->IsTripped())
+			count += p_host->numActive == 0 ? 1 : 0;
+		else if (p_host->maxActive == 0)
+			count += num_queued;
+		else if (p_host->numActive < p_host->maxActive)
+			count += MIN(num_queued, (size_t)(p_host->maxActive - p_host->numActive));
+	}
+	return count;
+}
+
+void HttpScheduler::SetMaxPerHost(uint maxRequests) {
+	m_maxPerHost = maxRequests;
+	for (auto it = m_hosts.begin(); it != m_hosts.end(); it++)
+		it->second.maxActive = GetLimit(it->first);
+}
+
+void HttpScheduler::SetHostLimit(const string& origin, uint maxRequests) {
+	const string key = GetOrigin(origin);
+	m_hostLimits[key] = maxRequests;
+	auto it = m_hosts.find(key);
+	if (it != m_hosts.end())
+		it->second.maxActive = maxRequests;
+}
+
+void HttpScheduler::SetCircuitBreaker(uint failureThreshold, uint coolDownMs) {
+	m_failureThreshold = failureThreshold;
+	m_coolDownMs = coolDownMs;
+	if (!failureThreshold) {
+		for (auto it = m_hosts.begin(); it != m_hosts.end(); it++)
+			it->second.pBreaker = nullptr;
+		m_breakers.clear();
+	}
+}
+
+void HttpScheduler::HandleResult(const string& origin, bool failed, uint64 nowMs) {
+	if (!m_failureThreshold)
+		return;
+	auto it = m_breakers.find(origin);
+	if (!failed) {
+		if (it == m_breakers.end())
+			return;
+		// Closed again:
+		auto host_it = m_hosts.find(origin);
+		if (host_it != m_hosts.end())
+			host_it->second.pBreaker = nullptr;
+		m_breakers.erase(it);
+		return;
+	}
+	if (it == m_breakers.end()) {
+		it = m_breakers.insert(std::make_pair(origin, Breaker())).first;
+		auto host_it = m_hosts.find(origin);
+		if (host_it != m_hosts.end())
+			host_it->second.pBreaker = &it->second;
+	}
+	Breaker& breaker = it->second;
+	breaker.numFailures++;
+	// It trips, or its probe failed (failures of requests that were already in progress while it was open change nothing):
+	if (breaker.IsTripped() ? nowMs >= breaker.openUntilMs : breaker.numFailures >= m_failureThreshold) {
+		breaker.openUntilMs = nowMs + MAX(m_coolDownMs, 1u);
+		s3eDebugTracePrintf("HttpScheduler: %s has failed %u times in a row; failing its requests fast for %u ms", origin.c_str(), breaker.numFailures, m_coolDownMs);
+	}
+}
+
+uint64 HttpScheduler::GetOpenUntil(const string& origin, uint64 nowMs) const {
+	if (m_breakers.empty())
+		return 0;
+	auto it = m_breakers.find(origin);
+	return it != m_breakers.end() && nowMs < it->second.openUntilMs ? it->second.openUntilMs : 0;
+}
+
+HttpRequest* HttpScheduler::FindLeader(const string& key) const {
+	auto it = m_leaders.find(key);
+	return it != m_leaders.end() ? it->second : nullptr;
+}
+
+void HttpScheduler::SetLeader(HttpRequest* pRequest, const string& key) {
+	HttpRequest*& p_leader = m_leaders[key];
+	if (p_leader)
+		p_leader->m_coalesceKey.clear(); // Too late for anyone to follow that one now
+	p_leader = pRequest;
+	pRequest->m_coalesceKey = key;
+}
+
+void HttpScheduler::RemoveLeader(HttpRequest* pRequest) {
+	if (pRequest->m_coalesceKey.empty())
+		return;
+	auto it = m_leaders.find(pRequest->m_coalesceKey);
+	if (it != m_leaders.end() && it->second == pRequest)
+		m_leaders.erase(it);
+	pRequest->m_coalesceKey.clear();
+}
+
+uint HttpScheduler::GetLimit(const string& origin) const {
+	auto it = m_hostLimits.find(origin);
+	return it != m_hostLimits.end() ? it->second : m_maxPerHost;
+}
+
+void HttpScheduler::ReleaseHost(Host* pHost) {
+	if (pHost->numActive > 0)
+		return;
+	for (int p = 0; p < HttpRequest::NUM_PRIORITIES; p++) {
+		if (!pHost->queues[p].empty())
+			return;
+	}
+	m_hosts.erase(m_hosts.find(pHost->origin));
+}
+
+void HttpScheduler::HandleNotBefore(HttpRequest* pRequest) {
+	Ptr<HttpRequest> p_request = std::move(*pRequest->m_scheduleIt);
+	m_delayed.erase(pRequest->m_scheduleIt);
+	p_request->m_pScheduler = nullptr;
+	p_request->m_notBeforeMs = 0;
+	m_size--;
+	Push(p_request);
+}
+
+void HttpScheduler::HandleDeadline(HttpRequest* pRequest) {
+	if (m_expireDelegate)
+		m_expireDelegate(pRequest);
+}
+
+string HttpScheduler::GetOrigin(const string& url) {
+	return HttpUrl::GetOrigin(url);
+}
@@ -0,0 +1,142 @@
+// HttpScheduler:
+// The queue of requests that are waiting for a free HttpClient worker.
+// Requests are taken from a multi-level priority queue: the highest priority
+// first. Within each priority level, the hosts that have requests waiting
+// take turns (round-robin), and each host's requests are sent in the order
+// they were queued. Requests with a deadline (see HttpRequest::SetDeadline())
+// come before all of those, earliest deadline first, whichever host they are
+// for. Each host can also be limited to a maximum number of concurrent
+// requests, so one worker pool can serve several hosts at once without
+// hammering any single one of them.
+// A request can also be held back until a given time (e.g. a retry that is
+// backing off), in which case it waits in a separate queue until its timer on
+// the client's HttpTimerWheel is called. Deadlines are timers too: once one
+// passes, the request is handed to the delegate given to SetExpireDelegate(),
+// to be cancelled.
+// Hosts that keep failing can have their circuit broken (see
+// SetCircuitBreaker()): once one has failed enough times in a row, it is only
+// sent one request at a time, and HttpClient fails the rest fast, without a
+// worker, until a cool-down has passed and a probe has got through.
+// Used by HttpClient; all methods must be called from the app thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HttpRequest.h"
+
+struct HttpScheduler_Host;
+struct HttpScheduler_Breaker;
+typedef std::list< HttpScheduler_Host*, HttpSlabAllocator<HttpScheduler_Host*> > HttpScheduler_Ring; // (Its nodes come from HttpSlab, like the queues')
+
+// Circuit breaking data for one host (origin), kept from its first failure until it succeeds again:
+struct HttpScheduler_Breaker {
+	uint numFailures; // In a row
+	uint64 openUntilMs; // Once it has tripped, requests fail fast until then (an s3eTimerGetMs() time); 0 until it has
+	HttpScheduler_Breaker() : numFailures(0), openUntilMs(0) {}
+	bool IsTripped() const { return openUntilMs != 0; } // Open, or letting probes through
+};
+
+// Scheduling data for one host (origin), kept while it has requests queued or in progress:
+struct HttpScheduler_Host {
+	std::string origin; // e.g. "https://www.example.com:443"
+	uint numActive; // Requests to this host that have been popped but not finished yet
+	uint maxActive; // 0 for no limit
+	const HttpScheduler_Breaker* pBreaker; // Its entry in HttpScheduler::m_breakers, or nullptr
+	HttpRequest::ScheduleQueue queues[HttpRequest::NUM_PRIORITIES];
+	HttpScheduler_Ring::iterator ringIt[HttpRequest::NUM_PRIORITIES]; // Our place in that priority's round-robin; valid while queues[p] is not empty
+	HttpScheduler_Host() : numActive(0), maxActive(0), pBreaker(nullptr) {}
+	// (A host whose breaker has tripped gets one request at a time: the probe, or one that fails fast)
+	bool CanStart() const { return (maxActive == 0 || numActive < maxActive) && !(numActive && pBreaker && pBreaker->IsTripped()); }
+};
+
+class HttpScheduler {
+public:
+	typedef fastdelegate::FastDelegate1<HttpRequest*> ExpireDelegate;
+	HttpScheduler(HttpTimerWheel& timers) : m_timers(timers), m_size(0), m_maxPerHost(0), m_failureThreshold(0), m_coolDownMs(0) { for (int p = 0; p < HttpRequest::NUM_PRIORITIES; p++) m_numDeadlines[p] = 0; }
+	~HttpScheduler() { Clear(); }
+
+	// Called with each queued request whose deadline has passed, as the timers are advanced, to Remove() it (e.g. by
+	// cancelling it). Expired requests are left in the queue if there is none.
+	void SetExpireDelegate(ExpireDelegate expireDelegate) { m_expireDelegate = expireDelegate; }
+	// Add pRequest at the back of its host's queue for its priority level. If notBeforeMs is set
+	// (an s3eTimerGetMs() time), it is held back until then instead, once the timers get there:
+	void Push(const Ptr<HttpRequest>& pRequest, uint64 notBeforeMs = 0);
+	// Remove and return the request that should be sent next, or nullptr if there is none
+	// (or if every host that has requests waiting is already at its limit).
+	// The request counts against its host's limit until HandleFinished() is called.
+	// If pfnAccept is given, hosts whose next request it turns down are passed over (see HttpWorkPool).
+	Ptr<HttpRequest> Pop(bool (*pfnAccept)(const HttpRequest& request, const void* pContext) = nullptr, const void* pContext = nullptr);
+	// Remove pRequest from the queue in O(1), e.g. because it was cancelled. If identical requests
+	// were following it (see HttpRequest::SetCoalesce()), the first of them is queued in its place.
+	void Remove(HttpRequest* pRequest);
+	// Move pRequest (which must be queued) to the back of its host's queue for priority (or, if it has a deadline,
+	// to its place among those with deadlines), in O(1) otherwise. Unlike Remove() and Push(), the requests that are
+	// following it stay with it, and its timers are left alone. Called by HttpRequest::SetPriority().
+	void Reprioritize(HttpRequest* pRequest, HttpRequest::Priority priority);
+	// Call once a request returned by Pop() has finished, so that its host can start another:
+	void HandleFinished(HttpRequest* pRequest);
+	// Remove all requests, dropping their callbacks:
+	void Clear();
+
+	bool Empty() const { return m_size == 0; } // Including the requests that are held back
+	size_t Size() const { return m_size; }
+	size_t NumDelayed() const { return m_delayed.size(); } // Held back
+	// How many requests of the given priority could be started right now if workers were available:
+	size_t NumRunnable(HttpRequest::Priority priority) const;
+
+	// Per-host concurrency limits (0 for no limit). SetHostLimit() overrides the default for one origin.
+	void SetMaxPerHost(uint maxRequests);
+	void SetHostLimit(const std::string& origin, uint maxRequests);
+
+	// Circuit breaking: once failureThreshold requests in a row to a host have failed (0, the default, for never),
+	// its breaker trips. For coolDownMs, GetOpenUntil() says its requests are to fail fast; after that, they are let
+	// through one at a time, as probes, until one succeeds and closes the breaker again. A probe that fails opens it
+	// for another coolDownMs. Either way, a tripped host only ever has one request in progress.
+	void SetCircuitBreaker(uint failureThreshold, uint coolDownMs);
+	// Call with the outcome of each request to origin that says something about it (e.g. not one that was aborted):
+	void HandleResult(const std::string& origin, bool failed, uint64 nowMs);
+	// Until when requests to origin are to fail fast, or 0 if they aren't (an s3eTimerGetMs() time):
+	uint64 GetOpenUntil(const std::string& origin, uint64 nowMs) const;
+
+	// Coalescing: the request (queued or in progress) that new requests with this key should follow, or nullptr:
+	HttpRequest* FindLeader(const std::string& key) const;
+	void SetLeader(HttpRequest* pRequest, const std::string& key);
+	void RemoveLeader(HttpRequest* pRequest); // Once pRequest can't take any more followers. O(log n)
+
+	// Get the origin ("scheme://host:port", lower case) of a URL, which is what limits apply to:
+	static std::string GetOrigin(const std::string& url);
+
+private:
+	friend class HttpRequest; // (For its timers' delegates)
+	typedef HttpRequest::ScheduleQueue Queue;
+	typedef HttpScheduler_Host Host;
+	typedef HttpScheduler_Ring Ring;
+	HttpTimerWheel& m_timers;
+	ExpireDelegate m_expireDelegate;
+	std::map<std::string, Host> m_hosts;
+	Ring m_rings[HttpRequest::NUM_PRIORITIES]; // Hosts with requests waiting at each priority, in round-robin order
+	size_t m_size;
+	size_t m_numDeadlines[HttpRequest::NUM_PRIORITIES]; // Requests with deadlines in the hosts' queues at each priority
+	uint m_maxPerHost;
+	std::map<std::string, uint> m_hostLimits;
+	typedef HttpScheduler_Breaker Breaker;
+	uint m_failureThreshold; // 0 if circuit breaking is off
+	uint m_coolDownMs;
+	std::map<std::string, Breaker> m_breakers; // By origin, for the hosts that have failed since they last succeeded
+	std::map<std::string, HttpRequest*> m_leaders; // By coalescing key. Each holds its key in m_coalesceKey.
+	Queue m_delayed; // The requests that are held back, in no particular order. They have no m_pScheduleHost yet.
+	uint GetLimit(const std::string& origin) const;
+	// Where a request with deadlineMs (0 for none) goes in a host's queue: requests with deadlines go first, earliest
+	// first (and in the order they were queued for the same one), and the rest in the order they came.
+	static Queue::iterator FindPlace(Queue& queue, uint64 deadlineMs);
+	void ReleaseHost(Host* pHost); // Forget about pHost if it has nothing queued or in progress
+	void HandleNotBefore(HttpRequest* pRequest); // Move it from m_delayed to its host's queue
+	void HandleDeadline(HttpRequest* pRequest);
+};
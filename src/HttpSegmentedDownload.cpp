@@ -0,0 +1,219 @@
+// HttpSegmentedDownload:
+// Downloads one large file over several connections at once.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpSegmentedDownload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/iohelpers.h"
+
+using std::string;
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpSegmentedDownload::Segment: a GET of one byte range of the file, written
+// at its offset in the .tmp file. Its length is -1 for a download of the whole
+// file, if the server doesn't support ranges.
+
+class HttpSegmentedDownload::Segment : public HttpRequest {
+public:
+	Segment(const string& url, const string& tmpFile, int64 offset, int64 length) :
+		HttpRequest(GET, url.c_str()), m_tmpFile(tmpFile), m_offset(offset), m_length(length),
+		m_pFile(nullptr), m_received(0), m_rangeOk(false), m_complete(false)
+	{
+		// Every segment of the file has the same URL, but they're anything but identical requests:
+		SetCoalesce(false);
+		SetUseCache(false);
+		SetCompression(COMPRESSION_REFUSE); // The file is saved as the server has it, at the offsets the probe found
+	}
+
+	bool IsComplete() const { return m_complete; }
+	int64 GetBytesReceived() const { return m_received; }
+
+	virtual void HandleRequestStart() {
+		if (m_length >= 0) {
+			// If a previous attempt was preempted, we only need to ask for the part we don't have yet:
+			char range[64];
+			snprintf(range, sizeof(range), "bytes=%lld-%lld", (long long)(m_offset + m_received), (long long)(m_offset + m_length - 1));
+			SetAttemptHeader("Range", range);
+		} else {
+			m_received = 0; // Without ranges, every attempt starts over
+		}
+		m_rangeOk = m_complete = false;
+		HttpRequest::HandleRequestStart();
+	}
+
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+		if (m_length < 0) {
+			m_rangeOk = httpStatusCode == 200;
+		} else if (httpStatusCode == 206) {
+			// Make sure that this is exactly the range we asked for: "Content-Range: bytes <start>-<end>/<size>"
+			const char* p_range = headers.Find("Content-Range");
+			long long start = -1, end = -1;
+			m_rangeOk = p_range && sscanf(p_range, "bytes %lld-%lld", &start, &end) == 2
+				&& start == m_offset + m_received && end == m_offset + m_length - 1;
+		}
+	}
+
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) {
+		if (!m_rangeOk)
+			return 0; // Not the data we asked for (e.g. an error page, or the whole file): abort
+		if (m_length >= 0 && m_received + (int64)size > m_length)
+			return 0;
+		if (!m_pFile) {
+			m_pFile = s3eFileOpen(m_tmpFile.c_str(), "r+");
+			if (!m_pFile || s3eFileSeek(m_pFile, (int32)(m_offset + m_received), S3E_FILESEEK_SET) != S3E_RESULT_SUCCESS)
+				return 0;
+		}
+		if (s3eFileWrite(contents, 1, size, m_pFile) != size)
+			return 0;
+		m_received += size;
+		return size;
+	}
+
+	virtual void Worker_HandleDone(bool success, int httpStatusCode) {
+		if (m_pFile) {
+			s3eFileClose(m_pFile);
+			m_pFile = nullptr;
+		}
+		m_complete = success && m_rangeOk && (m_length < 0 || m_received == m_length);
+		HttpRequest::Worker_HandleDone(success, httpStatusCode);
+	}
+
+private:
+	const string m_tmpFile;
+	const int64 m_offset;
+	const int64 m_length;
+	// Only modified by the worker thread while the segment is being transferred:
+	s3eFile* m_pFile;
+	volatile int64 m_received;
+	bool m_rangeOk;
+	bool m_complete;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpSegmentedDownload:
+
+HttpSegmentedDownload::HttpSegmentedDownload(HttpClient& client, const string& url, const string& destFile, uint numSegments, uint minSegmentSize) :
+	HttpRequest(HEAD, url.c_str()),
+	m_client(client),
+	m_destFile(destFile),
+	m_maxSegments(numSegments ? numSegments : 1),
+	m_minSegmentSize(minSegmentSize ? minSegmentSize : 1),
+	m_fileSize(-1),
+	m_numSegmentsDone(0),
+	m_failed(false)
+{
+	SetCompression(COMPRESSION_REFUSE); // Its Content-Length must be the file's size, not that of a compressed response
+}
+
+HttpSegmentedDownload::~HttpSegmentedDownload() {
+	// Segments that are still waiting for a worker are no use to anyone now:
+	for (auto it = m_segments.begin(); it != m_segments.end(); it++)
+		(*it)->Cancel();
+}
+
+int64 HttpSegmentedDownload::GetBytesReceived() const {
+	int64 total = 0;
+	for (auto it = m_segments.begin(); it != m_segments.end(); it++)
+		total += (*it)->GetBytesReceived();
+	return total;
+}
+
+void HttpSegmentedDownload::HandleResponse(bool success, int httpStatusCode) {
+	if (!success) {
+		HttpRequest::HandleResponse(success, httpStatusCode);
+		return;
+	}
+	const HttpHeaders& headers = GetResponseHeaders();
+	const char* p_length = headers.Find("Content-Length");
+	const char* p_ranges = headers.Find("Accept-Ranges");
+	m_fileSize = p_length ? strtoll(p_length, nullptr, 10) : -1;
+	if (headers.Find("Content-Encoding"))
+		m_fileSize = -1; // That's the compressed length (if the server compressed it anyway), so the file is downloaded in one piece
+	const bool ranges = m_fileSize > 0 && p_ranges && strstr(p_ranges, "bytes");
+
+	// Create the .tmp file, and make it the full size of the file up front, so that every segment
+	// can write at its own offset no matter which of them arrives first:
+	const string tmp_file = string(m_destFile).append(".tmp");
+	s3eFile* p_file = nullptr;
+	try {
+		MakePath(DirName(m_destFile));
+		p_file = s3eFileOpen(tmp_file.c_str(), "w");
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpSegmentedDownload: %s", e.what());
+	}
+	if (p_file && ranges) {
+		const char zero = 0;
+		if (s3eFileSeek(p_file, (int32)(m_fileSize - 1), S3E_FILESEEK_SET) != S3E_RESULT_SUCCESS || s3eFileWrite(&zero, 1, 1, p_file) != 1) {
+			s3eFileClose(p_file);
+			p_file = nullptr;
+		}
+	}
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpSegmentedDownload: Unable to create %s", tmp_file.c_str());
+		s3eFileDelete(tmp_file.c_str());
+		HttpRequest::HandleResponse(false, httpStatusCode);
+		return;
+	}
+	s3eFileClose(p_file);
+
+	if (m_fileSize == 0) {
+		s3eFileRename(tmp_file.c_str(), m_destFile.c_str());
+		HttpRequest::HandleResponse(true, httpStatusCode);
+		return;
+	}
+	if (ranges) {
+		const uint profile_max = m_client.GetNetworkProfile().maxSegments; // (Fewer on a slow network)
+		const uint max_segments = profile_max && profile_max < m_maxSegments ? profile_max : m_maxSegments;
+		int64 num_segments = m_fileSize / m_minSegmentSize;
+		num_segments = num_segments < 1 ? 1 : num_segments > max_segments ? max_segments : num_segments;
+		for (int64 i = 0; i < num_segments; i++) {
+			const int64 offset = m_fileSize * i / num_segments;
+			const int64 end = m_fileSize * (i + 1) / num_segments;
+			m_segments.push_back(new Segment(GetURL(), tmp_file, offset, end - offset));
+		}
+	} else {
+		s3eDebugTracePrintf("HttpSegmentedDownload: %s has no known size or does not support ranges; downloading it in one piece", GetURL().c_str());
+		m_segments.push_back(new Segment(GetURL(), tmp_file, 0, -1));
+	}
+	// Our status stays HEADERS until every segment is done, so our callback won't be called yet:
+	m_pSelf = this;
+	for (auto it = m_segments.begin(); it != m_segments.end(); it++) {
+		(*it)->SetPriority(GetPriority());
+		m_client.QueueRequest(*it, this, &HttpSegmentedDownload::HandleSegmentDone);
+	}
+}
+
+void HttpSegmentedDownload::HandleSegmentDone(Ptr<HttpRequest> pSegment) {
+	m_numSegmentsDone++;
+	if (!static_cast<Segment*>(pSegment.ptr())->IsComplete() && !m_failed) {
+		m_failed = true;
+		s3eDebugTracePrintf("HttpSegmentedDownload: A segment of %s failed", GetURL().c_str());
+		// There's no point in starting the segments that are still waiting:
+		for (auto it = m_segments.begin(); it != m_segments.end(); it++) {
+			if ((*it)->GetStatus() == PENDING) {
+				(*it)->Cancel();
+				m_numSegmentsDone++;
+			}
+		}
+	}
+	if (m_numSegmentsDone == m_segments.size())
+		Finish();
+}
+
+void HttpSegmentedDownload::Finish() {
+	// Every segment has either arrived in full or failed:
+	const string tmp_file = string(m_destFile).append(".tmp");
+	if (m_failed)
+		s3eFileDelete(tmp_file.c_str());
+	else
+		s3eFileRename(tmp_file.c_str(), m_destFile.c_str());
+	m_status = m_failed ? ERROR : DONE;
+	Ptr<HttpSegmentedDownload> p_this = m_pSelf; // We may be deleted once this goes out of scope
+	m_pSelf = nullptr;
+	NotifyDone();
+}
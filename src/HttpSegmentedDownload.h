@@ -0,0 +1,54 @@
+// HttpSegmentedDownload:
+// Downloads one large file over several connections at once, which is much
+// faster than a single TCP stream on high-latency networks such as LTE.
+// The request itself is a HEAD request that probes the file's size and
+// whether the server supports byte ranges. Once it has a response, it splits
+// the file into segments and queues a ranged GET for each of them with the
+// same HttpClient. Every segment is written straight to its offset in
+// "<destFile>.tmp", which is only renamed to destFile once every segment has
+// arrived in full. If the server doesn't support ranges, the file is
+// downloaded in one piece instead.
+//
+// Queue it like any other request:
+//     client.QueueRequest(new HttpSegmentedDownload(client, url, destFile), pCallback);
+// pCallback is called once the whole file is done (or has failed), not when the probe is.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <vector>
+
+#include "HttpClient.h"
+
+class HttpSegmentedDownload : public HttpRequest {
+public:
+	// The file is split into at most numSegments segments of at least minSegmentSize bytes each.
+	HttpSegmentedDownload(HttpClient& client, const std::string& url, const std::string& destFile, uint numSegments = 4, uint minSegmentSize = 512 * 1024);
+	~HttpSegmentedDownload();
+
+	// The number of segments the file was split into; 0 until the probe has finished:
+	uint GetNumSegments() const { return (uint)m_segments.size(); }
+	// The size of the file (-1 if unknown) and how much of it has been received so far:
+	int64 GetFileSize() const { return m_fileSize; }
+	int64 GetBytesReceived() const;
+
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) { return size; } // A HEAD response has no body
+
+private:
+	class Segment;
+	void HandleSegmentDone(Ptr<HttpRequest> pSegment);
+	void Finish();
+
+	HttpClient& m_client;
+	const std::string m_destFile;
+	const uint m_maxSegments;
+	const uint m_minSegmentSize;
+	int64 m_fileSize;
+	std::vector< Ptr<Segment> > m_segments;
+	uint m_numSegmentsDone;
+	bool m_failed;
+	Ptr<HttpSegmentedDownload> m_pSelf; // Keeps us alive while the segments are in progress, even if nobody else holds on to us
+};
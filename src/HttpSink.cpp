@@ -0,0 +1,399 @@
+// HttpSink:
+// Stages of a pipeline that a response body is passed through as it arrives.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpSink.h"
+
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <s3eDebug.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "HttpHeaders.h"
+#include "HttpMemoryDownload.h"
+#include "util/iohelpers.h"
+
+using std::string;
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpTeeSink:
+
+bool HttpTeeSink::Worker_End(bool success) {
+	// Both ends are told, whatever the other says:
+	const bool branch_ok = m_pBranch->Worker_End(success);
+	return Worker_EndNext(success) && branch_ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpInflateSink:
+
+HttpInflateSink::~HttpInflateSink() {
+	IwAssert(HTTP_CLIENT, !m_initialised && !m_pOut); // Worker_Cleanup() must have been called from the worker thread
+}
+
+bool HttpInflateSink::Worker_Begin(const HttpHeaders& headers, int64 size) {
+	m_ended = m_failed = false;
+	if (m_initialised) {
+		inflateReset(&m_stream);
+	} else {
+		memset(&m_stream, 0, sizeof(m_stream));
+		// windowBits 15 + 32 reads either a gzip or a zlib header:
+		if (inflateInit2(&m_stream, 15 + 32) != Z_OK)
+			return false;
+		m_initialised = true;
+	}
+	if (!m_pOut && !(m_pOut = static_cast<unsigned char*>(malloc(OUT_BUFFER_SIZE))))
+		return false;
+	return HttpSink::Worker_Begin(headers, -1); // (The size is what it inflates to, which we can't know yet)
+}
+
+bool HttpInflateSink::Worker_Write(const unsigned char* pData, size_t size) {
+	m_stream.next_in = const_cast<Bytef*>(pData);
+	m_stream.avail_in = (uInt)size;
+	for (;;) {
+		if (m_ended) {
+			if (!m_stream.avail_in)
+				return true;
+			inflateReset(&m_stream); // The next member of a multi-member gzip file
+			m_ended = false;
+		}
+		m_stream.next_out = m_pOut;
+		m_stream.avail_out = OUT_BUFFER_SIZE;
+		const int result = inflate(&m_stream, Z_NO_FLUSH);
+		if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+			m_failed = true;
+			return false;
+		}
+		const size_t out = OUT_BUFFER_SIZE - m_stream.avail_out;
+		if (out && !Worker_Pass(m_pOut, out))
+			return false;
+		if (result == Z_STREAM_END)
+			m_ended = true;
+		else if (m_stream.avail_out)
+			return true; // It has taken all of the input
+	}
+}
+
+bool HttpInflateSink::Worker_End(bool success) {
+	// A body that stops part way through a member is truncated:
+	const bool ok = success && !m_failed && m_ended;
+	return Worker_EndNext(ok) && (ok || !success);
+}
+
+void HttpInflateSink::Worker_Cleanup() {
+	if (m_initialised)
+		inflateEnd(&m_stream);
+	m_initialised = false;
+	free(m_pOut);
+	m_pOut = nullptr;
+	HttpSink::Worker_Cleanup();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpDigestSink:
+
+HttpDigestSink::HttpDigestSink(HttpDigest::Type type, const string& expectedHex) :
+	m_type(type), m_expected(!expectedHex.empty()), m_complete(false), m_mismatch(false)
+{
+	if (m_expected && !HttpDigest::ParseHex(expectedHex.data(), expectedHex.size(), m_expectedDigest, HttpDigest::GetSize(type)))
+		throw std::runtime_error(string("HttpDigestSink: Not a digest of that type: ").append(expectedHex));
+}
+
+HttpDigestSink::~HttpDigestSink() {
+	IwAssert(HTTP_CLIENT, !m_context.IsActive()); // Worker_Cleanup() must have been called from the worker thread
+}
+
+bool HttpDigestSink::Worker_Begin(const HttpHeaders& headers, int64 size) {
+	m_complete = m_mismatch = false;
+	if (m_context.IsActive())
+		m_context.Abandon();
+	return m_context.Begin(m_type) && HttpSink::Worker_Begin(headers, size);
+}
+
+bool HttpDigestSink::Worker_Write(const unsigned char* pData, size_t size) {
+	m_context.Update(pData, size);
+	return Worker_Pass(pData, size);
+}
+
+bool HttpDigestSink::Worker_End(bool success) {
+	if (success && m_context.IsActive()) {
+		const size_t digest_size = m_context.Finish(m_digest);
+		m_complete = true;
+		m_mismatch = m_expected && memcmp(m_digest, m_expectedDigest, digest_size) != 0;
+		if (m_mismatch)
+			s3eDebugTracePrintf("HttpDigestSink: The body's digest is %s, not the one expected", HttpDigest::ToHex(m_digest, digest_size).c_str());
+	}
+	// The stages after this one mustn't keep what doesn't match (e.g. a file sink mustn't replace its file with it):
+	const bool ok = success && m_complete && !m_mismatch;
+	return Worker_EndNext(ok) && (ok || !success);
+}
+
+void HttpDigestSink::Worker_Cleanup() {
+	if (m_context.IsActive())
+		m_context.Abandon();
+	HttpSink::Worker_Cleanup();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpDecryptSink:
+
+HttpDecryptSink::HttpDecryptSink(Mode mode, const void* pKey, size_t keySize, const void* pIv, size_t ivSize, const void* pTag) :
+	m_mode(mode), m_keySize(keySize), m_ivSize(ivSize), m_tagGiven(pTag != nullptr), m_pContext(nullptr), m_pOut(nullptr),
+	m_heldSize(0), m_failed(false), m_authenticated(false), m_authFailure(false)
+{
+	if (keySize != 16 && keySize != 24 && keySize != 32)
+		throw std::runtime_error("HttpDecryptSink: An AES key is 16, 24 or 32 bytes");
+	if (mode == AES_CTR ? ivSize != 16 : (ivSize == 0 || ivSize > MAX_IV_SIZE))
+		throw std::runtime_error("HttpDecryptSink: The IV is the wrong size for the mode");
+	if (mode == AES_CTR && pTag)
+		throw std::runtime_error("HttpDecryptSink: Only GCM has a tag");
+	memcpy(m_key, pKey, keySize);
+	memcpy(m_iv, pIv, ivSize);
+	if (pTag)
+		memcpy(m_tag, pTag, TAG_SIZE);
+}
+
+HttpDecryptSink::~HttpDecryptSink() {
+	IwAssert(HTTP_CLIENT, !m_pContext && !m_pOut); // Worker_Cleanup() must have been called from the worker thread
+	OPENSSL_cleanse(m_key, sizeof(m_key));
+}
+
+static const EVP_CIPHER* HttpDecryptSink_GetCipher(HttpDecryptSink::Mode mode, size_t keySize) {
+	if (mode == HttpDecryptSink::AES_CTR)
+		return keySize == 16 ? EVP_aes_128_ctr() : keySize == 24 ? EVP_aes_192_ctr() : EVP_aes_256_ctr();
+	return keySize == 16 ? EVP_aes_128_gcm() : keySize == 24 ? EVP_aes_192_gcm() : EVP_aes_256_gcm();
+}
+
+bool HttpDecryptSink::Worker_Begin(const HttpHeaders& headers, int64 size) {
+	m_heldSize = 0;
+	m_failed = m_authenticated = m_authFailure = false;
+	// A retry decrypts from the start again, with a new context (EVP_CIPHER_CTX_reset() is only in OpenSSL 1.1 on):
+	EVP_CIPHER_CTX_free(static_cast<EVP_CIPHER_CTX*>(m_pContext));
+	EVP_CIPHER_CTX* p_context = EVP_CIPHER_CTX_new();
+	m_pContext = p_context;
+	if (!p_context)
+		return false;
+	if (!m_pOut && !(m_pOut = static_cast<unsigned char*>(malloc(OUT_BUFFER_SIZE))))
+		return false;
+	if (EVP_DecryptInit_ex(p_context, HttpDecryptSink_GetCipher(m_mode, m_keySize), nullptr, nullptr, nullptr) != 1 ||
+		(m_mode == AES_GCM && EVP_CIPHER_CTX_ctrl(p_context, EVP_CTRL_GCM_SET_IVLEN, (int)m_ivSize, nullptr) != 1) ||
+		EVP_DecryptInit_ex(p_context, nullptr, nullptr, m_key, m_iv) != 1)
+		return false;
+	// The plaintext is as long as the ciphertext (without a tag at the end of it):
+	const bool tag_in_body = m_mode == AES_GCM && !m_tagGiven;
+	if (tag_in_body && size >= 0)
+		size = size >= TAG_SIZE ? size - TAG_SIZE : -1;
+	return HttpSink::Worker_Begin(headers, size);
+}
+
+bool HttpDecryptSink::Worker_Decrypt(const unsigned char* pData, size_t size) {
+	EVP_CIPHER_CTX* p_context = static_cast<EVP_CIPHER_CTX*>(m_pContext);
+	while (size) {
+		// (CTR and GCM are stream modes, so each piece decrypts to exactly as many bytes)
+		const size_t in = size < OUT_BUFFER_SIZE ? size : OUT_BUFFER_SIZE;
+		int out = 0;
+		if (EVP_DecryptUpdate(p_context, m_pOut, &out, pData, (int)in) != 1) {
+			m_failed = true;
+			return false;
+		}
+		if (out && !Worker_Pass(m_pOut, (size_t)out))
+			return false;
+		pData += in;
+		size -= in;
+	}
+	return true;
+}
+
+bool HttpDecryptSink::Worker_Write(const unsigned char* pData, size_t size) {
+	if (!m_pContext)
+		return false;
+	if (m_mode == AES_CTR || m_tagGiven)
+		return Worker_Decrypt(pData, size);
+	// Hold back the last TAG_SIZE bytes that have arrived, as they may be the tag:
+	if (m_heldSize + size <= TAG_SIZE) {
+		memcpy(m_held + m_heldSize, pData, size);
+		m_heldSize += size;
+		return true;
+	}
+	const size_t to_decrypt = m_heldSize + size - TAG_SIZE;
+	const size_t from_held = to_decrypt < m_heldSize ? to_decrypt : m_heldSize;
+	if (from_held) {
+		if (!Worker_Decrypt(m_held, from_held))
+			return false;
+		memmove(m_held, m_held + from_held, m_heldSize - from_held);
+		m_heldSize -= from_held;
+	}
+	const size_t from_data = to_decrypt - from_held;
+	if (!Worker_Decrypt(pData, from_data))
+		return false;
+	memcpy(m_held + m_heldSize, pData + from_data, size - from_data);
+	m_heldSize += size - from_data;
+	return true;
+}
+
+bool HttpDecryptSink::Worker_End(bool success) {
+	EVP_CIPHER_CTX* p_context = static_cast<EVP_CIPHER_CTX*>(m_pContext);
+	bool ok = success && p_context && !m_failed;
+	if (ok) {
+		const unsigned char* p_tag = m_tagGiven ? m_tag : m_held;
+		if (m_mode == AES_GCM && !m_tagGiven && m_heldSize < TAG_SIZE)
+			ok = false; // Too short to have a tag
+		else if (m_mode == AES_GCM)
+			ok = EVP_CIPHER_CTX_ctrl(p_context, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, const_cast<unsigned char*>(p_tag)) == 1;
+		int out = 0;
+		if (ok)
+			ok = EVP_DecryptFinal_ex(p_context, m_pOut, &out) == 1; // (For GCM, this checks the tag)
+		if (m_mode == AES_GCM) {
+			m_authenticated = ok;
+			m_authFailure = !ok;
+			if (!ok)
+				s3eDebugTracePrintf("HttpDecryptSink: The body isn't authentic");
+		}
+	}
+	// As for a digest, the stages after this one mustn't keep what isn't authentic:
+	return Worker_EndNext(ok) && (ok || !success);
+}
+
+void HttpDecryptSink::Worker_Cleanup() {
+	EVP_CIPHER_CTX_free(static_cast<EVP_CIPHER_CTX*>(m_pContext)); // (Which wipes the key schedule)
+	m_pContext = nullptr;
+	free(m_pOut);
+	m_pOut = nullptr;
+	OPENSSL_cleanse(m_held, sizeof(m_held));
+	m_heldSize = 0;
+	HttpSink::Worker_Cleanup();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpFileSink:
+
+HttpFileSink::~HttpFileSink() {
+	IwAssert(HTTP_CLIENT, m_pFile == nullptr); // Worker_Cleanup() must have been called from the worker thread
+}
+
+bool HttpFileSink::Worker_Begin(const HttpHeaders& headers, int64 size) {
+	m_written = false;
+	if (m_pFile)
+		s3eFileClose(m_pFile);
+	m_pFile = nullptr;
+	try {
+		MakePath(DirName(m_destFile));
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("HttpFileSink: %s", e.what());
+		return false;
+	}
+	m_pFile = s3eFileOpen(string(m_destFile).append(".tmp").c_str(), "wb");
+	if (!m_pFile) {
+		s3eDebugTracePrintf("HttpFileSink: Unable to write %s.tmp", m_destFile.c_str());
+		return false;
+	}
+	return HttpSink::Worker_Begin(headers, size);
+}
+
+bool HttpFileSink::Worker_Write(const unsigned char* pData, size_t size) {
+	return m_pFile && s3eFileWrite(pData, 1, size, m_pFile) == size && Worker_Pass(pData, size);
+}
+
+bool HttpFileSink::Worker_End(bool success) {
+	const string tmp_file = string(m_destFile).append(".tmp");
+	bool ok = m_pFile != nullptr;
+	if (m_pFile)
+		ok = s3eFileClose(m_pFile) == S3E_RESULT_SUCCESS;
+	m_pFile = nullptr;
+	// Only replace the file once the rest of the pipeline is happy with the data, too:
+	ok = Worker_EndNext(success && ok) && ok;
+	if (success && ok) {
+		if (IsFile(m_destFile))
+			s3eFileDelete(m_destFile.c_str());
+		ok = s3eFileRename(tmp_file.c_str(), m_destFile.c_str()) == S3E_RESULT_SUCCESS;
+		m_written = ok;
+	}
+	if (!m_written)
+		s3eFileDelete(tmp_file.c_str());
+	return ok || !success;
+}
+
+void HttpFileSink::Worker_Cleanup() {
+	if (m_pFile) {
+		// The transfer never got to Worker_End():
+		s3eFileClose(m_pFile);
+		m_pFile = nullptr;
+		s3eFileDelete(string(m_destFile).append(".tmp").c_str());
+	}
+	HttpSink::Worker_Cleanup();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpMemorySink:
+
+HttpMemorySink::HttpMemorySink(size_t maxSize) : m_maxSize(maxSize), m_pData(nullptr), m_size(0), m_capacity(0) {}
+
+HttpMemorySink::~HttpMemorySink() {
+	IwAssert(HTTP_CLIENT, m_pData == nullptr); // Worker_Cleanup() must have been called from the worker thread
+}
+
+Ptr<HttpBuffer> HttpMemorySink::TakeBuffer() {
+	Ptr<HttpBuffer> p_buffer = m_pBuffer;
+	m_pBuffer = nullptr;
+	return p_buffer;
+}
+
+bool HttpMemorySink::Worker_Begin(const HttpHeaders& headers, int64 size) {
+	m_size = 0; // (Keeping the memory of a failed attempt, if there was one)
+	if (size > 0 && (uint64)size <= m_maxSize && (size_t)size > m_capacity) {
+		unsigned char* p_data = HttpBuffer::Worker_Alloc(m_pData, (size_t)size);
+		if (!p_data)
+			return false;
+		m_pData = p_data;
+		m_capacity = (size_t)size;
+	}
+	return HttpSink::Worker_Begin(headers, size);
+}
+
+bool HttpMemorySink::Worker_Write(const unsigned char* pData, size_t size) {
+	if (m_size + size > m_maxSize)
+		return false;
+	if (m_size + size > m_capacity) {
+		size_t new_capacity = m_capacity ? m_capacity : 64 * 1024;
+		while (new_capacity < m_size + size)
+			new_capacity *= 2;
+		if (new_capacity > m_maxSize)
+			new_capacity = m_maxSize;
+		unsigned char* p_data = HttpBuffer::Worker_Alloc(m_pData, new_capacity);
+		if (!p_data)
+			return false;
+		m_pData = p_data;
+		m_capacity = new_capacity;
+	}
+	memcpy(m_pData + m_size, pData, size);
+	m_size += size;
+	return Worker_Pass(pData, size);
+}
+
+bool HttpMemorySink::Worker_End(bool success) {
+	if (success && !m_pData && !(m_pData = HttpBuffer::Worker_Alloc(nullptr, 0))) // An empty body still gets a buffer
+		success = false;
+	return Worker_EndNext(success) && success;
+}
+
+void HttpMemorySink::Worker_Cleanup() {
+	HttpBuffer::Worker_Free(m_pData);
+	m_pData = nullptr;
+	m_size = m_capacity = 0;
+	HttpSink::Worker_Cleanup();
+}
+
+void HttpMemorySink::HandleDone(bool success) {
+	m_pBuffer = nullptr;
+	if (success && m_pData) {
+		// The app thread takes the data over; Worker_Cleanup() leaves it alone:
+		m_pBuffer = new HttpBuffer(m_pData, m_size);
+		m_pData = nullptr;
+		m_size = m_capacity = 0;
+	}
+	HttpSink::HandleDone(success);
+}
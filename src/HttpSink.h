@@ -0,0 +1,228 @@
+// HttpSink:
+// A stage of a pipeline that a response body is passed through as it arrives
+// (see HttpRequest::SetSink()), so that a request can have its body, say,
+// inflated, checked against a digest and saved to a file, all in one pass
+// over the bytes, without a subclass of its own for the combination:
+//     Ptr<HttpSink> p_sink = new HttpInflateSink();
+//     p_sink->Then(new HttpDigestSink(HttpDigest::DIGEST_SHA256, expectedHex))
+//           ->Then(new HttpTeeSink(new HttpFileSink("ram://levels/3.bin")))
+//           ->Then(p_memory = new HttpMemorySink());
+//     Ptr<HttpRequest> p_request = new HttpRequest(HttpRequest::GET, url);
+//     p_request->SetSink(p_sink);
+// Each stage hands the data on to the next one (see Then()) by pointer: a
+// stage that only looks at the data (a digest, or a tee) passes the very
+// buffer it was given, and only a stage that changes the data (e.g. inflating
+// it) has a buffer of its own, which it reuses for each chunk.
+// Only the body of a successful (2xx) response goes through the sink. Every
+// attempt at the request (see HttpClient::SetRetryPolicy()) starts it again,
+// with Worker_Begin(). A stage that fails (e.g. a disk full, or a digest that
+// doesn't match) fails the request, which is then a CURLE_WRITE_ERROR.
+// The Worker_ methods are called on the worker thread, in the worker memory
+// environment (see HttpClientWorker.h), so whatever they allocate must be
+// freed by Worker_End() or Worker_Cleanup(). HandleDone() is called on the
+// app thread, once the transfer is over, before the request's HandleResponse():
+// that is where a stage hands its results to the app thread.
+// A sink is for one request at a time.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+#include <s3eFile.h>
+#include <zlib.h>
+
+#include "HttpDigest.h"
+#include "util/ptr.h"
+
+class HttpBuffer;
+class HttpHeaders;
+
+class HttpSink : public IRefCounted {
+public:
+	HttpSink() {}
+	virtual ~HttpSink() {}
+
+	// Hand what this stage outputs to pNext. Returns pNext, to add the stage after that to. (App thread, before the
+	// request is queued.)
+	HttpSink* Then(Ptr<HttpSink> pNext) { m_pNext = pNext; return pNext.ptr(); }
+	HttpSink* GetNext() const { return m_pNext.ptr(); }
+
+	/////// Worker thread ///////
+	// A body is about to arrive: size bytes of it, if that's known, or -1. headers are the response's (in the worker
+	// memory environment, so they can only be read). Return false to fail the request. Stages that override these
+	// must call on to the next stage (see Worker_Pass() and Worker_EndNext()).
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size) { return !m_pNext || m_pNext->Worker_Begin(headers, size); }
+	virtual bool Worker_Write(const unsigned char* pData, size_t size) { return Worker_Pass(pData, size); }
+	// The body has all arrived (success), or the transfer has failed (!success). Return false if the stage
+	// failed to finish (which fails the request).
+	virtual bool Worker_End(bool success) { return Worker_EndNext(success); }
+	// After the transfer, once the app thread has handled it, or if it never got to Worker_End(): free whatever is left.
+	virtual void Worker_Cleanup() { if (m_pNext) m_pNext->Worker_Cleanup(); }
+
+	/////// App thread ///////
+	// The transfer is over (success as for HttpRequest::HandleResponse()):
+	virtual void HandleDone(bool success) { if (m_pNext) m_pNext->HandleDone(success); }
+
+protected:
+	bool Worker_Pass(const unsigned char* pData, size_t size) { return !m_pNext || m_pNext->Worker_Write(pData, size); }
+	bool Worker_EndNext(bool success) { return !m_pNext || m_pNext->Worker_End(success); }
+	Ptr<HttpSink> m_pNext;
+
+private:
+	HttpSink(const HttpSink&);
+	HttpSink& operator=(const HttpSink&);
+};
+
+// Passes the data to pBranch as well as on to the next stage, e.g. to save it to a file and keep it in memory too:
+class HttpTeeSink : public HttpSink {
+public:
+	HttpTeeSink(Ptr<HttpSink> pBranch) : m_pBranch(pBranch) {}
+	HttpSink* GetBranch() const { return m_pBranch.ptr(); }
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size) { return m_pBranch->Worker_Begin(headers, size) && HttpSink::Worker_Begin(headers, size); }
+	virtual bool Worker_Write(const unsigned char* pData, size_t size) { return m_pBranch->Worker_Write(pData, size) && Worker_Pass(pData, size); }
+	virtual bool Worker_End(bool success);
+	virtual void Worker_Cleanup() { m_pBranch->Worker_Cleanup(); HttpSink::Worker_Cleanup(); }
+	virtual void HandleDone(bool success) { m_pBranch->HandleDone(success); HttpSink::HandleDone(success); }
+private:
+	const Ptr<HttpSink> m_pBranch;
+};
+
+// Inflates a gzip (or zlib) body, e.g. a .gz file that is served as it is (curl already decodes a Content-Encoding):
+class HttpInflateSink : public HttpSink {
+public:
+	HttpInflateSink() : m_pOut(nullptr), m_initialised(false), m_ended(false), m_failed(false) {}
+	~HttpInflateSink();
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size);
+	virtual bool Worker_Write(const unsigned char* pData, size_t size);
+	virtual bool Worker_End(bool success);
+	virtual void Worker_Cleanup();
+private:
+	enum { OUT_BUFFER_SIZE = 32 * 1024 };
+	z_stream m_stream;
+	unsigned char* m_pOut; // From the worker memory environment
+	bool m_initialised;
+	bool m_ended; // At the end of a gzip member
+	bool m_failed;
+};
+
+// Computes a digest of the data (without changing it), and checks it, if it was given one to expect:
+class HttpDigestSink : public HttpSink {
+public:
+	// expectedHex: the digest it must match (in hex), or empty to just compute it. Throws std::runtime_error if it
+	// isn't a digest of that type.
+	HttpDigestSink(HttpDigest::Type type, const std::string& expectedHex = std::string());
+	~HttpDigestSink();
+	// Once the request has finished: the digest, in hex (empty if the body didn't all arrive), and whether it was
+	// what was expected (false if it wasn't, or there was nothing to expect):
+	std::string GetDigest() const { return m_complete ? HttpDigest::ToHex(m_digest, HttpDigest::GetSize(m_type)) : std::string(); }
+	bool IsVerified() const { return m_complete && m_expected && !m_mismatch; }
+	bool IsMismatch() const { return m_mismatch; }
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size);
+	virtual bool Worker_Write(const unsigned char* pData, size_t size);
+	virtual bool Worker_End(bool success);
+	virtual void Worker_Cleanup();
+private:
+	const HttpDigest::Type m_type;
+	unsigned char m_expectedDigest[HttpDigest::MAX_SIZE];
+	bool m_expected;
+	HttpDigest m_context;
+	// Set by the worker:
+	unsigned char m_digest[HttpDigest::MAX_SIZE];
+	bool m_complete;
+	bool m_mismatch;
+};
+
+// Decrypts the data with AES (in CTR or GCM mode, with the OpenSSL that curl is linked with), e.g. an encrypted asset
+// pack, so that it only ever reaches a later stage (say, a file) as plaintext:
+//     p_sink = new HttpDecryptSink(HttpDecryptSink::AES_GCM, key, iv);
+//     p_sink->Then(new HttpFileSink("ram://packs/3.pak"));
+// GCM authenticates the data as well. The last TAG_SIZE bytes of the body are the tag, unless it was given
+// separately, and the data only counts as authentic once all of it has arrived: until then, the stages after
+// this one see plaintext that hasn't been checked yet, and if the tag doesn't match, they are ended as failed
+// (so a file sink after this one never replaces its file), and so is the request.
+class HttpDecryptSink : public HttpSink {
+public:
+	enum Mode {
+		AES_CTR, // ivSize 16: the initial counter block
+		AES_GCM // ivSize from 1 to MAX_IV_SIZE, usually 12
+	};
+	enum {
+		MAX_KEY_SIZE = 32,
+		MAX_IV_SIZE = 16,
+		TAG_SIZE = 16 // For GCM
+	};
+	// keySize is 16, 24 or 32 (AES-128, -192 or -256). pTag is GCM's tag (TAG_SIZE bytes), or nullptr if it is at the
+	// end of the body. Throws std::runtime_error if the sizes are wrong.
+	HttpDecryptSink(Mode mode, const void* pKey, size_t keySize, const void* pIv, size_t ivSize, const void* pTag = nullptr);
+	~HttpDecryptSink();
+	// Once the request has finished: whether GCM found the data authentic, and whether it found that it wasn't:
+	bool IsAuthenticated() const { return m_authenticated; }
+	bool IsAuthFailure() const { return m_authFailure; }
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size);
+	virtual bool Worker_Write(const unsigned char* pData, size_t size);
+	virtual bool Worker_End(bool success);
+	virtual void Worker_Cleanup();
+private:
+	enum { OUT_BUFFER_SIZE = 32 * 1024 };
+	const Mode m_mode;
+	unsigned char m_key[MAX_KEY_SIZE];
+	const size_t m_keySize;
+	unsigned char m_iv[MAX_IV_SIZE];
+	const size_t m_ivSize;
+	unsigned char m_tag[TAG_SIZE];
+	const bool m_tagGiven;
+	// Managed by the worker thread:
+	void* m_pContext; // EVP_CIPHER_CTX
+	unsigned char* m_pOut; // From the worker memory environment
+	unsigned char m_held[TAG_SIZE]; // The last bytes of the body so far, which may be the tag
+	size_t m_heldSize;
+	bool m_failed;
+	bool m_authenticated;
+	bool m_authFailure;
+	bool Worker_Decrypt(const unsigned char* pData, size_t size);
+};
+
+// Writes the data to destFile: to destFile.tmp as it arrives, which replaces destFile once the body has all
+// arrived (and the stages after this one have finished too), so that it is never left half written:
+class HttpFileSink : public HttpSink {
+public:
+	HttpFileSink(const std::string& destFile) : m_destFile(destFile), m_pFile(nullptr), m_written(false) {}
+	~HttpFileSink();
+	const std::string& GetDestFile() const { return m_destFile; }
+	bool IsWritten() const { return m_written; } // Once the request has finished
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size);
+	virtual bool Worker_Write(const unsigned char* pData, size_t size);
+	virtual bool Worker_End(bool success);
+	virtual void Worker_Cleanup();
+private:
+	const std::string m_destFile;
+	s3eFile* m_pFile;
+	bool m_written; // Set by the worker
+};
+
+// Keeps the data in memory, as an HttpBuffer (see HttpMemoryDownload) for the app to take once the request is done.
+// More than maxSize bytes fail the request.
+class HttpMemorySink : public HttpSink {
+public:
+	HttpMemorySink(size_t maxSize = 64 * 1024 * 1024);
+	~HttpMemorySink();
+	// Once the request is DONE, the data. Otherwise nullptr.
+	const Ptr<HttpBuffer>& GetBuffer() const { return m_pBuffer; }
+	Ptr<HttpBuffer> TakeBuffer();
+	virtual bool Worker_Begin(const HttpHeaders& headers, int64 size);
+	virtual bool Worker_Write(const unsigned char* pData, size_t size);
+	virtual bool Worker_End(bool success);
+	virtual void Worker_Cleanup();
+	virtual void HandleDone(bool success);
+private:
+	const size_t m_maxSize;
+	// Managed by the worker thread, until HandleDone() wraps the data in m_pBuffer:
+	unsigned char* m_pData;
+	size_t m_size;
+	size_t m_capacity;
+	Ptr<HttpBuffer> m_pBuffer;
+};
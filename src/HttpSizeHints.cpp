@@ -0,0 +1,42 @@
+// HttpSizeHints:
+// Moving estimates of the response body sizes of each endpoint.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpSizeHints.h"
+
+#include <math.h>
+
+using std::string;
+
+size_t HttpSizeHints::Find(const string& endpoint) const {
+	auto it = m_entries.find(endpoint);
+	if (it == m_entries.end())
+		return 0;
+	return (size_t)ceil(it->second.average + 2 * it->second.deviation);
+}
+
+void HttpSizeHints::Learn(const string& endpoint, size_t size) {
+	auto it = m_entries.find(endpoint);
+	if (it == m_entries.end()) {
+		if (m_entries.size() >= MAX_ENDPOINTS) {
+			auto oldest = m_entries.begin();
+			for (auto jt = m_entries.begin(); jt != m_entries.end(); jt++) {
+				if (jt->second.learned < oldest->second.learned)
+					oldest = jt;
+			}
+			m_entries.erase(oldest);
+		}
+		Entry entry;
+		entry.average = (double)size;
+		entry.deviation = 0;
+		it = m_entries.insert(std::make_pair(endpoint, entry)).first;
+	} else {
+		// (Weighted as TCP weights its round trip times, so a few odd bodies don't throw it)
+		Entry& entry = it->second;
+		entry.deviation += (fabs((double)size - entry.average) - entry.deviation) / 4;
+		entry.average += ((double)size - entry.average) / 8;
+	}
+	it->second.learned = ++m_numLearned;
+}
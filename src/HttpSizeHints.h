@@ -0,0 +1,44 @@
+// HttpSizeHints:
+// How big the response bodies of each endpoint have been, so that the next
+// request there can reserve its buffer up front even if the response has no
+// Content-Length (e.g. it's chunked or compressed), rather than grow it by
+// doubling, and so that the memory budget (see HttpMemoryBudget.h) can charge
+// it what it is likely to hold before its headers arrive. Endpoints are as
+// HttpUrl::GetEndpoint() makes them, e.g. "https://api.example.com:443/users/*/avatar":
+// the bodies that come from one are mostly about the same size.
+// Each endpoint keeps a moving average of its body sizes, and of how far they
+// are from it, and the hint is the average plus twice that, so that most
+// bodies fit. Only so many endpoints are kept; the one that was learned from
+// longest ago makes way for a new one.
+// App thread only (see HttpClient::SetSizeHints()).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+#include "s3eTypes.h"
+
+class HttpSizeHints {
+public:
+	enum { MAX_ENDPOINTS = 256 };
+
+	HttpSizeHints() : m_numLearned(0) {}
+
+	// The size to reserve for a body from endpoint, or 0 if none have been learned from it:
+	size_t Find(const std::string& endpoint) const;
+	// Note that a body of size bytes came from endpoint:
+	void Learn(const std::string& endpoint, size_t size);
+	void Clear() { m_entries.clear(); }
+	size_t GetNumEndpoints() const { return m_entries.size(); }
+
+private:
+	struct Entry {
+		double average, deviation; // Moving averages of the size, and of its distance from average
+		uint64 learned; // m_numLearned when it was last learned from
+	};
+	std::map<std::string, Entry> m_entries; // By HttpUrl::GetEndpoint()
+	uint64 m_numLearned;
+};
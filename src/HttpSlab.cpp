@@ -0,0 +1,114 @@
+// HttpSlab:
+// Per-size free lists for the app thread's small, short-lived objects, if built with HTTP_SLAB_ALLOC.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpSlab.h"
+
+namespace HttpSlab {
+
+#ifdef HTTP_SLAB_ALLOC
+
+// Block sizes are rounded up to a multiple of GRANULE, which also keeps every block aligned for any type
+static const size_t HTTP_SLAB_GRANULE = 16;
+static const size_t HTTP_SLAB_NUM_SIZES = MAX_BLOCK_SIZE / HTTP_SLAB_GRANULE;
+static const size_t HTTP_SLAB_BYTES = 4096; // How much a slab holds, or two blocks if they're bigger
+
+struct HttpSlab_Block {
+	HttpSlab_Block* pNext; // While it is on its free list
+};
+// At the start of every slab, padded to a GRANULE, so that the blocks after it stay aligned:
+union HttpSlab_Header {
+	HttpSlab_Header* pNext; // The next of its size's slabs
+	char padding[HTTP_SLAB_GRANULE];
+};
+struct HttpSlab_Size {
+	HttpSlab_Block* pFree;
+	HttpSlab_Header* pSlabs;
+	size_t numSlabs;
+	size_t slabBytes;
+	size_t numInUse;
+};
+static HttpSlab_Size s_sizes[HTTP_SLAB_NUM_SIZES]; // Zeroed, as statics are
+
+static void HttpSlab_Grow(HttpSlab_Size& slabSize, size_t blockSize) {
+	size_t num_blocks = (HTTP_SLAB_BYTES - sizeof(HttpSlab_Header)) / blockSize;
+	if (num_blocks < 2)
+		num_blocks = 2;
+	const size_t bytes = sizeof(HttpSlab_Header) + num_blocks * blockSize;
+	HttpSlab_Header* p_slab = static_cast<HttpSlab_Header*>(::operator new(bytes));
+	p_slab->pNext = slabSize.pSlabs;
+	slabSize.pSlabs = p_slab;
+	slabSize.numSlabs++;
+	slabSize.slabBytes += bytes;
+	// Thread the blocks onto the free list, so that they're handed out in address order:
+	char* p_blocks = reinterpret_cast<char*>(p_slab + 1);
+	for (size_t i = num_blocks; i-- > 0; ) {
+		HttpSlab_Block* p_block = reinterpret_cast<HttpSlab_Block*>(p_blocks + i * blockSize);
+		p_block->pNext = slabSize.pFree;
+		slabSize.pFree = p_block;
+	}
+}
+
+void* Alloc(size_t size) {
+	if (size == 0 || size > MAX_BLOCK_SIZE)
+		return ::operator new(size);
+	const size_t index = (size - 1) / HTTP_SLAB_GRANULE;
+	HttpSlab_Size& slab_size = s_sizes[index];
+	if (!slab_size.pFree)
+		HttpSlab_Grow(slab_size, (index + 1) * HTTP_SLAB_GRANULE);
+	HttpSlab_Block* p_block = slab_size.pFree;
+	slab_size.pFree = p_block->pNext;
+	slab_size.numInUse++;
+	return p_block;
+}
+
+void Free(void* p, size_t size) {
+	if (!p)
+		return;
+	if (size == 0 || size > MAX_BLOCK_SIZE) {
+		::operator delete(p);
+		return;
+	}
+	HttpSlab_Size& slab_size = s_sizes[(size - 1) / HTTP_SLAB_GRANULE];
+	HttpSlab_Block* p_block = static_cast<HttpSlab_Block*>(p);
+	p_block->pNext = slab_size.pFree;
+	slab_size.pFree = p_block;
+	slab_size.numInUse--;
+}
+
+void Trim() {
+	for (size_t i = 0; i < HTTP_SLAB_NUM_SIZES; i++) {
+		HttpSlab_Size& slab_size = s_sizes[i];
+		if (slab_size.numInUse)
+			continue; // (A block in use may be in any of them)
+		while (HttpSlab_Header* p_slab = slab_size.pSlabs) {
+			slab_size.pSlabs = p_slab->pNext;
+			::operator delete(p_slab);
+		}
+		slab_size.pFree = NULL;
+		slab_size.numSlabs = slab_size.slabBytes = 0;
+	}
+}
+
+Stats GetStats() {
+	Stats stats;
+	for (size_t i = 0; i < HTTP_SLAB_NUM_SIZES; i++) {
+		stats.numSlabs += s_sizes[i].numSlabs;
+		stats.slabBytes += s_sizes[i].slabBytes;
+		stats.numBlocksInUse += s_sizes[i].numInUse;
+	}
+	return stats;
+}
+
+#else
+
+void* Alloc(size_t size) { return ::operator new(size); }
+void Free(void* p, size_t) { ::operator delete(p); }
+void Trim() {}
+Stats GetStats() { return Stats(); }
+
+#endif
+
+} // End namespace
@@ -0,0 +1,70 @@
+// HttpSlab:
+// Free lists for the small objects that every request allocates and frees on
+// the app thread: the HttpRequest (of whatever subclass), its callback, and
+// the scheduler's list nodes. The s3e heap is small, and allocating and
+// freeing these over and over in a long session fragments it. Define
+// HTTP_SLAB_ALLOC (e.g. in the defines of HttpUtils.mkb) to have them come
+// out of slabs of a few KB instead, one set of slabs per block size (so in
+// effect per type), that are kept once allocated. A freed block goes back on
+// its size's free list, so once a session is under way, steady request churn
+// allocates nothing from the heap. Without it, the functions here just call
+// operator new and delete.
+// Blocks of up to MAX_BLOCK_SIZE bytes come from the slabs; anything bigger
+// goes straight to operator new. App thread only, like the objects themselves;
+// HttpClient::GlobalCleanup() frees the slabs of every size that has nothing
+// left in use.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <new>
+
+namespace HttpSlab {
+
+enum { MAX_BLOCK_SIZE = 2048 };
+
+void* Alloc(size_t size); // Throws std::bad_alloc, like operator new
+void Free(void* p, size_t size); // size is what p was allocated with
+void Trim(); // Free the slabs of every size that has no blocks in use
+
+struct Stats {
+	size_t numSlabs;
+	size_t slabBytes; // Taken from the heap for the slabs, in total
+	size_t numBlocksInUse;
+	Stats() : numSlabs(0), slabBytes(0), numBlocksInUse(0) {}
+};
+Stats GetStats();
+
+} // End namespace
+
+// An STL allocator that takes its nodes from HttpSlab, e.g. for the lists that requests are queued in:
+template <class T>
+class HttpSlabAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template <class U> struct rebind { typedef HttpSlabAllocator<U> other; };
+
+	HttpSlabAllocator() throw() {}
+	template <class U> HttpSlabAllocator(const HttpSlabAllocator<U>&) throw() {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+	pointer allocate(size_type n, const void* = 0) { return static_cast<pointer>(HttpSlab::Alloc(n * sizeof(T))); }
+	void deallocate(pointer p, size_type n) { HttpSlab::Free(p, n * sizeof(T)); }
+	size_type max_size() const throw() { return (size_t)-1 / sizeof(T); }
+	void construct(pointer p, const T& value) { new ((void*)p) T(value); }
+	void construct(pointer p, T&& value) { new ((void*)p) T(static_cast<T&&>(value)); }
+	void destroy(pointer p) { p->~T(); }
+
+	template <class U> bool operator==(const HttpSlabAllocator<U>&) const throw() { return true; }
+	template <class U> bool operator!=(const HttpSlabAllocator<U>&) const throw() { return false; }
+};
@@ -0,0 +1,304 @@
+// HttpStreamReader:
+// Random access to a file on a server, over range requests.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpStreamReader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <s3eDebug.h>
+
+#include "HttpClient.h"
+
+using std::string;
+
+// How many blocks may fail in a row (each after the client's own retries) before the reader gives up:
+static const uint MAX_FAILURES = 3;
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpStreamReader::Block: a GET of one block of the file, into memory. The last
+// block of the file may be shorter than the others.
+
+class HttpStreamReader::Block : public HttpMemoryDownload {
+public:
+	Block(const string& url, int64 offset, int64 length) :
+		HttpMemoryDownload(url, (size_t)length), offset(offset), length(length), lastUse(0), missed(false),
+		m_totalSize(-1), m_httpStatusCode(0), m_rangeOk(false), m_wholeFile(false)
+	{
+		// Every block of the file has the same URL, but they're anything but identical requests:
+		SetCoalesce(false);
+		SetUseCache(false);
+	}
+
+	const int64 offset;
+	const int64 length;
+	uint64 lastUse; // HttpStreamReader::m_useCounter when it was last read or asked for
+	bool missed; // A read has had to wait for it
+
+	bool IsReady() const { return GetStatus() == DONE; }
+	bool IsFinished() const { return GetStatus() == DONE || GetStatus() == ERROR || GetStatus() == CANCELLED; }
+	// Once it has finished: the size of the file, if the response said (-1 if not), and whether the server
+	// sent the whole file rather than a range (which is only read if it fits in the block):
+	int64 GetTotalSize() const { return m_totalSize; }
+	bool IsWholeFile() const { return m_wholeFile; }
+	int GetHttpStatusCode() const { return m_httpStatusCode; }
+
+	virtual void HandleRequestStart() {
+		char range[64];
+		snprintf(range, sizeof(range), "bytes=%lld-%lld", (long long)offset, (long long)(offset + length - 1));
+		SetAttemptHeader("Range", range);
+		m_rangeOk = m_wholeFile = false;
+		HttpMemoryDownload::HandleRequestStart();
+	}
+
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+		const char* p_range = headers.Find("Content-Range");
+		long long start = -1, end = -1, total = -1;
+		if (httpStatusCode == 206) {
+			// Make sure that this is the range we asked for, or the start of it if the file ends sooner:
+			// "Content-Range: bytes <start>-<end>/<size>", where the size may be "*"
+			const int num_fields = p_range ? sscanf(p_range, "bytes %lld-%lld/%lld", &start, &end, &total) : 0;
+			m_rangeOk = num_fields >= 2 && start == offset && end >= start && end <= offset + length - 1;
+			if (m_rangeOk && num_fields == 3)
+				m_totalSize = total;
+			else if (m_rangeOk && end < offset + length - 1)
+				m_totalSize = end + 1;
+		} else if (httpStatusCode == 200) {
+			// No ranges: the whole file, which is only any use if we asked for its start, and it fits
+			const char* p_length = headers.Find("Content-Length");
+			total = p_length ? strtoll(p_length, nullptr, 10) : -1;
+			m_wholeFile = true;
+			m_rangeOk = offset == 0 && total <= length;
+			m_totalSize = total;
+		} else if (httpStatusCode == 416) {
+			// Past the end: "Content-Range: bytes */<size>"
+			if (p_range && sscanf(p_range, "bytes */%lld", &total) == 1)
+				m_totalSize = total;
+		}
+		HttpMemoryDownload::Worker_HandleResponseHeaders(headers, httpStatusCode);
+	}
+
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size) {
+		if (!m_discardData && !m_rangeOk)
+			return 0; // Not the data we asked for: abort
+		return HttpMemoryDownload::Worker_HandleData(contents, size);
+	}
+
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		m_httpStatusCode = httpStatusCode;
+		HttpMemoryDownload::HandleResponse(success && m_rangeOk, httpStatusCode);
+	}
+
+private:
+	// Set by the worker thread while the block is being transferred:
+	int64 m_totalSize;
+	int m_httpStatusCode;
+	bool m_rangeOk;
+	bool m_wholeFile;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpStreamReader:
+
+HttpStreamReader::HttpStreamReader(HttpClient& client, const string& url, uint blockSize, uint maxBlocks) :
+	m_client(client),
+	m_url(url),
+	m_blockSize(blockSize ? blockSize : 1),
+	m_maxBlocks(maxBlocks > 1 ? maxBlocks : 2),
+	m_priority(HttpRequest::PRIORITY_HIGH),
+	m_maxReadAhead(m_maxBlocks / 2),
+	m_size(-1),
+	m_failed(false),
+	m_position(-1),
+	m_readAhead(m_maxReadAhead ? 1 : 0),
+	m_numFailures(0),
+	m_numMisses(0),
+	m_useCounter(0)
+{
+}
+
+HttpStreamReader::~HttpStreamReader() {
+	for (auto it = m_blocks.begin(); it != m_blocks.end(); it++) {
+		if (it->second->GetStatus() == HttpRequest::PENDING)
+			it->second->Cancel();
+		else if (!it->second->IsFinished())
+			it->second->Abort();
+	}
+}
+
+HttpStreamReader& HttpStreamReader::SetMaxReadAhead(uint numBlocks) {
+	// The block being read and the ones ahead of it must all fit:
+	m_maxReadAhead = numBlocks < m_maxBlocks ? numBlocks : m_maxBlocks - 1;
+	if (m_readAhead > m_maxReadAhead)
+		m_readAhead = m_maxReadAhead;
+	else if (!m_readAhead && m_maxReadAhead)
+		m_readAhead = 1;
+	return *this;
+}
+
+int64 HttpStreamReader::Read(int64 offset, void* pDest, size_t size) {
+	IwAssert(HTTP_CLIENT, offset >= 0);
+	if (m_failed)
+		return FAILED;
+	if (!size || (m_size >= 0 && offset >= m_size))
+		return 0;
+	const int64 index = offset / m_blockSize;
+	const bool sequential = m_position < 0 || index == m_position || index == m_position + 1;
+	if (!sequential)
+		Seek(index);
+	m_position = index;
+
+	Block* p_block = Fetch(index, m_priority);
+	if (m_failed)
+		return FAILED;
+	if (!p_block || !p_block->IsReady()) {
+		if (p_block && !p_block->missed) {
+			p_block->missed = true;
+			m_numMisses++;
+			// Reading in order, and still catching up with the blocks: read further ahead
+			if (sequential && index && m_readAhead < m_maxReadAhead)
+				m_readAhead = m_readAhead * 2 < m_maxReadAhead ? m_readAhead * 2 : m_maxReadAhead;
+		}
+		ReadAhead();
+		Evict();
+		return WOULD_BLOCK;
+	}
+
+	// Copy what there is, going on into the next blocks for as long as they have arrived:
+	unsigned char* p_dest = static_cast<unsigned char*>(pDest);
+	size_t copied = 0;
+	int64 at = offset;
+	while (copied < size) {
+		Blocks::iterator it = m_blocks.find(at / m_blockSize);
+		if (it == m_blocks.end() || !it->second->IsReady())
+			break;
+		Block& block = *it->second.ptr();
+		const HttpBuffer& buffer = *block.GetBuffer().ptr();
+		const size_t within = (size_t)(at - block.offset);
+		if (within >= buffer.Size())
+			break; // The end of the file
+		size_t num_bytes = buffer.Size() - within;
+		if (num_bytes > size - copied)
+			num_bytes = size - copied;
+		memcpy(p_dest + copied, buffer.Data() + within, num_bytes);
+		copied += num_bytes;
+		at += num_bytes;
+		block.lastUse = ++m_useCounter;
+		if (within + num_bytes < (size_t)block.length)
+			break; // (A short block is the last one)
+	}
+	if (copied)
+		m_position = (at - 1) / m_blockSize;
+	ReadAhead();
+	Evict();
+	return (int64)copied;
+}
+
+void HttpStreamReader::Prefetch(int64 offset) {
+	IwAssert(HTTP_CLIENT, offset >= 0);
+	if (m_failed || (m_size >= 0 && offset >= m_size))
+		return;
+	Fetch(offset / m_blockSize, m_priority < HttpRequest::PRIORITY_NORMAL ? m_priority : HttpRequest::PRIORITY_NORMAL);
+	Evict();
+}
+
+HttpStreamReader::Block* HttpStreamReader::Fetch(int64 index, HttpRequest::Priority priority) {
+	Blocks::iterator it = m_blocks.find(index);
+	if (it != m_blocks.end()) {
+		Block* p_block = it->second.ptr();
+		p_block->lastUse = ++m_useCounter;
+		const HttpRequest::Status status = p_block->GetStatus();
+		if (status == HttpRequest::PENDING && p_block->GetPriority() < priority)
+			p_block->SetPriority(priority); // Wanted sooner than it was
+		if (m_failed || (status != HttpRequest::ERROR && status != HttpRequest::CANCELLED))
+			return p_block;
+		m_blocks.erase(it); // Failed: ask again
+	}
+	if (m_failed)
+		return nullptr;
+	const int64 offset = index * m_blockSize;
+	int64 length = m_blockSize;
+	if (m_size >= 0 && offset + length > m_size)
+		length = m_size - offset;
+	Ptr<Block> p_block = new Block(m_url, offset, length);
+	p_block->lastUse = ++m_useCounter;
+	p_block->SetPriority(priority);
+	m_blocks[index] = p_block;
+	// (The callback may come right away, e.g. if the client is offline)
+	m_client.QueueRequest(p_block.ptr(), this, &HttpStreamReader::HandleBlockDone);
+	return p_block.ptr();
+}
+
+void HttpStreamReader::ReadAhead() {
+	// Without the size, we don't know where to stop, so there's no reading ahead until the first block is in:
+	if (m_failed || m_position < 0 || m_size < 0)
+		return;
+	const int64 num_blocks = GetNumBlocks();
+	const HttpRequest::Priority priority = m_priority < HttpRequest::PRIORITY_NORMAL ? m_priority : HttpRequest::PRIORITY_NORMAL;
+	for (int64 index = m_position + 1; index <= m_position + m_readAhead && index < num_blocks; index++) {
+		Blocks::iterator it = m_blocks.find(index);
+		if (it == m_blocks.end() || it->second->GetStatus() == HttpRequest::ERROR)
+			Fetch(index, priority);
+	}
+}
+
+void HttpStreamReader::Seek(int64 index) {
+	// Start reading ahead over again, and don't wait for the blocks that only the old position wanted:
+	m_readAhead = m_maxReadAhead ? 1 : 0;
+	for (Blocks::iterator it = m_blocks.begin(); it != m_blocks.end();) {
+		if (it->second->GetStatus() == HttpRequest::PENDING && (it->first < index || it->first > index + m_readAhead)) {
+			it->second->Cancel();
+			m_blocks.erase(it++);
+		} else {
+			it++;
+		}
+	}
+}
+
+void HttpStreamReader::Evict() {
+	// Drop the blocks that haven't been used for the longest, apart from the ones being read and read ahead,
+	// and the ones under way:
+	while (m_blocks.size() > m_maxBlocks) {
+		Blocks::iterator oldest = m_blocks.end();
+		for (Blocks::iterator it = m_blocks.begin(); it != m_blocks.end(); it++) {
+			if (it->first >= m_position && it->first <= m_position + m_readAhead)
+				continue;
+			const HttpRequest::Status status = it->second->GetStatus();
+			if (status == HttpRequest::SENDING || status == HttpRequest::HEADERS)
+				continue;
+			if (oldest == m_blocks.end() || it->second->lastUse < oldest->second->lastUse)
+				oldest = it;
+		}
+		if (oldest == m_blocks.end())
+			break;
+		if (oldest->second->GetStatus() == HttpRequest::PENDING)
+			oldest->second->Cancel();
+		m_blocks.erase(oldest);
+	}
+}
+
+void HttpStreamReader::HandleBlockDone(Ptr<HttpRequest> pRequest) {
+	Block* p_block = static_cast<Block*>(pRequest.ptr());
+	if (m_size < 0 && p_block->GetTotalSize() >= 0)
+		m_size = p_block->GetTotalSize();
+	if (p_block->IsReady()) {
+		if (p_block->IsWholeFile())
+			m_size = (int64)p_block->GetBuffer()->Size();
+		m_numFailures = 0;
+		ReadAhead();
+		Evict();
+		return;
+	}
+	if (p_block->GetHttpStatusCode() == 416 && m_size >= 0)
+		return; // Past the end, which we know now
+	if (p_block->IsWholeFile() && p_block->GetHttpStatusCode() == 200) {
+		s3eDebugTracePrintf("HttpStreamReader: %s doesn't support ranges, and is bigger than a block", m_url.c_str());
+		m_failed = true;
+	} else if (++m_numFailures > MAX_FAILURES) {
+		s3eDebugTracePrintf("HttpStreamReader: Giving up on %s after %u failed blocks (HTTP %d)", m_url.c_str(), m_numFailures, p_block->GetHttpStatusCode());
+		m_failed = true;
+	}
+}
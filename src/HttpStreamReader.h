@@ -0,0 +1,92 @@
+// HttpStreamReader:
+// Random access to a file on a server, e.g. a video or a music track that a
+// decoder reads a little at a time, and seeks around in, without downloading
+// the whole of it first. The file is read in blocks of blockSize bytes, each
+// one a GET with a Range header (so the server must support ranges: one that
+// doesn't can only be read if the whole file fits in the first block), sent
+// through the client's worker pool like any other request. The blocks are
+// kept, up to maxBlocks of them, and the ones that haven't been read for the
+// longest are dropped to make room for more.
+// Read() never waits. If the block it needs hasn't arrived yet, it asks for
+// it (ahead of everything else the reader has asked for) and returns
+// WOULD_BLOCK, and the caller tries again later, e.g. next frame. The reader
+// also reads ahead: while the reads go through the file in order, the blocks
+// after the one being read are fetched too, at a lower priority. It starts
+// with one block ahead, and doubles that each time a read finds that its block
+// hasn't arrived yet (i.e. the file is being read faster than the blocks
+// come), up to half of maxBlocks. A seek starts it over at one block, and
+// cancels the blocks it had asked for that haven't started yet, unless they
+// are ahead of the new position too.
+//     HttpStreamReader reader(client, "https://cdn.example.com/intro.mp4");
+//     ...
+//     int64 got = reader.Read(position, buffer, sizeof(buffer));
+//     if (got > 0) position += got; // else WOULD_BLOCK, FAILED or 0 at the end
+// Like HttpClient, it must only be used from the app thread. It must not
+// outlive its client.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "HttpMemoryDownload.h"
+
+class HttpClient;
+
+class HttpStreamReader : public IObservable {
+public:
+	enum {
+		WOULD_BLOCK = -1, // The data has been asked for, but hasn't arrived yet: try again later
+		FAILED = -2 // The file can't be read (see HasFailed())
+	};
+	HttpStreamReader(HttpClient& client, const std::string& url, uint blockSize = 256 * 1024, uint maxBlocks = 16);
+	~HttpStreamReader(); // Cancels the blocks that are still waiting, and aborts the ones under way
+
+	// Copy up to size bytes from offset in the file to pDest. Returns how many bytes were copied (as many as there
+	// are, from whichever blocks have arrived, starting at offset), 0 if offset is at or past the end of the file,
+	// WOULD_BLOCK if the block at offset hasn't arrived yet, or FAILED.
+	int64 Read(int64 offset, void* pDest, size_t size);
+	// Start fetching the block at offset, e.g. before seeking there, without reading it:
+	void Prefetch(int64 offset);
+
+	// The priority of the block that a read is waiting for (PRIORITY_HIGH by default). The blocks read ahead go
+	// at PRIORITY_NORMAL, or this one, if it is lower.
+	HttpStreamReader& SetPriority(HttpRequest::Priority priority) { m_priority = priority; return *this; }
+	// The most blocks to read ahead (maxBlocks / 2 by default). 0 reads only the blocks that are asked for.
+	HttpStreamReader& SetMaxReadAhead(uint numBlocks);
+
+	// The size of the file, once the first block has arrived (or a read has gone past the end). -1 until then.
+	int64 GetSize() const { return m_size; }
+	// The file couldn't be read: a block failed more than a few times over, or the server doesn't do ranges.
+	bool HasFailed() const { return m_failed; }
+	uint GetReadAhead() const { return m_readAhead; } // How many blocks are being read ahead now
+	uint GetNumMisses() const { return m_numMisses; } // How many times a read has had to wait for its block
+
+private:
+	class Block;
+	typedef std::map< int64, Ptr<Block> > Blocks; // By index, i.e. offset / m_blockSize
+	HttpClient& m_client;
+	const std::string m_url;
+	const uint m_blockSize;
+	const uint m_maxBlocks;
+	HttpRequest::Priority m_priority;
+	uint m_maxReadAhead;
+	Blocks m_blocks;
+	int64 m_size;
+	bool m_failed;
+	int64 m_position; // The index of the block that was read last, or -1
+	uint m_readAhead;
+	uint m_numFailures; // In a row
+	uint m_numMisses;
+	uint64 m_useCounter; // For the blocks' last use
+
+	Block* Fetch(int64 index, HttpRequest::Priority priority); // Returns the block, asking for it if need be
+	void ReadAhead();
+	void Seek(int64 index);
+	void Evict();
+	int64 GetNumBlocks() const { return m_size < 0 ? -1 : (m_size + m_blockSize - 1) / m_blockSize; }
+	void HandleBlockDone(Ptr<HttpRequest> pRequest);
+};
@@ -0,0 +1,189 @@
+// HttpStreamRequest:
+// A GET whose response the app receives record by record, as it arrives.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpStreamRequest.h"
+
+#include <string.h>
+
+#include "HttpAllocStats.h"
+#include "HttpMemoryDownload.h"
+
+using std::string;
+
+static size_t HttpStreamRequest_QueueSize(uint maxQueued) {
+	size_t size = 2;
+	while (size < maxQueued)
+		size *= 2;
+	return size;
+}
+
+HttpStreamRequest::HttpStreamRequest(const string& url, Mode mode, uint maxQueued) :
+	HttpRequest(GET, url.c_str()), m_mode(mode), m_pRuns(new Run[HttpStreamRequest_QueueSize(maxQueued)]), m_mask(HttpStreamRequest_QueueSize(maxQueued) - 1), m_head(0), m_tail(0), m_bytesPublished(0), m_bytesDelivered(0),
+	m_pOpen(nullptr), m_openSize(0), m_openCapacity(0), m_openRecords(0), m_discardData(false), m_failed(false), m_numRecords(0)
+{
+	SetCoalesce(false); // Each stream has its own queue
+	SetMaxUnconsumed(1024 * 1024);
+}
+
+HttpStreamRequest::~HttpStreamRequest() {
+	IwAssert(HTTP_CLIENT, m_pOpen == nullptr && m_head == m_tail); // Worker_HandleCleanup() must have been called from the worker thread
+	delete[] m_pRuns;
+}
+
+size_t HttpStreamRequest::EstimateMemory(int64 contentLength) const {
+	const size_t estimate = HttpRequest::EstimateMemory(contentLength);
+	return GetMaxUnconsumed() && GetMaxUnconsumed() < estimate ? GetMaxUnconsumed() : estimate;
+}
+
+void HttpStreamRequest::Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode) {
+	m_discardData = httpStatusCode / 100 != 2;
+}
+
+size_t HttpStreamRequest::Worker_HandleData(const unsigned char* contents, size_t size) {
+	if (m_discardData)
+		return size;
+	if (m_openSize + size > m_openCapacity) {
+		size_t new_capacity = m_openCapacity ? m_openCapacity : 16 * 1024;
+		while (new_capacity < m_openSize + size)
+			new_capacity *= 2;
+		HTTP_ALLOC_SCOPE(SITE_BODY, nullptr);
+		unsigned char* p_open = HttpBuffer::Worker_Alloc(m_pOpen, new_capacity);
+		if (!p_open) {
+			m_failed = true;
+			return 0;
+		}
+		m_pOpen = p_open;
+		m_openCapacity = new_capacity;
+	}
+	memcpy(m_pOpen + m_openSize, contents, size);
+	m_openSize += size;
+	if (m_mode == STREAM_CHUNKS) {
+		m_openRecords = m_openSize;
+	} else {
+		// The records end at the last line break, if the new data has one:
+		for (size_t i = size; i-- > 0; ) {
+			if (contents[i] == '\n') {
+				m_openRecords = m_openSize - size + i + 1;
+				break;
+			}
+		}
+	}
+	if (!Worker_Publish()) {
+		m_failed = true;
+		return 0;
+	}
+	return size;
+}
+
+bool HttpStreamRequest::Worker_Publish() {
+	if (!m_openRecords || m_head - atomic::LoadAcquire(m_tail) > m_mask)
+		return true; // Nothing to publish yet, or the queue is full: carry on collecting
+	// The partial record after the complete ones starts the next run:
+	const size_t rest = m_openSize - m_openRecords;
+	unsigned char* p_rest = nullptr;
+	if (rest) {
+		HTTP_ALLOC_SCOPE(SITE_BODY, nullptr);
+		p_rest = HttpBuffer::Worker_Alloc(nullptr, rest * 2);
+		if (!p_rest)
+			return false;
+		memcpy(p_rest, m_pOpen + m_openRecords, rest);
+	}
+	Run& run = m_pRuns[m_head & m_mask];
+	run.pData = m_pOpen;
+	run.size = m_openRecords;
+	m_bytesPublished += m_openRecords;
+	atomic::StoreRelease(m_head, m_head + 1);
+	m_pOpen = p_rest;
+	m_openSize = rest;
+	m_openCapacity = rest * 2;
+	m_openRecords = 0;
+	return true;
+}
+
+void HttpStreamRequest::Worker_HandleDone(bool success, int httpStatusCode) {
+	if (success && !m_discardData && !m_failed) {
+		m_openRecords = m_openSize; // A last line needn't end with a line break
+		if (!Worker_Publish())
+			m_failed = true;
+		// (If the queue is full, the app thread takes what's left straight from m_pOpen)
+	}
+	HttpRequest::Worker_HandleDone(success, httpStatusCode);
+}
+
+void HttpStreamRequest::HandleReceiving() {
+	Drain();
+}
+
+void HttpStreamRequest::Drain() {
+	Ptr<HttpRequest> p_this(this); // (A record callback may let go of us)
+	size_t tail = m_tail;
+	const size_t head = atomic::LoadAcquire(m_head);
+	while (tail != head && !IsAborted()) {
+		const Run& run = m_pRuns[tail & m_mask];
+		Deliver(reinterpret_cast<const char*>(run.pData), run.size);
+		atomic::StoreRelease(m_bytesDelivered, m_bytesDelivered + run.size);
+		HttpBuffer::Release(run.pData);
+		atomic::StoreRelease(m_tail, ++tail);
+	}
+	// (What's left after Cancel() is freed by Worker_HandleCleanup())
+}
+
+void HttpStreamRequest::Deliver(const char* pData, size_t size) {
+	if (m_mode == STREAM_CHUNKS) {
+		m_numRecords++;
+		HandleRecord(pData, size);
+		return;
+	}
+	const char* const p_end = pData + size;
+	while (pData < p_end && !IsAborted()) {
+		const char* p_newline = static_cast<const char*>(memchr(pData, '\n', p_end - pData));
+		const char* p_line_end = p_newline ? p_newline : p_end;
+		size_t length = p_line_end - pData;
+		if (length && pData[length - 1] == '\r')
+			length--;
+		if (length) {
+			m_numRecords++;
+			HandleRecord(pData, length);
+		}
+		pData = p_newline ? p_newline + 1 : p_end;
+	}
+}
+
+void HttpStreamRequest::HandleResponse(bool success, int httpStatusCode) {
+	success = success && !m_discardData && !m_failed;
+	// The runs that were published are complete records, even if the transfer then failed:
+	if (!m_discardData)
+		Drain();
+	if (success) {
+		// The worker is done, so what it couldn't publish is ours now too:
+		if (m_pOpen) {
+			if (!IsAborted())
+				Deliver(reinterpret_cast<const char*>(m_pOpen), m_openSize);
+			HttpBuffer::Release(m_pOpen);
+			m_pOpen = nullptr;
+			m_openSize = m_openCapacity = m_openRecords = 0;
+		}
+	}
+	HttpRequest::HandleResponse(success, httpStatusCode);
+}
+
+void HttpStreamRequest::Worker_HandleCleanup() {
+	// The app thread has done with the request, so the runs it didn't take (after a failure, or Cancel()) are ours to free:
+	for (size_t tail = m_tail; tail != m_head; tail++)
+		HttpBuffer::Worker_Free(m_pRuns[tail & m_mask].pData);
+	m_head = m_tail = 0;
+	m_bytesPublished = m_bytesDelivered = 0;
+	HttpBuffer::Worker_Free(m_pOpen);
+	m_pOpen = nullptr;
+	m_openSize = m_openCapacity = m_openRecords = 0;
+}
+
+void HttpStreamRequest::HandleRequeue() {
+	// Worker_HandleCleanup() has freed anything left from the last attempt
+	m_discardData = m_failed = false;
+	m_numRecords = 0;
+	HttpRequest::HandleRequeue();
+}
@@ -0,0 +1,100 @@
+// HttpStreamRequest:
+// A GET whose response the app receives as it arrives, rather than all at
+// once when the transfer is over: e.g. an NDJSON feed, a long poll that sends
+// events as they happen, or a progressive image. In STREAM_LINES mode the app
+// gets the body one line (record) at a time, without its line break; in
+// STREAM_CHUNKS mode, in pieces as big as they happen to arrive.
+// The worker collects the data in memory from the worker memory environment,
+// and publishes each run of complete records to a bounded queue that the app
+// thread drains in every HttpClient::Update(), calling HandleRecord() (and so
+// the record callback) for each one. So the first records can be used long
+// before the transfer ends, and nothing is copied on the way: the app thread
+// reads the worker's memory, and hands it back to the workers when it has
+// done with it (see HttpBuffer). While the queue is full, the worker keeps
+// adding to the run it is collecting, and publishes it all in one go once
+// there is room. To keep that bounded, the transfer is paused while the
+// request holds 1 MB that the app hasn't had yet (see
+// HttpRequest::SetMaxUnconsumed(), and HttpClient::SetMaxBufferedBytes() for
+// a limit on all of a client's requests together), and resumes as the app
+// catches up.
+// When the transfer is over, whatever the app hasn't had yet (including a last
+// line without a line break) is delivered just before HandleResponse() and the
+// request's callback, and GetNumRecords() tells how many there were.
+// Error responses aren't delivered: the request fails, as usual. A transfer
+// that fails partway (e.g. the connection is lost) still delivers the
+// complete records that it had published, before HandleResponse(). If the
+// request is sent again (e.g. a retry), the records start again from the
+// first. Streamed requests don't follow identical ones, nor are they answered
+// from an HttpMemoryCache.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+
+#include "HttpRequest.h"
+#include "util/atomic.h"
+
+class HttpStreamRequest : public HttpRequest {
+public:
+	enum Mode {
+		STREAM_LINES, // A record per line (LF or CRLF); empty lines are skipped
+		STREAM_CHUNKS // A record per run of data, as received
+	};
+	// maxQueued runs of records (rounded up to a power of two) may be waiting for the app at once:
+	HttpStreamRequest(const std::string& url, Mode mode = STREAM_LINES, uint maxQueued = 64);
+	~HttpStreamRequest();
+
+	// Called on the app thread with each record, during HttpClient::Update(). The data is only valid for the
+	// duration of the call. The callback may Cancel() the request, after which it gets no more records.
+	typedef fastdelegate::FastDelegate3<HttpStreamRequest*, const char*, size_t> RecordDelegate; // (request, pData, size)
+	void SetRecordCallback(RecordDelegate callback) { m_recordCallback = callback; }
+	Mode GetMode() const { return m_mode; }
+	uint GetNumRecords() const { return m_numRecords; } // Delivered so far
+
+	virtual std::string GetMemoryCacheKey() const { return std::string(); }
+	virtual size_t EstimateMemory(int64 contentLength) const; // No more than GetMaxUnconsumed(), if that's set
+	virtual void HandleReceiving();
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	virtual void HandleRequeue();
+	virtual void Worker_HandleResponseHeaders(const HttpHeaders& headers, int httpStatusCode);
+	virtual size_t Worker_GetUnconsumed() const { return m_bytesPublished - atomic::LoadAcquire(m_bytesDelivered) + m_openSize; }
+	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
+	virtual void Worker_HandleDone(bool success, int httpStatusCode);
+	virtual void Worker_HandleCleanup();
+
+protected:
+	// Called on the app thread for each record. By default, calls the record callback.
+	virtual void HandleRecord(const char* pData, size_t size) { if (m_recordCallback) m_recordCallback(this, pData, size); }
+
+private:
+	// A run of complete records, in memory from HttpBuffer::Worker_Alloc():
+	struct Run {
+		unsigned char* pData;
+		size_t size;
+	};
+	const Mode m_mode;
+	// The queue: only the worker writes m_head, and only the app thread m_tail (apart from the worker's cleanup,
+	// once the app thread has done with the request). Each is published with a release, after the run it covers.
+	Run* m_pRuns; // An array allocated by the app thread
+	const size_t m_mask;
+	volatile size_t m_head; // Runs published
+	volatile size_t m_tail; // Runs delivered
+	volatile size_t m_bytesPublished; // The sizes of the runs so far, which only the worker writes...
+	volatile size_t m_bytesDelivered; // ...and of those delivered, which only the app thread writes (for Worker_GetUnconsumed())
+	// Managed by the worker thread (and by the app thread once the worker is done): the run being collected
+	unsigned char* m_pOpen;
+	size_t m_openSize;
+	size_t m_openCapacity;
+	size_t m_openRecords; // How much of m_pOpen is complete records, which can be published
+	bool m_discardData; // The response is an error page
+	bool m_failed; // Set by the worker thread if memory ran out
+	RecordDelegate m_recordCallback;
+	uint m_numRecords;
+
+	bool Worker_Publish(); // Returns false if memory ran out
+	void Drain();
+	void Deliver(const char* pData, size_t size);
+};
@@ -0,0 +1,35 @@
+// HttpThreadOptions:
+// How an HttpClient's worker and I/O threads are set up (see
+// HttpClient::SetThreadOptions()): their stack size, their priority, and which
+// CPUs they may run on, e.g. to keep them off the big cores on which the app
+// renders, and to reserve less memory for each of them than the platform's
+// default stack (often 1 to 8 MB). All plain data, so that the app thread can
+// copy it into each worker as it spawns its thread.
+// The priority and the CPUs are applied by each thread as it starts, where the
+// platform supports them (Linux and Android); elsewhere, they are ignored, and
+// only the stack size applies.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include "s3eTypes.h"
+
+struct HttpThreadOptions {
+	// The stack to reserve for each thread, in bytes; 0 (the default) for the platform's. curl and OpenSSL need
+	// some room (mostly during TLS handshakes and inflating compressed responses): 128 KB is plenty for both.
+	// Rounded up to a multiple of 16 KB, and to at least the platform's minimum.
+	size_t stackSize;
+	// If setNiceness is true, each thread sets its own nice value to niceness: from -20 (the highest priority)
+	// to 19 (the lowest), where 0 is normal, e.g. 5 to let the app's own threads come first. Otherwise (the
+	// default) the threads keep the priority of the thread that creates them, i.e. the app thread's.
+	bool setNiceness;
+	int niceness;
+	// The CPUs each thread may run on: bit n for CPU n (as the platform numbers them, e.g. the little cores of
+	// a big.LITTLE phone are usually the first). 0 (the default) for any of them.
+	uint32 cpuMask;
+
+	HttpThreadOptions() : stackSize(0), setNiceness(false), niceness(0), cpuMask(0) {}
+};
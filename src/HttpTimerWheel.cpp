@@ -0,0 +1,145 @@
+// HttpTimerWheel:
+// An HttpClient's timers, in a hierarchical timing wheel.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpTimerWheel.h"
+
+#include <IwDebug.h>
+
+static void LinkBefore(HttpTimer_Link& node, HttpTimer_Link& next) {
+	node.pNext = &next;
+	node.pPrev = next.pPrev;
+	next.pPrev->pNext = &node;
+	next.pPrev = &node;
+}
+
+static void UnlinkNode(HttpTimer_Link& node) {
+	node.pPrev->pNext = node.pNext;
+	node.pNext->pPrev = node.pPrev;
+	node.pNext = node.pPrev = &node;
+}
+
+void HttpTimer::Cancel() {
+	if (m_pWheel)
+		m_pWheel->Unlink(*this);
+}
+
+void HttpTimerWheel::Set(HttpTimer& timer, uint64 dueMs, HttpTimer::Delegate delegate) {
+	timer.Cancel();
+	timer.m_pWheel = this;
+	timer.m_dueMs = dueMs;
+	timer.m_delegate = delegate;
+	m_size++;
+	Place(timer);
+}
+
+void HttpTimerWheel::Advance(uint64 nowMs) {
+	IwAssert(HTTP_CLIENT, !m_advancing);
+	if (nowMs > m_nowMs) {
+		// The timers are in the slots for the groups of SLOT_BITS in which their due times first differ from m_nowMs
+		// (so each wheel's timers are all ahead of where it has got to, within its current turn). The group in which
+		// nowMs first differs is the coarsest wheel that turns: everything in the finer ones is due, and so is what
+		// is in the slots that wheel turns past. The timers in the slot it reaches may be due, or may go into finer
+		// slots now. The coarser wheels don't move, and none of their timers are due yet.
+		Link pending;
+		uint top = 0;
+		for (uint64 diff = (nowMs ^ m_nowMs) >> SLOT_BITS; diff; diff >>= SLOT_BITS)
+			top++;
+		for (uint level = 0; level < top && level < NUM_LEVELS; level++) {
+			for (uint slot = 0; m_occupied[level]; slot++) {
+				if (m_occupied[level] & ((uint64)1 << slot))
+					TakeSlot(level, slot, pending);
+			}
+		}
+		if (top < NUM_LEVELS) {
+			const uint shift = top * SLOT_BITS;
+			const uint from = (uint)(m_nowMs >> shift) & (NUM_SLOTS - 1), to = (uint)(nowMs >> shift) & (NUM_SLOTS - 1);
+			for (uint slot = from + 1; slot <= to && m_occupied[top]; slot++) {
+				if (m_occupied[top] & ((uint64)1 << slot))
+					TakeSlot(top, slot, pending);
+			}
+		} else {
+			// Past the end of the coarsest wheel: the timers that were too far ahead for it may not be any more
+			Link& overflow = m_lists[LIST_OVERFLOW];
+			while (!overflow.Empty()) {
+				Link& node = *overflow.pNext;
+				UnlinkNode(node);
+				LinkBefore(node, pending);
+			}
+		}
+		m_nowMs = nowMs;
+		while (!pending.Empty()) {
+			HttpTimer& timer = static_cast<HttpTimer&>(*pending.pNext);
+			UnlinkNode(timer);
+			Place(timer);
+		}
+	}
+	m_advancing = true;
+	Link& due = m_lists[LIST_DUE];
+	while (!due.Empty()) {
+		HttpTimer& timer = static_cast<HttpTimer&>(*due.pNext);
+		Unlink(timer);
+		const HttpTimer::Delegate delegate = timer.m_delegate; // (This call may destroy the timer, or set it again)
+		delegate();
+	}
+	m_advancing = false;
+}
+
+void HttpTimerWheel::Clear() {
+	for (uint i = 0; i < NUM_LISTS; i++) {
+		Link& list = m_lists[i];
+		while (!list.Empty()) {
+			HttpTimer& timer = static_cast<HttpTimer&>(*list.pNext);
+			UnlinkNode(timer);
+			timer.m_pWheel = nullptr;
+		}
+	}
+	for (uint level = 0; level < NUM_LEVELS; level++)
+		m_occupied[level] = 0;
+	m_size = 0;
+}
+
+void HttpTimerWheel::Place(HttpTimer& timer) {
+	if (timer.m_dueMs <= m_nowMs) {
+		// Due now: in order of due time, after any others that are due at the same time
+		Link* p_next = &m_lists[LIST_DUE];
+		while (p_next->pPrev != &m_lists[LIST_DUE] && static_cast<HttpTimer*>(p_next->pPrev)->m_dueMs > timer.m_dueMs)
+			p_next = p_next->pPrev;
+		timer.m_list = LIST_DUE;
+		LinkBefore(timer, *p_next);
+		return;
+	}
+	uint level = 0;
+	for (uint64 diff = (timer.m_dueMs ^ m_nowMs) >> SLOT_BITS; diff; diff >>= SLOT_BITS)
+		level++;
+	if (level >= NUM_LEVELS) {
+		timer.m_list = LIST_OVERFLOW;
+	} else {
+		const uint slot = (uint)(timer.m_dueMs >> (level * SLOT_BITS)) & (NUM_SLOTS - 1);
+		timer.m_list = level * NUM_SLOTS + slot;
+		m_occupied[level] |= (uint64)1 << slot;
+	}
+	LinkBefore(timer, m_lists[timer.m_list]);
+}
+
+void HttpTimerWheel::Unlink(HttpTimer& timer) {
+	UnlinkNode(timer);
+	if (timer.m_list < LIST_OVERFLOW && m_lists[timer.m_list].Empty())
+		m_occupied[timer.m_list / NUM_SLOTS] &= ~((uint64)1 << (timer.m_list % NUM_SLOTS));
+	timer.m_pWheel = nullptr;
+	m_size--;
+}
+
+void HttpTimerWheel::TakeSlot(uint level, uint slot, Link& to) {
+	Link& list = m_lists[level * NUM_SLOTS + slot];
+	Link* p_first = list.pNext;
+	Link* p_last = list.pPrev;
+	p_first->pPrev = to.pPrev;
+	to.pPrev->pNext = p_first;
+	p_last->pNext = &to;
+	to.pPrev = p_last;
+	list.pNext = list.pPrev = &list;
+	m_occupied[level] &= ~((uint64)1 << slot);
+}
@@ -0,0 +1,92 @@
+// HttpTimerWheel:
+// The timers of one HttpClient (e.g. each retry's backoff, and each queued
+// request's deadline), so that Update() doesn't have to keep them in order,
+// or look through the requests every frame to find the ones that are due.
+// A hierarchical timing wheel: NUM_LEVELS wheels of NUM_SLOTS slots each, the
+// first with a slot per millisecond, each of the others with a slot per turn
+// of the one below. A timer goes in the slot of the coarsest wheel in which
+// it isn't due yet; Advance() passes the slots it has gone by, and moves the
+// timers in the coarser ones that it reaches into the finer ones (or calls
+// them, if they are due). So setting and cancelling a timer is O(1) (it is
+// linked into the slot's list, and knows where it is), and so is Advance(),
+// apart from the timers it calls or moves. Timers too far ahead for any of
+// the wheels (over 4.6 hours) wait in a list of their own until they aren't.
+// The HttpTimers are the caller's (typically members of what they are for),
+// so nothing is allocated. App thread only.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <s3eTypes.h>
+
+#include "util/FastDelegate.h"
+
+class HttpTimerWheel;
+
+struct HttpTimer_Link {
+	HttpTimer_Link* pNext;
+	HttpTimer_Link* pPrev;
+	HttpTimer_Link() : pNext(this), pPrev(this) {} // An empty (or unlinked) list
+	bool Empty() const { return pNext == this; }
+};
+
+// One timer, set with HttpTimerWheel::Set(). It is cancelled when it is destroyed, so what it calls
+// may destroy it (or anything else with a timer), and may set it again.
+class HttpTimer : private HttpTimer_Link {
+public:
+	typedef fastdelegate::FastDelegate0<> Delegate;
+	HttpTimer() : m_pWheel(nullptr), m_list(0), m_dueMs(0) {}
+	~HttpTimer() { Cancel(); }
+
+	bool IsSet() const { return m_pWheel != nullptr; }
+	uint64 GetDueMs() const { return m_dueMs; } // While set
+	void Cancel(); // O(1). Does nothing if it isn't set
+
+private:
+	friend class HttpTimerWheel;
+	HttpTimerWheel* m_pWheel; // While set
+	uint m_list; // Which of m_pWheel's lists we are in
+	uint64 m_dueMs;
+	Delegate m_delegate;
+	HttpTimer(const HttpTimer&);
+	HttpTimer& operator=(const HttpTimer&);
+};
+
+class HttpTimerWheel {
+public:
+	enum { SLOT_BITS = 6, NUM_SLOTS = 1 << SLOT_BITS, NUM_LEVELS = 4 }; // Slots of 1 ms, 64 ms, 4.1 s and 4.4 minutes
+
+	HttpTimerWheel() : m_nowMs(0), m_size(0), m_advancing(false) { for (uint level = 0; level < NUM_LEVELS; level++) m_occupied[level] = 0; }
+	~HttpTimerWheel() { Clear(); }
+
+	// Have timer call delegate once Advance() reaches dueMs (an s3eTimerGetMs() time), instead of whatever it was set
+	// for before, if anything (on this wheel or another). If dueMs has been reached already, it is called by the
+	// next Advance(), or by this one if it is a timer's delegate that sets it.
+	void Set(HttpTimer& timer, uint64 dueMs, HttpTimer::Delegate delegate);
+	// Call the delegates of the timers that are due at or before nowMs, earliest first (in the order they were set,
+	// for the same time). A delegate can set and cancel timers, but mustn't call Advance().
+	void Advance(uint64 nowMs);
+	// Cancel all of the timers:
+	void Clear();
+
+	bool Empty() const { return m_size == 0; }
+	size_t Size() const { return m_size; }
+	uint64 GetNowMs() const { return m_nowMs; } // Where the last Advance() got to
+
+private:
+	friend class HttpTimer;
+	typedef HttpTimer_Link Link;
+	enum { LIST_OVERFLOW = NUM_LEVELS * NUM_SLOTS, LIST_DUE, NUM_LISTS }; // (The slots' lists come first)
+	Link m_lists[NUM_LISTS];
+	uint64 m_occupied[NUM_LEVELS]; // A bit for each slot whose list isn't empty
+	uint64 m_nowMs;
+	size_t m_size;
+	bool m_advancing;
+	void Place(HttpTimer& timer); // Link it into the right list for its m_dueMs
+	void Unlink(HttpTimer& timer);
+	void TakeSlot(uint level, uint slot, Link& to); // Move the timers in that slot to the end of to
+	HttpTimerWheel(const HttpTimerWheel&);
+	HttpTimerWheel& operator=(const HttpTimerWheel&);
+};
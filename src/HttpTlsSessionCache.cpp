@@ -0,0 +1,228 @@
+// HttpTlsSessionCache:
+// Keeps TLS sessions by server name, and persists them in a JSON file between launches.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpTlsSessionCache.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sstream>
+#include <s3eDebug.h>
+#include <s3eFile.h>
+#include "util/iohelpers.h"
+#include "util/json.h"
+#include "util/jsonbind.h"
+
+using std::string;
+
+// What the file holds, read and written without building json elements:
+struct HttpTlsSessionCache_SavedSession {
+	string host;
+	string session; // Hex
+};
+struct HttpTlsSessionCache_File {
+	HttpTlsSessionCache_File() : version(1) {}
+	int version;
+	std::vector<HttpTlsSessionCache_SavedSession> sessions;
+};
+JSON_FIELDS(HttpTlsSessionCache_SavedSession, host, session)
+JSON_FIELDS(HttpTlsSessionCache_File, version, sessions)
+
+namespace HttpTlsSessionCache {
+
+struct Slot {
+	char host[MAX_HOST_LENGTH + 1]; // Empty if the slot is free
+	unsigned char session[MAX_SESSION_SIZE]; // i2d_SSL_SESSION()
+	size_t size;
+	unsigned long long used; // s_sequence when last stored or resumed
+};
+
+static Slot s_slots[NUM_SLOTS];
+static unsigned long long s_sequence = 0;
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool s_enabled = false;
+static string s_filePath; // Only used by the app thread
+
+static Slot* HttpTlsSessionCache_Find(const char* host) {
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		if (s_slots[i].host[0] && strcmp(s_slots[i].host, host) == 0)
+			return &s_slots[i];
+	}
+	return nullptr;
+}
+
+// Replace host's session (else the least recently used one) with size bytes of session. Call with s_lock held.
+static void HttpTlsSessionCache_Store(const char* host, const unsigned char* session, size_t size) {
+	Slot* p_slot = HttpTlsSessionCache_Find(host);
+	for (int i = 0; !p_slot && i < NUM_SLOTS; i++) {
+		if (!s_slots[i].host[0])
+			p_slot = &s_slots[i];
+	}
+	if (!p_slot) {
+		p_slot = &s_slots[0];
+		for (int i = 1; i < NUM_SLOTS; i++) {
+			if (s_slots[i].used < p_slot->used)
+				p_slot = &s_slots[i];
+		}
+	}
+	strncpy(p_slot->host, host, MAX_HOST_LENGTH);
+	p_slot->host[MAX_HOST_LENGTH] = '\0';
+	memcpy(p_slot->session, session, size);
+	p_slot->size = size;
+	p_slot->used = ++s_sequence;
+}
+
+static const char* HttpTlsSessionCache_GetHost(const SSL* pSsl) {
+	const char* host = SSL_get_servername(pSsl, TLSEXT_NAMETYPE_host_name);
+	return host && *host && strlen(host) <= MAX_HOST_LENGTH ? host : nullptr;
+}
+
+// Before the ClientHello is written, give the connection the host's session (unless curl already
+// gave it one from its own cache). Once the handshake is done, keep the connection's session.
+static void HttpTlsSessionCache_InfoCallback(const SSL* pSsl, int where, int ret) {
+	if (!(where & (SSL_CB_HANDSHAKE_START | SSL_CB_HANDSHAKE_DONE)) || !s_enabled)
+		return;
+	const char* host = HttpTlsSessionCache_GetHost(pSsl);
+	if (!host)
+		return;
+	if (where & SSL_CB_HANDSHAKE_START) {
+		if (SSL_get_session(pSsl))
+			return;
+		SSL_SESSION* p_session = nullptr;
+		pthread_mutex_lock(&s_lock);
+		if (Slot* p_slot = HttpTlsSessionCache_Find(host)) {
+			const unsigned char* p = p_slot->session;
+			p_session = d2i_SSL_SESSION(nullptr, &p, (long)p_slot->size);
+			p_slot->used = ++s_sequence;
+		}
+		pthread_mutex_unlock(&s_lock);
+		if (p_session) {
+			SSL_set_session(const_cast<SSL*>(pSsl), p_session); // Takes its own reference
+			SSL_SESSION_free(p_session);
+		}
+	} else if (SSL_SESSION* p_session = SSL_get_session(pSsl)) {
+		const int size = i2d_SSL_SESSION(p_session, nullptr);
+		if (size <= 0 || size > MAX_SESSION_SIZE)
+			return;
+		unsigned char session[MAX_SESSION_SIZE];
+		unsigned char* p = session;
+		i2d_SSL_SESSION(p_session, &p);
+		pthread_mutex_lock(&s_lock);
+		HttpTlsSessionCache_Store(host, session, (size_t)size);
+		pthread_mutex_unlock(&s_lock);
+	}
+}
+
+void Install(SSL_CTX* pSslCtx) {
+	if (s_enabled)
+		SSL_CTX_set_info_callback(pSslCtx, HttpTlsSessionCache_InfoCallback);
+}
+
+bool IsEnabled() {
+	return s_enabled;
+}
+
+static string HttpTlsSessionCache_ToHex(const unsigned char* data, size_t size) {
+	static const char digits[] = "0123456789abcdef";
+	string hex(size * 2, '0');
+	for (size_t i = 0; i < size; i++) {
+		hex[i * 2] = digits[data[i] >> 4];
+		hex[i * 2 + 1] = digits[data[i] & 15];
+	}
+	return hex;
+}
+
+static int HttpTlsSessionCache_HexDigit(char c) {
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Returns the number of bytes, or 0 if hex isn't valid (or doesn't fit)
+static size_t HttpTlsSessionCache_FromHex(const string& hex, unsigned char* data, size_t capacity) {
+	if (hex.size() % 2 || hex.size() / 2 > capacity)
+		return 0;
+	for (size_t i = 0; i < hex.size() / 2; i++) {
+		const int hi = HttpTlsSessionCache_HexDigit(hex[i * 2]), lo = HttpTlsSessionCache_HexDigit(hex[i * 2 + 1]);
+		if (hi < 0 || lo < 0)
+			return 0;
+		data[i] = (unsigned char)(hi << 4 | lo);
+	}
+	return hex.size() / 2;
+}
+
+// Whether the session has expired since it was stored (servers would only refuse to resume it)
+static bool HttpTlsSessionCache_IsExpired(const unsigned char* session, size_t size) {
+	const unsigned char* p = session;
+	SSL_SESSION* p_session = d2i_SSL_SESSION(nullptr, &p, (long)size);
+	if (!p_session)
+		return true;
+	const bool expired = SSL_SESSION_get_time(p_session) + SSL_SESSION_get_timeout(p_session) < (long)time(nullptr);
+	SSL_SESSION_free(p_session);
+	return expired;
+}
+
+void Load(const char* filePath) {
+	s_filePath = filePath;
+	memset(s_slots, 0, sizeof(s_slots));
+	s_sequence = 0;
+	if (IsFile(s_filePath)) {
+		try {
+			const FileData data(s_filePath.c_str());
+			HttpTlsSessionCache_File file;
+			json::Reader::ReadValue(file, data.Data(), data.Size());
+			int num_loaded = 0;
+			for (size_t i = 0; i < file.sessions.size() && num_loaded < NUM_SLOTS; i++) {
+				const string& host = file.sessions[i].host;
+				Slot& slot = s_slots[num_loaded];
+				slot.size = HttpTlsSessionCache_FromHex(file.sessions[i].session, slot.session, MAX_SESSION_SIZE);
+				if (host.empty() || host.size() > MAX_HOST_LENGTH || !slot.size || HttpTlsSessionCache_IsExpired(slot.session, slot.size))
+					continue;
+				strcpy(slot.host, host.c_str());
+				slot.used = ++s_sequence;
+				num_loaded++;
+			}
+			s3eDebugTracePrintf("HttpTlsSessionCache: loaded %d sessions", num_loaded);
+		} catch (const std::exception& e) {
+			s3eDebugTracePrintf("HttpTlsSessionCache: Ignoring damaged file %s (%s)", s_filePath.c_str(), e.what());
+			memset(s_slots, 0, sizeof(s_slots));
+		}
+	}
+	s_enabled = true;
+}
+
+void Save() {
+	if (!s_enabled)
+		return;
+	s_enabled = false;
+	HttpTlsSessionCache_File file;
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		const Slot& slot = s_slots[i];
+		if (!slot.host[0])
+			continue;
+		HttpTlsSessionCache_SavedSession saved;
+		saved.host = slot.host;
+		saved.session = HttpTlsSessionCache_ToHex(slot.session, slot.size);
+		file.sessions.push_back(saved);
+	}
+	std::ostringstream out;
+	json::Writer::WriteValue(file, out, json::Writer::COMPACT);
+	const string data = out.str();
+
+	// As with HttpCache's index, replace the old file only once the new one is complete:
+	const string tmp_path = s_filePath + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "w");
+	if (!p_file) {
+		s3eDebugTracePrintf("HttpTlsSessionCache: Unable to write %s", tmp_path.c_str());
+		return;
+	}
+	const bool written = s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	s3eFileClose(p_file);
+	if (written) {
+		s3eFileDelete(s_filePath.c_str());
+		s3eFileRename(tmp_path.c_str(), s_filePath.c_str());
+	}
+}
+
+} // End namespace
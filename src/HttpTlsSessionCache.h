@@ -0,0 +1,38 @@
+// HttpTlsSessionCache:
+// An optional cache of TLS sessions that outlives the app, so that the first
+// HTTPS request of a launch can resume the session negotiated by an earlier
+// one (an abbreviated handshake: one round trip fewer) instead of starting a
+// full handshake. curl keeps its own session cache, but only in memory.
+// Sessions are kept by server name (SNI), so connections that are made to an
+// IP address are not cached. Turn it on with
+// HttpClient::SetTlsSessionCacheFile(): HttpClient::GlobalInit() then Load()s
+// the file, and HttpClient::GlobalCleanup() Save()s it.
+// The sessions are kept in a small fixed table of plain data guarded by a
+// mutex, so workers can update it without allocating in the app's memory
+// environment (see HttpClientWorker.h).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+namespace HttpTlsSessionCache {
+
+enum {
+	NUM_SLOTS = 8,             // Hosts; the least recently used one is replaced
+	MAX_HOST_LENGTH = 255,
+	MAX_SESSION_SIZE = 4096,   // Of a serialized session (which includes the server's certificate); larger ones aren't cached
+};
+
+// On the app thread, with no HttpClient alive:
+void Load(const char* filePath); // Enables the cache, starting with the sessions in filePath if it exists
+void Save(); // Write the cached sessions to the file given to Load(), and disable the cache
+bool IsEnabled();
+
+// From curl's CURLOPT_SSL_CTX_FUNCTION, on a worker: make the SSL connections of pSslCtx resume
+// a cached session and cache the sessions they negotiate.
+void Install(SSL_CTX* pSslCtx);
+
+} // End namespace
@@ -0,0 +1,151 @@
+// HttpTracer:
+// Records timestamped request lifecycle events from HttpClients.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpTracer.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+#include <s3eFile.h>
+
+using std::string;
+
+static const char* const HTTP_TRACER_EVENT_NAMES[HttpTracer::NUM_EVENTS] = { "queued", "started", "headers", "first byte", "done", "callback", "cleanup" };
+
+HttpTracer::HttpTracer(uint ringSize) : m_ringSize(ringSize), m_nextId(1) {
+}
+
+HttpTracer::~HttpTracer() {
+	for (auto it = m_rings.begin(); it != m_rings.end(); it++) {
+		delete[] (*it)->records;
+		delete *it;
+	}
+}
+
+uint64 HttpTracer::NowUs() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+HttpTracer::Ring* HttpTracer::AddRing(const string& name) {
+	uint size = 2;
+	while (size < m_ringSize)
+		size *= 2;
+	Ring* p_ring = new Ring;
+	p_ring->records = new Record[size];
+	p_ring->mask = size - 1;
+	p_ring->head = p_ring->tail = 0;
+	p_ring->dropped = 0;
+	p_ring->name = name;
+	m_rings.push_back(p_ring);
+	return p_ring;
+}
+
+uint HttpTracer::NewId(const HttpRequest& request) {
+	const uint id = m_nextId++;
+	m_names[id] = string(request.GetMethodStr()).append(1, ' ').append(request.GetURL());
+	return id;
+}
+
+void HttpTracer::Collect() {
+	for (uint i = 0; i < m_rings.size(); i++) {
+		Ring* p_ring = m_rings[i];
+		const uint tail = atomic::LoadRelaxed(p_ring->tail);
+		const uint head = atomic::LoadAcquire(p_ring->head);
+		for (uint pos = tail; pos != head; pos++) {
+			m_records.push_back(p_ring->records[pos & p_ring->mask]);
+			m_recordRings.push_back(i);
+		}
+		atomic::StoreRelease(p_ring->tail, head); // The producer may now reuse those slots
+	}
+}
+
+void HttpTracer::Clear() {
+	Collect();
+	m_records.clear();
+	m_recordRings.clear();
+	m_names.clear();
+}
+
+uint HttpTracer::GetNumDropped() const {
+	uint dropped = 0;
+	for (auto it = m_rings.begin(); it != m_rings.end(); it++)
+		dropped += (*it)->dropped;
+	return dropped;
+}
+
+static void HttpTracer_AppendQuoted(string& json, const string& value) {
+	json.append(1, '"');
+	const char* p = value.data();
+	const char* const p_end = p + value.size();
+	while (p != p_end) {
+		const char* p_run = p;
+		p = json::Detail::FindEscape(p, p_end);
+		json.append(p_run, p - p_run);
+		if (p == p_end)
+			break;
+		char escape[6];
+		json.append(escape, json::Detail::Escape(*p++, escape));
+	}
+	json.append(1, '"');
+}
+
+struct HttpTracer_ByTime {
+	const std::vector<HttpTracer::Record>& records;
+	HttpTracer_ByTime(const std::vector<HttpTracer::Record>& records) : records(records) {}
+	bool operator()(size_t a, size_t b) const { return records[a].timeUs < records[b].timeUs; }
+};
+
+string HttpTracer::ExportChromeTrace() {
+	Collect();
+	string json("{\"traceEvents\":[");
+	char buffer[160];
+	// Name each ring's track:
+	for (uint i = 0; i < m_rings.size(); i++) {
+		snprintf(buffer, sizeof(buffer), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", i ? "," : "", i + 1);
+		json.append(buffer);
+		HttpTracer_AppendQuoted(json, m_rings[i]->name);
+		json.append("}}");
+	}
+	std::vector<size_t> order(m_records.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), HttpTracer_ByTime(m_records));
+	static const string unknown("?");
+	for (size_t i = 0; i < order.size(); i++) {
+		const Record& record = m_records[order[i]];
+		auto it_name = m_names.find(record.id);
+		const string& name = it_name != m_names.end() ? it_name->second : unknown;
+		const uint tid = m_recordRings[order[i]] + 1;
+		if (record.event == EVENT_QUEUED || record.event == EVENT_CALLBACK || record.event == EVENT_STARTED) {
+			// The app thread's events make up an async span for each request, from being queued until its callback:
+			const char* phase = record.event == EVENT_QUEUED ? "b" : record.event == EVENT_CALLBACK ? "e" : "n";
+			json.append(",{\"name\":");
+			HttpTracer_AppendQuoted(json, record.event == EVENT_STARTED ? string(HTTP_TRACER_EVENT_NAMES[record.event]) : name);
+			snprintf(buffer, sizeof(buffer), ",\"cat\":\"http\",\"ph\":\"%s\",\"id\":%u,\"ts\":%llu,\"pid\":1,\"tid\":%u}", phase, record.id, (unsigned long long)record.timeUs, tid);
+			json.append(buffer);
+		} else {
+			// The workers' events are instants on their own tracks:
+			snprintf(buffer, sizeof(buffer), ",{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%u,\"args\":{\"id\":%u,\"request\":",
+				HTTP_TRACER_EVENT_NAMES[record.event < NUM_EVENTS ? record.event : 0], (unsigned long long)record.timeUs, tid, record.id);
+			json.append(buffer);
+			HttpTracer_AppendQuoted(json, name);
+			json.append("}}");
+		}
+	}
+	return json.append("],\"displayTimeUnit\":\"ms\"}");
+}
+
+bool HttpTracer::WriteChromeTrace(const char* filePath) {
+	const string json = ExportChromeTrace();
+	s3eFile* p_file = s3eFileOpen(filePath, "w");
+	if (!p_file)
+		return false;
+	const bool ok = s3eFileWrite(json.data(), 1, json.size(), p_file) == json.size();
+	s3eFileClose(p_file);
+	return ok;
+}
@@ -0,0 +1,90 @@
+// HttpTracer:
+// Records timestamped lifecycle events of the requests sent by one or more
+// HttpClients (see HttpClient::SetTracer()), for lining network activity up
+// against the app's own frame timeline. Each thread that produces events (the
+// app thread, and each worker) writes into its own fixed-size lock-free ring
+// buffer, so recording an event costs a clock read and a few stores, with no
+// locks or allocations. Collect() moves the events out of the rings on the app
+// thread; call it regularly (e.g. once per frame) so they don't overflow, as
+// events that don't fit are dropped and counted. ExportChromeTrace() writes
+// everything collected so far in Chrome's trace event format, for
+// chrome://tracing or https://ui.perfetto.dev.
+// Must outlive the HttpClients that use it. All methods but Trace() must be
+// called on the app thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HttpRequest.h"
+#include "util/atomic.h"
+
+class HttpTracer {
+public:
+	enum Event {
+		EVENT_QUEUED,     // QueueRequest() (or queued again after being preempted)
+		EVENT_STARTED,    // Handed to a worker
+		EVENT_HEADERS,    // The worker has received the response headers
+		EVENT_FIRST_BYTE, // The worker has received the first byte of the response body
+		EVENT_DONE,       // The worker has finished the transfer
+		EVENT_CALLBACK,   // The request's callback has been called
+		EVENT_CLEANUP,    // The worker has cleaned up after the request
+		NUM_EVENTS
+	};
+	struct Record {
+		uint64 timeUs; // See NowUs()
+		uint id; // The request, as numbered by NewId()
+		uint event;
+	};
+	// Each ring holds up to ringSize events (rounded up to a power of two) between calls to Collect().
+	HttpTracer(uint ringSize = 1024);
+	~HttpTracer();
+
+	void Collect(); // Move recorded events out of the rings
+	void Clear(); // Forget everything collected so far
+	uint GetNumDropped() const; // Events dropped because their ring was full
+	size_t GetNumRecords() const { return m_records.size(); } // Collected so far
+	// Collect(), then format everything as Chrome trace event JSON
+	std::string ExportChromeTrace();
+	bool WriteChromeTrace(const char* filePath);
+
+	static uint64 NowUs(); // Microseconds on a monotonic clock: use this to timestamp the app's own events, so they line up
+
+	/////// Internal methods used by HttpClient ///////
+	// One producer (thread) per ring: only that thread may Trace() to it.
+	struct Ring {
+		Record* records;
+		uint mask;
+		volatile uint head; // Written by the producer
+		volatile uint tail; // Written by Collect()
+		uint dropped; // Only written by the producer
+		std::string name; // e.g. "HttpClient 1 worker 3"
+	};
+	Ring* AddRing(const std::string& name);
+	uint NewId(const HttpRequest& request); // Number a request, and remember what to call it
+	static void Trace(Ring* pRing, Event event, uint id) {
+		const uint head = atomic::LoadRelaxed(pRing->head);
+		if (head - atomic::LoadAcquire(pRing->tail) > pRing->mask) {
+			pRing->dropped++;
+			return;
+		}
+		Record& record = pRing->records[head & pRing->mask];
+		record.timeUs = NowUs();
+		record.id = id;
+		record.event = event;
+		atomic::StoreRelease(pRing->head, head + 1);
+	}
+
+private:
+	const uint m_ringSize;
+	std::vector<Ring*> m_rings;
+	std::vector<Record> m_records;
+	std::vector<uint> m_recordRings; // The index of the ring that each of m_records came from
+	std::map<uint, std::string> m_names; // By request id, e.g. "GET http://example.com/"
+	uint m_nextId;
+};
@@ -0,0 +1,119 @@
+// HttpUrl:
+// A URL, parsed once, and a builder for it.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpUrl.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "HttpRequest.h"
+
+using std::string;
+
+void HttpUrl::Parse() {
+	// "scheme://user@host:port/path?query#fragment"
+	const string::size_type scheme_end = m_url.find("://");
+	m_schemeLength = scheme_end == string::npos ? 0 : scheme_end;
+	const size_t authority_start = scheme_end == string::npos ? 0 : scheme_end + 3;
+	string::size_type authority_end = m_url.find_first_of("/?#", authority_start);
+	if (authority_end == string::npos)
+		authority_end = m_url.size();
+	const string::size_type at = m_url.rfind('@', authority_end);
+	m_hostStart = at == string::npos || at < authority_start ? authority_start : at + 1;
+	// The port is after the last ':', unless that is inside an IPv6 address ("[::1]:8080"):
+	string::size_type colon = m_url.rfind(':', authority_end);
+	const string::size_type bracket = m_url.rfind(']', authority_end);
+	if (colon != string::npos && (colon < m_hostStart || (bracket != string::npos && bracket >= m_hostStart && colon < bracket)))
+		colon = string::npos;
+	m_hostLength = (colon == string::npos ? authority_end : colon) - m_hostStart;
+	m_port = colon == string::npos ? 0 : (uint)strtoul(m_url.c_str() + colon + 1, nullptr, 10);
+	m_hasQuery = m_url.find('?', authority_end) != string::npos;
+}
+
+bool HttpUrl::IsHttps() const {
+	return m_schemeLength == 5 && HttpHeaders::CompareNames(m_url.data(), 5, "https", 5) == 0;
+}
+
+HttpUrl& HttpUrl::AddPath(const string& segment) {
+	IwAssert(HTTP_CLIENT, !m_hasQuery);
+	m_url.append(1, '/');
+	HttpRequest::UrlEncode(segment.data(), segment.size(), m_url);
+	return *this;
+}
+
+HttpUrl& HttpUrl::AddQuery(const string& key, const string& value) {
+	m_url.append(1, m_hasQuery ? '&' : '?');
+	m_hasQuery = true;
+	// (Not strict, so "-_." stay as they are and spaces are '+', as servers expect in a query string)
+	HttpRequest::UrlEncode(key.data(), key.size(), m_url, false);
+	m_url.append(1, '=');
+	HttpRequest::UrlEncode(value.data(), value.size(), m_url, false);
+	return *this;
+}
+
+HttpUrl& HttpUrl::AddQuery(const string& key, int64 value) {
+	char number[24];
+	snprintf(number, sizeof(number), "%lld", (long long)value);
+	return AddQuery(key, string(number));
+}
+
+string HttpUrl::GetOrigin() const {
+	string origin = GetScheme();
+	origin.append("://").append(m_url, m_hostStart, m_hostLength);
+	for (auto it = origin.begin(); it != origin.end(); it++)
+		*it = tolower(*it);
+	// Add the default port so that "http://a.com" and "http://a.com:80" count as the same host:
+	char port[16];
+	snprintf(port, sizeof(port), ":%u", m_port ? m_port : IsHttps() ? 443u : 80u);
+	return origin.append(port);
+}
+
+string HttpUrl::GetOrigin(const string& url) {
+	return HttpUrl(url).GetOrigin();
+}
+
+// Whether a path segment looks like an ID, rather than a name that the server routes on:
+static bool HttpUrl_IsId(const char* pSegment, size_t length) {
+	bool digits = length > 0, hex = length >= 8, any_digit = false;
+	for (size_t i = 0; i < length && (digits || hex); i++) {
+		const char c = pSegment[i];
+		any_digit = any_digit || isdigit((unsigned char)c);
+		digits = digits && isdigit((unsigned char)c);
+		hex = hex && (isxdigit((unsigned char)c) || c == '-');
+	}
+	return digits || (hex && any_digit);
+}
+
+string HttpUrl::GetEndpoint() const {
+	string endpoint = GetOrigin();
+	size_t pos = m_url.find_first_of("/?#", m_hostStart + m_hostLength);
+	while (pos < m_url.size() && m_url[pos] == '/') {
+		size_t end = m_url.find_first_of("/?#", pos + 1);
+		if (end == string::npos)
+			end = m_url.size();
+		endpoint += '/';
+		if (HttpUrl_IsId(m_url.data() + pos + 1, end - pos - 1))
+			endpoint += '*';
+		else
+			endpoint.append(m_url, pos + 1, end - pos - 1);
+		pos = end;
+	}
+	return endpoint;
+}
+
+string HttpUrl::GetEndpoint(const string& url) {
+	return HttpUrl(url).GetEndpoint();
+}
+
+string HttpUrl::GetPathAndQuery() const {
+	size_t start = m_hostStart + m_hostLength;
+	while (start < m_url.size() && m_url[start] != '/' && m_url[start] != '?' && m_url[start] != '#')
+		start++; // (Past the port)
+	const size_t end = m_url.find('#', start);
+	string path = m_url.substr(start, end == string::npos ? string::npos : end - start);
+	return path.empty() || path[0] != '/' ? path.insert(0, 1, '/') : path;
+}
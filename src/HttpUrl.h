@@ -0,0 +1,63 @@
+// HttpUrl:
+// A URL, parsed once into the parts that the HttpClient needs (scheme, host,
+// port and origin), and a builder for adding path segments and URL-encoded
+// query parameters to it in place, e.g.
+//     HttpUrl url("https://www.googleapis.com/youtube/v3");
+//     url.AddPath("videos").AddQuery("part", "snippet").AddQuery("id", videoId);
+//     client.QueueRequest(new HttpPost(url), pCallback);
+// Each addition is encoded straight onto the end of the URL, measuring first
+// so that the string grows at most once (call Reserve() to make it none).
+// It converts to a const std::string&, so it can go wherever a URL string
+// does.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include "s3eTypes.h"
+
+class HttpUrl {
+public:
+	HttpUrl() { Parse(); }
+	HttpUrl(const char* url) : m_url(url) { Parse(); }
+	HttpUrl(const std::string& url) : m_url(url) { Parse(); }
+
+	// Building. The scheme, host and port don't change and are not re-parsed, so these
+	// only touch the end of the URL. Query parameters must come after the path.
+	HttpUrl& Reserve(size_t extraLength) { m_url.reserve(m_url.size() + extraLength); return *this; }
+	HttpUrl& AddPath(const std::string& segment); // Appends "/<segment>", URL-encoded
+	HttpUrl& AddQuery(const std::string& key, const std::string& value); // Appends "?key=value" or "&key=value", URL-encoded
+	HttpUrl& AddQuery(const std::string& key, int64 value);
+
+	const std::string& Str() const { return m_url; }
+	const char* c_str() const { return m_url.c_str(); }
+	operator const std::string&() const { return m_url; }
+
+	// The parts, as they are in the URL (the scheme is "http" if there is none; the port is 0 if there is none):
+	std::string GetScheme() const { return m_schemeLength ? m_url.substr(0, m_schemeLength) : std::string("http"); }
+	std::string GetHost() const { return m_url.substr(m_hostStart, m_hostLength); }
+	uint GetPort() const { return m_port; }
+	bool IsHttps() const;
+	// "scheme://host:port" in lower case, with the scheme's default port if there is none, which is what
+	// per-host limits (see HttpScheduler) apply to:
+	std::string GetOrigin() const;
+	static std::string GetOrigin(const std::string& url); // Without keeping an HttpUrl
+	// What goes in the request line: the path (at least "/") and the query, if any:
+	std::string GetPathAndQuery() const;
+	// The endpoint: the origin and the path, with the path segments that look like IDs (all digits, or long runs of
+	// hex digits, as in UUIDs and hashes) as "*", and without the query, e.g. "https://api.example.com:443/users/*/avatar"
+	// for "https://api.example.com/users/1234/avatar?size=64". What the client keeps per-endpoint figures by (see
+	// HttpClient::SetSizeHints() and SetEndpointStats()):
+	std::string GetEndpoint() const;
+	static std::string GetEndpoint(const std::string& url);
+
+private:
+	std::string m_url;
+	size_t m_schemeLength; // 0 if there is no "scheme://"
+	size_t m_hostStart, m_hostLength; // Without any "user@" or ":port"
+	uint m_port;
+	bool m_hasQuery;
+	void Parse();
+};
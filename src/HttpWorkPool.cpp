@@ -0,0 +1,54 @@
+// HttpWorkPool:
+// Lets several HttpClients lend each other their idle workers.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpWorkPool.h"
+
+#include <algorithm>
+
+#include "HttpClient.h"
+
+HttpWorkPool::~HttpWorkPool() {
+	IwAssert(HTTP_CLIENT, m_clients.empty()); // Every client must be detached first
+}
+
+void HttpWorkPool::Attach(HttpClient* pClient) {
+	IwAssert(HTTP_CLIENT, std::find(m_clients.begin(), m_clients.end(), pClient) == m_clients.end());
+	m_clients.push_back(pClient);
+}
+
+void HttpWorkPool::Detach(HttpClient* pClient) {
+	// As far as their owners' queues are concerned, requests lent by or to pClient are done with now. They
+	// still complete on the workers that have them:
+	for (size_t i = 0; i < m_clients.size(); i++)
+		m_clients[i]->ReturnBorrowed(m_clients[i] == pClient ? nullptr : pClient);
+	m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), pClient), m_clients.end());
+}
+
+Ptr<HttpRequest> HttpWorkPool::Borrow(HttpClient& borrower, HttpClient*& pOwner) {
+	// The client with the most requests that could start right now, if it has no worker for them:
+	HttpClient* p_lender = nullptr;
+	size_t most_waiting = 0;
+	for (size_t i = 0; i < m_clients.size(); i++) {
+		HttpClient* p_client = m_clients[i];
+		if (p_client == &borrower || !p_client->CanLendTo(borrower))
+			continue;
+		const size_t num_waiting = p_client->m_scheduler.Size() - p_client->m_scheduler.NumDelayed();
+		if (num_waiting > most_waiting) {
+			most_waiting = num_waiting;
+			p_lender = p_client;
+		}
+	}
+	if (!p_lender)
+		return nullptr;
+	// Popped just as the lender's own Update() would, so it counts against the lender's host limits until it's done:
+	Ptr<HttpRequest> p_request = p_lender->m_scheduler.Pop(HttpClient::IsLendable, &borrower);
+	if (p_request) {
+		pOwner = p_lender;
+		p_lender->m_numLent++;
+		borrower.m_numBorrowed++;
+	}
+	return p_request;
+}
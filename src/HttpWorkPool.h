@@ -0,0 +1,49 @@
+// HttpWorkPool:
+// Lets several HttpClients (e.g. one for API calls, one for a CDN and one for
+// uploads) lend each other their idle workers. Each client keeps its own
+// queue, settings and workers; but when one of them has workers left idle
+// after Update() has given them all of its own requests, they may take
+// requests that another client in the pool has queued but has no worker for.
+// Those requests still count against their own client's host limits (see
+// HttpClient::SetMaxRequestsPerHost()), so the limits hold wherever they are
+// sent from, and their callbacks are called as usual.
+// Only work that is safe to move is taken: from a client whose workers are
+// all busy, that shares the borrower's caches, tracer and user agent and has
+// no bandwidth limit, and never a request that the borrower would hedge
+// (hedging goes by a client's own latencies). The owner's retry policy still
+// applies, and so does its queue if the request is retried; timeouts,
+// compression and the like are the borrowing client's.
+// Like HttpClient, it must only be used from the app thread. Detach a client
+// (with HttpClient::SetWorkPool(nullptr), which its destructor does too)
+// before destroying the pool.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <vector>
+
+#include "HttpRequest.h"
+
+class HttpClient;
+
+class HttpWorkPool {
+public:
+	HttpWorkPool() {}
+	~HttpWorkPool();
+	
+	size_t Size() const { return m_clients.size(); } // How many clients are attached
+	
+	/////// Internal methods used by HttpClient ///////
+	void Attach(HttpClient* pClient);
+	void Detach(HttpClient* pClient);
+	// A request for one of borrower's idle workers, from the busiest client that can lend it one, or nullptr.
+	// pOwner is set to the client that it was queued with.
+	Ptr<HttpRequest> Borrow(HttpClient& borrower, HttpClient*& pOwner);
+	
+private:
+	std::vector<HttpClient*> m_clients;
+	HttpWorkPool(const HttpWorkPool&);
+	HttpWorkPool& operator=(const HttpWorkPool&);
+};
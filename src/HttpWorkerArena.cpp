@@ -0,0 +1,152 @@
+// HttpWorkerArena:
+// The scratch memory that each HttpClient worker reuses from one request to the next.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "HttpWorkerArena.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HttpAllocStats.h"
+
+static pthread_key_t s_currentKey;
+static pthread_once_t s_currentKeyOnce = PTHREAD_ONCE_INIT;
+
+static void HttpWorkerArena_CreateKey() {
+	pthread_key_create(&s_currentKey, nullptr);
+}
+
+HttpWorkerArena* HttpWorkerArena::Current() {
+	pthread_once(&s_currentKeyOnce, HttpWorkerArena_CreateKey);
+	return static_cast<HttpWorkerArena*>(pthread_getspecific(s_currentKey));
+}
+
+HttpWorkerArena::Scope::Scope(HttpWorkerArena& arena) : m_pPrevious(Current()) {
+	pthread_setspecific(s_currentKey, &arena);
+}
+
+HttpWorkerArena::Scope::~Scope() {
+	pthread_setspecific(s_currentKey, m_pPrevious);
+}
+
+void* HttpWorkerArena::Alloc(size_t size) {
+	if (IsLarge(size))
+		return AllocLarge(size);
+	size = Round(size ? size : 1);
+	if (!m_pTop || (size_t)(m_pEnd - m_pTop) < size) {
+		Block* p_block = static_cast<Block*>(malloc(offsetof(Block, align) + BLOCK_SIZE));
+		if (!p_block)
+			return nullptr;
+		HTTP_ALLOC_COUNT(offsetof(Block, align) + BLOCK_SIZE);
+		p_block->pPrev = nullptr;
+		p_block->pNext = m_pBlocks;
+		p_block->size = BLOCK_SIZE;
+		m_pBlocks = p_block;
+		m_pTop = BlockData(p_block);
+		m_pEnd = m_pTop + BLOCK_SIZE;
+	}
+	void* p = m_pTop;
+	m_pTop += size;
+	return p;
+}
+
+void* HttpWorkerArena::Realloc(void* p, size_t oldSize, size_t newSize) {
+	if (!p)
+		return Alloc(newSize);
+	if (IsLarge(oldSize) && IsLarge(newSize))
+		return ReallocLarge(p, newSize);
+	if (!IsLarge(oldSize) && !IsLarge(newSize)) {
+		char* p_end = static_cast<char*>(p) + Round(oldSize ? oldSize : 1);
+		// The latest allocation can grow or shrink where it is:
+		if (p_end == m_pTop && static_cast<char*>(p) + Round(newSize ? newSize : 1) <= m_pEnd) {
+			m_pTop = static_cast<char*>(p) + Round(newSize ? newSize : 1);
+			return p;
+		}
+		if (newSize <= oldSize)
+			return p;
+	}
+	void* p_new = Alloc(newSize);
+	if (!p_new)
+		return nullptr;
+	memcpy(p_new, p, oldSize < newSize ? oldSize : newSize);
+	Free(p, oldSize);
+	return p_new;
+}
+
+void HttpWorkerArena::Free(void* p, size_t size) {
+	if (!p)
+		return;
+	if (IsLarge(size)) {
+		FreeLarge(p);
+		return;
+	}
+	// Only the latest allocation can be given back before Reset():
+	if (static_cast<char*>(p) + Round(size ? size : 1) == m_pTop)
+		m_pTop = static_cast<char*>(p);
+}
+
+void HttpWorkerArena::Reset() {
+	while (m_pLarge)
+		FreeLarge(BlockData(m_pLarge));
+	if (!m_pBlocks)
+		return;
+	// Keep the first block, which is the last in the list:
+	while (m_pBlocks->pNext) {
+		Block* p_next = m_pBlocks->pNext;
+		free(m_pBlocks);
+		m_pBlocks = p_next;
+	}
+	m_pTop = BlockData(m_pBlocks);
+	m_pEnd = m_pTop + BLOCK_SIZE;
+}
+
+void HttpWorkerArena::Release() {
+	Reset();
+	free(m_pBlocks);
+	m_pBlocks = nullptr;
+	m_pTop = m_pEnd = nullptr;
+}
+
+void* HttpWorkerArena::AllocLarge(size_t size) {
+	Block* p_block = static_cast<Block*>(malloc(offsetof(Block, align) + size));
+	if (!p_block)
+		return nullptr;
+	HTTP_ALLOC_COUNT(offsetof(Block, align) + size);
+	p_block->pPrev = nullptr;
+	p_block->pNext = m_pLarge;
+	p_block->size = size;
+	if (m_pLarge)
+		m_pLarge->pPrev = p_block;
+	m_pLarge = p_block;
+	return BlockData(p_block);
+}
+
+void* HttpWorkerArena::ReallocLarge(void* p, size_t size) {
+	Block* p_block = static_cast<Block*>(realloc(LargeBlockOf(p), offsetof(Block, align) + size));
+	if (!p_block)
+		return nullptr; // (p is still as it was)
+	HTTP_ALLOC_COUNT(offsetof(Block, align) + size);
+	p_block->size = size;
+	// It may have moved:
+	if (p_block->pPrev)
+		p_block->pPrev->pNext = p_block;
+	else
+		m_pLarge = p_block;
+	if (p_block->pNext)
+		p_block->pNext->pPrev = p_block;
+	return BlockData(p_block);
+}
+
+void HttpWorkerArena::FreeLarge(void* p) {
+	Block* p_block = LargeBlockOf(p);
+	if (p_block->pPrev)
+		p_block->pPrev->pNext = p_block->pNext;
+	else
+		m_pLarge = p_block->pNext;
+	if (p_block->pNext)
+		p_block->pNext->pPrev = p_block->pPrev;
+	free(p_block);
+}
@@ -0,0 +1,80 @@
+// HttpWorkerArena:
+// A bump allocator that each HttpClient worker keeps for what its requests
+// need only while they are being received: the response body and the JSON
+// tape it is parsed onto (see HttpResponseBody). It is all given back at once
+// when the worker cleans up after a request (see
+// HttpClient_Worker_HandleCleanup()), and the arena keeps its first block for
+// the next one, so a worker that receives one ordinary response after another
+// allocates nothing for them. Anything bigger than a quarter of a block (a
+// download, or a large document) gets a block to itself, which can grow in
+// place with realloc(), and is freed at that point with any extra blocks. So
+// what each worker keeps stays at one block, however big its responses get.
+// The worker's header buffers already keep their memory from one request to
+// the next (see HttpHeaders::Clear()), so they don't need this.
+// It lives in the worker memory environment: only the worker or I/O thread
+// that drives the worker uses it, which it marks with a Scope while it calls
+// the request, so that the request's body can find it through Current().
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+
+#include <IwDebug.h>
+
+#include "util/jsontape.h"
+
+class HttpWorkerArena : public json::TapeWriter::Allocator {
+public:
+	enum { BLOCK_SIZE = 64 * 1024 };
+
+	HttpWorkerArena() : m_pBlocks(nullptr), m_pLarge(nullptr), m_pTop(nullptr), m_pEnd(nullptr) {}
+	~HttpWorkerArena() { IwAssert(HTTP_CLIENT, m_pBlocks == nullptr && m_pLarge == nullptr); } // Release() must have been called from the worker thread
+
+	// Like malloc()/realloc()/free(), except that the caller says how big p is. NULL if out of memory.
+	// (Realloc() and Free() are also what a TapeWriter that records into the arena calls.)
+	void* Alloc(size_t size);
+	virtual void* Realloc(void* p, size_t oldSize, size_t newSize);
+	virtual void Free(void* p, size_t size);
+	// Forget everything allocated, keeping the first block:
+	void Reset();
+	// Free all of it, e.g. along with the worker's curl handle:
+	void Release();
+
+	// The arena of the worker whose request this thread is calling, or nullptr:
+	static HttpWorkerArena* Current();
+	class Scope {
+	public:
+		Scope(HttpWorkerArena& arena);
+		~Scope();
+	private:
+		HttpWorkerArena* m_pPrevious;
+		Scope(const Scope&);
+		Scope& operator=(const Scope&);
+	};
+
+private:
+	struct Block {
+		Block* pPrev; // (Only kept up for large blocks, which can be freed one at a time)
+		Block* pNext;
+		size_t size;
+		double align; // The allocations come after this
+	};
+	Block* m_pBlocks; // Blocks of BLOCK_SIZE, the one being allocated from first
+	Block* m_pLarge; // Blocks of their own, for large allocations
+	char* m_pTop; // Free space in m_pBlocks...
+	char* m_pEnd; // ...up to here
+
+	static bool IsLarge(size_t size) { return size > BLOCK_SIZE / 4; }
+	static size_t Round(size_t size) { return (size + sizeof(double) - 1) & ~(sizeof(double) - 1); }
+	static char* BlockData(Block* pBlock) { return reinterpret_cast<char*>(&pBlock->align); }
+	static Block* LargeBlockOf(void* p) { return reinterpret_cast<Block*>(static_cast<char*>(p) - offsetof(Block, align)); }
+	void* AllocLarge(size_t size);
+	void* ReallocLarge(void* p, size_t size);
+	void FreeLarge(void* p);
+
+	HttpWorkerArena(const HttpWorkerArena&);
+	HttpWorkerArena& operator=(const HttpWorkerArena&);
+};
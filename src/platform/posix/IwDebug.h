@@ -0,0 +1,21 @@
+// POSIX platform layer: IwDebug.h
+// IwAssert() is checked unless NDEBUG is defined (much as Marmalade only
+// checks it in debug builds), and aborts with the failed expression.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eDebug.h"
+#include "s3eDevice.h" // (Which the SDK's IwDebug.h brings in too)
+
+void s3ePosix_AssertFailed(const char* channel, const char* expr, const char* file, int line);
+
+#ifdef NDEBUG
+#define IwAssert(channel, expr) ((void)0)
+#define IwAssertMsg(channel, expr, message) ((void)0)
+#else
+#define IwAssert(channel, expr) ((expr) ? (void)0 : s3ePosix_AssertFailed(#channel, #expr, __FILE__, __LINE__))
+#define IwAssertMsg(channel, expr, message) ((expr) ? (void)0 : (s3eDebugTracePrintf message, s3ePosix_AssertFailed(#channel, #expr, __FILE__, __LINE__)))
+#endif
@@ -0,0 +1,15 @@
+// POSIX platform layer: IwMath.h
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eTypes.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
@@ -0,0 +1,12 @@
+// POSIX platform layer: s3eDebug.h
+// Traces go to stderr, one line each.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eTypes.h"
+
+void s3eDebugTracePrintf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void s3eDebugTraceLine(const char* line);
@@ -0,0 +1,28 @@
+// POSIX platform layer: s3eDevice.h
+// There is no event loop to run: s3eDeviceYield() just sleeps (or gives up
+// the CPU, for 0 ms), and a quit is only ever requested by
+// s3ePosix_RequestQuit(), e.g. from a signal handler. Likewise, the device
+// callbacks (e.g. S3E_DEVICE_PAUSE) are only ever called by
+// s3ePosix_SendDeviceEvent(), on the thread that calls it (which should be
+// the app thread, as it is on a device).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eTypes.h"
+
+s3eResult s3eDeviceYield(int32 ms = 0);
+s3eBool s3eDeviceCheckQuitRequest();
+void s3ePosix_RequestQuit();
+
+typedef enum s3eDeviceCallback {
+	S3E_DEVICE_PAUSE,   // The app is being suspended (sent to the background)
+	S3E_DEVICE_UNPAUSE, // And is back
+	S3E_DEVICE_CALLBACK_MAX
+} s3eDeviceCallback;
+
+s3eResult s3eDeviceRegister(s3eDeviceCallback cbid, s3eCallback fn, void* userData);
+s3eResult s3eDeviceUnRegister(s3eDeviceCallback cbid, s3eCallback fn);
+void s3ePosix_SendDeviceEvent(s3eDeviceCallback cbid); // Call the callbacks registered for cbid
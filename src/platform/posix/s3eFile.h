@@ -0,0 +1,73 @@
+// POSIX platform layer: s3eFile.h
+// The s3e file functions that the library uses, on stdio and the POSIX file
+// system calls. A path may start with an s3e drive ("rom://", "ram://",
+// "cache://" and so on), which is mapped to a folder: "raw://" to the root of
+// the file system, and any other drive, by default, to a folder of its name
+// in the current directory (so "cache://a/b" is "cache/a/b").
+// s3ePosix_SetDriveFolder() maps a drive elsewhere. A path without a drive is
+// relative to the current directory.
+// The last error is per thread, not global as on Marmalade.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eTypes.h"
+
+#define S3E_FILE_MAX_PATH 128
+
+struct s3eFile;
+struct s3eFileList;
+
+typedef enum s3eFileSeekOrigin {
+	S3E_FILESEEK_SET,
+	S3E_FILESEEK_CUR,
+	S3E_FILESEEK_END
+} s3eFileSeekOrigin;
+
+typedef enum s3eFileProperty {
+	S3E_FILE_ISDIR,
+	S3E_FILE_ISFILE,
+	S3E_FILE_SIZE,
+	S3E_FILE_MODIFIED_DATE, // In ms since 1970
+	S3E_FILE_REAL_PATH // (For s3eFileGetFileString())
+} s3eFileProperty;
+
+typedef enum s3eFileError {
+	S3E_FILE_ERR_NONE = 0,
+	S3E_FILE_ERR_PARAM = 1,
+	S3E_FILE_ERR_NOT_FOUND = 4,
+	S3E_FILE_ERR_EXISTS = 6,
+	S3E_FILE_ERR_ACCESS = 9,
+	S3E_FILE_ERR_DEVICE = 11,
+	S3E_FILE_ERR_GENERIC = 1000
+} s3eFileError;
+
+s3eFile* s3eFileOpen(const char* filename, const char* mode);
+s3eResult s3eFileClose(s3eFile* file);
+uint32 s3eFileRead(void* buffer, uint32 elemSize, uint32 noElems, s3eFile* file);
+uint32 s3eFileWrite(const void* buffer, uint32 elemSize, uint32 noElems, s3eFile* file);
+s3eResult s3eFileSeek(s3eFile* file, int32 offset, s3eFileSeekOrigin origin);
+int32 s3eFileTell(s3eFile* file);
+int32 s3eFileGetSize(s3eFile* file);
+s3eResult s3eFileFlush(s3eFile* file);
+s3eBool s3eFileEOF(s3eFile* file);
+
+s3eBool s3eFileCheckExists(const char* filename);
+int64 s3eFileGetFileInt(const char* filename, s3eFileProperty property); // -1 if the file isn't there
+s3eResult s3eFileGetFileString(const char* filename, s3eFileProperty property, char* str, int len);
+s3eResult s3eFileDelete(const char* filename);
+s3eResult s3eFileRename(const char* src, const char* dest);
+s3eResult s3eFileMakeDirectory(const char* dirName);
+s3eResult s3eFileDeleteDirectory(const char* dirName);
+
+s3eFileList* s3eFileListDirectory(const char* dirName);
+s3eResult s3eFileListNext(s3eFileList* handle, char* filename, int filenameLen); // S3E_RESULT_ERROR once there are no more
+s3eResult s3eFileListClose(s3eFileList* handle);
+
+s3eFileError s3eFileGetError();
+const char* s3eFileGetErrorString();
+
+// Map "<drive>://" to folder (e.g. "/var/cache/myservice"), instead of "<drive>" in the current directory.
+void s3ePosix_SetDriveFolder(const char* drive, const char* folder);
@@ -0,0 +1,15 @@
+// POSIX platform layer: s3eMemory.h
+// There is only the one heap, so the app thread's and the workers' memory
+// environments are the same and allocations may cross between them (the
+// library still keeps them apart, as it must on Marmalade).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eTypes.h"
+
+inline void* s3eMalloc(int size) { return malloc(size); }
+inline void* s3eRealloc(void* item, int size) { return realloc(item, size); }
+inline void s3eFree(void* item) { free(item); }
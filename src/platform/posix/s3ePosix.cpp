@@ -0,0 +1,304 @@
+// POSIX platform layer:
+// Stands in for the parts of the Marmalade SDK (s3e and IwDebug) that the
+// library uses, so that the same HttpClient, HttpRequest and json code builds
+// as a native library on Linux and macOS, e.g. for backend services, or for
+// load and benchmark tests on real multi-core hardware. The headers in this
+// folder take the place of the SDK's: put it on the include path (ahead of
+// anything else providing them) and compile this file along with src and
+// src/util. The Marmalade build never sees it.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "IwDebug.h"
+#include "s3eDevice.h"
+#include "s3eFile.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using std::string;
+
+struct s3eFile {
+	FILE* pFile;
+};
+
+struct s3eFileList {
+	DIR* pDir;
+};
+
+static __thread int s_fileErrno = 0; // Of the last file function on this thread to fail
+static std::map<string, string> s_driveFolders; // Set from the app's startup, before any other thread uses the file system
+static volatile int s_quitRequested = 0;
+static std::vector< std::pair<s3eCallback, void*> > s_deviceCallbacks[S3E_DEVICE_CALLBACK_MAX]; // App thread only
+
+///////////////////////////////////////////////////////////////////////////////
+// Debug:
+
+void s3eDebugTracePrintf(const char* format, ...) {
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	s3eDebugTraceLine(line);
+}
+
+void s3eDebugTraceLine(const char* line) {
+	fprintf(stderr, "%s\n", line); // (One call, so that the lines of different threads don't interleave)
+}
+
+void s3ePosix_AssertFailed(const char* channel, const char* expr, const char* file, int line) {
+	fprintf(stderr, "%s:%d: %s assertion failed: %s\n", file, line, channel, expr);
+	abort();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Device:
+
+s3eResult s3eDeviceYield(int32 ms) {
+	if (ms > 0)
+		usleep((useconds_t)ms * 1000);
+	else
+		sched_yield();
+	return S3E_RESULT_SUCCESS;
+}
+
+s3eBool s3eDeviceCheckQuitRequest() {
+	return __atomic_load_n(&s_quitRequested, __ATOMIC_RELAXED) ? S3E_TRUE : S3E_FALSE;
+}
+
+void s3ePosix_RequestQuit() {
+	__atomic_store_n(&s_quitRequested, 1, __ATOMIC_RELAXED); // (An atomic store is safe in a signal handler)
+}
+
+s3eResult s3eDeviceRegister(s3eDeviceCallback cbid, s3eCallback fn, void* userData) {
+	if ((uint)cbid >= S3E_DEVICE_CALLBACK_MAX || !fn)
+		return S3E_RESULT_ERROR;
+	s_deviceCallbacks[cbid].push_back(std::make_pair(fn, userData));
+	return S3E_RESULT_SUCCESS;
+}
+
+s3eResult s3eDeviceUnRegister(s3eDeviceCallback cbid, s3eCallback fn) {
+	if ((uint)cbid >= S3E_DEVICE_CALLBACK_MAX)
+		return S3E_RESULT_ERROR;
+	std::vector< std::pair<s3eCallback, void*> >& callbacks = s_deviceCallbacks[cbid];
+	for (size_t i = 0; i < callbacks.size(); i++) {
+		if (callbacks[i].first == fn) {
+			callbacks.erase(callbacks.begin() + i);
+			return S3E_RESULT_SUCCESS;
+		}
+	}
+	return S3E_RESULT_ERROR;
+}
+
+void s3ePosix_SendDeviceEvent(s3eDeviceCallback cbid) {
+	if ((uint)cbid >= S3E_DEVICE_CALLBACK_MAX)
+		return;
+	const std::vector< std::pair<s3eCallback, void*> > callbacks = s_deviceCallbacks[cbid]; // (A callback may unregister itself)
+	for (size_t i = 0; i < callbacks.size(); i++)
+		callbacks[i].first(nullptr, callbacks[i].second);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// File:
+
+void s3ePosix_SetDriveFolder(const char* drive, const char* folder) {
+	string& mapped = s_driveFolders[drive];
+	mapped = folder;
+	if (!mapped.empty() && mapped[mapped.size() - 1] != '/')
+		mapped += '/';
+}
+
+// The native path of an s3e path:
+static string s3ePosix_MapPath(const char* path) {
+	const char* p_sep = strstr(path, "://");
+	if (!p_sep)
+		return path;
+	const string drive(path, p_sep - path);
+	const char* p_rest = p_sep + 3;
+	auto it = s_driveFolders.find(drive);
+	if (it != s_driveFolders.end())
+		return it->second + p_rest;
+	if (drive == "raw")
+		return *p_rest == '/' ? string(p_rest) : "/" + string(p_rest);
+	return drive + "/" + p_rest;
+}
+
+static s3eResult s3ePosix_Result(bool success) {
+	if (success)
+		return S3E_RESULT_SUCCESS;
+	s_fileErrno = errno;
+	return S3E_RESULT_ERROR;
+}
+
+s3eFile* s3eFileOpen(const char* filename, const char* mode) {
+	if (!filename || !mode) {
+		s_fileErrno = EINVAL;
+		return nullptr;
+	}
+	FILE* p_file = fopen(s3ePosix_MapPath(filename).c_str(), mode);
+	if (!p_file) {
+		s_fileErrno = errno;
+		return nullptr;
+	}
+	s3eFile* p_handle = new s3eFile;
+	p_handle->pFile = p_file;
+	return p_handle;
+}
+
+s3eResult s3eFileClose(s3eFile* file) {
+	if (!file)
+		return S3E_RESULT_ERROR;
+	const bool success = fclose(file->pFile) == 0;
+	delete file;
+	return s3ePosix_Result(success);
+}
+
+uint32 s3eFileRead(void* buffer, uint32 elemSize, uint32 noElems, s3eFile* file) {
+	const size_t num_read = fread(buffer, elemSize, noElems, file->pFile);
+	if (num_read < noElems && ferror(file->pFile))
+		s_fileErrno = errno;
+	return (uint32)num_read;
+}
+
+uint32 s3eFileWrite(const void* buffer, uint32 elemSize, uint32 noElems, s3eFile* file) {
+	const size_t num_written = fwrite(buffer, elemSize, noElems, file->pFile);
+	if (num_written < noElems)
+		s_fileErrno = errno;
+	return (uint32)num_written;
+}
+
+s3eResult s3eFileSeek(s3eFile* file, int32 offset, s3eFileSeekOrigin origin) {
+	const int whence = origin == S3E_FILESEEK_SET ? SEEK_SET : origin == S3E_FILESEEK_CUR ? SEEK_CUR : SEEK_END;
+	return s3ePosix_Result(fseek(file->pFile, offset, whence) == 0);
+}
+
+int32 s3eFileTell(s3eFile* file) {
+	return (int32)ftell(file->pFile);
+}
+
+int32 s3eFileGetSize(s3eFile* file) {
+	fflush(file->pFile); // (So that what has been written counts)
+	struct stat info;
+	if (fstat(fileno(file->pFile), &info) != 0) {
+		s_fileErrno = errno;
+		return -1;
+	}
+	return (int32)info.st_size;
+}
+
+s3eResult s3eFileFlush(s3eFile* file) {
+	return s3ePosix_Result(fflush(file->pFile) == 0);
+}
+
+s3eBool s3eFileEOF(s3eFile* file) {
+	return feof(file->pFile) ? S3E_TRUE : S3E_FALSE;
+}
+
+s3eBool s3eFileCheckExists(const char* filename) {
+	struct stat info;
+	return stat(s3ePosix_MapPath(filename).c_str(), &info) == 0 ? S3E_TRUE : S3E_FALSE;
+}
+
+int64 s3eFileGetFileInt(const char* filename, s3eFileProperty property) {
+	struct stat info;
+	if (stat(s3ePosix_MapPath(filename).c_str(), &info) != 0) {
+		s_fileErrno = errno;
+		return property == S3E_FILE_ISDIR || property == S3E_FILE_ISFILE ? 0 : -1;
+	}
+	switch (property) {
+		case S3E_FILE_ISDIR: return S_ISDIR(info.st_mode) ? 1 : 0;
+		case S3E_FILE_ISFILE: return S_ISREG(info.st_mode) ? 1 : 0;
+		case S3E_FILE_SIZE: return (int64)info.st_size;
+		case S3E_FILE_MODIFIED_DATE: return (int64)info.st_mtime * 1000;
+		default: s_fileErrno = EINVAL; return -1;
+	}
+}
+
+s3eResult s3eFileGetFileString(const char* filename, s3eFileProperty property, char* str, int len) {
+	if (property != S3E_FILE_REAL_PATH || len <= 0) {
+		s_fileErrno = EINVAL;
+		return S3E_RESULT_ERROR;
+	}
+	char real_path[PATH_MAX];
+	if (!realpath(s3ePosix_MapPath(filename).c_str(), real_path))
+		return s3ePosix_Result(false);
+	if (strlen(real_path) >= (size_t)len) {
+		s_fileErrno = ENAMETOOLONG;
+		return S3E_RESULT_ERROR;
+	}
+	strcpy(str, real_path);
+	return S3E_RESULT_SUCCESS;
+}
+
+s3eResult s3eFileDelete(const char* filename) {
+	return s3ePosix_Result(unlink(s3ePosix_MapPath(filename).c_str()) == 0);
+}
+
+s3eResult s3eFileRename(const char* src, const char* dest) {
+	return s3ePosix_Result(rename(s3ePosix_MapPath(src).c_str(), s3ePosix_MapPath(dest).c_str()) == 0);
+}
+
+s3eResult s3eFileMakeDirectory(const char* dirName) {
+	return s3ePosix_Result(mkdir(s3ePosix_MapPath(dirName).c_str(), 0755) == 0);
+}
+
+s3eResult s3eFileDeleteDirectory(const char* dirName) {
+	return s3ePosix_Result(rmdir(s3ePosix_MapPath(dirName).c_str()) == 0);
+}
+
+s3eFileList* s3eFileListDirectory(const char* dirName) {
+	DIR* p_dir = opendir(s3ePosix_MapPath(dirName).c_str());
+	if (!p_dir) {
+		s_fileErrno = errno;
+		return nullptr;
+	}
+	s3eFileList* p_list = new s3eFileList;
+	p_list->pDir = p_dir;
+	return p_list;
+}
+
+s3eResult s3eFileListNext(s3eFileList* handle, char* filename, int filenameLen) {
+	while (const dirent* p_entry = readdir(handle->pDir)) {
+		if (p_entry->d_name[0] == '.' && (!p_entry->d_name[1] || (p_entry->d_name[1] == '.' && !p_entry->d_name[2])))
+			continue;
+		if (strlen(p_entry->d_name) >= (size_t)filenameLen)
+			continue; // (As with s3e, a name too long for the buffer can't be listed)
+		strcpy(filename, p_entry->d_name);
+		return S3E_RESULT_SUCCESS;
+	}
+	return S3E_RESULT_ERROR;
+}
+
+s3eResult s3eFileListClose(s3eFileList* handle) {
+	if (!handle)
+		return S3E_RESULT_ERROR;
+	closedir(handle->pDir);
+	delete handle;
+	return S3E_RESULT_SUCCESS;
+}
+
+s3eFileError s3eFileGetError() {
+	switch (s_fileErrno) {
+		case 0: return S3E_FILE_ERR_NONE;
+		case EINVAL: return S3E_FILE_ERR_PARAM;
+		case ENOENT: case ENOTDIR: return S3E_FILE_ERR_NOT_FOUND;
+		case EEXIST: case ENOTEMPTY: return S3E_FILE_ERR_EXISTS;
+		case EACCES: case EPERM: case EROFS: return S3E_FILE_ERR_ACCESS;
+		case EIO: case ENOSPC: return S3E_FILE_ERR_DEVICE;
+		default: return S3E_FILE_ERR_GENERIC;
+	}
+}
+
+const char* s3eFileGetErrorString() {
+	return s_fileErrno ? strerror(s_fileErrno) : "No error";
+}
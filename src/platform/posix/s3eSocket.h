@@ -0,0 +1,33 @@
+// POSIX platform layer: s3eSocket.h
+// A server's network is taken to be a LAN.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include "s3eTypes.h"
+
+typedef enum s3eSocketProperty {
+	S3E_SOCKET_NETWORK_AVAILABLE,
+	S3E_SOCKET_NETWORK_TYPE
+} s3eSocketProperty;
+
+typedef enum s3eNetworkType {
+	S3E_NETWORK_TYPE_NONE,
+	S3E_NETWORK_TYPE_UNKNOWN,
+	S3E_NETWORK_TYPE_LAN,
+	S3E_NETWORK_TYPE_WLAN,
+	S3E_NETWORK_TYPE_GPRS,
+	S3E_NETWORK_TYPE_UMTS,
+	S3E_NETWORK_TYPE_EVDO,
+	S3E_NETWORK_TYPE_CDMA2000,
+	S3E_NETWORK_TYPE_HSDPA,
+	S3E_NETWORK_TYPE_WIMAX,
+	S3E_NETWORK_TYPE_BLUETOOTH,
+	S3E_NETWORK_TYPE_EDGE
+} s3eNetworkType;
+
+inline int32 s3eSocketGetInt(s3eSocketProperty property) {
+	return property == S3E_SOCKET_NETWORK_TYPE ? S3E_NETWORK_TYPE_LAN : 1;
+}
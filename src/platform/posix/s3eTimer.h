@@ -0,0 +1,25 @@
+// POSIX platform layer: s3eTimer.h
+// s3eTimerGetMs() and s3eTimerGetUST() are from the monotonic clock (which is
+// all the library uses them for: intervals), s3eTimerGetUTC() from the
+// wall clock, in milliseconds since 1970.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <time.h>
+
+#include "s3eTypes.h"
+
+inline uint64 s3eTimerGetUST() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+inline uint64 s3eTimerGetMs() { return s3eTimerGetUST(); }
+inline uint64 s3eTimerGetUTC() {
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,35 @@
+// POSIX platform layer: s3eTypes.h
+// The Marmalade types that the library uses, for native builds on Linux and
+// macOS (see s3ePosix.cpp).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned int uint;
+typedef int8_t int8;
+typedef uint8_t uint8;
+typedef int16_t int16;
+typedef uint16_t uint16;
+typedef int32_t int32;
+typedef uint32_t uint32;
+typedef long long int64; // (As on Marmalade, so that "%lld" works everywhere)
+typedef unsigned long long uint64;
+
+typedef enum s3eResult {
+	S3E_RESULT_SUCCESS = 0,
+	S3E_RESULT_ERROR = 1
+} s3eResult;
+
+typedef uint8 s3eBool;
+#define S3E_TRUE 1
+#define S3E_FALSE 0
+
+typedef int32 (*s3eCallback)(void* systemData, void* userData);
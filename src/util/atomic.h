@@ -0,0 +1,58 @@
+// atomic.h:
+// Minimal atomic operations for sharing POD data between the app thread and
+// worker threads. Uses the GCC __atomic builtins where available, and falls
+// back to the older __sync builtins (full barriers) on older toolchains such
+// as the GCC 4.4 used by some Marmalade SDKs.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+namespace atomic {
+
+#if defined(__ATOMIC_ACQUIRE)
+
+template <typename T> inline T LoadAcquire(const volatile T& v) { return __atomic_load_n(&v, __ATOMIC_ACQUIRE); }
+template <typename T> inline T LoadRelaxed(const volatile T& v) { return __atomic_load_n(&v, __ATOMIC_RELAXED); }
+template <typename T> inline void StoreRelease(volatile T& v, T value) { __atomic_store_n(&v, value, __ATOMIC_RELEASE); }
+template <typename T> inline void StoreRelaxed(volatile T& v, T value) { __atomic_store_n(&v, value, __ATOMIC_RELAXED); }
+// Returns true if v was equal to expected and has been set to desired:
+template <typename T> inline bool CompareAndSwap(volatile T& v, T expected, T desired) { return __atomic_compare_exchange_n(&v, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+// Returns the value before the operation:
+template <typename T> inline T FetchAdd(volatile T& v, T delta) { return __atomic_fetch_add(&v, delta, __ATOMIC_ACQ_REL); }
+template <typename T> inline T FetchSub(volatile T& v, T delta) { return __atomic_fetch_sub(&v, delta, __ATOMIC_ACQ_REL); }
+template <typename T> inline T Exchange(volatile T& v, T value) { return __atomic_exchange_n(&v, value, __ATOMIC_ACQ_REL); }
+inline void Fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+#else
+
+template <typename T> inline T LoadAcquire(const volatile T& v) { T value = v; __sync_synchronize(); return value; }
+template <typename T> inline T LoadRelaxed(const volatile T& v) { return v; }
+template <typename T> inline void StoreRelease(volatile T& v, T value) { __sync_synchronize(); v = value; }
+template <typename T> inline void StoreRelaxed(volatile T& v, T value) { v = value; }
+template <typename T> inline bool CompareAndSwap(volatile T& v, T expected, T desired) { return __sync_bool_compare_and_swap(&v, expected, desired); }
+template <typename T> inline T FetchAdd(volatile T& v, T delta) { return __sync_fetch_and_add(&v, delta); }
+template <typename T> inline T FetchSub(volatile T& v, T delta) { return __sync_fetch_and_sub(&v, delta); }
+template <typename T> inline T Exchange(volatile T& v, T value) { T old; do { old = v; } while (!__sync_bool_compare_and_swap(&v, old, value)); return old; }
+inline void Fence() { __sync_synchronize(); }
+
+#endif
+
+// A flag or state (a bool or an enum) that one thread sets for another to see: every read is an acquire
+// and every write a release, so everything the writer did before setting it is visible to a thread
+// that reads the new value. Reads and writes look like those of a plain variable.
+template <typename T>
+class Published {
+public:
+	Published(T value = T()) : m_value((int)value) {}
+	operator T() const { return (T)LoadAcquire(m_value); }
+	Published& operator=(T value) { StoreRelease(m_value, (int)value); return *this; }
+	T LoadRelaxed() const { return (T)atomic::LoadRelaxed(m_value); } // e.g. for the thread that is the only writer
+private:
+	volatile int m_value; // (Stored as an int, which every toolchain can load and store atomically)
+	Published(const Published&);
+	Published& operator=(const Published&);
+};
+
+} // End namespace
@@ -0,0 +1,187 @@
+// fileops:
+// An asynchronous queue of file operations, run on a background thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#include "fileops.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <s3eDevice.h>
+
+#include "iohelpers.h"
+
+using std::string;
+
+FileOp::FileOp(Type type, const string& src, const string& dst, fastdelegate::FastDelegate1< Ptr<FileOp> > callback)
+: m_type(type), m_src(src), m_dst(dst), m_callback(callback), m_pNext(nullptr), m_status(PENDING), m_bytesDone(0), m_bytesTotal(0), m_renamed(false), m_cancelRequested(false) {
+	m_error[0] = '\0';
+}
+
+FileOpQueue::FileOpQueue(size_t bufferSize)
+: m_bufferSize(bufferSize ? bufferSize : 1), m_started(false), m_quit(false), m_pFirst(nullptr), m_pLast(nullptr) {
+	pthread_mutex_init(&m_mutex, nullptr);
+	pthread_cond_init(&m_wakeCond, nullptr);
+}
+
+FileOpQueue::~FileOpQueue() {
+	for (auto it = m_ops.begin(); it != m_ops.end(); it++)
+		(*it)->Cancel();
+	if (m_started) {
+		pthread_mutex_lock(&m_mutex);
+		m_quit = true;
+		pthread_cond_signal(&m_wakeCond);
+		pthread_mutex_unlock(&m_mutex);
+		pthread_join(m_thread, nullptr);
+	}
+	for (auto it = m_ops.begin(); it != m_ops.end(); it++) {
+		if (!(*it)->IsFinished())
+			(*it)->m_status = FileOp::CANCELLED; // (The thread has gone, so nothing else is writing it)
+	}
+	pthread_cond_destroy(&m_wakeCond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+extern "C" {
+static void* FileOpQueue_Thread(void* pQueue) {
+	((FileOpQueue*)pQueue)->Thread_Run();
+	return nullptr;
+}
+}
+
+Ptr<FileOp> FileOpQueue::Queue(FileOp::Type type, const string& src, const string& dst, Callback callback) {
+	Ptr<FileOp> p_op = new FileOp(type, src, dst, callback);
+	m_ops.push_back(p_op); // Holds the reference until Update() is done with it
+	if (!m_started) {
+		// Spawned once there is something for it to do:
+		if (pthread_create(&m_thread, nullptr, FileOpQueue_Thread, this) != 0) {
+			m_ops.pop_back();
+			throw std::runtime_error("Unable to spawn a FileOpQueue thread.");
+		}
+		m_started = true;
+	}
+	pthread_mutex_lock(&m_mutex);
+	if (m_pLast)
+		m_pLast->m_pNext = p_op.ptr();
+	else
+		m_pFirst = p_op.ptr();
+	m_pLast = p_op.ptr();
+	pthread_cond_signal(&m_wakeCond);
+	pthread_mutex_unlock(&m_mutex);
+	return p_op;
+}
+
+void FileOpQueue::Update() {
+	// The thread finishes them in order, so the finished ones are always at the front:
+	while (!m_ops.empty() && m_ops.front()->IsFinished()) {
+		Ptr<FileOp> p_op = m_ops.front();
+		m_ops.pop_front();
+		if (p_op->m_callback)
+			p_op->m_callback(p_op);
+	}
+}
+
+void FileOpQueue::Thread_Run() {
+	unsigned char* p_buffer = nullptr; // Allocated in our own memory environment, once we have a file to copy
+	for (;;) {
+		pthread_mutex_lock(&m_mutex);
+		while (!m_pFirst && !m_quit)
+			pthread_cond_wait(&m_wakeCond, &m_mutex);
+		FileOp* p_op = m_quit ? nullptr : m_pFirst;
+		if (p_op) {
+			m_pFirst = p_op->m_pNext;
+			if (!m_pFirst)
+				m_pLast = nullptr;
+		}
+		pthread_mutex_unlock(&m_mutex);
+		s3eDeviceYield(); // We must call s3eDeviceYield from time to time, or other threads might be blocked waiting for this thread to yield.
+		if (!p_op)
+			break;
+		if (p_op->m_cancelRequested) {
+			p_op->m_status = FileOp::CANCELLED;
+			continue;
+		}
+		if (!p_buffer && p_op->m_type != FileOp::DELETE) {
+			p_buffer = (unsigned char*)malloc(m_bufferSize);
+			if (!p_buffer) {
+				snprintf(p_op->m_error, sizeof(p_op->m_error), "Out of memory; unable to allocate a buffer for copying");
+				p_op->m_status = FileOp::FAILED;
+				continue;
+			}
+		}
+		p_op->m_status = FileOp::RUNNING;
+		Thread_Perform(*p_op, p_buffer, m_bufferSize);
+	}
+	free(p_buffer);
+}
+
+// The drive of an s3e path, e.g. "cache://" for "cache://assets/a.png", or "" if it has none:
+static string FileOpQueue_GetDrive(const string& path) {
+	const size_t pos = path.find("://");
+	return pos == string::npos ? string() : path.substr(0, pos + 3);
+}
+
+void FileOpQueue::Thread_Perform(FileOp& op, unsigned char* pBuffer, size_t bufferSize) {
+	FileOp::Status status = FileOp::DONE;
+	try {
+		if (op.m_type == FileOp::DELETE) {
+			if (IsDir(op.m_src))
+				DeleteFolderAndContents(op.m_src.c_str());
+			else if (IsFile(op.m_src) && s3eFileDelete(op.m_src.c_str()) != S3E_RESULT_SUCCESS)
+				throw std::runtime_error(string("Unable to delete ").append(op.m_src).append(": ").append(s3eFileGetErrorString()));
+		} else {
+			MakePath(DirName(op.m_dst));
+			if (IsFile(op.m_dst))
+				s3eFileDelete(op.m_dst.c_str()); // (Neither a rename nor a copy may leave the old one's data behind)
+			if (op.m_type == FileOp::MOVE && FileOpQueue_GetDrive(op.m_src) == FileOpQueue_GetDrive(op.m_dst)
+				&& s3eFileRename(op.m_src.c_str(), op.m_dst.c_str()) == S3E_RESULT_SUCCESS) {
+				op.m_renamed = true;
+			} else if (!Thread_Copy(op, pBuffer, bufferSize)) {
+				status = FileOp::CANCELLED;
+			} else if (op.m_type == FileOp::MOVE && s3eFileDelete(op.m_src.c_str()) != S3E_RESULT_SUCCESS) {
+				throw std::runtime_error(string("Copied, but unable to delete ").append(op.m_src).append(": ").append(s3eFileGetErrorString()));
+			}
+		}
+	} catch (const std::exception& e) {
+		snprintf(op.m_error, sizeof(op.m_error), "%s", e.what());
+		status = FileOp::FAILED;
+	}
+	op.m_status = status;
+}
+
+// Returns false if the copy was cancelled. Throws if it failed. Either way, a partial copy is deleted.
+bool FileOpQueue::Thread_Copy(FileOp& op, unsigned char* pBuffer, size_t bufferSize) {
+	s3eFile* in_file = s3eFileOpen(op.m_src.c_str(), "rb");
+	if (!in_file)
+		throw std::runtime_error(string("Unable to open source file for copying: ").append(op.m_src).append(". Error: ").append(s3eFileGetErrorString()));
+	s3eFile* out_file = s3eFileOpen(op.m_dst.c_str(), "wb");
+	if (!out_file) {
+		s3eFileClose(in_file);
+		throw std::runtime_error(string("Unable to open destination file for copying: ").append(op.m_dst));
+	}
+	const int32 size = s3eFileGetSize(in_file);
+	op.m_bytesTotal = size > 0 ? size : 0;
+	uint32 bytes_left = op.m_bytesTotal;
+	bool ok = true, cancelled = false;
+	while (bytes_left && ok) {
+		if (op.m_cancelRequested) {
+			cancelled = true;
+			break;
+		}
+		const uint32 chunk = bytes_left > bufferSize ? (uint32)bufferSize : bytes_left;
+		const uint32 num_read = s3eFileRead(pBuffer, 1, chunk, in_file);
+		ok = num_read == chunk && s3eFileWrite(pBuffer, 1, num_read, out_file) == num_read;
+		bytes_left -= num_read;
+		op.m_bytesDone = op.m_bytesTotal - bytes_left;
+		s3eDeviceYield();
+	}
+	s3eFileClose(in_file);
+	ok = s3eFileClose(out_file) == S3E_RESULT_SUCCESS && ok;
+	if (!ok || cancelled)
+		s3eFileDelete(op.m_dst.c_str());
+	if (!ok)
+		throw std::runtime_error(string("Unable to copy ").append(op.m_src).append(" to ").append(op.m_dst));
+	return !cancelled;
+}
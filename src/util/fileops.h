@@ -0,0 +1,119 @@
+// fileops:
+// An asynchronous queue of file operations: copying, moving and deleting
+// files, one after another on a background thread of the queue's own, so
+// that e.g. installing hundreds of MB of downloaded assets from cache://
+// doesn't block the app thread.
+// Each operation reports its progress as it goes, like an HttpRequest does,
+// and can be cancelled. A move between two paths on the same drive is just a
+// rename; otherwise it is a copy followed by deleting the source. The thread
+// copies through a single buffer that it keeps for as long as the queue lives.
+//
+// FileOpQueue::Update() must be called from time to time, on the thread that
+// queued the operations, to call their callbacks.
+// The queue's thread has a memory environment of its own (see
+// HttpClientWorker.h): it only reads an operation's paths, and only writes
+// its POD members (the status, progress and error message).
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include "s3eTypes.h"
+
+#include "FastDelegate.h"
+#include "ptr.h"
+
+class FileOpQueue;
+
+class FileOp : public IRefCounted {
+public:
+	enum Type {
+		COPY,
+		MOVE,
+		DELETE // A file, or a directory and everything in it
+	};
+	enum Status {
+		PENDING,
+		RUNNING,
+		DONE,
+		FAILED,   // See GetError()
+		CANCELLED // With Cancel(), or when its queue was destroyed
+	};
+
+	Type GetType() const { return m_type; }
+	const std::string& GetSrc() const { return m_src; } // For DELETE, the path to delete
+	const std::string& GetDst() const { return m_dst; }
+	Status GetStatus() const { return m_status; }
+	bool IsFinished() const { const Status status = m_status; return status == DONE || status == FAILED || status == CANCELLED; }
+	// Progress: how many bytes have been copied so far, of how many. A rename or a delete goes from 0 of 0 to done.
+	uint32 GetBytesDone() const { return m_bytesDone; }
+	uint32 GetBytesTotal() const { return m_bytesTotal; }
+	double GetFraction() const { const uint32 total = m_bytesTotal; return total ? (double)m_bytesDone / total : 0; }
+	bool WasRenamed() const { return m_renamed; } // A MOVE was done without copying
+	const char* GetError() const { return m_error; } // Why it FAILED, or ""
+
+	// An operation that hasn't started never will. A copy that is under way stops at the next buffer,
+	// and deletes what it had written of the destination (a move leaves its source alone). Its callback is
+	// still called, with its status CANCELLED, unless it had already finished.
+	void Cancel() { m_cancelRequested = true; }
+
+private:
+	FileOp(Type type, const std::string& src, const std::string& dst, fastdelegate::FastDelegate1< Ptr<FileOp> > callback);
+	friend class FileOpQueue;
+	const Type m_type;
+	const std::string m_src, m_dst;
+	fastdelegate::FastDelegate1< Ptr<FileOp> > m_callback; // Only used by the app thread
+	FileOp* m_pNext; // In the queue's list of operations that its thread hasn't taken yet (guarded by its mutex)
+	// Written by the queue's thread:
+	volatile Status m_status;
+	volatile uint32 m_bytesDone, m_bytesTotal;
+	volatile bool m_renamed;
+	char m_error[160];
+	volatile bool m_cancelRequested; // Written by the app thread
+};
+
+class FileOpQueue {
+public:
+	typedef fastdelegate::FastDelegate1< Ptr<FileOp> > Callback;
+
+	// bufferSize is how much the thread reads and writes at a time.
+	FileOpQueue(size_t bufferSize = 128 * 1024);
+	// Cancels the operations that haven't finished, and waits for the one under way to stop.
+	~FileOpQueue();
+
+	// Queue an operation, to run once those queued before it have finished. The destination's
+	// directory is created if need be, and a destination that exists already is replaced.
+	// callback (if any) is called from Update() once it has finished, however it finished.
+	Ptr<FileOp> Copy(const std::string& src, const std::string& dst, Callback callback = Callback()) { return Queue(FileOp::COPY, src, dst, callback); }
+	Ptr<FileOp> Move(const std::string& src, const std::string& dst, Callback callback = Callback()) { return Queue(FileOp::MOVE, src, dst, callback); }
+	Ptr<FileOp> Delete(const std::string& path, Callback callback = Callback()) { return Queue(FileOp::DELETE, path, std::string(), callback); }
+
+	// Call the callbacks of the operations that have finished since the last Update(), in the order they were queued:
+	void Update();
+	size_t Size() const { return m_ops.size(); } // Operations that haven't been through Update() yet
+	bool Empty() const { return m_ops.empty(); }
+
+	/////// Internal methods used by the queue's thread ///////
+	void Thread_Run();
+
+private:
+	const size_t m_bufferSize;
+	std::deque< Ptr<FileOp> > m_ops; // Only used by the app thread: everything queued, in order, until Update() is done with it
+	// Shared with the thread, guarded by m_mutex:
+	pthread_t m_thread;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_wakeCond;
+	bool m_started;
+	bool m_quit;
+	FileOp* m_pFirst; // The operations that the thread hasn't taken yet
+	FileOp* m_pLast;
+	Ptr<FileOp> Queue(FileOp::Type type, const std::string& src, const std::string& dst, Callback callback);
+	static void Thread_Perform(FileOp& op, unsigned char* pBuffer, size_t bufferSize);
+	static bool Thread_Copy(FileOp& op, unsigned char* pBuffer, size_t bufferSize);
+	FileOpQueue(const FileOpQueue&);
+	FileOpQueue& operator=(const FileOpQueue&);
+};
@@ -8,8 +8,24 @@
 
 #include "s3eMemory.h"
 #include <sstream>
+#include <stdexcept>
 #include <queue>
 #include <vector>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0 && !defined(IOHELPERS_NO_MMAP)
+#define IOHELPERS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(_POSIX_VERSION) && !defined(IOHELPERS_NO_DIRENT)
+#include <dirent.h>
+#ifdef DT_DIR
+#define IOHELPERS_DIRENT
+#endif
+#endif
 using std::string;
 using std::runtime_error;
 using std::vector;
@@ -23,25 +39,112 @@ string ReadFileToString(const char* filePath) {
 	s3eFile* file = s3eFileOpen(filePath, "rb");
 	if (file == NULL)
 		throw runtime_error(string("Unable to open file ").append(filePath));
-	int32 file_size = s3eFileGetSize(file);
+	const int32 file_size = s3eFileGetSize(file);
+	// Read straight into the string, which may hold any bytes (NULs included):
+	string result(file_size > 0 ? file_size : 0, '\0');
+	const uint32 num_read = file_size > 0 ? s3eFileRead(&result[0], 1, file_size, file) : 0;
+	s3eFileClose(file);
+	if (file_size < 0 || num_read != (uint32)file_size)
+		throw runtime_error(string("Unable to read file ").append(filePath));
+	return result;
+}
 
-	//Allocate memory for file data
-	char* file_buf = (char*)s3eMalloc(file_size + 1); // Plus 1 for NULL byte
-	if (!file_buf) {
+void FileData::Open(const char* filePath) {
+	Close();
+	s3eFile* file = s3eFileOpen(filePath, "rb");
+	if (file == NULL)
+		throw runtime_error(string("Unable to open file ").append(filePath));
+	const int32 file_size = s3eFileGetSize(file);
+	if (file_size < 0) {
 		s3eFileClose(file);
-		throw runtime_error("Unable to allocate enough memory to load file.");
+		throw runtime_error(string("Unable to read file ").append(filePath));
 	}
-	s3eFileRead(file_buf, 1, file_size, file);
+#ifdef IOHELPERS_MMAP
+	char real_path[512];
+	if (file_size >= MAP_MIN_SIZE && s3eFileGetFileString(filePath, S3E_FILE_REAL_PATH, real_path, sizeof(real_path)) == S3E_RESULT_SUCCESS) {
+		const int fd = open(real_path, O_RDONLY);
+		struct stat info;
+		// (Only if it really is the same file: e.g. on Android, a rom:// file may be inside the package)
+		if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size == file_size) {
+			void* p_data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p_data != MAP_FAILED) {
+				m_pData = (const char*)p_data;
+				m_size = file_size;
+				m_mapped = true;
+			}
+		}
+		if (fd >= 0)
+			close(fd); // (A mapping stays valid without it)
+		if (m_mapped) {
+			s3eFileClose(file);
+			return;
+		}
+	}
+#endif
+	m_buffer.resize(file_size);
+	const uint32 num_read = file_size ? s3eFileRead(&m_buffer[0], 1, file_size, file) : 0;
 	s3eFileClose(file);
-	file_buf[file_size] = '\0';
-	string result(file_buf);
-	s3eFree(file_buf);
-	return result;
+	if (num_read != (uint32)file_size) {
+		Close();
+		throw runtime_error(string("Unable to read file ").append(filePath));
+	}
+	m_pData = file_size ? &m_buffer[0] : nullptr;
+	m_size = file_size;
+}
+
+void FileData::Close() {
+#ifdef IOHELPERS_MMAP
+	if (m_mapped)
+		munmap((void*)m_pData, m_size);
+#endif
+	std::vector<char>().swap(m_buffer);
+	m_pData = nullptr;
+	m_size = 0;
+	m_mapped = false;
+}
+
+// The directories that MakePath() knows exist. Since it is used by the app thread and workers alike, which
+// mustn't modify each other's non-POD data (see HttpClientWorker.h), this is a fixed table of path hashes
+// rather than a set of strings: each path has one slot, so a path that collides with another just costs a
+// stat again.
+static const size_t IOHELPERS_NUM_KNOWN_DIRS = 1024;
+static uint64 s_knownDirs[IOHELPERS_NUM_KNOWN_DIRS]; // 0 for none
+static pthread_mutex_t s_knownDirsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64 IoHelpers_HashPath(const string& path) {
+	uint64 hash = 14695981039346656037ULL; // FNV-1a
+	for (size_t i = 0; i < path.size(); i++)
+		hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+	return hash ? hash : 1;
+}
+
+static bool IoHelpers_IsKnownDir(uint64 hash) {
+	pthread_mutex_lock(&s_knownDirsMutex);
+	const bool known = s_knownDirs[hash % IOHELPERS_NUM_KNOWN_DIRS] == hash;
+	pthread_mutex_unlock(&s_knownDirsMutex);
+	return known;
+}
+
+static void IoHelpers_AddKnownDir(uint64 hash) {
+	pthread_mutex_lock(&s_knownDirsMutex);
+	s_knownDirs[hash % IOHELPERS_NUM_KNOWN_DIRS] = hash;
+	pthread_mutex_unlock(&s_knownDirsMutex);
+}
+
+void ForgetKnownDirs() {
+	pthread_mutex_lock(&s_knownDirsMutex);
+	memset(s_knownDirs, 0, sizeof(s_knownDirs));
+	pthread_mutex_unlock(&s_knownDirsMutex);
 }
 
 // MakePath: Split a path into components and create each directory in the path
 // that doesn't yet exist. Note: path must use '/', not '\' as dir separator
 void MakePath(const string& uri) {
+	// Most of the time, we have made this very path before:
+	const uint64 uri_hash = IoHelpers_HashPath(uri);
+	if (IoHelpers_IsKnownDir(uri_hash))
+		return;
+
 	// First, convert 'cache://mision-data/test/' to 'cache://' and 'mission-data/test'
 	const size_t drive_sep = uri.find("://");
 	const string drive = (drive_sep != string::npos) ? uri.substr( 0, drive_sep+3) : ""; // e.g. "cache://", "ram://", or ""
@@ -62,6 +165,9 @@ void MakePath(const string& uri) {
 			continue; // May happen if path has double-slashes anywhere or ends in trailing slash.
 		sub_path.append(*part_it);
 		sub_path.append("/");
+		const uint64 hash = IoHelpers_HashPath(sub_path);
+		if (IoHelpers_IsKnownDir(hash))
+			continue;
 		if (!IsDir(sub_path)) {
 			// Directory does not exist, so create it:
 			if (s3eFileMakeDirectory(sub_path.c_str()) != S3E_RESULT_SUCCESS) {
@@ -70,29 +176,104 @@ void MakePath(const string& uri) {
 				throw std::runtime_error(err_msg.str());
 			}
 		}
+		IoHelpers_AddKnownDir(hash);
 	}
+	IoHelpers_AddKnownDir(uri_hash);
 }
 
-void DeleteFolderAndContents(const char* folder_path) {
-	s3eFileList* file_list = s3eFileListDirectory(folder_path);
-	char file_name[64];
-	while (file_list && s3eFileListNext(file_list, file_name, 64) == S3E_RESULT_SUCCESS) {
-		string file_path = string(folder_path).append("/").append(file_name);
-		if (IsDir(file_path)) {
-			s3eFileListClose(file_list); //Required. Simulator runs out of handles after 5 recursions?!?
-			DeleteFolderAndContents(file_path);
-			file_list = s3eFileListDirectory(folder_path); //Re-open list handle. Ensures only one handle open at a time.
-		} else {
-			if (s3eFileDelete(file_path.c_str()) != S3E_RESULT_SUCCESS) {
+namespace {
+	struct DirEntry {
+		string name;
+		bool isDir;
+	};
+	// The visitors for DeleteFolderAndContents() (which deletes the files, and keeps the folders to delete once
+	// they are empty) and ListDirContents():
+	struct DirPathCollector {
+		const string& folderPath;
+		vector<string>& paths;
+		DirPathCollector(const string& folderPath, vector<string>& paths) : folderPath(folderPath), paths(paths) {}
+		bool DeleteFile(const string& path, bool isDir) {
+			const string full_path = folderPath + path;
+			if (isDir) {
+				paths.push_back(full_path);
+			} else if (s3eFileDelete(full_path.c_str()) != S3E_RESULT_SUCCESS) {
 				ostringstream oss_err;
-				oss_err << "Error: Can not delete " << file_path << ". Error code = " << s3eFileGetError();
+				oss_err << "Error: Can not delete " << full_path << ". Error code = " << s3eFileGetError();
 				throw runtime_error(oss_err.str());
 			}
+			return true;
+		}
+		bool Add(const string& path, bool isDir) {
+			paths.push_back(isDir ? path + "/" : path);
+			return true;
+		}
+	};
+}
+
+// Fill entries with those of folder (which must end in '/'), in one pass over its listing:
+static void IoHelpers_ListDir(const string& folder, vector<DirEntry>& entries) {
+	entries.clear();
+#ifdef IOHELPERS_DIRENT
+	char real_path[512];
+	const string s3e_path = folder.size() > 1 && folder[folder.size() - 2] != '/' ? folder.substr(0, folder.size() - 1) : folder;
+	if (s3eFileGetFileString(s3e_path.c_str(), S3E_FILE_REAL_PATH, real_path, sizeof(real_path)) == S3E_RESULT_SUCCESS) {
+		if (DIR* p_dir = opendir(real_path)) {
+			while (const dirent* p_entry = readdir(p_dir)) {
+				if (p_entry->d_name[0] == '.' && (!p_entry->d_name[1] || (p_entry->d_name[1] == '.' && !p_entry->d_name[2])))
+					continue;
+				DirEntry entry;
+				entry.name = p_entry->d_name;
+				// (Some filesystems don't say, and a link might be to a folder)
+				entry.isDir = p_entry->d_type == DT_DIR || ((p_entry->d_type == DT_UNKNOWN || p_entry->d_type == DT_LNK) && IsDir(folder + entry.name));
+				entries.push_back(entry);
+			}
+			closedir(p_dir);
+			return;
 		}
 	}
-	if (file_list)
-		s3eFileListClose(file_list);
+#endif
+	s3eFileList* file_list = s3eFileListDirectory(folder.c_str());
+	if (!file_list)
+		return;
+	char file_name[512]; // (Names can be far longer than S3E_FILE_MAX_PATH)
+	while (s3eFileListNext(file_list, file_name, ArrayLength(file_name)) == S3E_RESULT_SUCCESS) {
+		DirEntry entry;
+		entry.name = file_name;
+		entries.push_back(entry);
+	}
+	s3eFileListClose(file_list); // Before the stats, which may need a handle of their own
+	for (auto it = entries.begin(); it != entries.end(); it++)
+		it->isDir = IsDir(folder + it->name);
+}
+
+void VisitDirContents(const string& folderPath, DirVisitor visitor, bool recursive) {
+	const string root = folderPath.empty() || folderPath[folderPath.size() - 1] == '/' ? folderPath : folderPath + "/";
+	std::queue<string> folders; // FIFO Queue of folders that we have yet to list, relative to root. Each entry must end with a '/'
+	folders.push("");
+	vector<DirEntry> entries; // (Reused for every folder)
+	while (!folders.empty()) {
+		const string folder = folders.front();
+		folders.pop();
+		IoHelpers_ListDir(root + folder, entries);
+		for (auto it = entries.begin(); it != entries.end(); it++) {
+			const string path = folder + it->name;
+			if (!visitor(path, it->isDir))
+				return;
+			if (it->isDir && recursive)
+				folders.push(path + "/");
+		}
+	}
+}
+
+void DeleteFolderAndContents(const char* folder_path) {
+	const string root = string(folder_path).append(*folder_path && folder_path[strlen(folder_path) - 1] == '/' ? "" : "/");
+	vector<string> folders; // Breadth-first, so every folder comes before its subfolders
+	DirPathCollector collector(root, folders);
+	VisitDirContents(root, fastdelegate::MakeDelegate(&collector, &DirPathCollector::DeleteFile));
+	for (auto it = folders.rbegin(); it != folders.rend(); it++)
+		s3eFileDeleteDirectory(it->c_str());
 	s3eFileDeleteDirectory(folder_path);
+	ForgetKnownDirs(); // (Simpler than working out which of them were in this folder, and it is rarely needed)
 }
 
 vector<string> ListDirContents(string folderPath, bool recursive) {
@@ -100,33 +281,16 @@ vector<string> ListDirContents(string folderPath, bool recursive) {
 	if (!recursive) {
 		// Simply list the files/folders in folderPath:
 		s3eFileList* file_list = s3eFileListDirectory(folderPath.c_str());
-		char file_name[64];
+		char file_name[512]; // (Names can be far longer than S3E_FILE_MAX_PATH)
 		while (file_list && s3eFileListNext(file_list, file_name, ArrayLength(file_name)) == S3E_RESULT_SUCCESS) {
 			contents.push_back(file_name);
 		}
-		s3eFileListClose(file_list);
+		if (file_list)
+			s3eFileListClose(file_list);
 	} else {
 		// Create a flattened list of the files in folderPath and all subfolders:
-		if (folderPath.at(folderPath.size()-1) != '/')
-			folderPath += "/";
-		std::queue<string> folders; // FIFO Queue of folders that we have yet to list. Each entry must end with a '/'
-		folders.push("");
-		while (!folders.empty()) {
-			// List all the items in 'folder'
-			string folder = folders.front();
-			s3eFileList* file_list = s3eFileListDirectory((folderPath+folder).c_str());
-			char file_name[64];
-			while (file_list && s3eFileListNext(file_list, file_name, ArrayLength(file_name)) == S3E_RESULT_SUCCESS) {
-				string full_subpath = folder+file_name;
-				if (IsDir(folderPath+full_subpath)) {
-					full_subpath += "/";
-					folders.push(full_subpath);
-				}
-				contents.push_back(full_subpath);
-			}
-			s3eFileListClose(file_list);
-			folders.pop();
-		}
+		DirPathCollector collector(folderPath, contents);
+		VisitDirContents(folderPath, fastdelegate::MakeDelegate(&collector, &DirPathCollector::Add));
 	}
 	return contents;
 }
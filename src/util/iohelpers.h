@@ -8,10 +8,38 @@
 #include <string>
 #include <vector>
 #include "s3eFile.h"
+#include "FastDelegate.h"
 
+// Read a whole file (text or binary) into a string. Throws a runtime_error if it can't be opened or read.
 std::string ReadFileToString(const char* filePath);
 inline std::string ReadFileToString(const std::string& filePath) { return ReadFileToString(filePath.c_str()); }
 
+// FileData:
+// The whole contents of a file, e.g. for parsing, without copying them into a string first. Files of at least
+// MAP_MIN_SIZE bytes are memory-mapped where the platform allows it (if the s3e path is a real file; build with
+// IOHELPERS_NO_MMAP to never map them); anything else is read with a single s3eFileRead() into a buffer of
+// its own. The data is not NUL-terminated. Throws a runtime_error if the file can't be opened or read.
+// Like any non-POD data, a FileData belongs to the memory environment of the thread that opened it.
+class FileData {
+public:
+	enum { MAP_MIN_SIZE = 64 * 1024 };
+	FileData() : m_pData(nullptr), m_size(0), m_mapped(false) {}
+	explicit FileData(const char* filePath) : m_pData(nullptr), m_size(0), m_mapped(false) { Open(filePath); }
+	~FileData() { Close(); }
+	void Open(const char* filePath);
+	void Close();
+	const char* Data() const { return m_pData; }
+	size_t Size() const { return m_size; }
+	bool IsMapped() const { return m_mapped; }
+private:
+	const char* m_pData;
+	size_t m_size;
+	bool m_mapped;
+	std::vector<char> m_buffer; // If it isn't mapped
+	FileData(const FileData&);
+	FileData& operator=(const FileData&);
+};
+
 // Get the directory name from a file path
 // e.g. "factory/components/widget.comp" becomes "factory/components"
 // Note: path must use '/', not '\' as dir separator
@@ -57,15 +85,34 @@ inline bool IsFile(const std::string& path) { return IsFile(path.c_str()); }
 
 // MakePath: Split a path into components and create each directory in the path
 // that doesn't yet exist. Note: path must use '/', not '\' as dir separator
+// The directories that it finds or makes are remembered, by every thread, so that making the same path
+// again (e.g. for each of thousands of downloads into the same few folders) costs no stats at all.
 void MakePath(const std::string& uri);
+// Forget every directory that MakePath() has remembered. DeleteFolderAndContents() does this itself; call it
+// if directories are deleted any other way.
+void ForgetKnownDirs();
 
+// Delete a folder, and all the files and folders in it:
 void DeleteFolderAndContents(const char* folder_path);
-inline void DeleteFolderAndContents(std::string& folder_path) { DeleteFolderAndContents(folder_path.c_str()); }
+inline void DeleteFolderAndContents(const std::string& folder_path) { DeleteFolderAndContents(folder_path.c_str()); }
 
+// List the files and folders in folderPath (by name), or with recursive, those in all its subfolders too
+// (by path relative to folderPath, with each folder's ending in '/'), breadth-first:
 std::vector<std::string> ListDirContents(std::string folderPath, bool recursive = false);
 
+// VisitDirContents:
+// Call visitor(path, isDir) for each file and folder in folderPath, and with recursive, in all its subfolders,
+// breadth-first, as ListDirContents() would list them (but a folder's path doesn't end in '/'). Each folder is
+// listed in a single pass, with its listing closed again before any of its entries are visited, so the visitor
+// may delete what it is given, and only one listing is ever open. Where the platform allows (if the s3e path is
+// a real folder; build with IOHELPERS_NO_DIRENT not to look), the listing says which entries are folders, so
+// there is no need to stat each one. Return false from visitor to stop.
+typedef fastdelegate::FastDelegate2<const std::string&, bool, bool> DirVisitor;
+void VisitDirContents(const std::string& folderPath, DirVisitor visitor, bool recursive = true);
+
 // Copy a file from src path to destination path:
 // The "Fast" means fast when compared to the insanely slow "CopyFile" undocumented global method from IwResManager available in debug builds
+// (To copy without blocking the calling thread, with progress and cancellation, see FileOpQueue in fileops.h)
 void CopyFileFast(const char* src, const char* dst);
 
 inline void CopyFileFast(const std::string& src, const std::string& dst) {
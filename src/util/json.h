@@ -32,6 +32,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <utility>
 #include <algorithm>
 #include <map>
 #include <deque>
@@ -43,6 +48,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <set>
 #include <sstream>
 #include <iomanip>
+#include <limits>
+
+// vectorized scanning (see Detail::FindStringSpecial() etc.), where the target supports it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JSON_USE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define JSON_USE_NEON
+#include <arm_neon.h>
+#endif
+
+// storage that each thread has its own copy of (see Arena::Current())
+#ifndef JSON_THREAD_LOCAL
+#ifdef _MSC_VER
+#define JSON_THREAD_LOCAL __declspec(thread)
+#else
+#define JSON_THREAD_LOCAL __thread
+#endif
+#endif
 
 
 /*  
@@ -81,6 +108,16 @@ typedef TrivialType_T<std::string> String;
 class Object;
 class Array;
 class Null;
+class Name;
+
+namespace Detail
+{
+struct NameEntry;
+}
+
+// reads and writes plain C++ values (see jsonbind.h)
+template <typename ValueT, typename EnableT = void>
+struct Bind;
 
 
 
@@ -96,6 +133,226 @@ public:
 
 
 
+/////////////////////////////////////////////////////////////////////////
+// Arena - a block allocator for the elements of a document. While an 
+//  Arena::Scope is alive, every string, array and object element that gets
+//  created (e.g. by Reader; the others are held inside their UnknownElement),
+//  and the storage of every Array and Object that grows, comes from the 
+//  arena, in large blocks, rather than from one small heap allocation each. 
+//  Freeing an element that lives in an arena doesn't return anything to the
+//  heap; the arena's blocks are all freed together when it is destroyed or
+//  Reset(). Strings still come from the heap.
+// The arena also interns the names of the object members created in it (see 
+//  Name): each distinct name is stored once, however many objects use it.
+// The current arena is per thread: a Scope only affects the json that its
+//  own thread creates, so several threads can each parse into their own
+//  arena at once (or use the heap). Everything that was allocated from an
+//  arena must have been destroyed before the arena is Reset() or destroyed,
+//  and a document that was built inside a Scope should only be modified 
+//  inside one too (see Document, which takes care of this).
+// Note that moving an element (rather than copying it) out of a document 
+//  leaves it in the document's arena.
+
+class Arena
+{
+public:
+   explicit Arena(size_t nBlockSize = 64 * 1024);
+   ~Arena();
+
+   void* Allocate(size_t nSize);
+   // free all blocks but the first, which is kept for reuse
+   void Reset();
+
+   size_t BytesAllocated() const { return m_nBytesAllocated; }
+   size_t NamesInterned() const { return m_nNames; }
+
+   // the arena's copy of a member name, made if it doesn't have one yet
+   const Detail::NameEntry* Intern(const char* pName, size_t nSize, size_t nHash);
+
+   class Scope
+   {
+   public:
+      Scope(Arena& arena) : m_pPrevious(Current()) { Current() = &arena; }
+      ~Scope() { Current() = m_pPrevious; }
+   private:
+      Arena* m_pPrevious;
+      Scope(const Scope&);
+      Scope& operator = (const Scope&);
+   };
+
+   // the arena that this thread's elements are currently being allocated from, or NULL for the heap
+   static Arena*& Current() { static JSON_THREAD_LOCAL Arena* s_pCurrent = NULL; return s_pCurrent; }
+
+private:
+   struct Block
+   {
+      Block* pNext;
+      size_t nSize;
+   };
+   Block* m_pBlocks;      // most recent first
+   char* m_pFree;         // free space in m_pBlocks...
+   size_t m_nFree;        // ...and how much of it there is
+   size_t m_nBlockSize;
+   size_t m_nBytesAllocated;
+
+   // the interned names, by hash (open addressing with linear probing, as in Object): 
+   //  empty, or a power of two in size and at most half full. The entries themselves
+   //  live in the blocks.
+   std::vector<Detail::NameEntry*> m_Names;
+   size_t m_nNames;
+
+   void FreeNames();
+
+   Arena(const Arena&);
+   Arena& operator = (const Arena&);
+};
+
+
+namespace Detail
+{
+
+// allocations are prefixed with the arena they came from (if any), so that
+//  they can be freed correctly whatever arena is current at the time
+union AllocHeader
+{
+   Arena* pArena;
+   double dAlign;
+   long long llAlign;
+};
+
+inline void* Allocate(size_t nSize)
+{
+   Arena* pArena = Arena::Current();
+   AllocHeader* pHeader = static_cast<AllocHeader*>(pArena ? pArena->Allocate(sizeof(AllocHeader) + nSize) : ::operator new(sizeof(AllocHeader) + nSize));
+   pHeader->pArena = pArena;
+   return pHeader + 1;
+}
+
+// the arena that p was allocated from, or NULL for the heap
+inline Arena* ArenaOf(const void* p)
+{
+   return (static_cast<const AllocHeader*>(p) - 1)->pArena;
+}
+
+inline void Deallocate(void* p)
+{
+   if (p == NULL)
+      return;
+   AllocHeader* pHeader = static_cast<AllocHeader*>(p) - 1;
+   if (pHeader->pArena == NULL)
+      ::operator delete(pHeader);
+   // else: it is freed along with the rest of the arena
+}
+
+// a member name's string and hash, shared by every Name that was interned in
+//  the same arena, or else owned by a single Name
+struct NameEntry
+{
+   NameEntry(const std::string& sNameIn, size_t nHashIn, Arena* pArenaIn) : sName(sNameIn), nHash(nHashIn), pArena(pArenaIn) {}
+   NameEntry(std::string&& sNameIn, size_t nHashIn) : sName(std::move(sNameIn)), nHash(nHashIn), pArena(NULL) {}
+   NameEntry(const char* pName, size_t nSize, size_t nHashIn, Arena* pArenaIn) : sName(pName, nSize), nHash(nHashIn), pArena(pArenaIn) {}
+
+   std::string sName;
+   size_t nHash;
+   Arena* pArena; // the arena that interned it, or NULL if it is on the heap
+};
+
+// what precedes a string, array or object that an UnknownElement holds, which
+//  copies of the element share (see UnknownElement)
+struct SharedHeader
+{
+   unsigned int nRefs;
+   bool bUnshareable; // someone may hold a reference into it, so copies get their own
+};
+
+// a std::allocator replacement for the containers inside Array and Object
+template <typename T>
+class Allocator
+{
+public:
+   typedef T value_type;
+   typedef T* pointer;
+   typedef const T* const_pointer;
+   typedef T& reference;
+   typedef const T& const_reference;
+   typedef size_t size_type;
+   typedef ptrdiff_t difference_type;
+   template <typename U> struct rebind { typedef Allocator<U> other; };
+
+   Allocator() {}
+   template <typename U> Allocator(const Allocator<U>&) {}
+
+   pointer address(reference r) const { return &r; }
+   const_pointer address(const_reference r) const { return &r; }
+   pointer allocate(size_type n, const void* = 0) { return static_cast<pointer>(Allocate(n * sizeof(T))); }
+   void deallocate(pointer p, size_type) { Deallocate(p); }
+   size_type max_size() const { return size_t(-1) / sizeof(T); }
+   void construct(pointer p, const T& t) { new (static_cast<void*>(p)) T(t); }
+   template <typename... Args>
+   void construct(pointer p, Args&&... args) { new (static_cast<void*>(p)) T(std::forward<Args>(args)...); }
+   void destroy(pointer p) { p->~T(); }
+
+   template <typename U> bool operator == (const Allocator<U>&) const { return true; }
+   template <typename U> bool operator != (const Allocator<U>&) const { return false; }
+};
+
+} // namespace Detail
+
+
+/////////////////////////////////////////////////////////////////////////
+// Name - the name of an object member. While an Arena::Scope is alive, names
+//  are interned in the arena, so the members of a document that have the 
+//  same name (e.g. the same few keys in each of thousands of objects) share 
+//  one copy of it, and two such names are equal exactly when they point to 
+//  the same copy. Otherwise a Name owns its own copy. Either way its hash is
+//  worked out once, when it is created, for Object's index.
+// It reads like a const std::string, e.g. it->name == "id" or 
+//  it->name.Str() for what needs a real one.
+
+class Name
+{
+public:
+   Name() : m_pEntry(NULL) {}
+   Name(const std::string& sName);
+   Name(std::string&& sName);
+   Name(const Name& name);
+   Name(Name&& name) : m_pEntry(name.m_pEntry) { name.m_pEntry = NULL; }
+   ~Name();
+
+   Name& operator = (const Name& name);
+   Name& operator = (Name&& name) { swap(name); return *this; }
+   void swap(Name& name) { std::swap(m_pEntry, name.m_pEntry); }
+
+   const std::string& Str() const;
+   operator const std::string& () const { return Str(); }
+   const char* c_str() const { return Str().c_str(); }
+   size_t size() const { return Str().size(); }
+   bool empty() const { return m_pEntry == NULL; }
+   size_t Hash() const;
+
+   bool operator == (const Name& name) const;
+   bool operator != (const Name& name) const { return !(*this == name); }
+   bool operator == (const std::string& sName) const { return Str() == sName; }
+   bool operator != (const std::string& sName) const { return Str() != sName; }
+   bool operator == (const char* pName) const { return Str() == pName; }
+   bool operator != (const char* pName) const { return Str() != pName; }
+
+   // FNV-1a
+   static size_t Hash(const char* pName, size_t nSize);
+
+private:
+   void Assign(const std::string& sName);
+   void Release();
+
+   const Detail::NameEntry* m_pEntry; // NULL for ""
+};
+
+inline bool operator == (const std::string& sName, const Name& name) { return name == sName; }
+inline bool operator != (const std::string& sName, const Name& name) { return name != sName; }
+inline bool operator == (const char* pName, const Name& name) { return name == pName; }
+inline bool operator != (const char* pName, const Name& name) { return name != pName; }
+
+
 /////////////////////////////////////////////////////////////////////////
 // UnknownElement - provides a typesafe surrogate for any of the JSON-
 //  sanctioned element types. This class allows the Array and Object
@@ -109,6 +366,19 @@ public:
 //  element accesses can be chained together, allowing the following
 //  (when document structure is well-known):
 //  String str = objInvoices[1]["Customer"]["Company"];
+// Copying an element that holds a string, array or object doesn't copy what
+//  it holds: the copies share it, and one of them only makes its own copy (of
+//  that one level, whose children are shared in turn) once it is about to be
+//  changed. So copying a whole tree, or passing subtrees of it around, takes
+//  O(1) until something is modified. Once a non-const reference into an 
+//  element has been handed out (e.g. Object& obj = element, or element["x"]),
+//  it stops sharing with later copies, since whoever holds the reference could
+//  write through it at any time; the trees built by Reader and DomBuilder are
+//  free of that. (Note that a cast of a non-const element, even to a const 
+//  reference, picks the non-const cast operator.) A const reference (e.g. const Object& obj = element) into an
+//  element that is then copied and modified can end up seeing the copy. Like
+//  the rest of json, the copies of a tree must all be used from one thread, 
+//  as the counts of who shares what are not atomic.
 
 
 class UnknownElement
@@ -123,9 +393,17 @@ public:
    UnknownElement(const String& string);
    UnknownElement(const Null& null);
 
+   // moving takes over the element without copying it. the source is left 
+   //  holding a Null (or, after assignment, whatever this held)
+   UnknownElement(UnknownElement&& unknown) noexcept; // (so that Array's vector moves, rather than copies, when it grows)
+   UnknownElement(Object&& object);
+   UnknownElement(Array&& array);
+   UnknownElement(String&& string);
+
    ~UnknownElement();
 
    UnknownElement& operator = (const UnknownElement& unknown);
+   UnknownElement& operator = (UnknownElement&& unknown);
 
    // implicit cast to actual element type. throws on failure
    operator const Object& () const;
@@ -163,19 +441,25 @@ public:
    bool IsOfType() const;
 
 private:
-   class Imp;
+   // null, booleans and numbers are held inline, so that e.g. an array of numbers
+   //  doesn't take a heap allocation per element. strings, arrays and objects are
+   //  held out of line, allocated like the rest of the document (see Arena)
+   enum Type { TYPE_NULL, TYPE_BOOLEAN, TYPE_NUMBER, TYPE_STRING, TYPE_ARRAY, TYPE_OBJECT };
 
    template <typename ElementTypeT>
-   class Imp_T;
+   struct Traits; // TYPE, and whether it is held INLINE
 
-   class CastVisitor;
-   class ConstCastVisitor;
-   
    template <typename ElementTypeT>
-   class CastVisitor_T;
+   ElementTypeT* Ptr_i() const;
 
+   // for an element that holds TYPE_NULL (and so nothing that needs freeing)
+   template <typename ElementTypeT, typename ArgT>
+   void Construct(ArgT&& arg);
+   void TakeOver(UnknownElement& unknown);
+
+   void Destroy(); // leaves us holding TYPE_NULL
    template <typename ElementTypeT>
-   class ConstCastVisitor_T;
+   void Free();
 
    template <typename ElementTypeT>
    const ElementTypeT& CastTo() const;
@@ -183,19 +467,41 @@ private:
    template <typename ElementTypeT>
    ElementTypeT& ConvertTo();
 
-   Imp* m_pImp;
+   // sharing (for strings, arrays and objects)
+   Detail::SharedHeader* Shared_i() const { return static_cast<Detail::SharedHeader*>(m_pOutOfLine) - 1; }
+   template <typename ElementTypeT>
+   void Share_i(const UnknownElement& unknown);
+   template <typename ElementTypeT>
+   void Unshare_i();
+   // like ConvertTo(), for those that don't keep the reference (Reader and DomBuilder, while 
+   //  they build the tree), so sharing it stays possible
+   template <typename ElementTypeT>
+   ElementTypeT& Modify_i();
+   friend class Reader;
+   friend class DomBuilder;
+
+   Type m_eType;
+   union
+   {
+      char m_acInline[3 * sizeof(double)]; // as big as a Number (see below)
+      double m_dAlign;
+      long long m_llAlign;
+      void* m_pOutOfLine;
+   };
 };
 
 
 /////////////////////////////////////////////////////////////////////////////////
-// Array - mimics std::deque<UnknownElement>. The array contents are effectively 
+// Array - mimics std::vector<UnknownElement>. The array contents are effectively 
 //  heterogeneous thanks to the ElementUnknown class. push_back has been replaced 
 //  by more generic insert functions.
+// The elements are contiguous, so inserting may move them: iterators and 
+//  references into an array are only good until it next grows (see Reserve()).
 
 class Array
 {
 public:
-   typedef std::deque<UnknownElement> Elements;
+   typedef std::vector<UnknownElement, Detail::Allocator<UnknownElement> > Elements;
    typedef Elements::iterator iterator;
    typedef Elements::const_iterator const_iterator;
 
@@ -204,10 +510,22 @@ public:
    const_iterator Begin() const;
    const_iterator End() const;
    
+   Array() {}
+   Array(const Array& array) : m_Elements(array.m_Elements) {}
+   Array(Array&& array) { m_Elements.swap(array.m_Elements); }
+   Array& operator = (const Array& array) { m_Elements = array.m_Elements; return *this; }
+   Array& operator = (Array&& array) { m_Elements.swap(array.m_Elements); return *this; }
+
    iterator Insert(const UnknownElement& element, iterator itWhere);
    iterator Insert(const UnknownElement& element);
+   iterator Insert(UnknownElement&& element, iterator itWhere);
+   iterator Insert(UnknownElement&& element);
    iterator Erase(iterator itWhere);
    void Resize(size_t newSize);
+   // makes room for newCapacity elements in one go, e.g. before inserting a known number of
+   //  them (Reader does this for every array it reads). in an Arena, this also saves the 
+   //  storage that growing one element at a time would leave behind
+   void Reserve(size_t newCapacity);
    void Clear();
 
    size_t Size() const;
@@ -216,6 +534,12 @@ public:
    UnknownElement& operator[] (size_t index);
    const UnknownElement& operator[] (size_t index) const;
 
+   // copies out an array of numbers (e.g. vertex data) in one go, converted to NumberT 
+   //  (double, float, int...; integer types get Number::AsInteger()). returns false, leaving
+   //  values empty, if any element isn't a Number
+   template <typename NumberT>
+   bool GetNumbers(std::vector<NumberT>& values) const;
+
    bool operator == (const Array& array) const;
 
 private:
@@ -232,17 +556,29 @@ class Object
 public:
    struct Member {
       Member(const std::string& nameIn = std::string(), const UnknownElement& elementIn = UnknownElement());
+      Member(std::string&& nameIn, UnknownElement&& elementIn);
+      Member(const Name& nameIn, const UnknownElement& elementIn = UnknownElement()) : name(nameIn), element(elementIn) {}
+      Member(const Member& member) : name(member.name), element(member.element) {}
+      Member(Member&& member) : name(std::move(member.name)), element(std::move(member.element)) {}
+      Member& operator = (const Member& member) { name = member.name; element = member.element; return *this; }
+      Member& operator = (Member&& member) { name.swap(member.name); element = std::move(member.element); return *this; }
 
       bool operator == (const Member& member) const;
 
-      std::string name;
+      Name name;
       UnknownElement element;
    };
 
-   typedef std::list<Member> Members; // map faster, but does not preserve order
+   typedef std::list<Member, Detail::Allocator<Member> > Members; // map faster, but does not preserve order (see m_Index below)
    typedef Members::iterator iterator;
    typedef Members::const_iterator const_iterator;
 
+   Object();
+   Object(const Object& object);
+   Object(Object&& object);
+   Object& operator = (const Object& object);
+   Object& operator = (Object&& object);
+
    bool operator == (const Object& object) const;
 
    iterator Begin();
@@ -255,10 +591,16 @@ public:
 
    iterator Find(const std::string& name);
    const_iterator Find(const std::string& name) const;
+   // the same, with Name::Hash(name) worked out beforehand, e.g. once for many lookups (see Path)
+   const_iterator Find(const std::string& name, size_t nHash) const;
    bool HasKey(const std::string& name) const { const_iterator it=Find(name); return (it != End() ); }
 
    iterator Insert(const Member& member);
    iterator Insert(const Member& member, iterator itWhere);
+   iterator Insert(Member&& member);
+   iterator Insert(Member&& member, iterator itWhere);
+   // constructs the member in place: obj.Insert("name", std::move(element))
+   iterator Insert(std::string&& name, UnknownElement&& element);
    iterator Erase(iterator itWhere);
    void Clear();
 
@@ -270,12 +612,33 @@ public:
 	const double GetOrDefault(const std::string& name, double defaultVal) const { return ImpGetOrDefault(name, defaultVal); }
 	const std::string GetOrDefault(const std::string& name, const std::string& defaultVal) const { return ImpGetOrDefault(name, defaultVal); }
 	const bool GetOrDefault(const std::string& name, bool defaultVal) const { return ImpGetOrDefault(name, defaultVal); }
+	const long long GetOrDefault(const std::string& name, long long defaultVal) const; // exact, even for big IDs
 private:
    template <typename ValueTypeT>
    const ValueTypeT ImpGetOrDefault(const std::string& name, ValueTypeT defaultVal) const;
-   class Finder;
 
    Members m_Members;
+
+   // Objects with more than INDEX_THRESHOLD members also keep a hash index of their members
+   // (open addressing with linear probing), so that looking a member up by name takes O(1)
+   // instead of a linear scan, while m_Members keeps them in insertion order.
+   // Note: for the same reason, members must not be renamed through an iterator.
+   enum { INDEX_THRESHOLD = 8 };
+   struct IndexSlot {
+      size_t hash;
+      Member* pMember; // NULL if the slot is empty
+      iterator it;
+   };
+   std::vector<IndexSlot, Detail::Allocator<IndexSlot> > m_Index; // Empty, or a power of two in size and at most half full
+
+   size_t FindSlot(const std::string& name) const { return FindSlot(name, Name::Hash(name.data(), name.size())); }
+   size_t FindSlot(const std::string& name, size_t hash) const; // Index of name's slot in m_Index, or m_Index.size() if not found
+   size_t FindSlot(const Name& name) const;
+   iterator FindName(const Name& name); // Find(), by pointer where the names were interned together
+   void IndexPlace(iterator it, size_t hash);
+   void IndexInsert(iterator it);
+   void IndexErase(iterator it);
+   void RebuildIndex();
 };
 
 
@@ -290,6 +653,7 @@ class TrivialType_T
 {
 public:
    TrivialType_T(const DataTypeT& t = DataTypeT());
+   TrivialType_T(DataTypeT&& t);
 
    operator DataTypeT&();
    operator const DataTypeT&() const;
@@ -304,6 +668,40 @@ private:
 };
 
 
+// Number: like any other TrivialType_T, but it also keeps the exact value of 
+//  integers, which a double can only hold up to 2^53 (e.g. 64-bit IDs).
+template <>
+class TrivialType_T<double>
+{
+public:
+   TrivialType_T(const double& t = 0.0) : m_tValue(t), m_nInteger(0), m_bInteger(false) {}
+   static TrivialType_T<double> FromInteger(long long n) { TrivialType_T<double> number((double)n); number.m_nInteger = n; number.m_bInteger = true; return number; }
+
+   operator double&() { return m_tValue; }
+   operator const double&() const { return m_tValue; }
+
+   double& Value() { return m_tValue; }
+   const double& Value() const { return m_tValue; }
+
+   // true if the number was made by FromInteger() (e.g. Reader reads all integers that fit
+   //  in a long long that way), and hasn't been changed since. AsInteger() is exact for these.
+   bool IsInteger() const { return m_bInteger && (double)m_nInteger == m_tValue; }
+   long long AsInteger() const { return IsInteger() ? m_nInteger : (long long)m_tValue; }
+
+   bool operator == (const TrivialType_T<double>& trivial) const
+   {
+      if (IsInteger() && trivial.IsInteger())
+         return m_nInteger == trivial.m_nInteger;
+      return m_tValue == trivial.m_tValue;
+   }
+
+private:
+   double m_tValue;
+   long long m_nInteger;
+   bool m_bInteger;
+};
+
+
 
 /////////////////////////////////////////////////////////////////////////////////
 // Null - doesn't do much of anything but satisfy the JSON spec. It is the default
@@ -344,116 +742,427 @@ public:
 inline Exception::Exception(const std::string& sMessage) :
    std::runtime_error(sMessage) {}
 
+
+/////////////////
+// Arena members
+
+inline Arena::Arena(size_t nBlockSize) :
+   m_pBlocks(NULL),
+   m_pFree(NULL),
+   m_nFree(0),
+   m_nBlockSize(nBlockSize),
+   m_nBytesAllocated(0),
+   m_nNames(0)
+{}
+
+inline Arena::~Arena()
+{
+   FreeNames();
+   while (m_pBlocks)
+   {
+      Block* pBlock = m_pBlocks;
+      m_pBlocks = pBlock->pNext;
+      ::operator delete(pBlock);
+   }
+}
+
+inline void* Arena::Allocate(size_t nSize)
+{
+   const size_t nAlign = sizeof(Detail::AllocHeader);
+   nSize = (nSize + nAlign - 1) & ~(nAlign - 1);
+   if (nSize > m_nFree)
+   {
+      // start a new block (a big enough one for large allocations, e.g. the storage
+      //  of a big array)
+      const size_t nHeader = (sizeof(Block) + nAlign - 1) & ~(nAlign - 1);
+      const size_t nBlockSize = nSize > m_nBlockSize - nHeader ? nSize + nHeader : m_nBlockSize;
+      Block* pBlock = static_cast<Block*>(::operator new(nBlockSize));
+      pBlock->pNext = m_pBlocks;
+      pBlock->nSize = nBlockSize;
+      m_pBlocks = pBlock;
+      m_pFree = reinterpret_cast<char*>(pBlock) + nHeader;
+      m_nFree = nBlockSize - nHeader;
+   }
+   void* p = m_pFree;
+   m_pFree += nSize;
+   m_nFree -= nSize;
+   m_nBytesAllocated += nSize;
+   return p;
+}
+
+inline void Arena::Reset()
+{
+   FreeNames();
+   if (m_pBlocks == NULL)
+      return;
+   while (m_pBlocks->pNext)
+   {
+      Block* pBlock = m_pBlocks;
+      m_pBlocks = pBlock->pNext;
+      ::operator delete(pBlock);
+   }
+   const size_t nAlign = sizeof(Detail::AllocHeader);
+   const size_t nHeader = (sizeof(Block) + nAlign - 1) & ~(nAlign - 1);
+   m_pFree = reinterpret_cast<char*>(m_pBlocks) + nHeader;
+   m_nFree = m_pBlocks->nSize - nHeader;
+   m_nBytesAllocated = 0;
+}
+
+inline const Detail::NameEntry* Arena::Intern(const char* pName, size_t nSize, size_t nHash)
+{
+   if ((m_nNames + 1) * 2 > m_Names.size())
+   {
+      std::vector<Detail::NameEntry*> names(m_Names.empty() ? 64 : m_Names.size() * 2, static_cast<Detail::NameEntry*>(NULL));
+      const size_t mask = names.size() - 1;
+      for (size_t i = 0; i < m_Names.size(); ++i)
+      {
+         if (m_Names[i] == NULL)
+            continue;
+         size_t j = m_Names[i]->nHash & mask;
+         while (names[j])
+            j = (j + 1) & mask;
+         names[j] = m_Names[i];
+      }
+      m_Names.swap(names);
+   }
+   const size_t mask = m_Names.size() - 1;
+   size_t i = nHash & mask;
+   for (; m_Names[i]; i = (i + 1) & mask)
+   {
+      const Detail::NameEntry& entry = *m_Names[i];
+      if (entry.nHash == nHash && entry.sName.size() == nSize && std::memcmp(entry.sName.data(), pName, nSize) == 0)
+         return &entry;
+   }
+   m_Names[i] = new (Allocate(sizeof(Detail::NameEntry))) Detail::NameEntry(pName, nSize, nHash, this);
+   ++m_nNames;
+   return m_Names[i];
+}
+
+inline void Arena::FreeNames()
+{
+   if (m_nNames == 0)
+      return;
+   // (the entries' memory goes with the blocks, but their strings are on the heap)
+   for (size_t i = 0; i < m_Names.size(); ++i)
+   {
+      if (m_Names[i])
+      {
+         m_Names[i]->~NameEntry();
+         m_Names[i] = NULL;
+      }
+   }
+   m_nNames = 0;
+}
+
+///////////////
+// Name members
+
+inline size_t Name::Hash(const char* pName, size_t nSize)
+{
+   size_t hash = 2166136261u;
+   for (size_t i = 0; i < nSize; ++i)
+      hash = (hash ^ (unsigned char)pName[i]) * 16777619u;
+   return hash;
+}
+
+inline Name::Name(const std::string& sName) : m_pEntry(NULL) { Assign(sName); }
+
+inline Name::Name(std::string&& sName) : m_pEntry(NULL)
+{
+   if (Arena::Current() != NULL)
+      Assign(sName);
+   else if (!sName.empty())
+   {
+      const size_t nHash = Hash(sName.data(), sName.size());
+      m_pEntry = new Detail::NameEntry(std::move(sName), nHash);
+   }
+}
+
+inline Name::Name(const Name& name) : m_pEntry(NULL)
+{
+   // sharing is only safe within one arena: anything else gets its own copy
+   if (name.m_pEntry && name.m_pEntry->pArena && name.m_pEntry->pArena == Arena::Current())
+      m_pEntry = name.m_pEntry;
+   else if (name.m_pEntry && Arena::Current())
+      m_pEntry = Arena::Current()->Intern(name.m_pEntry->sName.data(), name.m_pEntry->sName.size(), name.m_pEntry->nHash);
+   else if (name.m_pEntry)
+      m_pEntry = new Detail::NameEntry(name.m_pEntry->sName, name.m_pEntry->nHash, NULL);
+}
+
+inline Name::~Name() { Release(); }
+
+inline Name& Name::operator = (const Name& name)
+{
+   if (this != &name)
+   {
+      Name copy(name);
+      swap(copy);
+   }
+   return *this;
+}
+
+inline void Name::Assign(const std::string& sName)
+{
+   if (sName.empty())
+      return;
+   const size_t nHash = Hash(sName.data(), sName.size());
+   Arena* pArena = Arena::Current();
+   m_pEntry = pArena ? pArena->Intern(sName.data(), sName.size(), nHash) : new Detail::NameEntry(sName, nHash, NULL);
+}
+
+inline void Name::Release()
+{
+   if (m_pEntry && m_pEntry->pArena == NULL)
+      delete m_pEntry;
+   // else: it is freed along with the rest of the arena
+   m_pEntry = NULL;
+}
+
+inline const std::string& Name::Str() const
+{
+   static const std::string s_sEmpty;
+   return m_pEntry ? m_pEntry->sName : s_sEmpty;
+}
+
+inline size_t Name::Hash() const
+{
+   return m_pEntry ? m_pEntry->nHash : Hash("", 0);
+}
+
+inline bool Name::operator == (const Name& name) const
+{
+   if (m_pEntry == name.m_pEntry)
+      return true;
+   if (m_pEntry == NULL || name.m_pEntry == NULL || m_pEntry->nHash != name.m_pEntry->nHash)
+      return false;
+   // an arena holds only one copy of each name
+   if (m_pEntry->pArena && m_pEntry->pArena == name.m_pEntry->pArena)
+      return false;
+   return m_pEntry->sName == name.m_pEntry->sName;
+}
+
 /////////////////////////
 // UnknownElement members
 
-class UnknownElement::Imp
-{
-public:
-   virtual ~Imp() {}
-   virtual Imp* Clone() const = 0;
+template <> struct UnknownElement::Traits<Null>     { static const Type TYPE = TYPE_NULL;    static const bool INLINE = true;  };
+template <> struct UnknownElement::Traits<Boolean>  { static const Type TYPE = TYPE_BOOLEAN; static const bool INLINE = true;  };
+template <> struct UnknownElement::Traits<Number>   { static const Type TYPE = TYPE_NUMBER;  static const bool INLINE = true;  };
+template <> struct UnknownElement::Traits<String>   { static const Type TYPE = TYPE_STRING;  static const bool INLINE = false; };
+template <> struct UnknownElement::Traits<Array>    { static const Type TYPE = TYPE_ARRAY;   static const bool INLINE = false; };
+template <> struct UnknownElement::Traits<Object>   { static const Type TYPE = TYPE_OBJECT;  static const bool INLINE = false; };
 
-   virtual bool Compare(const Imp& imp) const = 0;
+static_assert(sizeof(Number) <= sizeof(double) * 3, "UnknownElement can't hold a Number inline");
 
-   virtual void Accept(ConstVisitor& visitor) const = 0;
-   virtual void Accept(Visitor& visitor) = 0;
-};
+template <typename ElementTypeT>
+ElementTypeT* UnknownElement::Ptr_i() const
+{
+   return Traits<ElementTypeT>::INLINE ? reinterpret_cast<ElementTypeT*>(const_cast<char*>(m_acInline)) : static_cast<ElementTypeT*>(m_pOutOfLine);
+}
 
+template <typename ElementTypeT, typename ArgT>
+void UnknownElement::Construct(ArgT&& arg)
+{
+   void* p = m_acInline;
+   Detail::SharedHeader* pShared = NULL;
+   if (!Traits<ElementTypeT>::INLINE)
+   {
+      pShared = static_cast<Detail::SharedHeader*>(Detail::Allocate(sizeof(Detail::SharedHeader) + sizeof(ElementTypeT)));
+      p = pShared + 1;
+   }
+   try
+   {
+      new (p) ElementTypeT(std::forward<ArgT>(arg));
+   }
+   catch (...)
+   {
+      Detail::Deallocate(pShared);
+      throw;
+   }
+   if (pShared)
+   {
+      pShared->nRefs = 1;
+      pShared->bUnshareable = false;
+      m_pOutOfLine = p;
+   }
+   m_eType = Traits<ElementTypeT>::TYPE;
+}
 
 template <typename ElementTypeT>
-class UnknownElement::Imp_T : public UnknownElement::Imp
+void UnknownElement::Share_i(const UnknownElement& unknown)
 {
-public:
-   Imp_T(const ElementTypeT& element) : m_Element(element) {}
-   virtual Imp* Clone() const { return new Imp_T<ElementTypeT>(*this); }
+   // only within the arena (or the heap) that it lives in: a copy out of a document, for one,
+   //  mustn't depend on the document's arena
+   Detail::SharedHeader* pShared = unknown.Shared_i();
+   if (!pShared->bUnshareable && Detail::ArenaOf(pShared) == Arena::Current())
+   {
+      ++pShared->nRefs;
+      m_pOutOfLine = unknown.m_pOutOfLine;
+      m_eType = unknown.m_eType;
+   }
+   else
+      Construct<ElementTypeT>(*unknown.Ptr_i<ElementTypeT>());
+}
 
-   virtual void Accept(ConstVisitor& visitor) const { visitor.Visit(m_Element); }
-   virtual void Accept(Visitor& visitor) { visitor.Visit(m_Element); }
+template <typename ElementTypeT>
+void UnknownElement::Unshare_i()
+{
+   // copy just this level (the children are shared in turn), then let go of the original, which
+   //  the others still hold
+   UnknownElement copy;
+   copy.Construct<ElementTypeT>(*Ptr_i<ElementTypeT>());
+   --Shared_i()->nRefs;
+   m_pOutOfLine = copy.m_pOutOfLine;
+   copy.m_eType = TYPE_NULL;
+}
 
-   virtual bool Compare(const Imp& imp) const
+inline void UnknownElement::TakeOver(UnknownElement& unknown)
+{
+   // the inline types are all trivially copyable, and the others are a pointer
+   switch (unknown.m_eType)
    {
-      ConstCastVisitor_T<ElementTypeT> castVisitor;
-      imp.Accept(castVisitor);
-      return castVisitor.m_pElement &&
-             m_Element == *castVisitor.m_pElement;
+      case TYPE_NULL:      break;
+      case TYPE_BOOLEAN:   memcpy(m_acInline, unknown.m_acInline, sizeof(Boolean));   break;
+      case TYPE_NUMBER:    memcpy(m_acInline, unknown.m_acInline, sizeof(Number));    break;
+      default:             m_pOutOfLine = unknown.m_pOutOfLine;                       break;
    }
+   m_eType = unknown.m_eType;
+   unknown.m_eType = TYPE_NULL;
+}
 
-private:
-   ElementTypeT m_Element;
-};
+template <typename ElementTypeT>
+void UnknownElement::Free()
+{
+   // (only called for the types that are held out of line)
+   Detail::SharedHeader* pShared = Shared_i();
+   if (--pShared->nRefs > 0)
+      return;
+   Ptr_i<ElementTypeT>()->~ElementTypeT();
+   Detail::Deallocate(pShared);
+}
+
+inline void UnknownElement::Destroy()
+{
+   switch (m_eType)
+   {
+      case TYPE_STRING:    Free<String>();   break;
+      case TYPE_ARRAY:     Free<Array>();    break;
+      case TYPE_OBJECT:    Free<Object>();   break;
+      default:             break; // nothing to free
+   }
+   m_eType = TYPE_NULL;
+}
 
+template <typename ElementTypeT>
+const ElementTypeT& UnknownElement::CastTo() const
+{
+   if (m_eType != Traits<ElementTypeT>::TYPE)
+      throw Exception("Bad cast");
+   return *Ptr_i<ElementTypeT>();
+}
 
-class UnknownElement::ConstCastVisitor : public ConstVisitor
+// Braden's addition: a number that is 0 or 1 can be cast to a Boolean...
+template <>
+inline const Boolean& UnknownElement::CastTo<Boolean>() const
 {
-   virtual void Visit(const Array& array) {}
-   virtual void Visit(const Object& object) {}
-   virtual void Visit(const Number& number) {}
-   virtual void Visit(const String& string) {}
-   virtual void Visit(const Boolean& boolean) {}
-   virtual void Visit(const Null& null) {}
-};
+   static const Boolean s_False(false), s_True(true);
+   if (m_eType == TYPE_NUMBER && (Ptr_i<Number>()->Value() == 0 || Ptr_i<Number>()->Value() == 1))
+      return Ptr_i<Number>()->Value() == 1 ? s_True : s_False;
+   if (m_eType != TYPE_BOOLEAN)
+      throw Exception("Bad cast");
+   return *Ptr_i<Boolean>();
+}
+
+// ...and any Boolean to a Number
+template <>
+inline const Number& UnknownElement::CastTo<Number>() const
+{
+   static const Number s_Zero(0.0), s_One(1.0);
+   if (m_eType == TYPE_BOOLEAN)
+      return Ptr_i<Boolean>()->Value() ? s_One : s_Zero;
+   if (m_eType != TYPE_NUMBER)
+      throw Exception("Bad cast");
+   return *Ptr_i<Number>();
+}
 
 template <typename ElementTypeT>
-class UnknownElement::ConstCastVisitor_T : public ConstCastVisitor
+bool UnknownElement::IsOfType() const
 {
-public:
-   ConstCastVisitor_T() : m_pElement(0) {}
-   virtual void Visit(const ElementTypeT& element) { m_pElement = &element; } // we don't know what this is, but it overrides one of the base's no-op functions
-   const ElementTypeT* m_pElement;
-};
+   return m_eType == Traits<ElementTypeT>::TYPE;
+}
 
-// Braden's addition: specialize the Boolean template so we can cast numbers to bool
+// (with the same conversions as CastTo())
 template <>
-class UnknownElement::ConstCastVisitor_T<Boolean> : public ConstCastVisitor
+inline bool UnknownElement::IsOfType<Boolean>() const
 {
-public:
-	ConstCastVisitor_T<Boolean>() : m_pElement(0) {}
-	virtual void Visit(const Boolean& element) { m_pElement = &element; } // Normal casting from UnknownElement to Boolean
-	virtual void Visit(const Number& element) { double val=element; if (val == 0 || val == 1) { Visit(m_value = Boolean(val==1)); } } // Conversion casting from Number to Boolean
-	const Boolean* m_pElement;
-	Boolean m_value; // We need this to temporarily store the value if we've done a conversion.
-};
-// Braden's addition: specialize the Number template so we can cast bool to double
+   return m_eType == TYPE_BOOLEAN || (m_eType == TYPE_NUMBER && (Ptr_i<Number>()->Value() == 0 || Ptr_i<Number>()->Value() == 1));
+}
+
 template <>
-class UnknownElement::ConstCastVisitor_T<Number> : public ConstCastVisitor
+inline bool UnknownElement::IsOfType<Number>() const
 {
-public:
-	ConstCastVisitor_T<Number>() : m_pElement(0) {}
-	virtual void Visit(const Number& element) { m_pElement = &element; } // Normal casting from UnknownElement to Number
-	virtual void Visit(const Boolean& element) { Visit(m_value = Number(element.Value())); } // Conversion casting from Boolean to Number
-	const Number* m_pElement;
-	Number m_value; // We need this to temporarily store the value if we've done a conversion.
-};
+   return m_eType == TYPE_NUMBER || m_eType == TYPE_BOOLEAN;
+}
 
-class UnknownElement::CastVisitor : public Visitor
+
+template <typename ElementTypeT>
+ElementTypeT& UnknownElement::Modify_i() 
 {
-   virtual void Visit(Array& array) {}
-   virtual void Visit(Object& object) {}
-   virtual void Visit(Number& number) {}
-   virtual void Visit(String& string) {}
-   virtual void Visit(Boolean& boolean) {}
-   virtual void Visit(Null& null) {}
-};
+   if (m_eType != Traits<ElementTypeT>::TYPE)
+   {
+      // we're not the right type. fix it
+      *this = ElementTypeT();
+   }
+   else if (!Traits<ElementTypeT>::INLINE && Shared_i()->nRefs > 1)
+   {
+      // we're about to be changed, so we need our own
+      Unshare_i<ElementTypeT>();
+   }
+
+   return *Ptr_i<ElementTypeT>();
+}
 
 template <typename ElementTypeT>
-class UnknownElement::CastVisitor_T : public CastVisitor
+ElementTypeT& UnknownElement::ConvertTo() 
 {
-public:
-   CastVisitor_T() : m_pElement(0) {}
-   virtual void Visit(ElementTypeT& element) { m_pElement = &element; } // we don't know what this is, but it overrides one of the base's no-op functions
-   ElementTypeT* m_pElement;
-};
+   ElementTypeT& element = Modify_i<ElementTypeT>();
+   // the caller may hold on to the reference, and write through it after we've been copied
+   if (!Traits<ElementTypeT>::INLINE)
+      Shared_i()->bUnshareable = true;
+   return element;
+}
+
+
+inline UnknownElement::UnknownElement() :                               m_eType(TYPE_NULL) {}
+inline UnknownElement::UnknownElement(const Object& object) :           m_eType(TYPE_NULL) { Construct<Object>(object); }
+inline UnknownElement::UnknownElement(const Array& array) :             m_eType(TYPE_NULL) { Construct<Array>(array); }
+inline UnknownElement::UnknownElement(const Number& number) :           m_eType(TYPE_NULL) { Construct<Number>(number); }
+inline UnknownElement::UnknownElement(const Boolean& boolean) :         m_eType(TYPE_NULL) { Construct<Boolean>(boolean); }
+inline UnknownElement::UnknownElement(const String& string) :           m_eType(TYPE_NULL) { Construct<String>(string); }
+inline UnknownElement::UnknownElement(const Null& null) :               m_eType(TYPE_NULL) {}
+inline UnknownElement::UnknownElement(Object&& object) :                m_eType(TYPE_NULL) { Construct<Object>(std::move(object)); }
+inline UnknownElement::UnknownElement(Array&& array) :                  m_eType(TYPE_NULL) { Construct<Array>(std::move(array)); }
+inline UnknownElement::UnknownElement(String&& string) :                m_eType(TYPE_NULL) { Construct<String>(std::move(string)); }
 
-inline UnknownElement::UnknownElement() :                               m_pImp( new Imp_T<Null>( Null() ) ) {}
-inline UnknownElement::UnknownElement(const UnknownElement& unknown) :  m_pImp( unknown.m_pImp->Clone()) {}
-inline UnknownElement::UnknownElement(const Object& object) :           m_pImp( new Imp_T<Object>(object) ) {}
-inline UnknownElement::UnknownElement(const Array& array) :             m_pImp( new Imp_T<Array>(array) ) {}
-inline UnknownElement::UnknownElement(const Number& number) :           m_pImp( new Imp_T<Number>(number) ) {}
-inline UnknownElement::UnknownElement(const Boolean& boolean) :         m_pImp( new Imp_T<Boolean>(boolean) ) {}
-inline UnknownElement::UnknownElement(const String& string) :           m_pImp( new Imp_T<String>(string) ) {}
-inline UnknownElement::UnknownElement(const Null& null) :               m_pImp( new Imp_T<Null>(null) ) {}
+inline UnknownElement::UnknownElement(const UnknownElement& unknown) :  m_eType(TYPE_NULL)
+{
+   switch (unknown.m_eType)
+   {
+      case TYPE_NULL:      break;
+      case TYPE_BOOLEAN:   Construct<Boolean>(*unknown.Ptr_i<Boolean>());   break;
+      case TYPE_NUMBER:    Construct<Number>(*unknown.Ptr_i<Number>());     break;
+      case TYPE_STRING:    Share_i<String>(unknown);                         break;
+      case TYPE_ARRAY:     Share_i<Array>(unknown);                          break;
+      case TYPE_OBJECT:    Share_i<Object>(unknown);                         break;
+   }
+}
 
-inline UnknownElement::~UnknownElement()   { delete m_pImp; }
+inline UnknownElement::UnknownElement(UnknownElement&& unknown) noexcept : m_eType(TYPE_NULL)
+{
+   // the source is left holding a Null, which costs nothing
+   TakeOver(unknown);
+}
+
+inline UnknownElement::~UnknownElement()   { Destroy(); }
 
 inline UnknownElement::operator const Object& () const    { return CastTo<Object>(); }
 inline UnknownElement::operator const Array& () const     { return CastTo<Array>(); }
@@ -474,12 +1183,25 @@ inline UnknownElement& UnknownElement::operator = (const UnknownElement& unknown
    // always check for this
    if (&unknown != this)
    {
-      // we might be copying from a subtree of ourselves. delete the old imp
-      //  only after the clone operation is complete. yes, this could be made 
-      //  more efficient, but isn't worth the complexity
-      Imp* pOldImp = m_pImp;
-      m_pImp = unknown.m_pImp->Clone();
-      delete pOldImp;
+      // we might be copying from a subtree of ourselves, so copy before letting
+      //  go of what we hold
+      UnknownElement copy(unknown);
+      *this = std::move(copy);
+   }
+
+   return *this;
+}
+
+inline UnknownElement& UnknownElement::operator = (UnknownElement&& unknown) 
+{
+   if (&unknown != this)
+   {
+      // as above, unknown might be a subtree of ourselves, so it can't simply 
+      //  be swapped with us. it's left holding a Null instead, and what we held
+      //  is only freed once we have taken it over
+      UnknownElement old;
+      old.TakeOver(*this);
+      TakeOver(unknown);
    }
 
    return *this;
@@ -514,50 +1236,48 @@ inline const UnknownElement& UnknownElement::operator[] (size_t index) const
 }
 
 
-template <typename ElementTypeT>
-const ElementTypeT& UnknownElement::CastTo() const
-{
-   ConstCastVisitor_T<ElementTypeT> castVisitor;
-   m_pImp->Accept(castVisitor);
-   if (castVisitor.m_pElement == 0)
-      throw Exception("Bad cast");
-   return *castVisitor.m_pElement;
-}
-
-template <typename ElementTypeT>
-bool UnknownElement::IsOfType() const
+inline void UnknownElement::Accept(ConstVisitor& visitor) const
 {
-   ConstCastVisitor_T<ElementTypeT> castVisitor;
-   m_pImp->Accept(castVisitor);
-   return (castVisitor.m_pElement != 0);
+   switch (m_eType)
+   {
+      case TYPE_NULL:      visitor.Visit(*Ptr_i<Null>());      break;
+      case TYPE_BOOLEAN:   visitor.Visit(*Ptr_i<Boolean>());   break;
+      case TYPE_NUMBER:    visitor.Visit(*Ptr_i<Number>());    break;
+      case TYPE_STRING:    visitor.Visit(*Ptr_i<String>());    break;
+      case TYPE_ARRAY:     visitor.Visit(*Ptr_i<Array>());     break;
+      case TYPE_OBJECT:    visitor.Visit(*Ptr_i<Object>());    break;
+   }
 }
 
-
-
-
-template <typename ElementTypeT>
-ElementTypeT& UnknownElement::ConvertTo() 
+inline void UnknownElement::Accept(Visitor& visitor)
 {
-   CastVisitor_T<ElementTypeT> castVisitor;
-   m_pImp->Accept(castVisitor);
-   if (castVisitor.m_pElement == 0)
+   switch (m_eType)
    {
-      // we're not the right type. fix it & try again
-      *this = ElementTypeT();
-      m_pImp->Accept(castVisitor);
+      case TYPE_NULL:      visitor.Visit(*Ptr_i<Null>());      break;
+      case TYPE_BOOLEAN:   visitor.Visit(*Ptr_i<Boolean>());   break;
+      case TYPE_NUMBER:    visitor.Visit(*Ptr_i<Number>());    break;
+      case TYPE_STRING:    visitor.Visit(ConvertTo<String>()); break; // (the visitor may change them)
+      case TYPE_ARRAY:     visitor.Visit(ConvertTo<Array>());  break;
+      case TYPE_OBJECT:    visitor.Visit(ConvertTo<Object>()); break;
    }
-
-   return *castVisitor.m_pElement;
 }
 
 
-inline void UnknownElement::Accept(ConstVisitor& visitor) const { m_pImp->Accept(visitor); }
-inline void UnknownElement::Accept(Visitor& visitor)            { m_pImp->Accept(visitor); }
-
-
 inline bool UnknownElement::operator == (const UnknownElement& element) const
 {
-   return m_pImp->Compare(*element.m_pImp);
+   // booleans and numbers compare with each other as CastTo() converts them
+   if (m_eType == element.m_eType && m_eType >= TYPE_STRING && m_pOutOfLine == element.m_pOutOfLine)
+      return true; // shared
+   switch (m_eType)
+   {
+      case TYPE_NULL:      return element.m_eType == TYPE_NULL;
+      case TYPE_BOOLEAN:   return element.IsOfType<Boolean>() && *Ptr_i<Boolean>() == element.CastTo<Boolean>();
+      case TYPE_NUMBER:    return element.IsOfType<Number>() && *Ptr_i<Number>() == element.CastTo<Number>();
+      case TYPE_STRING:    return element.m_eType == TYPE_STRING && *Ptr_i<String>() == *element.Ptr_i<String>();
+      case TYPE_ARRAY:     return element.m_eType == TYPE_ARRAY && *Ptr_i<Array>() == *element.Ptr_i<Array>();
+      case TYPE_OBJECT:    return element.m_eType == TYPE_OBJECT && *Ptr_i<Object>() == *element.Ptr_i<Object>();
+   }
+   return false;
 }
 
 
@@ -569,25 +1289,133 @@ inline bool UnknownElement::operator == (const UnknownElement& element) const
 inline Object::Member::Member(const std::string& nameIn, const UnknownElement& elementIn) :
    name(nameIn), element(elementIn) {}
 
+inline Object::Member::Member(std::string&& nameIn, UnknownElement&& elementIn) :
+   name(std::move(nameIn)), element(std::move(elementIn)) {}
+
 inline bool Object::Member::operator == (const Member& member) const 
 {
    return name == member.name &&
           element == member.element;
 }
 
-class Object::Finder : public std::unary_function<Object::Member, bool>
+inline Object::Object() {}
+
+inline Object::Object(const Object& object) :
+   m_Members(object.m_Members)
 {
-public:
-   Finder(const std::string& name) : m_name(name) {}
-   bool operator () (const Object::Member& member) {
-      return member.name == m_name;
+   if (m_Members.size() > INDEX_THRESHOLD)
+      RebuildIndex();
+}
+
+// swapping (unlike moving) std::list guarantees that iterators stay valid, so the index 
+//  can come along too
+inline Object::Object(Object&& object)
+{
+   m_Members.swap(object.m_Members);
+   m_Index.swap(object.m_Index);
+}
+
+inline Object& Object::operator = (Object&& object)
+{
+   m_Members.swap(object.m_Members);
+   m_Index.swap(object.m_Index);
+   return *this;
+}
+
+inline Object& Object::operator = (const Object& object)
+{
+   if (this != &object)
+   {
+      m_Members = object.m_Members;
+      m_Index.clear();
+      if (m_Members.size() > INDEX_THRESHOLD)
+         RebuildIndex();
    }
+   return *this;
+}
 
-private:
-   std::string m_name;
-};
+inline size_t Object::FindSlot(const std::string& name, size_t hash) const
+{
+   const size_t mask = m_Index.size() - 1;
+   for (size_t i = hash & mask; m_Index[i].pMember; i = (i + 1) & mask)
+   {
+      if (m_Index[i].hash == hash && m_Index[i].pMember->name == name)
+         return i;
+   }
+   return m_Index.size();
+}
+
+inline size_t Object::FindSlot(const Name& name) const
+{
+   const size_t hash = name.Hash();
+   const size_t mask = m_Index.size() - 1;
+   for (size_t i = hash & mask; m_Index[i].pMember; i = (i + 1) & mask)
+   {
+      if (m_Index[i].pMember->name == name)
+         return i;
+   }
+   return m_Index.size();
+}
+
+inline void Object::IndexPlace(iterator it, size_t hash)
+{
+   const size_t mask = m_Index.size() - 1;
+   size_t i = hash & mask;
+   while (m_Index[i].pMember)
+      i = (i + 1) & mask;
+   m_Index[i].hash = hash;
+   m_Index[i].pMember = &*it;
+   m_Index[i].it = it;
+}
+
+inline void Object::IndexInsert(iterator it)
+{
+   // Note: *it has already been added to m_Members
+   if (m_Index.empty() ? m_Members.size() > INDEX_THRESHOLD : m_Members.size() * 2 > m_Index.size())
+      RebuildIndex();
+   else if (!m_Index.empty())
+      IndexPlace(it, it->name.Hash());
+}
 
+inline void Object::IndexErase(iterator it)
+{
+   if (m_Index.empty())
+      return;
+   const size_t mask = m_Index.size() - 1;
+   size_t i = FindSlot(it->name);
+   assert(i < m_Index.size());
+   // Backward-shift deletion: move any later entries of the same probe run into the gap,
+   // so that lookups never need "deleted" markers.
+   size_t j = i;
+   for (;;)
+   {
+      m_Index[i].pMember = NULL;
+      for (;;)
+      {
+         j = (j + 1) & mask;
+         if (!m_Index[j].pMember)
+            return;
+         const size_t home = m_Index[j].hash & mask;
+         // The entry at j can stay put if its home slot lies cyclically within (i, j]:
+         if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+         break;
+      }
+      m_Index[i] = m_Index[j];
+      i = j;
+   }
+}
 
+inline void Object::RebuildIndex()
+{
+   size_t capacity = 32;
+   while (capacity < m_Members.size() * 4)
+      capacity *= 2;
+   IndexSlot empty = { 0, NULL, m_Members.end() };
+   m_Index.assign(capacity, empty);
+   for (iterator it = m_Members.begin(); it != m_Members.end(); ++it)
+      IndexPlace(it, it->name.Hash());
+}
 
 inline Object::iterator Object::Begin() { return m_Members.begin(); }
 inline Object::iterator Object::End() { return m_Members.end(); }
@@ -599,12 +1427,47 @@ inline bool Object::Empty() const { return m_Members.empty(); }
 
 inline Object::iterator Object::Find(const std::string& name) 
 {
-   return std::find_if(m_Members.begin(), m_Members.end(), Finder(name));
+   if (!m_Index.empty())
+   {
+      const size_t i = FindSlot(name);
+      return i < m_Index.size() ? m_Index[i].it : m_Members.end();
+   }
+   iterator it = m_Members.begin();
+   while (it != m_Members.end() && it->name != name)
+      ++it;
+   return it;
 }
 
 inline Object::const_iterator Object::Find(const std::string& name) const 
 {
-   return std::find_if(m_Members.begin(), m_Members.end(), Finder(name));
+   return const_cast<Object*>(this)->Find(name);
+}
+
+inline Object::const_iterator Object::Find(const std::string& name, size_t nHash) const
+{
+   if (!m_Index.empty())
+   {
+      const size_t i = FindSlot(name, nHash);
+      return i < m_Index.size() ? m_Index[i].it : m_Members.end();
+   }
+   // every Name knows its hash, so most members are passed over without comparing strings
+   const_iterator it = m_Members.begin();
+   while (it != m_Members.end() && (it->name.Hash() != nHash || it->name != name))
+      ++it;
+   return it;
+}
+
+inline Object::iterator Object::FindName(const Name& name) 
+{
+   if (!m_Index.empty())
+   {
+      const size_t i = FindSlot(name);
+      return i < m_Index.size() ? m_Index[i].it : m_Members.end();
+   }
+   iterator it = m_Members.begin();
+   while (it != m_Members.end() && it->name != name)
+      ++it;
+   return it;
 }
 
 inline Object::iterator Object::Insert(const Member& member)
@@ -614,16 +1477,45 @@ inline Object::iterator Object::Insert(const Member& member)
 
 inline Object::iterator Object::Insert(const Member& member, iterator itWhere)
 {
-   iterator it = Find(member.name);
+   iterator it = FindName(member.name);
    if (it != m_Members.end())
-      throw Exception(std::string("Object member already exists: ") + member.name);
+      throw Exception(std::string("Object member already exists: ") + member.name.Str());
 
    it = m_Members.insert(itWhere, member);
+   IndexInsert(it);
+   return it;
+}
+
+inline Object::iterator Object::Insert(Member&& member)
+{
+   return Insert(std::move(member), End());
+}
+
+inline Object::iterator Object::Insert(Member&& member, iterator itWhere)
+{
+   iterator it = FindName(member.name);
+   if (it != m_Members.end())
+      throw Exception(std::string("Object member already exists: ") + member.name.Str());
+
+   it = m_Members.insert(itWhere, std::move(member));
+   IndexInsert(it);
+   return it;
+}
+
+inline Object::iterator Object::Insert(std::string&& name, UnknownElement&& element)
+{
+   iterator it = Find(name);
+   if (it != m_Members.end())
+      throw Exception(std::string("Object member already exists: ") + name);
+
+   it = m_Members.emplace(m_Members.end(), std::move(name), std::move(element));
+   IndexInsert(it);
    return it;
 }
 
 inline Object::iterator Object::Erase(iterator itWhere) 
 {
+   IndexErase(itWhere);
    return m_Members.erase(itWhere);
 }
 
@@ -633,8 +1525,7 @@ inline UnknownElement& Object::operator [](const std::string& name)
    iterator it = Find(name);
    if (it == m_Members.end())
    {
-      Member member(name);
-      it = Insert(member, End());
+      it = Insert(Member(name), End());
    }
    return it->element;      
 }
@@ -657,9 +1548,18 @@ const ValueTypeT Object::ImpGetOrDefault(const std::string& name, ValueTypeT def
 	return (TrivialType_T<ValueTypeT>)it->element;
 }
 
+inline const long long Object::GetOrDefault(const std::string& name, long long defaultVal) const
+{
+	const_iterator it = Find(name);
+	if (it == End())
+		return defaultVal;
+	return ((const Number&)it->element).AsInteger();
+}
+
 inline void Object::Clear() 
 {
    m_Members.clear(); 
+   m_Index.clear();
 }
 
 inline bool Object::operator == (const Object& object) const 
@@ -686,6 +1586,16 @@ inline Array::iterator Array::Insert(const UnknownElement& element)
    return Insert(element, End());
 }
 
+inline Array::iterator Array::Insert(UnknownElement&& element, iterator itWhere)
+{ 
+   return m_Elements.insert(itWhere, std::move(element));
+}
+
+inline Array::iterator Array::Insert(UnknownElement&& element)
+{
+   return Insert(std::move(element), End());
+}
+
 inline Array::iterator Array::Erase(iterator itWhere)
 { 
    return m_Elements.erase(itWhere);
@@ -696,6 +1606,28 @@ inline void Array::Resize(size_t newSize)
    m_Elements.resize(newSize);
 }
 
+inline void Array::Reserve(size_t newCapacity)
+{
+   m_Elements.reserve(newCapacity);
+}
+
+template <typename NumberT>
+bool Array::GetNumbers(std::vector<NumberT>& values) const
+{
+   values.resize(m_Elements.size());
+   for (size_t i = 0; i < m_Elements.size(); ++i)
+   {
+      if (!m_Elements[i].IsOfType<Number>())
+      {
+         values.clear();
+         return false;
+      }
+      const Number& number = m_Elements[i];
+      values[i] = std::numeric_limits<NumberT>::is_integer ? static_cast<NumberT>(number.AsInteger()) : static_cast<NumberT>(number.Value());
+   }
+   return true;
+}
+
 inline size_t Array::Size() const  { return m_Elements.size(); }
 inline bool Array::Empty() const   { return m_Elements.empty(); }
 
@@ -731,6 +1663,10 @@ template <typename DataTypeT>
 TrivialType_T<DataTypeT>::TrivialType_T(const DataTypeT& t) :
    m_tValue(t) {}
 
+template <typename DataTypeT>
+TrivialType_T<DataTypeT>::TrivialType_T(DataTypeT&& t) :
+   m_tValue(std::move(t)) {}
+
 template <typename DataTypeT>
 TrivialType_T<DataTypeT>::operator DataTypeT&()
 {
@@ -772,6 +1708,190 @@ inline bool Null::operator == (const Null& trivial) const
 }
 
 
+/////////////////////////////////////////////////////////////////////////////////
+// Detail - scanning helpers shared by Reader and PushParser. Where the target 
+//  supports SSE2 (x86) or NEON (ARM), they look at 16 characters at a time,
+//  which matters most for long strings.
+
+namespace Detail
+{
+
+inline bool IsWhiteSpace(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v'; }
+
+#ifdef JSON_USE_SSE2
+inline unsigned int FirstSetBit(unsigned int mask) // mask must not be 0
+{
+#ifdef _MSC_VER
+   unsigned long index;
+   _BitScanForward(&index, mask);
+   return index;
+#else
+   return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+#ifdef JSON_USE_NEON
+inline bool AnySet(uint8x16_t v)
+{
+   // armv7 has no movemask or horizontal max, so just test both halves
+   const uint64x2_t halves = vreinterpretq_u64_u8(v);
+   return (vgetq_lane_u64(halves, 0) | vgetq_lane_u64(halves, 1)) != 0;
+}
+#endif
+
+// the first '"', '\\' or '\n' in [p, pEnd), or pEnd if there is none. everything
+//  before it can be copied into a string as is.
+inline const char* FindStringSpecial(const char* p, const char* pEnd)
+{
+#if defined(JSON_USE_SSE2)
+   const __m128i quote = _mm_set1_epi8('"');
+   const __m128i backslash = _mm_set1_epi8('\\');
+   const __m128i newline = _mm_set1_epi8('\n');
+   while (pEnd - p >= 16)
+   {
+      const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      const __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), _mm_cmpeq_epi8(chunk, newline));
+      const unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+      if (mask != 0)
+         return p + FirstSetBit(mask);
+      p += 16;
+   }
+#elif defined(JSON_USE_NEON)
+   const uint8x16_t quote = vdupq_n_u8('"');
+   const uint8x16_t backslash = vdupq_n_u8('\\');
+   const uint8x16_t newline = vdupq_n_u8('\n');
+   while (pEnd - p >= 16)
+   {
+      const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+      const uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)), vceqq_u8(chunk, newline));
+      if (AnySet(special))
+         break; // it's in these 16; the loop below finds it
+      p += 16;
+   }
+#endif
+   while (p != pEnd && *p != '"' && *p != '\\' && *p != '\n')
+      ++p;
+   return p;
+}
+
+// the first character in [p, pEnd) that isn't white space, or pEnd if there is none
+inline const char* SkipWhiteSpace(const char* p, const char* pEnd)
+{
+   // there is usually little or no white space, so check one character before anything else
+   if (p == pEnd || !IsWhiteSpace(*p))
+      return p;
+   ++p;
+#if defined(JSON_USE_SSE2)
+   const __m128i space = _mm_set1_epi8(' ');
+   const __m128i tab = _mm_set1_epi8('\t');
+   const __m128i newline = _mm_set1_epi8('\n');
+   const __m128i cr = _mm_set1_epi8('\r');
+   while (pEnd - p >= 16)
+   {
+      const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      const __m128i white = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, cr)));
+      const unsigned int mask = ~(unsigned int)_mm_movemask_epi8(white) & 0xFFFF;
+      if (mask != 0)
+         return SkipWhiteSpace(p + FirstSetBit(mask), pEnd); // (could be '\f' or '\v')
+      p += 16;
+   }
+#elif defined(JSON_USE_NEON)
+   const uint8x16_t space = vdupq_n_u8(' ');
+   const uint8x16_t tab = vdupq_n_u8('\t');
+   const uint8x16_t newline = vdupq_n_u8('\n');
+   const uint8x16_t cr = vdupq_n_u8('\r');
+   while (pEnd - p >= 16)
+   {
+      const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+      const uint8x16_t white = vorrq_u8(vorrq_u8(vceqq_u8(chunk, space), vceqq_u8(chunk, tab)),
+                                        vorrq_u8(vceqq_u8(chunk, newline), vceqq_u8(chunk, cr)));
+      if (AnySet(vmvnq_u8(white)))
+         break;
+      p += 16;
+   }
+#endif
+   while (p != pEnd && IsWhiteSpace(*p))
+      ++p;
+   return p;
+}
+
+// for the writers: what follows the '\\' in the escape for each character, 'u' for a \u00XX
+//  one, or 0 if it goes out as it is (everything from ' ' up, apart from '"' and '\\')
+inline const char* EscapeTable()
+{
+   static const char sTable[256] =
+   {
+      'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+      'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+      0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   '\\', 0,  0,   0,
+      // (the rest are 0, UTF-8 included)
+   };
+   return sTable;
+}
+
+// the first character in [p, pEnd) that has to be escaped, or pEnd if there is none. everything
+//  before it can be copied out as it is.
+inline const char* FindEscape(const char* p, const char* pEnd)
+{
+#if defined(JSON_USE_SSE2)
+   const __m128i quote = _mm_set1_epi8('"');
+   const __m128i backslash = _mm_set1_epi8('\\');
+   const __m128i control = _mm_set1_epi8(0x1F);
+   while (pEnd - p >= 16)
+   {
+      const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      // (a byte is a control character if the unsigned max of it and 0x1F is 0x1F)
+      const __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                           _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+      const unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+      if (mask != 0)
+         return p + FirstSetBit(mask);
+      p += 16;
+   }
+#elif defined(JSON_USE_NEON)
+   const uint8x16_t quote = vdupq_n_u8('"');
+   const uint8x16_t backslash = vdupq_n_u8('\\');
+   const uint8x16_t space = vdupq_n_u8(' ');
+   while (pEnd - p >= 16)
+   {
+      const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+      const uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)), vcltq_u8(chunk, space));
+      if (AnySet(special))
+         break; // it's in these 16; the loop below finds it
+      p += 16;
+   }
+#endif
+   const char* sTable = EscapeTable();
+   while (p != pEnd && !sTable[(unsigned char)*p])
+      ++p;
+   return p;
+}
+
+// writes the escape for c (which FindEscape() stopped at) to pOut, and returns its length: 2, or 6 for
+//  a \u00XX
+inline size_t Escape(char c, char* pOut)
+{
+   static const char sHex[] = "0123456789abcdef";
+   const char cEscape = EscapeTable()[(unsigned char)c];
+   pOut[0] = '\\';
+   pOut[1] = cEscape;
+   if (cEscape != 'u')
+      return 2;
+   pOut[2] = '0';
+   pOut[3] = '0';
+   pOut[4] = sHex[(c >> 4) & 0xF];
+   pOut[5] = sHex[c & 0xF];
+   return 6;
+}
+
+} // namespace Detail
+
+
 class Reader
 {
 public:
@@ -785,8 +1905,8 @@ public:
       unsigned int m_nDocOffset;  // character offset from entire document, zero indexed
    };
 
-   // thrown during the first phase of reading. generally catches low-level problems such
-   //  as errant characters or corrupt/incomplete documents
+   // thrown on low-level problems such as errant characters or corrupt/incomplete 
+   //  documents
    class ScanException : public Exception
    {
    public:
@@ -797,8 +1917,7 @@ public:
       Reader::Location m_locError;
    };
 
-   // thrown during the second phase of reading. generally catches higher-level problems such
-   //  as missing commas or brackets
+   // thrown on higher-level problems such as missing commas or brackets
    class ParseException : public Exception
    {
    public:
@@ -823,85 +1942,83 @@ public:
    // ...otherwise, if you don't know, call this & visit it
    static void Read(UnknownElement& elementRoot, std::istream& istr);
 
-private:
-   struct Token
-   {
-      enum Type
-      {
-         TOKEN_OBJECT_BEGIN,  //    {
-         TOKEN_OBJECT_END,    //    }
-         TOKEN_ARRAY_BEGIN,   //    [
-         TOKEN_ARRAY_END,     //    ]
-         TOKEN_NEXT_ELEMENT,  //    ,
-         TOKEN_MEMBER_ASSIGN, //    :
-         TOKEN_STRING,        //    "xxx"
-         TOKEN_NUMBER,        //    [+/-]000.000[e[+/-]000]
-         TOKEN_BOOLEAN,       //    true -or- false
-         TOKEN_NULL,          //    null
-      };
-
-      Token() : nType(TOKEN_NULL), sValue(NULL) {}
-      Token(const Token& t) : nType(t.nType), sValue(NULL) { if (t.sValue) SetStrValue(t.GetStrValue()); }
-      Token& operator=(const Token& r) { if (&r != this) { nType = r.nType; if (r.sValue) SetStrValue(r.sValue); else sValue = NULL; } return *this; }
-      ~Token() { if (sValue && sValue != sValueBuffer) delete[] sValue; }
-
-      Type nType;
-
-      void SetStrValue(const char* val) {
-         assert(sValue == NULL); // Should only be set once
-         unsigned int length_needed = strlen(val)+1;
-		 if (length_needed > sizeof(sValueBuffer)/sizeof(char)) {
-            sValue = new char[length_needed];
-            memcpy(sValue, val, length_needed);
-         } else {
-            memcpy(sValueBuffer, val, length_needed);
-            sValue = sValueBuffer;
-         }
-      }
-      void SetStrValue(const char val) {
-         assert(sValue == NULL);
-         sValueBuffer[0] = val;
-         sValueBuffer[1] = '\0';
-         sValue = sValueBuffer;
-      }
-      const char* GetStrValue() const {
-         assert(sValue != NULL);
-         return sValue;
-      }
-
-      // for malformed file debugging
-      Reader::Location locBegin;
-      Reader::Location locEnd;
-   private:
-      char sValueBuffer[8]; // Optimization: for short string values, store the string in this buffer, rather than triggering a malloc()
-      char* sValue;
-   };
+   // the same, for a document that is already in memory (it needn't be null-terminated).
+   //  this is the fastest way to read a document: the text is scanned and parsed in 
+   //  place, in a single pass, without going through an istream at all.
+   static void Read(Object& object, const char* pData, size_t nSize);
+   static void Read(Array& array, const char* pData, size_t nSize);
+   static void Read(String& string, const char* pData, size_t nSize);
+   static void Read(Number& number, const char* pData, size_t nSize);
+   static void Read(Boolean& boolean, const char* pData, size_t nSize);
+   static void Read(Null& null, const char* pData, size_t nSize);
+   static void Read(UnknownElement& elementRoot, const char* pData, size_t nSize);
+
+   // reads a document straight into a plain C++ value (a struct described by JSON_FIELDS, or a
+   //  container of them: see jsonbind.h, which must be included), without building any elements
+   template <typename ValueT>
+   static void ReadValue(ValueT& value, const char* pData, size_t nSize) { Read_i(value, pData, nSize); }
+   template <typename ValueT>
+   static void ReadValue(ValueT& value, std::istream& istr) { Read_i(value, istr); }
+
+   // converts the text of a NUMBER token to a double. returns false if the text is malformed
+   static bool ParseNumber(const char* sValue, double& result);
+   // the same, for tokens that are plain integers (no fraction or exponent) that fit in a
+   //  long long. returns false for anything else
+   static bool ParseInteger(const char* sValue, long long& result);
 
-   class InputStream;
-   class TokenStream;
-   typedef std::vector<Token> Tokens;
+private:
+   Reader(const char* pBegin, const char* pEnd) :
+      m_pBegin(pBegin), m_pCurrent(pBegin), m_pEnd(pEnd), m_nArrayDepth(0) {}
 
    template <typename ElementTypeT>   
    static void Read_i(ElementTypeT& element, std::istream& istr);
-
-   // scanning istream into token sequence
-   void Scan(Tokens& tokens, InputStream& inputStream);
-
-   void EatWhiteSpace(InputStream& inputStream);
-   std::string MatchString(InputStream& inputStream);
-   std::string MatchNumber(InputStream& inputStream);
-   const char* MatchExpectedString(InputStream& inputStream, const char* sExpected);
-
-   // parsing token sequence into element structure
-   void Parse(UnknownElement& element, TokenStream& tokenStream);
-   void Parse(Object& object, TokenStream& tokenStream);
-   void Parse(Array& array, TokenStream& tokenStream);
-   void Parse(String& string, TokenStream& tokenStream);
-   void Parse(Number& number, TokenStream& tokenStream);
-   void Parse(Boolean& boolean, TokenStream& tokenStream);
-   void Parse(Null& null, TokenStream& tokenStream);
-
-   const char* MatchExpectedToken(Token::Type nExpected, TokenStream& tokenStream);
+   template <typename ElementTypeT>   
+   static void Read_i(ElementTypeT& element, const char* pData, size_t nSize);
+
+   // scanning & parsing, fused into one pass. each Parse() expects any leading white
+   //  space to have been eaten already, and stops just after the element.
+   void Parse(UnknownElement& element);
+   void Parse(Object& object);
+   void Parse(Array& array);
+   void Parse(String& string);
+   void Parse(Number& number);
+   void Parse(Boolean& boolean);
+   void Parse(Null& null);
+   // anything else is read by its Bind
+   template <typename ValueT>
+   void Parse(ValueT& value) { Bind<ValueT>::Read(*this, value); }
+   template <typename ValueT, typename EnableT>
+   friend struct Bind;
+
+   // skips over the next value without building anything. it must still be well-formed, but
+   //  strings aren't unescaped, nor numbers converted
+   void Skip();
+   void SkipString();
+   // the next member name, pointing into the document where it has no escapes (or else into
+   //  m_sName), so that looking it up needn't allocate anything
+   void MatchName(const char*& pName, size_t& nSize);
+
+   void EatWhiteSpace();
+   char Peek(); // throws if we have reached the end of the document
+   void MatchExpectedChar(char cExpected);
+   void MatchExpectedString(const char* sExpected);
+   void MatchString(std::string& string);
+
+   // only worked out when we have an error to report
+   Location GetLocation(const char* pWhere) const;
+   void ThrowScan(const std::string& sMessage) const;
+   void ThrowParse(const std::string& sMessage, const char* pTokenBegin) const;
+
+   const char* m_pBegin;
+   const char* m_pCurrent;
+   const char* m_pEnd;
+
+   // the elements of the arrays being parsed, one buffer for each level of nesting (reused
+   //  from one array to the next), so that each array can be given exactly the storage it 
+   //  needs once its size is known
+   std::vector<std::vector<UnknownElement> > m_Pending;
+   size_t m_nArrayDepth;
+   std::string m_sName;
 };
 
 
@@ -917,98 +2034,6 @@ inline Reader::Location::Location() :
 {}
 
 
-//////////////////////
-// Reader::InputStream
-
-class Reader::InputStream // would be cool if we could inherit from std::istream & override "get"
-{
-public:
-   InputStream(std::istream& iStr) :
-      m_iStr(iStr) {}
-
-   // protect access to the input stream, so we can keeep track of document/line offsets
-   char Get(); // big, define outside
-   char Peek() {
-      assert(m_iStr.eof() == false); // enforce reading of only valid stream data 
-      return m_iStr.peek();
-   }
-
-   bool EOS() {
-      m_iStr.peek(); // apparently eof flag isn't set until a character read is attempted. whatever.
-      return m_iStr.eof();
-   }
-
-   const Location& GetLocation() const { return m_Location; }
-
-private:
-   std::istream& m_iStr;
-   Location m_Location;
-};
-
-
-inline char Reader::InputStream::Get()
-{
-   assert(m_iStr.eof() == false); // enforce reading of only valid stream data 
-   char c = m_iStr.get();
-   
-   ++m_Location.m_nDocOffset;
-   if (c == '\n') {
-      ++m_Location.m_nLine;
-      m_Location.m_nLineOffset = 0;
-   }
-   else {
-      ++m_Location.m_nLineOffset;
-   }
-
-   return c;
-}
-
-
-
-//////////////////////
-// Reader::TokenStream
-
-class Reader::TokenStream
-{
-public:
-   TokenStream(const Tokens& tokens);
-
-   const Token& Peek();
-   const Token& Get();
-
-   bool EOS() const;
-
-private:
-   const Tokens& m_Tokens;
-   Tokens::const_iterator m_itCurrent;
-};
-
-
-inline Reader::TokenStream::TokenStream(const Tokens& tokens) :
-   m_Tokens(tokens),
-   m_itCurrent(tokens.begin())
-{}
-
-inline const Reader::Token& Reader::TokenStream::Peek() {
-   if (EOS())
-   {
-      const Token& lastToken = *m_Tokens.rbegin();
-      std::string sMessage = "Unexpected end of token stream";
-      throw ParseException(sMessage, lastToken.locBegin, lastToken.locEnd); // nowhere to point to
-   }
-   return *(m_itCurrent); 
-}
-
-inline const Reader::Token& Reader::TokenStream::Get() {
-   const Token& token = Peek();
-   ++m_itCurrent;
-   return token;
-}
-
-inline bool Reader::TokenStream::EOS() const {
-   return m_itCurrent == m_Tokens.end(); 
-}
-
 ///////////////////
 // Reader (finally)
 
@@ -1021,439 +2046,1145 @@ inline void Reader::Read(Boolean& boolean, std::istream& istr)              { Re
 inline void Reader::Read(Null& null, std::istream& istr)                    { Read_i(null, istr); }
 inline void Reader::Read(UnknownElement& unknown, std::istream& istr)       { Read_i(unknown, istr); }
 
+inline void Reader::Read(Object& object, const char* pData, size_t nSize)          { Read_i(object, pData, nSize); }
+inline void Reader::Read(Array& array, const char* pData, size_t nSize)            { Read_i(array, pData, nSize); }
+inline void Reader::Read(String& string, const char* pData, size_t nSize)          { Read_i(string, pData, nSize); }
+inline void Reader::Read(Number& number, const char* pData, size_t nSize)          { Read_i(number, pData, nSize); }
+inline void Reader::Read(Boolean& boolean, const char* pData, size_t nSize)        { Read_i(boolean, pData, nSize); }
+inline void Reader::Read(Null& null, const char* pData, size_t nSize)              { Read_i(null, pData, nSize); }
+inline void Reader::Read(UnknownElement& unknown, const char* pData, size_t nSize) { Read_i(unknown, pData, nSize); }
+
 
 template <typename ElementTypeT>   
 void Reader::Read_i(ElementTypeT& element, std::istream& istr)
 {
-   Reader reader;
+   // pull the whole document out of the stream in blocks, then parse it in place
+   std::string sDocument;
+   char buffer[4096];
+   while (istr.read(buffer, sizeof(buffer)), istr.gcount() > 0)
+      sDocument.append(buffer, (size_t)istr.gcount());
+   istr.clear(std::ios::eofbit); // we read up to the end of the stream, which isn't a failure
+
+   Read_i(element, sDocument.data(), sDocument.size());
+}
 
-   Tokens tokens;
-   InputStream inputStream(istr);
-   reader.Scan(tokens, inputStream);
 
-   TokenStream tokenStream(tokens);
-   reader.Parse(element, tokenStream);
+template <typename ElementTypeT>   
+void Reader::Read_i(ElementTypeT& element, const char* pData, size_t nSize)
+{
+   Reader reader(pData, pData + nSize);
+   reader.EatWhiteSpace();
+   reader.Parse(element);
 
-   if (tokenStream.EOS() == false)
+   reader.EatWhiteSpace();
+   if (reader.m_pCurrent != reader.m_pEnd)
    {
-      const Token& token = tokenStream.Peek();
-      std::string sMessage = std::string("Expected End of token stream; found ") + token.GetStrValue();
-      throw ParseException(sMessage, token.locBegin, token.locEnd);
+      std::string sMessage = std::string("Expected end of document; found ") + *reader.m_pCurrent;
+      reader.ThrowParse(sMessage, reader.m_pCurrent);
    }
 }
 
 
-inline void Reader::Scan(Tokens& tokens, InputStream& inputStream)
+inline void Reader::EatWhiteSpace()
 {
-   while (EatWhiteSpace(inputStream),              // ignore any leading white space...
-          inputStream.EOS() == false) // ...before checking for EOS
+   m_pCurrent = Detail::SkipWhiteSpace(m_pCurrent, m_pEnd);
+}
+
+inline char Reader::Peek()
+{
+   if (m_pCurrent == m_pEnd)
+      ThrowParse("Unexpected end of document", m_pCurrent);
+   return *m_pCurrent;
+}
+
+inline void Reader::MatchExpectedChar(char cExpected)
+{
+   if (Peek() != cExpected)
    {
-      // if all goes well, we'll create a token each pass
-      Token token;
-      token.locBegin = inputStream.GetLocation();
+      std::string sMessage = std::string("Unexpected token: ") + *m_pCurrent;
+      ThrowParse(sMessage, m_pCurrent);
+   }
+   ++m_pCurrent;
+}
 
-      // gives us null-terminated string
-      char sChar = inputStream.Peek();
-      switch (sChar)
+inline void Reader::MatchExpectedString(const char* sExpected)
+{
+   for (const char* it = sExpected; *it != '\0'; ++it) {
+      if (m_pCurrent == m_pEnd ||   // did we reach the end before finding what we're looking for...
+          *m_pCurrent != *it)       // ...or did we find something different?
       {
-         case '{':
-            token.SetStrValue(inputStream.Get());
-            token.nType = Token::TOKEN_OBJECT_BEGIN;
-            break;
-
-         case '}':
-            token.SetStrValue(inputStream.Get());
-            token.nType = Token::TOKEN_OBJECT_END;
-            break;
+         std::string sMessage = std::string("Expected string: ") + sExpected;
+         ThrowScan(sMessage);
+      }
+      ++m_pCurrent;
+   }
+}
 
-         case '[':
-            token.SetStrValue(inputStream.Get());
-            token.nType = Token::TOKEN_ARRAY_BEGIN;
-            break;
 
-         case ']':
-            token.SetStrValue(inputStream.Get());
-            token.nType = Token::TOKEN_ARRAY_END;
-            break;
+inline void Reader::MatchString(std::string& string)
+{
+   if (m_pCurrent == m_pEnd || *m_pCurrent != '"')
+      ThrowScan("Expected quotation mark: \"");
+   ++m_pCurrent;
 
-         case ',':
-            token.SetStrValue(inputStream.Get());
-            token.nType = Token::TOKEN_NEXT_ELEMENT;
+   string.clear();
+   for (;;)
+   {
+      // copy everything up to the next quote or escape in one go
+      const char* pRun = m_pCurrent;
+      m_pCurrent = Detail::FindStringSpecial(m_pCurrent, m_pEnd);
+      while (m_pCurrent != m_pEnd && *m_pCurrent == '\n') // (line breaks don't matter here)
+         m_pCurrent = Detail::FindStringSpecial(m_pCurrent + 1, m_pEnd);
+      string.append(pRun, m_pCurrent);
+
+      if (m_pCurrent == m_pEnd)
+         break;
+      if (*m_pCurrent++ == '"')
+         return; // we have reached the closing quote
+      if (m_pCurrent == m_pEnd)
+         break; // shouldn't have reached the end yet
+
+      // escape
+      const char c = *m_pCurrent++;
+      switch (c) {
+         case '/':      string.push_back('/');     break;
+         case '"':      string.push_back('"');     break;
+         case '\\':     string.push_back('\\');    break;
+         case 'b':      string.push_back('\b');    break;
+         case 'f':      string.push_back('\f');    break;
+         case 'n':      string.push_back('\n');    break;
+         case 'r':      string.push_back('\r');    break;
+         case 't':      string.push_back('\t');    break;
+         case 'u':
+         {
+            // Unicode parsing:
+            if (m_pEnd - m_pCurrent < 4)
+               ThrowScan("Unable to parse unicode escape");
+            int val = 0;
+            for (int i = 0; i < 4; i++)
+            {
+               const char h = *m_pCurrent++;
+               val <<= 4;
+               if (h >= '0' && h <= '9')      val |= h - '0';
+               else if (h >= 'a' && h <= 'f') val |= h - 'a' + 10;
+               else if (h >= 'A' && h <= 'F') val |= h - 'A' + 10;
+               else ThrowScan("Unable to parse unicode escape");
+            }
+            // Convert from UTF-16 to UTF-8:
+            if (0xD800 <= val && val <= 0xDBFF)
+               ThrowScan("Unicode escape sequence is outside of supported range.");
+            if (val <= 0x7F) { string.push_back((char)val); }
+            else if (val <= 0x7FF) { string.push_back(char(0xC0 | ((val>>6) & 0x1F))); string.push_back(char(0x80 | (val & 0x3F))); }
+            else { string.push_back(char(0xE0 | ((val>>12) & 0x0F))); string.push_back(char(0x80 | ((val>>6) & 0x3F))); string.push_back(char(0x80 | (val & 0x3F))); }
             break;
+         }
+         default: {
+            std::string sMessage = std::string("Unrecognized escape sequence found in string: \\") + c;
+            ThrowScan(sMessage);
+         }
+      }
+   }
 
-         case ':':
-            token.SetStrValue(inputStream.Get());
-            token.nType = Token::TOKEN_MEMBER_ASSIGN;
-            break;
+   ThrowScan("Expected quotation mark \" before end of stream.");
+}
 
-         case '"':
-            token.SetStrValue(MatchString(inputStream).c_str());
-            token.nType = Token::TOKEN_STRING;
-            break;
 
-         case '-':
-         case '0':
-         case '1':
-         case '2':
-         case '3':
-         case '4':
-         case '5':
-         case '6':
-         case '7':
-         case '8':
-         case '9':
-            token.SetStrValue(MatchNumber(inputStream).c_str());
-            token.nType = Token::TOKEN_NUMBER;
-            break;
+inline void Reader::Parse(UnknownElement& element) 
+{
+   const char c = Peek();
+   switch (c) {
+      case '{':
+      {
+         // performs conversion for us (if necessary)
+         Object& object = element.Modify_i<Object>();
+         Parse(object);
+         break;
+      }
 
-         case 't':
-            token.SetStrValue(MatchExpectedString(inputStream, "true"));
-            token.nType = Token::TOKEN_BOOLEAN;
-            break;
+      case '[':
+      {
+         Array& array = element.Modify_i<Array>();
+         Parse(array);
+         break;
+      }
 
-         case 'f':
-            token.SetStrValue(MatchExpectedString(inputStream, "false"));
-            token.nType = Token::TOKEN_BOOLEAN;
-            break;
+      case '"':
+      {
+         String& string = element.Modify_i<String>();
+         Parse(string);
+         break;
+      }
 
-         case 'n':
-            ;
-            token.SetStrValue(MatchExpectedString(inputStream, "null"));
-            token.nType = Token::TOKEN_NULL;
-            break;
+      case '-':
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+      {
+         Number& number = element;
+         Parse(number);
+         break;
+      }
 
-         default:
-         {
-            std::string sErrorMessage = std::string("Unexpected character in stream: ") + sChar;
-            throw ScanException(sErrorMessage, inputStream.GetLocation());
-         }
+      case 't':
+      case 'f':
+      {
+         Boolean& boolean = element;
+         Parse(boolean);
+         break;
+      }
+
+      case 'n':
+      {
+         Null& null = element;
+         Parse(null);
+         break;
       }
 
-      token.locEnd = inputStream.GetLocation();
-      tokens.push_back(token);
+      default:
+      {
+         std::string sErrorMessage = std::string("Unexpected character in stream: ") + c;
+         ThrowScan(sErrorMessage);
+      }
    }
 }
 
 
-inline void Reader::EatWhiteSpace(InputStream& inputStream)
+inline void Reader::Parse(Object& object)
 {
-   while (inputStream.EOS() == false && 
-          ::isspace(inputStream.Peek()))
-      inputStream.Get();
-}
+   MatchExpectedChar('{');
+   EatWhiteSpace();
+   if (Peek() == '}')
+   {
+      ++m_pCurrent;
+      return;
+   }
 
-inline const char* Reader::MatchExpectedString(InputStream& inputStream, const char* sExpected)
-{
-   for (const char* it = sExpected; *it != '\0'; ++it) {
-      if (inputStream.EOS() ||      // did we reach the end before finding what we're looking for...
-          inputStream.Get() != *it) // ...or did we find something different?
+   std::string sName;
+   for (;;)
+   {
+      // first the member name. remember where it was in case we have to throw an exception
+      const char* pName = m_pCurrent;
+      if (Peek() != '"')
+         ThrowParse(std::string("Unexpected token: ") + *m_pCurrent, m_pCurrent);
+      MatchString(sName);
+
+      // ...then the key/value separator...
+      EatWhiteSpace();
+      MatchExpectedChar(':');
+      EatWhiteSpace();
+
+      // ...then the value itself (can be anything), which is parsed straight into the
+      //  new member rather than being copied in afterwards
+      Object::iterator itMember;
+      try
       {
-         std::string sMessage = std::string("Expected string: ") + sExpected;
-         throw ScanException(sMessage, inputStream.GetLocation());
+         itMember = object.Insert(Object::Member(sName));
+      }
+      catch (Exception&)
+      {
+         // must be a duplicate name
+         std::string sMessage = std::string("Duplicate object member token: ") + sName; 
+         ThrowParse(sMessage, pName);
       }
+      Parse(itMember->element);
+
+      EatWhiteSpace();
+      if (Peek() != ',')
+         break;
+      ++m_pCurrent;
+      EatWhiteSpace();
    }
-   // all's well if we made it here
-   return sExpected;
+
+   MatchExpectedChar('}');
 }
 
 
-inline std::string Reader::MatchString(InputStream& inputStream)
+inline void Reader::Parse(Array& array)
 {
-   //MatchExpectedString(inputStream, "\"");
-   if (inputStream.EOS() || inputStream.Get() != '"')
+   MatchExpectedChar('[');
+   EatWhiteSpace();
+   if (Peek() == ']')
    {
-      throw ScanException("Expected quotation mark: \"", inputStream.GetLocation());
+      ++m_pCurrent;
+      return;
    }
 
-   std::string string;
-   while (inputStream.EOS() == false)
+   // the elements are parsed into this level's pending buffer first. (nested arrays use the
+   //  next level's, which may move this buffer, but not the elements in it)
+   const size_t nDepth = m_nArrayDepth++;
+   if (m_Pending.size() <= nDepth)
+      m_Pending.resize(nDepth + 1);
+   for (;;)
    {
-      char c = inputStream.Get();
+      // ...what's next? could be anything
+      m_Pending[nDepth].push_back(UnknownElement());
+      Parse(m_Pending[nDepth].back());
 
-      // escape?
-      if (c == '\\' &&
-          inputStream.EOS() == false) // shouldn't have reached the end yet
-      {
-         c = inputStream.Get();
-         switch (c) {
-            case '/':      string.push_back('/');     break;
-            case '"':      string.push_back('"');     break;
-            case '\\':     string.push_back('\\');    break;
-            case 'b':      string.push_back('\b');    break;
-            case 'f':      string.push_back('\f');    break;
-            case 'n':      string.push_back('\n');    break;
-            case 'r':      string.push_back('\r');    break;
-            case 't':      string.push_back('\t');    break;
-            case 'u':
-			   // Unicode parsing:
-			   char hex[5];
-			   int val;
-			   for (int i=0;i<4 && !inputStream.EOS();i++)
-				  hex[i] = inputStream.Get();
-			   hex[4] = '\0';
-			   if (sscanf(hex, "%4x", &val) != 1)
-			      throw ScanException("Unable to parse unicode escape", inputStream.GetLocation());
-			   // Convert from UTF-16 to UTF-8:
-			   if (0xD800 <= val && val <= 0xDBFF)
-			      throw ScanException("Unicode escape sequence is outside of supported range.", inputStream.GetLocation());
-			   if (val <= 0x7F) { string.push_back((char)val); }
-			   else if (val <= 0x7FF) { string.push_back(char(0xC0 | ((val>>6) & 0x1F))); string.push_back(char(0x80 | (val & 0x3F))); }
-			   else if (val <= 0xFFFF) { string.push_back(char(0xE0 | ((val>>12) & 0x0F))); string.push_back(char(0x80 | ((val>>6) & 0x3F))); string.push_back(char(0x80 | (val & 0x3F))); }
-			   break;
-            default: {
-               std::string sMessage = std::string("Unrecognized escape sequence found in string: \\") + c;
-               throw ScanException(sMessage, inputStream.GetLocation());
-            }
-         }
-      } else if (c == '"') {
-         // We have reached the closing quote
-         return string;
-      } else {
-         string.push_back(c);
-      }
+      EatWhiteSpace();
+      if (Peek() != ',')
+         break;
+      ++m_pCurrent;
+      EatWhiteSpace();
    }
 
-   // We should not get here.
-   throw ScanException("Expected quotation mark \" before end of stream.", inputStream.GetLocation());
+   MatchExpectedChar(']');
+   --m_nArrayDepth;
+
+   std::vector<UnknownElement>& pending = m_Pending[nDepth];
+   array.Reserve(array.Size() + pending.size());
+   for (std::vector<UnknownElement>::iterator it = pending.begin(); it != pending.end(); ++it)
+      array.Insert(std::move(*it));
+   pending.clear();
 }
 
 
-inline std::string Reader::MatchNumber(InputStream& inputStream)
+inline void Reader::Parse(String& string)
 {
-   static const char sNumericChars[] = "0123456789.eE-+";
-   static const char* end = sNumericChars + sizeof(sNumericChars)/sizeof(char);
+   MatchString(string.Value());
+}
+
 
-   std::string sNumber;
-   while (inputStream.EOS() == false &&
-          std::find(sNumericChars, end, inputStream.Peek()) != end)
+inline void Reader::Parse(Number& number)
+{
+   // "0123456789.eE-+"
+   const char* pBegin = m_pCurrent;
+   while (m_pCurrent != m_pEnd &&
+          ((*m_pCurrent >= '0' && *m_pCurrent <= '9') || *m_pCurrent == '.' || *m_pCurrent == 'e' || *m_pCurrent == 'E' || *m_pCurrent == '-' || *m_pCurrent == '+'))
+      ++m_pCurrent;
+   if (m_pCurrent == pBegin)
+   {
+      std::string sMessage = std::string("Unexpected token: ") + Peek();
+      ThrowParse(sMessage, pBegin);
+   }
+
+   // ParseNumber() needs a null-terminated string; numbers are short, so use the stack
+   char sValueBuffer[64];
+   std::string sLongValue;
+   const char* sValue = sValueBuffer;
+   const size_t nLength = m_pCurrent - pBegin;
+   if (nLength < sizeof(sValueBuffer))
+   {
+      memcpy(sValueBuffer, pBegin, nLength);
+      sValueBuffer[nLength] = '\0';
+   }
+   else
    {
-      sNumber.push_back(inputStream.Get());
+      sLongValue.assign(pBegin, nLength);
+      sValue = sLongValue.c_str();
    }
 
-   return sNumber;
+   long long nValue;
+   double dValue;
+   if (ParseInteger(sValue, nValue))
+      number = Number::FromInteger(nValue);
+   else if (ParseNumber(sValue, dValue))
+      number = dValue;
+   else
+   {
+      std::string sMessage = std::string("Unexpected character in NUMBER token: ") + sValue;
+      ThrowParse(sMessage, pBegin);
+   }
 }
 
 
-inline void Reader::Parse(UnknownElement& element, Reader::TokenStream& tokenStream) 
+inline bool Reader::ParseInteger(const char* sValue, long long& result)
 {
-   const Token& token = tokenStream.Peek();
-   switch (token.nType) {
-      case Token::TOKEN_OBJECT_BEGIN:
-      {
-         // implicit non-const cast will perform conversion for us (if necessary)
-         Object& object = element;
-         Parse(object, tokenStream);
-         break;
-      }
+   const bool bNegative = (*sValue == '-');
+   if (bNegative)
+      ++sValue;
+   if (*sValue < '0' || *sValue > '9')
+      return false;
+   // accumulate as a negative number, so that the most negative long long fits too
+   const long long nMin = -9223372036854775807LL - 1;
+   long long nValue = 0;
+   for (; *sValue >= '0' && *sValue <= '9'; ++sValue)
+   {
+      const int nDigit = *sValue - '0';
+      if (nValue < (nMin + nDigit) / 10)
+         return false; // too big
+      nValue = nValue * 10 - nDigit;
+   }
+   if (*sValue != '\0' || (!bNegative && nValue == nMin))
+      return false;
+   if (bNegative && nValue == 0)
+      return false; // "-0" is left to ParseNumber(), as an integer would lose the sign
+   result = bNegative ? nValue : -nValue;
+   return true;
+}
+
 
-      case Token::TOKEN_ARRAY_BEGIN:
+inline bool Reader::ParseNumber(const char* sValue, double& result)
+{
+   // istringstream double parsing is terribly slow, so try to parse the number ourselves.
+   //  up to 19 significant digits are gathered as an integer; if that is exact in a double
+   //  (< 2^53) and the power of ten is small enough to be too (10^22), a single multiply 
+   //  or divide gives the correctly rounded result.
+   static const double s_dPowersOf10[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+   const char* p = sValue;
+   const bool bNegative = (*p == '-');
+   if (bNegative)
+      ++p;
+   unsigned long long nMantissa = 0;
+   int nDigits = 0;             // significant digits in nMantissa
+   int nExponent = 0;           // power of ten to apply to nMantissa
+   bool bTruncated = false;     // did we have to drop digits?
+   bool bAnyDigits = false;
+   for (; *p >= '0' && *p <= '9'; ++p, bAnyDigits = true)
+   {
+      if (nDigits < 19) {
+         nMantissa = nMantissa * 10 + (*p - '0');
+         if (nMantissa != 0)
+            ++nDigits;
+      }
+      else {
+         ++nExponent;
+         bTruncated |= (*p != '0');
+      }
+   }
+   if (*p == '.')
+   {
+      for (++p; *p >= '0' && *p <= '9'; ++p, bAnyDigits = true)
       {
-         Array& array = element;
-         Parse(array, tokenStream);
-         break;
+         if (nDigits < 19) {
+            nMantissa = nMantissa * 10 + (*p - '0');
+            if (nMantissa != 0)
+               ++nDigits;
+            --nExponent;
+         }
+         else {
+            bTruncated |= (*p != '0');
+         }
       }
+   }
+   if (bAnyDigits && (*p == 'e' || *p == 'E'))
+   {
+      ++p;
+      const bool bNegativeExponent = (*p == '-');
+      if (*p == '-' || *p == '+')
+         ++p;
+      int nExplicit = 0;
+      bool bExponentDigits = false;
+      for (; *p >= '0' && *p <= '9'; ++p, bExponentDigits = true)
+         if (nExplicit < 100000)
+            nExplicit = nExplicit * 10 + (*p - '0');
+      if (bExponentDigits == false)
+         return false;
+      nExponent += bNegativeExponent ? -nExplicit : nExplicit;
+   }
+   if (bAnyDigits && *p == '\0' && bTruncated == false && 
+       nMantissa <= (1ULL << 53) && nExponent >= -22 && nExponent <= 22)
+   {
+      double dValue = (double)nMantissa;
+      if (nExponent < 0)
+         dValue /= s_dPowersOf10[-nExponent];
+      else
+         dValue *= s_dPowersOf10[nExponent];
+      result = bNegative ? -dValue : dValue;
+      return true;
+   }
 
-      case Token::TOKEN_STRING:
+   // If we got here, the number has lots of digits or a large exponent (or is malformed).
+   // Let istringstream handle it (in the classic locale, so that '.' is the decimal point):
+   std::istringstream iStr(sValue);
+   iStr.imbue(std::locale::classic());
+   double dValue;
+   iStr >> dValue;
+
+   // did we consume all characters in the token?
+   if (iStr.fail() || iStr.eof() == false)
+      return false;
+
+   result = dValue;
+   return true;
+}
+
+
+inline void Reader::Parse(Boolean& boolean)
+{
+   if (Peek() == 't')
+   {
+      MatchExpectedString("true");
+      boolean = true;
+   }
+   else
+   {
+      MatchExpectedString("false");
+      boolean = false;
+   }
+}
+
+
+inline void Reader::Parse(Null&)
+{
+   MatchExpectedString("null");
+}
+
+
+inline void Reader::Skip()
+{
+   const char c = Peek();
+   if (c == '{' || c == '[')
+   {
+      const char cEnd = (c == '{') ? '}' : ']';
+      ++m_pCurrent;
+      EatWhiteSpace();
+      if (Peek() == cEnd)
       {
-         String& string = element;
-         Parse(string, tokenStream);
-         break;
+         ++m_pCurrent;
+         return;
       }
-
-      case Token::TOKEN_NUMBER:
+      for (;;)
       {
-         Number& number = element;
-         Parse(number, tokenStream);
-         break;
+         if (c == '{')
+         {
+            if (Peek() != '"')
+               ThrowParse(std::string("Unexpected token: ") + *m_pCurrent, m_pCurrent);
+            SkipString();
+            EatWhiteSpace();
+            MatchExpectedChar(':');
+            EatWhiteSpace();
+         }
+         Skip();
+         EatWhiteSpace();
+         if (Peek() != ',')
+            break;
+         ++m_pCurrent;
+         EatWhiteSpace();
       }
+      MatchExpectedChar(cEnd);
+   }
+   else if (c == '"')
+      SkipString();
+   else if (c == 't')
+      MatchExpectedString("true");
+   else if (c == 'f')
+      MatchExpectedString("false");
+   else if (c == 'n')
+      MatchExpectedString("null");
+   else if (c == '-' || (c >= '0' && c <= '9'))
+   {
+      while (m_pCurrent != m_pEnd &&
+             ((*m_pCurrent >= '0' && *m_pCurrent <= '9') || *m_pCurrent == '.' || *m_pCurrent == 'e' || *m_pCurrent == 'E' || *m_pCurrent == '-' || *m_pCurrent == '+'))
+         ++m_pCurrent;
+   }
+   else
+      ThrowScan(std::string("Unexpected character in stream: ") + c);
+}
+
 
-      case Token::TOKEN_BOOLEAN:
+inline void Reader::SkipString()
+{
+   ++m_pCurrent; // (the opening quote)
+   for (;;)
+   {
+      m_pCurrent = Detail::FindStringSpecial(m_pCurrent, m_pEnd);
+      if (m_pCurrent == m_pEnd)
+         ThrowScan("Expected quotation mark \" before end of stream.");
+      const char c = *m_pCurrent++;
+      if (c == '"')
+         return;
+      if (c == '\\')
       {
-         Boolean& boolean = element;
-         Parse(boolean, tokenStream);
-         break;
+         if (m_pCurrent == m_pEnd)
+            ThrowScan("Expected quotation mark \" before end of stream.");
+         ++m_pCurrent;
       }
+   }
+}
 
-      case Token::TOKEN_NULL:
+
+inline void Reader::MatchName(const char*& pName, size_t& nSize)
+{
+   if (m_pCurrent != m_pEnd && *m_pCurrent == '"')
+   {
+      const char* pClose = Detail::FindStringSpecial(m_pCurrent + 1, m_pEnd);
+      if (pClose != m_pEnd && *pClose == '"')
       {
-         Null& null = element;
-         Parse(null, tokenStream);
-         break;
+         pName = m_pCurrent + 1;
+         nSize = pClose - pName;
+         m_pCurrent = pClose + 1;
+         return;
       }
+   }
+   MatchString(m_sName);
+   pName = m_sName.data();
+   nSize = m_sName.size();
+}
 
-      default:
+
+inline Reader::Location Reader::GetLocation(const char* pWhere) const
+{
+   Location location;
+   const char* pLineBegin = m_pBegin;
+   for (const char* p = m_pBegin; p < pWhere; ++p)
+   {
+      if (*p == '\n')
       {
-         std::string sMessage = std::string("Unexpected token: ") + token.GetStrValue();
-         throw ParseException(sMessage, token.locBegin, token.locEnd);
+         ++location.m_nLine;
+         pLineBegin = p + 1;
       }
    }
+   location.m_nLineOffset = (unsigned int)(pWhere - pLineBegin);
+   location.m_nDocOffset = (unsigned int)(pWhere - m_pBegin);
+   return location;
 }
 
+inline void Reader::ThrowScan(const std::string& sMessage) const
+{
+   throw ScanException(sMessage, GetLocation(m_pCurrent));
+}
 
-inline void Reader::Parse(Object& object, Reader::TokenStream& tokenStream)
+inline void Reader::ThrowParse(const std::string& sMessage, const char* pTokenBegin) const
 {
-   MatchExpectedToken(Token::TOKEN_OBJECT_BEGIN, tokenStream);
+   throw ParseException(sMessage, GetLocation(pTokenBegin), GetLocation(m_pCurrent));
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Document - a root element whose whole tree lives in its own Arena, so that
+//  reading a document takes far fewer heap allocations, and Clear() (or the
+//  destructor) gives it all back in one go. Copying elements out of a 
+//  Document (outside of any Arena::Scope) makes ordinary heap copies.
+// Use GetArena() with an Arena::Scope to build or modify the tree in any 
+//  other way.
 
-   bool bContinue = (tokenStream.EOS() == false &&
-                     tokenStream.Peek().nType != Token::TOKEN_OBJECT_END);
-   while (bContinue)
+class Document
+{
+public:
+   explicit Document(size_t nBlockSize = 64 * 1024) : m_Arena(nBlockSize) {}
+   ~Document() { Clear(); }
+
+   void Read(const char* pData, size_t nSize)
+   {
+      Clear();
+      Arena::Scope scope(m_Arena);
+      Reader::Read(m_Root, pData, nSize);
+   }
+   void Read(std::istream& istr)
    {
-      Object::Member member;
+      Clear();
+      Arena::Scope scope(m_Arena);
+      Reader::Read(m_Root, istr);
+   }
+   void Clear()
+   {
+      m_Root = Null(); // (outside of the scope, so the new root comes from the heap)
+      m_Arena.Reset();
+   }
 
-      // first the member name. save the token in case we have to throw an exception
-      const Token& tokenName = tokenStream.Peek();
-      member.name = MatchExpectedToken(Token::TOKEN_STRING, tokenStream);
+   UnknownElement& Root() { return m_Root; }
+   const UnknownElement& Root() const { return m_Root; }
+   Arena& GetArena() { return m_Arena; }
 
-      // ...then the key/value separator...
-      MatchExpectedToken(Token::TOKEN_MEMBER_ASSIGN, tokenStream);
+private:
+   Arena m_Arena;
+   UnknownElement m_Root; // after m_Arena, so that it is destroyed first
 
-      // ...then the value itself (can be anything).
-      Parse(member.element, tokenStream);
+   Document(const Document&);
+   Document& operator = (const Document&);
+};
 
-      // try adding it to the object (this could throw)
-      try
-      {
-         object.Insert(member);
-      }
-      catch (Exception&)
-      {
-         // must be a duplicate name
-         std::string sMessage = std::string("Duplicate object member token: ") + member.name; 
-         throw ParseException(sMessage, tokenName.locBegin, tokenName.locEnd);
-      }
 
-      bContinue = (tokenStream.EOS() == false &&
-                   tokenStream.Peek().nType == Token::TOKEN_NEXT_ELEMENT);
-      if (bContinue)
-         MatchExpectedToken(Token::TOKEN_NEXT_ELEMENT, tokenStream);
-   }
+/////////////////////////////////////////////////////////////////////////////////
+// SaxHandler - receives the contents of a document as a stream of events, as
+//  they are parsed by PushParser. Member names are reported via Key(), just
+//  before the member's value.
+
+class SaxHandler
+{
+public:
+   virtual ~SaxHandler() {}
+
+   virtual void ObjectBegin() = 0;
+   virtual void ObjectEnd() = 0;
+   virtual void ArrayBegin() = 0;
+   virtual void ArrayEnd() = 0;
+   virtual void Key(const std::string& name) = 0;
+   virtual void Value(const std::string& string) = 0;
+   virtual void Value(double number) = 0;
+   virtual void Value(bool boolean) = 0;
+   virtual void NullValue() = 0;
+   // numbers that are plain integers (see Reader::ParseInteger()) are reported here instead
+   virtual void IntegerValue(long long number) { Value((double)number); }
+   // sources that know how many elements an array has (e.g. ReplayTape()) report it here,
+   //  straight after ArrayBegin()
+   virtual void ArraySize(size_t /*nElements*/) {}
+};
 
-   MatchExpectedToken(Token::TOKEN_OBJECT_END, tokenStream);
-}
 
+/////////////////////////////////////////////////////////////////////////////////
+// PushParser - an incremental parser. Unlike Reader, which needs the entire
+//  document up front, the document can be fed to PushParser in chunks of any
+//  size as they arrive (e.g. from the network). Each element is reported to
+//  the SaxHandler as soon as it is complete. Throws Reader::ScanException or 
+//  Reader::ParseException on malformed input, like Reader does.
 
-inline void Reader::Parse(Array& array, Reader::TokenStream& tokenStream)
+class PushParser
 {
-   MatchExpectedToken(Token::TOKEN_ARRAY_BEGIN, tokenStream);
+public:
+   PushParser(SaxHandler& handler);
+
+   // parse the next chunk of the document
+   void Feed(const char* pData, size_t nSize);
+   // call after the last chunk; throws if the document is incomplete
+   void Finish();
 
-   bool bContinue = (tokenStream.EOS() == false &&
-                     tokenStream.Peek().nType != Token::TOKEN_ARRAY_END);
-   while (bContinue)
+   // true once a complete document has been parsed
+   bool Done() const { return m_nState == STATE_DONE; }
+
+private:
+   enum State
    {
-      // ...what's next? could be anything
-      Array::iterator itElement = array.Insert(UnknownElement());
-      UnknownElement& element = *itElement;
-      Parse(element, tokenStream);
+      STATE_VALUE,               // expecting a value
+      STATE_ARRAY_VALUE_OR_END,  // just after '['
+      STATE_KEY_OR_OBJECT_END,   // just after '{'
+      STATE_KEY,                 // expecting a member name
+      STATE_MEMBER_ASSIGN,       // expecting ':'
+      STATE_AFTER_VALUE,         // expecting ',' or the end of the current object/array
+      STATE_DONE,                // the root element is complete; only white space may follow
+   };
 
-      bContinue = (tokenStream.EOS() == false &&
-                   tokenStream.Peek().nType == Token::TOKEN_NEXT_ELEMENT);
-      if (bContinue)
-         MatchExpectedToken(Token::TOKEN_NEXT_ELEMENT, tokenStream);
-   }
+   enum Lex
+   {
+      LEX_NONE,
+      LEX_STRING,
+      LEX_STRING_ESCAPE,
+      LEX_STRING_UNICODE,
+      LEX_NUMBER,
+      LEX_LITERAL,               // true, false or null
+   };
+
+   void Structural(char c);
+   void BeginValue(char c);
+   void ValueDone();
+   void EndContainer(char cContainer);
+   void StringDone();
+   void NumberDone();
+   void LiteralDone();
+   void NewLine(); // at m_pCurrent
+   // where m_pCurrent is in the document, worked out only when it's needed
+   Reader::Location GetLocation() const;
+   void ThrowScan(const std::string& sMessage) const { throw Reader::ScanException(sMessage, GetLocation()); }
+   void ThrowParse(const std::string& sMessage) const { throw Reader::ParseException(sMessage, m_locTokenBegin, GetLocation()); }
+
+   SaxHandler& m_Handler;
+   State m_nState;
+   Lex m_nLex;
+   bool m_bKey;                  // is the string being scanned a member name?
+   std::vector<char> m_Stack;    // '{' or '[' for each open container
+   std::string m_sToken;         // the string or number being scanned
+   const char* m_sLiteral;       // the literal being matched...
+   size_t m_nLiteralPos;         // ...and how much of it we have matched
+   char m_sHex[5];               // \uXXXX escape being scanned
+   int m_nHexPos;
+   // rather than counting every character, only line breaks are counted, and offsets come
+   //  from how far into the chunk we are
+   const char* m_pChunk;         // the chunk being fed, or where the last one ended
+   const char* m_pCurrent;       // the character being scanned in it
+   size_t m_nChunkOffset;        // the document offset of m_pChunk
+   unsigned int m_nLine;         // line breaks so far
+   size_t m_nLineStart;          // the document offset just after the last one
+   Reader::Location m_locTokenBegin;
+};
 
-   MatchExpectedToken(Token::TOKEN_ARRAY_END, tokenStream);
-}
 
+inline PushParser::PushParser(SaxHandler& handler) :
+   m_Handler(handler),
+   m_nState(STATE_VALUE),
+   m_nLex(LEX_NONE),
+   m_bKey(false),
+   m_sLiteral(0),
+   m_nLiteralPos(0),
+   m_nHexPos(0),
+   m_pChunk(NULL),
+   m_pCurrent(NULL),
+   m_nChunkOffset(0),
+   m_nLine(0),
+   m_nLineStart(0)
+{}
 
-inline void Reader::Parse(String& string, Reader::TokenStream& tokenStream)
+inline void PushParser::NewLine()
 {
-   string = std::string(MatchExpectedToken(Token::TOKEN_STRING, tokenStream));
+   ++m_nLine;
+   m_nLineStart = m_nChunkOffset + (m_pCurrent - m_pChunk) + 1;
 }
 
+inline Reader::Location PushParser::GetLocation() const
+{
+   const size_t nOffset = m_nChunkOffset + (m_pCurrent - m_pChunk);
+   Reader::Location location;
+   location.m_nLine = m_nLine;
+   location.m_nLineOffset = (unsigned int)(nOffset - m_nLineStart);
+   location.m_nDocOffset = (unsigned int)nOffset;
+   return location;
+}
 
-inline void Reader::Parse(Number& number, Reader::TokenStream& tokenStream)
+inline void PushParser::Feed(const char* pData, size_t nSize)
 {
-   const Token& currentToken = tokenStream.Peek(); // might need this later for throwing exception
-   const char* sValue = MatchExpectedToken(Token::TOKEN_NUMBER, tokenStream);
+   m_pChunk = pData;
+   const char* pEnd = pData + nSize;
+   // (m_pCurrent is only kept up to date where something might need the location)
+   for (const char* p = pData; p != pEnd; ++p)
+   {
+      const char c = *p;
+      switch (m_nLex)
+      {
+         case LEX_STRING:
+            if (c == '"')
+            {
+               m_pCurrent = p;
+               StringDone();
+            }
+            else if (c == '\\')
+               m_nLex = LEX_STRING_ESCAPE;
+            else if (c == '\n')
+            {
+               m_sToken.push_back(c);
+               m_pCurrent = p;
+               NewLine();
+            }
+            else
+            {
+               // copy the whole run of plain characters in one go
+               const char* pRun = Detail::FindStringSpecial(p + 1, pEnd);
+               m_sToken.append(p, pRun);
+               p = pRun - 1;
+            }
+            break;
 
-   // istringstream double parsing is terribly slow, so try to parse the number ourselves:
-   int sign = 1;
-   double value = 0;
-   if (*sValue == '-') {
-      sign = -1;
-      sValue++;
-   }
-   while (*sValue >= '0' && *sValue <= '9')
-      value = value*10 + (*sValue++ - '0');
-   if (*sValue == '.') {
-      // Parse the part after the decimal point:
-      long double decimal = 0;
-      long double order = 0.1;
-      sValue++;
-      while (*sValue >= '0' && *sValue <= '9') {
-         decimal += (*sValue++ - '0')*order;
-         order *= 0.1;
-      }
-      if (*sValue == '\0') {
-         // We parsed the whole number.
-         number = sign * (value + decimal);
-         return;
+         case LEX_STRING_ESCAPE:
+            m_pCurrent = p;
+            m_nLex = LEX_STRING;
+            switch (c) {
+               case '/':      m_sToken.push_back('/');     break;
+               case '"':      m_sToken.push_back('"');     break;
+               case '\\':     m_sToken.push_back('\\');    break;
+               case 'b':      m_sToken.push_back('\b');    break;
+               case 'f':      m_sToken.push_back('\f');    break;
+               case 'n':      m_sToken.push_back('\n');    break;
+               case 'r':      m_sToken.push_back('\r');    break;
+               case 't':      m_sToken.push_back('\t');    break;
+               case 'u':      m_nLex = LEX_STRING_UNICODE; m_nHexPos = 0; break;
+               default:
+                  ThrowScan(std::string("Unrecognized escape sequence found in string: \\") + c);
+            }
+            break;
+
+         case LEX_STRING_UNICODE:
+         {
+            m_pCurrent = p;
+            m_sHex[m_nHexPos++] = c;
+            if (m_nHexPos < 4)
+               break;
+            m_sHex[4] = '\0';
+            m_nLex = LEX_STRING;
+            int val;
+            if (sscanf(m_sHex, "%4x", &val) != 1)
+               ThrowScan("Unable to parse unicode escape");
+            // Convert from UTF-16 to UTF-8 (same as Reader::MatchString):
+            if (0xD800 <= val && val <= 0xDBFF)
+               ThrowScan("Unicode escape sequence is outside of supported range.");
+            if (val <= 0x7F) { m_sToken.push_back((char)val); }
+            else if (val <= 0x7FF) { m_sToken.push_back(char(0xC0 | ((val>>6) & 0x1F))); m_sToken.push_back(char(0x80 | (val & 0x3F))); }
+            else { m_sToken.push_back(char(0xE0 | ((val>>12) & 0x0F))); m_sToken.push_back(char(0x80 | ((val>>6) & 0x3F))); m_sToken.push_back(char(0x80 | (val & 0x3F))); }
+            break;
+         }
+
+         case LEX_NUMBER:
+            if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '-' || c == '+') {
+               m_sToken.push_back(c);
+               break;
+            }
+            // the number ended with the previous character; this one is structural
+            m_pCurrent = p;
+            NumberDone();
+            Structural(c);
+            break;
+
+         case LEX_LITERAL:
+            m_pCurrent = p;
+            if (c != m_sLiteral[m_nLiteralPos])
+               ThrowScan(std::string("Expected string: ") + m_sLiteral);
+            if (m_sLiteral[++m_nLiteralPos] == '\0')
+               LiteralDone();
+            break;
+
+         case LEX_NONE:
+            // plain white space needs no more than this
+            if (c == ' ' || c == '\t' || c == '\r')
+               break;
+            m_pCurrent = p;
+            Structural(c);
+            break;
       }
-   } else if (*sValue == '\0') {
-      // We parsed the whole number.
-      number = sign * value;
+   }
+   m_nChunkOffset += nSize;
+   m_pChunk = m_pCurrent = pEnd;
+}
+
+inline void PushParser::Finish()
+{
+   if (m_nLex == LEX_NUMBER)
+      NumberDone(); // a number at the very end of the document has nothing after it to end it
+   if (m_nLex != LEX_NONE)
+      ThrowScan("Unexpected end of stream");
+   if (m_nState != STATE_DONE)
+      ThrowParse("Unexpected end of token stream");
+}
+
+inline void PushParser::Structural(char c)
+{
+   if (::isspace(c))
+   {
+      if (c == '\n')
+         NewLine();
       return;
    }
+   m_locTokenBegin = GetLocation();
 
-   // If we got here, the number is likely in scientific notation.
-   // Let's just let istringstream handle it:
-   std::istringstream iStr(sValue);
-   double dValue;
-   iStr >> dValue;
+   switch (m_nState)
+   {
+      case STATE_ARRAY_VALUE_OR_END:
+         if (c == ']') {
+            EndContainer('[');
+            break;
+         }
+         // fall through: anything else must be the first value
+      case STATE_VALUE:
+         BeginValue(c);
+         break;
 
-   // did we consume all characters in the token?
-   if (iStr.eof() == false)
+      case STATE_KEY_OR_OBJECT_END:
+         if (c == '}') {
+            EndContainer('{');
+            break;
+         }
+         // fall through: anything else must be the first member name
+      case STATE_KEY:
+         if (c != '"')
+            ThrowParse(std::string("Unexpected token: ") + c);
+         m_bKey = true;
+         m_sToken.clear();
+         m_nLex = LEX_STRING;
+         break;
+
+      case STATE_MEMBER_ASSIGN:
+         if (c != ':')
+            ThrowParse(std::string("Unexpected token: ") + c);
+         m_nState = STATE_VALUE;
+         break;
+
+      case STATE_AFTER_VALUE:
+         if (c == ',')
+            m_nState = (m_Stack.back() == '{' ? STATE_KEY : STATE_VALUE);
+         else if (c == '}' && m_Stack.back() == '{')
+            EndContainer('{');
+         else if (c == ']' && m_Stack.back() == '[')
+            EndContainer('[');
+         else
+            ThrowParse(std::string("Unexpected token: ") + c);
+         break;
+
+      case STATE_DONE:
+         ThrowParse(std::string("Expected End of token stream; found ") + c);
+   }
+}
+
+inline void PushParser::BeginValue(char c)
+{
+   switch (c)
    {
-      char c = iStr.peek();
-      std::string sMessage = std::string("Unexpected character in NUMBER token: ") + c;
-      throw ParseException(sMessage, currentToken.locBegin, currentToken.locEnd);
+      case '{':
+         m_Stack.push_back('{');
+         m_nState = STATE_KEY_OR_OBJECT_END;
+         m_Handler.ObjectBegin();
+         break;
+
+      case '[':
+         m_Stack.push_back('[');
+         m_nState = STATE_ARRAY_VALUE_OR_END;
+         m_Handler.ArrayBegin();
+         break;
+
+      case '"':
+         m_bKey = false;
+         m_sToken.clear();
+         m_nLex = LEX_STRING;
+         break;
+
+      case '-':
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+         m_sToken.assign(1, c);
+         m_nLex = LEX_NUMBER;
+         break;
+
+      case 't':
+      case 'f':
+      case 'n':
+         m_sLiteral = (c == 't' ? "true" : c == 'f' ? "false" : "null");
+         m_nLiteralPos = 1;
+         m_nLex = LEX_LITERAL;
+         break;
+
+      default:
+         ThrowScan(std::string("Unexpected character in stream: ") + c);
    }
+}
 
-   number = dValue;
+inline void PushParser::ValueDone()
+{
+   m_nState = (m_Stack.empty() ? STATE_DONE : STATE_AFTER_VALUE);
 }
 
+inline void PushParser::EndContainer(char cContainer)
+{
+   m_Stack.pop_back();
+   if (cContainer == '{')
+      m_Handler.ObjectEnd();
+   else
+      m_Handler.ArrayEnd();
+   ValueDone();
+}
 
-inline void Reader::Parse(Boolean& boolean, Reader::TokenStream& tokenStream)
+inline void PushParser::StringDone()
 {
-   const std::string sValue = MatchExpectedToken(Token::TOKEN_BOOLEAN, tokenStream);
-   boolean = (sValue == "true" ? true : false);
+   m_nLex = LEX_NONE;
+   if (m_bKey) {
+      m_Handler.Key(m_sToken);
+      m_nState = STATE_MEMBER_ASSIGN;
+   }
+   else {
+      m_Handler.Value(m_sToken);
+      ValueDone();
+   }
 }
 
+inline void PushParser::NumberDone()
+{
+   m_nLex = LEX_NONE;
+   long long nValue;
+   double dValue;
+   if (Reader::ParseInteger(m_sToken.c_str(), nValue))
+      m_Handler.IntegerValue(nValue);
+   else if (Reader::ParseNumber(m_sToken.c_str(), dValue))
+      m_Handler.Value(dValue);
+   else
+      ThrowParse(std::string("Unexpected character in NUMBER token: ") + m_sToken);
+   ValueDone();
+}
 
-inline void Reader::Parse(Null&, Reader::TokenStream& tokenStream)
+inline void PushParser::LiteralDone()
 {
-   MatchExpectedToken(Token::TOKEN_NULL, tokenStream);
+   m_nLex = LEX_NONE;
+   if (m_sLiteral[0] == 'n')
+      m_Handler.NullValue();
+   else
+      m_Handler.Value(m_sLiteral[0] == 't');
+   ValueDone();
 }
 
 
-inline const char* Reader::MatchExpectedToken(Token::Type nExpected, Reader::TokenStream& tokenStream)
+/////////////////////////////////////////////////////////////////////////////////
+// DomBuilder - a SaxHandler that builds the same element tree that Reader would.
+//  e.g.:  UnknownElement root; DomBuilder builder(root); PushParser parser(builder);
+
+class DomBuilder : public SaxHandler
 {
-   const Token& token = tokenStream.Get();
-   if (token.nType != nExpected)
+public:
+   DomBuilder(UnknownElement& root) : m_Root(root) {}
+
+   virtual void ObjectBegin()                      { UnknownElement* p = NextElement(); *p = Object(); Push(p, false); }
+   virtual void ObjectEnd()                        { m_Stack.pop_back(); m_IsArray.pop_back(); }
+   virtual void ArrayBegin()                       { UnknownElement* p = NextElement(); *p = Array(); Push(p, true); }
+   virtual void ArrayEnd()                         { m_Stack.pop_back(); m_IsArray.pop_back(); }
+   virtual void ArraySize(size_t nElements)        { m_Stack.back()->Modify_i<Array>().Reserve(nElements); }
+   virtual void Key(const std::string& name)       { m_sKey = name; }
+   virtual void Value(const std::string& string)   { *NextElement() = String(string); }
+   virtual void Value(double number)               { *NextElement() = Number(number); }
+   virtual void IntegerValue(long long number)     { *NextElement() = Number::FromInteger(number); }
+   virtual void Value(bool boolean)                { *NextElement() = Boolean(boolean); }
+   virtual void NullValue()                        { *NextElement() = Null(); }
+
+private:
+   void Push(UnknownElement* pElement, bool bArray) { m_Stack.push_back(pElement); m_IsArray.push_back(bArray); }
+   // where to store the next value. note that values are only ever added to the innermost
+   //  open container, and adding to an Array only moves its own elements, so the pointers
+   //  in m_Stack (each an element of the container below it) stay valid.
+   UnknownElement* NextElement()
    {
-      std::string sMessage = std::string("Unexpected token: ") + token.GetStrValue();
-      throw ParseException(sMessage, token.locBegin, token.locEnd);
+      if (m_Stack.empty())
+         return &m_Root;
+      if (m_IsArray.back()) {
+         Array& array = m_Stack.back()->Modify_i<Array>();
+         return &*array.Insert(UnknownElement());
+      }
+      Object& object = m_Stack.back()->Modify_i<Object>();
+      try
+      {
+         return &object.Insert(Object::Member(m_sKey))->element;
+      }
+      catch (Exception&)
+      {
+         throw Exception(std::string("Duplicate object member token: ") + m_sKey);
+      }
    }
 
-   return token.GetStrValue();
-}
+   UnknownElement& m_Root;
+   std::vector<UnknownElement*> m_Stack;
+   std::vector<bool> m_IsArray;
+   std::string m_sKey;
+};
+
+
+// Writer - writes an element to an ostream: PRETTY-printed by default, one
+//  member or element per line and indented with tabs, for people to read (e.g.
+//  in debug output); or COMPACT, with no white space at all, as BufferWriter
+//  does, for anything that only a program reads. the stream is flushed once,
+//  at the end
 
 class Writer : private ConstVisitor
 {
 public:
-   static void Write(const Object& object, std::ostream& ostr);
-   static void Write(const Array& array, std::ostream& ostr);
-   static void Write(const String& string, std::ostream& ostr);
-   static void Write(const Number& number, std::ostream& ostr);
-   static void Write(const Boolean& boolean, std::ostream& ostr);
-   static void Write(const Null& null, std::ostream& ostr);
-   static void Write(const UnknownElement& elementRoot, std::ostream& ostr);
+   enum Format { PRETTY, COMPACT };
+
+   static void Write(const Object& object, std::ostream& ostr, Format format = PRETTY);
+   static void Write(const Array& array, std::ostream& ostr, Format format = PRETTY);
+   static void Write(const String& string, std::ostream& ostr, Format format = PRETTY);
+   static void Write(const Number& number, std::ostream& ostr, Format format = PRETTY);
+   static void Write(const Boolean& boolean, std::ostream& ostr, Format format = PRETTY);
+   static void Write(const Null& null, std::ostream& ostr, Format format = PRETTY);
+   static void Write(const UnknownElement& elementRoot, std::ostream& ostr, Format format = PRETTY);
+
+   // writes a plain C++ value (see Reader::ReadValue() and jsonbind.h) as if it were elements
+   template <typename ValueT>
+   static void WriteValue(const ValueT& value, std::ostream& ostr, Format format = PRETTY) { Write_i(value, ostr, format); }
+
+   // formats a number as JSON: integers exactly, other numbers with the fewest digits
+   //  that read back as the same double. doesn't depend on the locale
+   static void FormatNumber(const Number& number, char (&sBuffer)[32]);
 
 private:
-   Writer(std::ostream& ostr);
+   Writer(std::ostream& ostr, Format format);
 
    template <typename ElementTypeT>
-   static void Write_i(const ElementTypeT& element, std::ostream& ostr);
+   static void Write_i(const ElementTypeT& element, std::ostream& ostr, Format format);
 
    void Write_i(const Object& object);
    void Write_i(const Array& array);
@@ -1462,6 +3193,13 @@ private:
    void Write_i(const Boolean& boolean);
    void Write_i(const Null& null);
    void Write_i(const UnknownElement& unknown);
+   // anything else is written by its Bind
+   template <typename ValueT>
+   void Write_i(const ValueT& value) { Bind<ValueT>::Write(*this, value); }
+   template <typename ValueT, typename EnableT>
+   friend struct Bind;
+   void WriteString(const std::string& s); // quoted and escaped
+   void WriteNewLine(); // and the indent for the next line, if PRETTY
 
    virtual void Visit(const Array& array);
    virtual void Visit(const Object& object);
@@ -1471,54 +3209,67 @@ private:
    virtual void Visit(const Null& null);
 
    std::ostream& m_ostr;
+   const bool m_bPretty;
    int m_nTabDepth;
 };
 
-inline void Writer::Write(const UnknownElement& elementRoot, std::ostream& ostr) { Write_i(elementRoot, ostr); }
-inline void Writer::Write(const Object& object, std::ostream& ostr)              { Write_i(object, ostr); }
-inline void Writer::Write(const Array& array, std::ostream& ostr)                { Write_i(array, ostr); }
-inline void Writer::Write(const Number& number, std::ostream& ostr)              { Write_i(number, ostr); }
-inline void Writer::Write(const String& string, std::ostream& ostr)              { Write_i(string, ostr); }
-inline void Writer::Write(const Boolean& boolean, std::ostream& ostr)            { Write_i(boolean, ostr); }
-inline void Writer::Write(const Null& null, std::ostream& ostr)                  { Write_i(null, ostr); }
+inline void Writer::Write(const UnknownElement& elementRoot, std::ostream& ostr, Format format) { Write_i(elementRoot, ostr, format); }
+inline void Writer::Write(const Object& object, std::ostream& ostr, Format format)              { Write_i(object, ostr, format); }
+inline void Writer::Write(const Array& array, std::ostream& ostr, Format format)                { Write_i(array, ostr, format); }
+inline void Writer::Write(const Number& number, std::ostream& ostr, Format format)              { Write_i(number, ostr, format); }
+inline void Writer::Write(const String& string, std::ostream& ostr, Format format)              { Write_i(string, ostr, format); }
+inline void Writer::Write(const Boolean& boolean, std::ostream& ostr, Format format)            { Write_i(boolean, ostr, format); }
+inline void Writer::Write(const Null& null, std::ostream& ostr, Format format)                  { Write_i(null, ostr, format); }
 
 
-inline Writer::Writer(std::ostream& ostr) :
+inline Writer::Writer(std::ostream& ostr, Format format) :
    m_ostr(ostr),
+   m_bPretty(format == PRETTY),
    m_nTabDepth(0)
 {}
 
 template <typename ElementTypeT>
-void Writer::Write_i(const ElementTypeT& element, std::ostream& ostr)
+void Writer::Write_i(const ElementTypeT& element, std::ostream& ostr, Format format)
 {
-   Writer writer(ostr);
+   Writer writer(ostr, format);
    writer.Write_i(element);
    ostr.flush(); // all done
 }
 
+inline void Writer::WriteNewLine()
+{
+   if (!m_bPretty)
+      return;
+   // '\n' rather than std::endl, which would flush the stream every line
+   static const char sTabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+   m_ostr.put('\n');
+   for (int nLeft = m_nTabDepth; nLeft > 0; nLeft -= (int)(sizeof(sTabs) - 1))
+      m_ostr.write(sTabs, nLeft < (int)(sizeof(sTabs) - 1) ? nLeft : (int)(sizeof(sTabs) - 1));
+}
+
 inline void Writer::Write_i(const Array& array)
 {
    if (array.Empty())
       m_ostr << "[]";
    else
    {
-      m_ostr << '[' << std::endl;
+      m_ostr.put('[');
       ++m_nTabDepth;
 
       Array::const_iterator it(array.Begin()),
                             itEnd(array.End());
       while (it != itEnd) {
-         m_ostr << std::string(m_nTabDepth, '\t');
+         WriteNewLine();
          
          Write_i(*it);
 
          if (++it != itEnd)
-            m_ostr << ',';
-         m_ostr << std::endl;
+            m_ostr.put(',');
       }
 
       --m_nTabDepth;
-      m_ostr << std::string(m_nTabDepth, '\t') << ']';
+      WriteNewLine();
+      m_ostr.put(']');
    }
 }
 
@@ -1528,32 +3279,80 @@ inline void Writer::Write_i(const Object& object)
       m_ostr << "{}";
    else
    {
-      m_ostr << '{' << std::endl;
+      m_ostr.put('{');
       ++m_nTabDepth;
 
       Object::const_iterator it(object.Begin()),
                              itEnd(object.End());
       while (it != itEnd) {
-         m_ostr << std::string(m_nTabDepth, '\t');
+         WriteNewLine();
          
-         Write_i(it->name);
+         WriteString(it->name);
 
-         m_ostr << " : ";
+         if (m_bPretty)
+            m_ostr.write(" : ", 3);
+         else
+            m_ostr.put(':');
          Write_i(it->element); 
 
          if (++it != itEnd)
-            m_ostr << ',';
-         m_ostr << std::endl;
+            m_ostr.put(',');
       }
 
       --m_nTabDepth;
-      m_ostr << std::string(m_nTabDepth, '\t') << '}';
+      WriteNewLine();
+      m_ostr.put('}');
    }
 }
 
 inline void Writer::Write_i(const Number& numberElement)
 {
-   m_ostr << std::setprecision(20) << numberElement.Value();
+   // ostream formatting is slow and locale-dependent, so format the number ourselves
+   char sBuffer[32];
+   FormatNumber(numberElement, sBuffer);
+   m_ostr << sBuffer;
+}
+
+inline void Writer::FormatNumber(const Number& number, char (&sBuffer)[32])
+{
+   if (number.IsInteger())
+   {
+      // all the digits, from the back
+      long long nValue = number.AsInteger();
+      char* p = sBuffer + sizeof(sBuffer);
+      *--p = '\0';
+      do {
+         const int nDigit = (int)(nValue % 10);
+         *--p = (char)('0' + (nDigit < 0 ? -nDigit : nDigit));
+         nValue /= 10;
+      } while (nValue != 0);
+      if (number.AsInteger() < 0)
+         *--p = '-';
+      memmove(sBuffer, p, sBuffer + sizeof(sBuffer) - p);
+      return;
+   }
+
+   const double dValue = number.Value();
+   if (dValue != dValue || dValue - dValue != 0)
+   {
+      // NaN or infinity, which JSON has no way to express
+      strcpy(sBuffer, "null");
+      return;
+   }
+   // the fewest significant digits that read back as the same double. Any decimal of up to 15 digits survives the
+   //  trip through a normal double, so %.15g already gives the shortest of those and the search can start there;
+   //  subnormals (and zero) hold fewer digits, so for them it starts at 1 (e.g. 5e-324, not 4.94065645841247e-324).
+   const int nShortest = (dValue < 0 ? -dValue : dValue) < std::numeric_limits<double>::min() ? 1 : 15;
+   for (int nPrecision = nShortest; nPrecision <= 17; ++nPrecision)
+   {
+      snprintf(sBuffer, sizeof(sBuffer), "%.*g", nPrecision, dValue);
+      if (strtod(sBuffer, NULL) == dValue)
+         break;
+   }
+   // in case the C locale's decimal point isn't '.'
+   for (char* p = sBuffer; *p; ++p)
+      if (*p == ',')
+         *p = '.';
 }
 
 inline void Writer::Write_i(const Boolean& booleanElement)
@@ -1563,28 +3362,28 @@ inline void Writer::Write_i(const Boolean& booleanElement)
 
 inline void Writer::Write_i(const String& stringElement)
 {
-   m_ostr << '"';
+   WriteString(stringElement.Value());
+}
+
+inline void Writer::WriteString(const std::string& s)
+{
+   m_ostr.put('"');
 
-   const std::string& s = stringElement.Value();
-   std::string::const_iterator it(s.begin()),
-                               itEnd(s.end());
-   for (; it != itEnd; ++it)
+   const char* p = s.data();
+   const char* pEnd = p + s.size();
+   while (p != pEnd)
    {
-      switch (*it)
-      {
-         case '"':         m_ostr << "\\\"";   break;
-         case '\\':        m_ostr << "\\\\";   break;
-         case '\b':        m_ostr << "\\b";    break;
-         case '\f':        m_ostr << "\\f";    break;
-         case '\n':        m_ostr << "\\n";    break;
-         case '\r':        m_ostr << "\\r";    break;
-         case '\t':        m_ostr << "\\t";    break;
-         //case '\u':        m_ostr << "\\u";    break; // uh...
-         default:          m_ostr << *it;      break;
-      }
+      // write runs of characters that don't need escaping in one go, as BufferWriter does
+      const char* pRun = p;
+      p = Detail::FindEscape(p, pEnd);
+      m_ostr.write(pRun, p - pRun);
+      if (p == pEnd)
+         break;
+      char sEscape[6];
+      m_ostr.write(sEscape, Detail::Escape(*p++, sEscape));
    }
 
-   m_ostr << '"';   
+   m_ostr.put('"');
 }
 
 inline void Writer::Write_i(const Null& )
@@ -1605,5 +3404,289 @@ inline void Writer::Visit(const Boolean& boolean)   { Write_i(boolean); }
 inline void Writer::Visit(const Null& null)         { Write_i(null); }
 
 
+/////////////////////////////////////////////////////////////////////////////////
+// BufferWriter - writes compact JSON (no white space) straight into a buffer,
+//  without going through an ostream. MeasureSize() says how big the buffer 
+//  needs to be, so that it can be allocated once, e.g.:
+//     std::string s(BufferWriter::MeasureSize(object), '\0');
+//     BufferWriter::Write(object, &s[0]);
+
+class BufferWriter : private ConstVisitor
+{
+public:
+   // ElementTypeT may be UnknownElement, Object, Array, etc.
+   template <typename ElementTypeT>
+   static size_t MeasureSize(const ElementTypeT& element);
+   // writes exactly MeasureSize(element) bytes (with no terminating '\0'), and returns
+   //  a pointer just past them
+   template <typename ElementTypeT>
+   static char* Write(const ElementTypeT& element, char* pBuffer);
+
+private:
+   BufferWriter(char* pBuffer) : m_pOut(pBuffer), m_nSize(0) {}
+
+   void Put(const char* p, size_t n) { if (m_pOut) { memcpy(m_pOut, p, n); m_pOut += n; } m_nSize += n; }
+   void Put(char c) { if (m_pOut) *m_pOut++ = c; ++m_nSize; }
+   void PutString(const std::string& s);
+
+   virtual void Visit(const Array& array);
+   virtual void Visit(const Object& object);
+   virtual void Visit(const Number& number);
+   virtual void Visit(const String& string)    { PutString(string.Value()); }
+   virtual void Visit(const Boolean& boolean)  { if (boolean.Value()) Put("true", 4); else Put("false", 5); }
+   virtual void Visit(const Null& null)        { Put("null", 4); }
+   void Visit(const UnknownElement& element)   { element.Accept(*this); }
+
+   char* m_pOut; // NULL while measuring
+   size_t m_nSize;
+};
+
+template <typename ElementTypeT>
+size_t BufferWriter::MeasureSize(const ElementTypeT& element)
+{
+   BufferWriter writer(NULL);
+   writer.Visit(element);
+   return writer.m_nSize;
+}
+
+template <typename ElementTypeT>
+char* BufferWriter::Write(const ElementTypeT& element, char* pBuffer)
+{
+   BufferWriter writer(pBuffer);
+   writer.Visit(element);
+   return writer.m_pOut;
+}
+
+inline void BufferWriter::Visit(const Array& array)
+{
+   Put('[');
+   for (Array::const_iterator it(array.Begin()), itEnd(array.End()); it != itEnd; ++it)
+   {
+      if (it != array.Begin())
+         Put(',');
+      it->Accept(*this);
+   }
+   Put(']');
+}
+
+inline void BufferWriter::Visit(const Object& object)
+{
+   Put('{');
+   for (Object::const_iterator it(object.Begin()), itEnd(object.End()); it != itEnd; ++it)
+   {
+      if (it != object.Begin())
+         Put(',');
+      PutString(it->name);
+      Put(':');
+      it->element.Accept(*this);
+   }
+   Put('}');
+}
+
+inline void BufferWriter::Visit(const Number& number)
+{
+   char sBuffer[32];
+   Writer::FormatNumber(number, sBuffer);
+   Put(sBuffer, strlen(sBuffer));
+}
+
+inline void BufferWriter::PutString(const std::string& s)
+{
+   Put('"');
+   const char* p = s.data();
+   const char* pEnd = p + s.size();
+   while (p != pEnd)
+   {
+      // copy runs of characters that don't need escaping in one go
+      const char* pRun = p;
+      p = Detail::FindEscape(p, pEnd);
+      Put(pRun, p - pRun);
+      if (p == pEnd)
+         break;
+      char sEscape[6];
+      Put(sEscape, Detail::Escape(*p++, sEscape));
+   }
+   Put('"');
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// StreamWriter - writes the same compact JSON as BufferWriter, but a piece at a
+//  time: each Write() fills as much of a buffer as it can, and the next one
+//  carries on where it left off, so a big document can be sent (e.g. as a
+//  request body) without ever being written out whole. the element must stay
+//  as it is until the writer is done with it. the writer itself only holds a
+//  stack as deep as the document, and the few bytes of a token that didn't fit:
+//     StreamWriter writer(object);
+//     while (size_t n = writer.Write(buffer, sizeof(buffer)))
+//        Send(buffer, n);
+
+class StreamWriter : private ConstVisitor
+{
+public:
+   // ElementTypeT may be UnknownElement, Object, Array, etc.
+   template <typename ElementTypeT>
+   explicit StreamWriter(const ElementTypeT& element);
+
+   // writes up to nSize bytes to pBuffer. returns how many, which is only 0 (for
+   //  any nSize > 0) once the whole document has been written
+   size_t Write(char* pBuffer, size_t nSize);
+   bool IsDone() const { return m_Stack.empty() && !m_pString && m_nPendingPos == m_nPendingSize; }
+
+private:
+   struct Frame
+   {
+      const Array* pArray; // or NULL for an object:
+      const Object* pObject;
+      Array::const_iterator itArray;
+      Object::const_iterator itObject;
+      bool bFirst;
+      bool bValueNext; // an object's member name has been written; its value is next
+   };
+
+   void Pend(const char* p, size_t n) { memcpy(m_sPending + m_nPendingSize, p, n); m_nPendingSize += n; }
+   void Pend(char c) { m_sPending[m_nPendingSize++] = c; }
+   void BeginString(const std::string& s) { Pend('"'); m_pString = &s; m_nStringPos = 0; }
+   size_t PutString(char* pOut, size_t nRoom); // some more of m_pString
+   void Step(); // the next token onto m_sPending (or the next string to write)
+
+   virtual void Visit(const Array& array);
+   virtual void Visit(const Object& object);
+   virtual void Visit(const Number& number);
+   virtual void Visit(const String& string)    { BeginString(string.Value()); }
+   virtual void Visit(const Boolean& boolean)  { if (boolean.Value()) Pend("true", 4); else Pend("false", 5); }
+   virtual void Visit(const Null& null)        { Pend("null", 4); }
+   void Visit(const UnknownElement& element)   { element.Accept(*this); }
+
+   std::vector<Frame> m_Stack;
+   char m_sPending[40]; // room for a ',' or ':', then a number (or an escape), as Step() writes no more than that
+   size_t m_nPendingSize;
+   size_t m_nPendingPos;
+   const std::string* m_pString; // being written, or NULL
+   size_t m_nStringPos;
+};
+
+template <typename ElementTypeT>
+StreamWriter::StreamWriter(const ElementTypeT& element) :
+   m_nPendingSize(0),
+   m_nPendingPos(0),
+   m_pString(NULL),
+   m_nStringPos(0)
+{
+   Visit(element); // only the first token: Write() does the rest
+}
+
+inline void StreamWriter::Visit(const Array& array)
+{
+   Pend('[');
+   Frame frame = { &array, NULL, array.Begin(), Object::const_iterator(), true, false };
+   m_Stack.push_back(frame);
+}
+
+inline void StreamWriter::Visit(const Object& object)
+{
+   Pend('{');
+   Frame frame = { NULL, &object, Array::const_iterator(), object.Begin(), true, false };
+   m_Stack.push_back(frame);
+}
+
+inline void StreamWriter::Visit(const Number& number)
+{
+   char sBuffer[32];
+   Writer::FormatNumber(number, sBuffer);
+   Pend(sBuffer, strlen(sBuffer));
+}
+
+inline void StreamWriter::Step()
+{
+   Frame& frame = m_Stack.back();
+   if (frame.pArray)
+   {
+      if (frame.itArray == frame.pArray->End())
+      {
+         Pend(']');
+         m_Stack.pop_back();
+         return;
+      }
+      if (!frame.bFirst)
+         Pend(',');
+      frame.bFirst = false;
+      const UnknownElement& element = *frame.itArray++;
+      element.Accept(*this); // (which may push a frame, so frame is no good after this)
+   }
+   else if (frame.bValueNext)
+   {
+      Pend(':');
+      frame.bValueNext = false;
+      const UnknownElement& element = (frame.itObject++)->element;
+      element.Accept(*this);
+   }
+   else if (frame.itObject == frame.pObject->End())
+   {
+      Pend('}');
+      m_Stack.pop_back();
+   }
+   else
+   {
+      if (!frame.bFirst)
+         Pend(',');
+      frame.bFirst = false;
+      frame.bValueNext = true;
+      BeginString(frame.itObject->name);
+   }
+}
+
+inline size_t StreamWriter::PutString(char* pOut, size_t nRoom)
+{
+   // as BufferWriter::PutString(), stopping when the buffer is full
+   const char* pStart = m_pString->data();
+   const char* p = pStart + m_nStringPos;
+   const char* pEnd = pStart + m_pString->size();
+   const char* pRun = p;
+   const char* pRunEnd = p + (nRoom < (size_t)(pEnd - p) ? nRoom : (size_t)(pEnd - p));
+   p = Detail::FindEscape(p, pRunEnd);
+   const size_t nRun = p - pRun;
+   memcpy(pOut, pRun, nRun);
+   m_nStringPos += nRun;
+   if (p == pEnd)
+   {
+      Pend('"');
+      m_pString = NULL;
+   }
+   else if (p != pRunEnd)
+   {
+      ++m_nStringPos;
+      char sEscape[6];
+      Pend(sEscape, Detail::Escape(*p, sEscape));
+   }
+   return nRun;
+}
+
+inline size_t StreamWriter::Write(char* pBuffer, size_t nSize)
+{
+   size_t nWritten = 0;
+   while (nWritten < nSize)
+   {
+      if (m_nPendingPos < m_nPendingSize)
+      {
+         const size_t nLeft = m_nPendingSize - m_nPendingPos;
+         const size_t n = nLeft < nSize - nWritten ? nLeft : nSize - nWritten;
+         memcpy(pBuffer + nWritten, m_sPending + m_nPendingPos, n);
+         m_nPendingPos += n;
+         nWritten += n;
+         continue;
+      }
+      m_nPendingSize = m_nPendingPos = 0;
+      if (m_pString)
+         nWritten += PutString(pBuffer + nWritten, nSize - nWritten);
+      else if (!m_Stack.empty())
+         Step();
+      else
+         break; // all done
+   }
+   return nWritten;
+}
+
+
 
 } // End namespace
@@ -0,0 +1,287 @@
+// jsonbind.h:
+// Reading JSON straight into plain C++ structs, and writing them out again, without
+// building json elements on the way: Reader::ReadValue() and Writer::WriteValue().
+// Describe each struct's fields once, at namespace scope outside of any namespace:
+//
+//   struct Video { std::string id; std::string title; std::vector<std::string> tags; long long views; };
+//   JSON_FIELDS(Video, id, title, tags, views)
+//
+//   Video video;
+//   json::Reader::ReadValue(video, pData, nSize);
+//
+// Each field is named in the document as it is in C++, and may be a bool, any other
+// arithmetic type, a std::string, another JSON_FIELDS struct, a std::vector of any of
+// these, a std::map with std::string keys of any of them, or a json element (e.g. an
+// UnknownElement, for a part whose shape isn't known). Specialize json::Bind for anything
+// else. A struct may have up to 32 named fields.
+// The document's members that the struct has no field for are skipped without building,
+// or allocating, anything. A field whose member is missing, or null, keeps the value it
+// had. A value of the wrong type throws a json::Exception, as Reader does.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+#include "json.h"
+
+namespace json {
+
+// The fields of a struct, as listed by JSON_FIELDS. Visit() calls visitor(name, value.field)
+// for each one, in order.
+template <typename StructT>
+struct Fields;
+
+// What the Binds below share:
+template <>
+struct Bind<void> {
+	// A null leaves the value as it was; anything else is read into it.
+	template <typename ValueT>
+	static void ReadOrNull(Reader& reader, ValueT& value) {
+		if (reader.Peek() == 'n')
+			reader.MatchExpectedString("null");
+		else
+			reader.Parse(value);
+	}
+	// The separator before a member (unless it's the first), and its name
+	static void WriteName(Writer& writer, const std::string& name, bool first) {
+		if (!first)
+			writer.m_ostr.put(',');
+		writer.WriteNewLine();
+		writer.WriteString(name);
+		if (writer.m_bPretty)
+			writer.m_ostr.write(" : ", 3);
+		else
+			writer.m_ostr.put(':');
+	}
+};
+
+// The struct reader and writer, for anything with Fields:
+template <typename ValueT, typename EnableT>
+struct Bind {
+	static void Read(Reader& reader, ValueT& value) {
+		reader.MatchExpectedChar('{');
+		reader.EatWhiteSpace();
+		if (reader.Peek() == '}') {
+			++reader.m_pCurrent;
+			return;
+		}
+		for (;;) {
+			if (reader.Peek() != '"')
+				reader.ThrowParse(std::string("Unexpected token: ") + *reader.m_pCurrent, reader.m_pCurrent);
+			FieldReader field_reader(reader);
+			reader.MatchName(field_reader.pName, field_reader.nameSize);
+			reader.EatWhiteSpace();
+			reader.MatchExpectedChar(':');
+			reader.EatWhiteSpace();
+			Fields<ValueT>::Visit(field_reader, value);
+			if (!field_reader.found)
+				reader.Skip();
+			reader.EatWhiteSpace();
+			if (reader.Peek() != ',')
+				break;
+			++reader.m_pCurrent;
+			reader.EatWhiteSpace();
+		}
+		reader.MatchExpectedChar('}');
+	}
+	static void Write(Writer& writer, const ValueT& value) {
+		FieldWriter field_writer(writer);
+		writer.m_ostr.put('{');
+		++writer.m_nTabDepth;
+		Fields<ValueT>::Visit(field_writer, value);
+		--writer.m_nTabDepth;
+		if (field_writer.numWritten)
+			writer.WriteNewLine();
+		writer.m_ostr.put('}');
+	}
+
+private:
+	struct FieldReader {
+		FieldReader(Reader& readerIn) : reader(readerIn), pName(NULL), nameSize(0), found(false) {}
+		template <typename FieldT>
+		void operator()(const char* name, FieldT& field) {
+			if (!found && strncmp(name, pName, nameSize) == 0 && name[nameSize] == '\0') {
+				found = true;
+				Bind<void>::ReadOrNull(reader, field);
+			}
+		}
+		Reader& reader;
+		const char* pName; // The member's name, which may not be null-terminated
+		size_t nameSize;
+		bool found;
+	};
+	struct FieldWriter {
+		FieldWriter(Writer& writerIn) : writer(writerIn), numWritten(0) {}
+		template <typename FieldT>
+		void operator()(const char* name, const FieldT& field) {
+			Bind<void>::WriteName(writer, name, numWritten++ == 0);
+			writer.Write_i(field);
+		}
+		Writer& writer;
+		size_t numWritten;
+	};
+};
+
+template <>
+struct Bind<bool> {
+	static void Read(Reader& reader, bool& value) { Boolean boolean; reader.Parse(boolean); value = boolean.Value(); }
+	static void Write(Writer& writer, const bool& value) { writer.Write_i(Boolean(value)); }
+};
+
+// Integers are read exactly (see Number::AsInteger()); other numbers are converted from double.
+template <typename ValueT>
+struct Bind<ValueT, typename std::enable_if<std::is_arithmetic<ValueT>::value>::type> {
+	static void Read(Reader& reader, ValueT& value) {
+		Number number;
+		reader.Parse(number);
+		value = std::is_integral<ValueT>::value ? (ValueT)number.AsInteger() : (ValueT)number.Value();
+	}
+	static void Write(Writer& writer, const ValueT& value) {
+		writer.Write_i(std::is_integral<ValueT>::value ? Number::FromInteger((long long)value) : Number((double)value));
+	}
+};
+
+template <>
+struct Bind<std::string> {
+	static void Read(Reader& reader, std::string& value) { reader.MatchString(value); }
+	static void Write(Writer& writer, const std::string& value) { writer.WriteString(value); }
+};
+
+template <typename ElementT, typename AllocatorT>
+struct Bind< std::vector<ElementT, AllocatorT> > {
+	static void Read(Reader& reader, std::vector<ElementT, AllocatorT>& value) {
+		value.clear();
+		reader.MatchExpectedChar('[');
+		reader.EatWhiteSpace();
+		if (reader.Peek() == ']') {
+			++reader.m_pCurrent;
+			return;
+		}
+		for (;;) {
+			ElementT element = ElementT();
+			Bind<void>::ReadOrNull(reader, element);
+			value.push_back(std::move(element));
+			reader.EatWhiteSpace();
+			if (reader.Peek() != ',')
+				break;
+			++reader.m_pCurrent;
+			reader.EatWhiteSpace();
+		}
+		reader.MatchExpectedChar(']');
+	}
+	static void Write(Writer& writer, const std::vector<ElementT, AllocatorT>& value) {
+		writer.m_ostr.put('[');
+		++writer.m_nTabDepth;
+		for (size_t i = 0; i < value.size(); i++) {
+			if (i)
+				writer.m_ostr.put(',');
+			writer.WriteNewLine();
+			const ElementT& element = value[i]; // (a plain bool, for a std::vector<bool>)
+			writer.Write_i(element);
+		}
+		--writer.m_nTabDepth;
+		if (!value.empty())
+			writer.WriteNewLine();
+		writer.m_ostr.put(']');
+	}
+};
+
+template <typename ElementT, typename CompareT, typename AllocatorT>
+struct Bind< std::map<std::string, ElementT, CompareT, AllocatorT> > {
+	typedef std::map<std::string, ElementT, CompareT, AllocatorT> Map;
+	static void Read(Reader& reader, Map& value) {
+		value.clear();
+		reader.MatchExpectedChar('{');
+		reader.EatWhiteSpace();
+		if (reader.Peek() == '}') {
+			++reader.m_pCurrent;
+			return;
+		}
+		std::string name;
+		for (;;) {
+			if (reader.Peek() != '"')
+				reader.ThrowParse(std::string("Unexpected token: ") + *reader.m_pCurrent, reader.m_pCurrent);
+			reader.MatchString(name);
+			reader.EatWhiteSpace();
+			reader.MatchExpectedChar(':');
+			reader.EatWhiteSpace();
+			Bind<void>::ReadOrNull(reader, value[name]);
+			reader.EatWhiteSpace();
+			if (reader.Peek() != ',')
+				break;
+			++reader.m_pCurrent;
+			reader.EatWhiteSpace();
+		}
+		reader.MatchExpectedChar('}');
+	}
+	static void Write(Writer& writer, const Map& value) {
+		writer.m_ostr.put('{');
+		++writer.m_nTabDepth;
+		for (typename Map::const_iterator it = value.begin(); it != value.end(); ++it) {
+			Bind<void>::WriteName(writer, it->first, it == value.begin());
+			writer.Write_i(it->second);
+		}
+		--writer.m_nTabDepth;
+		if (!value.empty())
+			writer.WriteNewLine();
+		writer.m_ostr.put('}');
+	}
+};
+
+} // End namespace
+
+// JSON_FIELDS(StructT, field, ...): see the top of this file.
+#define JSON_FIELDS(STRUCT, ...) \
+	namespace json { \
+	template <> \
+	struct Fields<STRUCT> { \
+		template <typename VisitorT, typename ValueT> \
+		static void Visit(VisitorT& visitor, ValueT& value) { JSON_BIND_EXPAND(JSON_BIND_EACH(JSON_BIND_FIELD, __VA_ARGS__)) } \
+	}; \
+	}
+
+// (The machinery: calls M(field) for each field. JSON_BIND_EXPAND makes MSVC expand
+// __VA_ARGS__ into separate arguments.)
+#define JSON_BIND_FIELD(FIELD) visitor(#FIELD, value.FIELD);
+#define JSON_BIND_EXPAND(x) x
+#define JSON_BIND_SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, NAME, ...) NAME
+#define JSON_BIND_EACH(M, ...) JSON_BIND_EXPAND(JSON_BIND_SELECT(__VA_ARGS__, JSON_BIND_EACH_32, JSON_BIND_EACH_31, JSON_BIND_EACH_30, JSON_BIND_EACH_29, JSON_BIND_EACH_28, JSON_BIND_EACH_27, JSON_BIND_EACH_26, JSON_BIND_EACH_25, JSON_BIND_EACH_24, JSON_BIND_EACH_23, JSON_BIND_EACH_22, JSON_BIND_EACH_21, JSON_BIND_EACH_20, JSON_BIND_EACH_19, JSON_BIND_EACH_18, JSON_BIND_EACH_17, JSON_BIND_EACH_16, JSON_BIND_EACH_15, JSON_BIND_EACH_14, JSON_BIND_EACH_13, JSON_BIND_EACH_12, JSON_BIND_EACH_11, JSON_BIND_EACH_10, JSON_BIND_EACH_9, JSON_BIND_EACH_8, JSON_BIND_EACH_7, JSON_BIND_EACH_6, JSON_BIND_EACH_5, JSON_BIND_EACH_4, JSON_BIND_EACH_3, JSON_BIND_EACH_2, JSON_BIND_EACH_1)(M, __VA_ARGS__))
+#define JSON_BIND_EACH_1(M, a) M(a)
+#define JSON_BIND_EACH_2(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_1(M, __VA_ARGS__))
+#define JSON_BIND_EACH_3(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_2(M, __VA_ARGS__))
+#define JSON_BIND_EACH_4(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_3(M, __VA_ARGS__))
+#define JSON_BIND_EACH_5(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_4(M, __VA_ARGS__))
+#define JSON_BIND_EACH_6(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_5(M, __VA_ARGS__))
+#define JSON_BIND_EACH_7(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_6(M, __VA_ARGS__))
+#define JSON_BIND_EACH_8(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_7(M, __VA_ARGS__))
+#define JSON_BIND_EACH_9(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_8(M, __VA_ARGS__))
+#define JSON_BIND_EACH_10(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_9(M, __VA_ARGS__))
+#define JSON_BIND_EACH_11(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_10(M, __VA_ARGS__))
+#define JSON_BIND_EACH_12(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_11(M, __VA_ARGS__))
+#define JSON_BIND_EACH_13(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_12(M, __VA_ARGS__))
+#define JSON_BIND_EACH_14(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_13(M, __VA_ARGS__))
+#define JSON_BIND_EACH_15(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_14(M, __VA_ARGS__))
+#define JSON_BIND_EACH_16(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_15(M, __VA_ARGS__))
+#define JSON_BIND_EACH_17(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_16(M, __VA_ARGS__))
+#define JSON_BIND_EACH_18(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_17(M, __VA_ARGS__))
+#define JSON_BIND_EACH_19(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_18(M, __VA_ARGS__))
+#define JSON_BIND_EACH_20(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_19(M, __VA_ARGS__))
+#define JSON_BIND_EACH_21(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_20(M, __VA_ARGS__))
+#define JSON_BIND_EACH_22(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_21(M, __VA_ARGS__))
+#define JSON_BIND_EACH_23(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_22(M, __VA_ARGS__))
+#define JSON_BIND_EACH_24(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_23(M, __VA_ARGS__))
+#define JSON_BIND_EACH_25(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_24(M, __VA_ARGS__))
+#define JSON_BIND_EACH_26(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_25(M, __VA_ARGS__))
+#define JSON_BIND_EACH_27(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_26(M, __VA_ARGS__))
+#define JSON_BIND_EACH_28(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_27(M, __VA_ARGS__))
+#define JSON_BIND_EACH_29(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_28(M, __VA_ARGS__))
+#define JSON_BIND_EACH_30(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_29(M, __VA_ARGS__))
+#define JSON_BIND_EACH_31(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_30(M, __VA_ARGS__))
+#define JSON_BIND_EACH_32(M, a, ...) M(a) JSON_BIND_EXPAND(JSON_BIND_EACH_31(M, __VA_ARGS__))
@@ -0,0 +1,317 @@
+// jsoncbor.h:
+// CBOR (RFC 7049), a compact binary encoding of the same kind of document as
+// JSON, for servers that we control both ends of (see HttpPostJson::SetCbor()).
+// It is a fifth to a half smaller than compact JSON text (most for numbers),
+// numbers are written as they are held rather than formatted and parsed, and
+// strings are copied without any escaping, so both ends do less work too.
+//
+// CborWriter writes elements (as BufferWriter does JSON), and CborParser
+// reports a CBOR document to a SaxHandler (as PushParser does JSON), so the
+// same DomBuilder, TapeWriter and so on serve both encodings, and code that
+// reads the elements or the tape can't tell them apart.
+//
+// Mapping: integers that fit in a long long are written and read as integers
+// (see Number::IsInteger()), other numbers as a float if that is exact, or a
+// double. Byte strings are read as strings, and tags (e.g. dates) are ignored,
+// leaving the value they tag. Map keys must be text strings, and "undefined"
+// reads as null.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits>
+#include <string>
+
+#include "json.h"
+
+namespace json {
+
+namespace Cbor {
+	enum MajorType {
+		MAJOR_UNSIGNED = 0,
+		MAJOR_NEGATIVE,
+		MAJOR_BYTES,
+		MAJOR_TEXT,
+		MAJOR_ARRAY,
+		MAJOR_MAP,
+		MAJOR_TAG,
+		MAJOR_SIMPLE, // false, true, null, undefined and floats
+	};
+	enum {
+		SIMPLE_FALSE = 20,
+		SIMPLE_TRUE = 21,
+		SIMPLE_NULL = 22,
+		SIMPLE_UNDEFINED = 23,
+		SIMPLE_HALF = 25,
+		SIMPLE_FLOAT = 26,
+		SIMPLE_DOUBLE = 27,
+		INDEFINITE = 31, // In the low bits of an initial byte: the length is not given up front
+		BREAK = 0xFF, // Ends an indefinite-length item
+	};
+	const char MEDIA_TYPE[] = "application/cbor";
+	// Documents nested deeper than this are rejected, rather than recursing without limit on untrusted input:
+	const size_t MAX_DEPTH = 512;
+}
+
+// CborWriter: writes elements as CBOR, in one pass to measure them and one to write them, e.g.:
+//    std::string s(CborWriter::MeasureSize(object), '\0');
+//    CborWriter::Write(object, &s[0]);
+class CborWriter : private ConstVisitor {
+public:
+	// ElementTypeT may be UnknownElement, Object, Array, etc.
+	template <typename ElementTypeT>
+	static size_t MeasureSize(const ElementTypeT& element) { CborWriter writer(NULL); writer.Visit(element); return writer.m_size; }
+	// Writes exactly MeasureSize(element) bytes, and returns a pointer just past them:
+	template <typename ElementTypeT>
+	static char* Write(const ElementTypeT& element, char* pBuffer) { CborWriter writer(pBuffer); writer.Visit(element); return writer.m_pOut; }
+
+private:
+	CborWriter(char* pBuffer) : m_pOut(pBuffer), m_size(0) {}
+
+	void Put(const void* p, size_t n) { if (m_pOut) { memcpy(m_pOut, p, n); m_pOut += n; } m_size += n; }
+	void Put(unsigned char c) { if (m_pOut) *m_pOut++ = (char)c; m_size++; }
+	// An initial byte and its argument, in the fewest bytes that hold it (big-endian, as CBOR is):
+	void PutHead(Cbor::MajorType major, uint64_t value) {
+		const unsigned char type = (unsigned char)(major << 5);
+		if (value < 24) {
+			Put((unsigned char)(type | value));
+		} else {
+			const int num_bytes = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFFu ? 4 : 8;
+			Put((unsigned char)(type | (num_bytes == 1 ? 24 : num_bytes == 2 ? 25 : num_bytes == 4 ? 26 : 27)));
+			PutBigEndian(value, num_bytes);
+		}
+	}
+	void PutBigEndian(uint64_t value, int numBytes) {
+		unsigned char bytes[8];
+		for (int i = numBytes - 1; i >= 0; i--, value >>= 8)
+			bytes[i] = (unsigned char)value;
+		Put(bytes, numBytes);
+	}
+	void PutText(const std::string& s) { PutHead(Cbor::MAJOR_TEXT, s.size()); Put(s.data(), s.size()); }
+
+	virtual void Visit(const Array& array) {
+		PutHead(Cbor::MAJOR_ARRAY, array.Size());
+		for (Array::const_iterator it(array.Begin()), it_end(array.End()); it != it_end; ++it)
+			it->Accept(*this);
+	}
+	virtual void Visit(const Object& object) {
+		PutHead(Cbor::MAJOR_MAP, object.Size());
+		for (Object::const_iterator it(object.Begin()), it_end(object.End()); it != it_end; ++it) {
+			PutText(it->name);
+			it->element.Accept(*this);
+		}
+	}
+	virtual void Visit(const Number& number) {
+		if (number.IsInteger()) {
+			const long long value = number.AsInteger();
+			if (value >= 0)
+				PutHead(Cbor::MAJOR_UNSIGNED, (uint64_t)value);
+			else
+				PutHead(Cbor::MAJOR_NEGATIVE, (uint64_t)-(value + 1)); // -1 - value, without overflowing for LLONG_MIN
+			return;
+		}
+		const double value = number.Value();
+		const float single = (float)value;
+		if ((double)single == value) {
+			uint32_t bits;
+			memcpy(&bits, &single, sizeof(bits));
+			Put((unsigned char)(Cbor::MAJOR_SIMPLE << 5 | Cbor::SIMPLE_FLOAT));
+			PutBigEndian(bits, 4);
+		} else {
+			uint64_t bits;
+			memcpy(&bits, &value, sizeof(bits));
+			Put((unsigned char)(Cbor::MAJOR_SIMPLE << 5 | Cbor::SIMPLE_DOUBLE));
+			PutBigEndian(bits, 8);
+		}
+	}
+	virtual void Visit(const String& string) { PutText(string.Value()); }
+	virtual void Visit(const Boolean& boolean) { Put((unsigned char)(Cbor::MAJOR_SIMPLE << 5 | (boolean.Value() ? Cbor::SIMPLE_TRUE : Cbor::SIMPLE_FALSE))); }
+	virtual void Visit(const Null& null) { Put((unsigned char)(Cbor::MAJOR_SIMPLE << 5 | Cbor::SIMPLE_NULL)); }
+	void Visit(const UnknownElement& element) { element.Accept(*this); }
+
+	char* m_pOut; // NULL while measuring
+	size_t m_size;
+};
+
+// CborParser: reports a whole CBOR document (one data item) to handler, e.g. a DomBuilder or a
+// TapeWriter. Throws json::Exception if it is malformed, truncated or followed by anything else.
+class CborParser {
+public:
+	static void Parse(const char* pData, size_t size, SaxHandler& handler) {
+		CborParser parser((const unsigned char*)pData, size, handler);
+		parser.ParseItem(0);
+		if (parser.m_p != parser.m_pEnd)
+			throw Exception("CBOR: unexpected data after the end of the document");
+	}
+
+private:
+	CborParser(const unsigned char* pData, size_t size, SaxHandler& handler) : m_p(pData), m_pEnd(pData + size), m_handler(handler) {}
+
+	const unsigned char* m_p;
+	const unsigned char* const m_pEnd;
+	SaxHandler& m_handler;
+	std::string m_string; // Reused for every string and key
+
+	void Need(uint64_t n) const {
+		if (n > (uint64_t)(m_pEnd - m_p))
+			throw Exception("CBOR: unexpected end of document");
+	}
+	uint64_t ReadBigEndian(int numBytes) {
+		Need(numBytes);
+		uint64_t value = 0;
+		for (int i = 0; i < numBytes; i++)
+			value = value << 8 | *m_p++;
+		return value;
+	}
+	// The argument that follows an initial byte whose low 5 bits are info (not INDEFINITE):
+	uint64_t ReadArgument(unsigned char info) {
+		if (info < 24)
+			return info;
+		if (info > 27)
+			throw Exception("CBOR: reserved additional information");
+		return ReadBigEndian(1 << (info - 24));
+	}
+	// A definite count of items that each take at least minBytesEach bytes, checked against what is left,
+	// so that a corrupt count can't make us reserve more than the document could hold:
+	size_t ReadCount(unsigned char info, uint64_t minBytesEach) {
+		const uint64_t count = ReadArgument(info);
+		if (count > (uint64_t)(m_pEnd - m_p) / minBytesEach)
+			throw Exception("CBOR: unexpected end of document");
+		return (size_t)count;
+	}
+	bool AtBreak() {
+		Need(1);
+		if (*m_p != Cbor::BREAK)
+			return false;
+		m_p++;
+		return true;
+	}
+	// A byte or text string (major), into m_string:
+	void ReadString(Cbor::MajorType major, unsigned char info) {
+		m_string.clear();
+		if (info != Cbor::INDEFINITE) {
+			const size_t length = ReadCount(info, 1);
+			m_string.assign((const char*)m_p, length);
+			m_p += length;
+			return;
+		}
+		// A sequence of definite-length chunks of the same major type:
+		while (!AtBreak()) {
+			const unsigned char initial = *m_p++;
+			if (initial >> 5 != major || (initial & 0x1F) == Cbor::INDEFINITE)
+				throw Exception("CBOR: bad chunk in an indefinite-length string");
+			const size_t length = ReadCount(initial & 0x1F, 1);
+			m_string.append((const char*)m_p, length);
+			m_p += length;
+		}
+	}
+	static double HalfToDouble(uint16_t half) {
+		const int exponent = (half >> 10) & 0x1F;
+		const int mantissa = half & 0x3FF;
+		double value;
+		if (exponent == 0)
+			value = ldexp((double)mantissa, -24);
+		else if (exponent != 31)
+			value = ldexp((double)(mantissa + 1024), exponent - 25);
+		else
+			value = mantissa == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+		return half & 0x8000 ? -value : value;
+	}
+
+	void ParseItem(size_t depth) {
+		if (depth > Cbor::MAX_DEPTH)
+			throw Exception("CBOR: document nested too deeply");
+		Need(1);
+		const unsigned char initial = *m_p++;
+		const Cbor::MajorType major = (Cbor::MajorType)(initial >> 5);
+		const unsigned char info = initial & 0x1F;
+		switch (major) {
+			case Cbor::MAJOR_UNSIGNED: {
+				const uint64_t value = ReadArgument(info);
+				if (value <= (uint64_t)std::numeric_limits<long long>::max())
+					m_handler.IntegerValue((long long)value);
+				else
+					m_handler.Value((double)value);
+				break;
+			}
+			case Cbor::MAJOR_NEGATIVE: {
+				const uint64_t value = ReadArgument(info); // The number is -1 - value
+				if (value <= (uint64_t)std::numeric_limits<long long>::max())
+					m_handler.IntegerValue(-1 - (long long)value);
+				else
+					m_handler.Value(-1.0 - (double)value);
+				break;
+			}
+			case Cbor::MAJOR_BYTES:
+			case Cbor::MAJOR_TEXT:
+				ReadString(major, info);
+				m_handler.Value(m_string);
+				break;
+			case Cbor::MAJOR_ARRAY:
+				m_handler.ArrayBegin();
+				if (info == Cbor::INDEFINITE) {
+					while (!AtBreak())
+						ParseItem(depth + 1);
+				} else {
+					size_t count = ReadCount(info, 1);
+					m_handler.ArraySize(count);
+					while (count--)
+						ParseItem(depth + 1);
+				}
+				m_handler.ArrayEnd();
+				break;
+			case Cbor::MAJOR_MAP: {
+				m_handler.ObjectBegin();
+				const bool indefinite = info == Cbor::INDEFINITE;
+				size_t count = indefinite ? 0 : ReadCount(info, 2);
+				while (indefinite ? !AtBreak() : count-- > 0) {
+					Need(1);
+					const unsigned char key = *m_p++;
+					if (key >> 5 != Cbor::MAJOR_TEXT)
+						throw Exception("CBOR: map keys must be text strings");
+					ReadString(Cbor::MAJOR_TEXT, key & 0x1F);
+					m_handler.Key(m_string);
+					ParseItem(depth + 1);
+				}
+				m_handler.ObjectEnd();
+				break;
+			}
+			case Cbor::MAJOR_TAG:
+				ReadArgument(info);
+				ParseItem(depth + 1);
+				break;
+			case Cbor::MAJOR_SIMPLE:
+				switch (info) {
+					case Cbor::SIMPLE_FALSE:     m_handler.Value(false); break;
+					case Cbor::SIMPLE_TRUE:      m_handler.Value(true); break;
+					case Cbor::SIMPLE_NULL:
+					case Cbor::SIMPLE_UNDEFINED: m_handler.NullValue(); break;
+					case Cbor::SIMPLE_HALF:      m_handler.Value(HalfToDouble((uint16_t)ReadBigEndian(2))); break;
+					case Cbor::SIMPLE_FLOAT: {
+						const uint32_t bits = (uint32_t)ReadBigEndian(4);
+						float value;
+						memcpy(&value, &bits, sizeof(value));
+						m_handler.Value((double)value);
+						break;
+					}
+					case Cbor::SIMPLE_DOUBLE: {
+						const uint64_t bits = ReadBigEndian(8);
+						double value;
+						memcpy(&value, &bits, sizeof(value));
+						m_handler.Value(value);
+						break;
+					}
+					default:
+						throw Exception(info == Cbor::INDEFINITE ? "CBOR: unexpected break" : "CBOR: unsupported simple value");
+				}
+				break;
+		}
+	}
+};
+
+} // End namespace
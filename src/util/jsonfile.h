@@ -0,0 +1,86 @@
+// jsonfile.h:
+// Reading JSON documents straight from files (e.g. bundled config, or a
+// response that was saved to disk), without going through a std::string or an
+// istream first:
+//     json::Object config;
+//     json::ReadFile(config, "rom://config.json");
+// ReadFile() parses the whole text in place, in one pass: a file that is big
+// enough is memory-mapped (see FileData), and anything else is read with a
+// single s3eFileRead(). Given an s3eFile* that is already open (e.g. an entry
+// in a pack file that has been seeked to), it reads from there to the end of
+// the file, again in one read.
+// ReadFileBlocks() is for a document that is too big to hold as text as well
+// as elements: it reads blockSize bytes at a time, and feeds each block to a
+// PushParser, so only one block of the text is ever in memory. It is slower
+// than ReadFile() (the parser copies each token), so only use it when memory
+// is what matters.
+// All of them throw what Reader would for a malformed document, or a
+// runtime_error (which json::Exception is) if the file can't be read.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "s3eFile.h"
+#include "iohelpers.h"
+#include "json.h"
+
+namespace json {
+
+// ElementTypeT may be UnknownElement, Object, Array, etc., as for Reader::Read():
+template <typename ElementTypeT>
+void ReadFile(ElementTypeT& element, const char* filePath) {
+	const FileData data(filePath);
+	Reader::Read(element, data.Data(), data.Size());
+}
+template <typename ElementTypeT>
+void ReadFile(ElementTypeT& element, const std::string& filePath) { ReadFile(element, filePath.c_str()); }
+
+// From pFile's current position to its end. The file is left open, at its end.
+template <typename ElementTypeT>
+void ReadFile(ElementTypeT& element, s3eFile* pFile) {
+	const int32 size = s3eFileGetSize(pFile) - s3eFileTell(pFile);
+	if (size < 0)
+		throw Exception("Unable to read JSON from a file");
+	std::vector<char> text(size > 0 ? size : 1);
+	if (size > 0 && s3eFileRead(&text[0], 1, size, pFile) != (uint32)size)
+		throw Exception("Unable to read JSON from a file");
+	Reader::Read(element, &text[0], (size_t)size);
+}
+
+// From pFile's current position, blockSize bytes at a time, until the document is complete. (Only white space
+// may follow it, up to the end of the file.)
+inline void ReadFileBlocks(UnknownElement& root, s3eFile* pFile, size_t blockSize = 64 * 1024) {
+	std::vector<char> block(blockSize ? blockSize : 1);
+	DomBuilder builder(root);
+	PushParser parser(builder);
+	for (;;) {
+		const uint32 num_read = s3eFileRead(&block[0], 1, (uint32)block.size(), pFile);
+		if (num_read)
+			parser.Feed(&block[0], num_read);
+		if (num_read < block.size()) {
+			if (!s3eFileEOF(pFile))
+				throw Exception("Unable to read JSON from a file");
+			break;
+		}
+	}
+	parser.Finish();
+}
+inline void ReadFileBlocks(UnknownElement& root, const char* filePath, size_t blockSize = 64 * 1024) {
+	s3eFile* p_file = s3eFileOpen(filePath, "rb");
+	if (!p_file)
+		throw Exception(std::string("Unable to open file ") + filePath);
+	try {
+		ReadFileBlocks(root, p_file, blockSize);
+	} catch (...) {
+		s3eFileClose(p_file);
+		throw;
+	}
+	s3eFileClose(p_file);
+}
+
+} // End namespace
@@ -0,0 +1,226 @@
+// jsonpath.h:
+// Compiled JSON Pointers (RFC 6901, e.g. "/items/0/snippet/thumbnail/url"),
+// for handlers that pick the same few values out of every response. A Path is
+// parsed once, with each key's hash worked out up front, so looking it up in a
+// document is just a walk down its members: hashed lookups in a DOM (see
+// json::Object::Find()), or length checks and memcmp() on a tape (see
+// jsontape.h), with no strings built on the way. A missing value is reported
+// as NULL (or an invalid TapeValue) rather than thrown, since optional fields
+// are the usual case.
+// A PathSet looks up several paths in one walk of the document: paths that
+// start the same way share that part of the walk, and each object on a tape is
+// scanned once for all the keys wanted from it.
+// Paths are plain data, so they can be made once (e.g. as statics) and used
+// from any thread, on documents that belong to that thread.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "json.h"
+#include "jsontape.h"
+
+namespace json {
+
+class Path {
+public:
+	Path() {} // The whole document
+	// pointer is "" for the whole document, or a '/' before each key or array index,
+	// with '~' and '/' in keys written as "~0" and "~1". Throws json::Exception if it isn't valid.
+	explicit Path(const std::string& pointer) { Compile(pointer); }
+
+	// The value the path leads to, or NULL if there is none (a key that isn't there, an index
+	// past the end, or something that isn't an object or array on the way):
+	const UnknownElement* Find(const UnknownElement& root) const {
+		const UnknownElement* pElement = &root;
+		for (size_t i = 0; i < m_tokens.size() && pElement; i++)
+			pElement = Step(*pElement, m_tokens[i]);
+		return pElement;
+	}
+	// The same on a tape, giving an invalid TapeValue if there is none:
+	TapeValue Find(const TapeValue& root) const {
+		TapeValue value = root;
+		for (size_t i = 0; i < m_tokens.size() && value.IsValid(); i++)
+			value = Step(value, m_tokens[i]);
+		return value;
+	}
+
+	size_t Size() const { return m_tokens.size(); } // How many keys/indices it has
+	bool Empty() const { return m_tokens.empty(); }
+	std::string ToString() const; // Back to a JSON Pointer
+
+private:
+	friend class PathSet;
+	struct Token {
+		std::string key;
+		size_t nHash; // Name::Hash(key)
+		size_t nIndex; // key as an array index, or NOT_INDEX if it isn't one
+		bool operator == (const Token& token) const { return key == token.key; }
+	};
+	static const size_t NOT_INDEX = (size_t)-1;
+	std::vector<Token> m_tokens;
+
+	void Compile(const std::string& pointer);
+	static const UnknownElement* Step(const UnknownElement& element, const Token& token) {
+		if (element.IsOfType<Object>()) {
+			const Object& object = element;
+			Object::const_iterator it = object.Find(token.key, token.nHash);
+			return it != object.End() ? &it->element : NULL;
+		}
+		if (element.IsOfType<Array>()) {
+			const Array& array = element;
+			return token.nIndex < array.Size() ? &array[token.nIndex] : NULL;
+		}
+		return NULL;
+	}
+	static TapeValue Step(const TapeValue& value, const Token& token) {
+		if (value.IsObject()) {
+			for (TapeValue::Iterator it = value.Begin(), it_end = value.End(); it != it_end; ++it) {
+				if (KeyMatches(it, token))
+					return it.Value();
+			}
+			return TapeValue();
+		}
+		return token.nIndex != NOT_INDEX ? value[token.nIndex] : TapeValue();
+	}
+	// Whether the member an object iterator is at has the token's key:
+	static bool KeyMatches(const TapeValue::Iterator& it, const Token& token) {
+		return it.KeyLength() == token.key.size() && memcmp(it.Key(), token.key.data(), token.key.size()) == 0;
+	}
+};
+
+class PathSet {
+public:
+	PathSet() : m_numPaths(0) { m_nodes.push_back(Node()); }
+
+	// Add a path to look up, giving its index in the results of Find():
+	size_t Add(const Path& path) {
+		size_t node = 0;
+		for (size_t i = 0; i < path.m_tokens.size(); i++)
+			node = Child(node, path.m_tokens[i]);
+		m_nodes[node].paths.push_back(m_numPaths);
+		return m_numPaths++;
+	}
+	size_t Add(const std::string& pointer) { return Add(Path(pointer)); }
+	size_t Size() const { return m_numPaths; }
+
+	// Look up every path, setting results[i] to what the i'th one added leads to (NULL or invalid if nothing).
+	// results can be reused from one document to the next without allocating again.
+	void Find(const UnknownElement& root, std::vector<const UnknownElement*>& results) const {
+		results.assign(m_numPaths, NULL);
+		Visit(0, root, results);
+	}
+	void Find(const TapeValue& root, std::vector<TapeValue>& results) const {
+		results.assign(m_numPaths, TapeValue());
+		if (root.IsValid())
+			Visit(0, root, results);
+	}
+
+private:
+	// The paths make a tree, with the paths that start the same way sharing nodes:
+	struct Node {
+		Path::Token token; // The key/index that leads here from the parent (unused for the root)
+		std::vector<size_t> children; // Indices in m_nodes
+		std::vector<size_t> paths; // The paths that end here
+	};
+	std::vector<Node> m_nodes;
+	size_t m_numPaths;
+
+	size_t Child(size_t node, const Path::Token& token) {
+		for (size_t i = 0; i < m_nodes[node].children.size(); i++) {
+			if (m_nodes[m_nodes[node].children[i]].token == token)
+				return m_nodes[node].children[i];
+		}
+		const size_t child = m_nodes.size();
+		m_nodes.push_back(Node());
+		m_nodes[child].token = token;
+		m_nodes[node].children.push_back(child);
+		return child;
+	}
+
+	void Visit(size_t node, const UnknownElement& element, std::vector<const UnknownElement*>& results) const {
+		const Node& n = m_nodes[node];
+		for (size_t i = 0; i < n.paths.size(); i++)
+			results[n.paths[i]] = &element;
+		for (size_t i = 0; i < n.children.size(); i++) {
+			if (const UnknownElement* pChild = Path::Step(element, m_nodes[n.children[i]].token))
+				Visit(n.children[i], *pChild, results);
+		}
+	}
+	void Visit(size_t node, const TapeValue& value, std::vector<TapeValue>& results) const {
+		const Node& n = m_nodes[node];
+		for (size_t i = 0; i < n.paths.size(); i++)
+			results[n.paths[i]] = value;
+		if (n.children.empty())
+			return;
+		if (n.children.size() == 1 || !value.IsObject()) {
+			// Arrays can be indexed directly, and a single key needs only one scan anyway
+			for (size_t i = 0; i < n.children.size(); i++) {
+				const TapeValue child = Path::Step(value, m_nodes[n.children[i]].token);
+				if (child.IsValid())
+					Visit(n.children[i], child, results);
+			}
+			return;
+		}
+		// One pass over the members for all the keys, stopping once every one of them is found
+		size_t numLeft = n.children.size();
+		for (TapeValue::Iterator it = value.Begin(), it_end = value.End(); it != it_end && numLeft; ++it) {
+			for (size_t i = 0; i < n.children.size(); i++) {
+				if (Path::KeyMatches(it, m_nodes[n.children[i]].token)) {
+					Visit(n.children[i], it.Value(), results);
+					numLeft--;
+					break;
+				}
+			}
+		}
+	}
+};
+
+inline void Path::Compile(const std::string& pointer) {
+	if (!pointer.empty() && pointer[0] != '/')
+		throw Exception("JSON pointer doesn't start with '/': " + pointer);
+	for (size_t pos = 0; pos < pointer.size(); ) {
+		const size_t end = std::min(pointer.find('/', pos + 1), pointer.size());
+		Token token;
+		for (size_t i = pos + 1; i < end; i++) {
+			if (pointer[i] != '~')
+				token.key += pointer[i];
+			else if (i + 1 < end && (pointer[i + 1] == '0' || pointer[i + 1] == '1'))
+				token.key += pointer[++i] == '0' ? '~' : '/';
+			else
+				throw Exception("Bad escape in JSON pointer: " + pointer);
+		}
+		token.nHash = Name::Hash(token.key.data(), token.key.size());
+		// An index is digits without leading zeros ("-", for past the end, never matches anything here)
+		token.nIndex = token.key.empty() || (token.key[0] == '0' && token.key.size() > 1) || token.key.size() > 9 ? NOT_INDEX : 0;
+		for (size_t i = 0; i < token.key.size() && token.nIndex != NOT_INDEX; i++)
+			token.nIndex = token.key[i] >= '0' && token.key[i] <= '9' ? token.nIndex * 10 + (token.key[i] - '0') : NOT_INDEX;
+		m_tokens.push_back(token);
+		pos = end;
+	}
+}
+
+inline std::string Path::ToString() const {
+	std::string pointer;
+	for (size_t i = 0; i < m_tokens.size(); i++) {
+		pointer += '/';
+		for (size_t j = 0; j < m_tokens[i].key.size(); j++) {
+			const char c = m_tokens[i].key[j];
+			if (c == '~')
+				pointer += "~0";
+			else if (c == '/')
+				pointer += "~1";
+			else
+				pointer += c;
+		}
+	}
+	return pointer;
+}
+
+} // End namespace
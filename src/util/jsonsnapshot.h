@@ -0,0 +1,152 @@
+// jsonsnapshot.h:
+// A tape (see jsontape.h) saved to a file, so that a big JSON document that
+// the app reads at every launch (e.g. a cached config or feed) is only
+// parsed the first time: after that, the snapshot is loaded, memory-mapped
+// if it is big enough (see FileData), and its values are read straight off
+// it with TapeValue, without parsing or building anything, e.g.
+//     json::TapeSnapshot config;
+//     config.Open("cache://config.json", "cache://config.tape");
+//     int interval = config.Root()["refresh"].AsInteger(60);
+// Open() parses the JSON file instead, and saves a new snapshot, whenever the
+// file has changed since the snapshot was saved.
+//
+// A snapshot is stamped with a number that identifies what it was made from:
+// for a file, GetFileStamp() (its size and modification time), or anything
+// better that the caller has, e.g. a hash of a response's ETag (see Load()).
+// It is only loaded back with the same stamp.
+//
+// Format: "JTS1", uint32 0x01020304 (to catch a different byte order), uint64
+// stamp, uint64 tape size, then the tape. A snapshot is not meant to leave the
+// device that saved it: beyond its header and the size of its root record, it
+// is trusted as the tape it was.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <exception>
+#include <string>
+
+#include "s3eDebug.h"
+#include "iohelpers.h"
+#include "jsontape.h"
+
+namespace json {
+
+class TapeSnapshot {
+public:
+	TapeSnapshot() : m_pTape(NULL), m_size(0) {}
+
+	// Load the snapshot at snapshotPath, if it was saved with stamp. Returns false, leaving this empty, if there is
+	// none, or it was made from something else, or it is damaged.
+	bool Load(const char* snapshotPath, uint64_t stamp) {
+		Clear();
+		if (!IsFile(snapshotPath))
+			return false;
+		try {
+			m_file.Open(snapshotPath);
+		} catch (const std::exception&) {
+			return false;
+		}
+		const char* p = m_file.Data();
+		if (m_file.Size() < HEADER_SIZE || memcmp(p, "JTS1", 4) != 0 || Tape::ReadU32(p + 4) != (uint32_t)BYTE_ORDER_MARK ||
+			ReadU64(p + 8) != stamp || ReadU64(p + 16) != m_file.Size() - HEADER_SIZE || m_file.Size() == HEADER_SIZE ||
+			TapeValue::Skip(p + HEADER_SIZE) != p + m_file.Size()) {
+			m_file.Close();
+			return false;
+		}
+		m_pTape = p + HEADER_SIZE;
+		m_size = m_file.Size() - HEADER_SIZE;
+		return true;
+	}
+
+	// Save a tape, or a snapshot of given elements (ElementTypeT may be UnknownElement, Object, Array, etc.), as a
+	// new snapshot at snapshotPath. Throws json::Exception if it can't be written.
+	static void Save(const char* snapshotPath, const char* pTape, size_t size, uint64_t stamp) {
+		char header[HEADER_SIZE];
+		memcpy(header, "JTS1", 4);
+		Tape::WriteU32(header + 4, BYTE_ORDER_MARK);
+		memcpy(header + 8, &stamp, sizeof(stamp));
+		const uint64_t size64 = size;
+		memcpy(header + 16, &size64, sizeof(size64));
+		// Write a new snapshot and then replace the old one, so that a half-written one is never loaded:
+		const std::string tmp_path = std::string(snapshotPath) + ".tmp";
+		s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+		if (!p_file)
+			throw Exception("Unable to write " + tmp_path);
+		const bool written = s3eFileWrite(header, 1, HEADER_SIZE, p_file) == HEADER_SIZE && s3eFileWrite(pTape, 1, size, p_file) == size;
+		s3eFileClose(p_file);
+		if (!written) {
+			s3eFileDelete(tmp_path.c_str());
+			throw Exception("Unable to write " + tmp_path);
+		}
+		if (IsFile(snapshotPath))
+			s3eFileDelete(snapshotPath);
+		if (s3eFileRename(tmp_path.c_str(), snapshotPath) != S3E_RESULT_SUCCESS)
+			throw Exception(std::string("Unable to write ") + snapshotPath);
+	}
+	template <typename ElementTypeT>
+	static void Save(const char* snapshotPath, const ElementTypeT& element, uint64_t stamp) {
+		TapeWriter writer;
+		ElementReplayer::Replay(element, writer);
+		if (writer.OutOfMemory())
+			throw Exception("Out of memory recording a JSON tape");
+		Save(snapshotPath, writer.Data(), writer.Size(), stamp);
+	}
+
+	// Load the snapshot of the JSON file at sourcePath, if it is up to date, or else parse the file (onto a tape,
+	// without building any elements) and save a snapshot of it for next time. Throws json::Exception (or a
+	// runtime_error, if the file can't be read) as Reader would; failing to save the snapshot is only traced.
+	void Open(const char* sourcePath, const char* snapshotPath) {
+		const uint64_t stamp = GetFileStamp(sourcePath);
+		if (Load(snapshotPath, stamp))
+			return;
+		TapeWriter writer;
+		{
+			const FileData source(sourcePath);
+			PushParser parser(writer);
+			parser.Feed(source.Data(), source.Size());
+			parser.Finish();
+		}
+		m_parsed.Adopt(writer);
+		m_pTape = m_parsed.Data();
+		m_size = m_parsed.Size();
+		try {
+			Save(snapshotPath, m_pTape, m_size, stamp);
+		} catch (const Exception& e) {
+			s3eDebugTracePrintf("TapeSnapshot: %s", e.what()); // (We'll just parse it again next time)
+		}
+	}
+
+	// A stamp for the file at path, from its size and modification time, or 0 if there is no such file:
+	static uint64_t GetFileStamp(const char* path) {
+		const int64 size = s3eFileGetFileInt(path, S3E_FILE_SIZE);
+		const int64 modified = s3eFileGetFileInt(path, S3E_FILE_MODIFIED_DATE);
+		if (size < 0 || modified < 0)
+			return 0;
+		return ((uint64_t)modified * 1099511628211ULL) ^ (uint64_t)size;
+	}
+
+	void Clear() { m_file.Close(); m_parsed.Clear(); m_pTape = NULL; m_size = 0; }
+	bool Empty() const { return m_size == 0; }
+	const char* Data() const { return m_pTape; }
+	size_t Size() const { return m_size; }
+	bool IsMapped() const { return m_file.IsMapped(); }
+	TapeValue Root() const { return m_size ? TapeValue(m_pTape) : TapeValue(); }
+
+private:
+	enum { HEADER_SIZE = 24, BYTE_ORDER_MARK = 0x01020304 };
+	static uint64_t ReadU64(const char* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+	FileData m_file; // The snapshot, if it was loaded
+	TapeDocument m_parsed; // Or the tape, if Open() had to parse the source
+	const char* m_pTape;
+	size_t m_size;
+	TapeSnapshot(const TapeSnapshot&);
+	TapeSnapshot& operator=(const TapeSnapshot&);
+};
+
+} // End namespace
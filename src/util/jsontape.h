@@ -0,0 +1,379 @@
+// jsontape.h:
+// A compact, flat recording ("tape") of a JSON document, as produced by
+// json::PushParser. A worker thread can parse a document into a tape while
+// it downloads, and the app thread can later either replay the tape to build
+// the document's elements, which is much cheaper than scanning the text
+// again, or read values straight off the tape using TapeValue, which does
+// not need to build anything at all.
+//
+// The tape is a single block of memory with no pointers in it (every offset
+// is relative to the record it belongs to), so it can be read from any
+// thread, and moved or copied with a plain memcpy (see TapeDocument). It is
+// allocated with malloc()/realloc() by whichever thread records it, and must
+// be freed (see TapeWriter::Free()) by that same thread.
+//
+// Format: a sequence of records, each starting with a one-byte Tag:
+//   TAG_OBJECT/TAG_ARRAY: uint32 size of this record up to and including the matching TAG_*_END,
+//                         uint32 number of members/elements
+//   TAG_KEY/TAG_STRING:   uint32 length, then that many bytes, then '\0'
+//   TAG_NUMBER:           double
+//   TAG_INTEGER:          int64 (numbers that were plain integers in the text)
+//   anything else:        nothing more
+// Multi-byte values are stored unaligned, in native byte order.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "json.h"
+
+namespace json {
+
+namespace Tape {
+	enum Tag {
+		TAG_OBJECT = 1,
+		TAG_OBJECT_END,
+		TAG_ARRAY,
+		TAG_ARRAY_END,
+		TAG_KEY,
+		TAG_STRING,
+		TAG_NUMBER,
+		TAG_TRUE,
+		TAG_FALSE,
+		TAG_NULL,
+		TAG_INTEGER,
+	};
+	const size_t CONTAINER_HEADER_SIZE = 1 + 2 * sizeof(uint32_t);
+	const size_t STRING_HEADER_SIZE = 1 + sizeof(uint32_t);
+	inline uint32_t ReadU32(const char* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+	inline void WriteU32(char* p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+	inline double ReadDouble(const char* p) { double v; memcpy(&v, p, sizeof(v)); return v; }
+	inline int64_t ReadInt64(const char* p) { int64_t v; memcpy(&v, p, sizeof(v)); return v; }
+}
+
+// TapeWriter: a SaxHandler that records everything it is given onto a tape.
+class TapeWriter : public SaxHandler {
+public:
+	// Where a tape's memory can come from instead of malloc()/realloc(), e.g. a scratch arena that is
+	// thrown away along with the tape. Both are called on the thread that records the tape.
+	class Allocator {
+	public:
+		virtual void* Realloc(void* p, size_t oldSize, size_t newSize) = 0; // Like realloc(), NULL if out of memory
+		virtual void Free(void* p, size_t size) = 0;
+	protected:
+		~Allocator() {}
+	};
+
+	explicit TapeWriter(Allocator* pAllocator = NULL) : m_pAllocator(pAllocator), m_pData(NULL), m_size(0), m_capacity(0), m_bOutOfMemory(false) {}
+	~TapeWriter() { Free(); }
+
+	virtual void ObjectBegin() { BeginContainer(Tape::TAG_OBJECT); }
+	virtual void ObjectEnd() { EndContainer(Tape::TAG_OBJECT_END); }
+	virtual void ArrayBegin() { BeginContainer(Tape::TAG_ARRAY); }
+	virtual void ArrayEnd() { EndContainer(Tape::TAG_ARRAY_END); }
+	virtual void Key(const std::string& name) { PutString(Tape::TAG_KEY, name); }
+	virtual void Value(const std::string& string) { CountValue(); PutString(Tape::TAG_STRING, string); }
+	virtual void Value(double number) { CountValue(); PutTag(Tape::TAG_NUMBER); Put(&number, sizeof(number)); }
+	virtual void Value(bool boolean) { CountValue(); PutTag(boolean ? Tape::TAG_TRUE : Tape::TAG_FALSE); }
+	virtual void NullValue() { CountValue(); PutTag(Tape::TAG_NULL); }
+	virtual void IntegerValue(long long number) { CountValue(); PutTag(Tape::TAG_INTEGER); const int64_t v = number; Put(&v, sizeof(v)); }
+
+	const char* Data() const { return m_pData; }
+	size_t Size() const { return m_size; }
+	bool OutOfMemory() const { return m_bOutOfMemory; } // If true, the tape is incomplete
+	bool HasAllocator() const { return m_pAllocator != NULL; }
+	void Free() {
+		if (m_pAllocator)
+			m_pAllocator->Free(m_pData, m_capacity);
+		else
+			free(m_pData);
+		m_pData = NULL;
+		m_size = m_capacity = 0;
+		std::vector<size_t>().swap(m_openContainers);
+	}
+	// Hand the tape over to the caller, who must free() it from this same thread (so not for tapes that
+	// have an Allocator):
+	char* Release(size_t& size) { assert(!m_pAllocator); char* p_data = m_pData; size = m_size; m_pData = NULL; Free(); return p_data; }
+
+private:
+	Allocator* const m_pAllocator;
+	char* m_pData;
+	size_t m_size;
+	size_t m_capacity;
+	bool m_bOutOfMemory;
+	std::vector<size_t> m_openContainers; // Offset of each open TAG_OBJECT/TAG_ARRAY record
+
+	void Put(const void* p, size_t n) {
+		if (m_bOutOfMemory)
+			return;
+		if (m_size + n > m_capacity) {
+			size_t new_capacity = m_capacity ? m_capacity * 2 : 4096;
+			while (new_capacity < m_size + n)
+				new_capacity *= 2;
+			char* p_new = (char*)(m_pAllocator ? m_pAllocator->Realloc(m_pData, m_capacity, new_capacity) : realloc(m_pData, new_capacity));
+			if (!p_new) {
+				m_bOutOfMemory = true;
+				return;
+			}
+			m_pData = p_new;
+			m_capacity = new_capacity;
+		}
+		memcpy(m_pData + m_size, p, n);
+		m_size += n;
+	}
+	void PutTag(Tape::Tag tag) { const char c = (char)tag; Put(&c, 1); }
+	void PutU32(size_t value) { const uint32_t v = (uint32_t)value; Put(&v, sizeof(v)); }
+	void PutString(Tape::Tag tag, const std::string& s) { PutTag(tag); PutU32(s.size()); Put(s.c_str(), s.size() + 1); }
+	void CountValue() {
+		// Bump the member/element count of the enclosing container:
+		if (m_openContainers.empty() || m_bOutOfMemory)
+			return;
+		char* p_count = m_pData + m_openContainers.back() + 1 + sizeof(uint32_t);
+		Tape::WriteU32(p_count, Tape::ReadU32(p_count) + 1);
+	}
+	void BeginContainer(Tape::Tag tag) {
+		CountValue();
+		m_openContainers.push_back(m_size);
+		PutTag(tag);
+		PutU32(0); // Size, filled in by EndContainer()
+		PutU32(0); // Count, incremented by CountValue()
+	}
+	void EndContainer(Tape::Tag tag) {
+		PutTag(tag);
+		if (!m_bOutOfMemory)
+			Tape::WriteU32(m_pData + m_openContainers.back() + 1, (uint32_t)(m_size - m_openContainers.back()));
+		m_openContainers.pop_back();
+	}
+};
+
+// Replay a tape recorded by TapeWriter into handler (e.g. a DomBuilder, to build the elements):
+inline void ReplayTape(const char* pData, size_t size, SaxHandler& handler) {
+	const char* p = pData;
+	const char* p_end = pData + size;
+	std::string s;
+	while (p < p_end) {
+		const Tape::Tag tag = (Tape::Tag)*p;
+		switch (tag) {
+			case Tape::TAG_OBJECT:     handler.ObjectBegin(); p += Tape::CONTAINER_HEADER_SIZE; break;
+			case Tape::TAG_OBJECT_END: handler.ObjectEnd(); p++; break;
+			case Tape::TAG_ARRAY:      handler.ArrayBegin(); handler.ArraySize(Tape::ReadU32(p + 1 + sizeof(uint32_t))); p += Tape::CONTAINER_HEADER_SIZE; break;
+			case Tape::TAG_ARRAY_END:  handler.ArrayEnd(); p++; break;
+			case Tape::TAG_KEY:
+			case Tape::TAG_STRING: {
+				const uint32_t length = Tape::ReadU32(p + 1);
+				s.assign(p + Tape::STRING_HEADER_SIZE, length);
+				if (tag == Tape::TAG_KEY)
+					handler.Key(s);
+				else
+					handler.Value(s);
+				p += Tape::STRING_HEADER_SIZE + length + 1;
+				break;
+			}
+			case Tape::TAG_NUMBER:     handler.Value(Tape::ReadDouble(p + 1)); p += 1 + sizeof(double); break;
+			case Tape::TAG_TRUE:       handler.Value(true); p++; break;
+			case Tape::TAG_FALSE:      handler.Value(false); p++; break;
+			case Tape::TAG_NULL:       handler.NullValue(); p++; break;
+			case Tape::TAG_INTEGER:    handler.IntegerValue(Tape::ReadInt64(p + 1)); p += 1 + sizeof(int64_t); break;
+			default:
+				throw Exception("Corrupt JSON tape");
+		}
+	}
+}
+
+// Report elements to handler as if they were being parsed, e.g. to a TapeWriter, to record a tape of a document
+// that was built, or parsed without one. ElementTypeT may be UnknownElement, Object, Array, etc.
+class ElementReplayer : private ConstVisitor {
+public:
+	template <typename ElementTypeT>
+	static void Replay(const ElementTypeT& element, SaxHandler& handler) { ElementReplayer replayer(handler); replayer.Visit(element); }
+
+private:
+	explicit ElementReplayer(SaxHandler& handler) : m_handler(handler) {}
+
+	virtual void Visit(const Array& array) {
+		m_handler.ArrayBegin();
+		m_handler.ArraySize(array.Size());
+		for (Array::const_iterator it(array.Begin()), it_end(array.End()); it != it_end; ++it)
+			it->Accept(*this);
+		m_handler.ArrayEnd();
+	}
+	virtual void Visit(const Object& object) {
+		m_handler.ObjectBegin();
+		for (Object::const_iterator it(object.Begin()), it_end(object.End()); it != it_end; ++it) {
+			m_handler.Key(it->name);
+			it->element.Accept(*this);
+		}
+		m_handler.ObjectEnd();
+	}
+	virtual void Visit(const Number& number) {
+		if (number.IsInteger())
+			m_handler.IntegerValue(number.AsInteger());
+		else
+			m_handler.Value(number.Value());
+	}
+	virtual void Visit(const String& string) { m_handler.Value(string.Value()); }
+	virtual void Visit(const Boolean& boolean) { m_handler.Value(boolean.Value()); }
+	virtual void Visit(const Null&) { m_handler.NullValue(); }
+	void Visit(const UnknownElement& element) { element.Accept(*this); }
+
+	SaxHandler& m_handler;
+};
+
+// TapeValue: a read-only view of one value on a tape, e.g.:
+//   TapeValue root(pTapeData);
+//   std::string title = root["items"][0]["title"].AsString();
+// Looking up a missing key or index, or a value of the wrong type, gives an
+// invalid TapeValue (or the default value passed to As*()), rather than throwing.
+// Objects are searched linearly, skipping over nested values in O(1) each.
+class TapeValue {
+public:
+	TapeValue() : m_p(NULL) {}
+	explicit TapeValue(const char* pRecord) : m_p(pRecord) {}
+
+	bool IsValid() const { return m_p != NULL; }
+	Tape::Tag GetTag() const { return m_p ? (Tape::Tag)*m_p : (Tape::Tag)0; }
+	bool IsObject() const { return GetTag() == Tape::TAG_OBJECT; }
+	bool IsArray() const { return GetTag() == Tape::TAG_ARRAY; }
+	bool IsString() const { return GetTag() == Tape::TAG_STRING; }
+	bool IsNumber() const { return GetTag() == Tape::TAG_NUMBER || GetTag() == Tape::TAG_INTEGER; }
+	bool IsInteger() const { return GetTag() == Tape::TAG_INTEGER; }
+	bool IsBoolean() const { return GetTag() == Tape::TAG_TRUE || GetTag() == Tape::TAG_FALSE; }
+	bool IsNull() const { return GetTag() == Tape::TAG_NULL; }
+
+	// Number of members/elements, for objects and arrays:
+	size_t Size() const { return (IsObject() || IsArray()) ? Tape::ReadU32(m_p + 1 + sizeof(uint32_t)) : 0; }
+	double AsNumber(double defaultVal = 0) const { return IsInteger() ? (double)Tape::ReadInt64(m_p + 1) : IsNumber() ? Tape::ReadDouble(m_p + 1) : IsBoolean() ? (GetTag() == Tape::TAG_TRUE ? 1 : 0) : defaultVal; }
+	// Exact, even for integers too big for a double:
+	long long AsInteger(long long defaultVal = 0) const { return IsInteger() ? Tape::ReadInt64(m_p + 1) : IsNumber() ? (long long)Tape::ReadDouble(m_p + 1) : defaultVal; }
+	bool AsBoolean(bool defaultVal = false) const { return IsBoolean() ? GetTag() == Tape::TAG_TRUE : defaultVal; }
+	// Strings are stored with a trailing '\0', so they can be used in place:
+	const char* AsCString(const char* defaultVal = "") const { return IsString() ? m_p + Tape::STRING_HEADER_SIZE : defaultVal; }
+	size_t StringLength() const { return IsString() ? Tape::ReadU32(m_p + 1) : 0; }
+	std::string AsString(const std::string& defaultVal = std::string()) const { return IsString() ? std::string(AsCString(), StringLength()) : defaultVal; }
+
+	// For objects: like json::Object::GetOrDefault(), so that handlers can switch over easily.
+	// Only the requested member is looked at; nothing else is decoded or built.
+	int GetOrDefault(const std::string& key, int defaultVal) const { return (int)(*this)[key].AsNumber(defaultVal); }
+	long long GetOrDefault(const std::string& key, long long defaultVal) const { return (*this)[key].AsInteger(defaultVal); }
+	double GetOrDefault(const std::string& key, double defaultVal) const { return (*this)[key].AsNumber(defaultVal); }
+	bool GetOrDefault(const std::string& key, bool defaultVal) const { return (*this)[key].AsBoolean(defaultVal); }
+	std::string GetOrDefault(const std::string& key, const std::string& defaultVal) const { return (*this)[key].AsString(defaultVal); }
+	bool HasKey(const std::string& key) const { return (*this)[key].IsValid(); }
+
+	// Iterate over the members of an object or the elements of an array:
+	class Iterator {
+	public:
+		Iterator(const char* p, bool bObject) : m_p(p), m_bObject(bObject) {}
+		bool operator != (const Iterator& it) const { return m_p != it.m_p; }
+		bool operator == (const Iterator& it) const { return m_p == it.m_p; }
+		Iterator& operator ++ () { m_p = Skip(m_bObject ? Skip(m_p) : m_p); return *this; }
+		// For objects only: the member's name
+		const char* Key() const { return m_bObject ? m_p + Tape::STRING_HEADER_SIZE : NULL; }
+		size_t KeyLength() const { return m_bObject ? Tape::ReadU32(m_p + 1) : 0; }
+		TapeValue Value() const { return TapeValue(m_bObject ? Skip(m_p) : m_p); }
+	private:
+		const char* m_p; // The current element, or the current member's TAG_KEY record
+		bool m_bObject;
+	};
+	Iterator Begin() const { return (IsObject() || IsArray()) ? Iterator(m_p + Tape::CONTAINER_HEADER_SIZE, IsObject()) : Iterator(NULL, false); }
+	Iterator End() const { return (IsObject() || IsArray()) ? Iterator(Skip(m_p) - 1, IsObject()) : Iterator(NULL, false); }
+
+	TapeValue operator [] (const char* key) const {
+		if (!IsObject())
+			return TapeValue();
+		const size_t key_length = strlen(key);
+		for (Iterator it = Begin(), it_end = End(); it != it_end; ++it) {
+			if (it.KeyLength() == key_length && memcmp(it.Key(), key, key_length) == 0)
+				return it.Value();
+		}
+		return TapeValue();
+	}
+	TapeValue operator [] (const std::string& key) const { return (*this)[key.c_str()]; }
+	TapeValue operator [] (size_t index) const {
+		if (!IsArray() || index >= Size())
+			return TapeValue();
+		Iterator it = Begin();
+		while (index--)
+			++it;
+		return it.Value();
+	}
+	TapeValue operator [] (int index) const { return (*this)[(size_t)index]; } // So that [0] isn't ambiguous
+
+	// Build the elements for this value (and everything inside it):
+	void ToElement(UnknownElement& element) const {
+		if (!m_p)
+			throw Exception("Invalid TapeValue");
+		DomBuilder builder(element);
+		ReplayTape(m_p, Skip(m_p) - m_p, builder);
+	}
+
+	// Get a pointer just past the record at p (including everything inside it, for objects and arrays):
+	static const char* Skip(const char* p) {
+		switch ((Tape::Tag)*p) {
+			case Tape::TAG_OBJECT:
+			case Tape::TAG_ARRAY:  return p + Tape::ReadU32(p + 1);
+			case Tape::TAG_KEY:
+			case Tape::TAG_STRING: return p + Tape::STRING_HEADER_SIZE + Tape::ReadU32(p + 1) + 1;
+			case Tape::TAG_NUMBER: return p + 1 + sizeof(double);
+			case Tape::TAG_INTEGER: return p + 1 + sizeof(int64_t);
+			default:               return p + 1;
+		}
+	}
+
+private:
+	const char* m_p; // Our record on the tape, or NULL if invalid
+};
+
+// TapeDocument: owns a copy of a tape, e.g. so that the app thread can keep a document that a
+// worker thread parsed after the worker frees its own tape. Since the tape is flat, adopting
+// it is a single memcpy rather than a deep copy of every element.
+class TapeDocument {
+public:
+	TapeDocument() : m_pData(NULL), m_size(0) {}
+	~TapeDocument() { Clear(); }
+
+	void Assign(const char* pData, size_t size) {
+		Clear();
+		if (size == 0)
+			return;
+		m_pData = (char*)malloc(size);
+		if (!m_pData)
+			throw Exception("Out of memory copying a JSON tape");
+		memcpy(m_pData, pData, size);
+		m_size = size;
+	}
+	// Take over a tape recorded by writer on this thread, without copying it (unless it came from
+	// the writer's Allocator, which it can't leave):
+	void Adopt(TapeWriter& writer) {
+		Clear();
+		if (writer.OutOfMemory())
+			throw Exception("Out of memory recording a JSON tape");
+		if (writer.HasAllocator()) {
+			Assign(writer.Data(), writer.Size());
+			writer.Free();
+			return;
+		}
+		m_pData = writer.Release(m_size);
+	}
+	void Clear() { free(m_pData); m_pData = NULL; m_size = 0; }
+
+	bool Empty() const { return m_size == 0; }
+	const char* Data() const { return m_pData; }
+	size_t Size() const { return m_size; }
+	TapeValue Root() const { return m_size ? TapeValue(m_pData) : TapeValue(); }
+
+private:
+	char* m_pData;
+	size_t m_size;
+	TapeDocument(const TapeDocument&);
+	TapeDocument& operator=(const TapeDocument&);
+};
+
+} // End namespace
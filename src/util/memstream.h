@@ -0,0 +1,27 @@
+// memstream.h:
+// A read-only std::istream over a block of memory, so that data which is
+// already in memory (e.g. an HTTP response body) can be parsed in place
+// instead of being copied into a std::string or std::istringstream first.
+//
+// Created by the Get to Know Society
+// Public domain
+
+#pragma once
+
+#include <istream>
+#include <streambuf>
+
+class MemoryStreamBuf : public std::streambuf {
+public:
+	MemoryStreamBuf(const char* pData, size_t size) {
+		char* p = const_cast<char*>(pData); // std::streambuf wants char*, but the get area is never written to
+		setg(p, p, p + size);
+	}
+};
+
+class MemoryIStream : public std::istream {
+public:
+	MemoryIStream(const char* pData, size_t size) : std::istream(nullptr), m_buf(pData, size) { rdbuf(&m_buf); }
+private:
+	MemoryStreamBuf m_buf;
+};
@@ -2,12 +2,20 @@
 // An instrusive reference-counted smart pointer implementation for Marmalade apps.
 // Can create fairly robust smart pointers to any class that inherits from IRefCounted.
 // Can create weak pointers to any class that inherits from IObservable.
+// Classes that inherit from IAtomicRefCounted instead of IRefCounted get a thread-safe reference count.
+// Both kinds of pointer can be moved (e.g. std::move(), or returned by value): a moved Ptr<> hands over its
+// reference without touching the count, and a moved ObservingPtr<> takes the other's place in the object's
+// list of observers. Either way the one moved from is left null.
 //
 // Created by the Get to Know Society
 // Public domain
 
 #pragma once
 
+#include <utility>
+
+#include "atomic.h"
+
 ///// C++11 Null pointers are not implemented in GCC 4.4; only 4.6 /////
 // So work around the issue using this cool code from the C++0x nullptr working paper:
 // http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2007/n2431.pdf
@@ -34,7 +42,7 @@ public:
 	IObservable() : m_firstObserver(nullptr) {}
 	virtual ~IObservable() { SetObserversNull(); }
 private:
-	void* m_firstObserver; // A pointer to an ObservingPtr object
+	void* m_firstObserver; // A pointer to an ObservingPtr object, the head of a doubly-linked list of them
 	template <class T> friend class ObservingPtr;
 	inline void SetObserversNull();
 };
@@ -46,6 +54,26 @@ public:
 	
 private:
 	unsigned int m_refCount;
+	void RefUp() { m_refCount++; }
+	bool RefDown() { return --m_refCount == 0; } // Returns true if that was the last reference
+	unsigned int RefCount() const { return m_refCount; }
+	template <class T> friend class Ptr;
+};
+// Like IRefCounted, but Ptr<>s to the object may be copied and destroyed on any thread.
+// Note: this only makes the count itself thread-safe. The object is deleted by whichever thread
+// drops the last reference, so when the threads have different memory environments (see
+// HttpClientWorker.h), the last reference must still be dropped in the environment that allocated
+// the object. ObservingPtr<> is not thread-safe either way.
+class IAtomicRefCounted : public IObservable {
+public:
+	IAtomicRefCounted() : m_refCount(0) {}
+	virtual ~IAtomicRefCounted() { }
+
+private:
+	volatile unsigned int m_refCount;
+	void RefUp() { atomic::FetchAdd(m_refCount, 1u); }
+	bool RefDown() { return atomic::FetchSub(m_refCount, 1u) == 1; }
+	unsigned int RefCount() const { return atomic::LoadRelaxed(m_refCount); }
 	template <class T> friend class Ptr;
 };
 
@@ -58,6 +86,7 @@ public:
 	Ptr() : m_ptr(nullptr) {}
 	~Ptr() { down(); }
 	Ptr(const Ptr& r) throw() { m_ptr = r.m_ptr; up(); }
+	Ptr(Ptr&& r) throw() : m_ptr(r.m_ptr) { r.m_ptr = nullptr; }
 	Ptr& operator=(const Ptr& r)
 	{
 		if (this != &r) {// protect against invalid self-assignment
@@ -67,20 +96,33 @@ public:
 		}
 		return *this;
 	}
+	Ptr& operator=(Ptr&& r)
+	{
+		if (this != &r) {
+			// (Taken before the old object goes, in case deleting it drops whatever holds r)
+			Ptr old(std::move(*this));
+			m_ptr = r.m_ptr;
+			r.m_ptr = nullptr;
+		}
+		return *this;
+	}
+	void swap(Ptr& r) throw() { ObjectType* p = m_ptr; m_ptr = r.m_ptr; r.m_ptr = p; }
 	//ObjectType operator*() const throw() { return *m_ptr; }
 	ObjectType* operator->() const throw() { return m_ptr; }
 	ObjectType* ptr() const throw() { return m_ptr; }
-	int count() const throw() { return m_ptr->m_refCount; }
+	int count() const throw() { return m_ptr->RefCount(); }
 	operator bool() const throw() { return m_ptr != nullptr; }
 	bool operator ==(nullptr_t x) const throw() { return m_ptr == nullptr; }
-	bool operator ==(Ptr x) const throw() { return x.m_ptr == m_ptr; }
+	bool operator ==(const Ptr& x) const throw() { return x.m_ptr == m_ptr; }
 	template <class SubclassedType> bool isOfType() { return dynamic_cast<SubclassedType*>(m_ptr) != nullptr; }
 	template<class Subclass> Ptr(const Ptr<Subclass>& pSubclass) throw() : m_ptr(pSubclass.ptr()) { up(); } // Allow converting pointers to inherited classes
+	template<class Subclass> Ptr(Ptr<Subclass>&& pSubclass) throw() : m_ptr(pSubclass.m_ptr) { pSubclass.m_ptr = nullptr; }
 	// Comparator for use in std::map etc.
 	struct Comp { bool operator() (const Ptr<ObjectType>& x, const Ptr<ObjectType>& y) const {return x.ptr() < y.ptr();} };
 private:
 	ObjectType* m_ptr;
-	inline void up() const throw() { if (m_ptr) { m_ptr->m_refCount++; } }
+	template <class T> friend class Ptr;
+	inline void up() const throw() { if (m_ptr) { m_ptr->RefUp(); } }
 	inline void down() const throw();/* { 
 		if (m_ptr && --(m_ptr->m_refCount) == 0) { 
 			while (ObservingPtr<ObjectType>* o = (ObservingPtr<ObjectType>*)m_ptr->m_firstObserver) { 
@@ -97,12 +139,13 @@ class ObservingPtr {
 	// These observing pointers do not increase the reference count and will be automagically set NULL
 	// when the object they point to gets deleted.
 public:
-	ObservingPtr(ObjectType* ptr) : m_ptr(ptr), m_next(nullptr) { up(); }
-	ObservingPtr(Ptr<ObjectType> ptr) : m_ptr(ptr.ptr()), m_next(nullptr) { up(); }
-	ObservingPtr(nullptr_t ptr) : m_ptr(nullptr), m_next(nullptr) {}
-	ObservingPtr() : m_ptr(nullptr), m_next(nullptr) {}
+	ObservingPtr(ObjectType* ptr) : m_ptr(ptr), m_prev(nullptr), m_next(nullptr) { up(); }
+	ObservingPtr(const Ptr<ObjectType>& ptr) : m_ptr(ptr.ptr()), m_prev(nullptr), m_next(nullptr) { up(); }
+	ObservingPtr(nullptr_t ptr) : m_ptr(nullptr), m_prev(nullptr), m_next(nullptr) {}
+	ObservingPtr() : m_ptr(nullptr), m_prev(nullptr), m_next(nullptr) {}
 	~ObservingPtr() { down(); }
-	ObservingPtr(const ObservingPtr& r) throw() : m_ptr(r.m_ptr), m_next(nullptr) { up(); }
+	ObservingPtr(const ObservingPtr& r) throw() : m_ptr(r.m_ptr), m_prev(nullptr), m_next(nullptr) { up(); }
+	ObservingPtr(ObservingPtr&& r) throw() : m_ptr(nullptr), m_prev(nullptr), m_next(nullptr) { TakeOver(r); }
 	ObservingPtr& operator=(const ObservingPtr& r)
 	{
 		if (this != &r) {// protect against invalid self-assignment
@@ -112,6 +155,16 @@ public:
 		}
 		return *this;
 	}
+	ObservingPtr& operator=(ObservingPtr&& r)
+	{
+		if (this != &r) {
+			down();
+			m_ptr = nullptr;
+			TakeOver(r);
+		}
+		return *this;
+	}
+	void swap(ObservingPtr& r) throw() { ObservingPtr tmp(std::move(r)); r = std::move(*this); *this = std::move(tmp); }
 	//ObjectType operator*() const throw() { return *m_ptr; }
 	ObjectType* operator->() const throw() { return m_ptr; }
 	ObjectType* ptr() const throw() { return m_ptr; }
@@ -119,30 +172,62 @@ public:
 	operator bool() const throw() { return m_ptr != nullptr; }
 	bool operator ==(nullptr_t x) const throw() { return m_ptr == nullptr; }
 	bool operator !=(nullptr_t x) const throw() { return m_ptr != nullptr; }
-	bool operator ==(Ptr<ObjectType> x) const throw() { return x.m_ptr == m_ptr; }
-	bool operator ==(ObservingPtr x) const throw() { return x.m_ptr == m_ptr; }
+	bool operator ==(const Ptr<ObjectType>& x) const throw() { return x.ptr() == m_ptr; }
+	bool operator ==(const ObservingPtr& x) const throw() { return x.m_ptr == m_ptr; }
 	template <class SubclassedType> bool isOfType() { return dynamic_cast<SubclassedType*>(m_ptr) != nullptr; }
 private:
 	ObjectType* m_ptr;
+	ObservingPtr* m_prev; // The list is doubly linked so that observers can be added and removed in O(1)
 	ObservingPtr* m_next;
 	ObservingPtr* FirstObserver() const throw() { return static_cast<ObservingPtr*>(m_ptr->m_firstObserver); }
-	inline void up() const throw() { if (m_ptr) { const_cast<ObservingPtr*>(this)->m_next = FirstObserver(); m_ptr->m_firstObserver = const_cast<void*>((void* const)this); } }
-	inline void down() const throw() { 
-		if (m_ptr && FirstObserver() == this)
-			m_ptr->m_firstObserver = static_cast<void*>(m_next);
-		else if (m_ptr) {
-			ObservingPtr* i=FirstObserver();
-			while (i->m_next!=this) { i=i->m_next; }
-			i->m_next = this->m_next;
+	inline void up() throw() {
+		if (m_ptr) {
+			m_prev = nullptr;
+			m_next = FirstObserver();
+			if (m_next)
+				m_next->m_prev = this;
+			m_ptr->m_firstObserver = static_cast<void*>(this);
 		}
 	}
+	inline void down() throw() { 
+		if (!m_ptr)
+			return;
+		if (m_prev)
+			m_prev->m_next = m_next;
+		else
+			m_ptr->m_firstObserver = static_cast<void*>(m_next);
+		if (m_next)
+			m_next->m_prev = m_prev;
+	}
+	// Take r's place in the list (we must not be in one), leaving r null:
+	inline void TakeOver(ObservingPtr& r) throw() {
+		if (!r.m_ptr)
+			return;
+		m_ptr = r.m_ptr;
+		m_prev = r.m_prev;
+		m_next = r.m_next;
+		if (m_prev)
+			m_prev->m_next = this;
+		else
+			m_ptr->m_firstObserver = static_cast<void*>(this);
+		if (m_next)
+			m_next->m_prev = this;
+		r.m_ptr = nullptr;
+		r.m_prev = r.m_next = nullptr;
+	}
 	friend void IObservable::SetObserversNull();
 	friend class Ptr<ObjectType>;
 };
 
+// So that std::swap() and the standard algorithms find the cheap swaps:
+template <class ObjectType>
+inline void swap(Ptr<ObjectType>& a, Ptr<ObjectType>& b) throw() { a.swap(b); }
+template <class ObjectType>
+inline void swap(ObservingPtr<ObjectType>& a, ObservingPtr<ObjectType>& b) throw() { a.swap(b); }
+
 template <class ObjectType>
 inline void Ptr<ObjectType>::down() const throw() { 
-	if (m_ptr && --(m_ptr->m_refCount) == 0)
+	if (m_ptr && m_ptr->RefDown())
 		delete m_ptr; 
 }
 
@@ -721,6 +721,16 @@
 /* Define if you want to enable c-ares support */
 /* #undef USE_ARES */
 
+/* Resolve host names on a thread of their own (asyn-thread.c), so that a
+   lookup honours the connect timeout instead of blocking the transfer (and,
+   with HttpClient's multi engine, every other transfer on the same I/O
+   thread) for as long as the system resolver takes. Marmalade has POSIX
+   threads. Define CURL_MARMALADE_SYNC_RESOLVER to go back to the blocking
+   resolver. */
+#ifndef CURL_MARMALADE_SYNC_RESOLVER
+#define USE_THREADS_POSIX 1
+#endif
+
 /* if GnuTLS is enabled */
 /* #undef USE_GNUTLS */
 
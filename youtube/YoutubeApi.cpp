@@ -7,6 +7,11 @@
 
 #include "YoutubeApi.h"
 #include "iohelpers.h"
+#include "jsonfile.h"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <s3eTimer.h>
 
 using std::string;
 
@@ -43,92 +48,775 @@ GoogleOAuthRequest::GoogleOAuthRequest(const char* clientID, const char* clientT
 	SetValue("grant_type", "refresh_token");
 }
 
-YoutubeSessionRequest::YoutubeSessionRequest(string accessToken, int videoFileSize, string title, string description, int category, string privacyStatus)
+GoogleTokenProvider::GoogleTokenProvider(HttpClient& client, const char* clientID, const char* clientToken, const char* refreshToken, uint refreshMarginS)
+: m_client(client), m_clientID(clientID), m_clientToken(clientToken), m_refreshToken(refreshToken), m_refreshMarginMs(refreshMarginS * (uint64)1000),
+	m_expiryMs(0), m_retryAtMs(0) {}
+
+GoogleTokenProvider::~GoogleTokenProvider() {
+	if (m_pRefresh)
+		m_pRefresh->Abort(); // (Requests that were waiting for it are cancelled too)
+}
+
+void GoogleTokenProvider::Update() {
+	if (!m_pRefresh && !IsFresh() && s3eTimerGetMs() >= m_retryAtMs)
+		Refresh();
+}
+
+Ptr<HttpRequest> GoogleTokenProvider::Authorize(Ptr<HttpRequest> pRequest) {
+	if (!HasToken() || m_pRefresh)
+		pRequest->AddDependency(Refresh()); // The client sends the new token with it once it has arrived
+	else if (!IsFresh())
+		Refresh(); // This one can still go with the current token
+	return pRequest;
+}
+
+Ptr<HttpRequest> GoogleTokenProvider::Refresh() {
+	if (!m_pRefresh) {
+		m_pRefresh = new GoogleOAuthRequest(m_clientID.c_str(), m_clientToken.c_str(), m_refreshToken.c_str());
+		m_pRefresh->SetPriority(HttpRequest::PRIORITY_CRITICAL); // Everything else is waiting for it
+		m_client.QueueRequest(m_pRefresh, this, &GoogleTokenProvider::HandleToken);
+	}
+	return m_pRefresh;
+}
+
+bool GoogleTokenProvider::HasToken() const {
+	return !m_accessToken.empty() && s3eTimerGetMs() < m_expiryMs;
+}
+
+bool GoogleTokenProvider::IsFresh() const {
+	return !m_accessToken.empty() && s3eTimerGetMs() + m_refreshMarginMs < m_expiryMs;
+}
+
+void GoogleTokenProvider::HandleToken(Ptr<HttpRequest> pRequest) {
+	m_pRefresh = nullptr;
+	if (pRequest->GetStatus() == HttpRequest::DONE) {
+		try {
+			const json::Object& data = static_cast<GoogleOAuthRequest*>(pRequest.ptr())->GetResponse();
+			const string access_token = string((json::String)data["access_token"]);
+			const double expires_in = (json::Number)data["expires_in"];
+			m_accessToken = access_token;
+			m_expiryMs = s3eTimerGetMs() + (uint64)(expires_in * 1000);
+			m_retryAtMs = 0;
+			// Requests waiting for the token (see Authorize()) are sent right after this, and pick it up:
+			m_client.SetDefaultHeader("Authorization", string_format("Bearer %s", m_accessToken.c_str()));
+			return;
+		} catch (const json::Exception& e) { s3eDebugTracePrintf("Error: %s", e.what()); }
+	}
+	s3eDebugTracePrintf("Error: Google OAuth token refresh failed");
+	m_retryAtMs = s3eTimerGetMs() + 30000;
+}
+
+YoutubeSessionRequest::YoutubeSessionRequest(string accessToken, int64 videoFileSize, string title, string description, int category, string privacyStatus)
 : HttpPostJson("https://www.googleapis.com/upload/youtube/v3/videos?uploadType=resumable&part=snippet,status"){
-	SetHeader("Authorization", string_format("Bearer %s", accessToken.c_str()));
+	if (!accessToken.empty()) // (Otherwise it goes with the client's, e.g. from a GoogleTokenProvider)
+		SetHeader("Authorization", string_format("Bearer %s", accessToken.c_str()));
 	SetHeader("Content-Type", "application/json; charset=UTF-8");
 	SetHeader("X-upload-content-type", "video/*");
-	SetHeader("X-Upload-Content-Length", string_format("%d", videoFileSize));
+	SetHeader("X-Upload-Content-Length", string_format("%lld", (long long)videoFileSize));
 	json::Object video_resource;
 	json::Object video_snippet;
-	video_snippet["title"] = (json::String) title;
-	video_snippet["description"] = (json::String) description;
+	video_snippet["title"] = json::String(std::move(title));
+	video_snippet["description"] = json::String(std::move(description));
 	video_snippet["categoryId"] = (json::Number) category;
-	video_resource["snippet"] = video_snippet;
+	video_resource["snippet"] = std::move(video_snippet);
 	
 	json::Object video_status;
-	video_status["privacyStatus"] = (json::String) privacyStatus;
-	video_resource["status"] = video_status;
+	video_status["privacyStatus"] = json::String(std::move(privacyStatus));
+	video_resource["status"] = std::move(video_status);
 
-	SetPostData(video_resource);
+	SetPostData(std::move(video_resource));
 }
 
-YoutubeUploadRequest::YoutubeUploadRequest(string resumableURI, string accessToken, string filepath, int videoFileSize)
-: HttpRequest(PUT, resumableURI.c_str()),
-m_bytesUploaded(0),
-m_workerResponseSize(0),
-m_workerResponseBuffer(NULL),
-m_pUploadFile(nullptr),
-m_filePath(filepath)
-{
-	SetHeader("Authorization", string_format("Bearer %s", accessToken.c_str()));
-	SetHeader("Content-Type", "video/*");
-	SetHeader("Content-Length", string_format("%d", videoFileSize));
+// The API only accepts chunks that are multiples of this (apart from the last one):
+static const int64 YOUTUBE_CHUNK_GRANULARITY = 256 * 1024;
+
+// One PUT to the upload session: a chunk of the file, or (if length is 0) a query of how much of it the server has.
+class YoutubeUploadRequest::Chunk : public HttpFileUpload {
+public:
+	Chunk(const string& resumableURI, const string& filepath, int64 videoFileSize, const char* pAuthorization, int64 offset, int64 length)
+	: HttpFileUpload(resumableURI, filepath, videoFileSize, PUT, "video/*"), m_success(false), m_statusCode(0)
+	{
+		SetRange(offset, length);
+		if (pAuthorization)
+			SetHeader("Authorization", pAuthorization);
+		if (length > 0)
+			SetHeader("Content-Range", string_format("bytes %lld-%lld/%lld", (long long)offset, (long long)(offset + length - 1), (long long)videoFileSize));
+		else
+			SetHeader("Content-Range", string_format("bytes */%lld", (long long)videoFileSize));
+	}
+	
+	bool Succeeded() const { return m_success; }
+	int GetStatusCode() const { return m_statusCode; }
+	
+	virtual void HandleResponse(bool success, int httpStatusCode) {
+		m_success = success && !HasReadFailed();
+		m_statusCode = httpStatusCode;
+		HttpRequest::HandleResponse(m_success, httpStatusCode); // The YoutubeUploadRequest parses the final response itself
+	}
 	
-	m_fileSize = videoFileSize;
-	//Trace("YoutubeUploadRequest videoFileSize %d", videoFileSize);
+private:
+	bool m_success;
+	int m_statusCode;
+};
+
+YoutubeUploadRequest::YoutubeUploadRequest(HttpClient& client, string resumableURI, string accessToken, string filepath, int64 videoFileSize)
+: HttpFileUpload(resumableURI, filepath, videoFileSize, PUT, "video/*"),
+m_client(client),
+m_committed(0),
+m_chunkSize(4 * YOUTUBE_CHUNK_GRANULARITY),
+m_targetChunkMs(10000),
+m_minChunkSize(YOUTUBE_CHUNK_GRANULARITY),
+m_maxChunkSize(256 * YOUTUBE_CHUNK_GRANULARITY),
+m_maxRetries(10),
+m_numFailures(0),
+m_statusCode(0),
+m_retryPending(false)
+{
+	if (!accessToken.empty()) // (Otherwise it goes with the client's, e.g. from a GoogleTokenProvider)
+		SetHeader("Authorization", string_format("Bearer %s", accessToken.c_str()));
+	// Our own request is the first status query:
+	SetRange(0, 0);
+	SetHeader("Content-Range", string_format("bytes */%lld", (long long)m_fileSize));
+	//Trace("YoutubeUploadRequest videoFileSize %lld", (long long)videoFileSize);
 }
 
-size_t YoutubeUploadRequest::Worker_HandleUpload(const unsigned char* pData, size_t fillSize) {
-	size_t ncopy = 0;
-	if(!m_pUploadFile) {
-		m_pUploadFile = s3eFileOpen(m_filePath.c_str(), "rb");
-		if (m_pUploadFile == nullptr)
-			throw std::runtime_error("Unable to open file for uploading!");
+YoutubeUploadRequest::~YoutubeUploadRequest() {
+	if (m_retryPending)
+		s3eTimerCancelTimer(&YoutubeUploadRequest::RetryTimerCallback, this);
+	if (m_pChunk)
+		m_pChunk->Cancel();
+}
+
+YoutubeUploadRequest& YoutubeUploadRequest::SetChunking(uint targetChunkMs, int64 initialChunkSize, int64 minChunkSize, int64 maxChunkSize) {
+	m_targetChunkMs = targetChunkMs;
+	m_minChunkSize = minChunkSize < YOUTUBE_CHUNK_GRANULARITY ? YOUTUBE_CHUNK_GRANULARITY : minChunkSize / YOUTUBE_CHUNK_GRANULARITY * YOUTUBE_CHUNK_GRANULARITY;
+	m_maxChunkSize = maxChunkSize < m_minChunkSize ? m_minChunkSize : maxChunkSize / YOUTUBE_CHUNK_GRANULARITY * YOUTUBE_CHUNK_GRANULARITY;
+	m_chunkSize = initialChunkSize / YOUTUBE_CHUNK_GRANULARITY * YOUTUBE_CHUNK_GRANULARITY;
+	m_chunkSize = m_chunkSize < m_minChunkSize ? m_minChunkSize : m_chunkSize > m_maxChunkSize ? m_maxChunkSize : m_chunkSize;
+	return *this;
+}
+
+YoutubeUploadRequest& YoutubeUploadRequest::SetMaxUploadSpeed(uint64 bytesPerSecond) {
+	SetMaxSpeed(GetMaxRecvSpeed(), bytesPerSecond);
+	if (m_pChunk)
+		m_pChunk->SetMaxSpeed(m_pChunk->GetMaxRecvSpeed(), bytesPerSecond);
+	return *this;
+}
+
+double YoutubeUploadRequest::GetProgress() const {
+	if (m_fileSize <= 0)
+		return m_status == DONE ? 1 : 0;
+	const int64 in_flight = m_pChunk ? m_pChunk->GetBytesUploaded() : 0;
+	return (m_committed + in_flight) / (double)m_fileSize;
+}
+
+void YoutubeUploadRequest::Abort() {
+	if (!m_pSelf) {
+		HttpFileUpload::Abort(); // It's our own status query (if anything)
+		return;
+	}
+	if (m_retryPending) {
+		s3eTimerCancelTimer(&YoutubeUploadRequest::RetryTimerCallback, this);
+		m_retryPending = false;
 	}
-	if(m_pUploadFile) {
-		ncopy = s3eFileRead((void*)pData, 1, fillSize, m_pUploadFile);
+	if (m_pChunk) {
+		m_pChunk->Abort();
+		m_pChunk = nullptr;
 	}
-	m_bytesUploaded += ncopy;
-	//Trace("uploaded %d/%d for %0.2f", m_bytesUploaded, m_fileSize, m_bytesUploaded/((double) m_fileSize));
-	return ncopy;
+	ForgetCallbacks();
+	m_status = CANCELLED;
+	FinishProgressCounter();
+	Ptr<YoutubeUploadRequest> p_this = m_pSelf; // We may be deleted once this goes out of scope
+	m_pSelf = nullptr;
 }
 
-size_t YoutubeUploadRequest::Worker_HandleData(const unsigned char* contents, size_t size) {
-	if (size > 0) {
-		m_workerResponseBuffer = (const char*)realloc((void*)m_workerResponseBuffer, m_workerResponseSize + size);
-		if (m_workerResponseBuffer) {
-			memcpy((void*)(m_workerResponseBuffer + m_workerResponseSize), (void*)contents, size);
-			m_workerResponseSize += size;
+void YoutubeUploadRequest::HandleResponse(bool success, int httpStatusCode) {
+	// Our status stays HEADERS until the whole file is up, so our callback won't be called yet:
+	m_pSelf = this;
+	HandleStatus(success && !m_readFailed, httpStatusCode, GetResponseHeaders(), m_responseBody);
+}
+
+void YoutubeUploadRequest::HandleChunkDone(Ptr<HttpRequest> pChunk) {
+	Chunk* p_chunk = static_cast<Chunk*>(pChunk.ptr());
+	m_pChunk = nullptr;
+	if (p_chunk->HasReadFailed()) {
+		s3eDebugTracePrintf("Error: Unable to read %s for uploading", m_filePath.c_str());
+		Finish(false);
+		return;
+	}
+	if (p_chunk->Succeeded() && p_chunk->Worker_GetUploadSize() >= m_minChunkSize) {
+		// Size the next chunk to take about m_targetChunkMs at the throughput we just got (status queries and short
+		// last chunks are mostly latency, so they don't count):
+		const double throughput = p_chunk->GetUploadThroughput();
+		if (throughput > 0) {
+			int64 size = (int64)(throughput * m_targetChunkMs / 1000) / YOUTUBE_CHUNK_GRANULARITY * YOUTUBE_CHUNK_GRANULARITY;
+			m_chunkSize = size < m_minChunkSize ? m_minChunkSize : size > m_maxChunkSize ? m_maxChunkSize : size;
 		}
 	}
-	return size;
+	HandleStatus(p_chunk->Succeeded(), p_chunk->GetStatusCode(), p_chunk->GetResponseHeaders(), p_chunk->GetResponseBody());
 }
 
-void YoutubeUploadRequest::HandleResponse(bool success, int httpStatusCode) {
-	HttpRequest::HandleResponse(success, httpStatusCode);
-	string response(m_workerResponseBuffer, m_workerResponseSize);
-	if (success) {
+void YoutubeUploadRequest::HandleStatus(bool success, int httpStatusCode, const HttpHeaders& responseHeaders, const HttpResponseBody& body) {
+	m_statusCode = httpStatusCode;
+	if (success && (httpStatusCode == 200 || httpStatusCode == 201)) {
+		// The whole video is up, and the response is its resource:
 		s3eDebugTracePrintf("Youtube upload request succeeded (%s %s)", GetMethodStr(), m_url.c_str());
-		if (response.empty()) {
+		if (body.Empty())
 			s3eDebugTracePrintf("Warning: Empty response body from youtube upload call.");
-			m_responseData = json::Null();
-		} else if (response[0] == '[' || response[0] == '{') {
-			// Parse the response as a JSON object or array:
-			try {
-				std::istringstream json_istream(response);
-				json::Reader::Read(m_responseData, json_istream);
-			} catch(const json::Exception &e) {
-				s3eDebugTracePrintf("Error: Unable to parse JSON response: %s", e.what());
-				m_status = ERROR;
-			}
+		m_committed = m_fileSize;
+		m_status = DONE;
+		ParseResponse(body);
+		Finish(m_status == DONE);
+	} else if (success && httpStatusCode == 308) {
+		// "Resume Incomplete". The Range header, if any, says how much the server has: "bytes=0-<last byte>"
+		int64 committed = 0;
+		const char* p_range = responseHeaders.Find("Range");
+		long long last = -1;
+		if (p_range && sscanf(p_range, "bytes=0-%lld", &last) == 1)
+			committed = last + 1;
+		if (committed > m_committed)
+			m_numFailures = 0;
+		m_committed = committed;
+		if (m_committed < m_fileSize) {
+			const int64 remaining = m_fileSize - m_committed;
+			QueueChunk(m_committed, remaining < m_chunkSize ? remaining : m_chunkSize);
+		} else if (++m_numFailures > m_maxRetries) {
+			Finish(false); // It has all of the file, but won't say that it's done
 		} else {
-			m_responseData = json::String(response);
-			s3eDebugTracePrintf("Response: %s", string(json::String(response)).c_str());
+			Retry();
+		}
+	} else if (httpStatusCode == 0 || httpStatusCode >= 500 || httpStatusCode == 429) {
+		// The connection dropped, or the server is having trouble: find out what it got, after a while
+		s3eDebugTracePrintf("Youtube upload interrupted at %lld/%lld bytes. Response code %d", (long long)m_committed, (long long)m_fileSize, httpStatusCode);
+		if (++m_numFailures > m_maxRetries) {
+			Finish(false);
+			return;
 		}
-		
+		// Smaller chunks waste less when the connection is this unreliable:
+		const int64 half = m_chunkSize / 2 / YOUTUBE_CHUNK_GRANULARITY * YOUTUBE_CHUNK_GRANULARITY;
+		m_chunkSize = half < m_minChunkSize ? m_minChunkSize : half;
+		Retry();
 	} else {
+		// E.g. 404 if the session has expired (a new YoutubeSessionRequest is needed), or 401 if the access token has
 		s3eDebugTracePrintf("Error with Youtube upload request. Response code %d", httpStatusCode);
-		s3eDebugTraceLine(response.c_str());
+		if (!body.Empty())
+			s3eDebugTraceLine(body.Data());
+		Finish(false);
+	}
+}
+
+void YoutubeUploadRequest::Retry() {
+	const uint delay_ms = 1000 << (m_numFailures > 6 ? 5 : m_numFailures - 1); // 1 s, 2 s, 4 s... 32 s
+	m_retryPending = s3eTimerSetTimer(delay_ms, &YoutubeUploadRequest::RetryTimerCallback, this) == S3E_RESULT_SUCCESS;
+	if (!m_retryPending)
+		QueueChunk(m_committed, 0);
+}
+
+int32 YoutubeUploadRequest::RetryTimerCallback(void* systemData, void* pUpload) {
+	YoutubeUploadRequest* p_upload = reinterpret_cast<YoutubeUploadRequest*>(pUpload);
+	p_upload->m_retryPending = false;
+	p_upload->QueueChunk(p_upload->m_committed, 0); // Ask how much of the file the server has
+	return 0;
+}
+
+void YoutubeUploadRequest::QueueChunk(int64 offset, int64 length) {
+	m_pChunk = new Chunk(m_url, m_filePath, m_fileSize, GetRequestHeaders().Find("Authorization"), offset, length);
+	m_pChunk->SetReadAheadSize(m_readAheadSize);
+	m_pChunk->SetPriority(GetPriority());
+	m_pChunk->SetMaxSpeed(0, GetMaxSendSpeed());
+	m_client.QueueRequest(m_pChunk, this, &YoutubeUploadRequest::HandleChunkDone);
+}
+
+void YoutubeUploadRequest::Finish(bool success) {
+	m_status = success ? DONE : ERROR;
+	Ptr<YoutubeUploadRequest> p_this = m_pSelf; // We may be deleted once this goes out of scope
+	m_pSelf = nullptr;
+	NotifyDone();
+}
+
+const string* YoutubeETagStore::FindETag(const string& url) const {
+	auto it = m_entries.find(url);
+	return it != m_entries.end() ? &it->second.etag : nullptr;
+}
+
+const json::UnknownElement* YoutubeETagStore::FindResponse(const string& url) {
+	auto it = m_entries.find(url);
+	if (it == m_entries.end())
+		return nullptr;
+	it->second.lastUsed = ++m_useCount;
+	return &it->second.response;
+}
+
+void YoutubeETagStore::Store(const string& url, const string& etag, const json::UnknownElement& response) {
+	auto it = m_entries.find(url);
+	if (it == m_entries.end()) {
+		if (m_entries.size() >= m_maxEntries && !m_entries.empty()) {
+			// Make room by forgetting the one that was used longest ago:
+			auto oldest = m_entries.begin();
+			for (auto it_entry = m_entries.begin(); it_entry != m_entries.end(); it_entry++) {
+				if (it_entry->second.lastUsed < oldest->second.lastUsed)
+					oldest = it_entry;
+			}
+			m_entries.erase(oldest);
+		}
+		it = m_entries.insert(std::make_pair(url, Entry())).first;
+	}
+	it->second.etag = etag;
+	it->second.response = response;
+	it->second.lastUsed = ++m_useCount;
+}
+
+void YoutubeETagStore::Remove(const string& url) {
+	m_entries.erase(url);
+}
+
+static const char* const YOUTUBE_API_URL = "https://www.googleapis.com/youtube/v3/";
+
+YoutubeListRequest::YoutubeListRequest(string accessToken, const char* resource, const string& query, const string& fields, YoutubeETagStore* pETags)
+: HttpPost(GET, string(YOUTUBE_API_URL).append(resource).append(1, '?').append(query).append(query.empty() ? "fields=" : "&fields=").append(UrlEncode(fields))),
+m_pETags(pETags),
+m_notModified(false)
+{
+	IwAssert(HTTP_CLIENT, !fields.empty()); // Full responses are what these requests are for avoiding
+	if (!accessToken.empty()) // (Otherwise it goes with the client's, e.g. from a GoogleTokenProvider)
+		SetHeader("Authorization", string_format("Bearer %s", accessToken.c_str()));
+	SetUseCache(false); // Our ETag store revalidates instead
+	const string* p_etag = m_pETags ? m_pETags->FindETag(m_url) : nullptr;
+	if (p_etag)
+		SetHeader("If-None-Match", *p_etag);
+}
+
+string YoutubeListRequest::GetNextPageToken() const {
+	if (!m_responseData.IsOfType<json::Object>())
+		return string();
+	const json::Object& data = m_responseData;
+	json::Object::const_iterator it = data.Find("nextPageToken");
+	return it != data.End() && it->element.IsOfType<json::String>() ? string((const json::String&)it->element) : string();
+}
+
+void YoutubeListRequest::HandleResponse(bool success, int httpStatusCode) {
+	const json::UnknownElement* p_stored = success && httpStatusCode == 304 && m_pETags ? m_pETags->FindResponse(m_url) : nullptr;
+	if (p_stored) {
+		// Unchanged since we last asked: it's the response we have
+		HttpRequest::HandleResponse(true, httpStatusCode);
+		m_notModified = true;
+		m_responseData = *p_stored;
+		return;
+	}
+	HttpPost::HandleResponse(success && httpStatusCode != 304, httpStatusCode); // (A 304 we have nothing for is an error)
+	if (m_status != DONE || !m_pETags || m_responseAsTape)
+		return;
+	// The ETag header, or else the resource's own (if the mask asks for it), which is the same:
+	const char* p_etag = GetResponseHeaders().Find("ETag");
+	string etag = p_etag ? p_etag : "";
+	if (etag.empty() && m_responseData.IsOfType<json::Object>()) {
+		const json::Object& data = m_responseData;
+		json::Object::const_iterator it = data.Find("etag");
+		if (it != data.End() && it->element.IsOfType<json::String>())
+			etag = string("\"").append((const json::String&)it->element).append(1, '"');
+	}
+	if (!etag.empty())
+		m_pETags->Store(m_url, etag, m_responseData);
+	else
+		m_pETags->Remove(m_url);
+}
+
+const char* const YoutubeVideosListRequest::DEFAULT_PART = "snippet,status,processingDetails";
+const char* const YoutubeVideosListRequest::DEFAULT_FIELDS =
+	"etag,items(id,snippet(title,publishedAt,thumbnails/default/url),status(uploadStatus,failureReason,rejectionReason,privacyStatus),"
+	"processingDetails(processingStatus,processingProgress,processingFailureReason))";
+
+// "part=...&id=a,b,c" (the IDs aren't encoded, so that the commas stay as they are)
+static string YoutubeVideosListRequest_Query(const char* part, const std::vector<string>& videoIds) {
+	IwAssert(HTTP_CLIENT, !videoIds.empty() && videoIds.size() <= 50);
+	string query;
+	HttpRequest::AppendQueryParam(query, "part", part);
+	query.append("&id=");
+	for (size_t i = 0; i < videoIds.size(); i++) {
+		if (i)
+			query.append(1, ',');
+		HttpRequest::UrlEncode(videoIds[i].data(), videoIds[i].size(), query);
+	}
+	return query;
+}
+
+YoutubeVideosListRequest::YoutubeVideosListRequest(string accessToken, const std::vector<string>& videoIds, YoutubeETagStore* pETags, const char* part, const char* fields)
+: YoutubeListRequest(std::move(accessToken), "videos", YoutubeVideosListRequest_Query(part, videoIds), fields, pETags) {}
+
+const char* const YoutubePlaylistItemsListRequest::DEFAULT_PART = "snippet";
+const char* const YoutubePlaylistItemsListRequest::DEFAULT_FIELDS =
+	"etag,nextPageToken,pageInfo/totalResults,items(snippet(title,publishedAt,resourceId/videoId,thumbnails/default/url))";
+
+static string YoutubePlaylistItemsListRequest_Query(const char* part, const string& playlistId, const string& pageToken, uint maxResults) {
+	string query;
+	HttpRequest::AppendQueryParam(query, "part", part);
+	HttpRequest::AppendQueryParam(query, "playlistId", playlistId);
+	HttpRequest::AppendQueryParam(query, "maxResults", string_format("%u", maxResults < 1 ? 1 : maxResults > 50 ? 50 : maxResults));
+	if (!pageToken.empty())
+		HttpRequest::AppendQueryParam(query, "pageToken", pageToken);
+	return query;
+}
+
+YoutubePlaylistItemsListRequest::YoutubePlaylistItemsListRequest(string accessToken, const string& playlistId, const string& pageToken, uint maxResults, YoutubeETagStore* pETags, const char* part, const char* fields)
+: YoutubeListRequest(std::move(accessToken), "playlistItems", YoutubePlaylistItemsListRequest_Query(part, playlistId, pageToken, maxResults), fields, pETags) {}
+
+string YoutubePlaylistItemsListRequest::GetUploadsPlaylistId(const string& channelId) {
+	if (channelId.compare(0, 2, "UC") != 0)
+		return channelId;
+	return string("UU").append(channelId, 2, string::npos);
+}
+
+YoutubePlaylistPager::YoutubePlaylistPager(HttpClient& client, string accessToken, const string& playlistId, uint pagesAhead, YoutubeETagStore* pETags, uint maxResults, const char* fields)
+: m_client(client), m_accessToken(std::move(accessToken)), m_playlistId(playlistId), m_pagesAhead(pagesAhead ? pagesAhead : 1), m_pETags(pETags), m_maxResults(maxResults), m_fields(fields),
+	m_finished(false), m_failed(false), m_numTaken(0)
+{
+	SendAhead(); // The first page
+}
+
+YoutubePlaylistPager::~YoutubePlaylistPager() {
+	for (auto it = m_pages.begin(); it != m_pages.end(); it++) {
+		if ((*it)->GetStatus() != HttpRequest::DONE && (*it)->GetStatus() != HttpRequest::ERROR)
+			(*it)->Abort();
+	}
+}
+
+Ptr<YoutubePlaylistItemsListRequest> YoutubePlaylistPager::TakePage() {
+	if (m_pages.empty())
+		return nullptr;
+	Ptr<YoutubePlaylistItemsListRequest> p_page = m_pages.front();
+	if (p_page->GetStatus() != HttpRequest::DONE) {
+		if (p_page->GetStatus() != HttpRequest::ERROR && p_page->GetPriority() < HttpRequest::PRIORITY_NORMAL)
+			p_page->SetPriority(HttpRequest::PRIORITY_NORMAL); // The app is waiting for it now
+		return nullptr;
+	}
+	m_pages.pop_front();
+	m_numTaken++;
+	SendAhead();
+	return p_page;
+}
+
+void YoutubePlaylistPager::HandlePage(Ptr<HttpRequest> pRequest) {
+	YoutubePlaylistItemsListRequest* p_page = static_cast<YoutubePlaylistItemsListRequest*>(pRequest.ptr());
+	if (p_page->GetStatus() != HttpRequest::DONE) {
+		s3eDebugTracePrintf("Error: Youtube playlist page %u of %s failed", m_numTaken + (uint)m_pages.size(), m_playlistId.c_str());
+		m_failed = true;
+		return;
+	}
+	m_nextPageToken = p_page->GetNextPageToken();
+	m_finished = m_nextPageToken.empty();
+	SendAhead();
+}
+
+void YoutubePlaylistPager::SendAhead() {
+	// Each page's token comes with the one before it, so there is only ever one in flight:
+	if (m_finished || m_failed || m_pages.size() >= m_pagesAhead || (!m_pages.empty() && m_pages.back()->GetStatus() != HttpRequest::DONE))
+		return;
+	Ptr<YoutubePlaylistItemsListRequest> p_page = new YoutubePlaylistItemsListRequest(m_accessToken, m_playlistId, m_nextPageToken, m_maxResults, m_pETags,
+		YoutubePlaylistItemsListRequest::DEFAULT_PART, m_fields.c_str());
+	if (!m_pages.empty())
+		p_page->SetPriority(HttpRequest::PRIORITY_LOW); // The app has pages to be getting on with
+	m_pages.push_back(p_page);
+	m_client.QueueRequest(p_page.ptr(), this, &YoutubePlaylistPager::HandlePage);
+}
+
+YoutubeUploadManager::YoutubeUploadManager(HttpClient& client, GoogleTokenProvider* pTokens, const string& statePath, uint maxConcurrent)
+: m_client(client), m_pTokens(pTokens), m_statePath(statePath), m_maxConcurrent(maxConcurrent ? maxConcurrent : 1), m_bandwidthLimit(0),
+	m_priority(HttpRequest::PRIORITY_LOW), m_maxAttempts(3), m_nextId(1)
+{
+	Load();
+}
+
+YoutubeUploadManager::~YoutubeUploadManager() {
+	// (statePath still has them, so the next manager carries on where these got to)
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->pRequest)
+			it->pRequest->Abort();
+	}
+}
+
+uint YoutubeUploadManager::Add(const string& filepath, int64 fileSize, const string& title, const string& description, int category, const string& privacyStatus) {
+	if (fileSize < 0) {
+		// (The session needs the size up front)
+		if (s3eFile* p_file = s3eFileOpen(filepath.c_str(), "rb")) {
+			fileSize = s3eFileGetSize(p_file);
+			s3eFileClose(p_file);
+		}
+		if (fileSize < 0)
+			throw std::runtime_error("Unable to open file for uploading!");
+	}
+	Video video;
+	video.id = m_nextId++;
+	video.filepath = filepath;
+	video.fileSize = fileSize;
+	video.title = title;
+	video.description = description;
+	video.category = category;
+	video.privacyStatus = privacyStatus;
+	video.state = WAITING;
+	video.numAttempts = 0;
+	video.retryAtMs = 0;
+	video.bytesCommitted = 0;
+	m_videos.push_back(video);
+	Save();
+	return video.id;
+}
+
+void YoutubeUploadManager::Cancel(uint id) {
+	Video* p_video = FindVideo(id);
+	if (!p_video || p_video->state == DONE || p_video->state == FAILED || p_video->state == CANCELLED)
+		return;
+	if (p_video->pRequest)
+		p_video->pRequest->Abort();
+	p_video->pRequest = nullptr;
+	p_video->state = CANCELLED;
+	Save();
+}
+
+void YoutubeUploadManager::Remove(uint id) {
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->id == id) {
+			if (it->state == DONE || it->state == FAILED || it->state == CANCELLED)
+				m_videos.erase(it);
+			return;
+		}
+	}
+}
+
+void YoutubeUploadManager::RemoveFinished() {
+	for (size_t i = m_videos.size(); i-- > 0; ) {
+		if (m_videos[i].state == DONE || m_videos[i].state == FAILED || m_videos[i].state == CANCELLED)
+			m_videos.erase(m_videos.begin() + i);
+	}
+}
+
+void YoutubeUploadManager::Update() {
+	const uint64 now_ms = s3eTimerGetMs();
+	uint num_active = GetNumActive();
+	for (size_t i = 0; i < m_videos.size() && num_active < m_maxConcurrent; i++) {
+		Video& video = m_videos[i];
+		if (video.state == WAITING && video.retryAtMs <= now_ms) {
+			Start(video);
+			num_active++;
+		}
+	}
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->state == UPLOADING && it->pRequest)
+			it->bytesCommitted = static_cast<YoutubeUploadRequest*>(it->pRequest.ptr())->GetBytesCommitted();
+	}
+	ShareBandwidth();
+}
+
+const YoutubeUploadManager::Video* YoutubeUploadManager::Find(uint id) const {
+	return const_cast<YoutubeUploadManager*>(this)->FindVideo(id);
+}
+
+double YoutubeUploadManager::GetProgress(uint id) const {
+	const Video* p_video = Find(id);
+	if (!p_video)
+		return 0;
+	if (p_video->state == DONE)
+		return 1;
+	if (p_video->state == UPLOADING && p_video->pRequest)
+		return static_cast<const YoutubeUploadRequest*>(p_video->pRequest.ptr())->GetProgress();
+	return p_video->fileSize > 0 ? p_video->bytesCommitted / (double)p_video->fileSize : 0;
+}
+
+uint YoutubeUploadManager::GetNumActive() const {
+	uint num_active = 0;
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++)
+		num_active += it->state == STARTING || it->state == UPLOADING;
+	return num_active;
+}
+
+YoutubeUploadManager::Video* YoutubeUploadManager::FindVideo(uint id) {
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->id == id)
+			return &*it;
+	}
+	return nullptr;
+}
+
+YoutubeUploadManager::Video* YoutubeUploadManager::FindByRequest(HttpRequest* pRequest) {
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->pRequest.ptr() == pRequest)
+			return &*it;
+	}
+	return nullptr;
+}
+
+void YoutubeUploadManager::Start(Video& video) {
+	video.numAttempts++;
+	if (video.sessionURI.empty())
+		StartSession(video);
+	else
+		StartUpload(video); // Which first asks the session how much of the file it has
+}
+
+void YoutubeUploadManager::StartSession(Video& video) {
+	Ptr<HttpRequest> p_session = new YoutubeSessionRequest("", video.fileSize, video.title, video.description, video.category, video.privacyStatus);
+	p_session->SetPriority(m_priority);
+	video.state = STARTING;
+	video.pRequest = p_session;
+	m_client.QueueRequest(m_pTokens ? m_pTokens->Authorize(p_session) : p_session, this, &YoutubeUploadManager::HandleSession);
+}
+
+void YoutubeUploadManager::StartUpload(Video& video) {
+	Ptr<YoutubeUploadRequest> p_upload = new YoutubeUploadRequest(m_client, video.sessionURI, "", video.filepath, video.fileSize);
+	p_upload->SetPriority(m_priority);
+	video.state = UPLOADING;
+	video.pRequest = p_upload.ptr();
+	ShareBandwidth(); // (Before it starts, as it has one more to share with)
+	m_client.QueueRequest(m_pTokens ? m_pTokens->Authorize(p_upload.ptr()) : p_upload.ptr(), this, &YoutubeUploadManager::HandleUpload);
+}
+
+void YoutubeUploadManager::HandleSession(Ptr<HttpRequest> pRequest) {
+	Video* p_video = FindByRequest(pRequest.ptr());
+	if (!p_video)
+		return;
+	p_video->pRequest = nullptr;
+	const char* p_location = pRequest->GetStatus() == HttpRequest::DONE ? pRequest->GetResponseHeaders().Find("Location") : nullptr;
+	if (!p_location || !*p_location) {
+		HandleFailure(*p_video, 0);
+		return;
+	}
+	p_video->sessionURI = p_location;
+	Save(); // From now on, the upload can be resumed
+	StartUpload(*p_video);
+}
+
+void YoutubeUploadManager::HandleUpload(Ptr<HttpRequest> pRequest) {
+	Video* p_video = FindByRequest(pRequest.ptr());
+	if (!p_video)
+		return;
+	YoutubeUploadRequest* p_upload = static_cast<YoutubeUploadRequest*>(pRequest.ptr());
+	p_video->pRequest = nullptr;
+	p_video->bytesCommitted = p_upload->GetBytesCommitted();
+	if (p_upload->GetStatus() != HttpRequest::DONE) {
+		HandleFailure(*p_video, p_upload->GetStatusCode());
+		return;
+	}
+	try {
+		p_video->videoId = string((const json::String&)p_upload->GetResponse()["id"]);
+	} catch (const json::Exception& e) { s3eDebugTracePrintf("Error: %s", e.what()); }
+	Finish(*p_video, DONE);
+}
+
+void YoutubeUploadManager::HandleFailure(Video& video, int httpStatusCode) {
+	if (httpStatusCode == 404 || httpStatusCode == 410) {
+		// The session has expired (they last about a week): start a new one, from the beginning of the file
+		s3eDebugTracePrintf("Youtube upload session for %s has expired", video.filepath.c_str());
+		video.sessionURI.clear();
+		video.bytesCommitted = 0;
+		Save();
+	} else if (httpStatusCode >= 400 && httpStatusCode < 500 && httpStatusCode != 401 && httpStatusCode != 408 && httpStatusCode != 429) {
+		Finish(video, FAILED); // Trying again won't help
+		return;
+	}
+	if (video.numAttempts >= m_maxAttempts) {
+		Finish(video, FAILED);
+		return;
+	}
+	video.state = WAITING;
+	video.retryAtMs = s3eTimerGetMs() + ((uint64)RETRY_DELAY_MS << (video.numAttempts - 1));
+	if (httpStatusCode == 404 || httpStatusCode == 410)
+		video.retryAtMs = 0; // (It was the session's fault, not the network's)
+}
+
+void YoutubeUploadManager::Finish(Video& video, State state) {
+	s3eDebugTracePrintf("Youtube upload of %s %s", video.filepath.c_str(), state == DONE ? "succeeded" : "failed");
+	video.state = state;
+	video.pRequest = nullptr;
+	Save();
+	if (m_callback) {
+		const Video finished = video; // (The callback may add or remove videos)
+		m_callback(finished);
+	}
+}
+
+void YoutubeUploadManager::ShareBandwidth() {
+	uint num_uploading = 0;
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++)
+		num_uploading += it->state == UPLOADING && it->pRequest;
+	const uint64 share = m_bandwidthLimit && num_uploading ? m_bandwidthLimit / num_uploading : 0;
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->state == UPLOADING && it->pRequest && it->pRequest->GetMaxSendSpeed() != share)
+			static_cast<YoutubeUploadRequest*>(it->pRequest.ptr())->SetMaxUploadSpeed(share);
+	}
+}
+
+void YoutubeUploadManager::Load() {
+	if (!IsFile(m_statePath))
+		return;
+	try {
+		json::Object root;
+		json::ReadFile(root, m_statePath);
+		m_nextId = (uint)root.GetOrDefault("nextId", 1LL);
+		const json::Array& videos = root["videos"];
+		for (json::Array::const_iterator it = videos.Begin(); it != videos.End(); it++) {
+			const json::Object& entry = *it;
+			Video video;
+			video.id = (uint)entry.GetOrDefault("id", 0LL);
+			video.filepath = entry.GetOrDefault("file", string());
+			video.fileSize = entry.GetOrDefault("size", -1LL);
+			video.title = entry.GetOrDefault("title", string());
+			video.description = entry.GetOrDefault("description", string());
+			video.category = entry.GetOrDefault("category", 22);
+			video.privacyStatus = entry.GetOrDefault("privacyStatus", string("private"));
+			video.sessionURI = entry.GetOrDefault("session", string());
+			video.state = WAITING;
+			video.numAttempts = 0;
+			video.retryAtMs = 0;
+			video.bytesCommitted = 0;
+			if (!video.id || video.filepath.empty() || video.fileSize < 0)
+				continue;
+			m_videos.push_back(video);
+			if (video.id >= m_nextId)
+				m_nextId = video.id + 1;
+		}
+	} catch (const std::exception& e) {
+		s3eDebugTracePrintf("YoutubeUploadManager: Ignoring damaged %s (%s)", m_statePath.c_str(), e.what());
+		m_videos.clear();
+	}
+}
+
+void YoutubeUploadManager::Save() {
+	json::Array videos;
+	for (auto it = m_videos.begin(); it != m_videos.end(); it++) {
+		if (it->state == DONE || it->state == FAILED || it->state == CANCELLED)
+			continue;
+		json::Object entry;
+		entry["id"] = json::Number::FromInteger(it->id);
+		entry["file"] = json::String(it->filepath);
+		entry["size"] = json::Number::FromInteger(it->fileSize);
+		entry["title"] = json::String(it->title);
+		entry["description"] = json::String(it->description);
+		entry["category"] = json::Number::FromInteger(it->category);
+		entry["privacyStatus"] = json::String(it->privacyStatus);
+		if (!it->sessionURI.empty())
+			entry["session"] = json::String(it->sessionURI);
+		videos.Insert(std::move(entry));
+	}
+	if (videos.Empty()) {
+		s3eFileDelete(m_statePath.c_str()); // Nothing left to resume
+		return;
+	}
+	json::Object root;
+	root["nextId"] = json::Number::FromInteger(m_nextId);
+	root["videos"] = std::move(videos);
+	string data;
+	data.resize(json::BufferWriter::MeasureSize(root));
+	json::BufferWriter::Write(root, &data[0]);
+	// Write the new state and then replace the old one, so that a crash can't lose both:
+	const string tmp_path = m_statePath + ".tmp";
+	s3eFile* p_file = s3eFileOpen(tmp_path.c_str(), "wb");
+	const bool written = p_file && s3eFileWrite(data.data(), 1, data.size(), p_file) == data.size();
+	if (p_file)
+		s3eFileClose(p_file);
+	if (written) {
+		s3eFileDelete(m_statePath.c_str());
+		s3eFileRename(tmp_path.c_str(), m_statePath.c_str());
+	} else {
+		s3eDebugTracePrintf("YoutubeUploadManager: Unable to write %s", tmp_path.c_str());
+		s3eFileDelete(tmp_path.c_str());
 	}
 }
@@ -7,7 +7,12 @@
 
 #pragma once
 
+#include <deque>
+#include <map>
+#include <vector>
+
 #include "HttpClient.h"
+#include "HttpFileUpload.h"
 #include "s3eFile.h"
 
 //Exchange Google OAuth2 Refresh token for an Access token
@@ -17,36 +22,306 @@ public:
 	virtual ~GoogleOAuthRequest() {};
 };
 
-//ask Youtube for a resumable session URI
+//Keeps one Google OAuth2 access token for everything that a client sends: the token and its expiry are kept, and the
+//client sends it with every request, as its "Authorization" default header (see HttpClient::SetDefaultHeader()), so
+//use a client of its own for Google's APIs. Any number of modules can ask for it at once, e.g. at startup: there is
+//never more than one GoogleOAuthRequest in flight. Authorize() has a request wait for that refresh, if the token isn't
+//fresh (see HttpRequest::AddDependency()), so it is sent as soon as the new token arrives, without a trip through the
+//app's own callbacks. Call Update() every frame (or at least every few minutes) to refresh the token before it
+//expires, refreshMarginS (default 300) ahead of time, so that requests never have to wait for it.
+//    GoogleTokenProvider tokens(client, "MY_CLIENT_ID", "MY_CLIENT_TOKEN", "MY_REFRESH_TOKEN");
+//    client.QueueRequest(tokens.Authorize(new YoutubeSessionRequest("", ...)), pCallback);
+class GoogleTokenProvider : public IObservable {
+public:
+	GoogleTokenProvider(HttpClient& client, const char* clientID, const char* clientToken, const char* refreshToken, uint refreshMarginS = 300);
+	virtual ~GoogleTokenProvider();
+	
+	void Update();
+	// Have pRequest wait for the token if it isn't fresh (starting a refresh if there isn't one in flight), and return it.
+	// Requests that go out with the token don't need an "Authorization" header of their own.
+	Ptr<HttpRequest> Authorize(Ptr<HttpRequest> pRequest);
+	// The refresh in flight, starting one if there isn't one, e.g. for a request to wait for with AddDependency():
+	Ptr<HttpRequest> Refresh();
+	
+	bool HasToken() const; // A token that hasn't expired yet
+	const std::string& GetAccessToken() const { return m_accessToken; }
+	uint64 GetExpiryMs() const { return m_expiryMs; } // An s3eTimerGetMs() time
+	
+private:
+	void HandleToken(Ptr<HttpRequest> pRequest);
+	bool IsFresh() const; // Not due to be refreshed yet
+	
+	HttpClient& m_client;
+	const std::string m_clientID;
+	const std::string m_clientToken;
+	const std::string m_refreshToken;
+	const uint64 m_refreshMarginMs;
+	std::string m_accessToken;
+	uint64 m_expiryMs;
+	uint64 m_retryAtMs; // After a failed refresh, Update() waits until then before trying again
+	Ptr<HttpRequest> m_pRefresh; // In flight
+};
+
+//ask Youtube for a resumable session URI (with accessToken "" to leave it to the client's default header, see GoogleTokenProvider)
 class YoutubeSessionRequest: public HttpPostJson {
 public:
-	YoutubeSessionRequest(std::string accessToken, int videoFileSize, std::string title, std::string description, int category, std::string privacyStatus);
+	YoutubeSessionRequest(std::string accessToken, int64 videoFileSize, std::string title, std::string description, int category, std::string privacyStatus);
 	virtual ~YoutubeSessionRequest() {};
 };
 
-//Upload video to Youtube with a PUT request
-class YoutubeUploadRequest : public HttpRequest {
+//Upload video to Youtube using the resumable upload protocol: the file is sent with a series of PUT requests,
+//one chunk at a time, each with a "Content-Range: bytes <first>-<last>/<total>" header. If a chunk fails (e.g. the
+//connection drops), we wait a little, ask the session how much of the file it has ("Content-Range: bytes */<total>")
+//and carry on from there. The request itself is that status query, so a session URI kept from an earlier run of the
+//app (see YoutubeSessionRequest) resumes where that run left off.
+//Queue it like any other request; its callback is called once the whole video is up (or the upload has failed):
+//    client.QueueRequest(new YoutubeUploadRequest(client, sessionURI, accessToken, filepath, videoFileSize), pCallback);
+class YoutubeUploadRequest : public HttpFileUpload {
 public:
-	YoutubeUploadRequest(std::string resumableURI, std::string accessToken, std::string filepath, int videoFileSize);
-	virtual ~YoutubeUploadRequest() {};
+	YoutubeUploadRequest(HttpClient& client, std::string resumableURI, std::string accessToken, std::string filepath, int64 videoFileSize);
+	virtual ~YoutubeUploadRequest();
+	
+	// Chunks are sized to take about targetChunkMs each at the throughput measured so far, between minChunkSize and
+	// maxChunkSize (rounded down to multiples of 256 KB, as the API requires). Defaults: 1 MB to start, 10 s, 256 KB - 64 MB.
+	YoutubeUploadRequest& SetChunking(uint targetChunkMs, int64 initialChunkSize, int64 minChunkSize, int64 maxChunkSize);
+	// Give up after this many consecutive failed attempts that didn't get any more of the file through (10 by default).
+	// Attempts are spaced out from 1 s, doubling up to 32 s.
+	YoutubeUploadRequest& SetMaxRetries(uint maxRetries) { m_maxRetries = maxRetries; return *this; }
+	
+	// Cap the upload's speed, in bytes per second (0 for no limit). Like HttpRequest::SetMaxSpeed(), it can be changed
+	// while the upload is in progress: the chunk in flight takes it up within about a second, and later ones from the start.
+	YoutubeUploadRequest& SetMaxUploadSpeed(uint64 bytesPerSecond);
+	
+	int64 GetBytesCommitted() const { return m_committed; } // How much of the file the server has confirmed it has
+	double GetProgress() const; // 0 to 1, including the chunk that is in flight
+	int GetStatusCode() const { return m_statusCode; } // Of the last response, e.g. 404 if the session had expired (0 if none)
 	
-	virtual long Worker_GetUploadSize() const { return m_fileSize; }
-	virtual size_t Worker_HandleUpload(const unsigned char* pData, size_t fillSize);
-	virtual size_t Worker_HandleData(const unsigned char* contents, size_t size);
-	virtual void Worker_HandleCleanup() { if (m_workerResponseBuffer) free((void*)m_workerResponseBuffer); if(m_pUploadFile) s3eFileClose(m_pUploadFile); }
+	// Stops the upload however far it has got, e.g. between chunks or while waiting to retry one: it ends up CANCELLED,
+	// and its callback isn't called. The session is kept, so another YoutubeUploadRequest can resume it.
+	virtual void Abort();
 	virtual void HandleResponse(bool success, int httpStatusCode);
 	
-	size_t GetBytesUploaded() { return m_bytesUploaded; }
-	const json::Object& GetResponse() const { return m_responseData; }
+private:
+	class Chunk;
+	void HandleStatus(bool success, int httpStatusCode, const HttpHeaders& responseHeaders, const HttpResponseBody& body);
+	void HandleChunkDone(Ptr<HttpRequest> pChunk);
+	void Retry();
+	static int32 RetryTimerCallback(void* systemData, void* pUpload);
+	void QueueChunk(int64 offset, int64 length);
+	void Finish(bool success);
+	
+	HttpClient& m_client;
+	int64 m_committed;
+	int64 m_chunkSize;
+	uint m_targetChunkMs;
+	int64 m_minChunkSize;
+	int64 m_maxChunkSize;
+	uint m_maxRetries;
+	uint m_numFailures; // Consecutive failed attempts
+	int m_statusCode;
+	bool m_retryPending; // The retry timer is set
+	Ptr<Chunk> m_pChunk; // The chunk or status query in flight, if any
+	Ptr<YoutubeUploadRequest> m_pSelf; // Keeps us alive until the upload is over, even if nobody else holds on to us
+};
+
+//The ETags of the read calls' responses (see YoutubeListRequest), and the responses themselves: a call to the same URL
+//sends "If-None-Match" with its ETag, and if the server answers 304 Not Modified, the request gets the response it
+//had before, without it being sent or parsed again. Keeps the maxEntries URLs used most recently. App thread only.
+class YoutubeETagStore {
+public:
+	explicit YoutubeETagStore(size_t maxEntries = 256) : m_maxEntries(maxEntries), m_useCount(0) {}
+	
+	const std::string* FindETag(const std::string& url) const; // nullptr if there isn't one
+	const json::UnknownElement* FindResponse(const std::string& url); // Marks it as used
+	void Store(const std::string& url, const std::string& etag, const json::UnknownElement& response);
+	void Remove(const std::string& url);
+	void Clear() { m_entries.clear(); }
+	size_t Size() const { return m_entries.size(); }
+	
+private:
+	struct Entry {
+		std::string etag;
+		json::UnknownElement response;
+		uint64 lastUsed;
+	};
+	const size_t m_maxEntries;
+	uint64 m_useCount;
+	std::map<std::string, Entry> m_entries;
+};
+
+//A read call to the YouTube Data API (a GET of https://www.googleapis.com/youtube/v3/<resource>), which always asks for
+//a partial response: fields is the mask of what to send back (e.g. "items(id,status/uploadStatus)"), as metadata sent
+//in full is 5-10 times bigger than what an app shows. With an ETag store, it is a conditional request, and an unchanged
+//resource comes back as a 304 with no body (see IsNotModified()), which is what most status polls get. The client's own
+//cache is bypassed, as the store does its job. Its access token is as for YoutubeSessionRequest. GetResponse() is the
+//response, whether it is new or from the store (a request with SetResponseAsTape() doesn't use the store).
+class YoutubeListRequest : public HttpPost {
+public:
+	// query: the rest of the call's parameters, e.g. "part=status&id=abc", without the fields (which mustn't be empty)
+	YoutubeListRequest(std::string accessToken, const char* resource, const std::string& query, const std::string& fields, YoutubeETagStore* pETags = nullptr);
+	virtual ~YoutubeListRequest() {};
+	
+	bool IsNotModified() const { return m_notModified; } // The response is the one stored for this URL
+	// The token for the page after this one ("" if it is the last), for requests that take "pageToken":
+	std::string GetNextPageToken() const;
+	
+	virtual void HandleResponse(bool success, int httpStatusCode);
+	
+private:
+	YoutubeETagStore* m_pETags;
+	bool m_notModified;
+};
+
+//videos.list for up to 50 videos at a time, e.g. to poll the processing status of those that have just been uploaded.
+//The default mask asks for their titles, thumbnails and where their upload and processing are up to:
+//    client.QueueRequest(tokens.Authorize(new YoutubeVideosListRequest("", ids, &m_etags)), pCallback);
+class YoutubeVideosListRequest : public YoutubeListRequest {
+public:
+	static const char* const DEFAULT_PART; // "snippet,status,processingDetails"
+	static const char* const DEFAULT_FIELDS;
+	YoutubeVideosListRequest(std::string accessToken, const std::vector<std::string>& videoIds, YoutubeETagStore* pETags = nullptr,
+		const char* part = DEFAULT_PART, const char* fields = DEFAULT_FIELDS);
+};
+
+//playlistItems.list: a page of up to maxResults (at most 50) of a playlist's items, e.g. of a channel's uploads (see
+//GetUploadsPlaylistId()). The default mask asks for each video's ID, title, thumbnail and when it was published.
+class YoutubePlaylistItemsListRequest : public YoutubeListRequest {
+public:
+	static const char* const DEFAULT_PART; // "snippet"
+	static const char* const DEFAULT_FIELDS;
+	YoutubePlaylistItemsListRequest(std::string accessToken, const std::string& playlistId, const std::string& pageToken = "", uint maxResults = 50, YoutubeETagStore* pETags = nullptr,
+		const char* part = DEFAULT_PART, const char* fields = DEFAULT_FIELDS);
+	// The playlist of a channel's uploads, from its ID ("UC..." is "UU..."):
+	static std::string GetUploadsPlaylistId(const std::string& channelId);
+};
+
+//Pages through a playlist ahead of time: as each page arrives, the next is sent for, until pagesAhead pages are waiting
+//for the app (or in flight), so that scrolling through a channel's videos never waits for the network. A page that is
+//sent for while the app has others to take goes at PRIORITY_LOW, unless the app asks for it before it has arrived.
+//Take them, in order, with TakePage():
+//    m_pPager = new YoutubePlaylistPager(client, "", YoutubePlaylistItemsListRequest::GetUploadsPlaylistId(channelId));
+//    // Every frame, or when the list is scrolled near its end:
+//    while (Ptr<YoutubePlaylistItemsListRequest> p_page = m_pPager->TakePage())
+//        AddItems(p_page->GetResponse()["items"]);
+class YoutubePlaylistPager : public IObservable {
+public:
+	YoutubePlaylistPager(HttpClient& client, std::string accessToken, const std::string& playlistId, uint pagesAhead = 2, YoutubeETagStore* pETags = nullptr,
+		uint maxResults = 50, const char* fields = YoutubePlaylistItemsListRequest::DEFAULT_FIELDS);
+	virtual ~YoutubePlaylistPager(); // Aborts the pages in flight
+	
+	// The next page, once it has arrived successfully, or nullptr (while it is in flight, or once they have all been
+	// taken, or if it failed). Sends for more pages, to keep pagesAhead of them ahead.
+	Ptr<YoutubePlaylistItemsListRequest> TakePage();
+	bool IsFinished() const { return m_finished && m_pages.empty(); } // Every page has been taken
+	bool HasFailed() const { return m_failed; } // A page failed, so none after it will come
+	uint GetNumPagesTaken() const { return m_numTaken; }
+	
+private:
+	void HandlePage(Ptr<HttpRequest> pRequest);
+	void SendAhead();
+	
+	HttpClient& m_client;
+	const std::string m_accessToken;
+	const std::string m_playlistId;
+	const uint m_pagesAhead;
+	YoutubeETagStore* m_pETags;
+	const uint m_maxResults;
+	const std::string m_fields;
+	std::string m_nextPageToken; // For the next page to send for
+	bool m_finished; // The last page has been sent for
+	bool m_failed;
+	uint m_numTaken;
+	std::deque< Ptr<YoutubePlaylistItemsListRequest> > m_pages; // Sent for, in order (the first ones may have arrived)
+};
+
+//Uploads any number of videos in the background, a few at a time (maxConcurrent, 1 by default), each in a session of its
+//own (see YoutubeSessionRequest and YoutubeUploadRequest). The queue is kept in statePath, along with each session's
+//URI once it has one, so a video that was cut off by the app being closed (or killed) resumes from where its session got
+//to the next time a manager is made with that file; one that is done (or has failed for good) is dropped from it. The
+//uploads go at PRIORITY_LOW (see SetPriority()), so the app's own API calls go first, and with SetBandwidthLimit() they
+//share a cap, evenly, so that they leave the rest of the connection alone. An upload that the network or the server
+//cut short is tried again after a while, up to maxAttempts (3) times in all, and one whose session has expired starts
+//a new one. With a GoogleTokenProvider, each request waits for a fresh token if it needs one. Call Update() every frame.
+//    m_pUploads = new YoutubeUploadManager(client, &tokens, "ram://youtube_uploads.json"); // (Resumes any that were left)
+//    m_pUploads->SetCallback(fastdelegate::MakeDelegate(this, &MyAppModule::HandleVideo));
+//    m_pUploads->Add(filepath, -1, title, description, 22, "unlisted");
+class YoutubeUploadManager : public IObservable {
+public:
+	enum State {
+		WAITING, // For its turn, or to be tried again
+		STARTING, // Its session is being started
+		UPLOADING,
+		DONE,
+		FAILED,
+		CANCELLED
+	};
+	struct Video {
+		uint id; // Never 0, and never reused for the same statePath
+		std::string filepath;
+		int64 fileSize;
+		std::string title, description;
+		int category;
+		std::string privacyStatus;
+		std::string sessionURI; // Once its session has been started
+		State state;
+		uint numAttempts;
+		uint64 retryAtMs; // If WAITING after a failure, not before then
+		int64 bytesCommitted;
+		std::string videoId; // Once DONE
+		Ptr<HttpRequest> pRequest; // The session request or the upload in flight
+	};
+	typedef fastdelegate::FastDelegate1<const Video&> VideoDelegate;
+	
+	YoutubeUploadManager(HttpClient& client, GoogleTokenProvider* pTokens, const std::string& statePath, uint maxConcurrent = 1);
+	virtual ~YoutubeUploadManager(); // Stops the uploads in flight, which resume from statePath
+	
+	// Queue a video, and return its ID (fileSize as for HttpFileUpload):
+	uint Add(const std::string& filepath, int64 fileSize, const std::string& title, const std::string& description, int category, const std::string& privacyStatus);
+	// Stop a video's upload and drop it from the queue:
+	void Cancel(uint id);
+	// Forget a video that is DONE, FAILED or CANCELLED (or all of them):
+	void Remove(uint id);
+	void RemoveFinished();
+	// Called when a video is DONE or FAILED (not cancelled):
+	void SetCallback(VideoDelegate callback) { m_callback = callback; }
+	
+	YoutubeUploadManager& SetMaxConcurrent(uint maxConcurrent) { m_maxConcurrent = maxConcurrent ? maxConcurrent : 1; return *this; }
+	// The most that the uploads may send between them, in bytes per second (0, the default, for no limit):
+	YoutubeUploadManager& SetBandwidthLimit(uint64 bytesPerSecond) { m_bandwidthLimit = bytesPerSecond; return *this; }
+	// For the requests that are sent from now on (PRIORITY_LOW by default):
+	YoutubeUploadManager& SetPriority(HttpRequest::Priority priority) { m_priority = priority; return *this; }
+	YoutubeUploadManager& SetMaxAttempts(uint maxAttempts) { m_maxAttempts = maxAttempts ? maxAttempts : 1; return *this; }
+	
+	void Update();
 	
-protected:
-	int m_fileSize;
+	const std::vector<Video>& GetVideos() const { return m_videos; } // In the order they were added
+	const Video* Find(uint id) const;
+	double GetProgress(uint id) const; // 0 to 1
+	uint GetNumActive() const; // STARTING or UPLOADING
 	
-	size_t m_bytesUploaded;
-	const char* m_workerResponseBuffer; // Buffer used by the worker thread to store the response as it comes in.
-	size_t m_workerResponseSize;
+private:
+	enum { RETRY_DELAY_MS = 60000 }; // After an attempt has failed, doubling with each one
+	Video* FindVideo(uint id);
+	void Start(Video& video);
+	void StartSession(Video& video);
+	void StartUpload(Video& video);
+	void HandleSession(Ptr<HttpRequest> pRequest);
+	void HandleUpload(Ptr<HttpRequest> pRequest);
+	Video* FindByRequest(HttpRequest* pRequest);
+	void HandleFailure(Video& video, int httpStatusCode);
+	void Finish(Video& video, State state);
+	void ShareBandwidth();
+	void Load();
+	void Save();
 	
-	s3eFile* m_pUploadFile;
-	std::string m_filePath;
-	json::UnknownElement m_responseData;
+	HttpClient& m_client;
+	GoogleTokenProvider* m_pTokens;
+	const std::string m_statePath;
+	uint m_maxConcurrent;
+	uint64 m_bandwidthLimit;
+	HttpRequest::Priority m_priority;
+	uint m_maxAttempts;
+	uint m_nextId;
+	VideoDelegate m_callback;
+	std::vector<Video> m_videos;
 };